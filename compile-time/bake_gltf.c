@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Turn .gltf (or .glb) files into their baked form (see core/gltf-baked.h), which the
+ * engine picks up instead of the .gltf when it's there and not older
+ *
+ *   bake_gltf [-o <output>] <model.gltf>...
+ *
+ * By default, the output goes next to the input, with GLTF_BAKED_SUFFIX.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../core/json.c"
+#include "../core/base64.c"
+#include "../core/gltf-baked.h"
+
+#define DATA_URI "data:application/octet-stream;base64,"
+
+/* see core/gltf.c */
+#define GLB_MAGIC       0x46546c67
+#define GLB_CHUNK_JSON  0x4e4f534a
+#define GLB_CHUNK_BIN   0x004e4942
+
+#define ALIGN(_x) (((_x) + GLTF_BAKED_ALIGN - 1) & ~(uint64_t)(GLTF_BAKED_ALIGN - 1))
+
+struct buffer {
+    char        *data;
+    size_t      size;
+    /* within the baked data */
+    uint64_t    offset;
+};
+
+static char *read_file(const char *name, size_t *szp)
+{
+    struct stat st;
+    char *buf;
+    FILE *f;
+
+    f = fopen(name, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open '%s': %m\n", name);
+        return NULL;
+    }
+
+    if (fstat(fileno(f), &st) || !(buf = calloc(1, st.st_size + 1))) {
+        fclose(f);
+        return NULL;
+    }
+
+    if (st.st_size && fread(buf, st.st_size, 1, f) != 1) {
+        fprintf(stderr, "Can't read %s: %m\n", name);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+
+    *szp = st.st_size;
+    return buf;
+}
+
+static double json_number(JsonNode *obj, const char *name, double def)
+{
+    JsonNode *n = json_find_member(obj, name);
+
+    return n && n->tag == JSON_NUMBER ? n->number_ : def;
+}
+
+/* external buffers' URIs are relative to the .gltf; no URI means GLB's BIN chunk */
+static int load_buffer(struct buffer *b, JsonNode *jbuf, const char *input_name,
+                       const struct buffer *bin)
+{
+    JsonNode *juri = json_find_member(jbuf, "uri");
+    size_t len = json_number(jbuf, "byteLength", 0);
+    const char *slash = strrchr(input_name, '/');
+    char *path;
+    ssize_t ret;
+
+    if (!juri && bin->data) {
+        b->size = bin->size;
+        b->data = malloc(b->size);
+        if (!b->data)
+            return -ENOMEM;
+        memcpy(b->data, bin->data, b->size);
+    } else if (!juri || juri->tag != JSON_STRING) {
+        fprintf(stderr, "buffer without uri\n");
+        return -EINVAL;
+    } else if (!strncmp(juri->string_, DATA_URI, sizeof(DATA_URI) - 1)) {
+        const char *src = juri->string_ + sizeof(DATA_URI) - 1;
+        size_t slen = strlen(src);
+
+        b->size = base64_decoded_length(slen);
+        b->data = calloc(1, b->size);
+        if (!b->data)
+            return -ENOMEM;
+
+        ret = base64_decode(b->data, b->size, src, slen);
+        if (ret < 0) {
+            fprintf(stderr, "invalid base64 in buffer\n");
+            return -EINVAL;
+        }
+        b->size = ret;
+    } else {
+        if (asprintf(&path, "%.*s%s", slash ? (int)(slash - input_name + 1) : 0,
+                     input_name, juri->string_) == -1)
+            return -ENOMEM;
+        b->data = read_file(path, &b->size);
+        free(path);
+        if (!b->data)
+            return -ENOENT;
+    }
+
+    if (b->size < len) {
+        fprintf(stderr, "buffer is %zu bytes, expected %zu\n", b->size, len);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int write_padded(FILE *f, const void *data, size_t size, uint64_t *off)
+{
+    static const char zeroes[GLTF_BAKED_ALIGN];
+    size_t pad = ALIGN(*off + size) - (*off + size);
+
+    if (size && fwrite(data, size, 1, f) != 1)
+        return -EIO;
+    if (pad && fwrite(zeroes, pad, 1, f) != 1)
+        return -EIO;
+
+    *off += size + pad;
+    return 0;
+}
+
+/* split a .glb into the JSON and the BIN chunks, in place */
+static char *glb_split(char *text, size_t size, struct buffer *bin)
+{
+    uint32_t *hdr = (uint32_t *)text, *chunk;
+    size_t off = 20, len;
+
+    if (size < off || hdr[0] != GLB_MAGIC || hdr[2] > size)
+        return text;
+
+    size = hdr[2];
+    chunk = (uint32_t *)(text + 12);
+    if (chunk[1] != GLB_CHUNK_JSON || chunk[0] > size - off)
+        return NULL;
+
+    len = chunk[0];
+    off = (off + len + 3) & ~3ul;
+    chunk = (uint32_t *)(text + off);
+    if (off + 8 <= size && chunk[1] == GLB_CHUNK_BIN && chunk[0] <= size - off - 8) {
+        bin->data = text + off + 8;
+        bin->size = chunk[0];
+    }
+
+    /* the chunk header goes, the JSON gets its NUL */
+    memmove(text, text + 20, len);
+    text[len] = 0;
+
+    return text;
+}
+
+static int bake(const char *input_name, const char *output_name)
+{
+    struct gltf_baked_hdr hdr = { .magic = GLTF_BAKED_MAGIC, .version = GLTF_BAKED_VERSION };
+    JsonNode *root, *jbufs, *jbufvws, *jaccrs, *n;
+    struct gltf_baked_accessor *accrs = NULL;
+    struct gltf_baked_view *views = NULL;
+    struct buffer *bufs = NULL, bin = {};
+    unsigned int nr_bufs = 0, i;
+    char *text, *json = NULL;
+    int ret = -EINVAL;
+    uint64_t off;
+    size_t size;
+    FILE *f;
+
+    text = read_file(input_name, &size);
+    if (!text)
+        return -ENOENT;
+
+    /* a .glb's BIN chunk stays in @text until the buffers are loaded */
+    root = glb_split(text, size, &bin) ? json_decode(text) : NULL;
+    if (!root) {
+        fprintf(stderr, "Cannot parse '%s'\n", input_name);
+        free(text);
+        return -EINVAL;
+    }
+
+    jbufs = json_find_member(root, "buffers");
+    jbufvws = json_find_member(root, "bufferViews");
+    jaccrs = json_find_member(root, "accessors");
+    if (!jbufs || jbufs->tag != JSON_ARRAY ||
+        !jbufvws || jbufvws->tag != JSON_ARRAY ||
+        !jaccrs || jaccrs->tag != JSON_ARRAY) {
+        fprintf(stderr, "'%s' has no buffers, buffer views or accessors\n", input_name);
+        goto out;
+    }
+
+    /* buffers go back to back, each aligned */
+    for (n = jbufs->children.head, off = 0; n; n = n->next, nr_bufs++) {
+        bufs = realloc(bufs, (nr_bufs + 1) * sizeof(*bufs));
+        if (!bufs)
+            goto out;
+
+        memset(&bufs[nr_bufs], 0, sizeof(*bufs));
+        ret = load_buffer(&bufs[nr_bufs], n, input_name, &bin);
+        if (ret) {
+            nr_bufs++;
+            goto out;
+        }
+
+        bufs[nr_bufs].offset = off;
+        off = ALIGN(off + bufs[nr_bufs].size);
+    }
+    hdr.data_size = off;
+
+    ret = -EINVAL;
+    for (n = jbufvws->children.head; n; n = n->next, hdr.nr_views++) {
+        int buf = json_number(n, "buffer", -1);
+        struct gltf_baked_view *v;
+
+        views = realloc(views, (hdr.nr_views + 1) * sizeof(*views));
+        if (!views)
+            goto out;
+
+        v = &views[hdr.nr_views];
+        v->offset = json_number(n, "byteOffset", 0);
+        v->length = json_number(n, "byteLength", 0);
+        if (buf < 0 || buf >= nr_bufs || v->offset + v->length > bufs[buf].size) {
+            fprintf(stderr, "buffer view %u is out of bounds\n", hdr.nr_views);
+            goto out;
+        }
+        v->offset += bufs[buf].offset;
+    }
+
+    for (n = jaccrs->children.head; n; n = n->next, hdr.nr_accrs++) {
+        JsonNode *jtype = json_find_member(n, "type");
+        int view = json_number(n, "bufferView", -1);
+        struct gltf_baked_accessor *a;
+
+        accrs = realloc(accrs, (hdr.nr_accrs + 1) * sizeof(*accrs));
+        if (!accrs)
+            goto out;
+
+        a = &accrs[hdr.nr_accrs];
+        memset(a, 0, sizeof(*a));
+        a->view = view;
+        a->comptype = json_number(n, "componentType", 0);
+        a->count = json_number(n, "count", 0);
+        a->offset = json_number(n, "byteOffset", 0);
+        /* sparse accessors don't have buffer views; neither does the engine */
+        if (view < 0 || view >= hdr.nr_views || !jtype || jtype->tag != JSON_STRING ||
+            strlen(jtype->string_) >= sizeof(a->type)) {
+            fprintf(stderr, "accessor %u is not supported\n", hdr.nr_accrs);
+            goto out;
+        }
+        strcpy(a->type, jtype->string_);
+    }
+
+    /* the engine takes these from the tables */
+    json_delete(jbufs);
+    json_delete(jbufvws);
+    json_delete(jaccrs);
+    json = json_encode(root);
+    if (!json)
+        goto out;
+
+    hdr.json_size = strlen(json) + 1;
+    off = ALIGN(sizeof(hdr));
+    hdr.views_off = off;
+    off = ALIGN(off + hdr.nr_views * sizeof(*views));
+    hdr.accrs_off = off;
+    off = ALIGN(off + hdr.nr_accrs * sizeof(*accrs));
+    hdr.json_off = off;
+    off = ALIGN(off + hdr.json_size);
+    hdr.data_off = off;
+
+    f = fopen(output_name, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot create '%s': %m\n", output_name);
+        ret = -errno;
+        goto out;
+    }
+
+    off = 0;
+    ret = write_padded(f, &hdr, sizeof(hdr), &off);
+    if (!ret)
+        ret = write_padded(f, views, hdr.nr_views * sizeof(*views), &off);
+    if (!ret)
+        ret = write_padded(f, accrs, hdr.nr_accrs * sizeof(*accrs), &off);
+    if (!ret)
+        ret = write_padded(f, json, hdr.json_size, &off);
+    for (i = 0; i < nr_bufs && !ret; i++)
+        ret = write_padded(f, bufs[i].data, bufs[i].size, &off);
+
+    if (fclose(f) && !ret)
+        ret = -EIO;
+    if (ret) {
+        fprintf(stderr, "Can't write '%s'\n", output_name);
+        unlink(output_name);
+    } else {
+        printf("%s: %u views, %u accessors, %zu bytes of data\n", output_name,
+               hdr.nr_views, hdr.nr_accrs, (size_t)hdr.data_size);
+    }
+
+out:
+    for (i = 0; i < nr_bufs; i++)
+        free(bufs[i].data);
+    free(bufs);
+    free(views);
+    free(accrs);
+    free(json);
+    free(text);
+    json_delete(root);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output_name = NULL;
+    int c, i, ret = EXIT_SUCCESS;
+
+    for (;;) {
+        c = getopt(argc, argv, "o:");
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'o':
+            output_name = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-o <output>] <model.gltf>...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (output_name && argc - optind > 1) {
+        fprintf(stderr, "-o only makes sense with one input\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = optind; i < argc; i++) {
+        char *name = (char *)output_name;
+
+        if (!name && asprintf(&name, "%s" GLTF_BAKED_SUFFIX, argv[i]) == -1)
+            exit(EXIT_FAILURE);
+
+        if (bake(argv[i], name))
+            ret = EXIT_FAILURE;
+
+        if (!output_name)
+            free(name);
+    }
+
+    return ret;
+}
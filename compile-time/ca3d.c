@@ -13,6 +13,10 @@
 #define CUBE_SIDE 8
 #define __CLAP_LOGGER_H__
 #define __CLAP_UI_DEBUG_H__
+/* no workers here, the slabs go one after another */
+#define __CLAP_JOBS_H__
+#define jobs_parallel_for(_nr, _fn, _priv) \
+    do { for (unsigned int __i = 0; __i < (_nr); __i++) (_fn)(__i, (_priv)); } while (0)
 
 #include "../core/ca3d.c"
 
@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Pack the asset/ directory under <base> into one file (see core/lib-pack.h),
+ * which the librarian reads the assets and shaders from when it's there
+ *
+ *   pack_assets [-o <output>] <base>
+ *
+ * By default, the output is <base>/LIB_PACK_NAME. Fonts and sounds are left
+ * out: FreeType and vorbisfile open those by their paths.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../core/lib-pack.h"
+
+#define ALIGN(_x) (((_x) + LIB_PACK_ALIGN - 1) & ~(uint64_t)(LIB_PACK_ALIGN - 1))
+
+struct asset {
+    char        *name;
+    char        *path;
+    size_t      size;
+};
+
+static struct asset *assets;
+static unsigned int nr_assets;
+static size_t base_len;
+
+static const char *unpacked[] = { ".ttf", ".otf", ".ogg", ".wav" };
+
+static bool is_unpacked(const char *path)
+{
+    size_t len = strlen(path), sfx;
+    int i;
+
+    for (i = 0; i < sizeof(unpacked) / sizeof(*unpacked); i++) {
+        sfx = strlen(unpacked[i]);
+        if (len > sfx && !strcasecmp(path + len - sfx, unpacked[i]))
+            return true;
+    }
+
+    return false;
+}
+
+static int add_asset(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    struct asset *a;
+
+    if (type != FTW_F || is_unpacked(path))
+        return 0;
+
+    assets = realloc(assets, (nr_assets + 1) * sizeof(*assets));
+    if (!assets)
+        return -ENOMEM;
+
+    a = &assets[nr_assets++];
+    a->path = strdup(path);
+    a->name = strdup(path + base_len);
+    a->size = st->st_size;
+
+    return a->path && a->name ? 0 : -ENOMEM;
+}
+
+static int asset_cmp(const void *a, const void *b)
+{
+    const struct asset *aa = a, *ab = b;
+
+    return strcmp(aa->name, ab->name);
+}
+
+static char *read_file(const char *name, size_t size)
+{
+    char *buf;
+    FILE *f;
+
+    f = fopen(name, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open '%s': %m\n", name);
+        return NULL;
+    }
+
+    buf = malloc(size + 1);
+    if (buf && size && fread(buf, size, 1, f) != 1) {
+        fprintf(stderr, "Can't read %s: %m\n", name);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+
+    return buf;
+}
+
+static int write_padded(FILE *f, const void *data, size_t size, uint64_t *off)
+{
+    static const char zeroes[LIB_PACK_ALIGN];
+    size_t pad = ALIGN(*off + size) - (*off + size);
+
+    if (size && fwrite(data, size, 1, f) != 1)
+        return -EIO;
+    if (pad && fwrite(zeroes, pad, 1, f) != 1)
+        return -EIO;
+
+    *off += size + pad;
+    return 0;
+}
+
+static int pack(const char *base, const char *output_name)
+{
+    struct lib_pack_hdr hdr = { .magic = LIB_PACK_MAGIC, .version = LIB_PACK_VERSION };
+    struct lib_pack_entry *entries = NULL;
+    uint64_t off, stored = 0, packed = 0;
+    char *dir = NULL, *names = NULL;
+    int i, ret = -ENOMEM;
+    FILE *f = NULL;
+
+    /* names are relative to the base, like the librarian's URIs */
+    if (asprintf(&dir, "%s/asset", base) == -1)
+        return -ENOMEM;
+    base_len = strlen(base) + 1;
+
+    ret = nftw(dir, add_asset, 16, FTW_PHYS);
+    if (ret) {
+        fprintf(stderr, "Can't walk '%s': %m\n", dir);
+        goto out;
+    }
+
+    qsort(assets, nr_assets, sizeof(*assets), asset_cmp);
+
+    hdr.nr_entries = nr_assets;
+    entries = calloc(nr_assets, sizeof(*entries));
+    if (!entries)
+        goto out;
+
+    for (i = 0; i < nr_assets; i++) {
+        entries[i].name_off = hdr.names_size;
+        hdr.names_size += strlen(assets[i].name) + 1;
+    }
+
+    names = malloc(hdr.names_size ? : 1);
+    if (!names)
+        goto out;
+
+    for (i = 0; i < nr_assets; i++)
+        strcpy(names + entries[i].name_off, assets[i].name);
+
+    hdr.names_off = ALIGN(sizeof(hdr) + nr_assets * sizeof(*entries));
+
+    f = fopen(output_name, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot create '%s': %m\n", output_name);
+        ret = -errno;
+        goto out;
+    }
+
+    /* the data first, the header and the entries go in front when it's done */
+    off = ALIGN(hdr.names_off + hdr.names_size);
+    ret = fseek(f, off, SEEK_SET) ? -errno : 0;
+    for (i = 0; i < nr_assets && !ret; i++) {
+        struct lib_pack_entry *e = &entries[i];
+        uLongf zsize = compressBound(assets[i].size);
+        char *buf, *zbuf;
+
+        buf = read_file(assets[i].path, assets[i].size);
+        zbuf = malloc(zsize);
+        if (!buf || !zbuf) {
+            free(buf);
+            free(zbuf);
+            ret = -ENOMEM;
+            break;
+        }
+
+        e->offset = off;
+        e->size = assets[i].size;
+        /* only keep the compressed one if it's worth it */
+        if (compress2((Bytef *)zbuf, &zsize, (Bytef *)buf, e->size, Z_BEST_COMPRESSION) == Z_OK &&
+            zsize < e->size - e->size / 16) {
+            e->compression = LIB_PACK_ZLIB;
+            e->packed_size = zsize;
+            ret = write_padded(f, zbuf, zsize, &off);
+        } else {
+            e->compression = LIB_PACK_STORED;
+            e->packed_size = e->size;
+            ret = write_padded(f, buf, e->size, &off);
+        }
+
+        stored += e->size;
+        packed += e->packed_size;
+        free(buf);
+        free(zbuf);
+    }
+
+    if (!ret && fseek(f, 0, SEEK_SET))
+        ret = -errno;
+    off = 0;
+    if (!ret)
+        ret = write_padded(f, &hdr, sizeof(hdr), &off);
+    if (!ret && nr_assets && fwrite(entries, nr_assets * sizeof(*entries), 1, f) != 1)
+        ret = -EIO;
+    if (!ret && fseek(f, hdr.names_off, SEEK_SET))
+        ret = -errno;
+    if (!ret && hdr.names_size && fwrite(names, hdr.names_size, 1, f) != 1)
+        ret = -EIO;
+
+    if (fclose(f) && !ret)
+        ret = -EIO;
+    if (ret) {
+        fprintf(stderr, "Can't write '%s'\n", output_name);
+        unlink(output_name);
+    } else {
+        printf("%s: %u entries, %zu bytes packed into %zu\n", output_name,
+               nr_assets, (size_t)stored, (size_t)packed);
+    }
+
+out:
+    for (i = 0; i < nr_assets; i++) {
+        free(assets[i].name);
+        free(assets[i].path);
+    }
+    free(assets);
+    free(entries);
+    free(names);
+    free(dir);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output_name = NULL;
+    char *name;
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "o:");
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'o':
+            output_name = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-o <output>] <base>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-o <output>] <base>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    name = (char *)output_name;
+    if (!name && asprintf(&name, "%s/" LIB_PACK_NAME, argv[optind]) == -1)
+        exit(EXIT_FAILURE);
+
+    return pack(argv[optind], name) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
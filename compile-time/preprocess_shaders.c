@@ -12,6 +12,25 @@ enum shader_language {
     LANGUAGE_GLSL_ES
 };
 
+/*
+ * Features that a shader can have compiled in rather than looked up from a
+ * uniform at runtime; keep in sync with enum shader_feature in shader.h,
+ * including the order, which is the order of the suffixes in the variant
+ * names: "model+skinning+normals".
+ */
+static const struct {
+    const char  *name;
+    const char  *define;
+} features[] = {
+    { "skinning",   "SKINNING" },
+    { "normals",    "NORMALS" },
+    { "highlight",  "HIGHLIGHT" },
+    { "alpha",      "ALPHA" },
+    { "layers",     "LAYERS" },
+};
+
+#define NR_FEATURES (sizeof(features) / sizeof(*features))
+
 static inline const char *skip_space(const char *pos)
 {
     for (; *pos && isspace(*pos); pos++)
@@ -42,31 +61,121 @@ static inline int non_id_char(char c)
     return !id_char(c);
 }
 
-void preprocess_vert_shader(char *input_name, char *output_name, enum shader_language target)
+/* write [pos, end) with "texture" calls renamed to "texture2D" */
+static void write_line_es(const char *pos, const char *end, FILE *fout)
+{
+    const char *start;
+
+    for (start = pos; start != end; start++) {
+        if (strncmp(start, "texture", 7) == 0
+            && (start == pos || non_id_char(start[-1])) && non_id_char(start[7])) {
+            fwrite(pos, 1, start - pos, fout);
+            fwrite("texture2D", 1, 9, fout);
+            pos = start + 7;
+            start += 6;
+        }
+    }
+    fwrite(pos, 1, end - pos, fout);
+}
+
+static char *read_file(const char *name, size_t *size)
 {
-    FILE* f = fopen(input_name, "r");
+    FILE* f = fopen(name, "r");
     if (!f) {
-        fprintf(stderr, "Cannot open '%s'.\n", input_name);
-        exit(EXIT_FAILURE);            
+        fprintf(stderr, "Cannot open '%s'.\n", name);
+        exit(EXIT_FAILURE);
     }
     
     struct stat st;
     fstat(fileno(f), &st);
     char* buf = (char *)calloc(st.st_size + 1, 1);
     if (fread(buf, 1, st.st_size, f) != st.st_size) {
-        fprintf(stderr, "Can't read %s: %m\n", input_name);
+        fprintf(stderr, "Can't read %s: %m\n", name);
         exit(EXIT_FAILURE);
     }
     fclose(f);
 
+    *size = st.st_size;
+    return buf;
+}
+
+/*
+ * #include "frame.glsl" lines are replaced with that file, from the same
+ * directory as the shader; one level, the included ones don't include
+ */
+static char *read_shader(const char *name, size_t *size)
+{
+    const char *pos, *eol, *dir_end, *inc_end;
+    size_t buf_size, inc_size, out_size = 0;
+    char *buf, *inc, *out;
+
+    buf = read_file(name, &buf_size);
+    out = calloc(buf_size + 1, 1);
+    dir_end = strrchr(name, '/');
+    dir_end = dir_end ? dir_end + 1 : name;
+
+    for (pos = buf; *pos; pos = eol) {
+        eol = skip_to_eol(pos);
+        if (*eol)
+            eol++;
+
+        inc_end = strncmp(pos, "#include \"", 10) ? NULL : strchr(pos + 10, '"');
+        if (!inc_end || inc_end > eol) {
+            memcpy(out + out_size, pos, eol - pos);
+            out_size += eol - pos;
+            continue;
+        }
+
+        int dir_len = dir_end - name, inc_len = inc_end - (pos + 10);
+        char inc_name[dir_len + inc_len + 1];
+        memcpy(inc_name, name, dir_len);
+        memcpy(inc_name + dir_len, pos + 10, inc_len);
+        inc_name[dir_len + inc_len] = 0;
+
+        inc = read_file(inc_name, &inc_size);
+        out = realloc(out, buf_size + out_size + inc_size + 1);
+        memcpy(out + out_size, inc, inc_size);
+        out_size += inc_size;
+        free(inc);
+    }
+    out[out_size] = 0;
+    free(buf);
+
+    *size = out_size;
+    return out;
+}
+
+/* #version has to be the first thing in the source, the defines go right after */
+static void write_glsl(const char *buf, size_t size, const char *defines, FILE *fout)
+{
+    const char *pos = buf;
+
+    if (strncmp(pos, "#version ", 9) == 0) {
+        pos = skip_to_eol(pos);
+        if (*pos)
+            pos++;
+        fwrite(buf, 1, pos - buf, fout);
+    }
+    fwrite(defines, 1, strlen(defines), fout);
+    fwrite(pos, 1, size - (pos - buf), fout);
+}
+
+void preprocess_vert_shader(char *input_name, char *output_name, enum shader_language target,
+                            const char *defines)
+{
+    size_t size;
+    char *buf = read_shader(input_name, &size);
+
     FILE* fout = fopen(output_name, "w+");
     if (!fout) {
         fprintf(stderr, "Cannot create '%s'.\n", output_name);
         exit(EXIT_FAILURE);            
     }
     if (target == LANGUAGE_GLSL) {
-        fwrite(buf, 1, st.st_size, fout);        
+        write_glsl(buf, size, defines, fout);
     } else if (target == LANGUAGE_GLSL_ES) {
+        fwrite(defines, 1, strlen(defines), fout);
+
         const char *next_line;
         for (const char* pos = buf;;) {
             next_line = skip_to_new_line(pos);
@@ -87,7 +196,7 @@ void preprocess_vert_shader(char *input_name, char *output_name, enum shader_lan
                 fwrite("varying ", 1, 8, fout);
             }
 
-            fwrite(pos, 1, next_line - pos, fout);
+            write_line_es(pos, next_line, fout);
         
             pos = next_line;
         }
@@ -96,22 +205,11 @@ void preprocess_vert_shader(char *input_name, char *output_name, enum shader_lan
     free(buf);
 }
 
-void preprocess_frag_shader(char *input_name, char *output_name, enum shader_language target)
+void preprocess_frag_shader(char *input_name, char *output_name, enum shader_language target,
+                            const char *defines)
 {
-    FILE* f = fopen(input_name, "r");
-    if (!f) {
-        fprintf(stderr, "Cannot open '%s'.\n", input_name);
-        exit(EXIT_FAILURE);
-    }
-    
-    struct stat st;
-    fstat(fileno(f), &st);
-    char* buf = (char *)calloc(st.st_size + 1, 1);
-    if (fread(buf, 1, st.st_size, f) != st.st_size) {
-        fprintf(stderr, "Can't read %s: %m\n", input_name);
-        exit(EXIT_FAILURE);
-    }
-    fclose(f);
+    size_t size;
+    char *buf = read_shader(input_name, &size);
 
     FILE* fout = fopen(output_name, "w+");
     if (!fout) {
@@ -120,9 +218,10 @@ void preprocess_frag_shader(char *input_name, char *output_name, enum shader_lan
     }
 
     if (target == LANGUAGE_GLSL) {
-        fwrite(buf, 1, st.st_size, fout);        
+        write_glsl(buf, size, defines, fout);
     } else if (target == LANGUAGE_GLSL_ES) {
         fwrite("precision mediump float;\n", 1, 25, fout);
+        fwrite(defines, 1, strlen(defines), fout);
         
         const char *next_line;
         for (const char* pos = buf;;) {
@@ -181,47 +280,107 @@ void preprocess_frag_shader(char *input_name, char *output_name, enum shader_lan
     free(buf);
 }
 
-void preprocess_shader(char* input_name, char* output_path, int convert_to_glsl_es)
+void preprocess_shader(char* input_name, char* output_path, int convert_to_glsl_es,
+                       const char *suffix, const char *defines)
 {
     int n = strlen(input_name);
     int output_path_length = strlen(output_path);
+    int suffix_length = strlen(suffix);
     
     char input_vert_name[n + 6];
     strcpy(input_vert_name, input_name);
     strcat(input_vert_name, ".vert");
     int i = n;
     while (i >= 0 && input_vert_name[i] != '/') i--;
-    char *vert_file_name = input_vert_name + i + 1;
+    char *file_name = input_name + i + 1;
     
-    char output_vert_name[output_path_length + strlen(vert_file_name) + 1];
+    char output_vert_name[output_path_length + strlen(file_name) + suffix_length + 6];
     strcpy(output_vert_name, output_path);
-    strcat(output_vert_name, vert_file_name);
+    strcat(output_vert_name, file_name);
+    strcat(output_vert_name, suffix);
+    strcat(output_vert_name, ".vert");
     
     char input_frag_name[n + 6];
     strcpy(input_frag_name, input_name);
     strcat(input_frag_name, ".frag");
-    i = n;
-    while (i >= 0 && input_frag_name[i] != '/') i--;
-    char *frag_file_name = input_frag_name + i + 1;
     
-    char output_frag_name[output_path_length + strlen(frag_file_name) + 1];
+    char output_frag_name[output_path_length + strlen(file_name) + suffix_length + 6];
     strcpy(output_frag_name, output_path);
-    strcat(output_frag_name, frag_file_name);
+    strcat(output_frag_name, file_name);
+    strcat(output_frag_name, suffix);
+    strcat(output_frag_name, ".frag");
     
     printf("Vertex shader: '%s' -> '%s'.\n", input_vert_name, output_vert_name);
-    preprocess_vert_shader(input_vert_name, output_vert_name, convert_to_glsl_es);
+    preprocess_vert_shader(input_vert_name, output_vert_name, convert_to_glsl_es, defines);
     printf("Fragment shader: '%s' -> '%s'.\n", input_frag_name, output_frag_name);
-    preprocess_frag_shader(input_frag_name, output_frag_name, convert_to_glsl_es);
+    preprocess_frag_shader(input_frag_name, output_frag_name, convert_to_glsl_es, defines);
+}
+
+/*
+ * Every combination of the @mask features, as "<name>+feature+feature",
+ * with SPECIALIZED and the features' names #defined; the shader itself
+ * stays as it is, checking its uniforms at runtime.
+ */
+void preprocess_variants(char *input_name, char *output_path, int convert_to_glsl_es,
+                         unsigned int mask)
+{
+    char suffix[128], defines[256];
+    unsigned int variant, f;
+
+    preprocess_shader(input_name, output_path, convert_to_glsl_es, "", "");
+
+    for (variant = 1; variant < (1u << NR_FEATURES); variant++) {
+        if ((variant & mask) != variant)
+            continue;
+
+        strcpy(suffix, "");
+        strcpy(defines, "#define SPECIALIZED\n");
+        for (f = 0; f < NR_FEATURES; f++) {
+            if (!(variant & (1u << f)))
+                continue;
+            strcat(suffix, "+");
+            strcat(suffix, features[f].name);
+            strcat(defines, "#define ");
+            strcat(defines, features[f].define);
+            strcat(defines, "\n");
+        }
+        preprocess_shader(input_name, output_path, convert_to_glsl_es, suffix, defines);
+    }
+}
+
+/* -p skinning,normals */
+static unsigned int parse_features(char *arg)
+{
+    unsigned int mask = 0, f;
+    char *name;
+
+    for (name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+        for (f = 0; f < NR_FEATURES; f++)
+            if (!strcmp(name, features[f].name))
+                break;
+
+        if (f == NR_FEATURES) {
+            fprintf(stderr, "unknown feature '%s'. Valid features are:", name);
+            for (f = 0; f < NR_FEATURES; f++)
+                fprintf(stderr, " %s", features[f].name);
+            fprintf(stderr, ".\n");
+            exit(EXIT_FAILURE);
+        }
+        mask |= 1u << f;
+    }
+
+    return mask;
 }
 
 int main(int argc, char **argv, char **envp)
 {
     char* output_path = "./";
     enum shader_language target = LANGUAGE_UNDEFINED;
+    unsigned int mask = 0;
 
     int c;
     for (;;) {
-        c = getopt(argc, argv, "t:o:");
+        c = getopt(argc, argv, "t:o:p:");
         if (c == -1)
             break;
 
@@ -239,6 +398,9 @@ int main(int argc, char **argv, char **envp)
         case 'o':
             output_path = optarg;
             break;
+        case 'p':
+            mask |= parse_features(optarg);
+            break;
         default:
             fprintf(stderr, "invalid option %x\n", c);
             exit(EXIT_FAILURE);            
@@ -258,6 +420,6 @@ int main(int argc, char **argv, char **envp)
     }
     for (int i = optind; i < argc; i++) {
         printf("Preprocessing %s\n", argv[i]);
-        preprocess_shader(argv[i], output_path, target);
+        preprocess_variants(argv[i], output_path, target, mask);
     }
 }
@@ -11,6 +11,9 @@ fi
 if [ -n "$use_gles" ]; then
 	CLAP_OPTS="$CLAP_OPTS -DCLAP_BUILD_WITH_GLES=ON"
 fi
+if [ -n "$use_pthreads" ]; then
+	CLAP_OPTS="$CLAP_OPTS -DCLAP_BUILD_WITH_PTHREADS=ON"
+fi
 if [ -n "$server_ip" ]; then
 	CLAP_OPTS="$CLAP_OPTS -DCLAP_SERVER_IP=$server_ip"
 fi
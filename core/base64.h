@@ -116,7 +116,7 @@ int base64_decode_quartet_using_maps(const base64_maps_t *maps,
  * @note sets errno = EDOM if src contains invalid characters
  * @note sets errno = EINVAL if src is an invalid base64 tail
  */
-int base64_decode_tail_using_maps(const base64_maps_t *maps, char *dest,
+int base64_decode_tail_using_maps(const base64_maps_t *maps, char dest[3],
 				  const char *src, size_t srclen);
 
 
@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+#include "bench.h"
+#include "display.h"
+#include "histogram.h"
+#include "render.h"
+
+#ifndef CONFIG_BROWSER
+
+static struct bench {
+    struct bench_config cfg;
+    struct histogram    hist;
+    /* the virtual clock */
+    struct timespec     now;
+    struct timespec     frame_start;
+    uint64_t            total_us;
+    uint64_t            min_us;
+    /* the counted frames' totals, and where this frame's started */
+    struct render_stats stats;
+    struct render_stats frame_stats;
+    unsigned long       nr;
+    int                 width;
+    int                 height;
+    bool                active;
+} bench;
+
+void bench_init(const struct bench_config *cfg, int width, int height)
+{
+    memset(&bench, 0, sizeof(bench));
+    bench.cfg    = *cfg;
+    bench.width  = width;
+    bench.height = height;
+    bench.min_us = UINT64_MAX;
+    bench.active = !!cfg->frames;
+    if (bench.active)
+        msg("benchmark: %u frames after %u warmup at %dx%d\n", cfg->frames, cfg->warmup,
+            width, height);
+}
+
+bool bench_active(void)
+{
+    return bench.active;
+}
+
+void bench_frame_begin(struct timespec *now, struct timespec *delta)
+{
+    if (!bench.active)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &bench.frame_start);
+    render_stats(&bench.frame_stats, false);
+
+    delta->tv_sec  = 0;
+    delta->tv_nsec = 1000000000 / BENCH_RATE;
+    bench.now.tv_nsec += delta->tv_nsec;
+    if (bench.now.tv_nsec >= 1000000000) {
+        bench.now.tv_sec++;
+        bench.now.tv_nsec -= 1000000000;
+    }
+    *now = bench.now;
+}
+
+static int bench_capture(const char *path)
+{
+    LOCAL(uchar, pixels);
+    size_t stride = bench.width * 3;
+    int y, ret = 0;
+    FILE *f;
+
+    pixels = malloc(stride * bench.height);
+    if (!pixels)
+        return -ENOMEM;
+
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, gl_screen_fbo()));
+    GL(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+    GL(glReadPixels(0, 0, bench.width, bench.height, GL_RGB, GL_UNSIGNED_BYTE, pixels));
+
+    f = fopen(path, "wb");
+    if (!f)
+        return -errno;
+
+    fprintf(f, "P6\n%d %d\n255\n", bench.width, bench.height);
+    /* GL's rows go bottom up */
+    for (y = bench.height - 1; y >= 0; y--)
+        if (fwrite(pixels + y * stride, stride, 1, f) != 1)
+            ret = -EIO;
+
+    if (fclose(f))
+        ret = -EIO;
+
+    return ret;
+}
+
+static void bench_report(void)
+{
+    struct render_stats *rs = &bench.stats;
+    struct histogram *h = &bench.hist;
+    double nr = max(bench.nr, 1);
+    int err, lod;
+
+    /* one line, for the scripts */
+    printf("bench: frames %lu avg %.3f min %.3f p50 %.3f p95 %.3f p99 %.3f max %.3f ms\n",
+           bench.nr, bench.total_us / 1e3 / max(bench.nr, 1), bench.min_us / 1e3,
+           histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 95) / 1e3,
+           histogram_percentile(h, 99) / 1e3, h->max / 1e3);
+    /* and what went into them, per frame */
+    printf("bench: render draws %.1f inst %.1f tris %.1f culled %.1f occluded %.1f "
+           "prog %.1f tex %.1f vao %.1f fbo %.1f uniforms %.1f upload %.1f",
+           rs->draws / nr, rs->instances / nr, render_stats_triangles(rs) / nr, rs->culled / nr,
+           rs->occluded / nr, rs->programs / nr, rs->textures / nr, rs->vaos / nr, rs->fbos / nr,
+           rs->uniforms / nr, rs->upload_bytes / nr);
+    for (lod = 0; lod < RENDER_STATS_LODS; lod++)
+        if (rs->triangles[lod])
+            printf(" lod%d %.1f", lod, rs->triangles[lod] / nr);
+    printf("\n");
+    fflush(stdout);
+
+    if (bench.cfg.capture) {
+        err = bench_capture(bench.cfg.capture);
+        if (err)
+            err("couldn't write '%s': %d\n", bench.cfg.capture, err);
+    }
+}
+
+void bench_frame_end(void)
+{
+    struct render_stats now, frame;
+    struct timespec ts, diff;
+    uint64_t us;
+
+    if (!bench.active)
+        return;
+
+    /* what's not on the screen yet is part of the frame */
+    GL(glFinish());
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timespec_diff(&bench.frame_start, &ts, &diff);
+
+    if (bench.cfg.warmup) {
+        bench.cfg.warmup--;
+        return;
+    }
+
+    render_stats(&now, false);
+    render_stats_diff(&frame, &bench.frame_stats, &now);
+    render_stats_add(&bench.stats, &frame);
+
+    us = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+    histogram_add(&bench.hist, us);
+    bench.total_us += us;
+    bench.min_us = min(bench.min_us, us);
+
+    if (++bench.nr < bench.cfg.frames)
+        return;
+
+    bench_report();
+    bench.active = false;
+    gl_request_exit();
+}
+
+#endif /* CONFIG_BROWSER */
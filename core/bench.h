@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_BENCH_H__
+#define __CLAP_BENCH_H__
+
+#include <stdbool.h>
+#include <time.h>
+#include "config.h"
+
+/*
+ * Headless benchmark: render @frames frames without a window and print
+ * the frame time stats, and the frames' render stats (see render_stats())
+ * on average. Simulation runs at a fixed BENCH_RATE steps per
+ * second off a virtual clock and the demos put the camera on autopilot,
+ * so every run sees the same frames; what's measured is the wall clock
+ * time of each frame, GPU included (bench_frame_end() waits for it).
+ *
+ *   frame_cb()
+ *   {
+ *       clap_fps_calc(&s->fps);
+ *       bench_frame_begin(&ts_start, &ts_delta);
+ *       ...
+ *       bench_frame_end();
+ *       gl_swap_buffers();
+ *   }
+ *
+ * The first @warmup frames are not counted. With @capture, the last
+ * frame is written there as a binary PPM.
+ */
+#define BENCH_RATE  60
+
+struct bench_config {
+    unsigned int    frames;
+    unsigned int    warmup;
+    const char      *capture;
+};
+
+#ifndef CONFIG_BROWSER
+
+void bench_init(const struct bench_config *cfg, int width, int height);
+bool bench_active(void);
+/* replace @now and @delta with the virtual clock and its fixed step */
+void bench_frame_begin(struct timespec *now, struct timespec *delta);
+/* before gl_swap_buffers(); requests exit after the last frame */
+void bench_frame_end(void);
+
+#else /* CONFIG_BROWSER */
+
+static inline void bench_init(const struct bench_config *cfg, int width, int height) {}
+static inline bool bench_active(void) { return false; }
+static inline void bench_frame_begin(struct timespec *now, struct timespec *delta) {}
+static inline void bench_frame_end(void) {}
+
+#endif /* CONFIG_BROWSER */
+
+#endif /* __CLAP_BENCH_H__ */
@@ -0,0 +1,504 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <stdlib.h>
+#include <math.h>
+#include "bvh.h"
+
+#define NODE(_bvh, _i) (&(_bvh)->nodes.x[(_i)])
+
+static inline bool node_is_leaf(struct bvh_node *n)
+{
+    return n->left < 0;
+}
+
+static void aabb_union(float *res, const float *a, const float *b)
+{
+    res[0] = min(a[0], b[0]);
+    res[1] = max(a[1], b[1]);
+    res[2] = min(a[2], b[2]);
+    res[3] = max(a[3], b[3]);
+    res[4] = min(a[4], b[4]);
+    res[5] = max(a[5], b[5]);
+}
+
+static bool aabb_contains(const float *outer, const float *inner)
+{
+    return outer[0] <= inner[0] && outer[1] >= inner[1] &&
+           outer[2] <= inner[2] && outer[3] >= inner[3] &&
+           outer[4] <= inner[4] && outer[5] >= inner[5];
+}
+
+/* half of the surface area: insertion cost heuristic */
+static float aabb_area(const float *a)
+{
+    float dx = a[1] - a[0], dy = a[3] - a[2], dz = a[5] - a[4];
+
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static float aabb_union_area(const float *a, const float *b)
+{
+    float u[6];
+
+    aabb_union(u, a, b);
+    return aabb_area(u);
+}
+
+void bvh_init(struct bvh *bvh, float margin)
+{
+    darray_init(&bvh->nodes);
+    bvh->root = bvh->free = -1;
+    bvh->margin = margin;
+    bvh->nr_leaves = 0;
+}
+
+void bvh_done(struct bvh *bvh)
+{
+    darray_clearout(&bvh->nodes.da);
+    bvh->root = bvh->free = -1;
+    bvh->nr_leaves = 0;
+}
+
+static int bvh_node_alloc(struct bvh *bvh)
+{
+    struct bvh_node *n;
+    int idx;
+
+    if (bvh->free >= 0) {
+        idx = bvh->free;
+        bvh->free = NODE(bvh, idx)->parent;
+    } else {
+        if (!darray_add(&bvh->nodes.da))
+            return -1;
+        idx = bvh->nodes.da.nr_el - 1;
+    }
+
+    n = NODE(bvh, idx);
+    n->parent = n->left = n->right = -1;
+    n->data = NULL;
+
+    return idx;
+}
+
+/* free nodes are chained through ->parent */
+static void bvh_node_free(struct bvh *bvh, int idx)
+{
+    struct bvh_node *n = NODE(bvh, idx);
+
+    n->parent = bvh->free;
+    n->left = n->right = -1;
+    n->data = NULL;
+    bvh->free = idx;
+}
+
+static void bvh_refit(struct bvh *bvh, int idx)
+{
+    struct bvh_node *n;
+
+    for (; idx >= 0; idx = n->parent) {
+        n = NODE(bvh, idx);
+        aabb_union(n->aabb, NODE(bvh, n->left)->aabb, NODE(bvh, n->right)->aabb);
+    }
+}
+
+/*
+ * Pick the sibling for a new leaf by descending into the child that grows
+ * the least, stopping where pairing with the current node is cheapest
+ */
+static int bvh_find_sibling(struct bvh *bvh, const float *aabb)
+{
+    int idx = bvh->root;
+
+    while (!node_is_leaf(NODE(bvh, idx))) {
+        struct bvh_node *n = NODE(bvh, idx);
+        struct bvh_node *l = NODE(bvh, n->left), *r = NODE(bvh, n->right);
+        float area = aabb_area(n->aabb);
+        float combined = aabb_union_area(n->aabb, aabb);
+        float cost = 2 * combined;
+        float inherit = 2 * (combined - area);
+        float cost_l, cost_r;
+
+        cost_l = aabb_union_area(l->aabb, aabb) + inherit;
+        if (!node_is_leaf(l))
+            cost_l -= aabb_area(l->aabb);
+        cost_r = aabb_union_area(r->aabb, aabb) + inherit;
+        if (!node_is_leaf(r))
+            cost_r -= aabb_area(r->aabb);
+
+        if (cost < cost_l && cost < cost_r)
+            break;
+
+        idx = cost_l < cost_r ? n->left : n->right;
+    }
+
+    return idx;
+}
+
+static void bvh_insert_leaf(struct bvh *bvh, int leaf)
+{
+    int sibling, old_parent, parent;
+    struct bvh_node *n;
+
+    if (bvh->root < 0) {
+        bvh->root = leaf;
+        NODE(bvh, leaf)->parent = -1;
+        return;
+    }
+
+    sibling = bvh_find_sibling(bvh, NODE(bvh, leaf)->aabb);
+    /* this may reallocate the nodes */
+    parent = bvh_node_alloc(bvh);
+    if (parent < 0)
+        return;
+
+    old_parent = NODE(bvh, sibling)->parent;
+    n = NODE(bvh, parent);
+    n->parent = old_parent;
+    n->left = sibling;
+    n->right = leaf;
+    NODE(bvh, sibling)->parent = parent;
+    NODE(bvh, leaf)->parent = parent;
+
+    if (old_parent < 0) {
+        bvh->root = parent;
+    } else {
+        n = NODE(bvh, old_parent);
+        if (n->left == sibling)
+            n->left = parent;
+        else
+            n->right = parent;
+    }
+
+    bvh_refit(bvh, parent);
+}
+
+static void bvh_remove_leaf(struct bvh *bvh, int leaf)
+{
+    int parent = NODE(bvh, leaf)->parent, grandparent, sibling;
+    struct bvh_node *n;
+
+    if (parent < 0) {
+        bvh->root = -1;
+        return;
+    }
+
+    n = NODE(bvh, parent);
+    grandparent = n->parent;
+    sibling = n->left == leaf ? n->right : n->left;
+    bvh_node_free(bvh, parent);
+    NODE(bvh, sibling)->parent = grandparent;
+
+    if (grandparent < 0) {
+        bvh->root = sibling;
+        return;
+    }
+
+    n = NODE(bvh, grandparent);
+    if (n->left == parent)
+        n->left = sibling;
+    else
+        n->right = sibling;
+    bvh_refit(bvh, grandparent);
+}
+
+static void bvh_leaf_set_aabb(struct bvh *bvh, int leaf, const float *aabb)
+{
+    struct bvh_node *n = NODE(bvh, leaf);
+    float m = bvh->margin;
+
+    n->aabb[0] = aabb[0] - m;
+    n->aabb[1] = aabb[1] + m;
+    n->aabb[2] = aabb[2] - m;
+    n->aabb[3] = aabb[3] + m;
+    n->aabb[4] = aabb[4] - m;
+    n->aabb[5] = aabb[5] + m;
+}
+
+int bvh_insert(struct bvh *bvh, const float *aabb, void *data)
+{
+    int leaf = bvh_node_alloc(bvh);
+
+    if (leaf < 0)
+        return -1;
+
+    NODE(bvh, leaf)->data = data;
+    bvh_leaf_set_aabb(bvh, leaf, aabb);
+    bvh_insert_leaf(bvh, leaf);
+    bvh->nr_leaves++;
+
+    return leaf;
+}
+
+void bvh_remove(struct bvh *bvh, int node)
+{
+    /* also covers the tree having been bvh_done()d already */
+    if (node < 0 || node >= bvh->nodes.da.nr_el)
+        return;
+
+    bvh_remove_leaf(bvh, node);
+    bvh_node_free(bvh, node);
+    bvh->nr_leaves--;
+}
+
+/* the leaf keeps its index */
+void bvh_move(struct bvh *bvh, int node, const float *aabb)
+{
+    if (node < 0)
+        return;
+
+    /* still within the fattened AABB: nothing to do */
+    if (aabb_contains(NODE(bvh, node)->aabb, aabb))
+        return;
+
+    bvh_remove_leaf(bvh, node);
+    bvh_leaf_set_aabb(bvh, node, aabb);
+    bvh_insert_leaf(bvh, node);
+}
+
+enum {
+    FRUSTUM_OUTSIDE = 0,
+    FRUSTUM_INTERSECT,
+    FRUSTUM_INSIDE,
+};
+
+/*
+ * Planes point inwards (camera_calc_frustum()); for each plane, test the
+ * corner furthest along its normal: if that's behind, the whole box is
+ * outside; if the nearest corner is in front, the box is fully inside it
+ */
+static int aabb_frustum_classify(const float *aabb, float (*planes)[4])
+{
+    int i, ret = FRUSTUM_INSIDE;
+
+    for (i = 0; i < 6; i++) {
+        float *p = planes[i];
+        float far, near;
+
+        far = p[0] * (p[0] >= 0 ? aabb[1] : aabb[0]) +
+              p[1] * (p[1] >= 0 ? aabb[3] : aabb[2]) +
+              p[2] * (p[2] >= 0 ? aabb[5] : aabb[4]) + p[3];
+        if (far < 0)
+            return FRUSTUM_OUTSIDE;
+
+        near = p[0] * (p[0] >= 0 ? aabb[0] : aabb[1]) +
+               p[1] * (p[1] >= 0 ? aabb[2] : aabb[3]) +
+               p[2] * (p[2] >= 0 ? aabb[4] : aabb[5]) + p[3];
+        if (near < 0)
+            ret = FRUSTUM_INTERSECT;
+    }
+
+    return ret;
+}
+
+bool bvh_aabb_in_frustum(const float *aabb, float (*planes)[4])
+{
+    return aabb_frustum_classify(aabb, planes) != FRUSTUM_OUTSIDE;
+}
+
+static void bvh_query_node(struct bvh *bvh, int idx, float (*planes)[4], bool inside,
+                           bvh_cb cb, void *priv)
+{
+    struct bvh_node *n = NODE(bvh, idx);
+
+    if (!inside) {
+        int res = aabb_frustum_classify(n->aabb, planes);
+
+        if (res == FRUSTUM_OUTSIDE)
+            return;
+
+        /* the whole subtree is in, skip the tests below */
+        inside = res == FRUSTUM_INSIDE;
+    }
+
+    if (node_is_leaf(n)) {
+        cb(n->data, inside, priv);
+        return;
+    }
+
+    bvh_query_node(bvh, n->left, planes, inside, cb, priv);
+    bvh_query_node(bvh, n->right, planes, inside, cb, priv);
+}
+
+void bvh_query_frustum(struct bvh *bvh, float (*planes)[4], bvh_cb cb, void *priv)
+{
+    if (bvh->root < 0)
+        return;
+
+    bvh_query_node(bvh, bvh->root, planes, false, cb, priv);
+}
+
+static void bvh_query_node_views(struct bvh *bvh, int idx, float (**planes)[4], unsigned int mask,
+                                 unsigned int inside, bvh_views_cb cb, void *priv)
+{
+    struct bvh_node *n = NODE(bvh, idx);
+    unsigned int i, bit;
+
+    for (i = 0; i < BVH_VIEWS_MAX; i++) {
+        bit = 1u << i;
+        if (!(mask & bit) || (inside & bit))
+            continue;
+
+        switch (aabb_frustum_classify(n->aabb, planes[i])) {
+        case FRUSTUM_OUTSIDE:
+            mask &= ~bit;
+            break;
+        case FRUSTUM_INSIDE:
+            inside |= bit;
+            break;
+        }
+    }
+
+    if (!mask)
+        return;
+
+    if (node_is_leaf(n)) {
+        cb(n->data, mask, inside, priv);
+        return;
+    }
+
+    bvh_query_node_views(bvh, n->left, planes, mask, inside, cb, priv);
+    bvh_query_node_views(bvh, n->right, planes, mask, inside, cb, priv);
+}
+
+void bvh_query_frustums(struct bvh *bvh, float (**planes)[4], unsigned int nr,
+                        bvh_views_cb cb, void *priv)
+{
+    if (bvh->root < 0 || !nr)
+        return;
+
+    nr = min(nr, BVH_VIEWS_MAX);
+    bvh_query_node_views(bvh, bvh->root, planes, nr == BVH_VIEWS_MAX ? ~0u : (1u << nr) - 1,
+                         0, cb, priv);
+}
+
+/* squared distance from @p to the nearest point of @aabb, 0 if it's inside */
+static float aabb_dist2(const float *aabb, const float *p)
+{
+    float d, ret = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        d = max(aabb[i * 2] - p[i], p[i] - aabb[i * 2 + 1]);
+        if (d > 0)
+            ret += d * d;
+    }
+
+    return ret;
+}
+
+/* ...and to the furthest one */
+static float aabb_far_dist2(const float *aabb, const float *p)
+{
+    float d, ret = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        d = max(p[i] - aabb[i * 2], aabb[i * 2 + 1] - p[i]);
+        ret += d * d;
+    }
+
+    return ret;
+}
+
+static void bvh_query_node_sphere(struct bvh *bvh, int idx, const float *center, float r2,
+                                  bool inside, bvh_cb cb, void *priv)
+{
+    struct bvh_node *n = NODE(bvh, idx);
+
+    if (!inside) {
+        if (aabb_dist2(n->aabb, center) > r2)
+            return;
+
+        inside = aabb_far_dist2(n->aabb, center) <= r2;
+    }
+
+    if (node_is_leaf(n)) {
+        cb(n->data, inside, priv);
+        return;
+    }
+
+    bvh_query_node_sphere(bvh, n->left, center, r2, inside, cb, priv);
+    bvh_query_node_sphere(bvh, n->right, center, r2, inside, cb, priv);
+}
+
+void bvh_query_sphere(struct bvh *bvh, const float *center, float radius, bvh_cb cb, void *priv)
+{
+    if (bvh->root < 0)
+        return;
+
+    bvh_query_node_sphere(bvh, bvh->root, center, radius * radius, false, cb, priv);
+}
+
+struct bvh_nearest {
+    const float     *point;
+    bvh_dist_fn     dist;
+    void            *priv;
+    struct bvh_hit  *hits;
+    unsigned int    nr;
+    unsigned int    nr_hits;
+    /* nothing further than this can make it */
+    float           bound;
+};
+
+static void bvh_nearest_leaf(struct bvh_nearest *q, void *data)
+{
+    float d = q->dist(data, q->point, q->priv);
+    unsigned int i;
+
+    if (d < 0 || d > q->bound || (q->nr_hits == q->nr && d >= q->bound))
+        return;
+
+    /* insertion into the sorted hits, the furthest one falls off */
+    i = q->nr_hits < q->nr ? q->nr_hits++ : q->nr - 1;
+    for (; i && q->hits[i - 1].dist > d; i--)
+        q->hits[i] = q->hits[i - 1];
+    q->hits[i].data = data;
+    q->hits[i].dist = d;
+
+    if (q->nr_hits == q->nr)
+        q->bound = q->hits[q->nr - 1].dist;
+}
+
+static void bvh_nearest_node(struct bvh *bvh, int idx, float d, struct bvh_nearest *q)
+{
+    struct bvh_node *n = NODE(bvh, idx);
+    float dl, dr;
+
+    if (d > q->bound)
+        return;
+
+    if (node_is_leaf(n)) {
+        bvh_nearest_leaf(q, n->data);
+        return;
+    }
+
+    /* the nearer child first, it's likely to tighten the bound */
+    dl = aabb_dist2(NODE(bvh, n->left)->aabb, q->point);
+    dr = aabb_dist2(NODE(bvh, n->right)->aabb, q->point);
+    if (dl <= dr) {
+        bvh_nearest_node(bvh, n->left, dl, q);
+        bvh_nearest_node(bvh, n->right, dr, q);
+    } else {
+        bvh_nearest_node(bvh, n->right, dr, q);
+        bvh_nearest_node(bvh, n->left, dl, q);
+    }
+}
+
+unsigned int bvh_nearest(struct bvh *bvh, const float *point, float radius, bvh_dist_fn dist,
+                         void *priv, struct bvh_hit *hits, unsigned int nr)
+{
+    struct bvh_nearest q = {
+        .point  = point,
+        .dist   = dist,
+        .priv   = priv,
+        .hits   = hits,
+        .nr     = nr,
+        .bound  = radius * radius,
+    };
+
+    if (bvh->root < 0 || !nr)
+        return 0;
+
+    bvh_nearest_node(bvh, bvh->root, aabb_dist2(NODE(bvh, bvh->root)->aabb, point), &q);
+
+    return q.nr_hits;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_BVH_H__
+#define __CLAP_BVH_H__
+
+#include <stdbool.h>
+#include "util.h"
+
+/*
+ * Dynamic AABB tree for spatial queries over entities
+ *
+ * AABBs are laid out like entity3d::aabb: { min x, max x, min y, max y,
+ * min z, max z }. Leaves store their AABBs fattened by @margin, so small
+ * movements don't require reinsertion; internal nodes enclose their
+ * children. A node's @left == -1 marks a leaf.
+ */
+struct bvh_node {
+    float           aabb[6];
+    int             parent;
+    int             left;
+    int             right;
+    void            *data;
+};
+
+struct bvh {
+    darray(struct bvh_node, nodes);
+    int             root;
+    int             free;
+    float           margin;
+    unsigned int    nr_leaves;
+};
+
+/* @inside: the leaf is entirely within the frustum, no need to test it */
+typedef void (*bvh_cb)(void *data, bool inside, void *priv);
+/*
+ * Several frustums in one traversal: bit N of @mask is set if the leaf is
+ * in (or intersects) frustum N, of @inside, if it's entirely within it
+ */
+typedef void (*bvh_views_cb)(void *data, unsigned int mask, unsigned int inside, void *priv);
+#define BVH_VIEWS_MAX   32
+
+/*
+ * Squared distance from @point to the leaf's object, negative to skip it;
+ * the object must be inside its AABB for the pruning to hold
+ */
+typedef float (*bvh_dist_fn)(void *data, const float *point, void *priv);
+
+struct bvh_hit {
+    void            *data;
+    float           dist;
+};
+
+void bvh_init(struct bvh *bvh, float margin);
+void bvh_done(struct bvh *bvh);
+int bvh_insert(struct bvh *bvh, const float *aabb, void *data);
+void bvh_remove(struct bvh *bvh, int node);
+void bvh_move(struct bvh *bvh, int node, const float *aabb);
+void bvh_query_frustum(struct bvh *bvh, float (*planes)[4], bvh_cb cb, void *priv);
+/* subtrees outside of all @nr frustums are rejected once for all of them */
+void bvh_query_frustums(struct bvh *bvh, float (**planes)[4], unsigned int nr,
+                        bvh_views_cb cb, void *priv);
+bool bvh_aabb_in_frustum(const float *aabb, float (*planes)[4]);
+/* leaves whose AABBs are within @radius of @center, @inside: all of it is */
+void bvh_query_sphere(struct bvh *bvh, const float *center, float radius, bvh_cb cb, void *priv);
+/*
+ * Up to @nr objects nearest to @point, within @radius, by @dist, nearest
+ * first; returns how many it found
+ */
+unsigned int bvh_nearest(struct bvh *bvh, const float *point, float radius, bvh_dist_fn dist,
+                         void *priv, struct bvh_hit *hits, unsigned int nr);
+
+#endif /* __CLAP_BVH_H__ */
@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ca2d.h"
 #include "util.h"
 #include "xyarray.h"
@@ -58,22 +60,196 @@ int ca2d_neigh_mv(unsigned char *arr, int side, int x, int y)
     return n;
 }
 
-void ca2d_step(const struct cell_automaton *ca, unsigned char *arr, int side)
+/*
+ * Stepping: all cells at once, from the previous generation. The neighbor
+ * functions above are the reference; the ones the fast paths know are
+ * picked by ca2d_kind(), anything else goes through ca->neigh per cell.
+ */
+enum ca2d_kind {
+    CA2D_GENERIC = 0,
+    /* live neighbors: vn1, m1 */
+    CA2D_LIVE,
+    /* neighbors with a higher state: vnv, mv */
+    CA2D_HIGHER,
+};
+
+static enum ca2d_kind ca2d_kind(const struct cell_automaton *ca, bool *moore)
+{
+    *moore = ca->neigh == ca2d_neigh_m1 || ca->neigh == ca2d_neigh_mv;
+    if (ca->neigh == ca2d_neigh_vn1 || ca->neigh == ca2d_neigh_m1)
+        return CA2D_LIVE;
+    if (ca->neigh == ca2d_neigh_vnv || ca->neigh == ca2d_neigh_mv)
+        return CA2D_HIGHER;
+    return CA2D_GENERIC;
+}
+
+static inline unsigned char ca2d_rule(const struct cell_automaton *ca, int v, int n)
+{
+    if (!v)
+        return (ca->born >> n) & 1 ? ca->nr_states : 0;
+    if ((ca->surv >> n) & 1)
+        return v;
+    return ca->decay ? v - 1 : v;
+}
+
+static void ca2d_step_generic(const struct cell_automaton *ca, unsigned char *arr,
+                              unsigned char *prev, int side)
 {
     int i, j;
 
     for (i = 0; i < side; i++)
-        for (j = 0; j < side; j++) {
-            int n = ca->neigh(arr, side, i, j);
-            int v = xyarray_get(arr, side, i, j);
-
-            if (!v && (ca->born & (1 << n)))
-                xyarray_set(arr, side, i, j, ca->nr_states);
-            else if (v && (ca->surv & (1 << n)))
-                ;
-            else if (v && ca->decay)
-                xyarray_set(arr, side, i, j, v - 1);
+        for (j = 0; j < side; j++)
+            arr[j * side + i] = ca2d_rule(ca, xyarray_get(prev, side, i, j),
+                                          ca->neigh(prev, side, i, j));
+}
+
+/*
+ * Byte per cell, from a copy with a border of dead cells all around, so the
+ * inner loop is the same for every cell, and simple enough to vectorize.
+ */
+static void ca2d_step_bytes(const struct cell_automaton *ca, unsigned char *arr,
+                            unsigned char *pad, bool higher, bool moore, int side)
+{
+    int x, y, stride = side + 2;
+
+    for (y = 0; y < side; y++) {
+        const unsigned char *n = pad + y * stride + 1;
+        const unsigned char *c = n + stride;
+        const unsigned char *s = c + stride;
+        unsigned char *out = arr + y * side;
+
+        for (x = 0; x < side; x++) {
+            int v = c[x], nr;
+
+            if (higher) {
+                nr = (n[x] > v) + (s[x] > v) + (c[x - 1] > v) + (c[x + 1] > v);
+                if (moore)
+                    nr += (n[x - 1] > v) + (n[x + 1] > v) + (s[x - 1] > v) + (s[x + 1] > v);
+            } else {
+                nr = !!n[x] + !!s[x] + !!c[x - 1] + !!c[x + 1];
+                if (moore)
+                    nr += !!n[x - 1] + !!n[x + 1] + !!s[x - 1] + !!s[x + 1];
+            }
+
+            out[x] = ca2d_rule(ca, v, nr);
+        }
+    }
+}
+
+/*
+ * Two states, 0 and 1: 64 cells to a word, the neighbor counts are added
+ * up bit-sliced, into 4 bit planes, for all 64 cells at once.
+ */
+static inline void bits_add(uint64_t *plane, uint64_t bits)
+{
+    uint64_t carry;
+    int i;
+
+    for (i = 0; i < 4 && bits; i++) {
+        carry = plane[i] & bits;
+        plane[i] ^= bits;
+        bits = carry;
+    }
+}
+
+/* the cells whose count is one of the bits in @rule */
+static inline uint64_t bits_match(const uint64_t *plane, unsigned int rule)
+{
+    uint64_t ret = 0, eq;
+    int n, i;
+
+    for (n = 0; n <= 8; n++) {
+        if (!((rule >> n) & 1))
+            continue;
+        for (eq = ~0ull, i = 0; i < 4; i++)
+            eq &= (n >> i) & 1 ? plane[i] : ~plane[i];
+        ret |= eq;
+    }
+
+    return ret;
+}
+
+static inline uint64_t bits_west(const uint64_t *row, int k)
+{
+    return (row[k] << 1) | (k ? row[k - 1] >> 63 : 0);
+}
+
+static inline uint64_t bits_east(const uint64_t *row, int k, int nr_words)
+{
+    return (row[k] >> 1) | (k + 1 < nr_words ? row[k + 1] << 63 : 0);
+}
+
+static void ca2d_step_bits(const struct cell_automaton *ca, unsigned char *arr, bool higher,
+                           bool moore, int side)
+{
+    int nr_words = (side + 63) / 64, x, y, k;
+    /* one row of dead cells above and below */
+    uint64_t *bits, *row, *n, *s, plane[4], v, born, surv, next;
+
+    CHECK(bits = calloc((side + 2) * nr_words, sizeof(*bits)));
+    for (y = 0; y < side; y++)
+        for (x = 0; x < side; x++)
+            if (arr[y * side + x])
+                bits[(y + 1) * nr_words + x / 64] |= 1ull << (x % 64);
+
+    for (y = 0; y < side; y++) {
+        n   = bits + y * nr_words;
+        row = n + nr_words;
+        s   = row + nr_words;
+
+        for (k = 0; k < nr_words; k++) {
+            memset(plane, 0, sizeof(plane));
+            bits_add(plane, n[k]);
+            bits_add(plane, s[k]);
+            bits_add(plane, bits_west(row, k));
+            bits_add(plane, bits_east(row, k, nr_words));
+            if (moore) {
+                bits_add(plane, bits_west(n, k));
+                bits_add(plane, bits_east(n, k, nr_words));
+                bits_add(plane, bits_west(s, k));
+                bits_add(plane, bits_east(s, k, nr_words));
+            }
+
+            v = row[k];
+            born = bits_match(plane, ca->born);
+            /* no neighbor is higher than a live cell */
+            surv = higher ? (ca->surv & 1 ? ~0ull : 0) : bits_match(plane, ca->surv);
+            next = (~v & born) | (v & (ca->decay ? surv : ~0ull));
+
+            for (x = k * 64; x < min(side, k * 64 + 64); x++)
+                arr[y * side + x] = (next >> (x % 64)) & 1;
         }
+    }
+
+    free(bits);
+}
+
+void ca2d_step(const struct cell_automaton *ca, unsigned char *arr, int side)
+{
+    enum ca2d_kind kind;
+    unsigned char *prev;
+    bool moore;
+    int y;
+
+    kind = ca2d_kind(ca, &moore);
+    if (kind != CA2D_GENERIC && ca->nr_states == 1) {
+        ca2d_step_bits(ca, arr, kind == CA2D_HIGHER, moore, side);
+        return;
+    }
+
+    if (kind == CA2D_GENERIC) {
+        CHECK(prev = malloc(side * side));
+        memcpy(prev, arr, side * side);
+        ca2d_step_generic(ca, arr, prev, side);
+        free(prev);
+        return;
+    }
+
+    CHECK(prev = calloc((side + 2) * (side + 2), 1));
+    for (y = 0; y < side; y++)
+        memcpy(prev + (y + 1) * (side + 2) + 1, arr + y * side, side);
+    ca2d_step_bytes(ca, arr, prev, kind == CA2D_HIGHER, moore, side);
+    free(prev);
 }
 
 unsigned char *ca2d_generate(const struct cell_automaton *ca, int side, int steps)
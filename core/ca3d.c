@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <limits.h>
 #include "logger.h"
+#include "jobs.h"
 #include "ui-debug.h"
 #include "ca3d.h"
 
@@ -203,24 +204,145 @@ struct cell_automn cas[] = {
     CA_DEF(ca_crystal_1, CA_RANGE(0, 6),CA_1|CA_3, 2, vn1),
 };
 
+/*
+ * A step computes the next generation from a copy of the previous one, in
+ * slabs of CA3D_SLAB planes along Z, each on a worker. The cells' "alive"
+ * bits go into a padded byte array first, with dead cells all around, so
+ * nothing needs bounds checks. For the Moore neighborhood, the 3x3x3 sums
+ * are separable: along X, then Y for each plane, then the 3 planes around
+ * the cell, which is 3 additions a step instead of 26 loads.
+ */
+#define CA3D_SLAB 4
+
+struct ca3d_step {
+    struct cell_automn  *ca;
+    struct xyzarray     *xyz;
+    /* the previous generation */
+    int                 *prev;
+    /* (dim + 2)^3 of 0 or 1 */
+    unsigned char       *alive;
+};
+
+static inline int ca3d_rule(struct cell_automn *ca, int state, int neigh)
+{
+    if (state && !(ca->surv_mask & (1 << neigh)))
+        return state - 1;
+    if (!state && (ca->born_mask & (1 << neigh)))
+        return ca->nr_states - 1;
+    return state;
+}
+
+/* 3x3 sums around each cell of padded plane @pz, @sx is scratch */
+static void ca3d_plane_sum(struct ca3d_step *st, int pz, unsigned char *sx, unsigned char *sy)
+{
+    int d0 = st->xyz->dim[0], d1 = st->xyz->dim[1];
+    int p0 = d0 + 2, p1 = d1 + 2, x, y;
+    const unsigned char *a = st->alive + pz * p0 * p1, *r;
+
+    for (y = 0; y < p1; y++)
+        for (x = 0, r = a + y * p0; x < d0; x++)
+            sx[y * d0 + x] = r[x] + r[x + 1] + r[x + 2];
+
+    for (y = 0; y < d1; y++)
+        for (x = 0; x < d0; x++)
+            sy[y * d0 + x] = sx[y * d0 + x] + sx[(y + 1) * d0 + x] + sx[(y + 2) * d0 + x];
+}
+
+static void ca3d_slab_m1(struct ca3d_step *st, int z0, int z1)
+{
+    int d0 = st->xyz->dim[0], d1 = st->xyz->dim[1], plane = d0 * d1;
+    int p0 = d0 + 2, p1 = d1 + 2, pz, x, y, z, i, n;
+    unsigned char *sx, *sums, *s0, *s1, *s2;
+    const unsigned char *a;
+
+    CHECK(sx = malloc(p1 * d0));
+    CHECK(sums = malloc(3 * plane));
+
+    /* cells of plane z are at padded z + 1, and need the sums of z, z + 1, z + 2 */
+    for (pz = z0; pz < z1 + 2; pz++) {
+        ca3d_plane_sum(st, pz, sx, sums + (pz % 3) * plane);
+        if (pz < z0 + 2)
+            continue;
+
+        z = pz - 2;
+        s0 = sums + (z % 3) * plane;
+        s1 = sums + ((z + 1) % 3) * plane;
+        s2 = sums + ((z + 2) % 3) * plane;
+        for (y = 0; y < d1; y++) {
+            a = st->alive + ((z + 1) * p1 + y + 1) * p0 + 1;
+            for (x = 0; x < d0; x++) {
+                i = y * d0 + x;
+                /* the cell itself is in the sum */
+                n = s0[i] + s1[i] + s2[i] - a[x];
+                st->xyz->arr[z * plane + i] = ca3d_rule(st->ca, st->prev[z * plane + i], n);
+            }
+        }
+    }
+
+    free(sums);
+    free(sx);
+}
+
+static void ca3d_slab_vn1(struct ca3d_step *st, int z0, int z1)
+{
+    int d0 = st->xyz->dim[0], d1 = st->xyz->dim[1], plane = d0 * d1;
+    int p0 = d0 + 2, p01 = p0 * (d1 + 2), x, y, z, i, n;
+    const unsigned char *a;
+
+    for (z = z0; z < z1; z++)
+        for (y = 0; y < d1; y++) {
+            a = st->alive + (z + 1) * p01 + (y + 1) * p0 + 1;
+            for (x = 0; x < d0; x++) {
+                i = z * plane + y * d0 + x;
+                n = a[x - 1] + a[x + 1] + a[x - p0] + a[x + p0] + a[x - p01] + a[x + p01];
+                st->xyz->arr[i] = ca3d_rule(st->ca, st->prev[i], n);
+            }
+        }
+}
+
+static void ca3d_slab(unsigned int idx, void *priv)
+{
+    struct ca3d_step *st = priv;
+    int z0 = idx * CA3D_SLAB, z1 = min(z0 + CA3D_SLAB, st->xyz->dim[2]);
+
+    if (st->ca->neigh_fn == ca3d_neighbors_vn1)
+        ca3d_slab_vn1(st, z0, z1);
+    else
+        ca3d_slab_m1(st, z0, z1);
+}
+
 int ca3d_run(struct xyzarray *xyz, int nca, int steps)
 {
     struct cell_automn *ca = &cas[nca % array_size(cas)];
-    int x, y, z, neigh, state;
+    int d0 = xyz->dim[0], d1 = xyz->dim[1], d2 = xyz->dim[2];
+    int p0 = d0 + 2, p1 = d1 + 2, x, y, z;
+    size_t size = (size_t)d0 * d1 * d2;
+    struct ca3d_step st = {
+        .ca  = ca,
+        .xyz = xyz,
+    };
 
     ui_debug_printf("ca: %s\n", ca->name);
-    for (; steps; steps--)
-        for (z = 0; z < xyz->dim[2]; z++)
-            for (y = 0; y < xyz->dim[1]; y++)
-                for (x = 0; x < xyz->dim[0]; x++) {
-                    neigh = ca3d_neighbors_m1(xyz, x, y, z);
-                    state = xyzarray_getat(xyz, x, y, z);
-
-                    if (state && !(ca->surv_mask & (1 << neigh)))
-                        xyzarray_setat(xyz, x, y, z, state - 1);
-                    else if (!state && (ca->born_mask & (1 << neigh)))
-                        xyzarray_setat(xyz, x, y, z, ca->nr_states - 1);
-                }
+    if (!size)
+        return 0;
+
+    CHECK(st.prev = malloc(size * sizeof(*st.prev)));
+    CHECK(st.alive = calloc((size_t)p0 * p1 * (d2 + 2), 1));
+
+    for (; steps; steps--) {
+        memcpy(st.prev, xyz->arr, size * sizeof(*st.prev));
+        for (z = 0; z < d2; z++)
+            for (y = 0; y < d1; y++)
+                for (x = 0; x < d0; x++)
+                    st.alive[((z + 1) * p1 + y + 1) * p0 + x + 1] =
+                        !!st.prev[(z * d1 + y) * d0 + x];
+
+        jobs_parallel_for((d2 + CA3D_SLAB - 1) / CA3D_SLAB, ca3d_slab, &st);
+    }
+
+    free(st.alive);
+    free(st.prev);
+
     return xyzarray_count(xyz);
 }
 
@@ -132,7 +132,8 @@ void camera_set_target_to_current(struct camera *c)
     c->target_yaw = c->current_yaw;
 }
 
-bool test_if_ray_intersects_scene(struct entity3d *entity, vec3 start, vec3 end, double *scale, struct entity3d **hit)
+bool test_if_ray_intersects_scene(struct scene *s, struct entity3d *entity, vec3 start, vec3 end,
+                                  double *scale, struct entity3d **hit)
 {
     vec3 dir;
     double distance, distance_to_hit;
@@ -140,7 +141,7 @@ bool test_if_ray_intersects_scene(struct entity3d *entity, vec3 start, vec3 end,
     vec3_sub(dir, end, start);
     distance = vec3_len(dir);
     distance_to_hit = distance;
-    *hit = phys_ray_cast(entity, start, dir, &distance_to_hit);
+    *hit = phys_ray_cast(s->phys, entity, start, dir, &distance_to_hit);
     if (*hit) {
         *scale = distance_to_hit / distance;
         return true;
@@ -193,13 +194,13 @@ bool camera_position_is_good(struct camera *c, struct entity3d *entity,
     camera_calc_rays(c, s, start, dist, nw, ne, sw, se);
 
     min_scale = 1.0;
-    if (test_if_ray_intersects_scene(entity, start, nw, &scale_nw, &e1))
+    if (test_if_ray_intersects_scene(s, entity, start, nw, &scale_nw, &e1))
         min_scale = fmin(min_scale, scale_nw);
-    if (test_if_ray_intersects_scene(entity, start, ne, &scale_ne, &e2))
+    if (test_if_ray_intersects_scene(s, entity, start, ne, &scale_ne, &e2))
         min_scale = fmin(min_scale, scale_ne);
-    if (test_if_ray_intersects_scene(entity, start, sw, &scale_sw, &e3))
+    if (test_if_ray_intersects_scene(s, entity, start, sw, &scale_sw, &e3))
         min_scale = fmin(min_scale, scale_sw);
-    if (test_if_ray_intersects_scene(entity, start, se, &scale_se, &e4))
+    if (test_if_ray_intersects_scene(s, entity, start, se, &scale_se, &e4))
         min_scale = fmin(min_scale, scale_se);
 
     if (min_scale < 0.99) {
@@ -5,6 +5,8 @@
 #include "terrain.h"
 #include "character.h"
 #include "messagebus.h"
+#include "networking.h"
+#include "snapshot.h"
 #include "ui.h"
 #include "ui-debug.h"
 
@@ -124,7 +126,11 @@ static void motion_reset(struct motionctl *mctl, struct scene *s)
 
 void character_handle_input(struct character *ch, struct scene *s, struct message *m)
 {
-    memcpy(&ch->mctl.ts, &s->ts, sizeof(ch->mctl.ts));
+    /* the dash starts when it was pressed, not when the frame got to it */
+    if (timespec_nonzero(&m->ts))
+        memcpy(&ch->mctl.ts, &m->ts, sizeof(ch->mctl.ts));
+    else
+        memcpy(&ch->mctl.ts, &s->ts, sizeof(ch->mctl.ts));
     motion_parse_input(&ch->mctl, m);
 
     if (scene_character_is_camera(s, s->control) && m->input.trigger_l)
@@ -319,6 +325,7 @@ void character_move(struct character *ch, struct scene *s)
         dBodyEnable(body->body);
 
     ch->entity->dy = ch->pos[1];
+    entity3d_dirty(ch->entity);
 
     ch->motion[0] = 0;
     ch->motion[1] = 0;
@@ -334,6 +341,75 @@ static void character_drop(struct ref *ref)
 
 DECLARE_REFCLASS(character);
 
+/* body's horizontal speed off its motor's by more than this: it's blocked */
+#define CHARACTER_LOCAL_VEL 0.5
+
+/*
+ * What the server can't have seen: it only moves the player by its input,
+ * so falls, jumps and running into things are all local
+ */
+static bool character_motion_is_local(struct character *c)
+{
+    struct phys_body *body = c->entity->phys_body;
+    const dReal *vel;
+    dReal dx, dz;
+
+    if (!body || !phys_body_has_body(body))
+        return false;
+
+    if (c->ragdoll || !dJointGetBody(body->lmotor, 0))
+        return true;
+
+    vel = dBodyGetLinearVel(body->body);
+    dx = vel[0] - dJointGetLMotorParam(body->lmotor, dParamVel1);
+    dz = vel[2] - dJointGetLMotorParam(body->lmotor, dParamVel3);
+
+    return dx * dx + dz * dz > CHARACTER_LOCAL_VEL * CHARACTER_LOCAL_VEL;
+}
+
+/*
+ * The server only has it on the ground plane, so only x and z are
+ * predicted: the height is up to the local physics either way
+ */
+static void character_predict(struct character *c, struct scene *s)
+{
+    uint16_t seq = networking_input_seq();
+    struct entity3d *e = c->entity;
+    float delta[3];
+
+    prediction_smooth(&c->pred, s->fps.fps_fine ? 1.0f / s->fps.fps_fine : 0, delta);
+    if (delta[0] || delta[2]) {
+        entity3d_move(e, delta[0], 0, delta[2]);
+        c->pos[0] = e->dx;
+        c->pos[2] = e->dz;
+    }
+
+    if (seq)
+        prediction_record(&c->pred, seq, (float[]){ e->dx, 0, e->dz },
+                          character_motion_is_local(c));
+}
+
+void character_reconcile(struct character *ch, const struct snapshot *snap)
+{
+    struct snapshot_entity *se;
+    unsigned long frame;
+    unsigned int kind;
+    int animation;
+    float pos[3], yaw;
+
+    if (snap->self == SNAPSHOT_NO_ENTITY)
+        return;
+
+    se = snapshot_find(snap, snap->self);
+    if (!se)
+        return;
+
+    snapshot_entity_unpack(se, pos, &yaw, &animation, &frame, &kind);
+    pos[1] = 0;
+    ch->pred.enabled = true;
+    prediction_reconcile(&ch->pred, snap->input_seq, pos);
+}
+
 /* data is struct scene */
 static int character_update(struct entity3d *e, void *data)
 {
@@ -356,6 +432,9 @@ static int character_update(struct entity3d *e, void *data)
         s->camera->ch->moved++;
     }
 
+    if (c->pred.enabled && s->control == c)
+        character_predict(c, s);
+
     /* XXX "wow out" */
     if (e->dy <= s->limbo_height) {
         entity3d_position(e, e->dx, -e->dy, e->dz);
@@ -7,6 +7,7 @@
 #include "messagebus.h"
 #include "model.h"
 #include "physics.h"
+#include "prediction.h"
 #include "scene.h"
 
 struct motionctl {
@@ -31,6 +32,8 @@ struct motionctl {
     bool    jump;
 };
 
+struct snapshot;
+
 struct character {
     struct ref  ref;
     struct entity3d *entity;
@@ -50,6 +53,8 @@ struct character {
     float   pitch_turn;
     struct list entry;
     struct anictl anictl;
+    /* the controlled one, once the server has a say, see character_reconcile() */
+    struct prediction pred;
     int     moved;
     int     ragdoll;
     int     stuck;
@@ -69,5 +74,7 @@ struct character *character_new(struct model3dtx *txm, struct scene *s);
 void character_handle_input(struct character *ch, struct scene *s, struct message *m);
 bool character_is_grounded(struct character *ch, struct scene *s);
 void character_move(struct character *ch, struct scene *s);
+/* a snapshot from the server: correct the predicted position */
+void character_reconcile(struct character *ch, const struct snapshot *snap);
 
 #endif /* __CLAP_CHARACTER_H__ */
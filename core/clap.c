@@ -3,16 +3,21 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <time.h>
 #include "clap.h"
 #include "common.h"
 #include "input.h"
+#include "input-record.h"
 #include "font.h"
+#include "jobs.h"
+#include "profiler.h"
 #include "sound.h"
 #include "messagebus.h"
 #include "librarian.h"
 #include "physics.h"
+#include "render.h"
 #include "settings.h"
 #include "util.h"
 
@@ -44,32 +49,155 @@ struct clap_context {
     int                 argc;
 };
 
+/*
+ * Startup timeline: what clap_init() spent its time on, the phases that
+ * ran on the jobs overlapping with the rest, see startup_print(); and
+ * then how long it took to the first frame
+ */
+#define STARTUP_PHASES_MAX  16
+
+static struct startup_phase {
+    const char      *name;
+    struct timespec start;
+    struct timespec end;
+} startup_phases[STARTUP_PHASES_MAX];
+static atomic_uint nr_startup_phases;
+static struct timespec startup_ts;
+
+static struct startup_phase *startup_phase_begin(const char *name)
+{
+    unsigned int idx = atomic_fetch_add(&nr_startup_phases, 1);
+    struct startup_phase *sp;
+
+    if (idx >= STARTUP_PHASES_MAX)
+        return NULL;
+
+    sp = &startup_phases[idx];
+    sp->name = name;
+    clock_gettime(CLOCK_MONOTONIC, &sp->start);
+
+    return sp;
+}
+
+static void startup_phase_end(struct startup_phase *sp)
+{
+    if (sp)
+        clock_gettime(CLOCK_MONOTONIC, &sp->end);
+}
+
+static double startup_ms(struct timespec *from, struct timespec *to)
+{
+    struct timespec diff;
+
+    timespec_diff(from, to, &diff);
+    return diff.tv_sec * 1000.0 + diff.tv_nsec / 1000000.0;
+}
+
+static void startup_print(void)
+{
+    unsigned int i, nr = min(atomic_load(&nr_startup_phases), STARTUP_PHASES_MAX);
+    struct startup_phase *sp;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < nr; i++) {
+        sp = &startup_phases[i];
+        msg("startup: %-10s +%7.1fms %7.1fms\n", sp->name, startup_ms(&startup_ts, &sp->start),
+            startup_ms(&sp->start, &sp->end));
+    }
+    msg("startup: done in %.1fms\n", startup_ms(&startup_ts, &now));
+}
+
+/*
+ * The subsystems that don't care which thread brings them up; fonts only
+ * load their faces here, their atlases wait for the GL context
+ */
+static void font_init_job(void *data)
+{
+    struct startup_phase *sp = startup_phase_begin("font");
+
+    font_init();
+    startup_phase_end(sp);
+}
+
+static void sound_init_job(void *data)
+{
+    struct startup_phase *sp = startup_phase_begin("sound");
+
+    sound_init();
+    startup_phase_end(sp);
+}
+
+static void startup_job(job_run_fn fn, struct job_counter *counter)
+{
+    /* with no workers, they run right here */
+    if (jobs_submit(fn, NULL, counter))
+        fn(NULL);
+}
+
+static void frame_stats_get(struct frame_stats *fs, struct histogram *h)
+{
+    fs->p50 = histogram_percentile(h, 50);
+    fs->p95 = histogram_percentile(h, 95);
+    fs->p99 = histogram_percentile(h, 99);
+    fs->max = h->max;
+}
+
 void clap_fps_calc(struct fps_data *f)
 {
+    struct mem_stats cpu, gpu;
     bool status = false;
     struct timespec ts;
     struct message m;
+    uint64_t us;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
     timespec_diff(&f->ts_prev, &ts, &f->ts_delta);
+    input_record_frame();
+    /* the first frame has nothing to measure against */
+    if (timespec_nonzero(&f->ts_prev)) {
+        us = (uint64_t)f->ts_delta.tv_sec * 1000000 + f->ts_delta.tv_nsec / 1000;
+        histogram_add(&f->second_hist, us);
+        histogram_add(&f->session_hist, us);
+    } else if (timespec_nonzero(&startup_ts)) {
+        msg("startup: first frame at %.1fms\n", startup_ms(&startup_ts, &ts));
+    }
     memcpy(&f->ts_prev, &ts, sizeof(ts));
+    /* once a frame is as good a place as any */
+    textures_evict();
+    textures_upload(TEXTURE_UPLOAD_BUDGET);
+    render_stream_advance();
+    sound_update();
 
     if (f->seconds != ts.tv_sec) {
         f->fps_coarse = f->count;
         f->count      = 0;
         f->seconds    = ts.tv_sec;
         status        = true;
+
+        memset(&m, 0, sizeof(m));
+        frame_stats_get(&m.cmd.frame_time, &f->second_hist);
+        frame_stats_get(&m.cmd.session_frame_time, &f->session_hist);
+        histogram_reset(&f->second_hist);
+
+        mem_stats_total(&cpu, &gpu);
+        m.cmd.mem_live     = cpu.live;
+        m.cmd.mem_peak     = cpu.peak;
+        m.cmd.gpu_mem_live = gpu.live;
+        m.cmd.gpu_mem_peak = gpu.peak;
     }
     f->count += 1;//f->ts_delta.tv_nsec / (1000000000/60);
 
-    if (f->ts_delta.tv_sec) {
+    if (bench_active()) {
+        /* the simulation runs at a fixed rate, see bench_frame_begin() */
+        f->fps_fine = BENCH_RATE;
+    } else if (f->ts_delta.tv_sec) {
         f->fps_fine = 1;
     } else {
         f->fps_fine = 1000000000 / f->ts_delta.tv_nsec;
     }
 
     if (status) {
-        memset(&m, 0, sizeof(m));
         m.type            = MT_COMMAND;
         m.cmd.status      = 1;
         m.cmd.fps         = f->fps_fine;//f->fps_coarse;
@@ -107,6 +235,8 @@ int clap_restart(struct clap_context *ctx)
 struct clap_context *clap_init(struct clap_config *cfg, int argc, char **argv, char **envp)
 {
     unsigned int log_flags = LOG_DEFAULT;
+    struct startup_phase *sp;
+    struct job_counter startup;
     struct clap_context *ctx;
 
     if (cfg && !clap_config_is_valid(cfg))
@@ -130,31 +260,85 @@ struct clap_context *clap_init(struct clap_config *cfg, int argc, char **argv, c
     ctx->argv = argv;
     ctx->envp = envp;
 
+    clock_gettime(CLOCK_MONOTONIC, &startup_ts);
+    sp = startup_phase_begin("log");
     log_init(log_flags);
+    startup_phase_end(sp);
+
+    sp = startup_phase_begin("jobs");
+    (void)jobs_init(0);
     (void)librarian_init(ctx->cfg.base_url);
+    startup_phase_end(sp);
+
+    /* a replay is a benchmark that runs for as long as the recording */
+    if (ctx->cfg.replay) {
+        int nr_frames = input_replay_start(ctx->cfg.replay);
+
+        if (nr_frames > 0 && !ctx->cfg.bench.frames)
+            ctx->cfg.bench.frames = nr_frames;
+    }
+    if (ctx->cfg.record)
+        (void)input_record_start(ctx->cfg.record, time(NULL));
+
+    /*
+     * These go on the jobs while the main thread brings up the display,
+     * which has to be on the main thread; ODE wants its per-thread data on
+     * the thread that uses it, and the browser's OpenAL is on the main
+     * thread, so those two stay
+     */
+    job_counter_init(&startup);
     if (ctx->cfg.font)
-        font_init();
+        startup_job(font_init_job, &startup);
+#ifndef CONFIG_BROWSER
     if (ctx->cfg.sound)
-        sound_init();
-    if (ctx->cfg.phys)
-        phys_init();
-    if (ctx->cfg.graphics)
+        startup_job(sound_init_job, &startup);
+#else
+    if (ctx->cfg.sound)
+        sound_init_job(NULL);
+#endif
+    if (ctx->cfg.phys) {
+        sp = startup_phase_begin("phys");
+        phys_init(ctx->cfg.phys_rate, ctx->cfg.phys_max_substeps);
+        startup_phase_end(sp);
+    }
+    if (ctx->cfg.graphics) {
+        sp = startup_phase_begin("display");
         gl_init(ctx->cfg.title, ctx->cfg.width, ctx->cfg.height,
-                ctx->cfg.frame_cb, ctx->cfg.callback_data, ctx->cfg.resize_cb);
-    if (ctx->cfg.input)
+                ctx->cfg.frame_cb, ctx->cfg.callback_data, ctx->cfg.resize_cb,
+                !!ctx->cfg.bench.frames);
+        prof_init();
+        bench_init(&ctx->cfg.bench, ctx->cfg.width, ctx->cfg.height);
+        textures_set_budget(ctx->cfg.texture_budget);
+        startup_phase_end(sp);
+    }
+    if (ctx->cfg.input) {
+        sp = startup_phase_begin("input");
         (void)input_init(); /* XXX: error handling */
+        startup_phase_end(sp);
+    }
     //clap_settings = settings_init();
 
+    jobs_wait(&startup);
+    startup_print();
+
     return ctx;
 }
 
 void clap_done(struct clap_context *ctx, int status)
 {
+    input_record_stop();
+    input_replay_stop();
     if (ctx->cfg.sound)
         sound_done();
     if (ctx->cfg.phys)
         phys_done();
-    if (ctx->cfg.graphics)
+    if (ctx->cfg.graphics) {
+        if (ctx->cfg.profile)
+            prof_export(ctx->cfg.profile);
+        prof_done();
+        render_stream_done();
         gl_done();
+    }
+    jobs_done();
     exit_cleanup_run(status);
 }
@@ -2,9 +2,15 @@
 #ifndef __CLAP_CLAP_H__
 #define __CLAP_CLAP_H__
 
+#include <time.h>
+#include "bench.h"
+#include "histogram.h"
+
 struct fps_data {
     struct timespec ts_prev, ts_delta;
     unsigned long   fps_fine, fps_coarse, seconds, count;
+    /* frame times in microseconds: this second's and the whole session's */
+    struct histogram    second_hist, session_hist;
 };
 
 void clap_fps_calc(struct fps_data *f);
@@ -24,6 +30,18 @@ struct clap_config {
     void            (*frame_cb)(void *data);
     void            (*resize_cb)(void *data, int width, int height);
     void            *callback_data;
+    /* physics steps per second and per frame at most, 0 for defaults */
+    unsigned int    phys_rate;
+    unsigned int    phys_max_substeps;
+    /* write a Chrome trace of the last frames here on exit, see profiler.h */
+    const char      *profile;
+    /* headless benchmark, if .frames, see bench.h */
+    struct bench_config bench;
+    /* write the input to / play it back from here, see input-record.h */
+    const char      *record;
+    const char      *replay;
+    /* bytes of textures to keep resident, 0 for no limit, see render.h */
+    size_t          texture_budget;
 };
 
 struct clap_context;
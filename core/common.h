@@ -6,6 +6,10 @@
 #ifdef CONFIG_BROWSER
 #include <emscripten.h>
 #include <emscripten/html5.h>
+#ifdef CONFIG_BROWSER_WORKER
+#include <pthread.h>
+#include <emscripten/threading.h>
+#endif /* CONFIG_BROWSER_WORKER */
 #else
 #define EMSCRIPTEN_KEEPALIVE
 #define EM_ASM(x)
@@ -18,6 +18,8 @@ static int width, height;
 static display_update update_fn;
 static display_resize resize_fn;
 static void *update_fn_data;
+static bool headless;
+static GLuint headless_fbo, headless_rb[2];
 
 bool gl_does_vao(void)
 {
@@ -28,9 +30,27 @@ bool gl_does_vao(void)
 #endif
 }
 
+bool gl_does_vertex_textures(void)
+{
+#ifdef CONFIG_GLES
+    return false;
+#else
+    GLint units = 0;
+
+    glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS, &units);
+    return units > 0;
+#endif
+}
+
 int gl_refresh_rate(void)
 {
-    GLFWmonitor *monitor = glfwGetWindowMonitor(window);
+    GLFWmonitor *monitor;
+
+    /* nothing to sync to */
+    if (headless)
+        return 60;
+
+    monitor = glfwGetWindowMonitor(window);
 
     if (!monitor)
         monitor = glfwGetPrimaryMonitor();
@@ -87,6 +107,9 @@ static int                saved_width, saved_height;
 
 void gl_enter_fullscreen(void)
 {
+    if (headless)
+        return;
+
     glfwSetWindowMonitor(window, primary_monitor, 0, 0, 
                          primary_monitor_mode->width,
                          primary_monitor_mode->height,
@@ -99,11 +122,65 @@ void gl_enter_fullscreen(void)
 
 void gl_leave_fullscreen(void)
 {
+    if (headless)
+        return;
+
     glfwSetWindowMonitor(window, NULL, 0, 0, saved_width, saved_height, 0);
     gl_resize(saved_width, saved_height);
 }
 
-void gl_init(const char *title, int w, int h, display_update update, void *update_data, display_resize resize)
+unsigned int gl_screen_fbo(void)
+{
+    return headless_fbo;
+}
+
+static void headless_error_cb(int error, const char *desc)
+{
+    dbg("glfw error %d: '%s'\n", error, desc);
+}
+
+/*
+ * An invisible window for the context: on the null platform (GLFW 3.4+)
+ * that doesn't need a display server, and the context is EGL surfaceless
+ * or OSMesa, whichever works.
+ */
+static GLFWwindow *headless_window(const char *title)
+{
+    static const int apis[] = { GLFW_EGL_CONTEXT_API, GLFW_OSMESA_CONTEXT_API, GLFW_NATIVE_CONTEXT_API };
+    GLFWwindow *win = NULL;
+    int i;
+
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    glfwSetErrorCallback(headless_error_cb);
+    for (i = 0; i < array_size(apis) && !win; i++) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, apis[i]);
+        win = glfwCreateWindow(width, height, title, NULL, NULL);
+    }
+    glfwSetErrorCallback(error_cb);
+
+    return win;
+}
+
+/* surfaceless contexts don't have a default framebuffer, this is it */
+static void headless_fbo_init(void)
+{
+    GL(glGenFramebuffers(1, &headless_fbo));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, headless_fbo));
+    GL(glGenRenderbuffers(2, headless_rb));
+    GL(glBindRenderbuffer(GL_RENDERBUFFER, headless_rb[0]));
+    GL(glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height));
+    GL(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless_rb[0]));
+    GL(glBindRenderbuffer(GL_RENDERBUFFER, headless_rb[1]));
+    GL(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height));
+    GL(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless_rb[1]));
+    GL(glBindRenderbuffer(GL_RENDERBUFFER, 0));
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        err("headless framebuffer is incomplete\n");
+    GL(glViewport(0, 0, width, height));
+}
+
+void gl_init(const char *title, int w, int h, display_update update, void *update_data, display_resize resize,
+             bool _headless)
 {
     const unsigned char *ext, *vendor, *renderer, *glver, *shlangver;
     GLint nr_exts;
@@ -115,13 +192,20 @@ void gl_init(const char *title, int w, int h, display_update update, void *updat
     update_fn = update;
     update_fn_data = update_data;
     resize_fn = resize;
+    headless = _headless;
 
+#ifdef GLFW_PLATFORM_NULL
+    if (headless && glfwPlatformSupported(GLFW_PLATFORM_NULL))
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
     if (!glfwInit()) {
         err("failed to initialize GLFW\n");
         return;
     }
-    primary_monitor = glfwGetPrimaryMonitor();
-    primary_monitor_mode = glfwGetVideoMode(primary_monitor);
+    if (!headless) {
+        primary_monitor = glfwGetPrimaryMonitor();
+        primary_monitor_mode = glfwGetVideoMode(primary_monitor);
+    }
 
     glfwSetErrorCallback(error_cb);
     glfwWindowHint(GLFW_SAMPLES, 4);
@@ -136,7 +220,10 @@ void gl_init(const char *title, int w, int h, display_update update, void *updat
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
-    window = glfwCreateWindow(width, height, title, NULL, NULL);
+    if (headless)
+        window = headless_window(title);
+    else
+        window = glfwCreateWindow(width, height, title, NULL, NULL);
     if (!window) {
         err("failed to create GLFW window\n");
         return;
@@ -146,15 +233,22 @@ void gl_init(const char *title, int w, int h, display_update update, void *updat
     glfwMakeContextCurrent(window);
     glewExperimental = GL_TRUE;
     ret = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    /* GL entry points are all there, it's GLX that isn't */
+    if (headless && ret == GLEW_ERROR_NO_GLX_DISPLAY)
+        ret = GLEW_OK;
+#endif
     if (ret != GLEW_OK) {
         err("failed to initialize GLEW: %s\n", glewGetErrorString(ret));
         return;
     }
-    if (glfwExtensionSupported("WGL_EXT_swap_control_tear") ||
-        glfwExtensionSupported("GLX_EXT_swap_control_tear"))
-        glfwSwapInterval(-1);
-    else
-        glfwSwapInterval(1);
+    if (!headless) {
+        if (glfwExtensionSupported("WGL_EXT_swap_control_tear") ||
+            glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+            glfwSwapInterval(-1);
+        else
+            glfwSwapInterval(1);
+    }
 
     vendor    = glGetString(GL_VENDOR);
     renderer  = glGetString(GL_RENDERER);
@@ -167,6 +261,9 @@ void gl_init(const char *title, int w, int h, display_update update, void *updat
         ext = glGetStringi(GL_EXTENSIONS, i);
         msg("GL extension: '%s'\n", ext);
     }
+
+    if (headless)
+        headless_fbo_init();
     // msg("GL initialized extensions: %s\n", exts);
 }
 
@@ -175,15 +272,34 @@ void gl_request_exit(void)
     glfwSetWindowShouldClose(window, GLFW_TRUE);
 }
 
+static void glfw_input_poll(void);
+
+/* between the frames, input gets sampled at most this often */
+#define INPUT_POLL_NS   1000000
+
+static struct timespec input_polled;
+
 void gl_main_loop(void)
 {
+    struct timespec now, diff;
+
     while (!glfwWindowShouldClose(window)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timespec_diff(&input_polled, &now, &diff);
+        if (diff.tv_sec || diff.tv_nsec >= INPUT_POLL_NS)
+            glfw_input_poll();
+
         update_fn(update_fn_data);
     }
 }
 
 void gl_done(void)
 {
+    if (headless_fbo) {
+        GL(glDeleteFramebuffers(1, &headless_fbo));
+        GL(glDeleteRenderbuffers(2, headless_rb));
+        headless_fbo = 0;
+    }
     glfwDestroyWindow(window);
     glfwTerminate();
 }
@@ -313,9 +429,17 @@ int platform_input_init(void)
 
 void gl_swap_buffers(void)
 {
-    glfwSwapBuffers(window);
+    /* nothing to present */
+    if (!headless)
+        glfwSwapBuffers(window);
+    librarian_poll(LIB_POLL_BUDGET_US);
+    glfw_input_poll();
+}
+
+static void glfw_input_poll(void)
+{
     glfwPollEvents();
-    /* XXX: move to the start of frame code? */
     glfw_joysticks_poll();
     joysticks_poll();
+    clock_gettime(CLOCK_MONOTONIC, &input_polled);
 }
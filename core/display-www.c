@@ -6,7 +6,9 @@
 #include <EGL/egl.h>
 #include "common.h"
 #include "display.h"
+#include "input.h"
 #include "input-joystick.h"
+#include "librarian.h"
 
 static int width, height;
 
@@ -15,6 +17,12 @@ bool gl_does_vao(void)
     return false;
 }
 
+/* WebGL1 has no R32F */
+bool gl_does_vertex_textures(void)
+{
+    return false;
+}
+
 static int refresh_rate = 0;
 
 int gl_refresh_rate(void)
@@ -83,12 +91,13 @@ void gl_title(const char *fmt, ...)
     va_start(va, fmt);
     vasprintf(&title, fmt, va);
     va_end(va);
-    EM_ASM(document.title = UTF8ToString($0);, title);
+    MAIN_THREAD_EM_ASM(document.title = UTF8ToString($0);, title);
 }
 
 void gl_get_sizes(int *widthp, int *heightp)
 {
-    EM_ASM(window.onresize(););
+    /* on a worker, this comes back with the sizes already in place */
+    MAIN_THREAD_EM_ASM(window.onresize(););
 
     if (widthp)
         *widthp = width;
@@ -103,8 +112,33 @@ void gl_main_loop(void)
 static display_resize resize_fn;
 static void *callback_data;
 
+#ifdef CONFIG_BROWSER_WORKER
+static struct message_source resize_source = {
+    .name   = "resize",
+    .desc   = "canvas resize",
+    .type   = MST_KEYBOARD,
+};
+#endif /* CONFIG_BROWSER_WORKER */
+
+/*
+ * The page calls this on its own thread; with the GL context on a worker,
+ * it becomes a resize message that calls back here from the worker's
+ * messagebus, which is where the OffscreenCanvas can be resized
+ */
 EMSCRIPTEN_KEEPALIVE void gl_resize(int w, int h)
 {
+#ifdef CONFIG_BROWSER_WORKER
+    if (emscripten_is_main_browser_thread()) {
+        struct message_input mi = { .resize = 1, .x = w, .y = h };
+
+        width = w;
+        height = h;
+        message_input_send(&mi, &resize_source);
+        return;
+    }
+
+    emscripten_set_canvas_element_size("#canvas", w, h);
+#endif /* CONFIG_BROWSER_WORKER */
     resize_fn(callback_data, w, h);
     width = w;
     height = h;
@@ -115,6 +149,7 @@ extern void www_touch_poll(void);
 void gl_swap_buffers(void)
 {
     emscripten_webgl_commit_frame();
+    librarian_poll(LIB_POLL_BUDGET_US);
     www_joysticks_poll();
     www_touch_poll();
     joysticks_poll();
@@ -130,7 +165,14 @@ void gl_leave_fullscreen(void)
     emscripten_exit_fullscreen();
 }
 
-void gl_init(const char *title, int width, int height, display_update update_fn, void *data, display_resize rfn)
+unsigned int gl_screen_fbo(void)
+{
+    return 0;
+}
+
+/* there's always a canvas, @headless doesn't apply */
+void gl_init(const char *title, int width, int height, display_update update_fn, void *data, display_resize rfn,
+             bool headless)
 {
     EmscriptenWebGLContextAttributes attr;
     const unsigned char *exts;
@@ -147,13 +189,18 @@ void gl_init(const char *title, int width, int height, display_update update_fn,
     attr.majorVersion              = 2;
     attr.minorVersion              = 0;
     attr.enableExtensionsByDefault = 1;
-    
+#ifdef CONFIG_BROWSER_WORKER
+    /* the canvas has been transferred to this thread, draw on it directly */
+    attr.proxyContextToMainThread  = EMSCRIPTEN_WEBGL_CONTEXT_PROXY_DISALLOW;
+    attr.renderViaOffscreenBackBuffer = 0;
+#endif /* CONFIG_BROWSER_WORKER */
+
     context = emscripten_webgl_create_context("#canvas", &attr);
 
     emscripten_webgl_make_context_current(context);
     exts = glGetString(GL_EXTENSIONS);
     msg("GL context: %d Extensions: '%s'\n", context, exts);
-    EM_ASM(runtime_ready = true;);
+    MAIN_THREAD_EM_ASM(runtime_ready = true;);
     gl_get_sizes(NULL, NULL);
     calc_refresh_rate(update_fn, data);
     //resize_fn(width, height);
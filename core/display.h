@@ -15,7 +15,9 @@
 
 typedef void (*display_update)(void *data);
 typedef void (*display_resize)(void *data, int w, int h);
-void gl_init(const char *title, int width, int height, display_update update_fn, void *update_fn_data, display_resize resize_fn);
+/* @headless: no window, render into an offscreen framebuffer, see gl_screen_fbo() */
+void gl_init(const char *title, int width, int height, display_update update_fn, void *update_fn_data,
+             display_resize resize_fn, bool headless);
 int gl_refresh_rate(void);
 void gl_main_loop(void);
 void gl_done(void);
@@ -27,5 +29,9 @@ void gl_resize(int w, int h);
 void gl_enter_fullscreen(void);
 void gl_leave_fullscreen(void);
 bool gl_does_vao(void);
+/* vertex shaders can sample (float) textures */
+bool gl_does_vertex_textures(void);
+/* what stands for the screen: 0, or the offscreen framebuffer when headless */
+unsigned int gl_screen_fbo(void);
 
 #endif /* __CLAP_DISPLAY_H__ */
\ No newline at end of file
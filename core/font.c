@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include "common.h"
 #include "logger.h"
@@ -11,10 +12,28 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+/*
+ * All glyphs of a font live in one texture, packed in shelves: rows as
+ * tall as their tallest glyph, filled left to right. Glyphs go in as they
+ * are first asked for and stay until the font is dropped. font_open()
+ * doesn't touch GL, so it can run on a job; the atlas is made on the GL
+ * thread when it's first needed.
+ */
+#define ATLAS_MIN   256
+#define ATLAS_MAX   2048
+/* between glyphs, so that linear filtering doesn't pick up the neighbours */
+#define ATLAS_PAD   1
+
 struct font {
     char *       name;
     FT_Face      face;
     struct glyph g[256];
+    texture_t    atlas;
+    unsigned int size;
+    unsigned int atlas_size;
+    unsigned int shelf_x;
+    unsigned int shelf_y;
+    unsigned int shelf_h;
     struct ref   ref;
 };
 
@@ -26,10 +45,57 @@ const char *font_name(struct font *font)
     return font->name;
 }
 
+/* 16x16 glyph cells of the nominal size should do for the 8 bits we have */
+static void font_atlas_init(struct font *font, unsigned int size)
+{
+    LOCAL(uchar, buf);
+
+    if (font->atlas_size)
+        return;
+
+    for (font->atlas_size = ATLAS_MIN;
+         font->atlas_size < size * 16 && font->atlas_size < ATLAS_MAX;
+         font->atlas_size *= 2)
+        ;
+
+    /* the gaps between the glyphs have to be transparent */
+    CHECK(buf = calloc(1, font->atlas_size * font->atlas_size * 4));
+    texture_init(&font->atlas);
+    texture_load(&font->atlas, GL_RGBA, font->atlas_size, font->atlas_size, buf);
+    font->shelf_x = font->shelf_y = ATLAS_PAD;
+    font->shelf_h = 0;
+}
+
+/* find a spot for a @width x @height glyph, or -ENOSPC */
+static int font_atlas_alloc(struct font *font, unsigned int width, unsigned int height,
+                            unsigned int *px, unsigned int *py)
+{
+    if (width + ATLAS_PAD * 2 > font->atlas_size)
+        return -ENOSPC;
+
+    if (font->shelf_x + width + ATLAS_PAD > font->atlas_size) {
+        /* next shelf */
+        font->shelf_y += font->shelf_h + ATLAS_PAD;
+        font->shelf_x = ATLAS_PAD;
+        font->shelf_h = 0;
+    }
+
+    if (font->shelf_y + height + ATLAS_PAD > font->atlas_size)
+        return -ENOSPC;
+
+    *px = font->shelf_x;
+    *py = font->shelf_y;
+    font->shelf_x += width + ATLAS_PAD;
+    font->shelf_h = max(font->shelf_h, height);
+
+    return 0;
+}
+
 static void font_load_glyph(struct font *font, unsigned char c)
 {
+    struct glyph *g = &font->g[c];
+    unsigned int x, y, ax = 0, ay = 0;
     FT_GlyphSlot glyph;
-    unsigned int x, y;
     LOCAL(uchar, buf);
 
     if (FT_Load_Char(font->face, c, FT_LOAD_RENDER)) {
@@ -41,10 +107,26 @@ static void font_load_glyph(struct font *font, unsigned char c)
 #define _AT(_x, _y, _c) ((_y) * glyph->bitmap.width * RGBA_SZ + (_x) * RGBA_SZ + (_c))
 #define _GAT(_x, _y) ((_y) * glyph->bitmap.width + (_x))
     glyph = font->face->glyph;
-    font->g[c].width = glyph->bitmap.width;
-    font->g[c].height = glyph->bitmap.rows;
+    g->width = glyph->bitmap.width;
+    g->height = glyph->bitmap.rows;
+    g->advance_x = glyph->advance.x;
+    g->advance_y = glyph->advance.y;
+    g->bearing_x = glyph->bitmap_left;
+    g->bearing_y = glyph->bitmap_top;
+    g->loaded    = true;
     //dbg("glyph '%c': %ux%u\n", c, glyph->bitmap.width, glyph->bitmap.rows);
     //hexdump(glyph->bitmap.buffer, glyph->bitmap.width * glyph->bitmap.rows);
+
+    /* whitespace has no bitmap, but its metrics are still good */
+    if (!g->width || !g->height)
+        return;
+
+    if (font_atlas_alloc(font, g->width, g->height, &ax, &ay)) {
+        err("glyph atlas of '%s' is full, dropping '%c'\n", font->name, c);
+        g->width = g->height = 0;
+        return;
+    }
+
     buf = calloc(1, glyph->bitmap.width * glyph->bitmap.rows * RGBA_SZ);
     for (y = 0; y < glyph->bitmap.rows; y++) {
         for (x = 0; x < glyph->bitmap.width; x++) {
@@ -59,23 +141,21 @@ static void font_load_glyph(struct font *font, unsigned char c)
     }
 #undef _AT
 #undef _GAT
-    texture_init(&font->g[c].tex);
-    texture_load(&font->g[c].tex, GL_RGBA, glyph->bitmap.width, glyph->bitmap.rows, buf);
-
-    font->g[c].advance_x = glyph->advance.x;
-    font->g[c].advance_y = glyph->advance.y;
-    font->g[c].bearing_x = glyph->bitmap_left;
-    font->g[c].bearing_y = glyph->bitmap_top;
-    font->g[c].loaded    = true;
+    texture_update(&font->atlas, ax, ay, g->width, g->height, buf);
+
+    /* the bitmap's first row is the glyph's top */
+    g->u0 = (float)ax / font->atlas_size;
+    g->v0 = (float)ay / font->atlas_size;
+    g->u1 = (float)(ax + g->width) / font->atlas_size;
+    g->v1 = (float)(ay + g->height) / font->atlas_size;
 }
 
 static void font_drop(struct ref *ref)
 {
     struct font *font = container_of(ref, struct font, ref);
-    unsigned int i;
 
-    for (i = 0; i < array_size(font->g); i++)
-        texture_deinit(&font->g[i].tex);
+    if (font->atlas_size)
+        texture_deinit(&font->atlas);
     free(font->name);
 }
 
@@ -94,18 +174,18 @@ struct font *font_get_default(void)
     return font_get(default_font);
 }
 
-GLuint font_get_texture(struct font *font, unsigned char c)
+texture_t *font_get_texture(struct font *font)
 {
-    if (!font->g[c].loaded)
-        font_load_glyph(font, c);
-
-    return texture_id(&font->g[c].tex);
+    font_atlas_init(font, font->size);
+    return &font->atlas;
 }
 
 struct glyph *font_get_glyph(struct font *font, unsigned char c)
 {
-    if (!font->g[c].loaded)
+    if (!font->g[c].loaded) {
+        font_atlas_init(font, font->size);
         font_load_glyph(font, c);
+    }
 
     return &font->g[c];
 }
@@ -129,6 +209,7 @@ struct font *font_open(const char *name, unsigned int size)
     CHECK(asprintf(&font->name, "%s:%u", font_name, size));
     font->face = face;
     FT_Set_Pixel_Sizes(font->face, size, size);
+    font->size = size;
     //for (c = 32; c < 128; c++)
     //    font_load_glyph(font, c);
 
@@ -5,8 +5,9 @@
 #include "render.h"
 
 struct glyph {
-    // GLuint  texture_id;
-    texture_t       tex;
+    /* where it is in font_get_texture() */
+    float   u0, v0;
+    float   u1, v1;
     unsigned int width;
     unsigned int height;
     int     bearing_x;
@@ -23,7 +24,7 @@ struct font *font_open(const char *name, unsigned int size);
 void         font_put(struct font *font);
 struct font *font_get(struct font *font);
 struct font *font_get_default(void);
-GLuint font_get_texture(struct font *font, unsigned char c);
+texture_t *font_get_texture(struct font *font);
 struct glyph *font_get_glyph(struct font *font, unsigned char c);
 
 #endif /* __CLAP_FONT_H__ */
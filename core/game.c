@@ -7,6 +7,9 @@
 
 extern struct game_state game_state;
 
+/* items picked up in one update, at most */
+#define GAME_GATHER_MAX 4
+
 struct game_options game_options_init() {
     struct game_options options;
     options.max_age_ms[GAME_ITEM_APPLE] = 20000.0;
@@ -143,6 +146,7 @@ void place_apple(struct scene *s, struct entity3d *tree, struct entity3d *apple)
     apple->dx = tree->dx + 1.0 * cos(angle);
     apple->dz = tree->dz + 1.0 * sin(angle);
     apple->dy = terrain_height(s->terrain, apple->dx, apple->dz);
+    entity3d_dirty(apple);
 }
 
 static const char *game_item_str(struct game_item *item)
@@ -193,6 +197,17 @@ int game_item_find_idx(struct game_state *g, struct game_item *item)
     return -1;
 }
 
+struct game_item *game_item_find_by_entity(struct game_state *g, struct entity3d *e)
+{
+    int i;
+
+    for (i = 0; i < g->items.da.nr_el; i++)
+        if (g->items.x[i].entity == e)
+            return &g->items.x[i];
+
+    return NULL;
+}
+
 void game_item_delete_idx(struct game_state *g, int idx)
 {
     struct game_item *item = &g->items.x[idx];
@@ -352,15 +367,21 @@ void game_update(struct game_state *g, struct timespec ts, bool paused)
             continue;
         }
 
-        float squared_distance = calculate_squared_distance(item->entity, gatherer);
-        bool gathered = false;
-        if (squared_distance < g->options.gathering_distance_squared) {
-            if (item->interact)
-                item->interact(g, item, gatherer);
-        }
         idx++;
     }
 
+    /* interact() may delete them, so not from inside the query */
+    struct bvh_hit hits[GAME_GATHER_MAX];
+    int i, nr_hits;
+
+    nr_hits = mq_query_nearest(&g->scene->mq, &gatherer->dx, sqrtf(g->options.gathering_distance_squared),
+                               GAME_TAG_ITEM, hits, array_size(hits));
+    for (i = 0; i < nr_hits; i++) {
+        item = game_item_find_by_entity(g, hits[i].data);
+        if (item && item->interact)
+            item->interact(g, item, gatherer);
+    }
+
     burrow_update(&g->burrow, delta_t_ms, &g->options);
     
     float updated_next_spawn_time = g->next_spawn_time - delta_t_ms;
@@ -379,8 +400,8 @@ void game_update(struct game_state *g, struct timespec ts, bool paused)
 void find_trees(struct entity3d *e, void *data)
 {
     struct game_state *g = data;
-    const char* name = entity_name(e);
-    if (!strcmp(name, "tree") || !strcmp(name, "cool tree") || !strcmp(name, "spruce tree")) {
+
+    if (e->txmodel->model->tags & GAME_TAG_TREE) {
         // insert tree into the list of free trees.
         struct free_tree *new_tree = malloc(sizeof(struct free_tree));
         new_tree->entity = e;
@@ -389,6 +410,31 @@ void find_trees(struct entity3d *e, void *data)
     }
 }
 
+/* once per model, instead of comparing names per entity */
+static void game_tag_models(struct game_state *g, struct scene *scene)
+{
+    struct model3dtx *txmodel;
+
+    list_for_each_entry(txmodel, &scene->mq.txmodels, entry) {
+        const char *name = txmodel->model->name;
+
+        if (!strcmp(name, "tree") || !strcmp(name, "cool tree") || !strcmp(name, "spruce tree"))
+            txmodel->model->tags |= GAME_TAG_TREE;
+        if (!strcmp(name, "apple")) {
+            txmodel->model->tags |= GAME_TAG_ITEM;
+            g->txmodel[GAME_ITEM_APPLE] = txmodel;
+        }
+        if (!strcmp(name, "mushroom")) {
+            txmodel->model->tags |= GAME_TAG_ITEM;
+            g->txmodel[GAME_ITEM_MUSHROOM] = txmodel;
+        }
+        if (!strcmp(name, "fantasy well")) {
+            txmodel->model->tags |= GAME_TAG_BURROW;
+            g->burrow.entity = list_first_entry(&txmodel->entities, struct entity3d, entry);
+        }
+    }
+}
+
 struct burrow burrow_init() {
     struct burrow b;
     darray_init(&b.items);
@@ -406,17 +452,6 @@ void game_init(struct scene *scene, struct ui *ui)
     game_state.burrow = burrow_init();
     darray_init(&game_state.items);
     list_init(&game_state.free_trees);
+    game_tag_models(&game_state, scene);
     mq_for_each(&scene->mq, find_trees, &game_state);
-    struct model3dtx *txmodel;
-
-    // find apple
-    list_for_each_entry(txmodel, &scene->mq.txmodels, entry) {
-        if (!strcmp(txmodel->model->name, "apple"))
-            game_state.txmodel[GAME_ITEM_APPLE] = txmodel;
-        if (!strcmp(txmodel->model->name, "mushroom"))
-            game_state.txmodel[GAME_ITEM_MUSHROOM] = txmodel;
-        if (!strcmp(txmodel->model->name, "fantasy well")) {
-            game_state.burrow.entity = list_first_entry(&txmodel->entities, struct entity3d, entry);
-        }
-    }
 }
@@ -19,6 +19,13 @@ enum game_item_kind {
     GAME_ITEM_MAX,
 };
 
+/* model3d::tags, for mq_query_radius() and friends */
+enum game_tag {
+    GAME_TAG_TREE   = 1ul << 0,
+    GAME_TAG_ITEM   = 1ul << 1,
+    GAME_TAG_BURROW = 1ul << 2,
+};
+
 struct game_options {
     float max_age_ms[GAME_ITEM_MAX];
     float apple_maturity_age_ms;
@@ -80,6 +87,7 @@ struct game_item *game_item_new(struct game_state *g, enum game_item_kind kind,
                                 struct model3dtx *txm);
 void game_item_delete(struct game_state *g, struct game_item *item);
 int game_item_find_idx(struct game_state *g, struct game_item *item);
+struct game_item *game_item_find_by_entity(struct game_state *g, struct entity3d *e);
 void game_item_delete_idx(struct game_state *g, int idx);
 void game_item_collect(struct game_state *g, struct game_item *item, struct entity3d *actor);
 struct game_item *game_item_spawn(struct game_state *g, enum game_item_kind kind);
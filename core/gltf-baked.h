@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_GLTF_BAKED_H__
+#define __CLAP_GLTF_BAKED_H__
+
+#include <stdint.h>
+
+/*
+ * Baked glTF: what compile-time/bake_gltf makes of a .gltf, so that loading
+ * it doesn't involve base64 or parsing the buffer views and accessors. The
+ * data is laid out so that it can be mapped and handed to GL as is:
+ *
+ *   struct gltf_baked_hdr
+ *   struct gltf_baked_view[nr_views]      as "bufferViews", same indices
+ *   struct gltf_baked_accessor[nr_accrs]  as "accessors", same indices
+ *   the rest of the JSON, NUL-terminated
+ *   data: all the buffers, each GLTF_BAKED_ALIGN aligned
+ *
+ * Offsets in the header are from the start of the file, views' offsets are
+ * from the start of the data. Everything is in native byte order.
+ */
+#define GLTF_BAKED_MAGIC    "CLAPGLTF"
+#define GLTF_BAKED_VERSION  1
+#define GLTF_BAKED_ALIGN    16
+#define GLTF_BAKED_SUFFIX   ".baked"
+
+struct gltf_baked_hdr {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    nr_views;
+    uint32_t    nr_accrs;
+    uint32_t    json_size;
+    uint64_t    views_off;
+    uint64_t    accrs_off;
+    uint64_t    json_off;
+    uint64_t    data_off;
+    uint64_t    data_size;
+};
+
+struct gltf_baked_view {
+    uint64_t    offset;
+    uint64_t    length;
+};
+
+struct gltf_baked_accessor {
+    uint32_t    view;
+    uint32_t    comptype;
+    uint32_t    count;
+    /* glTF's "type": "SCALAR", "VEC3" etc */
+    char        type[8];
+    uint32_t    offset;
+};
+
+#endif /* __CLAP_GLTF_BAKED_H__ */
@@ -1,7 +1,10 @@
 // SPDX-License-Identifier: Apache-2.0
+#define _GNU_SOURCE
 #include <errno.h>
 #include "base64.h"
 #include "common.h"
+#include "gltf.h"
+#include "gltf-baked.h"
 #include "json.h"
 #include "librarian.h"
 #include "model.h"
@@ -12,6 +15,30 @@
 
 #define DATA_URI "data:application/octet-stream;base64,"
 
+/* binary glTF container: the JSON chunk, then an optional BIN chunk */
+#define GLB_MAGIC       0x46546c67 /* "glTF" */
+#define GLB_VERSION     2
+#define GLB_CHUNK_JSON  0x4e4f534a
+#define GLB_CHUNK_BIN   0x004e4942
+
+struct glb_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    length;
+};
+
+struct glb_chunk {
+    uint32_t    length;
+    uint32_t    type;
+};
+
+/* the BIN chunk of a mapped .glb */
+struct glb_bin {
+    struct lib_handle   *lh;
+    void                *buf;
+    size_t              size;
+};
+
 struct gltf_bufview {
     unsigned int buffer;
     size_t       offset;
@@ -194,6 +221,8 @@ struct gltf_material {
 struct gltf_data {
     struct scene *scene;
     darray(void *,                buffers);
+    /* mapped external buffers' handles, NULL for the decoded ones */
+    darray(struct lib_handle *,   buffer_handles);
     darray(struct gltf_bufview,   bufvws);
     darray(struct gltf_accessor,  accrs);
     darray(struct gltf_mesh,      meshes);
@@ -208,14 +237,28 @@ struct gltf_data {
     unsigned int nr_imgs;
     unsigned int nr_texs;
     unsigned int texid;
+    /* gltf_load()'s, plus the animation jobs that still read it */
+    unsigned int users;
+    /* a gltf_clone() has its own animations and shares the rest of @src */
+    struct gltf_data *src;
 };
 
-void gltf_free(struct gltf_data *gd)
+static void gltf_drop(struct gltf_data *gd)
 {
     struct gltf_skin *skin;
     struct gltf_node *node;
     int i, j;
 
+    if (gd->src) {
+        /* the samplers and channels are @src's */
+        for (i = 0; i < gd->anis.da.nr_el; i++)
+            free((void *)gd->anis.x[i].name);
+        darray_clearout(&gd->anis.da);
+        gltf_free(gd->src);
+        free(gd);
+        return;
+    }
+
     for (i = 0; i < gd->anis.da.nr_el; i++) {
         struct gltf_animation *ani = &gd->anis.x[i];
         free((void *)ani->name);
@@ -225,7 +268,10 @@ void gltf_free(struct gltf_data *gd)
     }
 
     for (i = 0; i < gd->buffers.da.nr_el; i++)
-        free(gd->buffers.x[i]);
+        if (gd->buffer_handles.x[i])
+            ref_put(gd->buffer_handles.x[i]);
+        else
+            free(gd->buffers.x[i]);
 
     for (i = 0; i < gd->meshes.da.nr_el; i++)
         free((void *)gd->meshes.x[i].name);
@@ -239,6 +285,7 @@ void gltf_free(struct gltf_data *gd)
         free((void *)skin->name);
     }
     darray_clearout(&gd->buffers.da);
+    darray_clearout(&gd->buffer_handles.da);
     darray_clearout(&gd->bufvws.da);
     darray_clearout(&gd->meshes.da);
     darray_clearout(&gd->accrs.da);
@@ -251,6 +298,52 @@ void gltf_free(struct gltf_data *gd)
     free(gd);
 }
 
+void gltf_free(struct gltf_data *gd)
+{
+    if (!--gd->users)
+        gltf_drop(gd);
+}
+
+/*
+ * For another user of the same file: only the animation names change after
+ * parsing (gltf_rename_animation()), everything else can be shared
+ */
+static struct gltf_data *gltf_clone(struct gltf_data *src, struct scene *scene)
+{
+    struct gltf_animation *ga, *sga;
+    struct gltf_data *gd;
+
+    CHECK(gd = malloc(sizeof(*gd)));
+    *gd = *src;
+    gd->scene = scene;
+    gd->users = 1;
+    gd->src   = src;
+    src->users++;
+
+    darray_init(&gd->anis);
+    darray_for_each(sga, &src->anis) {
+        CHECK(ga = darray_add(&gd->anis.da));
+        *ga = *sga;
+        ga->name = sga->name ? strdup(sga->name) : NULL;
+    }
+
+    return gd;
+}
+
+int gltf_rename_animation(struct gltf_data *gd, const char *name, const char *new_name)
+{
+    struct gltf_animation *ga;
+
+    darray_for_each(ga, &gd->anis)
+        if (ga->name && !strcmp(ga->name, name)) {
+            free((void *)ga->name);
+            ga->name = strdup(new_name);
+            return 0;
+        }
+
+    return -ENOENT;
+}
+
 int gltf_get_meshes(struct gltf_data *gd)
 {
     return gd->meshes.da.nr_el;
@@ -393,7 +486,7 @@ size_t gltf_nr_ ## _name(struct gltf_data *gd, int mesh) \
 }
 
 GLTF_MESH_ATTR(POSITION,   vx,      float)
-GLTF_MESH_ATTR(indices,    idx,     unsigned short)
+GLTF_MESH_ATTR(indices,    idx,     void)
 GLTF_MESH_ATTR(TEXCOORD_0, tx,      float)
 GLTF_MESH_ATTR(NORMAL,     norm,    float)
 GLTF_MESH_ATTR(TANGENT,    tangent, float)
@@ -618,28 +711,45 @@ static void gltf_load_skins(struct gltf_data *gd, JsonNode *skins)
     }
 }
 
-static void gltf_onload(struct lib_handle *h, void *data)
+/* @uri is relative to the .gltf file's directory */
+static int gltf_buffer_map(struct gltf_data *gd, const char *gltf_name, const char *uri,
+                           size_t len)
 {
-    JsonNode *nodes, *mats, *meshes, *texs, *imgs, *accrs, *bufvws, *bufs;
-    JsonNode *scenes, *scene, *skins, *anis;
-    JsonNode *root;
-    struct gltf_data *gd = data;
-    unsigned int nid;
-    JsonNode *n;
-
-    if (h->state == RES_ERROR) {
-        warn("couldn't load '%s'\n", h->name);
-        return;
+    const char *base = str_basename(gltf_name);
+    struct lib_handle *lh, **bh;
+    LOCAL(char, name);
+    void **buf, *data;
+    size_t sz;
+
+    if (asprintf(&name, "%.*s%s", (int)(base - gltf_name), gltf_name, uri) == -1)
+        return -ENOMEM;
+
+    lh = lib_map_file(RES_ASSET, name, &data, &sz);
+    if (!lh)
+        return -ENOENT;
+
+    /* the handle's name points to @name */
+    lh->name = NULL;
+    if (sz < len) {
+        ref_put(lh);
+        return -EINVAL;
     }
 
-    root = json_decode(h->buf);
-    dbg("loading '%s'\n", h->name);
-    if (!root) {
-        warn("couldn't parse '%s'\n", h->name);
-        h->state = RES_ERROR;
-        return;
+    bh = darray_add(&gd->buffer_handles.da);
+    if (!bh) {
+        ref_put(lh);
+        return -ENOMEM;
     }
 
+    *bh = lh;
+    CHECK(buf = darray_add(&gd->buffers.da));
+    *buf = data;
+
+    return 0;
+}
+
+static void gltf_data_init(struct gltf_data *gd)
+{
     gd->root_node = -1;
     darray_init(&gd->nodes);
     darray_init(&gd->meshes);
@@ -647,8 +757,158 @@ static void gltf_onload(struct lib_handle *h, void *data)
     darray_init(&gd->mats);
     darray_init(&gd->accrs);
     darray_init(&gd->buffers);
+    darray_init(&gd->buffer_handles);
     darray_init(&gd->anis);
     darray_init(&gd->skins);
+}
+
+/* "buffers", "bufferViews" and "accessors" of a .gltf */
+static int gltf_load_buffers(struct gltf_data *gd, JsonNode *root, const char *name,
+                             struct glb_bin *glb)
+{
+    JsonNode *accrs, *bufvws, *bufs;
+    JsonNode *n;
+
+    accrs = json_find_member(root, "accessors");
+    bufvws = json_find_member(root, "bufferViews");
+    bufs = json_find_member(root, "buffers");
+    if (!accrs || accrs->tag != JSON_ARRAY ||
+        !bufvws || bufvws->tag != JSON_ARRAY ||
+        !bufs || bufs->tag != JSON_ARRAY)
+        return -EINVAL;
+
+    /*
+     * Buffers: the bufferViews go by their index, so one that's missing
+     * fails the lot, rather than have the rest shift down into its place
+     */
+    for (n = bufs->children.head; n; n = n->next) {
+        JsonNode *jlen, *juri;
+        size_t   len, dlen, slen;
+        struct lib_handle **bh;
+        void **buf;
+        int ret;
+
+        jlen = n->tag == JSON_OBJECT ? json_find_member(n, "byteLength") : NULL;
+        juri = n->tag == JSON_OBJECT ? json_find_member(n, "uri") : NULL;
+        if (!jlen || jlen->tag != JSON_NUMBER) {
+            warn("buffer %u without a byteLength in '%s'\n", gd->buffers.da.nr_el, name);
+            return -EINVAL;
+        }
+
+        len = jlen->number_;
+
+        /* a buffer without a URI is a .glb's BIN chunk, used in place */
+        if (!juri) {
+            if (!glb || !glb->buf || glb->size < len) {
+                warn("buffer without a BIN chunk in '%s'\n", name);
+                return -EINVAL;
+            }
+
+            CHECK(buf = darray_add(&gd->buffers.da));
+            CHECK(bh = darray_add(&gd->buffer_handles.da));
+            *bh = ref_get(glb->lh);
+            *buf = glb->buf;
+            continue;
+        }
+
+        if (juri->tag != JSON_STRING) {
+            warn("buffer %u without a string uri in '%s'\n", gd->buffers.da.nr_el, name);
+            return -EINVAL;
+        }
+
+        /* external buffers are mapped and used in place */
+        if (strncmp(juri->string_, DATA_URI, sizeof(DATA_URI) - 1)) {
+            ret = gltf_buffer_map(gd, name, juri->string_, len);
+            if (ret) {
+                warn("couldn't load buffer '%s': %d\n", juri->string_, ret);
+                return ret;
+            }
+            continue;
+        }
+
+        slen = strlen(juri->string_) - sizeof(DATA_URI) + 1;
+        len = max(len, base64_decoded_length(slen));
+
+        CHECK(buf = darray_add(&gd->buffers.da));
+        CHECK(bh = darray_add(&gd->buffer_handles.da));
+        *bh = NULL;
+        CHECK(*buf = malloc(len));
+        dlen = base64_decode(*buf, len, juri->string_ + sizeof(DATA_URI) - 1, slen);
+        // dbg("buffer %d: byteLength=%d uri length=%d dlen=%d/%d slen=%d '%.10s' errno=%d\n",
+        //     gd->nr_buffers, (int)jlen->number_,
+        //     strlen(juri->string_), dlen, len,
+        //     slen, juri->string_ + sizeof(DATA_URI) - 1, errno);
+    }
+
+    /* BufferViews */
+    for (n = bufvws->children.head; n; n = n->next) {
+        JsonNode *jbuf, *jlen, *joff;
+        struct gltf_bufview *bv;
+
+        jbuf = json_find_member(n, "buffer");
+        jlen = json_find_member(n, "byteLength");
+        joff = json_find_member(n, "byteOffset");
+        if (!jbuf || !jlen || !joff)
+            continue;
+
+        if (jbuf->number_ >= gd->buffers.da.nr_el)
+            continue;
+
+        CHECK(bv = darray_add(&gd->bufvws.da));
+        bv->buffer = jbuf->number_;
+        bv->offset = joff->number_;
+        bv->length = jlen->number_;
+        // dbg("buffer view %d: buf %d offset %zu size %zu\n", gd->nr_bufvws, bv->buffer,
+        //     bv->offset, bv->length);
+    }
+
+    /* Accessors */
+    for (n = accrs->children.head; n; n = n->next) {
+        JsonNode *jbufvw, *jcount, *jtype, *jcomptype, *joffset;
+        struct gltf_accessor *ga;
+        int i;
+        
+        jbufvw = json_find_member(n, "bufferView");
+        joffset = json_find_member(n, "byteOffset");
+        jcount = json_find_member(n, "count");
+        jtype = json_find_member(n, "type");
+        jcomptype = json_find_member(n, "componentType");
+        if (!jbufvw || !jcount || !jtype || !jcomptype)
+            continue;
+        
+        if (jbufvw->number_ >= gd->bufvws.da.nr_el)
+            continue;
+        
+        for (i = 0; i < array_size(types); i++)
+            if (!strcmp(types[i], jtype->string_))
+                break;
+        
+        if (i == array_size(types))
+            continue;
+
+        CHECK(ga = darray_add(&gd->accrs.da));
+        ga->bufview = jbufvw->number_;
+        ga->comptype = jcomptype->number_;
+        ga->count = jcount->number_;
+        ga->type = i;
+        if (joffset && joffset->tag == JSON_NUMBER)
+            ga->offset = joffset->number_;
+
+        // dbg("accessor %d: bufferView: %d count: %d componentType: %d type: %s\n", gd->nr_accrs,
+        //     ga->bufview, ga->count, ga->comptype,
+        //     types[i]);
+    }
+
+    return 0;
+}
+
+/* everything else: doesn't care where the buffers came from */
+static int gltf_load_json(struct gltf_data *gd, JsonNode *root)
+{
+    JsonNode *nodes, *mats, *meshes, *texs, *imgs;
+    JsonNode *scenes, *scene, *skins, *anis;
+    unsigned int nid;
+    JsonNode *n;
 
     scenes = json_find_member(root, "scenes");
     scene = json_find_member(root, "scene");
@@ -659,27 +919,21 @@ static void gltf_onload(struct lib_handle *h, void *data)
     texs = json_find_member(root, "textures");
     imgs = json_find_member(root, "images");
     skins = json_find_member(root, "skins");
-    accrs = json_find_member(root, "accessors");
-    bufvws = json_find_member(root, "bufferViews");
-    bufs = json_find_member(root, "buffers"); 
-    if (scenes->tag != JSON_ARRAY ||
-        scene->tag != JSON_NUMBER ||
-        nodes->tag != JSON_ARRAY ||
-        mats->tag != JSON_ARRAY ||
-        meshes->tag != JSON_ARRAY ||
+    if (!scenes || scenes->tag != JSON_ARRAY ||
+        !scene || scene->tag != JSON_NUMBER ||
+        !nodes || nodes->tag != JSON_ARRAY ||
+        !mats || mats->tag != JSON_ARRAY ||
+        !meshes || meshes->tag != JSON_ARRAY ||
         (anis && anis->tag != JSON_ARRAY) ||
-        texs->tag != JSON_ARRAY ||
-        imgs->tag != JSON_ARRAY ||
-        accrs->tag != JSON_ARRAY ||
-        bufvws->tag != JSON_ARRAY ||
-        bufs->tag != JSON_ARRAY) {
-        dbg("type error %d/%d/%d/%d/%d/%d/%d/%d/%d/%d/%d\n",
-            scenes->tag, scene->tag, nodes->tag, mats->tag,
-            meshes->tag, texs->tag, imgs->tag, accrs->tag,
-            bufvws->tag, bufs->tag, anis->tag
+        !texs || texs->tag != JSON_ARRAY ||
+        !imgs || imgs->tag != JSON_ARRAY) {
+        dbg("type error %d/%d/%d/%d/%d/%d/%d/%d\n",
+            scenes ? scenes->tag : -1, scene ? scene->tag : -1,
+            nodes ? nodes->tag : -1, mats ? mats->tag : -1,
+            meshes ? meshes->tag : -1, texs ? texs->tag : -1,
+            imgs ? imgs->tag : -1, anis ? anis->tag : -1
         );
-        h->state = RES_ERROR;
-        return;
+        return -EINVAL;
     }
 
     /* Nodes */
@@ -755,97 +1009,6 @@ static void gltf_onload(struct lib_handle *h, void *data)
 
     nodes_print(gd, &gd->nodes.x[gd->root_node], 0);
 
-    /* Buffers */
-    for (n = bufs->children.head; n; n = n->next) {
-        JsonNode *jlen, *juri;
-        size_t   len, dlen, slen;
-        void **buf;
-
-        if (n->tag != JSON_OBJECT)
-            continue;
-
-        jlen = json_find_member(n, "byteLength");
-        juri = json_find_member(n, "uri");
-        if (!jlen && !juri)
-            continue;
-
-        len = jlen->number_;
-        if (juri->tag != JSON_STRING ||
-            strlen(juri->string_) < sizeof(DATA_URI) - 1 ||
-            strncmp(juri->string_, DATA_URI, sizeof(DATA_URI) - 1))
-            continue;
-
-        slen = strlen(juri->string_) - sizeof(DATA_URI) + 1;
-        len = max(len, base64_decoded_length(slen));
-
-        CHECK(buf = darray_add(&gd->buffers.da));
-        CHECK(*buf = malloc(len));
-        dlen = base64_decode(*buf, len, juri->string_ + sizeof(DATA_URI) - 1, slen);
-        // dbg("buffer %d: byteLength=%d uri length=%d dlen=%d/%d slen=%d '%.10s' errno=%d\n",
-        //     gd->nr_buffers, (int)jlen->number_,
-        //     strlen(juri->string_), dlen, len,
-        //     slen, juri->string_ + sizeof(DATA_URI) - 1, errno);
-    }
-
-    /* BufferViews */
-    for (n = bufvws->children.head; n; n = n->next) {
-        JsonNode *jbuf, *jlen, *joff;
-        struct gltf_bufview *bv;
-
-        jbuf = json_find_member(n, "buffer");
-        jlen = json_find_member(n, "byteLength");
-        joff = json_find_member(n, "byteOffset");
-        if (!jbuf || !jlen || !joff)
-            continue;
-
-        if (jbuf->number_ >= gd->buffers.da.nr_el)
-            continue;
-
-        CHECK(bv = darray_add(&gd->bufvws.da));
-        bv->buffer = jbuf->number_;
-        bv->offset = joff->number_;
-        bv->length = jlen->number_;
-        // dbg("buffer view %d: buf %d offset %zu size %zu\n", gd->nr_bufvws, bv->buffer,
-        //     bv->offset, bv->length);
-    }
-
-    /* Accessors */
-    for (n = accrs->children.head; n; n = n->next) {
-        JsonNode *jbufvw, *jcount, *jtype, *jcomptype, *joffset;
-        struct gltf_accessor *ga;
-        int i;
-        
-        jbufvw = json_find_member(n, "bufferView");
-        joffset = json_find_member(n, "byteOffset");
-        jcount = json_find_member(n, "count");
-        jtype = json_find_member(n, "type");
-        jcomptype = json_find_member(n, "componentType");
-        if (!jbufvw || !jcount || !jtype || !jcomptype)
-            continue;
-        
-        if (jbufvw->number_ >= gd->bufvws.da.nr_el)
-            continue;
-        
-        for (i = 0; i < array_size(types); i++)
-            if (!strcmp(types[i], jtype->string_))
-                break;
-        
-        if (i == array_size(types))
-            continue;
-
-        CHECK(ga = darray_add(&gd->accrs.da));
-        ga->bufview = jbufvw->number_;
-        ga->comptype = jcomptype->number_;
-        ga->count = jcount->number_;
-        ga->type = i;
-        if (joffset && joffset->tag == JSON_NUMBER)
-            ga->offset = joffset->number_;
-
-        // dbg("accessor %d: bufferView: %d count: %d componentType: %d type: %s\n", gd->nr_accrs,
-        //     ga->bufview, ga->count, ga->comptype,
-        //     types[i]);
-    }
-
     gltf_load_animations(gd, anis);
     gltf_load_skins(gd, skins);
 
@@ -984,13 +1147,126 @@ static void gltf_onload(struct lib_handle *h, void *data)
         // dbg("mesh %d: '%s' POSITION: %d\n", gd->nr_meshes, jname->string_, mesh->POSITION);
     }
 
+    return 0;
+}
+
+static void gltf_onload(struct lib_handle *h, void *data)
+{
+    struct gltf_data *gd = data;
+    JsonNode *root;
+
+    if (h->state == RES_ERROR) {
+        warn("couldn't load '%s'\n", h->name);
+        return;
+    }
+
+    root = json_decode_arena(h->buf);
+    dbg("loading '%s'\n", h->name);
+    if (!root) {
+        warn("couldn't parse '%s'\n", h->name);
+        h->state = RES_ERROR;
+        return;
+    }
+
+    gltf_data_init(gd);
+    if (gltf_load_buffers(gd, root, h->name, NULL) || gltf_load_json(gd, root))
+        h->state = RES_ERROR;
+
     json_free(root);
     ref_put(h);
+}
+
+/*
+ * The buffer views and accessors come straight from the tables, all of
+ * them pointing into the one mapped data buffer
+ */
+static int gltf_load_baked(struct gltf_data *gd, const char *name)
+{
+    struct gltf_baked_accessor *bacc;
+    struct gltf_baked_view *bview;
+    struct gltf_baked_hdr *hdr;
+    struct lib_handle *lh, **bh;
+    JsonNode *root = NULL;
+    int i, j, ret = -EINVAL;
+    void **buf, *map;
+    size_t size;
+
+    lh = lib_map_file(RES_ASSET, name, &map, &size);
+    if (!lh)
+        return -ENOENT;
+
+    hdr = map;
+    if (size < sizeof(*hdr) ||
+        memcmp(hdr->magic, GLTF_BAKED_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != GLTF_BAKED_VERSION ||
+        hdr->views_off + (uint64_t)hdr->nr_views * sizeof(*bview) > size ||
+        hdr->accrs_off + (uint64_t)hdr->nr_accrs * sizeof(*bacc) > size ||
+        hdr->json_off + hdr->json_size > size || !hdr->json_size ||
+        hdr->data_off + hdr->data_size > size ||
+        ((const char *)map)[hdr->json_off + hdr->json_size - 1]) {
+        warn("'%s' is not a baked glTF\n", name);
+        goto out;
+    }
+
+    gltf_data_init(gd);
+
+    /* from here on, gltf_free() takes care of the handle */
+    CHECK(bh = darray_add(&gd->buffer_handles.da));
+    CHECK(buf = darray_add(&gd->buffers.da));
+    *bh = lh;
+    *buf = map + hdr->data_off;
+    lh = NULL;
+
+    bview = map + hdr->views_off;
+    for (i = 0; i < hdr->nr_views; i++) {
+        struct gltf_bufview *bv;
+
+        if (bview[i].offset + bview[i].length > hdr->data_size)
+            goto out;
+
+        CHECK(bv = darray_add(&gd->bufvws.da));
+        bv->buffer = 0;
+        bv->offset = bview[i].offset;
+        bv->length = bview[i].length;
+    }
+
+    bacc = map + hdr->accrs_off;
+    for (i = 0; i < hdr->nr_accrs; i++) {
+        struct gltf_accessor *ga;
+
+        for (j = 0; j < array_size(types); j++)
+            if (!strncmp(types[j], bacc[i].type, sizeof(bacc[i].type)))
+                break;
 
-    return;
+        if (j == array_size(types) || bacc[i].view >= hdr->nr_views)
+            goto out;
+
+        CHECK(ga = darray_add(&gd->accrs.da));
+        ga->bufview = bacc[i].view;
+        ga->comptype = bacc[i].comptype;
+        ga->count = bacc[i].count;
+        ga->type = j;
+        ga->offset = bacc[i].offset;
+    }
+
+    root = json_decode_arena(map + hdr->json_off);
+    if (!root)
+        goto out;
+
+    dbg("loading baked '%s'\n", name);
+    ret = gltf_load_json(gd, root);
+    json_free(root);
+
+out:
+    if (lh)
+        ref_put(lh);
+    if (ret)
+        warn("couldn't load '%s': %d\n", name, ret);
+
+    return ret;
 }
 
-void gltf_mesh_data(struct gltf_data *gd, int mesh, float **vx, size_t *vxsz, unsigned short **idx, size_t *idxsz,
+void gltf_mesh_data(struct gltf_data *gd, int mesh, float **vx, size_t *vxsz, void **idx, size_t *idxsz,
                     float **tx, size_t *txsz, float **norm, size_t *normsz)
 {
     struct gltf_mesh *m = &gd->meshes.x[mesh];
@@ -1021,15 +1297,75 @@ int gltf_skin_node_to_joint(struct gltf_data *gd, int skin, int node)
     return gd->skins.x[skin].nodes[node];
 }
 
-void gltf_instantiate_one(struct gltf_data *gd, int mesh)
+struct gltf_anis_job {
+    struct gltf_data    *gd;
+    int                 skin;
+};
+
+/* on a job: the channels get copied out of the buffers and resampled */
+static void gltf_animations_build(struct model3d_anis *pending, void *data)
+{
+    struct gltf_anis_job *job = data;
+    struct gltf_data *gd = job->gd;
+    struct gltf_animation *ga;
+    struct animation *an;
+
+    darray_for_each(ga, &gd->anis) {
+        struct gltf_channel *chan;
+
+        /*
+         * There are no keyframes as such, that span all properties of all
+         * joints. Instead each transformation channel has a timeline, some
+         * share timelines and some don't.
+         * Interpolation is done for each channel separately, based on the
+         * timeline that it uses, in the renderer.
+         * If we were to stuff all this into poses, assuming that all timelines
+         * are reducible to one linear timeline, we'd have to interpolate here
+         * for the channels that are sparser.
+         * OTOH, the 'pose' / 'frame' based data will fit into channel based
+         * model trivially, where all channels move at the same time increments.
+         */
+        CHECK(an = model3d_anis_new(pending, ga->name, ga->channels.da.nr_el));
+        dbg("## animation '%s'\n", an->name);
+        darray_for_each(chan, &ga->channels) {
+            int accr_in = ga->samplers.x[chan->sampler].input;
+            int accr_out = ga->samplers.x[chan->sampler].output;
+            size_t frames = gltf_accessor_nr(gd, accr_in);
+            float *time = gltf_accessor_buf(gd, accr_in);
+            float *data = gltf_accessor_buf(gd, accr_out);
+
+            size_t data_stride = gltf_accessor_stride(gd, accr_out);
+
+            animation_add_channel(an, frames, time, data, data_stride,
+                                  gltf_skin_node_to_joint(gd, job->skin, chan->node), chan->path);
+        }
+
+        /* evenly spaced keys turn the keyframe lookup into an index */
+        if (animation_resample(an, ANIMATION_RESAMPLE_RATE))
+            warn("couldn't resample animation '%s'\n", an->name);
+
+        /* drop the redundant keys, pack the rotations */
+        if (animation_compress(an, ANIMATION_KEY_ERROR))
+            warn("couldn't compress animation '%s'\n", an->name);
+    }
+}
+
+/* main thread, same as gltf_free() */
+static void gltf_animations_release(void *data)
+{
+    struct gltf_anis_job *job = data;
+
+    gltf_free(job->gd);
+    free(job);
+}
+
+/* what gltf_instantiate_one() uploads, in the same order */
+struct mesh *gltf_mesh_new(struct gltf_data *gd, int mesh)
 {
-    struct model3dtx *txm;
-    struct model3d   *m;
     struct mesh *me;
-    int skin;
 
     if (mesh < 0 || mesh >= gd->meshes.da.nr_el)
-        return;
+        return NULL;
 
     me = mesh_new(gltf_mesh_name(gd, mesh));
     mesh_attr_dup(me, MESH_VX, gltf_vx(gd, mesh), gltf_vx_stride(gd, mesh), gltf_nr_vx(gd, mesh));
@@ -1045,7 +1381,62 @@ void gltf_instantiate_one(struct gltf_data *gd, int mesh)
         mesh_attr_dup(me, MESH_TANGENTS, gltf_tangent(gd, mesh), gltf_tangent_stride(gd, mesh), gltf_nr_tangent(gd, mesh));
     mesh_optimize(me);
 
-    m = model3d_new_from_mesh(gltf_mesh_name(gd, mesh), gd->scene->prog, me);
+    return me;
+}
+
+/*
+ * The geometry, the textures and the skin are there when this returns, the
+ * animations follow, see model3d_add_animations()
+ */
+static void gltf_instantiate(struct gltf_data *gd, int mesh, bool share)
+{
+    unsigned int features = SHADER_DEFAULT_FEATURES;
+    struct shader_prog *prog;
+    struct model3dtx *txm;
+    struct model3d   *m;
+    struct mesh *me;
+    uint64_t hash = 0;
+    int skin;
+
+    me = gltf_mesh_new(gd, mesh);
+    if (!me)
+        return;
+
+    /* the specialized programs, if there are any, see enum shader_feature */
+    if (gltf_has_nmap(gd, mesh) && gltf_has_tangent(gd, mesh))
+        features |= SHADER_NORMALS;
+    prog = shader_prog_find_variant(gd->scene->prog, "model", features);
+    if (!prog) {
+        ref_put(me);
+        return;
+    }
+
+    /*
+     * Another glTF's copy of the same mesh: only the textures are new, and go
+     * on the same model, see mq_texture_layers(); skins have their own joints
+     */
+    skin = gltf_mesh_skin(gd, mesh);
+    if (share && skin < 0)
+        hash = mesh_hash(me);
+    m = mq_model_by_mesh(&gd->scene->mq, hash, prog);
+    if (m) {
+        m = ref_get(m);
+        dbg("mesh '%s' is already in '%s'\n", gltf_mesh_name(gd, mesh), m->name);
+    } else {
+        m = model3d_new_from_mesh(gltf_mesh_name(gd, mesh), prog, me);
+        if (m)
+            m->mesh_hash = hash;
+    }
+    if (m && skin >= 0) {
+        m->skin_prog = shader_prog_find_variant(gd->scene->prog, "model",
+                                                features | SHADER_SKINNING);
+        /* the plain one can do either */
+        if (m->skin_prog == prog) {
+            ref_put(m->skin_prog);
+            m->skin_prog = NULL;
+        }
+    }
+    ref_put(prog);  /* matches shader_prog_find_variant() above */
     if (gltf_has_tangent(gd, mesh)) {
         dbg("added tangents for mesh '%s'\n", gltf_mesh_name(gd, mesh));
     }
@@ -1059,13 +1450,11 @@ void gltf_instantiate_one(struct gltf_data *gd, int mesh)
         txm = model3dtx_new_from_buffer(ref_pass(m), gltf_tex(gd, mesh), gltf_texsz(gd, mesh));
     }
 
-    skin = gltf_mesh_skin(gd, mesh);
     if (skin >= 0) {
         struct gltf_skin *s = &gd->skins.x[skin];
         mat4x4 *invmxs = s->invmxs;
-        struct gltf_animation *ga;
+        struct gltf_anis_job *job;
         struct gltf_node *node;
-        struct animation *an;
         mat4x4 root_pose;
         int err, i;
 
@@ -1104,35 +1493,16 @@ void gltf_instantiate_one(struct gltf_data *gd, int mesh)
             }
         }
 
-        darray_for_each(ga, &gd->anis) {
-            struct gltf_channel *chan;
-
-            /*
-             * There are no keyframes as such, that span all properties of all
-             * joints. Instead each transformation channel has a timeline, some
-             * share timelines and some don't.
-             * Interpolation is done for each channel separately, based on the
-             * timeline that it uses, in the renderer.
-             * If we were to stuff all this into poses, assuming that all timelines
-             * are reducible to one linear timeline, we'd have to interpolate here
-             * for the channels that are sparser.
-             * OTOH, the 'pose' / 'frame' based data will fit into channel based
-             * model trivially, where all channels move at the same time increments.
-             */
-            CHECK(an = animation_new(gd->scene->_model, ga->name,
-                                     ga->channels.da.nr_el));
-            dbg("## animation '%s'\n", an->name);
-            darray_for_each(chan, &ga->channels) {
-                int accr_in = ga->samplers.x[chan->sampler].input;
-                int accr_out = ga->samplers.x[chan->sampler].output;
-                size_t frames = gltf_accessor_nr(gd, accr_in);
-                float *time = gltf_accessor_buf(gd, accr_in);
-                float *data = gltf_accessor_buf(gd, accr_out);
-
-                size_t data_stride = gltf_accessor_stride(gd, accr_out);
-
-                animation_add_channel(an, frames, time, data, data_stride,
-                                      gltf_skin_node_to_joint(gd, skin, chan->node), chan->path);
+        /* the mesh is good to go without them */
+        if (gd->anis.da.nr_el) {
+            CHECK(job = calloc(1, sizeof(*job)));
+            job->gd   = gd;
+            job->skin = skin;
+            gd->users++;
+            if (model3d_add_animations(gd->scene->_model, gltf_animations_build,
+                                       gltf_animations_release, job)) {
+                gd->users--;
+                free(job);
             }
         }
     }
@@ -1144,6 +1514,16 @@ no_skinning:
     scene_add_model(gd->scene, txm);
 }
 
+void gltf_instantiate_one(struct gltf_data *gd, int mesh)
+{
+    gltf_instantiate(gd, mesh, false);
+}
+
+void gltf_instantiate_shared(struct gltf_data *gd, int mesh)
+{
+    gltf_instantiate(gd, mesh, true);
+}
+
 void gltf_instantiate_all(struct gltf_data *gd)
 {
     int i;
@@ -1152,14 +1532,117 @@ void gltf_instantiate_all(struct gltf_data *gd)
         gltf_instantiate_one(gd, i);
 }
 
+/*
+ * The JSON chunk is copied to get it NUL-terminated, the BIN chunk stays
+ * mapped for as long as the buffers are around
+ */
+static int gltf_load_glb(struct gltf_data *gd, const char *name)
+{
+    struct glb_bin glb = {};
+    struct glb_header *hdr;
+    struct glb_chunk *chunk;
+    JsonNode *root = NULL;
+    LOCAL(char, json);
+    int ret = -EINVAL;
+    size_t size, off;
+    void *map;
+
+    glb.lh = lib_map_file(RES_ASSET, name, &map, &size);
+    if (!glb.lh)
+        return -ENOENT;
+
+    hdr = map;
+    off = sizeof(*hdr) + sizeof(*chunk);
+    if (size < off || hdr->magic != GLB_MAGIC || hdr->version != GLB_VERSION ||
+        hdr->length > size)
+        goto out;
+
+    size = hdr->length;
+    chunk = map + sizeof(*hdr);
+    if (chunk->type != GLB_CHUNK_JSON || chunk->length > size - off)
+        goto out;
+
+    json = strndup(map + off, chunk->length);
+    if (!json) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* chunks are 4-byte aligned */
+    off = (off + chunk->length + 3) & ~3ul;
+    chunk = map + off;
+    if (off + sizeof(*chunk) <= size && chunk->type == GLB_CHUNK_BIN &&
+        chunk->length <= size - off - sizeof(*chunk)) {
+        glb.buf = map + off + sizeof(*chunk);
+        glb.size = chunk->length;
+    }
+
+    root = json_decode_arena(json);
+    if (!root)
+        goto out;
+
+    dbg("loading '%s'\n", name);
+    gltf_data_init(gd);
+    ret = gltf_load_buffers(gd, root, name, &glb);
+    if (!ret)
+        ret = gltf_load_json(gd, root);
+    json_free(root);
+
+out:
+    /* the buffers hold their own references */
+    ref_put(glb.lh);
+    if (ret)
+        warn("couldn't load '%s': %d\n", name, ret);
+
+    return ret;
+}
+
+/* a baked version that's newer than the .gltf is used instead */
+static bool gltf_has_baked(const char *name, const char *baked)
+{
+    struct stat st_gltf, st_baked;
+
+    if (lib_stat(RES_ASSET, baked, &st_baked))
+        return false;
+
+    if (!lib_stat(RES_ASSET, name, &st_gltf) && st_gltf.st_mtime > st_baked.st_mtime) {
+        warn("'%s' is older than '%s', ignoring it\n", baked, name);
+        return false;
+    }
+
+    return true;
+}
+
 struct gltf_data *gltf_load(struct scene *scene, const char *name)
 {
     struct gltf_data  *gd;
     struct lib_handle *lh;
     enum res_state state;
+    LOCAL(char, baked);
 
     CHECK(gd = calloc(1, sizeof(*gd)));
     gd->scene = scene;
+    gd->users = 1;
+
+    if (asprintf(&baked, "%s" GLTF_BAKED_SUFFIX, name) != -1 && gltf_has_baked(name, baked)) {
+        if (!gltf_load_baked(gd, baked))
+            return gd;
+
+        /* start over with the original */
+        gltf_free(gd);
+        CHECK(gd = calloc(1, sizeof(*gd)));
+        gd->scene = scene;
+        gd->users = 1;
+    }
+
+    if (str_endswith(name, ".glb")) {
+        if (!gltf_load_glb(gd, name))
+            return gd;
+
+        gltf_free(gd);
+        return NULL;
+    }
+
     lh = lib_request(RES_ASSET, name, gltf_onload, gd);
     state = lh->state;
     ref_put(lh);
@@ -1170,3 +1653,115 @@ struct gltf_data *gltf_load(struct scene *scene, const char *name)
     }
     return gd;
 }
+
+/*
+ * The first request for a file is also the one its data is parsed into,
+ * the rest share it, see gltf_request_done()
+ */
+struct gltf_request {
+    struct scene        *scene;
+    const char          *name;
+    struct gltf_data    *gd;
+    gltf_loaded_fn      cb;
+    void                *data;
+};
+
+/* on a worker: nothing here touches the scene */
+static int gltf_decode(struct lib_handle *h, void *data)
+{
+    struct gltf_request *req = data;
+    JsonNode *root;
+    int ret;
+
+    root = json_decode_arena(h->buf);
+    if (!root)
+        return -EINVAL;
+
+    dbg("loading '%s'\n", req->name);
+    gltf_data_init(req->gd);
+    ret = gltf_load_buffers(req->gd, root, req->name, NULL);
+    if (!ret)
+        ret = gltf_load_json(req->gd, root);
+    json_free(root);
+
+    return ret;
+}
+
+static void gltf_request_done(struct lib_handle *h, void *data)
+{
+    struct gltf_request *req = data;
+    struct gltf_data *gd = req->gd;
+
+    if (h->state == RES_ERROR) {
+        warn("couldn't load '%s'\n", req->name);
+        gltf_free(gd);
+        gd = NULL;
+    } else if (gd->users > 1) {
+        /* the same file again: scenes rename its animations, so they get copies */
+        gd = gltf_clone(req->gd, req->scene);
+        gltf_free(req->gd);
+    } else {
+        /* nobody else is using it */
+        gd->scene = req->scene;
+    }
+
+    req->cb(gd, req->data);
+    free(req);
+    ref_put(h);
+}
+
+int gltf_load_async(struct scene *scene, const char *name, enum lib_priority prio,
+                    gltf_loaded_fn cb, void *data)
+{
+    struct gltf_request *req;
+    struct lib_handle *lh;
+    char *baked = NULL;
+    bool now;
+
+    now = str_endswith(name, ".glb");
+    if (!now && asprintf(&baked, "%s" GLTF_BAKED_SUFFIX, name) != -1) {
+        now = gltf_has_baked(name, baked);
+        free(baked);
+    }
+
+    if (now) {
+        cb(gltf_load(scene, name), data);
+        return 0;
+    }
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return -ENOMEM;
+
+    req->gd = calloc(1, sizeof(*req->gd));
+    if (!req->gd) {
+        free(req);
+        return -ENOMEM;
+    }
+
+    req->gd->scene = scene;
+    req->gd->users = 1;
+    req->scene     = scene;
+    req->name      = name;
+    req->cb        = cb;
+    req->data      = data;
+
+    lh = lib_request_async(RES_ASSET, name, prio, gltf_decode, gltf_request_done, req);
+    if (!lh) {
+        free(req->gd);
+        free(req);
+        return -ENOMEM;
+    }
+
+    /* already on its way: parsed once into the first request's */
+    if (lh->data != req) {
+        struct gltf_request *first = lh->data;
+
+        free(req->gd);
+        req->gd = first->gd;
+        req->gd->users++;
+    }
+    ref_put(lh);
+
+    return 0;
+}
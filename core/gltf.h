@@ -2,31 +2,53 @@
 #ifndef __CLAP_GLTF_H__
 #define __CLAP_GLTF_H__
 
+#include "librarian.h"
+
 struct gltf_data;
+struct mesh;
+struct scene;
 struct gltf_data *gltf_load(struct scene *scene, const char *name);
+/* @gd is NULL if it didn't load; the callback gltf_free()s it */
+typedef void (*gltf_loaded_fn)(struct gltf_data *gd, void *data);
+/*
+ * A .gltf is read and parsed on a job, @cb gets it from librarian_poll();
+ * the baked and .glb ones are mapped and mostly used in place, those are
+ * loaded right away. @name must stay around until @cb.
+ */
+int gltf_load_async(struct scene *scene, const char *name, enum lib_priority prio,
+                    gltf_loaded_fn cb, void *data);
 void gltf_free(struct gltf_data *gd);
+/* before it's instantiated: the animations are built from it in the background */
+int gltf_rename_animation(struct gltf_data *gd, const char *name, const char *new_name);
 int gltf_root_mesh(struct gltf_data *gd);
 int gltf_mesh_by_name(struct gltf_data *gd, const char *name);
 void gltf_instantiate_one(struct gltf_data *gd, int mesh);
+/*
+ * Same, but if an earlier load has the same mesh, its model gets another
+ * txmodel with this one's textures, see mq_texture_layers()
+ */
+void gltf_instantiate_shared(struct gltf_data *gd, int mesh);
+struct mesh *gltf_mesh_new(struct gltf_data *gd, int mesh);
 void gltf_instantiate_all(struct gltf_data *gd);
 int gltf_get_meshes(struct gltf_data *gd);
-int gltf_mesh(struct gltf_data *gd, const char *name);
 const char *gltf_mesh_name(struct gltf_data *gd, int mesh);
-void gltf_mesh_data(struct gltf_data *gd, int mesh, float **vx, size_t *vxsz, unsigned short **idx, size_t *idxsz,
+void gltf_mesh_data(struct gltf_data *gd, int mesh, float **vx, size_t *vxsz, void **idx, size_t *idxsz,
                     float **tx, size_t *txsz, float **norm, size_t *normsz);
 void *gltf_accessor_buf(struct gltf_data *gd, int accr);
-void *gltf_accessor_sz(struct gltf_data *gd, int accr);
+unsigned int gltf_accessor_sz(struct gltf_data *gd, int accr);
 float *gltf_vx(struct gltf_data *gd, int mesh);
 unsigned int gltf_vxsz(struct gltf_data *gd, int mesh);
-unsigned short *gltf_idx(struct gltf_data *gd, int mesh);
+/* u16 or u32, see gltf_idx_stride() */
+void *gltf_idx(struct gltf_data *gd, int mesh);
 unsigned int gltf_idxsz(struct gltf_data *gd, int mesh);
+size_t gltf_idx_stride(struct gltf_data *gd, int mesh);
 float *gltf_tx(struct gltf_data *gd, int mesh);
 unsigned int gltf_txsz(struct gltf_data *gd, int mesh);
 float *gltf_norm(struct gltf_data *gd, int mesh);
 unsigned int gltf_normsz(struct gltf_data *gd, int mesh);
 float *gltf_color(struct gltf_data *gd, int mesh);
 unsigned int gltf_colorsz(struct gltf_data *gd, int mesh);
-float *gltf_joints(struct gltf_data *gd, int mesh);
+unsigned char *gltf_joints(struct gltf_data *gd, int mesh);
 unsigned int gltf_jointssz(struct gltf_data *gd, int mesh);
 float *gltf_weights(struct gltf_data *gd, int mesh);
 unsigned int gltf_weightssz(struct gltf_data *gd, int mesh);
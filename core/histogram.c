@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: Apache-2.0
+#include "histogram.h"
+
+static unsigned int histogram_bucket(uint64_t v)
+{
+    unsigned int msb;
+
+    if (v < HIST_SUB)
+        return v;
+    if (v >> HIST_BITS)
+        return HIST_BUCKETS - 1;
+
+    msb = 63 - __builtin_clzll(v);
+
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the largest value that goes into @bucket */
+static uint64_t histogram_bucket_top(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+    /* everything off the scale is in there too */
+    if (bucket == HIST_BUCKETS - 1)
+        return UINT64_MAX;
+
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+
+    return (((uint64_t)(HIST_SUB | (bucket & (HIST_SUB - 1))) + 1) << shift) - 1;
+}
+
+void histogram_add(struct histogram *h, uint64_t v)
+{
+    h->buckets[histogram_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+uint64_t histogram_percentile(struct histogram *h, double p)
+{
+    double rank = h->count * (p < 0 ? 0 : p > 100 ? 100 : p) / 100.0;
+    unsigned long target = rank, seen = 0;
+    unsigned int i;
+    uint64_t top;
+
+    if (!h->count)
+        return 0;
+
+    /* rounding up the rank */
+    if (target < rank || !target)
+        target++;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            top = histogram_bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+
+    return h->max;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_HISTOGRAM_H__
+#define __CLAP_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear histogram, HdrHistogram style: values below HIST_SUB are
+ * exact, above that each power of 2 is split into HIST_SUB buckets, so
+ * a percentile is off by less than 1/HIST_SUB of the value. Values from
+ * 2^HIST_BITS up all land in the last bucket, @max is always exact.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1u << HIST_SUB_BITS)
+#define HIST_BITS       24
+#define HIST_BUCKETS    ((HIST_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint32_t        buckets[HIST_BUCKETS];
+    unsigned long   count;
+    uint64_t        max;
+};
+
+void histogram_add(struct histogram *h, uint64_t v);
+/* the smallest value that @p percent of the samples don't exceed */
+uint64_t histogram_percentile(struct histogram *h, double p);
+
+static inline void histogram_reset(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+#endif /* __CLAP_HISTOGRAM_H__ */
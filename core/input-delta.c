@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "input-delta.h"
+#include "util.h"
+
+static const size_t input_axes[INPUT_NR_AXES] = {
+    offsetof(struct message_input, delta_lx),
+    offsetof(struct message_input, delta_ly),
+    offsetof(struct message_input, delta_rx),
+    offsetof(struct message_input, delta_ry),
+    offsetof(struct message_input, trigger_l),
+    offsetof(struct message_input, trigger_r),
+};
+
+static inline float *input_axis(const struct message_input *mi, int i)
+{
+    return (void *)mi + input_axes[i];
+}
+
+void input_state_pack(struct input_state *st, const struct message_input *mi)
+{
+    const unsigned char *buttons = (const unsigned char *)mi;
+    float v;
+    int i;
+
+    memset(st->buttons, 0, sizeof(st->buttons));
+    for (i = 0; i < INPUT_NR_BUTTONS; i++)
+        st->buttons[i / 4] |= min(buttons[i], 3) << (i % 4 * 2);
+
+    for (i = 0; i < INPUT_NR_AXES; i++) {
+        v = roundf(*input_axis(mi, i) * INPUT_AXIS_SCALE);
+        st->axes[i] = clampf(v, INT16_MIN, INT16_MAX);
+    }
+
+    st->x = min(mi->x, UINT16_MAX);
+    st->y = min(mi->y, UINT16_MAX);
+}
+
+void input_state_unpack(const struct input_state *st, struct message_input *mi)
+{
+    unsigned char *buttons = (unsigned char *)mi;
+    int i;
+
+    memset(mi, 0, sizeof(*mi));
+    for (i = 0; i < INPUT_NR_BUTTONS; i++)
+        buttons[i] = (st->buttons[i / 4] >> (i % 4 * 2)) & 3;
+
+    for (i = 0; i < INPUT_NR_AXES; i++)
+        *input_axis(mi, i) = (float)st->axes[i] / INPUT_AXIS_SCALE;
+
+    mi->x = st->x;
+    mi->y = st->y;
+}
+
+void input_history_add(struct input_history *h, const struct input_state *st)
+{
+    unsigned int slot = st->seq % INPUT_HISTORY;
+
+    h->states[slot] = *st;
+    h->valid |= 1u << slot;
+}
+
+struct input_state *input_history_find(struct input_history *h, uint16_t seq)
+{
+    unsigned int slot = seq % INPUT_HISTORY;
+
+    if (!(h->valid & (1u << slot)) || h->states[slot].seq != seq)
+        return NULL;
+
+    return &h->states[slot];
+}
+
+static inline uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    *p++ = v;
+    *p++ = v >> 8;
+    return p;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+size_t input_delta_encode(uint8_t *buf, const struct input_state *st, const struct input_state *base)
+{
+    static const struct input_state zero;
+    unsigned int mask = 0, changed = 0, i;
+    uint8_t *p = buf + sizeof(uint16_t);
+
+    /* the full state is a delta against all zeroes */
+    if (!base) {
+        mask |= INPUT_DELTA_FULL;
+        base = &zero;
+    }
+
+    for (i = 0; i < INPUT_BUTTON_BYTES; i++)
+        if (st->buttons[i] != base->buttons[i])
+            changed |= 1u << i;
+    if (changed)
+        mask |= INPUT_DELTA_BUTTONS;
+
+    for (i = 0; i < INPUT_NR_AXES; i++)
+        if (st->axes[i] != base->axes[i])
+            mask |= INPUT_DELTA_AXIS(i);
+
+    if (st->x != base->x || st->y != base->y)
+        mask |= INPUT_DELTA_POINTER;
+
+    p = put16(p, st->seq);
+    if (!(mask & INPUT_DELTA_FULL))
+        p = put16(p, base->seq);
+
+    if (mask & INPUT_DELTA_BUTTONS) {
+        p = put16(p, changed);
+        for (i = 0; i < INPUT_BUTTON_BYTES; i++)
+            if (changed & (1u << i))
+                *p++ = st->buttons[i];
+    }
+
+    for (i = 0; i < INPUT_NR_AXES; i++)
+        if (mask & INPUT_DELTA_AXIS(i))
+            p = put16(p, st->axes[i]);
+
+    if (mask & INPUT_DELTA_POINTER) {
+        p = put16(p, st->x);
+        p = put16(p, st->y);
+    }
+
+    put16(buf, mask);
+
+    return p - buf;
+}
+
+ssize_t input_delta_size(const uint8_t *buf, size_t size)
+{
+    unsigned int mask, i;
+    size_t len = 2 * sizeof(uint16_t);
+
+    if (size < len)
+        return -EAGAIN;
+
+    mask = get16(buf);
+    if (!(mask & INPUT_DELTA_FULL))
+        len += sizeof(uint16_t);
+
+    if (mask & INPUT_DELTA_BUTTONS) {
+        if (size < len + sizeof(uint16_t))
+            return -EAGAIN;
+        len += sizeof(uint16_t) + __builtin_popcount(get16(buf + len) & ((1u << INPUT_BUTTON_BYTES) - 1));
+    }
+
+    for (i = 0; i < INPUT_NR_AXES; i++)
+        if (mask & INPUT_DELTA_AXIS(i))
+            len += sizeof(int16_t);
+
+    if (mask & INPUT_DELTA_POINTER)
+        len += 2 * sizeof(uint16_t);
+
+    return size < len ? -EAGAIN : len;
+}
+
+ssize_t input_delta_decode(const uint8_t *buf, size_t size, struct input_state *st,
+                           struct input_history *h)
+{
+    const uint8_t *p = buf + sizeof(uint16_t);
+    struct input_state *base;
+    unsigned int mask, changed, i;
+    ssize_t len;
+
+    len = input_delta_size(buf, size);
+    if (len < 0)
+        return len;
+
+    mask = get16(buf);
+    memset(st, 0, sizeof(*st));
+    st->seq = get16(p);
+    p += sizeof(uint16_t);
+
+    if (!(mask & INPUT_DELTA_FULL)) {
+        base = input_history_find(h, get16(p));
+        if (!base)
+            return -ENOENT;
+
+        memcpy(st->buttons, base->buttons, sizeof(st->buttons));
+        memcpy(st->axes, base->axes, sizeof(st->axes));
+        st->x = base->x;
+        st->y = base->y;
+        p += sizeof(uint16_t);
+    }
+
+    if (mask & INPUT_DELTA_BUTTONS) {
+        changed = get16(p);
+        p += sizeof(uint16_t);
+        for (i = 0; i < INPUT_BUTTON_BYTES; i++)
+            if (changed & (1u << i))
+                st->buttons[i] = *p++;
+    }
+
+    for (i = 0; i < INPUT_NR_AXES; i++)
+        if (mask & INPUT_DELTA_AXIS(i)) {
+            st->axes[i] = (int16_t)get16(p);
+            p += sizeof(int16_t);
+        }
+
+    if (mask & INPUT_DELTA_POINTER) {
+        st->x = get16(p);
+        st->y = get16(p + sizeof(uint16_t));
+    }
+
+    input_history_add(h, st);
+
+    return len;
+}
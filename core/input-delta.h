@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_INPUT_DELTA_H__
+#define __CLAP_INPUT_DELTA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "messagebus.h"
+
+/*
+ * Compact input state for sending over the network: buttons are 2 bits
+ * each (0: nothing, 1: press, 2: release, 3: anything else), axes are
+ * fixed point with 1/INPUT_AXIS_SCALE steps and clamped to int16_t, the
+ * pointer is clamped to uint16_t.
+ *
+ * On the wire, a state is sent as a delta against an earlier one that the
+ * other side has acknowledged (by its @seq), or in full:
+ *
+ *   u16 mask     INPUT_DELTA_*
+ *   u16 seq
+ *   u16 base     unless INPUT_DELTA_FULL
+ *   u16 changed  INPUT_DELTA_BUTTONS: which bytes of @buttons follow
+ *   u8  buttons[]
+ *   s16 axes[]   INPUT_DELTA_AXIS(i)
+ *   u16 x, y     INPUT_DELTA_POINTER
+ *
+ * all little endian. A state that didn't change since @base is 6 bytes.
+ */
+
+/* the unsigned chars at the top of struct message_input, left to debug_action */
+#define INPUT_NR_BUTTONS    (offsetof(struct message_input, debug_action) + 1)
+#define INPUT_BUTTON_BYTES  ((INPUT_NR_BUTTONS * 2 + 7) / 8)
+/* delta_{l,r}{x,y}, trigger_{l,r} */
+#define INPUT_NR_AXES       6
+#define INPUT_AXIS_SCALE    256
+
+struct input_state {
+    uint16_t    seq;
+    uint8_t     buttons[INPUT_BUTTON_BYTES];
+    int16_t     axes[INPUT_NR_AXES];
+    uint16_t    x, y;
+};
+
+#define INPUT_DELTA_FULL        (1u << 0)
+#define INPUT_DELTA_BUTTONS     (1u << 1)
+#define INPUT_DELTA_AXIS(_i)    (1u << (2 + (_i)))
+#define INPUT_DELTA_POINTER     (1u << (2 + INPUT_NR_AXES))
+
+/* the largest encoded delta */
+#define INPUT_DELTA_MAX \
+    (4 * sizeof(uint16_t) + INPUT_BUTTON_BYTES + INPUT_NR_AXES * sizeof(int16_t) + 2 * sizeof(uint16_t))
+
+/* power of 2 */
+#define INPUT_HISTORY 32
+
+/* the last INPUT_HISTORY states sent or received, by their @seq */
+struct input_history {
+    struct input_state  states[INPUT_HISTORY];
+    uint32_t            valid;
+};
+
+void input_state_pack(struct input_state *st, const struct message_input *mi);
+void input_state_unpack(const struct input_state *st, struct message_input *mi);
+
+void input_history_add(struct input_history *h, const struct input_state *st);
+struct input_state *input_history_find(struct input_history *h, uint16_t seq);
+
+/* @base NULL: encode in full; returns the size, @buf is INPUT_DELTA_MAX */
+size_t input_delta_encode(uint8_t *buf, const struct input_state *st, const struct input_state *base);
+/* size of the encoded delta at @buf, -EAGAIN if it's not all there */
+ssize_t input_delta_size(const uint8_t *buf, size_t size);
+/*
+ * Decode a delta against its base from @h and add the result to @h;
+ * returns the size consumed, -EAGAIN if it's short, -ENOENT if the base
+ * is not in @h (input_delta_size() tells how much to skip)
+ */
+ssize_t input_delta_decode(const uint8_t *buf, size_t size, struct input_state *st,
+                           struct input_history *h);
+
+#endif /* __CLAP_INPUT_DELTA_H__ */
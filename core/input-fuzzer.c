@@ -99,5 +99,5 @@ static int fuzzer_handle_command(struct message *m, void *data)
 
 void fuzzer_input_init(void)
 {
-    subscribe(MT_COMMAND, fuzzer_handle_command, NULL);
+    subscribe_mask(MT_COMMAND, fuzzer_handle_command, NULL, MSG_COMMAND(toggle_fuzzer));
 }
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "input-record.h"
+
+static struct message_source replay_source = {
+    .name = "replay",
+    .desc = "input recording",
+    .type = MST_REPLAY,
+};
+
+static struct input_recorder {
+    FILE            *f;
+    struct timespec start;
+    unsigned int    frame;
+    bool            subscribed;
+} rec;
+
+static struct input_replay {
+    FILE                *f;
+    struct input_record next;
+    bool                have_next;
+    unsigned int        frame;
+} replay;
+
+static size_t input_record_size(int type)
+{
+    switch (type) {
+    case MT_INPUT:
+        return sizeof(struct message_input);
+    case MT_COMMAND:
+        return sizeof(struct message_command);
+    default:
+        return 0;
+    }
+}
+
+static int input_record_message(struct message *m, void *data)
+{
+    struct input_record r;
+    struct timespec now, diff;
+
+    if (!rec.f)
+        return 0;
+
+    /* the rest of the commands come out of the inputs */
+    if (m->type == MT_COMMAND && !m->source)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_diff(&rec.start, &now, &diff);
+
+    r.frame = rec.frame;
+    r.type  = m->type;
+    r.size  = input_record_size(m->type);
+    r.ts_ns = (uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec;
+    if (fwrite(&r, sizeof(r), 1, rec.f) != 1 ||
+        fwrite(m->type == MT_INPUT ? (void *)&m->input : (void *)&m->cmd, r.size, 1, rec.f) != 1) {
+        warn("couldn't write the input recording, stopping it\n");
+        input_record_stop();
+    }
+
+    return 0;
+}
+
+static void input_record_seed(uint32_t seed)
+{
+    srand(seed);
+    srand48(seed);
+}
+
+int input_record_start(const char *path, uint32_t seed)
+{
+    struct input_record_hdr hdr = {
+        .magic   = INPUT_RECORD_MAGIC,
+        .version = INPUT_RECORD_VERSION,
+        .seed    = seed,
+    };
+
+    if (rec.f)
+        return -EBUSY;
+
+    rec.f = fopen(path, "wb");
+    if (!rec.f) {
+        err("couldn't create '%s': %m\n", path);
+        return -errno;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, rec.f) != 1) {
+        input_record_stop();
+        return -EIO;
+    }
+
+    /* there's no unsubscribing, these stay quiet without a recording */
+    if (!rec.subscribed) {
+        subscribe(MT_INPUT, input_record_message, NULL);
+        subscribe(MT_COMMAND, input_record_message, NULL);
+        rec.subscribed = true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &rec.start);
+    rec.frame = 0;
+    input_record_seed(seed);
+    msg("recording input to '%s', seed %u\n", path, seed);
+
+    return 0;
+}
+
+void input_record_stop(void)
+{
+    if (!rec.f)
+        return;
+
+    if (fclose(rec.f))
+        warn("couldn't write the input recording\n");
+    rec.f = NULL;
+}
+
+static bool input_replay_read(struct input_record *r)
+{
+    return fread(r, sizeof(*r), 1, replay.f) == 1 &&
+           r->size && r->size == input_record_size(r->type);
+}
+
+int input_replay_start(const char *path)
+{
+    struct input_record_hdr hdr;
+    unsigned int nr_frames = 0;
+    struct input_record r;
+    long data;
+
+    if (replay.f)
+        return -EBUSY;
+
+    replay.f = fopen(path, "rb");
+    if (!replay.f) {
+        err("couldn't open '%s': %m\n", path);
+        return -errno;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, replay.f) != 1 ||
+        memcmp(hdr.magic, INPUT_RECORD_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != INPUT_RECORD_VERSION)
+        goto err;
+
+    /* the whole thing may be hours long, only the headers are read up front */
+    data = ftell(replay.f);
+    while (input_replay_read(&r)) {
+        nr_frames = max(nr_frames, r.frame + 1);
+        if (fseek(replay.f, r.size, SEEK_CUR))
+            goto err;
+    }
+
+    if (!feof(replay.f) || fseek(replay.f, data, SEEK_SET))
+        goto err;
+
+    replay.have_next = input_replay_read(&replay.next);
+    replay.frame = 0;
+    input_record_seed(hdr.seed);
+    msg("replaying '%s': %u frames, seed %u\n", path, nr_frames, hdr.seed);
+
+    return nr_frames;
+
+err:
+    err("'%s' is not an input recording of this build\n", path);
+    input_replay_stop();
+
+    return -EINVAL;
+}
+
+void input_replay_stop(void)
+{
+    if (replay.f)
+        fclose(replay.f);
+    memset(&replay, 0, sizeof(replay));
+}
+
+bool input_replay_active(void)
+{
+    return !!replay.f;
+}
+
+static void input_replay_frame(void)
+{
+    struct message m;
+
+    /* what came before the first frame goes out with it */
+    while (replay.have_next && replay.next.frame <= replay.frame) {
+        memset(&m, 0, sizeof(m));
+        m.type   = replay.next.type;
+        m.source = &replay_source;
+        if (fread(m.type == MT_INPUT ? (void *)&m.input : (void *)&m.cmd,
+                  replay.next.size, 1, replay.f) != 1) {
+            replay.have_next = false;
+            break;
+        }
+
+        /* same as message_input_send() */
+        if (m.type == MT_INPUT) {
+            clock_gettime(CLOCK_MONOTONIC, &m.ts);
+            if (message_post(&m))
+                message_send(&m);
+        } else {
+            message_send(&m);
+        }
+
+        replay.have_next = input_replay_read(&replay.next);
+    }
+
+    if (!replay.have_next) {
+        msg("replay done after %u frames\n", replay.frame);
+        input_replay_stop();
+    }
+}
+
+void input_record_frame(void)
+{
+    if (rec.f)
+        rec.frame++;
+
+    if (replay.f) {
+        replay.frame++;
+        input_replay_frame();
+    }
+}
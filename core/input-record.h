@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_INPUT_RECORD_H__
+#define __CLAP_INPUT_RECORD_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "messagebus.h"
+
+/*
+ * Input recordings, for repeatable soak runs: the recorder writes every
+ * MT_INPUT and every MT_COMMAND that came from a message source (network)
+ * with the frame it was delivered in; the rest of the commands the engine
+ * makes out of the inputs, so replaying them would double them up. The
+ * replay feeds them back in the same frames, after seeding rand() and
+ * drand48() with the recording's seed, see clap_config::replay, which
+ * also runs it as a benchmark at its fixed step, see bench.h. Replays of
+ * the same recording see the same frames; to see the same ones as the
+ * recorded session, record it with a benchmark too.
+ *
+ *   struct input_record_hdr
+ *   struct input_record, followed by @size bytes of the message, ...
+ *
+ * The messages are as they are in memory, so the recordings only work
+ * with the build that made them (checked by the sizes).
+ */
+#define INPUT_RECORD_MAGIC      "CLAPINPR"
+#define INPUT_RECORD_VERSION    1
+
+struct input_record_hdr {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    seed;
+};
+
+struct input_record {
+    uint32_t    frame;
+    uint16_t    type;
+    uint16_t    size;
+    /* since the start of the recording */
+    uint64_t    ts_ns;
+};
+
+int input_record_start(const char *path, uint32_t seed);
+void input_record_stop(void);
+/* the number of frames in it or -errno */
+int input_replay_start(const char *path);
+void input_replay_stop(void);
+bool input_replay_active(void);
+/* once a frame, before messagebus_drain(), see clap_fps_calc() */
+void input_record_frame(void);
+
+#endif /* __CLAP_INPUT_RECORD_H__ */
@@ -15,6 +15,28 @@ static struct message_source keyboard_source = {
     .type   = MST_KEYBOARD,
 };
 
+#ifdef CONFIG_BROWSER_WORKER
+/*
+ * The DOM events are handled on the page's thread, which only posts them
+ * to the worker's messagebus; that also gets their return values in time
+ * to preventDefault()
+ */
+#define INPUT_THREAD EM_CALLBACK_THREAD_CONTEXT_MAIN_BROWSER_THREAD
+#else
+#define INPUT_THREAD EM_CALLBACK_THREAD_CONTEXT_CALLING_THREAD
+#endif /* CONFIG_BROWSER_WORKER */
+
+/* everything but the input messages, which message_input_send() takes care of */
+static void www_message_send(struct message *m)
+{
+#ifdef CONFIG_BROWSER_WORKER
+    if (message_post(m))
+        warn("dropping message %d\n", m->type);
+#else
+    message_send(m);
+#endif /* CONFIG_BROWSER_WORKER */
+}
+
 static inline const char *emscripten_event_type_to_string(int eventType)
 {
     const char *events[] = {"(invalid)", "(none)", "keypress", "keydown", "keyup", "click", "mousedown", "mouseup", "dblclick", "mousemove", "wheel", "resize",
@@ -223,7 +245,7 @@ static EM_BOOL touch_callback(int type, const EmscriptenTouchEvent *e, void *use
         memset(&m, 0, sizeof(m));
         m.type = MT_COMMAND;
         m.cmd.menu_enter = 1;
-        message_send(&m);
+        www_message_send(&m);
         return true;
     }
 
@@ -248,12 +270,16 @@ static EM_BOOL touch_callback(int type, const EmscriptenTouchEvent *e, void *use
     return true;
 }
 
+static int nr_gamepads;
+
+/* these stay on the thread that polls the joysticks */
 static EM_BOOL gamepad_callback(int type, const EmscriptenGamepadEvent *e, void *data)
 {
     dbg("### GAMEPAD event: connected: %d index: %d nr_axes: %d nr_buttons: %d id: '%s' mapping: '%s'\n",
        e->connected, e->index, e->numAxes, e->numButtons, e->id, e->mapping);
 
     joystick_name_update(e->index, e->connected ? e->id : NULL);
+    nr_gamepads += e->connected ? 1 : -1;
     if (e->connected) {
         EmscriptenGamepadEvent ge;
         int ret;
@@ -269,7 +295,7 @@ static EM_BOOL gamepad_callback(int type, const EmscriptenGamepadEvent *e, void
 }
 
 static struct touch touch;
-void www_touch_poll(void)
+static void touch_poll(void)
 {
     struct message_input mi;
     struct touchpoint *pt;
@@ -298,10 +324,26 @@ void www_touch_poll(void)
     message_input_send(&mi, &keyboard_source);
 }
 
+/* the touch points belong to the thread that handles the touch events */
+void www_touch_poll(void)
+{
+#ifdef CONFIG_BROWSER_WORKER
+    emscripten_async_run_in_main_runtime_thread(EM_FUNC_SIG_V, touch_poll);
+#else
+    touch_poll();
+#endif /* CONFIG_BROWSER_WORKER */
+}
+
 void www_joysticks_poll(void)
 {
     int i, nr_joys, ret;
 
+#ifdef CONFIG_BROWSER_WORKER
+    /* sampling is a synchronous round trip to the page */
+    if (nr_gamepads <= 0)
+        return;
+#endif /* CONFIG_BROWSER_WORKER */
+
     ret = emscripten_sample_gamepad_data();
     if (ret)
         return;
@@ -417,18 +459,18 @@ void touch_set_size(int width, int height)
 int platform_input_init(void)
 {
     list_init(&touch.head);
-    CHECK0(emscripten_set_keydown_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, key_callback));
-    CHECK0(emscripten_set_keyup_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, key_callback));
-    CHECK0(emscripten_set_touchstart_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchstart_callback));
-    CHECK0(emscripten_set_touchend_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchend_callback));
-    CHECK0(emscripten_set_touchmove_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touch_callback));
-    CHECK0(emscripten_set_touchcancel_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchend_callback));
+    CHECK0(emscripten_set_keydown_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, key_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_keyup_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, key_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_touchstart_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchstart_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_touchend_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchend_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_touchmove_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touch_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_touchcancel_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, &touch, 1, touchend_callback, INPUT_THREAD));
     CHECK0(emscripten_set_gamepadconnected_callback(NULL, 1, gamepad_callback));
     CHECK0(emscripten_set_gamepaddisconnected_callback(NULL, 1, gamepad_callback));
-    CHECK0(emscripten_set_wheel_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, wheel_callback));
+    CHECK0(emscripten_set_wheel_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, wheel_callback, INPUT_THREAD));
     // CHECK0(emscripten_set_scroll_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, scroll_callback));
-    CHECK0(emscripten_set_click_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, click_callback));
-    CHECK0(emscripten_set_mousemove_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, mousemove_callback));
-    CHECK0(emscripten_set_resize_callback("#canvas", 0, 1, resize_callback));
+    CHECK0(emscripten_set_click_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, click_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_mousemove_callback_on_thread(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, 1, mousemove_callback, INPUT_THREAD));
+    CHECK0(emscripten_set_resize_callback_on_thread("#canvas", 0, 1, resize_callback, INPUT_THREAD));
     return 0;
 }
@@ -5,6 +5,10 @@
 #include "messagebus.h"
 #include "input.h"
 
+/*
+ * Input is sampled whenever the platform gets to it, possibly many times
+ * a frame, so it's timestamped and queued for the next messagebus_drain()
+ */
 int message_input_send(struct message_input *mi, struct message_source *src)
 {
     struct message m = {
@@ -12,10 +16,18 @@ int message_input_send(struct message_input *mi, struct message_source *src)
         .source = src,
     };
 
+    clock_gettime(CLOCK_MONOTONIC, &m.ts);
     memcpy(&m.input, mi, sizeof(m.input));
-    message_send(&m);
+    if (!message_post(&m))
+        return true;
 
+#ifdef CONFIG_BROWSER_WORKER
+    /* the page's thread can't deliver it to the worker's subscribers */
+    return false;
+#else
+    message_send(&m);
     return true;
+#endif /* CONFIG_BROWSER_WORKER */
 }
 
 int input_init(void)
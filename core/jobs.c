@@ -0,0 +1,433 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "jobs.h"
+#include "logger.h"
+#include "util.h"
+
+struct job {
+    job_run_fn          fn;
+    void                *priv;
+    struct job_counter  *counter;
+    /* on the waiter list of the counter it's waiting for */
+    struct job          *next;
+};
+
+static void job_enqueue(struct job *job);
+
+#ifdef CONFIG_JOBS_THREADED
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __EMSCRIPTEN__
+/*
+ * Browser workers only start once the main thread yields to the event loop,
+ * which jobs_wait() doesn't; this must not exceed PTHREAD_POOL_SIZE
+ */
+#define JOBS_MAX_WORKERS 4
+#else
+#define JOBS_MAX_WORKERS 16
+#endif
+
+/* power of 2, so that the indices can wrap around */
+#define JOB_DEQUE_SIZE 1024
+
+/*
+ * The owner pushes and pops at the bottom (newest first, likely still in
+ * its cache), thieves take from the top (oldest first)
+ */
+struct job_deque {
+    pthread_mutex_t lock;
+    unsigned int    top;
+    unsigned int    bottom;
+    struct job      *jobs[JOB_DEQUE_SIZE];
+};
+
+static struct jobs {
+    pthread_t           workers[JOBS_MAX_WORKERS];
+    /* set before the workers start, doesn't change while they run */
+    unsigned int        nr_workers;
+    unsigned int        nr_started;
+    /* deques[0] is shared by the threads that aren't workers */
+    struct job_deque    deques[JOBS_MAX_WORKERS + 1];
+    atomic_uint         queued;
+    /* protects @sleeping and @exit */
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+    unsigned int        sleeping;
+    bool                exit;
+} jobs = {
+    .deques = { [0 ... JOBS_MAX_WORKERS] = { .lock = PTHREAD_MUTEX_INITIALIZER } },
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .wake   = PTHREAD_COND_INITIALIZER,
+};
+
+/* counters' @pending and @waiters */
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 0 for the threads that aren't workers */
+static _Thread_local unsigned int worker_id;
+
+static inline void job_counter_lock(void)
+{
+    pthread_mutex_lock(&counter_lock);
+}
+
+static inline void job_counter_unlock(void)
+{
+    pthread_mutex_unlock(&counter_lock);
+}
+
+#else /* !CONFIG_JOBS_THREADED */
+
+static inline void job_counter_lock(void) {}
+static inline void job_counter_unlock(void) {}
+
+#endif /* !CONFIG_JOBS_THREADED */
+
+void job_counter_init(struct job_counter *counter)
+{
+    atomic_init(&counter->pending, 0);
+    counter->waiters = NULL;
+}
+
+static void job_counter_inc(struct job_counter *counter)
+{
+    job_counter_lock();
+    atomic_fetch_add(&counter->pending, 1);
+    job_counter_unlock();
+}
+
+/*
+ * Once @pending drops to zero, whoever's waiting for it may free the
+ * counter, so take the waiters off it before that, under the lock
+ */
+static void job_counter_dec(struct job_counter *counter)
+{
+    struct job *waiters = NULL, *next;
+
+    job_counter_lock();
+    if (atomic_load(&counter->pending) == 1) {
+        waiters = counter->waiters;
+        counter->waiters = NULL;
+    }
+    atomic_fetch_sub(&counter->pending, 1);
+    job_counter_unlock();
+
+    for (; waiters; waiters = next) {
+        next = waiters->next;
+        job_enqueue(waiters);
+    }
+}
+
+static void job_run(struct job *job)
+{
+    struct job_counter *counter = job->counter;
+
+    job->fn(job->priv);
+    free(job);
+
+    if (counter)
+        job_counter_dec(counter);
+}
+
+int jobs_submit_after(job_run_fn fn, void *priv, struct job_counter *counter,
+                      struct job_counter *after)
+{
+    struct job *job;
+
+    job = malloc(sizeof(*job));
+    if (!job)
+        return -ENOMEM;
+
+    job->fn = fn;
+    job->priv = priv;
+    job->counter = counter;
+    job->next = NULL;
+
+    if (counter)
+        job_counter_inc(counter);
+
+    if (after) {
+        job_counter_lock();
+        if (atomic_load(&after->pending)) {
+            job->next = after->waiters;
+            after->waiters = job;
+            job = NULL;
+        }
+        job_counter_unlock();
+
+        /* job_counter_dec() will enqueue it */
+        if (!job)
+            return 0;
+    }
+
+    job_enqueue(job);
+
+    return 0;
+}
+
+int jobs_submit(job_run_fn fn, void *priv, struct job_counter *counter)
+{
+    return jobs_submit_after(fn, priv, counter, NULL);
+}
+
+#ifdef CONFIG_JOBS_THREADED
+
+static bool job_deque_push(struct job_deque *d, struct job *job)
+{
+    bool ret = false;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top < JOB_DEQUE_SIZE) {
+        d->jobs[d->bottom++ % JOB_DEQUE_SIZE] = job;
+        ret = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return ret;
+}
+
+static struct job *job_deque_pop(struct job_deque *d)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        job = d->jobs[--d->bottom % JOB_DEQUE_SIZE];
+    pthread_mutex_unlock(&d->lock);
+
+    return job;
+}
+
+static struct job *job_deque_steal(struct job_deque *d)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        job = d->jobs[d->top++ % JOB_DEQUE_SIZE];
+    pthread_mutex_unlock(&d->lock);
+
+    return job;
+}
+
+static void job_enqueue(struct job *job)
+{
+    /* nobody to hand it over to: do it here and now */
+    if (!jobs.nr_workers) {
+        job_run(job);
+        return;
+    }
+
+    /*
+     * Counted before it's published: a thief can take it out of the deque
+     * the moment it's there, and its decrement mustn't come first
+     */
+    atomic_fetch_add(&jobs.queued, 1);
+    if (!job_deque_push(&jobs.deques[worker_id], job)) {
+        /* no room */
+        atomic_fetch_sub(&jobs.queued, 1);
+        job_run(job);
+        return;
+    }
+
+    /* a worker going to sleep either sees this or gets the signal */
+    pthread_mutex_lock(&jobs.lock);
+    if (jobs.sleeping)
+        pthread_cond_signal(&jobs.wake);
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/* own jobs first, then steal from the others, starting with the next one */
+static struct job *job_find(void)
+{
+    unsigned int i, nr = jobs.nr_workers + 1;
+    struct job *job;
+
+    job = job_deque_pop(&jobs.deques[worker_id]);
+    for (i = 1; !job && i < nr; i++)
+        job = job_deque_steal(&jobs.deques[(worker_id + i) % nr]);
+
+    if (job)
+        atomic_fetch_sub(&jobs.queued, 1);
+
+    return job;
+}
+
+static void *jobs_worker(void *data)
+{
+    struct job *job;
+    bool exit;
+
+    worker_id = (uintptr_t)data;
+
+    for (;;) {
+        job = job_find();
+        if (job) {
+            job_run(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&jobs.lock);
+        while (!jobs.exit && !atomic_load(&jobs.queued)) {
+            jobs.sleeping++;
+            pthread_cond_wait(&jobs.wake, &jobs.lock);
+            jobs.sleeping--;
+        }
+        exit = jobs.exit;
+        pthread_mutex_unlock(&jobs.lock);
+
+        if (exit)
+            break;
+    }
+
+    return NULL;
+}
+
+void jobs_wait(struct job_counter *counter)
+{
+    struct job *job;
+
+    while (!job_counter_done(counter)) {
+        job = job_find();
+        if (job)
+            job_run(job);
+        else
+            sched_yield();
+    }
+}
+
+int jobs_init(unsigned int nr_workers)
+{
+    unsigned int i;
+
+    if (!nr_workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nr_workers = cpus > 1 ? cpus - 1 : 0;
+    }
+    nr_workers = min(nr_workers, JOBS_MAX_WORKERS);
+
+    /*
+     * deques[i + 1] belongs to workers[i]; if some of them fail to start,
+     * their deques stay empty and the rest get by without them
+     */
+    jobs.nr_workers = nr_workers;
+    for (i = 0; i < nr_workers; i++)
+        if (pthread_create(&jobs.workers[i], NULL, jobs_worker, (void *)(uintptr_t)(i + 1)))
+            break;
+
+    jobs.nr_started = i;
+    if (i < nr_workers)
+        warn("started %u out of %u workers\n", i, nr_workers);
+    dbg("jobs: %u workers\n", i);
+
+    if (nr_workers && !i) {
+        jobs.nr_workers = 0;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+void jobs_done(void)
+{
+    struct job *job;
+    unsigned int i;
+
+    pthread_mutex_lock(&jobs.lock);
+    jobs.exit = true;
+    pthread_cond_broadcast(&jobs.wake);
+    pthread_mutex_unlock(&jobs.lock);
+
+    for (i = 0; i < jobs.nr_started; i++)
+        pthread_join(jobs.workers[i], NULL);
+
+    /* whatever is left over runs here */
+    while ((job = job_find()))
+        job_run(job);
+
+    jobs.nr_workers = jobs.nr_started = 0;
+    jobs.exit = false;
+}
+
+unsigned int jobs_nr_workers(void)
+{
+    return jobs.nr_workers;
+}
+
+unsigned int jobs_nr_queued(void)
+{
+    return atomic_load(&jobs.queued);
+}
+
+#else /* !CONFIG_JOBS_THREADED */
+
+static void job_enqueue(struct job *job)
+{
+    job_run(job);
+}
+
+/* everything has already run, unless it's waiting for a counter that doesn't drop */
+void jobs_wait(struct job_counter *counter)
+{
+    err_on(!job_counter_done(counter), "waiting for jobs that will never run\n");
+}
+
+int jobs_init(unsigned int nr_workers)
+{
+    return 0;
+}
+
+void jobs_done(void)
+{
+}
+
+unsigned int jobs_nr_workers(void)
+{
+    return 0;
+}
+
+unsigned int jobs_nr_queued(void)
+{
+    return 0;
+}
+
+#endif /* !CONFIG_JOBS_THREADED */
+
+struct parallel_for {
+    job_fn          fn;
+    void            *priv;
+    unsigned int    nr;
+    atomic_uint     next;
+};
+
+static void parallel_for_job(void *data)
+{
+    struct parallel_for *pf = data;
+    unsigned int idx;
+
+    while ((idx = atomic_fetch_add(&pf->next, 1)) < pf->nr)
+        pf->fn(idx, pf->priv);
+}
+
+/* indices are handed out one by one to a job per worker and the calling thread */
+void jobs_parallel_for(unsigned int nr, job_fn fn, void *priv)
+{
+    struct parallel_for pf = { .fn = fn, .priv = priv, .nr = nr };
+    unsigned int i, nr_jobs = min(nr - !!nr, jobs_nr_workers());
+    struct job_counter counter;
+
+    atomic_init(&pf.next, 0);
+    job_counter_init(&counter);
+
+    for (i = 0; i < nr_jobs; i++)
+        if (jobs_submit(parallel_for_job, &pf, &counter))
+            break;
+
+    parallel_for_job(&pf);
+    jobs_wait(&counter);
+}
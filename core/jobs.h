@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_JOBS_H__
+#define __CLAP_JOBS_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * Work-stealing job system: each worker has a deque of jobs, pushes and
+ * pops its own at one end, idle workers steal from the other end. Threads
+ * that aren't workers (the main thread) share one more deque.
+ *
+ * Without pthreads (the browser build without SharedArrayBuffer), or with
+ * no workers, jobs run right away on the submitting thread, so the same
+ * code works either way.
+ */
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define CONFIG_JOBS_THREADED 1
+#endif
+
+struct job;
+
+/*
+ * Counts the unfinished jobs submitted against it; jobs can wait for it
+ * to drop to zero before starting, see jobs_submit_after()
+ */
+struct job_counter {
+    atomic_int      pending;
+    struct job      *waiters;
+};
+
+typedef void (*job_run_fn)(void *priv);
+typedef void (*job_fn)(unsigned int idx, void *priv);
+
+/* @nr_workers: 0 means one less than the number of CPUs */
+int jobs_init(unsigned int nr_workers);
+void jobs_done(void);
+unsigned int jobs_nr_workers(void);
+/* submitted to the workers and not picked up yet */
+unsigned int jobs_nr_queued(void);
+
+void job_counter_init(struct job_counter *counter);
+static inline bool job_counter_done(struct job_counter *counter)
+{
+    return !atomic_load(&counter->pending);
+}
+
+/* @counter may be NULL */
+int jobs_submit(job_run_fn fn, void *priv, struct job_counter *counter);
+/* same, but don't start before @after drops to zero */
+int jobs_submit_after(job_run_fn fn, void *priv, struct job_counter *counter,
+                      struct job_counter *after);
+/* run jobs while waiting for @counter to drop to zero */
+void jobs_wait(struct job_counter *counter);
+/*
+ * Call @fn for each of [0, @nr) on the workers and the calling thread,
+ * return when all of them are done
+ */
+void jobs_parallel_for(unsigned int nr, job_fn fn, void *priv);
+
+#endif /* __CLAP_JOBS_H__ */
@@ -114,6 +114,100 @@ static void sb_free(SB *sb)
 	free(sb->start);
 }
 
+/* Arena: bump allocator for json_decode_arena() and json_sax() */
+
+#define ARENA_CHUNK_MIN 4096
+#define ARENA_CHUNK_MAX (4 * 1024 * 1024)
+#define ARENA_ALIGN     _Alignof(JsonNode)
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk
+{
+	ArenaChunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(JsonNode) char data[];
+};
+
+typedef struct
+{
+	/* json_decode_arena() hands this out, so it has to come first */
+	JsonNode root;
+	/* newest first */
+	ArenaChunk *chunk;
+	size_t chunk_size;
+} Arena;
+
+/* json_sax() rewinds its scratch arena once it's done with a string */
+typedef struct
+{
+	ArenaChunk *chunk;
+	size_t used;
+} ArenaMark;
+
+static Arena *arena_new(size_t size_hint)
+{
+	Arena *arena = (Arena*) calloc(1, sizeof(Arena));
+	if (arena == NULL)
+		out_of_memory();
+	
+	arena->chunk_size = size_hint < ARENA_CHUNK_MIN ? ARENA_CHUNK_MIN :
+	                    size_hint > ARENA_CHUNK_MAX ? ARENA_CHUNK_MAX : size_hint;
+	return arena;
+}
+
+static void *arena_alloc(Arena *arena, size_t size)
+{
+	ArenaChunk *chunk = arena->chunk;
+	void *ret;
+	
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+		
+		chunk = (ArenaChunk*) malloc(sizeof(ArenaChunk) + chunk_size);
+		if (chunk == NULL)
+			out_of_memory();
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = arena->chunk;
+		arena->chunk = chunk;
+		
+		/* the more it takes, the fewer chunks it takes */
+		if (arena->chunk_size < ARENA_CHUNK_MAX)
+			arena->chunk_size *= 2;
+	}
+	
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+static ArenaMark arena_mark(Arena *arena)
+{
+	ArenaMark mark = { arena->chunk, arena->chunk ? arena->chunk->used : 0 };
+	return mark;
+}
+
+static void arena_rewind(Arena *arena, ArenaMark mark)
+{
+	ArenaChunk *next;
+	
+	for (; arena->chunk != mark.chunk; arena->chunk = next) {
+		next = arena->chunk->next;
+		free(arena->chunk);
+	}
+	if (arena->chunk != NULL)
+		arena->chunk->used = mark.used;
+}
+
+static void arena_free(Arena *arena)
+{
+	arena_rewind(arena, (ArenaMark) { NULL, 0 });
+	free(arena);
+}
+
 /*
  * Unicode helper functions
  *
@@ -328,11 +422,11 @@ static void to_surrogate_pair(uchar_t unicode, uint16_t *uc, uint16_t *lc)
 #define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
+static bool parse_value     (const char **sp, JsonNode        **out, Arena *arena);
+static bool parse_string    (const char **sp, char            **out, Arena *arena);
 static bool parse_number    (const char **sp, double           *out);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
+static bool parse_array     (const char **sp, JsonNode        **out, Arena *arena);
+static bool parse_object    (const char **sp, JsonNode        **out, Arena *arena);
 static bool parse_hex16     (const char **sp, uint16_t         *out);
 
 static bool expect_literal  (const char **sp, const char *str);
@@ -350,6 +444,7 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 static int write_hex16(char *out, uint16_t val);
 
 static JsonNode *mknode(JsonTag tag);
+static JsonNode *arena_mknode(Arena *arena, JsonTag tag);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
@@ -364,7 +459,7 @@ JsonNode *json_decode(const char *json)
 	JsonNode *ret;
 	
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
+	if (!parse_value(&s, &ret, NULL))
 		return NULL;
 	
 	skip_space(&s);
@@ -376,6 +471,37 @@ JsonNode *json_decode(const char *json)
 	return ret;
 }
 
+JsonNode *json_decode_arena(const char *json)
+{
+	const char *s = json;
+	JsonNode *ret, *child;
+	Arena *arena;
+	
+	/* about as much as the text itself takes, in a few chunks at most */
+	arena = arena_new(strlen(json));
+	
+	skip_space(&s);
+	if (!parse_value(&s, &ret, arena))
+		goto failure;
+	
+	skip_space(&s);
+	if (*s != 0)
+		goto failure;
+	
+	/* the root lives in the Arena, so that freeing it can find the chunks */
+	arena->root = *ret;
+	arena->root.arena = JSON_ARENA_ROOT;
+	if (ret->tag == JSON_ARRAY || ret->tag == JSON_OBJECT)
+		json_foreach(child, &arena->root)
+			child->parent = &arena->root;
+	
+	return &arena->root;
+
+failure:
+	arena_free(arena);
+	return NULL;
+}
+
 char *json_encode(const JsonNode *node)
 {
 	return json_stringify(node, NULL);
@@ -404,9 +530,27 @@ char *json_stringify(const JsonNode *node, const char *space)
 	return sb_finish(&sb);
 }
 
+/* nodes inside an arena tree only get unlinked, see json_decode_arena() */
+static bool arena_delete(JsonNode *node)
+{
+	switch (node->arena) {
+		case JSON_ARENA_ROOT:
+			arena_free((Arena*) node);
+			return true;
+		case JSON_ARENA_NODE:
+			json_remove_from_parent(node);
+			return true;
+		default:
+			return false;
+	}
+}
+
 void json_delete(JsonNode *node)
 {
 	if (node != NULL) {
+		if (arena_delete(node))
+			return;
+		
 		json_remove_from_parent(node);
 		
 		switch (node->tag) {
@@ -435,7 +579,7 @@ bool json_validate(const char *json)
 	const char *s = json;
 	
 	skip_space(&s);
-	if (!parse_value(&s, NULL))
+	if (!parse_value(&s, NULL, NULL))
 		return false;
 	
 	skip_space(&s);
@@ -445,6 +589,123 @@ bool json_validate(const char *json)
 	return true;
 }
 
+typedef struct
+{
+	json_sax_cb cb;
+	void *priv;
+	/* keys and strings, gone as soon as the callback is done with them */
+	Arena *scratch;
+} Sax;
+
+static bool sax_value(Sax *sax, const char **sp, const char *key, unsigned int depth)
+{
+	struct json_sax_event ev = { .key = key, .depth = depth };
+	const char *s = *sp;
+	ArenaMark mark;
+	char *str;
+	
+	switch (*s) {
+		case 'n':
+			if (!expect_literal(&s, "null"))
+				return false;
+			ev.tag = JSON_NULL;
+			break;
+		
+		case 'f':
+		case 't':
+			ev.tag = JSON_BOOL;
+			ev.bool_ = *s == 't';
+			if (!expect_literal(&s, ev.bool_ ? "true" : "false"))
+				return false;
+			break;
+		
+		case '"':
+			mark = arena_mark(sax->scratch);
+			if (!parse_string(&s, &str, sax->scratch))
+				return false;
+			ev.tag = JSON_STRING;
+			ev.string_ = str;
+			if (!sax->cb(&ev, sax->priv))
+				return false;
+			arena_rewind(sax->scratch, mark);
+			*sp = s;
+			return true;
+		
+		case '[':
+		case '{': {
+			bool object = *s++ == '{';
+			char end = object ? '}' : ']';
+			
+			ev.tag = object ? JSON_OBJECT : JSON_ARRAY;
+			if (!sax->cb(&ev, sax->priv))
+				return false;
+			
+			skip_space(&s);
+			if (*s == end)
+				goto container_end;
+			
+			for (;;) {
+				char *member = NULL;
+				
+				mark = arena_mark(sax->scratch);
+				if (object) {
+					if (!parse_string(&s, &member, sax->scratch))
+						return false;
+					skip_space(&s);
+					if (*s++ != ':')
+						return false;
+					skip_space(&s);
+				}
+				
+				if (!sax_value(sax, &s, member, depth + 1))
+					return false;
+				arena_rewind(sax->scratch, mark);
+				skip_space(&s);
+				
+				if (*s == end)
+					break;
+				if (*s++ != ',')
+					return false;
+				skip_space(&s);
+			}
+		
+		container_end:
+			s++;
+			ev.end = true;
+			break;
+		}
+		
+		default:
+			ev.tag = JSON_NUMBER;
+			if (!parse_number(&s, &ev.number_))
+				return false;
+			break;
+	}
+	
+	if (!sax->cb(&ev, sax->priv))
+		return false;
+	
+	*sp = s;
+	return true;
+}
+
+bool json_sax(const char *json, json_sax_cb cb, void *priv)
+{
+	Sax sax = { cb, priv, arena_new(0) };
+	const char *s = json;
+	bool ret;
+	
+	skip_space(&s);
+	ret = sax_value(&sax, &s, NULL, 0);
+	if (ret) {
+		skip_space(&s);
+		ret = *s == 0;
+	}
+	
+	arena_free(sax.scratch);
+	return ret;
+}
+
 JsonNode *json_find_element(JsonNode *array, int index)
 {
 	JsonNode *element;
@@ -504,6 +765,20 @@ JsonNode *json_mkbool(bool b)
 	return ret;
 }
 
+static JsonNode *arena_mknode(Arena *arena, JsonTag tag)
+{
+	JsonNode *ret;
+	
+	if (arena == NULL)
+		return mknode(tag);
+	
+	ret = (JsonNode*) arena_alloc(arena, sizeof(JsonNode));
+	memset(ret, 0, sizeof(*ret));
+	ret->tag = tag;
+	ret->arena = JSON_ARENA_NODE;
+	return ret;
+}
+
 static JsonNode *mkstring(char *s)
 {
 	JsonNode *ret = mknode(JSON_STRING);
@@ -612,7 +887,8 @@ void json_remove_from_parent(JsonNode *node)
 		else
 			parent->children.tail = node->prev;
 		
-		free(node->key);
+		if (node->arena == JSON_ARENA_NONE)
+			free(node->key);
 		
 		node->parent = NULL;
 		node->prev = node->next = NULL;
@@ -620,7 +896,7 @@ void json_remove_from_parent(JsonNode *node)
 	}
 }
 
-static bool parse_value(const char **sp, JsonNode **out)
+static bool parse_value(const char **sp, JsonNode **out, Arena *arena)
 {
 	const char *s = *sp;
 	
@@ -628,7 +904,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'n':
 			if (expect_literal(&s, "null")) {
 				if (out)
-					*out = json_mknull();
+					*out = arena_mknode(arena, JSON_NULL);
 				*sp = s;
 				return true;
 			}
@@ -637,7 +913,7 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'f':
 			if (expect_literal(&s, "false")) {
 				if (out)
-					*out = json_mkbool(false);
+					*out = arena_mknode(arena, JSON_BOOL);
 				*sp = s;
 				return true;
 			}
@@ -645,8 +921,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 		
 		case 't':
 			if (expect_literal(&s, "true")) {
-				if (out)
-					*out = json_mkbool(true);
+				if (out) {
+					*out = arena_mknode(arena, JSON_BOOL);
+					(*out)->bool_ = true;
+				}
 				*sp = s;
 				return true;
 			}
@@ -654,9 +932,11 @@ static bool parse_value(const char **sp, JsonNode **out)
 		
 		case '"': {
 			char *str;
-			if (parse_string(&s, out ? &str : NULL)) {
-				if (out)
-					*out = mkstring(str);
+			if (parse_string(&s, out ? &str : NULL, arena)) {
+				if (out) {
+					*out = arena_mknode(arena, JSON_STRING);
+					(*out)->string_ = str;
+				}
 				*sp = s;
 				return true;
 			}
@@ -664,14 +944,14 @@ static bool parse_value(const char **sp, JsonNode **out)
 		}
 		
 		case '[':
-			if (parse_array(&s, out)) {
+			if (parse_array(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
 			return false;
 		
 		case '{':
-			if (parse_object(&s, out)) {
+			if (parse_object(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
@@ -680,8 +960,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 		default: {
 			double num;
 			if (parse_number(&s, out ? &num : NULL)) {
-				if (out)
-					*out = json_mknumber(num);
+				if (out) {
+					*out = arena_mknode(arena, JSON_NUMBER);
+					(*out)->number_ = num;
+				}
 				*sp = s;
 				return true;
 			}
@@ -690,10 +972,10 @@ static bool parse_value(const char **sp, JsonNode **out)
 	}
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+static bool parse_array(const char **sp, JsonNode **out, Arena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkarray() : NULL;
+	JsonNode *ret = out ? arena_mknode(arena, JSON_ARRAY) : NULL;
 	JsonNode *element;
 	
 	if (*s++ != '[')
@@ -706,12 +988,12 @@ static bool parse_array(const char **sp, JsonNode **out)
 	}
 	
 	for (;;) {
-		if (!parse_value(&s, out ? &element : NULL))
+		if (!parse_value(&s, out ? &element : NULL, arena))
 			goto failure;
 		skip_space(&s);
 		
 		if (out)
-			json_append_element(ret, element);
+			append_node(ret, element);
 		
 		if (*s == ']') {
 			s++;
@@ -734,10 +1016,10 @@ failure:
 	return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+static bool parse_object(const char **sp, JsonNode **out, Arena *arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkobject() : NULL;
+	JsonNode *ret = out ? arena_mknode(arena, JSON_OBJECT) : NULL;
 	char *key;
 	JsonNode *value;
 	
@@ -751,7 +1033,7 @@ static bool parse_object(const char **sp, JsonNode **out)
 	}
 	
 	for (;;) {
-		if (!parse_string(&s, out ? &key : NULL))
+		if (!parse_string(&s, out ? &key : NULL, arena))
 			goto failure;
 		skip_space(&s);
 		
@@ -759,7 +1041,7 @@ static bool parse_object(const char **sp, JsonNode **out)
 			goto failure_free_key;
 		skip_space(&s);
 		
-		if (!parse_value(&s, out ? &value : NULL))
+		if (!parse_value(&s, out ? &value : NULL, arena))
 			goto failure_free_key;
 		skip_space(&s);
 		
@@ -783,25 +1065,41 @@ success:
 	return true;
 
 failure_free_key:
-	if (out)
+	if (out && arena == NULL)
 		free(key);
 failure:
 	json_delete(ret);
 	return false;
 }
 
-bool parse_string(const char **sp, char **out)
+/*
+ * Unescaping never makes a string longer, so with an arena, the raw
+ * length is enough room for it, and it goes straight there.
+ */
+static size_t raw_string_length(const char *s)
+{
+	const char *start = s;
+	
+	while (*s != '"' && *s != 0)
+		if (*s++ == '\\' && *s != 0)
+			s++;
+	return s - start;
+}
+
+bool parse_string(const char **sp, char **out, Arena *arena)
 {
 	const char *s = *sp;
 	SB sb;
 	char throwaway_buffer[4];
 		/* enough space for a UTF-8 character */
-	char *b;
+	char *b, *arena_str = NULL;
 	
 	if (*s++ != '"')
 		return false;
 	
-	if (out) {
+	if (out && arena) {
+		b = arena_str = (char*) arena_alloc(arena, raw_string_length(s) + 1);
+	} else if (out) {
 		sb_init(&sb);
 		sb_need(&sb, 4);
 		b = sb.cur;
@@ -884,7 +1182,9 @@ bool parse_string(const char **sp, char **out)
 		 * Update sb to know about the new bytes,
 		 * and set up b to write another character.
 		 */
-		if (out) {
+		if (arena_str) {
+			/* already has the room */
+		} else if (out) {
 			sb.cur = b;
 			sb_need(&sb, 4);
 			b = sb.cur;
@@ -894,13 +1194,17 @@ bool parse_string(const char **sp, char **out)
 	}
 	s++;
 	
-	if (out)
+	if (arena_str) {
+		*b = 0;
+		*out = arena_str;
+	} else if (out) {
 		*out = sb_finish(&sb);
+	}
 	*sp = s;
 	return true;
 
 failed:
-	if (out)
+	if (out && !arena_str)
 		sb_free(&sb);
 	return false;
 }
@@ -1452,6 +1756,13 @@ void json_free(JsonNode *root)
 	if (!root)
 		return;
 
+    /* the whole arena goes with its root, the rest with it */
+    if (root->arena != JSON_ARENA_NONE) {
+        if (root->arena == JSON_ARENA_ROOT)
+            arena_free((Arena *)root);
+        return;
+    }
+
     free(root->key);
 	switch (root->tag) {
 		case JSON_OBJECT:
@@ -48,6 +48,10 @@ struct JsonNode
 	char *key; /* Must be valid UTF-8. */
 	
 	JsonTag tag;
+	
+	/* JSON_ARENA_*: where the node and its strings came from */
+	unsigned char arena;
+	
 	union {
 		/* JSON_BOOL */
 		bool bool_;
@@ -69,6 +73,7 @@ struct JsonNode
 /*** Encoding, decoding, and validation ***/
 
 JsonNode   *json_decode         (const char *json);
+JsonNode   *json_decode_arena   (const char *json);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
@@ -76,6 +81,43 @@ void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
 
+/*
+ * json_decode_arena() allocates all the nodes and strings of a document
+ * from one bump allocator instead of malloc()ing each of them, which is
+ * what loaders want: json_free() or json_delete() on the root drops it
+ * all at once. Such a tree is for reading: json_delete() on a node inside
+ * it only unlinks it, and nodes appended to it are not freed with it.
+ */
+enum {
+	JSON_ARENA_NONE = 0,
+	JSON_ARENA_NODE,
+	JSON_ARENA_ROOT,
+};
+
+/*
+ * Streaming (SAX) parsing: no tree at all, @cb gets called for each value
+ * in document order; arrays and objects get called twice, with @end false
+ * before their contents and true after them. @key is set for members of
+ * objects; @key and @string_ are only valid during the call. Returning
+ * false from @cb stops the parsing, and json_sax() returns false, same as
+ * on a syntax error.
+ */
+struct json_sax_event {
+	JsonTag		tag;
+	const char	*key;
+	unsigned int	depth;
+	bool		end;
+	union {
+		bool		bool_;
+		const char	*string_;
+		double		number_;
+	};
+};
+
+typedef bool (*json_sax_cb)(const struct json_sax_event *ev, void *priv);
+
+bool        json_sax            (const char *json, json_sax_cb cb, void *priv);
+
 /*** Lookup and traversal ***/
 
 JsonNode   *json_find_element   (JsonNode *array, int index);
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "ktx2.h"
+#include "util.h"
+
+static const unsigned char ktx2_magic[12] = {
+    0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+};
+
+struct ktx2_header {
+    unsigned char   magic[12];
+    uint32_t        vk_format;
+    uint32_t        type_size;
+    uint32_t        width;
+    uint32_t        height;
+    uint32_t        depth;
+    uint32_t        nr_layers;
+    uint32_t        nr_faces;
+    uint32_t        nr_levels;
+    uint32_t        supercompression;
+    uint32_t        dfd_off;
+    uint32_t        dfd_len;
+    uint32_t        kvd_off;
+    uint32_t        kvd_len;
+    uint64_t        sgd_off;
+    uint64_t        sgd_len;
+} __attribute__((packed));
+
+struct ktx2_level_index {
+    uint64_t        off;
+    uint64_t        len;
+    uint64_t        uncompressed_len;
+};
+
+/* VkFormat values of the block compressed formats that GL can take directly */
+static const struct {
+    uint32_t            vk_format;
+    enum ktx2_format    format;
+    bool                srgb;
+} ktx2_formats[] = {
+    { 131, KTX2_BC1_RGB,    false },
+    { 132, KTX2_BC1_RGB,    true },
+    { 133, KTX2_BC1_RGBA,   false },
+    { 134, KTX2_BC1_RGBA,   true },
+    { 137, KTX2_BC3,        false },
+    { 138, KTX2_BC3,        true },
+    { 145, KTX2_BC7,        false },
+    { 146, KTX2_BC7,        true },
+    { 147, KTX2_ETC2_RGB,   false },
+    { 148, KTX2_ETC2_RGB,   true },
+    { 151, KTX2_ETC2_RGBA,  false },
+    { 152, KTX2_ETC2_RGBA,  true },
+    { 157, KTX2_ASTC_4x4,   false },
+    { 158, KTX2_ASTC_4x4,   true },
+};
+
+/* bytes in a 4x4 block */
+static const unsigned int ktx2_block_size[KTX2_FORMAT_MAX] = {
+    [KTX2_BC1_RGB]      = 8,
+    [KTX2_BC1_RGBA]     = 8,
+    [KTX2_BC3]          = 16,
+    [KTX2_BC7]          = 16,
+    [KTX2_ETC2_RGB]     = 8,
+    [KTX2_ETC2_RGBA]    = 16,
+    [KTX2_ASTC_4x4]     = 16,
+};
+
+bool ktx2_is_ktx2(const void *buf, size_t size)
+{
+    return size >= sizeof(ktx2_magic) && !memcmp(buf, ktx2_magic, sizeof(ktx2_magic));
+}
+
+int ktx2_parse(const void *buf, size_t size, struct ktx2_image *img)
+{
+    const struct ktx2_header *hdr = buf;
+    struct ktx2_level_index li;
+    unsigned int i, w, h;
+
+    if (size < sizeof(*hdr) || !ktx2_is_ktx2(buf, size))
+        return -EINVAL;
+
+    if (hdr->supercompression || !hdr->vk_format) {
+        warn("KTX2: supercompressed or Basis texture, needs a transcoder\n");
+        return -ENOTSUP;
+    }
+
+    if (hdr->depth || hdr->nr_layers || hdr->nr_faces != 1 || !hdr->width || !hdr->height) {
+        warn("KTX2: only 2D textures are supported\n");
+        return -ENOTSUP;
+    }
+
+    for (i = 0; i < array_size(ktx2_formats); i++)
+        if (ktx2_formats[i].vk_format == hdr->vk_format)
+            break;
+
+    if (i == array_size(ktx2_formats)) {
+        warn("KTX2: unsupported VkFormat %u\n", hdr->vk_format);
+        return -ENOTSUP;
+    }
+
+    memset(img, 0, sizeof(*img));
+    img->format    = ktx2_formats[i].format;
+    img->srgb      = ktx2_formats[i].srgb;
+    img->width     = hdr->width;
+    img->height    = hdr->height;
+    /* 0 means "make your own mips", which we don't */
+    img->nr_levels = hdr->nr_levels ? : 1;
+    if (img->nr_levels > KTX2_MAX_LEVELS ||
+        sizeof(*hdr) + img->nr_levels * sizeof(li) > size)
+        return -EINVAL;
+
+    for (i = 0; i < img->nr_levels; i++) {
+        /* the index can be unaligned, after the packed header */
+        memcpy(&li, buf + sizeof(*hdr) + i * sizeof(li), sizeof(li));
+        w = hdr->width >> i ? : 1;
+        h = hdr->height >> i ? : 1;
+
+        if (li.off > size || li.len > size - li.off ||
+            li.len != (size_t)((w + 3) / 4) * ((h + 3) / 4) * ktx2_block_size[img->format])
+            return -EINVAL;
+
+        img->levels[i].data = buf + li.off;
+        img->levels[i].size = li.len;
+    }
+
+    return 0;
+}
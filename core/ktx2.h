@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_KTX2_H__
+#define __CLAP_KTX2_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * KTX2 containers of GPU compressed textures: 2D, one layer, one face, a
+ * mip chain of 4x4 blocks in one of the formats below, which go to GL as
+ * they are, see texture_load_ktx2(). Supercompressed ones (BasisLZ, zstd)
+ * and UASTC need transcoding into whatever the GPU takes, and there's no
+ * Basis transcoder here, so those are -ENOTSUP: encode them to a GPU format
+ * offline instead (toktx, basisu -unpack).
+ */
+enum ktx2_format {
+    KTX2_BC1_RGB = 0,
+    KTX2_BC1_RGBA,
+    KTX2_BC3,
+    KTX2_BC7,
+    KTX2_ETC2_RGB,
+    KTX2_ETC2_RGBA,
+    KTX2_ASTC_4x4,
+    KTX2_FORMAT_MAX
+};
+
+#define KTX2_MAX_LEVELS 16
+
+struct ktx2_level {
+    const void      *data;
+    size_t          size;
+};
+
+struct ktx2_image {
+    enum ktx2_format    format;
+    bool                srgb;
+    unsigned int        width;
+    unsigned int        height;
+    unsigned int        nr_levels;
+    /* [0] is the full size one; these point into the container */
+    struct ktx2_level   levels[KTX2_MAX_LEVELS];
+};
+
+bool ktx2_is_ktx2(const void *buf, size_t size);
+/* -EINVAL if it's broken, -ENOTSUP if it's not one of the above */
+int ktx2_parse(const void *buf, size_t size, struct ktx2_image *img);
+
+#endif /* __CLAP_KTX2_H__ */
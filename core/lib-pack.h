@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_LIB_PACK_H__
+#define __CLAP_LIB_PACK_H__
+
+#include <stdint.h>
+
+/*
+ * Asset pack: what compile-time/pack_assets makes of an asset directory,
+ * so that the web build downloads (and the librarian opens) one file
+ * instead of a tree of them. When there's a LIB_PACK_NAME next to asset/,
+ * the librarian looks up the assets' and shaders' paths in it first:
+ *
+ *   struct lib_pack_hdr
+ *   struct lib_pack_entry[nr_entries]     sorted by name
+ *   names: NUL-terminated, relative to the base URL ("asset/scene.json")
+ *   data: each entry as is or zlib compressed, LIB_PACK_ALIGN aligned
+ *
+ * Every entry is read with one pread() of its range, so the rest of the
+ * pack is never touched. Offsets are from the start of the file. Everything
+ * is in native byte order.
+ */
+#define LIB_PACK_MAGIC      "CLAPPACK"
+#define LIB_PACK_VERSION    1
+#define LIB_PACK_ALIGN      16
+#define LIB_PACK_NAME       "asset.pack"
+
+enum lib_pack_compression {
+    LIB_PACK_STORED = 0,
+    LIB_PACK_ZLIB,
+};
+
+struct lib_pack_hdr {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    nr_entries;
+    uint64_t    names_off;
+    uint64_t    names_size;
+};
+
+struct lib_pack_entry {
+    uint64_t    offset;
+    /* in the pack */
+    uint64_t    packed_size;
+    /* once it's uncompressed */
+    uint64_t    size;
+    /* into the names */
+    uint32_t    name_off;
+    uint32_t    compression;
+};
+
+#endif /* __CLAP_LIB_PACK_H__ */
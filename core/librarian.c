@@ -1,12 +1,20 @@
 // SPDX-License-Identifier: Apache-2.0
 #define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 #include "common.h"
+#include "jobs.h"
 #include "librarian.h"
+#include "lib-pack.h"
 #include "json.h"
 
 #if defined(CONFIG_BROWSER) && 0
@@ -44,10 +52,15 @@ static void handle_drop(struct ref *ref)
     struct lib_handle *h = container_of(ref, struct lib_handle, ref);
 
     dbg("dropping handle %s\n", h->name);
-    free(h->buf);
+    if (h->buf)
+        mem_account(MEM_LIB, -(ssize_t)h->size);
+    if (h->mapped)
+        munmap(h->buf, h->size);
+    else
+        free(h->buf);
 }
 
-DECLARE_REFCLASS_DROP(lib_handle, handle_drop);
+DECLARE_REFCLASS_DROP(lib_handle, handle_drop, .pooled = true);
 
 char *lib_figure_uri(enum res_type type, const char *name)
 {
@@ -68,6 +81,177 @@ char *lib_figure_uri(enum res_type type, const char *name)
     return ret == -1 ? NULL : uri;
 }
 
+/*
+ * The asset pack, see lib-pack.h: opened in librarian_init() and read-only
+ * after that, so the jobs can pread() from it without locking
+ */
+static struct lib_pack {
+    int                     fd;
+    unsigned int            nr_entries;
+    struct lib_pack_entry   *entries;
+    char                    *names;
+    struct stat             st;
+} lib_pack = { .fd = -1 };
+
+static void lib_pack_close(void)
+{
+    if (lib_pack.fd >= 0)
+        close(lib_pack.fd);
+    free(lib_pack.entries);
+    free(lib_pack.names);
+    memset(&lib_pack, 0, sizeof(lib_pack));
+    lib_pack.fd = -1;
+}
+
+static int lib_pack_open(void)
+{
+    struct lib_pack_hdr hdr;
+    LOCAL(char, uri);
+    size_t size;
+    int i;
+
+    if (asprintf(&uri, "%s" LIB_PACK_NAME, base_url) == -1)
+        return -ENOMEM;
+
+    /* no pack is the usual case */
+    lib_pack.fd = open(uri, O_RDONLY);
+    if (lib_pack.fd < 0)
+        return -ENOENT;
+
+    if (fstat(lib_pack.fd, &lib_pack.st) ||
+        pread(lib_pack.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, LIB_PACK_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != LIB_PACK_VERSION ||
+        hdr.names_off > lib_pack.st.st_size ||
+        hdr.names_size > lib_pack.st.st_size - hdr.names_off ||
+        !hdr.names_size ||
+        hdr.nr_entries > lib_pack.st.st_size / sizeof(*lib_pack.entries))
+        goto err;
+
+    size = (size_t)hdr.nr_entries * sizeof(*lib_pack.entries);
+    lib_pack.entries = malloc(size);
+    lib_pack.names = malloc(hdr.names_size);
+    if (!lib_pack.entries || !lib_pack.names ||
+        pread(lib_pack.fd, lib_pack.entries, size, sizeof(hdr)) != size ||
+        pread(lib_pack.fd, lib_pack.names, hdr.names_size, hdr.names_off) != hdr.names_size)
+        goto err;
+
+    /* lookups don't check any of this */
+    lib_pack.names[hdr.names_size - 1] = 0;
+    for (i = 0; i < hdr.nr_entries; i++) {
+        struct lib_pack_entry *e = &lib_pack.entries[i];
+
+        if (e->name_off >= hdr.names_size || e->offset > lib_pack.st.st_size ||
+            e->packed_size > lib_pack.st.st_size - e->offset ||
+            e->compression > LIB_PACK_ZLIB ||
+            (e->compression == LIB_PACK_STORED && e->packed_size != e->size) ||
+            (i && strcmp(lib_pack.names + lib_pack.entries[i - 1].name_off,
+                         lib_pack.names + e->name_off) >= 0))
+            goto err;
+    }
+
+    lib_pack.nr_entries = hdr.nr_entries;
+    dbg("opened '%s': %u entries\n", uri, lib_pack.nr_entries);
+
+    return 0;
+
+err:
+    err("'%s' is not a valid asset pack, ignoring it\n", uri);
+    lib_pack_close();
+
+    return -EINVAL;
+}
+
+static int lib_pack_cmp(const void *key, const void *elt)
+{
+    const struct lib_pack_entry *e = elt;
+
+    return strcmp(key, lib_pack.names + e->name_off);
+}
+
+/* @uri comes from lib_figure_uri() */
+static const struct lib_pack_entry *lib_pack_find(const char *uri)
+{
+    size_t len = strlen(base_url);
+
+    if (lib_pack.fd < 0 || strncmp(uri, base_url, len))
+        return NULL;
+
+    return bsearch(uri + len, lib_pack.entries, lib_pack.nr_entries,
+                   sizeof(*lib_pack.entries), lib_pack_cmp);
+}
+
+/* same as lib_read_uri() */
+static int lib_pack_read(const struct lib_pack_entry *e, void **bufp, size_t *szp)
+{
+    uLongf size = e->size;
+    void *buf, *packed;
+    int ret = -EIO;
+
+    buf = calloc(1, e->size + 1);
+    if (!buf)
+        return -ENOMEM;
+
+    if (e->compression == LIB_PACK_STORED) {
+        if (pread(lib_pack.fd, buf, e->size, e->offset) == e->size)
+            ret = 0;
+    } else {
+        packed = malloc(e->packed_size);
+        if (!packed) {
+            ret = -ENOMEM;
+        } else if (pread(lib_pack.fd, packed, e->packed_size, e->offset) == e->packed_size &&
+                   uncompress(buf, &size, packed, e->packed_size) == Z_OK && size == e->size) {
+            ret = 0;
+        }
+        free(packed);
+    }
+
+    if (ret) {
+        err("couldn't read '%s' from the asset pack\n", lib_pack.names + e->name_off);
+        free(buf);
+        return ret;
+    }
+
+    *bufp = buf;
+    *szp = e->size;
+
+    return 0;
+}
+
+/* read all of @uri into a NUL-terminated buffer */
+static int lib_read_uri(const char *uri, void **bufp, size_t *szp)
+{
+    const struct lib_pack_entry *e = lib_pack_find(uri);
+    LOCAL(FILE, f);
+    struct stat st;
+    void *buf;
+
+    if (e)
+        return lib_pack_read(e, bufp, szp);
+
+    f = fopen(uri, "r");
+    dbg("opened '%s': %p\n", uri, f);
+    if (!f) {
+        err("couldn't open '%s': %m\n", uri);
+        return -ENOENT;
+    }
+
+    fstat(fileno(f), &st);
+    buf = calloc(1, st.st_size + 1);
+    if (!buf)
+        return -ENOMEM;
+
+    if (st.st_size && fread(buf, st.st_size, 1, f) != 1) {
+        free(buf);
+        return -EIO;
+    }
+
+    *bufp = buf;
+    *szp = st.st_size;
+
+    return 0;
+}
+
 #if defined(CONFIG_BROWSER) && 0
 static void lib_onload(void *arg, void *buf, int size)
 {
@@ -105,7 +289,7 @@ struct lib_handle *lib_request(enum res_type type, const char *name, lib_complet
 {
     struct lib_handle *h;
     LOCAL(char, uri);
-    LOCAL(FILE, f);
+    int ret;
 
     uri = lib_figure_uri(type, name);
     if (!uri)
@@ -119,24 +303,14 @@ struct lib_handle *lib_request(enum res_type type, const char *name, lib_complet
     h->state = RES_REQUESTED;
 
     h = ref_get(h); /* matches ref_put() in lib_onload() */
-    f = fopen(uri, "r");
-    dbg("opened '%s': %p\n", uri, f);
-    if (!f) {
-        err("couldn't open '%s': %m\n", uri);
+    ret = lib_read_uri(uri, &h->buf, &h->size);
+    if (ret == -ENOENT) {
         h->state = RES_ERROR;
+    } else if (ret) {
+        ref_put(h);
+        return NULL;
     } else {
-        struct stat st;
-
-        fstat(fileno(f), &st);
-        h->buf = malloc(st.st_size + 1);
-
-        if (fread(h->buf, st.st_size, 1, f) != 1) {
-            ref_put(h);
-            return NULL;
-        }
-
-        *((char *)h->buf + st.st_size) = 0;
-        h->size = st.st_size;
+        mem_account(MEM_LIB, h->size);
         h->state = RES_LOADED;
     }
     cb(h, data);
@@ -145,6 +319,217 @@ struct lib_handle *lib_request(enum res_type type, const char *name, lib_complet
 }
 #endif
 
+/*
+ * Asynchronous requests: queued by priority on the main thread, a limited
+ * number of them at a time are read (and optionally decoded) by jobs; the
+ * main thread picks up the results in librarian_poll() and calls the
+ * completions there. Requests for a URI that's already queued or being
+ * read share its handle (and the first request's @decode).
+ */
+struct lib_waiter {
+    lib_complete_fn     func;
+    void                *data;
+    struct lib_waiter   *next;
+};
+
+struct lib_async {
+    struct lib_handle   *h;
+    char                *uri;
+    lib_decode_fn       decode;
+    struct lib_waiter   *waiters;
+    /* set by the job when it's done with the handle */
+    atomic_bool         done;
+    struct list         entry;
+};
+
+static struct list lib_queue[LIB_PRIO_MAX] = {
+    EMPTY_LIST(lib_queue[LIB_PRIO_HIGH]),
+    EMPTY_LIST(lib_queue[LIB_PRIO_NORMAL]),
+    EMPTY_LIST(lib_queue[LIB_PRIO_LOW]),
+};
+static DECLARE_LIST(lib_inflight);
+static unsigned int nr_inflight;
+
+static void lib_decode_job(void *priv)
+{
+    struct lib_async *la = priv;
+    struct lib_handle *h = la->h;
+
+    if (la->decode(h, h->data))
+        h->state = RES_ERROR;
+
+    atomic_store(&la->done, true);
+}
+
+/* I/O and decoding are separate jobs, so reads don't queue up behind decoding */
+static void lib_read_job(void *priv)
+{
+    struct lib_async *la = priv;
+    struct lib_handle *h = la->h;
+
+    h->state = lib_read_uri(la->uri, &h->buf, &h->size) ? RES_ERROR : RES_LOADED;
+    if (h->state == RES_LOADED)
+        mem_account(MEM_LIB, h->size);
+
+    if (h->state == RES_LOADED && la->decode &&
+        !jobs_submit(lib_decode_job, la, NULL))
+        return;
+
+    atomic_store(&la->done, true);
+}
+
+static struct lib_async *lib_async_find(const char *uri)
+{
+    struct lib_async *la;
+    int prio;
+
+    list_for_each_entry(la, &lib_inflight, entry)
+        if (!strcmp(la->uri, uri))
+            return la;
+
+    for (prio = 0; prio < LIB_PRIO_MAX; prio++)
+        list_for_each_entry(la, &lib_queue[prio], entry)
+            if (!strcmp(la->uri, uri))
+                return la;
+
+    return NULL;
+}
+
+/* keep the workers busy, but leave them room for other jobs */
+static void lib_dispatch(void)
+{
+    unsigned int max_inflight = jobs_nr_workers() + 1;
+    struct lib_async *la;
+    int prio;
+
+    for (prio = 0; prio < LIB_PRIO_MAX && nr_inflight < max_inflight; prio++)
+        while (!list_empty(&lib_queue[prio]) && nr_inflight < max_inflight) {
+            la = list_first_entry(&lib_queue[prio], struct lib_async, entry);
+            list_del(&la->entry);
+            list_append(&lib_inflight, &la->entry);
+            nr_inflight++;
+
+            if (jobs_submit(lib_read_job, la, NULL))
+                lib_read_job(la);
+        }
+}
+
+static void lib_async_complete(struct lib_async *la)
+{
+    struct lib_waiter *w, *next;
+
+    /* each waiter's callback drops its reference */
+    for (w = la->waiters; w; w = next) {
+        next = w->next;
+        w->func(la->h, w->data);
+        free(w);
+    }
+
+    ref_put(la->h);
+    free(la->uri);
+    free(la);
+}
+
+struct lib_handle *
+lib_request_async(enum res_type type, const char *name, enum lib_priority prio,
+                  lib_decode_fn decode, lib_complete_fn cb, void *data)
+{
+    struct lib_waiter *w, **lastp;
+    struct lib_async *la;
+    char *uri;
+
+    uri = lib_figure_uri(type, name);
+    if (!uri)
+        return NULL;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+        goto err_uri;
+
+    w->func = cb;
+    w->data = data;
+
+    la = lib_async_find(uri);
+    if (la) {
+        free(uri);
+        /* completions are called in the order of requests */
+        for (lastp = &la->waiters; *lastp; lastp = &(*lastp)->next)
+            ;
+        *lastp = w;
+        ref_get(la->h); /* matches ref_put() in the completion */
+        return ref_get(la->h);
+    }
+
+    la = calloc(1, sizeof(*la));
+    if (!la)
+        goto err_waiter;
+
+    la->h = ref_new(lib_handle);
+    if (!la->h)
+        goto err_async;
+
+    la->h->name  = name;
+    la->h->type  = type;
+    la->h->data  = data;
+    la->h->func  = cb;
+    la->h->state = RES_REQUESTED;
+    la->uri      = uri;
+    la->decode   = decode;
+    la->waiters  = w;
+    atomic_init(&la->done, false);
+    list_append(&lib_queue[clamp(prio, LIB_PRIO_HIGH, LIB_PRIO_LOW)], &la->entry);
+
+    lib_dispatch();
+
+    ref_get(la->h); /* matches ref_put() in the completion */
+    return ref_get(la->h);
+
+err_async:
+    free(la);
+err_waiter:
+    free(w);
+err_uri:
+    free(uri);
+
+    return NULL;
+}
+
+static unsigned long lib_elapsed_us(struct timespec *start)
+{
+    struct timespec now, diff;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_diff(start, &now, &diff);
+
+    return diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/*
+ * Deliver finished requests on the main thread until @budget_us runs out;
+ * whatever is left waits for the next frame
+ */
+void librarian_poll(unsigned long budget_us)
+{
+    struct lib_async *la, *itla;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    list_for_each_entry_iter(la, itla, &lib_inflight, entry) {
+        if (!atomic_load(&la->done))
+            continue;
+
+        list_del(&la->entry);
+        nr_inflight--;
+        lib_async_complete(la);
+
+        if (lib_elapsed_us(&start) >= budget_us)
+            break;
+    }
+
+    lib_dispatch();
+}
+
 void lib_release(struct lib_handle *h)
 {
     free(h->data);
@@ -160,8 +545,7 @@ struct lib_handle *lib_read_file(enum res_type type, const char *name, void **bu
 {
     struct lib_handle *h;
     LOCAL(char, uri);
-    LOCAL(FILE, f);
-    int ret = 0;
+    int ret;
 
     uri = lib_figure_uri(type, name);
     if (!uri)
@@ -175,25 +559,16 @@ struct lib_handle *lib_read_file(enum res_type type, const char *name, void **bu
     h->state = RES_REQUESTED;
 
     h = ref_get(h); /* matches ref_put() in lib_onload() */
-    f = fopen(uri, "r");
-    if (!f) {
-        err("couldn't open '%s': %m\n", uri);
+    ret = lib_read_uri(uri, &h->buf, &h->size);
+    if (ret == -ENOENT) {
         h->state = RES_ERROR;
-        ret = -1;
+    } else if (ret) {
+        ref_put(h);
+        return NULL;
     } else {
-        struct stat st;
-
-        fstat(fileno(f), &st);
-        h->buf = calloc(1, st.st_size + 1);
         *bufp = h->buf;
-
-        if (fread(h->buf, st.st_size, 1, f) != 1) {
-            ref_put(h);
-            return NULL;
-        }
-
-        h->size = st.st_size;
         *szp = h->size;
+        mem_account(MEM_LIB, h->size);
         h->state = RES_LOADED;
     }
     ref_put(h);
@@ -201,10 +576,215 @@ struct lib_handle *lib_read_file(enum res_type type, const char *name, void **bu
     return ret ? NULL : h;
 }
 
+/*
+ * Like lib_read_file(), but @buf points into a read-only mapping of the file
+ * instead of a copy, which is dropped with the handle; unlike with the
+ * former, the contents are not NUL-terminated, so this is for binary data
+ */
+struct lib_handle *lib_map_file(enum res_type type, const char *name, void **bufp, size_t *szp)
+{
+#ifndef CONFIG_BROWSER
+    struct lib_handle *h;
+    LOCAL(char, uri);
+    struct stat st;
+    void *buf;
+    int fd;
+
+    uri = lib_figure_uri(type, name);
+    if (!uri)
+        return NULL;
+
+    /* entries may be compressed or unaligned, no mapping those */
+    if (lib_pack_find(uri))
+        goto fallback;
+
+    fd = open(uri, O_RDONLY);
+    if (fd < 0) {
+        err("couldn't open '%s': %m\n", uri);
+        return NULL;
+    }
+
+    /* can't map an empty file */
+    if (fstat(fd, &st) || !st.st_size) {
+        close(fd);
+        goto fallback;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        warn("couldn't map '%s': %m\n", uri);
+        goto fallback;
+    }
+
+    h = ref_new(lib_handle);
+    if (!h) {
+        munmap(buf, st.st_size);
+        return NULL;
+    }
+
+    h->name   = name;
+    h->type   = type;
+    h->buf    = buf;
+    h->size   = st.st_size;
+    h->mapped = true;
+    h->state  = RES_LOADED;
+    mem_account(MEM_LIB, h->size);
+    *bufp = h->buf;
+    *szp = h->size;
+
+    return h;
+
+fallback:
+#endif /* CONFIG_BROWSER */
+    return lib_read_file(type, name, bufp, szp);
+}
+
+#define LIB_CACHE_DIR "cache"
+
+void lib_cache_key(char *key, const char *kind, unsigned int version, SHA1_CTX *ctx)
+{
+    unsigned char digest[20];
+    int i, pos;
+
+    SHA1Final(digest, ctx);
+    pos = snprintf(key, LIB_CACHE_KEY_MAX, "%s-%u-", kind, version);
+    for (i = 0; i < sizeof(digest) && pos + 2 < LIB_CACHE_KEY_MAX; i++)
+        pos += snprintf(key + pos, LIB_CACHE_KEY_MAX - pos, "%02x", digest[i]);
+}
+
+void lib_cache_key64(char *key, const char *kind, unsigned int version, uint64_t hash)
+{
+    snprintf(key, LIB_CACHE_KEY_MAX, "%s-%u-%016" PRIx64, kind, version, hash);
+}
+
+static char *lib_cache_uri_type(enum res_type type, const char *key)
+{
+    LOCAL(char, name);
+
+    if (asprintf(&name, LIB_CACHE_DIR "/%s", key) == -1)
+        return NULL;
+
+    return lib_figure_uri(type, name);
+}
+
+static char *lib_cache_uri(const char *key)
+{
+    return lib_cache_uri_type(RES_STATE, key);
+}
+
+int lib_cache_get(const char *key, void **bufp, size_t *szp)
+{
+    LOCAL(char, uri);
+    LOCAL(char, asset_uri);
+
+    uri = lib_cache_uri(key);
+    if (!uri)
+        return -ENOMEM;
+
+    /* misses are expected, don't make noise about them */
+    if (!access(uri, R_OK))
+        return lib_read_uri(uri, bufp, szp);
+
+    /* then the entries that were baked along with the assets */
+    asset_uri = lib_cache_uri_type(RES_ASSET, key);
+    if (!asset_uri)
+        return -ENOMEM;
+
+    if (!lib_pack_find(asset_uri) && access(asset_uri, R_OK))
+        return -ENOENT;
+
+    return lib_read_uri(asset_uri, bufp, szp);
+}
+
+/*
+ * Entries are written to a temporary file and renamed into place, so a
+ * reader (or a crash) never sees a partial one; this may be called from
+ * jobs, concurrently with itself
+ */
+int lib_cache_put(const char *key, const struct iovec *iov, int nr_iov)
+{
+    LOCAL(char, dir);
+    LOCAL(char, uri);
+    LOCAL(char, tmp);
+    int i, fd, ret = 0;
+    FILE *f;
+
+    dir = lib_figure_uri(RES_STATE, LIB_CACHE_DIR);
+    uri = lib_cache_uri(key);
+    if (!dir || !uri || asprintf(&tmp, "%s.XXXXXX", uri) == -1)
+        return -ENOMEM;
+
+    /* state/ may not be there yet either */
+    *strrchr(dir, '/') = 0;
+    mkdir(dir, 0755);
+    dir[strlen(dir)] = '/';
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        warn("couldn't create '%s': %m\n", dir);
+        return -errno;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        warn("couldn't create '%s': %m\n", tmp);
+        return -errno;
+    }
+
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        ret = -errno;
+        goto out_unlink;
+    }
+
+    for (i = 0; i < nr_iov; i++)
+        if (iov[i].iov_len && fwrite(iov[i].iov_base, iov[i].iov_len, 1, f) != 1) {
+            ret = -EIO;
+            break;
+        }
+
+    if (fclose(f) && !ret)
+        ret = -EIO;
+
+    if (!ret && rename(tmp, uri))
+        ret = -errno;
+
+out_unlink:
+    if (ret) {
+        warn("couldn't write cache entry '%s': %d\n", key, ret);
+        unlink(tmp);
+    }
+
+    return ret;
+}
+
+int lib_stat(enum res_type type, const char *name, struct stat *st)
+{
+    const struct lib_pack_entry *e;
+    LOCAL(char, uri);
+
+    uri = lib_figure_uri(type, name);
+    if (!uri)
+        return -ENOMEM;
+
+    /* packed entries are as old as the pack */
+    e = lib_pack_find(uri);
+    if (e) {
+        *st = lib_pack.st;
+        st->st_size = e->size;
+        return 0;
+    }
+
+    return stat(uri, st) ? -errno : 0;
+}
+
 int librarian_init(const char *dir)
 {
     if (dir && strlen(dir))
         strncpy(base_url, dir, PATH_MAX);
+
+    lib_pack_close();
+    lib_pack_open();
     //fetch_file("librarian.json");
     //lib_request(RES_ASSET, "scene.json", _fetch_config_onload, NULL);
 
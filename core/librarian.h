@@ -2,7 +2,11 @@
 #ifndef __CLAP_LIBRARIAN_H__
 #define __CLAP_LIBRARIAN_H__
 
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "object.h"
+#include "sha1.h"
 
 enum res_type {
     RES_CONFIG = 0,
@@ -17,8 +21,21 @@ enum res_state {
     RES_ERROR,
 };
 
+/* async requests are read in this order */
+enum lib_priority {
+    LIB_PRIO_HIGH = 0,
+    LIB_PRIO_NORMAL,
+    LIB_PRIO_LOW,
+    LIB_PRIO_MAX,
+};
+
+/* main thread time librarian_poll() spends on completions per frame */
+#define LIB_POLL_BUDGET_US 2000
+
 struct lib_handle;
 typedef void (*lib_complete_fn)(struct lib_handle *, void *);
+/* runs on a worker thread, must not touch anything but the handle's buffer */
+typedef int (*lib_decode_fn)(struct lib_handle *, void *);
 
 struct lib_handle {
     const char      *name;
@@ -29,14 +46,50 @@ struct lib_handle {
     enum res_type   type;
     enum res_state  state;
     lib_complete_fn func;
+    /* @buf is a read-only file mapping, see lib_map_file() */
+    bool            mapped;
 };
 
 int librarian_init(const char *dir);
 struct lib_handle *
 lib_request(enum res_type type, const char *name, lib_complete_fn cb, void *data);
+/*
+ * The completion runs from librarian_poll() on the main thread and owns a
+ * reference to the handle, same as with lib_request(); @name must stay
+ * around until then
+ */
+struct lib_handle *
+lib_request_async(enum res_type type, const char *name, enum lib_priority prio,
+                  lib_decode_fn decode, lib_complete_fn cb, void *data);
+void librarian_poll(unsigned long budget_us);
 char *lib_figure_uri(enum res_type type, const char *name);
 struct lib_handle *lib_read_file(enum res_type type, const char *name, void **buf, size_t *szp);
+struct lib_handle *lib_map_file(enum res_type type, const char *name, void **buf, size_t *szp);
+/* quietly: -ENOENT is a perfectly normal answer */
+int lib_stat(enum res_type type, const char *name, struct stat *st);
 
 void lib_release(struct lib_handle *h);
 
+/*
+ * Cache of processed assets under state/cache/, so that restarts don't
+ * redo the processing: entries are keyed by the SHA-1 of everything that
+ * went into it plus the @kind of processing and its @version; bump the
+ * latter when the processing or the entry layout changes. Data that never
+ * comes from outside can use a hash64() of it instead, which is cheaper.
+ *
+ * Misses fall back to the assets' cache/: entries baked offline and shipped
+ * with the game, so that the first run doesn't do the processing either
+ * (mesh optimization, LOD chains); that's a copy of a state/cache/ from a
+ * run that loaded all of the assets. Entries only ever get written to
+ * state/cache/.
+ */
+#define LIB_CACHE_KEY_MAX 80
+
+/* finalizes @ctx */
+void lib_cache_key(char *key, const char *kind, unsigned int version, SHA1_CTX *ctx);
+void lib_cache_key64(char *key, const char *kind, unsigned int version, uint64_t hash);
+/* @buf is allocated, same as lib_read_file()'s; -ENOENT on a miss */
+int lib_cache_get(const char *key, void **bufp, size_t *szp);
+int lib_cache_put(const char *key, const struct iovec *iov, int nr_iov);
+
 #endif /* __CLAP_LIBRARIAN_H__ */
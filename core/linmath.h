@@ -3,6 +3,7 @@
 #define LINMATH_H
 
 #include <math.h>
+#include <string.h>
 
 #ifdef LINMATH_NO_INLINE
 #define LINMATH_H_FUNC static
@@ -10,6 +11,48 @@
 #define LINMATH_H_FUNC static inline
 #endif
 
+/*
+ * The mat4x4 kernels work a column at a time on 4 wide vectors where the
+ * target has them: SSE, NEON or WebAssembly SIMD, whichever the compiler
+ * is building for; the API is the same either way. Loads and stores are
+ * unaligned, mat4x4s can be anywhere.
+ */
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define LINMATH_SIMD 1
+typedef __m128 lm_f4;
+#define lm_load(p)          _mm_loadu_ps(p)
+#define lm_store(p, v)      _mm_storeu_ps((p), (v))
+#define lm_set1(x)          _mm_set1_ps(x)
+#define lm_add(a, b)        _mm_add_ps((a), (b))
+#define lm_sub(a, b)        _mm_sub_ps((a), (b))
+#define lm_mul(a, b)        _mm_mul_ps((a), (b))
+/* a + b * c */
+#define lm_madd(a, b, c)    _mm_add_ps((a), _mm_mul_ps((b), (c)))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LINMATH_SIMD 1
+typedef float32x4_t lm_f4;
+#define lm_load(p)          vld1q_f32(p)
+#define lm_store(p, v)      vst1q_f32((p), (v))
+#define lm_set1(x)          vdupq_n_f32(x)
+#define lm_add(a, b)        vaddq_f32((a), (b))
+#define lm_sub(a, b)        vsubq_f32((a), (b))
+#define lm_mul(a, b)        vmulq_f32((a), (b))
+#define lm_madd(a, b, c)    vmlaq_f32((a), (b), (c))
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define LINMATH_SIMD 1
+typedef v128_t lm_f4;
+#define lm_load(p)          wasm_v128_load(p)
+#define lm_store(p, v)      wasm_v128_store((p), (v))
+#define lm_set1(x)          wasm_f32x4_splat(x)
+#define lm_add(a, b)        wasm_f32x4_add((a), (b))
+#define lm_sub(a, b)        wasm_f32x4_sub((a), (b))
+#define lm_mul(a, b)        wasm_f32x4_mul((a), (b))
+#define lm_madd(a, b, c)    wasm_f32x4_add((a), wasm_f32x4_mul((b), (c)))
+#endif
+
 #define LINMATH_H_DEFINE_VEC(n) \
 typedef float vec##n[n]; \
 LINMATH_H_FUNC void vec##n##_add(vec##n r, vec##n const a, vec##n const b) \
@@ -118,6 +161,17 @@ LINMATH_H_FUNC void mat4x4_dup(mat4x4 M, mat4x4 N)
 		for(j=0; j<4; ++j)
 			M[i][j] = N[i][j];
 }
+/* r = a * sa + b * sb, the building block of everything below */
+LINMATH_H_FUNC void vec4_lincomb(vec4 r, vec4 const a, float sa, vec4 const b, float sb)
+{
+#ifdef LINMATH_SIMD
+	lm_store(r, lm_madd(lm_mul(lm_load(a), lm_set1(sa)), lm_load(b), lm_set1(sb)));
+#else
+	int i;
+	for(i=0; i<4; ++i)
+		r[i] = a[i] * sa + b[i] * sb;
+#endif
+}
 LINMATH_H_FUNC void mat4x4_row(vec4 r, mat4x4 M, int i)
 {
 	int k;
@@ -141,19 +195,31 @@ LINMATH_H_FUNC void mat4x4_add(mat4x4 M, mat4x4 a, mat4x4 b)
 {
 	int i;
 	for(i=0; i<4; ++i)
+#ifdef LINMATH_SIMD
+		lm_store(M[i], lm_add(lm_load(a[i]), lm_load(b[i])));
+#else
 		vec4_add(M[i], a[i], b[i]);
+#endif
 }
 LINMATH_H_FUNC void mat4x4_sub(mat4x4 M, mat4x4 a, mat4x4 b)
 {
 	int i;
 	for(i=0; i<4; ++i)
+#ifdef LINMATH_SIMD
+		lm_store(M[i], lm_sub(lm_load(a[i]), lm_load(b[i])));
+#else
 		vec4_sub(M[i], a[i], b[i]);
+#endif
 }
 LINMATH_H_FUNC void mat4x4_scale(mat4x4 M, mat4x4 a, float k)
 {
 	int i;
 	for(i=0; i<4; ++i)
+#ifdef LINMATH_SIMD
+		lm_store(M[i], lm_mul(lm_load(a[i]), lm_set1(k)));
+#else
 		vec4_scale(M[i], a[i], k);
+#endif
 }
 LINMATH_H_FUNC void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y, float z)
 {
@@ -167,6 +233,22 @@ LINMATH_H_FUNC void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y, flo
 }
 LINMATH_H_FUNC void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
 {
+#ifdef LINMATH_SIMD
+	/*
+	 * Each column of the result is the columns of @a weighed by the
+	 * column of @b; all of @a is in registers and each column of @b is
+	 * read before it's written, so @M can be either of them.
+	 */
+	lm_f4 a0 = lm_load(a[0]), a1 = lm_load(a[1]), a2 = lm_load(a[2]), a3 = lm_load(a[3]);
+	int c;
+	for(c=0; c<4; ++c) {
+		lm_f4 r = lm_mul(a0, lm_set1(b[c][0]));
+		r = lm_madd(r, a1, lm_set1(b[c][1]));
+		r = lm_madd(r, a2, lm_set1(b[c][2]));
+		r = lm_madd(r, a3, lm_set1(b[c][3]));
+		lm_store(M[c], r);
+	}
+#else
 	mat4x4 temp;
 	int k, r, c;
 	for(c=0; c<4; ++c) for(r=0; r<4; ++r) {
@@ -175,15 +257,31 @@ LINMATH_H_FUNC void mat4x4_mul(mat4x4 M, mat4x4 a, mat4x4 b)
 			temp[c][r] += a[k][r] * b[c][k];
 	}
 	mat4x4_dup(M, temp);
+#endif
+}
+/* R[i] = A[i] * B[i], any of them may be the same array */
+LINMATH_H_FUNC void mat4x4_mul_n(mat4x4 *R, mat4x4 *A, mat4x4 *B, unsigned int n)
+{
+	unsigned int i;
+	for(i=0; i<n; ++i)
+		mat4x4_mul(R[i], A[i], B[i]);
 }
 LINMATH_H_FUNC void mat4x4_mul_vec4(vec4 r, mat4x4 M, vec4 v)
 {
+#ifdef LINMATH_SIMD
+	lm_f4 t = lm_mul(lm_load(M[0]), lm_set1(v[0]));
+	t = lm_madd(t, lm_load(M[1]), lm_set1(v[1]));
+	t = lm_madd(t, lm_load(M[2]), lm_set1(v[2]));
+	t = lm_madd(t, lm_load(M[3]), lm_set1(v[3]));
+	lm_store(r, t);
+#else
 	int i, j;
 	for(j=0; j<4; ++j) {
 		r[j] = 0.f;
 		for(i=0; i<4; ++i)
 			r[j] += M[i][j] * v[i];
 	}
+#endif
 }
 LINMATH_H_FUNC void mat4x4_translate(mat4x4 T, float x, float y, float z)
 {
@@ -194,6 +292,13 @@ LINMATH_H_FUNC void mat4x4_translate(mat4x4 T, float x, float y, float z)
 }
 LINMATH_H_FUNC void mat4x4_translate_in_place(mat4x4 M, float x, float y, float z)
 {
+#ifdef LINMATH_SIMD
+	lm_f4 t = lm_load(M[3]);
+	t = lm_madd(t, lm_load(M[0]), lm_set1(x));
+	t = lm_madd(t, lm_load(M[1]), lm_set1(y));
+	t = lm_madd(t, lm_load(M[2]), lm_set1(z));
+	lm_store(M[3], t);
+#else
 	vec4 t = {x, y, z, 0};
 	vec4 r;
 	int i;
@@ -201,6 +306,7 @@ LINMATH_H_FUNC void mat4x4_translate_in_place(mat4x4 M, float x, float y, float
 		mat4x4_row(r, M, i);
 		M[3][i] += vec4_mul_inner(r, t);
 	}
+#endif
 }
 LINMATH_H_FUNC void mat4x4_from_vec3_mul_outer(mat4x4 M, vec3 a, vec3 b)
 {
@@ -242,41 +348,45 @@ LINMATH_H_FUNC void mat4x4_rotate(mat4x4 R, mat4x4 M, float x, float y, float z,
 		mat4x4_dup(R, M);
 	}
 }
+/*
+ * Rotating around an axis only mixes the other two columns of @M:
+ * Q = M * R without multiplying by all the zeros and ones of R.
+ */
 LINMATH_H_FUNC void mat4x4_rotate_X(mat4x4 Q, mat4x4 M, float angle)
 {
 	float s = sinf(angle);
 	float c = cosf(angle);
-	mat4x4 R = {
-		{1.f, 0.f, 0.f, 0.f},
-		{0.f,   c,   s, 0.f},
-		{0.f,  -s,   c, 0.f},
-		{0.f, 0.f, 0.f, 1.f}
-	};
-	mat4x4_mul(Q, M, R);
+	vec4 y;
+	if(Q != M) {
+		mat4x4_dup(Q, M);
+	}
+	vec4_lincomb(y, M[1], c, M[2], s);
+	vec4_lincomb(Q[2], M[1], -s, M[2], c);
+	memcpy(Q[1], y, sizeof(y));
 }
 LINMATH_H_FUNC void mat4x4_rotate_Y(mat4x4 Q, mat4x4 M, float angle)
 {
 	float s = sinf(angle);
 	float c = cosf(angle);
-	mat4x4 R = {
-		{   c, 0.f,  -s, 0.f},
-		{ 0.f, 1.f, 0.f, 0.f},
-		{   s, 0.f,   c, 0.f},
-		{ 0.f, 0.f, 0.f, 1.f}
-	};
-	mat4x4_mul(Q, M, R);
+	vec4 x;
+	if(Q != M) {
+		mat4x4_dup(Q, M);
+	}
+	vec4_lincomb(x, M[0], c, M[2], -s);
+	vec4_lincomb(Q[2], M[0], s, M[2], c);
+	memcpy(Q[0], x, sizeof(x));
 }
 LINMATH_H_FUNC void mat4x4_rotate_Z(mat4x4 Q, mat4x4 M, float angle)
 {
 	float s = sinf(angle);
 	float c = cosf(angle);
-	mat4x4 R = {
-		{   c,   s, 0.f, 0.f},
-		{  -s,   c, 0.f, 0.f},
-		{ 0.f, 0.f, 1.f, 0.f},
-		{ 0.f, 0.f, 0.f, 1.f}
-	};
-	mat4x4_mul(Q, M, R);
+	vec4 x;
+	if(Q != M) {
+		mat4x4_dup(Q, M);
+	}
+	vec4_lincomb(x, M[0], c, M[1], s);
+	vec4_lincomb(Q[1], M[0], -s, M[1], c);
+	memcpy(Q[0], x, sizeof(x));
 }
 LINMATH_H_FUNC void mat4x4_invert(mat4x4 T, mat4x4 M)
 {
@@ -550,6 +660,32 @@ LINMATH_H_FUNC void mat4x4_from_quat(mat4x4 M, quat q)
 	M[3][3] = 1.f;
 }
 
+/* M = T * R * S, without multiplying any of them */
+LINMATH_H_FUNC void mat4x4_from_trs(mat4x4 M, vec3 const t, quat const r, vec3 const s)
+{
+	mat4x4_from_quat(M, (float *)r);
+#ifdef LINMATH_SIMD
+	lm_store(M[0], lm_mul(lm_load(M[0]), lm_set1(s[0])));
+	lm_store(M[1], lm_mul(lm_load(M[1]), lm_set1(s[1])));
+	lm_store(M[2], lm_mul(lm_load(M[2]), lm_set1(s[2])));
+#else
+	vec4_scale(M[0], M[0], s[0]);
+	vec4_scale(M[1], M[1], s[1]);
+	vec4_scale(M[2], M[2], s[2]);
+#endif
+	M[3][0] = t[0];
+	M[3][1] = t[1];
+	M[3][2] = t[2];
+	M[3][3] = 1.f;
+}
+LINMATH_H_FUNC void mat4x4_from_trs_n(mat4x4 *M, vec3 *t, quat *r, vec3 *s,
+				      unsigned int n)
+{
+	unsigned int i;
+	for(i=0; i<n; ++i)
+		mat4x4_from_trs(M[i], t[i], r[i], s[i]);
+}
+
 LINMATH_H_FUNC void mat4x4o_mul_quat(mat4x4 R, mat4x4 M, quat q)
 {
 /*  XXX: The way this is written only works for othogonal matrices. */
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <time.h>
 #include "config.h"
@@ -21,7 +22,6 @@
  *  * move timestamping to the logging core from rb
  *  * think about filtering (by level, module, etc)
  *  * ftrace needs to be either more (elf symbol lookup) or go away
- *  * make rb atomic update/thread safe
  *  * make stdio logger also a file logger
  *  * allow multiple instances of the same logger
  *  * allow 'parameters'/filtering on instances
@@ -76,10 +76,37 @@ static struct logger logger_stdio = {
 };
 
 /*
- * TODO we do actually want this to be thread-safe
- * ? make log_rb_wp atomic
+ * Log entries come in through a bounded lock-free MPSC queue (Vyukov's):
+ * any thread can log, but only the thread that initialized the logger
+ * moves them from the queue to the history ring (log_rb) and runs the
+ * sinks, which aren't thread safe (networking). Messages are formatted
+ * at the call site, because their arguments may point to things that
+ * are gone by the time the sinks see them; the short ones are stored
+ * inline, so the usual case doesn't allocate.
  */
-static struct log_entry *log_rb;
+#define LOG_MSG_INLINE  192
+/* power of 2 */
+#define LOG_QUEUE_SIZE  256
+
+struct rb_entry {
+    struct log_entry    e;
+    /* e.msg points here, or to a heap copy if it doesn't fit */
+    char                buf[LOG_MSG_INLINE];
+};
+
+struct log_slot {
+    atomic_uint         seq;
+    struct rb_entry     entry;
+};
+
+static struct log_slot log_queue[LOG_QUEUE_SIZE];
+static atomic_uint log_queue_tail;
+static unsigned int log_queue_head;
+/* entries that didn't make it into the queue */
+static atomic_uint log_queue_dropped;
+static _Thread_local bool log_flusher;
+
+static struct rb_entry *log_rb;
 static int log_rb_wp;
 static int log_rb_sz;
 //static FILE *log_rb_output;
@@ -94,17 +121,34 @@ struct rb_sink {
     int         filter;
 };
 
+static notrace void rb_entry_release(struct rb_entry *re)
+{
+    if (re->e.msg != re->buf)
+        free((void *)re->e.msg);
+    re->e.msg = NULL;
+}
+
+static notrace void rb_entry_move(struct rb_entry *dst, struct rb_entry *src)
+{
+    dst->e = src->e;
+    if (src->e.msg == src->buf) {
+        strcpy(dst->buf, src->buf);
+        dst->e.msg = dst->buf;
+    }
+    src->e.msg = NULL;
+}
+
 static notrace void rb_flush_one(struct rb_sink *sink)
 {
     int i;
 
     for (i = (sink->rp + 1) % log_rb_sz; i != log_rb_wp; i = (i + 1) % log_rb_sz)
-        if (log_rb[i].msg) {
-            if (log_rb[i].level >= sink->filter) {
+        if (log_rb[i].e.msg) {
+            if (log_rb[i].e.level >= sink->filter) {
                 /*fprintf(log_rb_output, "[%08lu.%09lu] %s",
                     log_rb[i].ts.tv_sec, log_rb[i].ts.tv_nsec,
                     log_rb[i].msg);*/
-                sink->flush(&log_rb[i], sink->data);
+                sink->flush(&log_rb[i].e, sink->data);
                 sink->rp = i;
             }
         }
@@ -155,7 +199,7 @@ static notrace bool rb_needs_flush(struct rb_sink *s)
         return true;
     }
 
-    if (log_rb[log_rb_wp].msg)
+    if (log_rb[log_rb_wp].e.msg)
         return true;
     
     if (rb_space(s->rp) >= s->fill)
@@ -179,51 +223,134 @@ static notrace void rb_flush(void)
 
     if (rp_min == __INT_MAX__ || rp_max == __INT_MAX__)
         return;
-    for (i = rp_min; i != rp_max; i = (i + 1) % log_rb_sz) {
-        free((void *)log_rb[i].msg);
-        log_rb[i].msg = NULL;
+    for (i = rp_min; i != rp_max; i = (i + 1) % log_rb_sz)
+        rb_entry_release(&log_rb[i]);
+}
+
+/* queue -> history, in the order the slots were claimed */
+static notrace void rb_drain(void)
+{
+    struct log_slot *slot;
+
+    for (;;) {
+        slot = &log_queue[log_queue_head & (LOG_QUEUE_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_queue_head + 1)
+            break;
+
+        /* sinks that haven't got this far by now won't see it */
+        rb_entry_release(&log_rb[log_rb_wp]);
+        rb_entry_move(&log_rb[log_rb_wp], &slot->entry);
+        log_rb_wp = (log_rb_wp + 1) % log_rb_sz;
+
+        atomic_store_explicit(&slot->seq, log_queue_head + LOG_QUEUE_SIZE, memory_order_release);
+        log_queue_head++;
     }
 }
 
-static void rb_cleanup(int status)
+/* drain the queue and run the sinks, on the logger's own thread */
+notrace void log_rb_flush(void)
 {
+    static bool flushing;
+
+    /* sinks that log end up here again */
+    if (!log_flusher || !log_rb || flushing)
+        return;
+
+    flushing = true;
+    rb_drain();
     rb_flush();
+    flushing = false;
+}
+
+static void rb_cleanup(int status)
+{
+    unsigned int dropped = atomic_load(&log_queue_dropped);
+
+    log_rb_flush();
+    if (dropped)
+        fprintf(stderr, "%u log messages dropped\n", dropped);
 }
 
 static notrace int rb_init(void)
 {
-    log_rb = calloc(LOG_RB_MAX, sizeof(struct log_entry));
+    unsigned int i;
+
+    log_rb = calloc(LOG_RB_MAX, sizeof(*log_rb));
     if (!log_rb)
         return -ENOMEM;
 
+    for (i = 0; i < LOG_QUEUE_SIZE; i++)
+        atomic_init(&log_queue[i].seq, i);
+
     //log_rb_output = stdout;
     log_rb_sz = LOG_RB_MAX;
+    log_flusher = true;
     exit_cleanup(rb_cleanup);
 
     return 0;
 }
 
-static notrace int rb_log(int level, const char *mod, int line, const char *func, const char *msg)
+static notrace bool rb_queue(int level, const char *mod, int line, const char *func, const char *msg)
 {
-    struct timespec ts;
+    unsigned int pos = atomic_load_explicit(&log_queue_tail, memory_order_relaxed), seq;
+    struct log_slot *slot;
+    struct rb_entry *re;
+    size_t len;
+
+    for (;;) {
+        slot = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&log_queue_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((int)(seq - pos) < 0) {
+            /* full */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&log_queue_tail, memory_order_relaxed);
+        }
+    }
 
+    re = &slot->entry;
     /* XXX not dealing with absence of clock_gettime() */
-    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    (void)clock_gettime(CLOCK_REALTIME, &re->e.ts);
+    re->e.mod   = mod;
+    re->e.func  = func;
+    re->e.line  = line;
+    re->e.level = level;
+
+    len = strlen(msg);
+    if (len < sizeof(re->buf)) {
+        memcpy(re->buf, msg, len + 1);
+        re->e.msg = re->buf;
+    } else {
+        re->e.msg = strdup(msg);
+        if (!re->e.msg)
+            re->e.msg = strcpy(re->buf, "<out of memory>\n");
+    }
 
-    msg = strdup(msg);
-    if (!msg)
-        return -ENOMEM; /* XXX error codes */
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
 
-    rb_flush();
+    return true;
+}
+
+static notrace int rb_log(int level, const char *mod, int line, const char *func, const char *msg)
+{
+    bool queued = rb_queue(level, mod, line, func, msg);
+
+    /* make room and try again, if this is the thread that can */
+    if (!queued && log_flusher) {
+        log_rb_flush();
+        queued = rb_queue(level, mod, line, func, msg);
+    }
+
+    if (!queued) {
+        atomic_fetch_add_explicit(&log_queue_dropped, 1, memory_order_relaxed);
+        return -ENOSPC;
+    }
 
-    log_rb[log_rb_wp].mod = mod;
-    log_rb[log_rb_wp].func = func;
-    log_rb[log_rb_wp].line = line;
-    log_rb[log_rb_wp].level = level;
-    log_rb[log_rb_wp].ts.tv_sec = ts.tv_sec;
-    log_rb[log_rb_wp].ts.tv_nsec = ts.tv_nsec;
-    log_rb[log_rb_wp].msg = msg;
-    log_rb_wp = (log_rb_wp + 1) % LOG_RB_MAX;
+    log_rb_flush();
 
     return 0;
 }
@@ -249,7 +376,7 @@ static notrace void logger_append(struct logger *lg)
         lg->init();
 }
 
-static int log_floor =
+int log_floor =
 #ifdef CONFIG_FINAL
     WARN
 #else
@@ -279,7 +406,7 @@ void notrace log_init(unsigned int flags)
     if (flags & LOG_QUIET)
         log_floor = NORMAL;
 
-    subscribe(MT_COMMAND, log_command_handler, NULL);
+    subscribe_mask(MT_COMMAND, log_command_handler, NULL, MSG_COMMAND(toggle_noise));
     log_up++;
     dbg("logger initialized, build %s\n", CONFIG_BUILDDATE);
 }
@@ -296,7 +423,9 @@ static notrace void log_submit(int level, const char *mod, int line, const char
 
 notrace void vlogg(int level, const char *mod, int line, const char *func, const char *fmt, va_list va)
 {
-    LOCAL(char, buf);
+    char buf[LOG_MSG_INLINE];
+    LOCAL(char, long_buf);
+    va_list va_long;
     int ret;
 
     if (unlikely(!log_up))
@@ -306,12 +435,17 @@ notrace void vlogg(int level, const char *mod, int line, const char *func, const
     if (level < log_floor)
         return;
 
-    ret = vasprintf(&buf, fmt, va);
+    /* most messages fit */
+    va_copy(va_long, va);
+    ret = vsnprintf(buf, sizeof(buf), fmt, va);
+    if (ret >= (int)sizeof(buf) && vasprintf(&long_buf, fmt, va_long) < 0)
+        ret = -1;
+    va_end(va_long);
 
     if (ret < 0)
         return;
 
-    log_submit(level, mod, line, func, buf);
+    log_submit(level, mod, line, func, long_buf ? long_buf : buf);
 }
 
 notrace void logg(int level, const char *mod, int line, const char *func, const char *fmt, ...)
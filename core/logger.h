@@ -8,6 +8,7 @@
 
 #include <sys/types.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <time.h>
 #include "common.h"
@@ -29,6 +30,13 @@ enum {
 };
 
 extern unsigned int abort_on_error;
+/* messages below this level are dropped */
+extern int log_floor;
+
+static inline bool log_enabled(int level)
+{
+    return level >= log_floor;
+}
 
 struct log_entry {
     struct timespec ts;     /* timestamp */
@@ -44,23 +52,28 @@ void rb_sink_del(void *data);
 
 void hexdump(unsigned char *buf, size_t size);
 void log_init(unsigned int flags);
+/* any thread can log, but the sinks only run here, on the thread that did log_init() */
+void log_rb_flush(void);
 void vlogg(int level, const char *mod, int line, const char *func, const char *fmt, va_list va);
 void logg(int level, const char *mod, int line, const char *func, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+/* the arguments aren't even evaluated for the levels that are filtered out */
+#define __logg(_l, args...) \
+    do { if (log_enabled(_l)) logg(_l, MODNAME, __LINE__, __func__, ## args); } while (0)
 #define trace(args...) \
-    logg(VDBG, MODNAME, __LINE__, __func__, ## args);
+    __logg(VDBG, ## args)
 #define trace_on(_c, args...) do { if ((_c)) trace("condition '" # _c "': " args); } while (0)
 #define dbg(args...) \
-    logg(DBG, MODNAME, __LINE__, __func__, ## args);
+    __logg(DBG, ## args)
 
 #define dbg_on(_c, args...) do { if ((_c)) dbg("condition '" # _c "': " args); } while (0)
-#define dbg_once(args...) do { static int __printed = 0; if (!__printed++) dbg(args) } while (0)
+#define dbg_once(args...) do { static int __printed = 0; if (!__printed++) dbg(args); } while (0)
 #define msg(args...) \
-    logg(NORMAL, MODNAME, __LINE__, __func__, ## args);
+    __logg(NORMAL, ## args)
 #define warn(args...) \
-    logg(WARN, MODNAME, __LINE__, __func__, ## args);
+    __logg(WARN, ## args)
 #define warn_on(_c, args...) do { if ((_c)) warn("condition '" # _c "': " args); } while (0)
 #define err(args...) \
-    logg(ERR, MODNAME, __LINE__, __func__, ## args);
+    __logg(ERR, ## args)
 /*
  * err_on_cond() ignores @_cc, because sometimes format strings end up there,
  * which subsequently get pasted with the actuall error format string. I'm too
@@ -1,14 +1,32 @@
 #include <meshoptimizer.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <limits.h>
 #include "common.h"
+#include "librarian.h"
 #include "mesh.h"
+#include "voxel.h"
+
+/* the attributes' bytes as they are now, for the MEM_MESH total */
+static void mesh_account(struct mesh *mesh)
+{
+    size_t mem = 0;
+    int i;
+
+    for (i = 0; i < MESH_MAX; i++)
+        mem += mesh->attr[i].nr * mesh->attr[i].stride;
+
+    mem_account(MEM_MESH, (ssize_t)mem - (ssize_t)mesh->mem);
+    mesh->mem = mem;
+}
 
 static void mesh_drop(struct ref *ref)
 {
     struct mesh *mesh = container_of(ref, struct mesh, ref);
     int i;
 
+    mem_account(MEM_MESH, -(ssize_t)mesh->mem);
+
     for (i = 0; i < MESH_MAX; i++) {
         struct mesh_attr *ma = mesh_attr(mesh, i);
 
@@ -40,6 +58,7 @@ int mesh_attr_add(struct mesh *mesh, unsigned int attr, void *data, size_t strid
     mesh->attr[attr].stride = stride;
     mesh->attr[attr].nr = nr;
     mesh->attr[attr].type = attr;
+    mesh_account(mesh);
 
     return 0;
 }
@@ -64,30 +83,53 @@ int mesh_attr_dup(struct mesh *mesh, unsigned int attr, void *data, size_t strid
 
     memcpy(mesh->attr[attr].data, data, stride * nr);
     mesh->attr[attr].nr = nr;
+    mesh_account(mesh);
 
     return 0;
 }
 
-static unsigned int *idx_to_idx32(unsigned short *idx, size_t nr_idx)
+/*
+ * Index width is per mesh: u16 when all the indices fit, which is half the
+ * bandwidth and the common case, u32 otherwise. Processing is done in u32.
+ */
+static unsigned int *idx_to_idx32(void *idx, unsigned int stride, size_t nr_idx)
 {
+    unsigned short *idx16 = idx;
     unsigned int *idx32;
-    int i;
+    size_t i;
+
+    if (stride == sizeof(*idx32))
+        return memdup(idx, nr_idx * sizeof(*idx32));
 
     CHECK(idx32 = malloc(nr_idx * sizeof(*idx32)));
     for (i = 0; i < nr_idx; i++)
-        idx32[i] = idx[i];
+        idx32[i] = idx16[i];
 
     return idx32;
 }
 
-static unsigned short *idx32_to_idx(unsigned int *idx32, size_t nr_idx)
+static unsigned int idx32_stride(unsigned int *idx32, size_t nr_idx)
+{
+    size_t i;
+
+    for (i = 0; i < nr_idx; i++)
+        if (idx32[i] > USHRT_MAX)
+            return sizeof(unsigned int);
+
+    return sizeof(unsigned short);
+}
+
+/* NULL if they don't fit into @stride */
+static void *idx32_to_idx(unsigned int *idx32, size_t nr_idx, unsigned int stride)
 {
     unsigned short *idx;
-    int i;
+    size_t i;
+
+    if (stride == sizeof(*idx32))
+        return memdup(idx32, nr_idx * sizeof(*idx32));
 
     CHECK(idx = malloc(nr_idx * sizeof(*idx)));
     for (i = 0; i < nr_idx; i++) {
-        /* XXX: CU() */
         if (idx32[i] > USHRT_MAX) {
             free(idx);
             return NULL;
@@ -100,17 +142,16 @@ static unsigned short *idx32_to_idx(unsigned int *idx32, size_t nr_idx)
 
 unsigned int *mesh_idx_to_idx32(struct mesh *mesh)
 {
-    if (mesh_idx_stride(mesh) == sizeof(unsigned int))
-        return mesh->attr[MESH_IDX].data;
-
-    return idx_to_idx32(mesh_idx(mesh), mesh_nr_idx(mesh));
+    return idx_to_idx32(mesh_idx(mesh), mesh_idx_stride(mesh), mesh_nr_idx(mesh));
 }
 
 void mesh_idx_from_idx32(struct mesh *mesh, unsigned int *idx32)
 {
+    unsigned int stride = idx32_stride(idx32, mesh_nr_idx(mesh));
+
     free(mesh->attr[MESH_IDX].data);
-    mesh->attr[MESH_IDX].data = idx32_to_idx(idx32, mesh_nr_idx(mesh));
-    mesh->attr[MESH_IDX].stride = sizeof(unsigned short); /* because GLES/WebGL */
+    mesh->attr[MESH_IDX].data = idx32_to_idx(idx32, mesh_nr_idx(mesh), stride);
+    mesh->attr[MESH_IDX].stride = stride;
     free(idx32);
     /* XXX: propagate the error up the stack */
     assert(mesh_idx(mesh));
@@ -138,7 +179,7 @@ void mesh_push_mesh(struct mesh *mesh, struct mesh *src,
 {
     size_t nr_vx = mesh_nr_vx(mesh);
     struct mesh_attr *ma, *ma_src;
-    unsigned short *idx, *idx_src;
+    void *idx, *idx_src;
     float *vx, *vx_src;
     int i, attr;
 
@@ -177,12 +218,180 @@ void mesh_push_mesh(struct mesh *mesh, struct mesh *src,
     idx = ma->data + mesh_idx_sz(mesh);
     idx_src = ma_src->data;
     for (i = 0; i < mesh_nr_idx(src); i++) {
-        idx[i] = nr_vx + idx_src[i];
+        if (ma->stride == sizeof(unsigned int))
+            ((unsigned int *)idx)[i] = nr_vx + ((unsigned int *)idx_src)[i];
+        else
+            ((unsigned short *)idx)[i] = nr_vx + ((unsigned short *)idx_src)[i];
     }
     ma->nr += ma_src->nr;
+    mesh_account(mesh);
 }
 
-void mesh_optimize(struct mesh *mesh)
+void mesh_push_mesh_mx(struct mesh *mesh, struct mesh *src, mat4x4 mx)
+{
+    size_t nr_vx = mesh_nr_vx(mesh);
+    struct mesh_attr *ma, *ma_src;
+    unsigned int idx;
+    vec4 v, r;
+    float *p;
+    int attr;
+    size_t i;
+
+    for (attr = 0; attr < MESH_MAX; attr++) {
+        ma = mesh_attr(mesh, attr);
+        ma_src = mesh_attr(src, attr);
+
+        if (attr == MESH_IDX || !ma_src->nr || ma->stride != ma_src->stride)
+            continue;
+
+        p = ma->data + mesh_sz(mesh, attr);
+        memcpy(p, ma_src->data, ma->stride * ma_src->nr);
+        ma->nr += ma_src->nr;
+        if (attr != MESH_VX && attr != MESH_NORM && attr != MESH_TANGENTS)
+            continue;
+
+        /* positions are points, the rest are directions; tangents keep their w */
+        for (i = 0; i < ma_src->nr; i++, p = (void *)p + ma->stride) {
+            v[0] = p[0];
+            v[1] = p[1];
+            v[2] = p[2];
+            v[3] = attr == MESH_VX ? 1 : 0;
+            mat4x4_mul_vec4(r, mx, v);
+            if (attr != MESH_VX)
+                vec3_norm(r, r);
+            memcpy(p, r, sizeof(vec3));
+        }
+    }
+
+    ma = mesh_attr(mesh, MESH_IDX);
+    ma_src = mesh_attr(src, MESH_IDX);
+    for (i = 0; i < ma_src->nr; i++) {
+        if (ma_src->stride == sizeof(unsigned int))
+            idx = nr_vx + ((unsigned int *)ma_src->data)[i];
+        else
+            idx = nr_vx + ((unsigned short *)ma_src->data)[i];
+
+        if (ma->stride == sizeof(unsigned int))
+            ((unsigned int *)ma->data)[ma->nr + i] = idx;
+        else
+            ((unsigned short *)ma->data)[ma->nr + i] = idx;
+    }
+    ma->nr += ma_src->nr;
+    mesh_account(mesh);
+}
+
+/*
+ * Processed meshes are cached by librarian, keyed by whatever the
+ * processing starts from: all the attributes and @extra parameters
+ */
+#define MESH_CACHE_VERSION 2
+
+struct mesh_cache_attr {
+    uint32_t    stride;
+    uint32_t    nr;
+};
+
+static void mesh_hash_update(struct mesh *mesh, struct hash64 *h)
+{
+    struct mesh_cache_attr mca;
+    struct mesh_attr *ma;
+    int attr;
+
+    for (attr = 0; attr < MESH_MAX; attr++) {
+        ma = mesh_attr(mesh, attr);
+        mca.stride = ma->nr ? ma->stride : 0;
+        mca.nr = ma->nr;
+        hash64_update(h, &mca, sizeof(mca));
+        if (ma->nr)
+            hash64_update(h, ma->data, ma->nr * ma->stride);
+    }
+}
+
+uint64_t mesh_hash(struct mesh *mesh)
+{
+    struct hash64 h;
+
+    hash64_init(&h, 0);
+    mesh_hash_update(mesh, &h);
+
+    return hash64_final(&h);
+}
+
+static void mesh_cache_key(struct mesh *mesh, char *key, const char *kind,
+                           const void *extra, size_t extrasz)
+{
+    struct hash64 h;
+
+    hash64_init(&h, 0);
+    mesh_hash_update(mesh, &h);
+    if (extrasz)
+        hash64_update(&h, extra, extrasz);
+
+    lib_cache_key64(key, kind, MESH_CACHE_VERSION, hash64_final(&h));
+}
+
+/* entry: struct mesh_cache_attr for each attribute, then their data */
+static void mesh_cache_put(struct mesh *mesh, const char *key)
+{
+    struct mesh_cache_attr mca[MESH_MAX];
+    struct iovec iov[MESH_MAX + 1];
+    struct mesh_attr *ma;
+    int attr;
+
+    iov[0].iov_base = mca;
+    iov[0].iov_len  = sizeof(mca);
+    for (attr = 0; attr < MESH_MAX; attr++) {
+        ma = mesh_attr(mesh, attr);
+        mca[attr].stride = ma->nr ? ma->stride : 0;
+        mca[attr].nr = ma->nr;
+        iov[attr + 1].iov_base = ma->data;
+        iov[attr + 1].iov_len  = ma->nr * ma->stride;
+    }
+
+    lib_cache_put(key, iov, array_size(iov));
+}
+
+static int mesh_cache_get(struct mesh *mesh, const char *key)
+{
+    struct mesh_cache_attr *mca;
+    size_t size, off;
+    void *buf;
+    int attr;
+
+    if (lib_cache_get(key, &buf, &size))
+        return -ENOENT;
+
+    mca = buf;
+    for (attr = 0, off = sizeof(*mca) * MESH_MAX; attr < MESH_MAX && off <= size; attr++)
+        off += (size_t)mca[attr].nr * mca[attr].stride;
+    if (off != size) {
+        free(buf);
+        return -EINVAL;
+    }
+
+    for (attr = 0, off = sizeof(*mca) * MESH_MAX; attr < MESH_MAX; attr++) {
+        struct mesh_attr *ma = mesh_attr(mesh, attr);
+        size_t sz = (size_t)mca[attr].nr * mca[attr].stride;
+
+        if (!ma->nr && !mca[attr].nr)
+            continue;
+
+        free(ma->data);
+        ma->data = NULL;
+        ma->stride = mca[attr].stride;
+        ma->nr = mca[attr].nr;
+        if (sz) {
+            CHECK(ma->data = malloc(sz));
+            memcpy(ma->data, buf + off, sz);
+        }
+        off += sz;
+    }
+    free(buf);
+
+    return 0;
+}
+
+static void mesh_optimize_uncached(struct mesh *mesh)
 {
     struct mesh_attr *vxa = mesh_attr(mesh, MESH_VX);
     size_t nr_new_vx, nr_vx = mesh_nr_vx(mesh);
@@ -249,31 +458,288 @@ void mesh_optimize(struct mesh *mesh)
     mesh_idx_from_idx32(mesh, idx32);
 }
 
-ssize_t mesh_idx_to_lod(struct mesh *mesh, int lod, unsigned short **idx, size_t orig_idx)
+void mesh_optimize(struct mesh *mesh)
+{
+    char key[LIB_CACHE_KEY_MAX];
+
+    mesh_cache_key(mesh, key, "mesh", NULL, 0);
+    if (mesh_cache_get(mesh, key)) {
+        mesh_optimize_uncached(mesh);
+        mesh_cache_put(mesh, key);
+    }
+    mesh_account(mesh);
+}
+
+struct mesh *mesh_new_voxels(const char *name, struct xyzarray *xyz, bool inv, float side, vec3 origin)
+{
+    /* the cells' y and z trade places in the world */
+    static const int world_axis[3] = { 0, 2, 1 };
+    unsigned int *idx32, stride;
+    struct voxel_quad *quads, *q;
+    float *vx, *tx, *norm, c[4][3];
+    ssize_t nr_quads, i;
+    struct voxel_mask vm;
+    struct mesh *mesh;
+    int a, ua, va, j, k;
+
+    if (voxel_mask_init(&vm, xyz, inv))
+        return NULL;
+
+    nr_quads = voxel_quads(&vm, &quads);
+    voxel_mask_done(&vm);
+    if (nr_quads <= 0)
+        return NULL;
+
+    CHECK(vx = calloc(nr_quads * 4 * 3, sizeof(*vx)));
+    CHECK(tx = calloc(nr_quads * 4 * 2, sizeof(*tx)));
+    CHECK(norm = calloc(nr_quads * 4 * 3, sizeof(*norm)));
+    CHECK(idx32 = malloc(nr_quads * 6 * sizeof(*idx32)));
+
+    for (i = 0, q = quads; i < nr_quads; i++, q++) {
+        a = q->axis;
+        ua = (a + 1) % 3;
+        va = (a + 2) % 3;
+
+        for (j = 0; j < 4; j++)
+            for (k = 0; k < 3; k++)
+                c[j][k] = q->pos[k] + (k == a && q->positive);
+        c[1][ua] += q->w;
+        c[2][ua] += q->w;
+        c[2][va] += q->h;
+        c[3][va] += q->h;
+
+        for (j = 0; j < 4; j++) {
+            for (k = 0; k < 3; k++)
+                vx[(i * 4 + j) * 3 + world_axis[k]] = origin[world_axis[k]] + c[j][k] * side;
+            tx[(i * 4 + j) * 2 + 0] = j == 1 || j == 2 ? q->w : 0;
+            tx[(i * 4 + j) * 2 + 1] = j >= 2 ? q->h : 0;
+            norm[(i * 4 + j) * 3 + world_axis[a]] = q->positive ? 1 : -1;
+        }
+
+        /*
+         * 0-1-2-3 go counter-clockwise around +@a in the cells, swapping y
+         * and z mirrors that, so it's the positive faces that get flipped
+         */
+        idx32[i * 6 + 0] = i * 4;
+        idx32[i * 6 + 1] = i * 4 + (q->positive ? 2 : 1);
+        idx32[i * 6 + 2] = i * 4 + (q->positive ? 1 : 2);
+        idx32[i * 6 + 3] = i * 4;
+        idx32[i * 6 + 4] = i * 4 + (q->positive ? 3 : 2);
+        idx32[i * 6 + 5] = i * 4 + (q->positive ? 2 : 3);
+    }
+    free(quads);
+
+    mesh = mesh_new(name);
+    mesh_attr_add(mesh, MESH_VX, vx, sizeof(float) * 3, nr_quads * 4);
+    mesh_attr_add(mesh, MESH_TX, tx, sizeof(float) * 2, nr_quads * 4);
+    mesh_attr_add(mesh, MESH_NORM, norm, sizeof(float) * 3, nr_quads * 4);
+    stride = idx32_stride(idx32, nr_quads * 6);
+    mesh_attr_add(mesh, MESH_IDX, idx32_to_idx(idx32, nr_quads * 6, stride), stride, nr_quads * 6);
+    free(idx32);
+    mesh_optimize(mesh);
+
+    return mesh;
+}
+
+/*
+ * Each LOD is simplified from the previous one, to at most half of its
+ * indices, with the error budget growing along the chain; it ends when a
+ * level doesn't come out much smaller than the one before, or gets too
+ * small to bother
+ */
+#define LOD_ERROR_BUDGET    0.02f
+#define LOD_MIN_IDX         36
+
+static ssize_t mesh_idx_to_lod_uncached(struct mesh *mesh, int lod, void *src, size_t nr_src,
+                                        void **idx, float *error)
 {
     struct mesh_attr *vxa = mesh_attr(mesh, MESH_VX);
-    struct mesh_attr *ia = mesh_attr(mesh, MESH_IDX);
-    int nr_idx, target = orig_idx / (1 << (lod + 1)), i;
-    float target_error = 1e-2;
+    float budget = LOD_ERROR_BUDGET * (lod + 1), target_error = 0;
+    int nr_idx, target = nr_src / 2;
     unsigned int *idx32;
 
-    idx32 = mesh_idx_to_idx32(mesh);
-    nr_idx = meshopt_simplify(idx32, idx32, orig_idx, vxa->data, vxa->nr, vxa->stride,
-                              target, 0.02f, &target_error);
+    if (nr_src < LOD_MIN_IDX)
+        return -1;
+
+    idx32 = idx_to_idx32(src, mesh_idx_stride(mesh), nr_src);
+    nr_idx = meshopt_simplify(idx32, idx32, nr_src, vxa->data, vxa->nr, vxa->stride,
+                              target, budget, &target_error);
 
 #define goodenough(_new, _orig) ((_new) * 11 / 10 < (_orig))
-    if (!goodenough(nr_idx, orig_idx) || nr_idx < 0) {
-        nr_idx = meshopt_simplifySloppy(idx32, idx32, orig_idx, vxa->data, vxa->nr, vxa->stride,
-                                        target, 0.02f, &target_error);
-        if (!goodenough(nr_idx, orig_idx)) {
+    if (!goodenough(nr_idx, nr_src) || nr_idx < 0) {
+        nr_idx = meshopt_simplifySloppy(idx32, idx32, nr_src, vxa->data, vxa->nr, vxa->stride,
+                                        target, budget, &target_error);
+        if (!goodenough(nr_idx, nr_src)) {
             nr_idx = -1;
             goto out;
         }
     }
 
-    *idx = idx32_to_idx(idx32, nr_idx);
+    *idx = idx32_to_idx(idx32, nr_idx, mesh_idx_stride(mesh));
+    *error = target_error;
 out:
     free(idx32);
 
     return nr_idx;
 }
+
+/*
+ * An empty entry means there is no good enough LOD at this level; otherwise
+ * it's the simplification error, followed by the indices. The key doesn't
+ * need @src: it's the same chain from the same mesh every time
+ */
+ssize_t mesh_idx_to_lod(struct mesh *mesh, int lod, void *src, size_t nr_src, void **idx,
+                        float *error)
+{
+    size_t stride = mesh_idx_stride(mesh);
+    struct { int32_t lod; uint32_t nr_src; } extra = { lod, nr_src };
+    char key[LIB_CACHE_KEY_MAX];
+    struct iovec iov[2];
+    ssize_t nr_idx;
+    size_t size;
+    void *buf;
+
+    *idx = NULL;
+    mesh_cache_key(mesh, key, "lod-chain", &extra, sizeof(extra));
+    if (!lib_cache_get(key, &buf, &size)) {
+        if (size <= sizeof(*error) || (size - sizeof(*error)) % stride) {
+            free(buf);
+            return -1;
+        }
+
+        memcpy(error, buf, sizeof(*error));
+        size -= sizeof(*error);
+        CHECK(*idx = memdup(buf + sizeof(*error), size));
+        free(buf);
+        return size / stride;
+    }
+
+    *error = 0;
+    nr_idx = mesh_idx_to_lod_uncached(mesh, lod, src, nr_src, idx, error);
+    if (nr_idx >= 0 && !*idx)
+        return -1;
+
+    iov[0].iov_base = error;
+    iov[0].iov_len  = sizeof(*error);
+    iov[1].iov_base = *idx;
+    iov[1].iov_len  = nr_idx * stride;
+    lib_cache_put(key, iov, nr_idx < 0 ? 0 : 2);
+
+    return nr_idx;
+}
+
+/* the box's corners are the bits of their index: 1 is x, 2 is y, 4 is z */
+static const unsigned short box_idx[] = {
+    0, 4, 6, 0, 6, 2, /* -x */
+    1, 3, 7, 1, 7, 5, /* +x */
+    0, 1, 5, 0, 5, 4, /* -y */
+    2, 6, 7, 2, 7, 3, /* +y */
+    0, 2, 3, 0, 3, 1, /* -z */
+    4, 5, 7, 4, 7, 6, /* +z */
+};
+
+static int collision_box(float **vx, size_t *vxsz, void **idx, size_t *idxsz, unsigned int *stride)
+{
+    size_t i, nr_vx = *vxsz / (sizeof(float) * 3);
+    vec3 lo, hi;
+    float *box;
+    int j, k;
+
+    if (!nr_vx)
+        return -EINVAL;
+
+    for (k = 0; k < 3; k++)
+        lo[k] = hi[k] = (*vx)[k];
+    for (i = 1; i < nr_vx; i++)
+        for (k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], (*vx)[i * 3 + k]);
+            hi[k] = max(hi[k], (*vx)[i * 3 + k]);
+        }
+
+    CHECK(box = malloc(8 * 3 * sizeof(*box)));
+    for (j = 0; j < 8; j++)
+        for (k = 0; k < 3; k++)
+            box[j * 3 + k] = j & (1 << k) ? hi[k] : lo[k];
+
+    free(*vx);
+    free(*idx);
+    *vx = box;
+    *vxsz = 8 * 3 * sizeof(*box);
+    CHECK(*idx = memdup(box_idx, sizeof(box_idx)));
+    *idxsz = sizeof(box_idx);
+    *stride = sizeof(unsigned short);
+
+    return 0;
+}
+
+/* the ODE end only needs triangles, so it's fine to fall back to the sloppy one */
+#define COLLISION_TARGET_DIV    16
+
+static int collision_simplify(float error, float **vx, size_t *vxsz, void **idx, size_t *idxsz,
+                              unsigned int *stride)
+{
+    size_t i, nr_vx = *vxsz / (sizeof(float) * 3), nr_src = *idxsz / *stride, nr_idx, nr_new_vx;
+    size_t target = max(nr_src / COLLISION_TARGET_DIV / 3 * 3, (size_t)LOD_MIN_IDX);
+    unsigned int *idx32, *remap;
+    float target_error = 0;
+    float *new_vx;
+
+    if (nr_src <= target)
+        return 0;
+
+    idx32 = idx_to_idx32(*idx, *stride, nr_src);
+    nr_idx = meshopt_simplify(idx32, idx32, nr_src, *vx, nr_vx, sizeof(float) * 3,
+                              target, error, &target_error);
+    if (!goodenough(nr_idx, nr_src) || nr_idx > target * 2)
+        nr_idx = meshopt_simplifySloppy(idx32, idx32, nr_src, *vx, nr_vx, sizeof(float) * 3,
+                                        target, error, &target_error);
+    if (!nr_idx || !goodenough(nr_idx, nr_src)) {
+        free(idx32);
+        return -1;
+    }
+
+    /* only keep the vertices that are still in use */
+    CHECK(remap = malloc(nr_vx * sizeof(*remap)));
+    memset(remap, 0xff, nr_vx * sizeof(*remap));
+    CHECK(new_vx = malloc(nr_vx * sizeof(float) * 3));
+    for (i = 0, nr_new_vx = 0; i < nr_idx; i++) {
+        if (remap[idx32[i]] == UINT_MAX) {
+            memcpy(&new_vx[nr_new_vx * 3], &(*vx)[idx32[i] * 3], sizeof(float) * 3);
+            remap[idx32[i]] = nr_new_vx++;
+        }
+        idx32[i] = remap[idx32[i]];
+    }
+    free(remap);
+
+    dbg("collision mesh: %zu -> %zu triangles, %zu -> %zu vertices, error %f\n",
+        nr_src / 3, nr_idx / 3, nr_vx, nr_new_vx, target_error);
+
+    free(*vx);
+    free(*idx);
+    CHECK(*vx = realloc(new_vx, nr_new_vx * sizeof(float) * 3));
+    *vxsz = nr_new_vx * sizeof(float) * 3;
+    *stride = idx32_stride(idx32, nr_idx);
+    *idx = idx32_to_idx(idx32, nr_idx, *stride);
+    *idxsz = nr_idx * *stride;
+    free(idx32);
+
+    return 0;
+}
+
+int mesh_collision_proxy(enum collision_proxy proxy, float error, float **vx, size_t *vxsz,
+                         void **idx, size_t *idxsz, unsigned int *stride)
+{
+    if (!*stride)
+        *stride = sizeof(unsigned short);
+
+    switch (proxy) {
+    case COLLISION_FULL:
+        return 0;
+    case COLLISION_SIMPLIFIED:
+        return collision_simplify(error, vx, vxsz, idx, idxsz, stride);
+    case COLLISION_BOX:
+        return collision_box(vx, vxsz, idx, idxsz, stride);
+    }
+
+    return -EINVAL;
+}
@@ -1,7 +1,10 @@
 #ifndef __CLAP_MESH_H__
 #define __CLAP_MESH_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include "linmath.h"
 #include "logger.h"
 #include "object.h"
 
@@ -45,6 +48,8 @@ struct mesh {
     const char          *name;
     size_t              idxsz;
     struct mesh_attr    attr[MESH_MAX];
+    /* what mem_account() has of the attributes, see mesh_account() */
+    size_t              mem;
 };
 typedef struct mesh mesh_t;
 
@@ -96,14 +101,23 @@ ATTR_ACCESSORS(norm, NORM, float);
 ATTR_ACCESSORS(tangent, TANGENTS, float);
 ATTR_ACCESSORS(joints, JOINTS, unsigned char);
 ATTR_ACCESSORS(weights, WEIGHTS, float);
-ATTR_ACCESSORS(idx, IDX, unsigned short);
+/* u16 or u32, see mesh_idx_stride() */
+ATTR_ACCESSORS(idx, IDX, void);
 
 int mesh_attr_add(struct mesh *mesh, unsigned int attr, void *data, size_t stride, size_t nr);
 int mesh_attr_alloc(struct mesh *mesh, unsigned int attr, size_t stride, size_t nr);
 int mesh_attr_dup(struct mesh *mesh, unsigned int attr, void *data, size_t stride, size_t nr);
 struct mesh *mesh_new(const char *name);
+/* of all the attributes' data, the same for the same mesh from different loads */
+uint64_t mesh_hash(struct mesh *mesh);
 void mesh_push_mesh(struct mesh *mesh, struct mesh *src,
                     float x, float y, float z, float scale);
+/*
+ * Same, but @src goes through @mx, which has no scale other than a uniform
+ * one, so the normals and tangents only need the rotation; the indices of
+ * either width go into @mesh's width.
+ */
+void mesh_push_mesh_mx(struct mesh *mesh, struct mesh *src, mat4x4 mx);
 
 void mesh_push(float *vx, float *tx, float *norm, unsigned short *idx,
                int *nr_vx, int *nr_tx, int *nr_idx,
@@ -115,6 +129,36 @@ void mesh_optimize0(float *vx, float *tx, float *norm, unsigned short *idx,
                    float **_new_vx, unsigned short **_new_idx, float **_new_tx,
                    float **_new_norm, size_t *_nr_new_vx);
 void mesh_optimize(struct mesh *mesh);
-ssize_t mesh_idx_to_lod(struct mesh *mesh, int lod, unsigned short **idx, size_t orig_idx);
+
+struct xyzarray;
+/*
+ * Faces of the solid cells of @xyz (or the empty ones, if @inv), merged
+ * greedily, see voxel.h; cells are @side long, (x, y, z) lands at @origin +
+ * (x, z, y) * @side, that is, z is up. Texture coordinates are in cells, for
+ * repeating textures. NULL if there's nothing solid.
+ */
+struct mesh *mesh_new_voxels(const char *name, struct xyzarray *xyz, bool inv, float side, vec3 origin);
+/*
+ * Next LOD in the chain after @src; @error: of the simplification from @src,
+ * relative to the mesh's extents. Safe to call from jobs.
+ */
+ssize_t mesh_idx_to_lod(struct mesh *mesh, int lod, void *src, size_t nr_src, void **idx,
+                        float *error);
+
+enum collision_proxy {
+    COLLISION_FULL = 0,
+    COLLISION_SIMPLIFIED,
+    COLLISION_BOX,
+};
+
+/*
+ * Swap a collision mesh (3 floats per vertex, indices of @stride) for a
+ * cheaper one, in place: an aggressively simplified one within @error (of
+ * the extents), or the bounding box, for small props; the arrays are
+ * malloc()ed, byte sizes, like model3d::collision_*. If it doesn't simplify,
+ * it stays as it is and it's -1.
+ */
+int mesh_collision_proxy(enum collision_proxy proxy, float error, float **vx, size_t *vxsz,
+                         void **idx, size_t *idxsz, unsigned int *stride);
 
 #endif /* __CLAP_MESH_H__ */
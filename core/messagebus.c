@@ -1,12 +1,14 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include "common.h"
 #include "messagebus.h"
 
 static struct subscriber *subscriber[MT_MAX];
 
-int subscribe(enum message_type type, subscriber_fn fn, void *data)
+int subscribe_mask(enum message_type type, subscriber_fn fn, void *data, uint64_t mask)
 {
     struct subscriber *s, **lastp;
 
@@ -16,6 +18,7 @@ int subscribe(enum message_type type, subscriber_fn fn, void *data)
 
     s->handle = fn;
     s->data = data;
+    s->mask = mask;
     s->next = NULL;
 
     for (lastp = &subscriber[type]; *lastp; lastp = &((*lastp)->next))
@@ -26,12 +29,62 @@ int subscribe(enum message_type type, subscriber_fn fn, void *data)
     return 0;
 }
 
+int subscribe(enum message_type type, subscriber_fn fn, void *data)
+{
+    return subscribe_mask(type, fn, data, MSG_ALL);
+}
+
+_Static_assert(offsetof(struct message_input, debug_action) < 56,
+               "input button bits run into the analog ones");
+
+uint64_t message_command_mask(struct message_command *cmd)
+{
+    unsigned int bits;
+
+    /* the command bits are the first word */
+    memcpy(&bits, cmd, sizeof(bits));
+
+    return bits;
+}
+
+uint64_t message_mask(struct message *m)
+{
+    struct message_input *mi = &m->input;
+    const unsigned char *p;
+    uint64_t mask = 0;
+
+    switch (m->type) {
+    case MT_INPUT:
+        for (p = &mi->left; p <= &mi->debug_action; p++)
+            if (*p)
+                mask |= 1ull << (p - &mi->left);
+
+        if (mi->delta_lx || mi->delta_ly)
+            mask |= MSG_INPUT_DELTA_L;
+        if (mi->delta_rx || mi->delta_ry)
+            mask |= MSG_INPUT_DELTA_R;
+        if (mi->trigger_l || mi->trigger_r)
+            mask |= MSG_INPUT_TRIGGERS;
+        if (mi->x || mi->y)
+            mask |= MSG_INPUT_POINTER;
+        return mask;
+    case MT_COMMAND:
+        return message_command_mask(&m->cmd);
+    default:
+        return MSG_ALL;
+    }
+}
+
 int message_send(struct message *m)
 {
+    uint64_t mask = message_mask(m);
     struct subscriber *s;
     int ret = 0, res;
 
     for (s = subscriber[m->type]; s; s = s->next) {
+        if (s->mask != MSG_ALL && !(s->mask & mask))
+            continue;
+
         res = s->handle(m, s->data);
         if (res == MSG_STOP)
             break;
@@ -41,6 +94,103 @@ int message_send(struct message *m)
     return ret;
 }
 
+/*
+ * Posted messages: producers push onto a lock-free stack per type, the
+ * drain takes the whole stack in one exchange and reverses it into the
+ * posting order. Whatever the handlers post goes to the next drain.
+ */
+struct message_node {
+    struct message_node *next;
+    /* last: MT_LOG's text follows it */
+    struct message      m;
+};
+
+static _Atomic(struct message_node *) posted[MT_MAX];
+
+static size_t message_size(struct message *m)
+{
+    return sizeof(*m) + (m->type == MT_LOG ? m->log.length : 0);
+}
+
+int message_post(struct message *m)
+{
+    struct message_node *n;
+
+    n = malloc(offsetof(struct message_node, m) + message_size(m));
+    if (!n)
+        return -ENOMEM;
+
+    memcpy(&n->m, m, message_size(m));
+    n->next = atomic_load_explicit(&posted[m->type], memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&posted[m->type], &n->next, n,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+
+    return 0;
+}
+
+/*
+ * Nothing but the pointer position and the sticks; the keyboard source's
+ * deltas are the wheel (and touch), which add up rather than replace each
+ * other, so those don't count
+ */
+static bool message_input_is_motion(struct message *m)
+{
+    struct message_input *mi = &m->input;
+    unsigned char *p;
+
+    for (p = &mi->left; p <= &mi->debug_action; p++)
+        if (*p && p != &mi->mouse_move)
+            return false;
+
+    if (m->source && m->source->type == MST_KEYBOARD &&
+        (mi->delta_lx || mi->delta_ly || mi->delta_rx || mi->delta_ry))
+        return false;
+
+    return !mi->trigger_l && !mi->trigger_r;
+}
+
+/*
+ * The positions and stick deflections are absolute, so the later one
+ * has all of it, as long as it knows the pointer moved in between.
+ */
+static bool message_coalesce(struct message *prev, struct message *next)
+{
+    if (next->type != MT_INPUT || prev->source != next->source ||
+        !message_input_is_motion(prev) || !message_input_is_motion(next))
+        return false;
+
+    if (prev->input.mouse_move && !next->input.mouse_move) {
+        next->input.mouse_move = 1;
+        next->input.x = prev->input.x;
+        next->input.y = prev->input.y;
+    }
+
+    return true;
+}
+
+void messagebus_drain(void)
+{
+    struct message_node *n, *next, *list;
+    int type;
+
+    for (type = 0; type < MT_MAX; type++) {
+        n = atomic_exchange_explicit(&posted[type], NULL, memory_order_acquire);
+        for (list = NULL; n; n = next) {
+            next = n->next;
+            n->next = list;
+            list = n;
+        }
+
+        for (n = list; n; n = next) {
+            next = n->next;
+            if (!next || !message_coalesce(&n->m, &next->m))
+                message_send(&n->m);
+            free(n);
+        }
+    }
+}
+
 int messagebus_init(void)
 {
     return 0;
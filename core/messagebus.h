@@ -2,6 +2,8 @@
 #ifndef __CLAP_MESSAGEBUS_H__
 #define __CLAP_MESSAGEBUS_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include "util.h"
 
@@ -24,6 +26,7 @@ enum message_source_type {
     MST_CLIENT,
     MST_SERVER,
     MST_FUZZER,
+    MST_REPLAY,
 };
 
 struct message_input {
@@ -78,6 +81,11 @@ struct message_input {
     unsigned int    x, y;
 };
 
+/* frame times in microseconds, see clap_fps_calc() */
+struct frame_stats {
+    unsigned int    p50, p95, p99, max;
+};
+
 struct message_command {
     unsigned int    menu_enter  : 1,
                     menu_exit   : 1,
@@ -89,8 +97,23 @@ struct message_command {
                     log_follows : 1,
                     toggle_fuzzer : 1,
                     toggle_autopilot : 1,
-                    toggle_noise: 1;
+                    toggle_noise: 1,
+                    input_follows : 1,
+                    input_ack   : 1,
+                    snapshot_follows : 1,
+                    snapshot_ack : 1,
+                    load_progress : 1;
     unsigned int    fps, sys_seconds, world_seconds;
+    /* with input_ack: the last input delta received */
+    unsigned int    input_seq;
+    /* with snapshot_ack: the last snapshot received */
+    unsigned int    snapshot_seq;
+    /* with load_progress: entities made so far, out of how many, see scene_load_step() */
+    unsigned int    load_done, load_total;
+    /* with status: over the last second and over the whole session */
+    struct frame_stats  frame_time, session_frame_time;
+    /* with status: bytes, see mem_stats_total() */
+    uint64_t        mem_live, mem_peak, gpu_mem_live, gpu_mem_peak;
     struct timespec64 time;
 };
 
@@ -109,6 +132,8 @@ struct message_source {
 struct message {
     enum message_type           type;
     struct message_source       *source; /* for input: keyboard, joystick */
+    /* for input: when it was sampled, CLOCK_MONOTONIC; or zero */
+    struct timespec             ts;
 
     union {
         struct message_input    input;
@@ -119,14 +144,46 @@ struct message {
 
 typedef int (*subscriber_fn)(struct message *m, void *data);
 
+/*
+ * What a message carries, see message_mask(): for MT_INPUT, a bit per
+ * button field that's set and one per analog pair that's not zero; for
+ * MT_COMMAND, the command bits. Subscribers only get messages that have
+ * one of the bits they asked for; MSG_ALL ones get everything.
+ */
+#define MSG_ALL             (~0ull)
+/* the button fields are the first bytes of struct message_input */
+#define MSG_INPUT(_field)   (1ull << offsetof(struct message_input, _field))
+#define MSG_INPUT_DELTA_L   (1ull << 56)
+#define MSG_INPUT_DELTA_R   (1ull << 57)
+#define MSG_INPUT_TRIGGERS  (1ull << 58)
+#define MSG_INPUT_POINTER   (1ull << 59)
+#define MSG_COMMAND(_field) ({ \
+    struct message_command __cmd = { ._field = 1 }; \
+    message_command_mask(&__cmd); \
+})
+
+uint64_t message_command_mask(struct message_command *cmd);
+uint64_t message_mask(struct message *m);
+
 struct subscriber {
     subscriber_fn       handle;
     void                *data;
+    uint64_t            mask;
     struct subscriber   *next;
 };
 
 int subscribe(enum message_type type, subscriber_fn fn, void *data);
+int subscribe_mask(enum message_type type, subscriber_fn fn, void *data, uint64_t mask);
+/* to the subscribers, right away, on the caller's stack */
 int message_send(struct message *m);
+/*
+ * Queue a copy for messagebus_drain(), from any thread; consecutive
+ * pointer and stick motion inputs from the same source get merged
+ * into the last one of them. -ENOMEM if it couldn't be queued.
+ */
+int message_post(struct message *m);
+/* the main thread, once a frame: sends out everything posted so far */
+void messagebus_drain(void);
 int messagebus_init(void);
 
 #endif /* __CLAP_MESSAGEBUS_H__ */
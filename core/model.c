@@ -5,8 +5,13 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
 #include "librarian.h"
 #include "common.h"
+#include "jobs.h"
+#include "ktx2.h"
 #include "render.h"
 #include "matrix.h"
 #include "util.h"
@@ -15,15 +20,97 @@
 #include "model.h"
 #include "pngloader.h"
 #include "physics.h"
+#include "profiler.h"
 #include "shader.h"
 #include "scene.h"
-#include "ui-debug.h"
+#include "xform.h"
 
 /****************************************************************************
  * model3d
  * the actual rendered model
  ****************************************************************************/
 
+/*
+ * LODs are simplified in a job, so the model is there to draw at LOD0 in the
+ * meantime; index buffers only get made on the GL thread, when it next draws
+ * the model and finds the job done. Unless the chain is cached, which it is
+ * after the first run.
+ */
+struct model3d_lods {
+    struct job_counter  counter;
+    struct mesh         *mesh;
+    void                *idx[LOD_MAX];
+    size_t              nr_idx[LOD_MAX];
+    float               error[LOD_MAX];
+    unsigned int        nr_lods;
+    char                *name;
+};
+
+static void model3d_lods_free(struct model3d_lods *lods)
+{
+    int i;
+
+    for (i = 0; i < LOD_MAX; i++)
+        free(lods->idx[i]);
+    ref_put(lods->mesh);
+    free(lods->name);
+    free(lods);
+}
+
+/*
+ * Animations are built in a job too, the model is there to draw in its
+ * bind pose in the meantime; see model3d_add_animations()
+ */
+struct model3d_anis {
+    struct job_counter  counter;
+    struct model3d      *model;
+    darray(struct animation, anis);
+    model3d_anis_fn     build;
+    void                (*release)(void *data);
+    void                *data;
+};
+
+static size_t channel_bytes(struct channel *chan)
+{
+    return chan->nr * (sizeof(float) + chan->stride);
+}
+
+static void animation_channels_free(struct animation *an)
+{
+    int i;
+
+    for (i = 0; i < an->nr_channels; i++) {
+        mem_account(MEM_ANIMATION, -(ssize_t)channel_bytes(&an->channels[i]));
+        free(an->channels[i].time);
+        free(an->channels[i].data);
+    }
+    free(an->channels);
+    free(an->name);
+}
+
+static void model3d_anis_free(struct model3d_anis *pending)
+{
+    struct animation *an;
+
+    darray_for_each(an, &pending->anis)
+        animation_channels_free(an);
+    darray_clearout(&pending->anis.da);
+    pending->release(pending->data);
+    free(pending);
+}
+
+/* the GPU memory estimate goes with it, see load_gl_buffer() */
+static void gl_buffer_delete(GLuint *obj, size_t *size)
+{
+    if (!*obj)
+        return;
+
+    GL(glDeleteBuffers(1, obj));
+    mem_account(MEM_GPU_BUFFER, -(ssize_t)*size);
+    *obj = 0;
+    *size = 0;
+}
+
 static void model3d_drop(struct ref *ref)
 {
     struct model3d *m = container_of(ref, struct model3d, ref);
@@ -31,38 +118,55 @@ static void model3d_drop(struct ref *ref)
     struct joint *joint;
     int i;
 
-    glDeleteBuffers(1, &m->vertex_obj);
-    for (i = 0; i < m->nr_lods; i++)
-        glDeleteBuffers(1, &m->index_obj[i]);
-    if (m->norm_obj)
-        glDeleteBuffers(1, &m->norm_obj);
-    if (m->tex_obj)
-        glDeleteBuffers(1, &m->tex_obj);
-    if (m->nr_joints) {
-        GL(glDeleteBuffers(1, &m->joints_obj));
-        GL(glDeleteBuffers(1, &m->weights_obj));
+    if (m->lods) {
+        jobs_wait(&m->lods->counter);
+        model3d_lods_free(m->lods);
+    }
+
+    if (m->pending_anis) {
+        jobs_wait(&m->pending_anis->counter);
+        model3d_anis_free(m->pending_anis);
     }
+
+    gl_buffer_delete(&m->vertex_obj, &m->vertex_size);
+    gl_buffer_delete(&m->index_obj, &m->index_size);
+    gl_buffer_delete(&m->norm_obj, &m->norm_size);
+    gl_buffer_delete(&m->tex_obj, &m->tex_size);
+    gl_buffer_delete(&m->tangent_obj, &m->tangent_size);
+    gl_buffer_delete(&m->joints_obj, &m->joints_size);
+    gl_buffer_delete(&m->weights_obj, &m->weights_size);
+    for (i = 0; i < LOD_MAX; i++)
+        darray_clearout(&m->instances[i].da);
     if (gl_does_vao())
-        glDeleteVertexArrays(1, &m->vao);
+        render_delete_vao(m->vao);
     /* delete gl buffers */
     ref_put(m->prog);
+    if (m->skin_prog)
+        ref_put(m->skin_prog);
     trace("dropping model '%s'\n", m->name);
-    darray_for_each(an, &m->anis) {
-        for (i = 0; i < an->nr_channels; i++) {
-            free(an->channels[i].time);
-            free(an->channels[i].data);
-        }
-        free(an->channels);
-        free(an->name);
-    }
+    darray_for_each(an, &m->anis)
+        animation_channels_free(an);
     darray_clearout(&m->anis.da);
     for (i = 0; i < m->nr_joints; i++) {
         darray_clearout(&m->joints[i].children.da);
         free(m->joints[i].name);
     }
     free(m->joints);
+    free(m->joint_invmx);
+    free(m->joint_order);
+    free(m->joint_parent);
+    for (i = 0; i < POSE_CACHE_MAX; i++) {
+        free(m->poses[i].joint_transforms);
+        free(m->poses[i].translation);
+        free(m->poses[i].rotation);
+        free(m->poses[i].scale);
+    }
     free(m->collision_vx);
     free(m->collision_idx);
+    phys_trimesh_free(m->trimesh);
+    free(m->batch_vx);
+    free(m->batch_tx);
+    free(m->batch_idx);
     free(m->name);
 }
 
@@ -78,7 +182,7 @@ static int load_gl_texture_buffer(struct shader_prog *p, void *buffer, int width
     //hexdump(buffer, 16);
     texture_init_target(tex, target);
     texture_filters(tex, GL_REPEAT, GL_NEAREST);
-    GL(glUniform1i(loc, target - GL_TEXTURE0));
+    UNIFORM(glUniform1i(loc, target - GL_TEXTURE0));
 
     // Bind it
     texture_load(tex, color_type, width, height, buffer);
@@ -86,6 +190,28 @@ static int load_gl_texture_buffer(struct shader_prog *p, void *buffer, int width
     return 0;
 }
 
+/* compressed textures go to the GPU as they are, mips and all */
+static int load_gl_texture_ktx2(struct shader_prog *p, void *buf, size_t size, GLuint target,
+                                GLint loc, texture_t *tex)
+{
+    struct ktx2_image img;
+    int ret;
+
+    ret = ktx2_parse(buf, size, &img);
+    if (ret)
+        return ret;
+
+    texture_init_target(tex, target);
+    texture_filters(tex, GL_REPEAT, GL_NEAREST);
+    ret = texture_load_ktx2(tex, &img);
+    if (ret)
+        return ret;
+
+    UNIFORM(glUniform1i(loc, target - GL_TEXTURE0));
+
+    return 0;
+}
+
 /* XXX: actually, make it take the decoded texture, not the png */
 static int model3d_add_texture_from_buffer(struct model3dtx *txm, GLuint target, void *input, size_t length)
 {
@@ -95,6 +221,16 @@ static int model3d_add_texture_from_buffer(struct model3dtx *txm, GLuint target,
     int width, height, has_alpha, ret;
     unsigned char *buffer;
 
+    if (ktx2_is_ktx2(input, length)) {
+        shader_prog_use(prog);
+        ret = load_gl_texture_ktx2(prog, input, length, target, locs[target - GL_TEXTURE0],
+                                   targets[target - GL_TEXTURE0]);
+        shader_prog_done(prog);
+        if (ret)
+            warn("couldn't load compressed texture%d: %d\n", target - GL_TEXTURE0, ret);
+        return ret;
+    }
+
     // dbg("## shader '%s' texture_map: %d normal_map: %d\n", prog->name, prog->texture_map, prog->normal_map);
     buffer = decode_png(input, length, &width, &height, &has_alpha);
     shader_prog_use(prog);
@@ -108,24 +244,206 @@ static int model3d_add_texture_from_buffer(struct model3dtx *txm, GLuint target,
     return ret;
 }
 
+/* foo.ktx2 next to foo.png is used instead, unless it's older */
+static struct lib_handle *texture_map_ktx2(const char *name, void **buf, size_t *size)
+{
+    struct stat st_png, st_ktx2;
+    LOCAL(char, ktx2);
+
+    if (!str_endswith(name, ".png") ||
+        asprintf(&ktx2, "%.*s.ktx2", (int)strlen(name) - 4, name) == -1)
+        return NULL;
+
+    if (lib_stat(RES_ASSET, ktx2, &st_ktx2))
+        return NULL;
+
+    if (!lib_stat(RES_ASSET, name, &st_png) && st_png.st_mtime > st_ktx2.st_mtime) {
+        warn("'%s' is older than '%s', ignoring it\n", ktx2, name);
+        return NULL;
+    }
+
+    return lib_map_file(RES_ASSET, ktx2, buf, size);
+}
+
+/* 2x2 box filter, in place */
+static void texture_halve(unsigned char *buf, int *width, int *height, int comps)
+{
+    int x, y, c, w = *width / 2, h = *height / 2, stride = *width * comps;
+    unsigned char *p;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            for (c = 0; c < comps; c++) {
+                p = buf + y * 2 * stride + x * 2 * comps + c;
+                buf[(y * w + x) * comps + c] =
+                    (p[0] + p[comps] + p[stride] + p[stride + comps] + 2) / 4;
+            }
+
+    *width  = w;
+    *height = h;
+}
+
+/*
+ * texture_load_fn: upload @name into @tex without its top @lod levels;
+ * pngs don't have any, so they're scaled down instead. If the GPU can't
+ * take the ktx2's format, it's back to the png.
+ */
+static int model3d_texture_load(texture_t *tex, const char *name, unsigned int lod)
+{
+    int width = 0, height = 0, has_alpha = 0, ret = -ENOENT;
+    struct ktx2_image img;
+    struct lib_handle *lh;
+    unsigned char *buffer;
+    unsigned int i;
+    size_t size;
+    void *buf;
+
+    lh = texture_map_ktx2(name, &buf, &size);
+    if (lh) {
+        ret = ktx2_parse(buf, size, &img);
+        if (!ret && lod >= img.nr_levels) {
+            ret = -ERANGE;
+        } else if (!ret) {
+            memmove(img.levels, img.levels + lod, (img.nr_levels - lod) * sizeof(*img.levels));
+            img.nr_levels -= lod;
+            img.width      = max(img.width >> lod, 1);
+            img.height     = max(img.height >> lod, 1);
+            ret = texture_load_ktx2(tex, &img);
+        }
+        ref_put(lh);
+
+        if (ret != -ENOTSUP)
+            return ret;
+    }
+
+    buffer = fetch_png(name, &width, &height, &has_alpha);
+    if (!buffer)
+        return -ENOENT;
+
+    for (i = 0; i < lod && width > 1 && height > 1; i++)
+        texture_halve(buffer, &width, &height, has_alpha ? 4 : 3);
+
+    if (i == lod)
+        texture_load(tex, has_alpha ? GL_RGBA : GL_RGB, width, height, buffer);
+    free(buffer);
+
+    return i == lod ? 0 : -ERANGE;
+}
+
+struct texture_job {
+    struct lib_handle       *lh;
+    void                    *buf;
+    size_t                  size;
+    void                    *pixels;
+    size_t                  pixels_size;
+    struct texture_upload   *upl;
+};
+
+/* main thread, the handle isn't safe to put from a job */
+static void texture_job_done(void *data)
+{
+    struct texture_job *tj = data;
+
+    ref_put(tj->lh);
+    free(tj);
+}
+
+static void texture_decode_job(void *priv)
+{
+    struct texture_job *tj = priv;
+
+    texture_upload_ready(tj->upl, !decode_png_into(tj->buf, tj->size, tj->pixels, tj->pixels_size));
+}
+
+/*
+ * The first load of a png goes to a job, which decodes it straight into
+ * the upload, see texture_upload_begin(); ktx2s and the pngs that the
+ * header doesn't say enough about are -ENOTSUP, for the synchronous path.
+ */
+static int model3d_texture_load_async(texture_t *tex, const char *name)
+{
+    int width, height, has_alpha, ret;
+    struct texture_job *tj;
+    struct lib_handle *lh;
+    size_t size;
+    void *buf;
+
+    lh = texture_map_ktx2(name, &buf, &size);
+    if (lh) {
+        ref_put(lh);
+        return -ENOTSUP;
+    }
+
+    lh = lib_map_file(RES_ASSET, name, &buf, &size);
+    if (!lh)
+        return -ENOENT;
+
+    ret = png_get_header(buf, size, &width, &height, &has_alpha);
+    if (ret)
+        goto err;
+
+    ret = -ENOMEM;
+    tj = calloc(1, sizeof(*tj));
+    if (!tj)
+        goto err;
+
+    tj->lh          = lh;
+    tj->buf         = buf;
+    tj->size        = size;
+    tj->pixels_size = (size_t)width * height * (has_alpha ? 4 : 3);
+    tj->upl = texture_upload_begin(tex, has_alpha ? GL_RGBA : GL_RGB, width, height,
+                                   &tj->pixels, texture_job_done, tj);
+    if (!tj->upl) {
+        free(tj);
+        goto err;
+    }
+
+    if (jobs_submit(texture_decode_job, tj, NULL))
+        texture_decode_job(tj);
+
+    return 0;
+
+err:
+    ref_put(lh);
+    return ret;
+}
+
 static int model3d_add_texture_at(struct model3dtx *txm, GLuint target, const char *name)
 {
-    int width = 0, height = 0, has_alpha = 0, ret;
-    unsigned char *buffer = fetch_png(name, &width, &height, &has_alpha);
     struct shader_prog *prog = txm->model->prog;
-    texture_t *targets[] = { txm->texture, txm->normals };
-    GLint locs[] = { prog->texture_map, prog->normal_map };
+    texture_t **slot = target == GL_TEXTURE0 ? &txm->texture : &txm->normals;
+    GLint loc = target == GL_TEXTURE0 ? prog->texture_map : prog->normal_map;
+    texture_t *tex;
+    int ret;
+
+    /* the same asset, loaded by another model */
+    tex = texture_get(name);
+    if (!tex) {
+        tex = texture_new(target);
+        if (!tex)
+            return -ENOMEM;
+
+        texture_filters(tex, GL_REPEAT, GL_NEAREST);
+        ret = model3d_texture_load_async(tex, name);
+        if (ret)
+            ret = model3d_texture_load(tex, name, 0);
+        if (ret) {
+            err("couldn't load texture '%s': %d\n", name, ret);
+            texture_done(tex);
+            return ret;
+        }
+
+        CHECK0(texture_set_source(tex, name, model3d_texture_load));
+    }
+    *slot = tex;
 
     shader_prog_use(prog);
-    ret = load_gl_texture_buffer(prog, buffer, width, height, has_alpha, target,
-                                 locs[target - GL_TEXTURE0],
-                                 targets[target - GL_TEXTURE0]);
+    UNIFORM(glUniform1i(loc, target - GL_TEXTURE0));
     shader_prog_done(prog);
-    free(buffer);
 
-    dbg("loaded texture%d %d %dx%d\n", target - GL_TEXTURE0, texture_id(txm->texture), width, height);
+    dbg("loaded texture%d %d '%s'\n", target - GL_TEXTURE0, texture_id(tex), name);
 
-    return ret;
+    return 0;
 }
 
 static int model3d_add_texture(struct model3dtx *txm, const char *name)
@@ -139,6 +457,7 @@ static int model3dtx_make(struct ref *ref)
     txm->texture = &txm->_texture;
     txm->normals = &txm->_normals;
     list_init(&txm->entities);
+    list_init(&txm->model_entry);
     return 0;
 }
 
@@ -154,18 +473,33 @@ static void model3dtx_drop(struct ref *ref)
 
     trace("dropping model3dtx [%s]\n", name);
     list_del(&txm->entry);
+    list_del(&txm->model_entry);
+    ref_put(txm->model);
+    /* borrowed, see model3dtx_batch_static() */
+    if (txm->tex_owner) {
+        ref_put(txm->tex_owner);
+        return;
+    }
+
     /* XXX this is a bit XXX */
     if (model3dtx_tex_is_ext(txm))
         texture_done(txm->texture);
     else
         texture_deinit(txm->texture);
-    if (txm->normals)
+    if (txm->normals && txm->normals != &txm->_normals)
+        texture_done(txm->normals);
+    else if (txm->normals)
         texture_deinit(txm->normals);
-    ref_put(txm->model);
 }
 
 DECLARE_REFCLASS2(model3dtx);
 
+static void model3dtx_set_model(struct model3dtx *txm, struct model3d *model)
+{
+    txm->model = ref_get(model);
+    list_append(&model->txmodels, &txm->model_entry);
+}
+
 struct model3dtx *model3dtx_new2(struct model3d *model, const char *tex, const char *norm)
 {
     struct model3dtx *txm = ref_new(model3dtx);
@@ -173,7 +507,7 @@ struct model3dtx *model3dtx_new2(struct model3d *model, const char *tex, const c
     if (!txm)
         return NULL;
 
-    txm->model = ref_get(model);
+    model3dtx_set_model(txm, model);
     model3d_add_texture(txm, tex);
     if (norm)
         model3d_add_texture_at(txm, GL_TEXTURE1, norm);
@@ -195,7 +529,7 @@ struct model3dtx *model3dtx_new_from_buffer(struct model3d *model, void *buffer,
     if (!txm)
         return NULL;
 
-    txm->model = ref_get(model);
+    model3dtx_set_model(txm, model);
     model3d_add_texture_from_buffer(txm, GL_TEXTURE0, buffer, length);
 
     return txm;
@@ -208,7 +542,7 @@ struct model3dtx *model3dtx_new_from_buffers(struct model3d *model, void *tex, s
     if (!txm)
         return NULL;
 
-    txm->model = ref_get(model);
+    model3dtx_set_model(txm, model);
     model3d_add_texture_from_buffer(txm, GL_TEXTURE0, tex, texsz);
     model3d_add_texture_from_buffer(txm, GL_TEXTURE1, norm, normsz);
 
@@ -222,7 +556,7 @@ struct model3dtx *model3dtx_new_texture(struct model3d *model, texture_t *tex)
     if (!txm)
         return NULL;
 
-    txm->model = ref_get(model);
+    model3dtx_set_model(txm, model);
     txm->texture = tex;
     txm->external_tex = true;
 
@@ -230,11 +564,15 @@ struct model3dtx *model3dtx_new_texture(struct model3d *model, texture_t *tex)
 }
 
 static void load_gl_buffer(GLint loc, void *data, GLuint type, size_t sz, GLuint *obj,
-                           GLint nr_coords, GLenum target)
+                           size_t *obj_size, GLint nr_coords, GLenum target)
 {
     GL(glGenBuffers(1, obj));
     GL(glBindBuffer(target, *obj));
     GL(glBufferData(target, sz, data, GL_STATIC_DRAW));
+    mem_account(MEM_GPU_BUFFER, sz);
+    *obj_size = sz;
+    if (data)
+        render_stats_upload(sz);
     
     /*
      *   <attr number>
@@ -319,7 +657,7 @@ void model3d_add_tangents(struct model3d *m, float *tg, size_t tgsz)
 
     shader_prog_use(m->prog);
     model3d_prepare(m);
-    load_gl_buffer(m->prog->tangent, tg, GL_FLOAT, tgsz, &m->tangent_obj, 4, GL_ARRAY_BUFFER);
+    load_gl_buffer(m->prog->tangent, tg, GL_FLOAT, tgsz, &m->tangent_obj, &m->tangent_size, 4, GL_ARRAY_BUFFER);
     model3d_done(m);
     shader_prog_done(m->prog);
 }
@@ -327,6 +665,7 @@ void model3d_add_tangents(struct model3d *m, float *tg, size_t tgsz)
 int model3d_add_skinning(struct model3d *m, unsigned char *joints, size_t jointssz,
                          float *weights, size_t weightssz, size_t nr_joints, mat4x4 *invmxs)
 {
+    unsigned char *weights8;
     int v, j, jmax = 0;
 
     if (jointssz != m->nr_vertices * 4 ||
@@ -344,33 +683,88 @@ int model3d_add_skinning(struct model3d *m, unsigned char *joints, size_t joints
     }
     dbg("## max joints: %d\n", jmax);
 
+    /* weights go as unorm8, the rounding error goes to the biggest one */
+    CHECK(weights8 = malloc(m->nr_vertices * 4));
+    for (v = 0; v < m->nr_vertices; v++) {
+        int sum = 0, big = 0;
+
+        for (j = 0; j < 4; j++) {
+            weights8[v * 4 + j] = lrintf(fmaxf(0, fminf(weights[v * 4 + j], 1)) * 255);
+            sum += weights8[v * 4 + j];
+            if (weights8[v * 4 + j] > weights8[v * 4 + big])
+                big = j;
+        }
+        if (abs(sum - 255) <= 4)
+            weights8[v * 4 + big] += 255 - sum;
+    }
+
     CHECK(m->joints = calloc(nr_joints, sizeof(struct model_joint)));
-    for (j = 0; j < nr_joints; j++) {
-        memcpy(&m->joints[j].invmx, invmxs[j], sizeof(mat4x4));
+    CHECK(m->joint_invmx = memdup(invmxs, nr_joints * sizeof(mat4x4)));
+    for (j = 0; j < nr_joints; j++)
         darray_init(&m->joints[j].children);
-    }
 
     shader_prog_use(m->prog);
     if (gl_does_vao())
-        glBindVertexArray(m->vao);
+        render_bind_vao(m->vao);
     load_gl_buffer(m->prog->joints, joints, GL_UNSIGNED_BYTE, m->nr_vertices * 4,
-                   &m->joints_obj, 4, GL_ARRAY_BUFFER);
-    load_gl_buffer(m->prog->weights, weights, GL_FLOAT, m->nr_vertices * 4 * sizeof(float),
-                   &m->weights_obj, 4, GL_ARRAY_BUFFER);
+                   &m->joints_obj, &m->joints_size, 4, GL_ARRAY_BUFFER);
+    load_gl_buffer(m->prog->weights, weights8, GL_UNSIGNED_BYTE, m->nr_vertices * 4,
+                   &m->weights_obj, &m->weights_size, 4, GL_ARRAY_BUFFER);
     if (gl_does_vao())
-        glBindVertexArray(0);
+        render_bind_vao(0);
     shader_prog_done(m->prog);
+    free(weights8);
 
     m->nr_joints = nr_joints;
     return 0;
 }
 
-struct model3d *
-model3d_new_from_vectors(const char *name, struct shader_prog *p, GLfloat *vx, size_t vxsz,
-                         GLushort *idx, size_t idxsz, GLfloat *tx, size_t txsz,
-                         GLfloat *norm, size_t normsz)
+static inline size_t idx_type_size(GLenum idx_type)
+{
+    return idx_type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+}
+
+/*
+ * The next LOD's @nr_idx indices go after the others' in the one index
+ * buffer, which all of them draw from at their index_off[], so that one
+ * multi-draw can cover all the LODs, see model3dtx_draw_instanced(). The
+ * buffer is re-created a size up for each one; there are a handful.
+ */
+static void model3d_lod_append(struct model3d *m, const void *idx, unsigned int nr_idx)
+{
+    size_t size = nr_idx * idx_type_size(m->idx_type);
+    size_t old_size = m->index_size;
+    unsigned int level = m->nr_lods;
+    GLuint obj;
+
+    if (m->index_obj)
+        GL(glBindBuffer(GL_COPY_READ_BUFFER, m->index_obj));
+
+    GL(glGenBuffers(1, &obj));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj));
+    GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, old_size + size, NULL, GL_STATIC_DRAW));
+    mem_account(MEM_GPU_BUFFER, old_size + size);
+    if (m->index_obj) {
+        GL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ELEMENT_ARRAY_BUFFER, 0, 0, old_size));
+        gl_buffer_delete(&m->index_obj, &m->index_size);
+    }
+    GL(glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, old_size, size, idx));
+    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+    render_stats_upload(size);
+
+    m->index_obj = obj;
+    m->index_size = old_size + size;
+    m->index_off[level] = old_size;
+    m->nr_faces[level] = nr_idx;
+    m->nr_lods++;
+}
+
+/* everything but the vertex attributes; leaves the VAO and @p bound */
+static struct model3d *model3d_new(const char *name, struct shader_prog *p, GLfloat *vx,
+                                   size_t vxsz, void *idx, size_t idxsz, GLenum idx_type)
 {
     struct model3d *m;
+    int i;
 
     m = ref_new(model3d);
     if (!m)
@@ -381,69 +775,283 @@ model3d_new_from_vectors(const char *name, struct shader_prog *p, GLfloat *vx, s
     m->cull_face = true;
     m->alpha_blend = false;
     m->draw_type = GL_TRIANGLES;
+    m->idx_type = idx_type;
     model3d_calc_aabb(m, vx, vxsz);
+    m->pos_scale[0] = m->pos_scale[1] = m->pos_scale[2] = 1;
     darray_init(&m->anis);
+    list_init(&m->txmodels);
+    for (i = 0; i < LOD_MAX; i++)
+        darray_init(&m->instances[i]);
 
     if (gl_does_vao()) {
         GL(glGenVertexArrays(1, &m->vao));
-        GL(glBindVertexArray(m->vao));
+        render_bind_vao(m->vao);
     }
 
     shader_prog_use(p);
-    load_gl_buffer(m->prog->pos, vx, GL_FLOAT, vxsz, &m->vertex_obj, 3, GL_ARRAY_BUFFER);
-    load_gl_buffer(-1, idx, GL_UNSIGNED_SHORT, idxsz, &m->index_obj[0], 0, GL_ELEMENT_ARRAY_BUFFER);
-    m->nr_lods++;
+    model3d_lod_append(m, idx, idxsz / idx_type_size(idx_type));
+    m->cur_lod = -1;
+    m->nr_vertices = vxsz / sizeof(*vx) / 3; /* XXX: could be GLuint? */
+
+    return m;
+}
 
+static struct model3d *
+__model3d_new_from_vectors(const char *name, struct shader_prog *p, GLfloat *vx, size_t vxsz,
+                           void *idx, size_t idxsz, GLenum idx_type, GLfloat *tx, size_t txsz,
+                           GLfloat *norm, size_t normsz)
+{
+    struct model3d *m;
+
+    m = model3d_new(name, p, vx, vxsz, idx, idxsz, idx_type);
+    if (!m)
+        return NULL;
+
+    load_gl_buffer(m->prog->pos, vx, GL_FLOAT, vxsz, &m->vertex_obj, &m->vertex_size, 3, GL_ARRAY_BUFFER);
     if (txsz)
-        load_gl_buffer(m->prog->tex, tx, GL_FLOAT, txsz, &m->tex_obj, 2, GL_ARRAY_BUFFER);
+        load_gl_buffer(m->prog->tex, tx, GL_FLOAT, txsz, &m->tex_obj, &m->tex_size, 2, GL_ARRAY_BUFFER);
 
     if (normsz)
-        load_gl_buffer(m->prog->norm, norm, GL_FLOAT, normsz, &m->norm_obj, 3, GL_ARRAY_BUFFER);
+        load_gl_buffer(m->prog->norm, norm, GL_FLOAT, normsz, &m->norm_obj, &m->norm_size, 3, GL_ARRAY_BUFFER);
     shader_prog_done(p);
 
-    m->cur_lod = -1;
-    m->nr_vertices = vxsz / sizeof(*vx) / 3; /* XXX: could be GLuint? */
-    m->nr_faces[0] = idxsz / sizeof(*idx); /* XXX: could be GLuint? */
     /*dbg("created model '%s' vobj: %d iobj: %d nr_vertices: %d\n",
         m->name, m->vertex_obj, m->index_obj, m->nr_vertices);*/
 
     return m;
 }
 
-struct model3d *model3d_new_from_mesh(const char *name, struct shader_prog *p, struct mesh *mesh)
+/*
+ * Meshes' vertices go into one interleaved buffer, quantized: positions to
+ * snorm16 within the AABB, which model.vert scales back with pos_scale and
+ * pos_offset, normals and tangents to snorm8, with the tangent's handedness
+ * in .w, texture coordinates to half floats, because tiling takes them past
+ * [0, 1]. That's 20 bytes a vertex instead of 48; the vertex cache and fetch
+ * order are mesh_optimize()'s.
+ */
+struct packed_vertex {
+    GLshort     pos[4];
+    GLbyte      norm[4];
+    GLbyte      tangent[4];
+    GLushort    tx[2];
+};
+
+static inline GLshort quantize_snorm16(float v)
+{
+    return lrintf(fmaxf(-1, fminf(v, 1)) * 32767);
+}
+
+static inline GLbyte quantize_snorm8(float v)
+{
+    return lrintf(fmaxf(-1, fminf(v, 1)) * 127);
+}
+
+/* round to nearest, no denormals, no NaNs */
+static GLushort quantize_half(float v)
+{
+    union { float f; uint32_t u; } x = { .f = v };
+    uint32_t sign = (x.u >> 16) & 0x8000, mant = x.u & 0x7fffff;
+    int exp = (int)((x.u >> 23) & 0xff) - 127 + 15;
+
+    if (exp <= 0)
+        return sign;
+    if (exp >= 31)
+        return sign | 0x7c00;
+
+    /* mantissa rounding overflow carries into the exponent, as it should */
+    return sign | ((exp << 10) + ((mant + 0x1000) >> 13));
+}
+
+static struct model3d *model3d_new_packed(const char *name, struct shader_prog *p,
+                                          struct mesh *mesh, GLenum idx_type)
 {
-    unsigned short *lod = NULL;
+    float *vx = mesh_vx(mesh), *tx = mesh_tx(mesh), *norm = mesh_norm(mesh);
+    float *tg = mesh_tangent(mesh);
+    size_t v, nr_vx = mesh_nr_vx(mesh);
+    struct packed_vertex *pv;
     struct model3d *m;
-    ssize_t nr_idx;
-    int level;
+    int i;
+
+    m = model3d_new(name, p, vx, mesh_vx_sz(mesh), mesh_idx(mesh), mesh_idx_sz(mesh), idx_type);
+    if (!m)
+        return NULL;
+
+    m->packed = MESH_VX_BIT;
+    if (mesh_nr_tx(mesh) == nr_vx)
+        m->packed |= MESH_TX_BIT;
+    if (mesh_nr_norm(mesh) == nr_vx)
+        m->packed |= MESH_NORM_BIT;
+    if (mesh_nr_tangent(mesh) == nr_vx && p->tangent >= 0)
+        m->packed |= MESH_TANGENTS_BIT;
+
+    for (i = 0; i < 3; i++) {
+        m->pos_offset[i] = (m->aabb[i * 2] + m->aabb[i * 2 + 1]) / 2;
+        m->pos_scale[i] = max((m->aabb[i * 2 + 1] - m->aabb[i * 2]) / 2, FLT_MIN);
+    }
+
+    CHECK(pv = calloc(nr_vx, sizeof(*pv)));
+    for (v = 0; v < nr_vx; v++) {
+        for (i = 0; i < 3; i++) {
+            pv[v].pos[i] = quantize_snorm16((vx[v * 3 + i] - m->pos_offset[i]) / m->pos_scale[i]);
+            if (m->packed & MESH_NORM_BIT)
+                pv[v].norm[i] = quantize_snorm8(norm[v * 3 + i]);
+        }
+        if (m->packed & MESH_TANGENTS_BIT)
+            for (i = 0; i < 4; i++)
+                pv[v].tangent[i] = quantize_snorm8(tg[v * 4 + i]);
+        if (m->packed & MESH_TX_BIT)
+            for (i = 0; i < 2; i++)
+                pv[v].tx[i] = quantize_half(tx[v * 2 + i]);
+    }
+
+    load_gl_buffer(-1, pv, GL_SHORT, nr_vx * sizeof(*pv), &m->vertex_obj, &m->vertex_size, 0, GL_ARRAY_BUFFER);
+    free(pv);
+    shader_prog_done(p);
+
+    return m;
+}
+
+struct model3d *
+model3d_new_from_vectors(const char *name, struct shader_prog *p, GLfloat *vx, size_t vxsz,
+                         GLushort *idx, size_t idxsz, GLfloat *tx, size_t txsz,
+                         GLfloat *norm, size_t normsz)
+{
+    return __model3d_new_from_vectors(name, p, vx, vxsz, idx, idxsz, GL_UNSIGNED_SHORT,
+                                      tx, txsz, norm, normsz);
+}
+
+/*
+ * Overwrite @nr vertices' positions and texture coordinates, starting at
+ * vertex @first, and draw the first @nr_idx indices from now on. For models
+ * that change a little at a time, like text; the buffers don't grow.
+ */
+void model3d_update_vectors(struct model3d *m, GLfloat *vx, GLfloat *tx, unsigned int first,
+                            unsigned int nr, unsigned int nr_idx)
+{
+    if (first + nr > m->nr_vertices)
+        return;
+
+    if (nr) {
+        GL(glBindBuffer(GL_ARRAY_BUFFER, m->vertex_obj));
+        GL(glBufferSubData(GL_ARRAY_BUFFER, first * 3 * sizeof(*vx), nr * 3 * sizeof(*vx), vx));
+        render_stats_upload(nr * 3 * sizeof(*vx));
+        if (m->tex_obj && tx) {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, m->tex_obj));
+            GL(glBufferSubData(GL_ARRAY_BUFFER, first * 2 * sizeof(*tx), nr * 2 * sizeof(*tx), tx));
+            render_stats_upload(nr * 2 * sizeof(*tx));
+        }
+        GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    }
+
+    m->nr_faces[0] = nr_idx;
+}
+
+/*
+ * The next LOD, for models that make their own: @idx is over the same
+ * vertices, @error as in lod_error[], which only goes up along the chain.
+ */
+int model3d_add_lod(struct model3d *m, GLushort *idx, size_t idxsz, float error)
+{
+    unsigned int level = m->nr_lods;
+
+    if (m->idx_type != GL_UNSIGNED_SHORT || m->lods)
+        return -EINVAL;
+    if (level == LOD_MAX)
+        return -ENOSPC;
+
+    if (gl_does_vao())
+        render_bind_vao(m->vao);
 
-    m = model3d_new_from_vectors(name, p,
-                                 mesh_vx(mesh), mesh_vx_sz(mesh),
-                                 mesh_idx(mesh), mesh_idx_sz(mesh),
-                                 mesh_tx(mesh), mesh_tx_sz(mesh),
-                                 mesh_norm(mesh), mesh_norm_sz(mesh));
-    if (mesh_nr_tangent(mesh))
-        model3d_add_tangents(m, mesh_tangent(mesh), mesh_tangent_sz(mesh));
+    model3d_lod_append(m, idx, idxsz / sizeof(*idx));
+    m->lod_error[level] = max(error, m->lod_error[level - 1]);
 
     if (gl_does_vao())
-        GL(glBindVertexArray(m->vao));
-    shader_prog_use(m->prog);
+        render_bind_vao(0);
 
-    for (level = 0, nr_idx = mesh_nr_idx(mesh); level < LOD_MAX - 1; level++) {
-        nr_idx = mesh_idx_to_lod(mesh, level, &lod, nr_idx);
+    return 0;
+}
+
+static void model3d_lods_job(void *data)
+{
+    struct model3d_lods *lods = data;
+    void *src = mesh_idx(lods->mesh);
+    size_t nr_src = mesh_nr_idx(lods->mesh);
+    ssize_t nr_idx;
+    int level;
+
+    /* [0] is LOD0, which the model already has */
+    for (level = 1; level < LOD_MAX; level++) {
+        nr_idx = mesh_idx_to_lod(lods->mesh, level - 1, src, nr_src, &lods->idx[level],
+                                 &lods->error[level]);
         if (nr_idx < 0)
             break;
-        dbg("lod%d for '%s' idx: %zd -> %zd\n", level, m->name, mesh_nr_idx(mesh), nr_idx);
-        load_gl_buffer(-1, lod, GL_UNSIGNED_SHORT, nr_idx * mesh_idx_stride(mesh),
-                       &m->index_obj[m->nr_lods], 0, GL_ELEMENT_ARRAY_BUFFER);
-        free(lod);
-        m->nr_faces[m->nr_lods] = nr_idx;
-        m->nr_lods++;
+
+        dbg("lod%d for '%s' idx: %zu -> %zd error: %f\n", level, lods->name, nr_src, nr_idx,
+            lods->error[level]);
+        lods->nr_idx[level] = nr_idx;
+        lods->nr_lods = level + 1;
+        src = lods->idx[level];
+        nr_src = nr_idx;
+    }
+}
+
+static void model3d_lods_poll(struct model3d *m)
+{
+    struct model3d_lods *lods = m->lods;
+    unsigned int level;
+
+    if (!lods || !job_counter_done(&lods->counter))
+        return;
+
+    if (gl_does_vao())
+        render_bind_vao(m->vao);
+
+    for (level = m->nr_lods; level < lods->nr_lods; level++) {
+        model3d_lod_append(m, lods->idx[level], lods->nr_idx[level]);
+        /* errors add up along the chain */
+        m->lod_error[level] = m->lod_error[level - 1] + lods->error[level];
     }
 
-    shader_prog_done(m->prog);
     if (gl_does_vao())
-        GL(glBindVertexArray(0));
+        render_bind_vao(0);
+
+    m->lods = NULL;
+    model3d_lods_free(lods);
+}
+
+struct model3d *model3d_new_from_mesh(const char *name, struct shader_prog *p, struct mesh *mesh)
+{
+    GLenum idx_type = mesh_idx_stride(mesh) == sizeof(GLuint) ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    struct model3d_lods *lods;
+    struct model3d *m;
+
+    /* programs that don't know how to undo the quantization get floats */
+    if (p->data.pos_scale >= 0 && p->data.pos_offset >= 0) {
+        m = model3d_new_packed(name, p, mesh, idx_type);
+    } else {
+        m = __model3d_new_from_vectors(name, p,
+                                       mesh_vx(mesh), mesh_vx_sz(mesh),
+                                       mesh_idx(mesh), mesh_idx_sz(mesh), idx_type,
+                                       mesh_tx(mesh), mesh_tx_sz(mesh),
+                                       mesh_norm(mesh), mesh_norm_sz(mesh));
+        if (m && mesh_nr_tangent(mesh))
+            model3d_add_tangents(m, mesh_tangent(mesh), mesh_tangent_sz(mesh));
+    }
+    if (!m)
+        return NULL;
+
+    lods = calloc(1, sizeof(*lods));
+    if (!lods)
+        return m;
+
+    job_counter_init(&lods->counter);
+    lods->mesh = ref_get(mesh);
+    lods->name = strdup(m->name);
+    if (jobs_submit(model3d_lods_job, lods, &lods->counter)) {
+        model3d_lods_free(lods);
+        return m;
+    }
+    m->lods = lods;
 
     return m;
 }
@@ -475,9 +1083,9 @@ static void model3d_set_lod(struct model3d *m, unsigned int lod)
     if (lod == m->cur_lod)
         return;
 
+    /* the LODs are all in the one buffer, see model3d_lod_append() */
     if (m->cur_lod < 0)
-        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
-    GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->index_obj[lod]));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->index_obj));
     m->cur_lod = lod;
 }
 
@@ -486,12 +1094,30 @@ static void model3d_prepare(struct model3d *m)
     struct shader_prog *p = m->prog;
 
     if (gl_does_vao())
-        GL(glBindVertexArray(m->vao));
+        render_bind_vao(m->vao);
     if (m->cur_lod >= 0)
-        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->index_obj[m->cur_lod]));
+        GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->index_obj));
     GL(glBindBuffer(GL_ARRAY_BUFFER, m->vertex_obj));
-    GL(glVertexAttribPointer(p->pos, 3, GL_FLOAT, GL_FALSE, 0, (void *)0));
-    GL(glEnableVertexAttribArray(p->pos));
+    if (m->packed) {
+        GLsizei stride = sizeof(struct packed_vertex);
+
+        GL(glVertexAttribPointer(p->pos, 3, GL_SHORT, GL_TRUE, stride,
+                                 (void *)offsetof(struct packed_vertex, pos)));
+        GL(glEnableVertexAttribArray(p->pos));
+        if ((m->packed & MESH_NORM_BIT) && p->norm >= 0) {
+            GL(glVertexAttribPointer(p->norm, 3, GL_BYTE, GL_TRUE, stride,
+                                     (void *)offsetof(struct packed_vertex, norm)));
+            GL(glEnableVertexAttribArray(p->norm));
+        }
+        if ((m->packed & MESH_TANGENTS_BIT) && p->tangent >= 0) {
+            GL(glVertexAttribPointer(p->tangent, 4, GL_BYTE, GL_TRUE, stride,
+                                     (void *)offsetof(struct packed_vertex, tangent)));
+            GL(glEnableVertexAttribArray(p->tangent));
+        }
+    } else {
+        GL(glVertexAttribPointer(p->pos, 3, GL_FLOAT, GL_FALSE, 0, (void *)0));
+        GL(glEnableVertexAttribArray(p->pos));
+    }
 
     if (m->norm_obj && p->norm >= 0) {
         GL(glBindBuffer(GL_ARRAY_BUFFER, m->norm_obj));
@@ -510,11 +1136,24 @@ static void model3d_prepare(struct model3d *m)
     }
     if (p->weights >= 0 && m->nr_joints && m->weights_obj >= 0) {
         GL(glBindBuffer(GL_ARRAY_BUFFER, m->weights_obj));
-        GL(glVertexAttribPointer(p->weights, 4, GL_FLOAT, GL_FALSE, 0, (void *)0));
+        GL(glVertexAttribPointer(p->weights, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (void *)0));
         GL(glEnableVertexAttribArray(p->weights));
     }
 }
 
+/*
+ * Keep a copy of a small model's vectors, which makes it eligible for the
+ * batched draws, see model3d_can_batch()
+ */
+static void model3d_keep_vectors(struct model3d *m, GLfloat *vx, size_t vxsz, GLfloat *tx,
+                                 size_t txsz, GLushort *idx, size_t idxsz)
+{
+    CHECK(m->batch_vx = memdup(vx, vxsz));
+    CHECK(m->batch_tx = memdup(tx, txsz));
+    CHECK(m->batch_idx = memdup(idx, idxsz));
+    m->nr_batch_idx = idxsz / sizeof(*idx);
+}
+
 /* Cube and quad */
 #include "primitives.c"
 
@@ -525,19 +1164,37 @@ void model3dtx_prepare(struct model3dtx *txm)
 
     model3d_prepare(txm->model);
 
-    if (p->tex >= 0 && m->tex_obj && texture_loaded(txm->texture)) {
-        GL(glBindBuffer(GL_ARRAY_BUFFER, m->tex_obj));
-        GL(glVertexAttribPointer(p->tex, 2, GL_FLOAT, GL_FALSE, 0, (void *)0));
+    if (p->data.pos_scale >= 0 && p->data.pos_offset >= 0) {
+        UNIFORM(glUniform3fv(p->data.pos_scale, 1, m->pos_scale));
+        UNIFORM(glUniform3fv(p->data.pos_offset, 1, m->pos_offset));
+    }
+
+    if (p->tex >= 0 && (m->tex_obj || (m->packed & MESH_TX_BIT)) &&
+        texture_loaded(txm->texture)) {
+        if (m->packed) {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, m->vertex_obj));
+            GL(glVertexAttribPointer(p->tex, 2, GL_HALF_FLOAT, GL_FALSE,
+                                     sizeof(struct packed_vertex),
+                                     (void *)offsetof(struct packed_vertex, tx)));
+        } else {
+            GL(glBindBuffer(GL_ARRAY_BUFFER, m->tex_obj));
+            GL(glVertexAttribPointer(p->tex, 2, GL_FLOAT, GL_FALSE, 0, (void *)0));
+        }
         GL(glEnableVertexAttribArray(p->tex));
-        GL(glActiveTexture(GL_TEXTURE0));
-        GL(glBindTexture(GL_TEXTURE_2D, texture_id(txm->texture)));
-        GL(glUniform1i(p->texture_map, 0));
+        texture_used(txm->texture);
+        texture_bind(txm->texture, 0);
+        UNIFORM(glUniform1i(p->texture_map, 0));
     }
 
     if (p->normal_map >= 0 && txm->normals && texture_loaded(txm->normals)) {
-        GL(glActiveTexture(GL_TEXTURE1));
-        GL(glBindTexture(GL_TEXTURE_2D, texture_id(txm->normals)));
-        GL(glUniform1i(p->normal_map, 1));
+        texture_used(txm->normals);
+        texture_bind(txm->normals, 1);
+        UNIFORM(glUniform1i(p->normal_map, 1));
+    }
+
+    if (p->data.height_map >= 0 && txm->heights && texture_loaded(txm->heights)) {
+        render_bind_texture(HEIGHT_MAP_TEX_UNIT, texture_id(txm->heights));
+        UNIFORM(glUniform1i(p->data.height_map, HEIGHT_MAP_TEX_UNIT));
     }
 }
 
@@ -545,8 +1202,322 @@ void model3dtx_draw(struct model3dtx *txm)
 {
     struct model3d *m = txm->model;
 
-    /* GL_UNSIGNED_SHORT == typeof *indices */
-    GL(glDrawElements(m->draw_type, m->nr_faces[m->cur_lod], GL_UNSIGNED_SHORT, 0));
+    GL(glDrawElements(m->draw_type, m->nr_faces[m->cur_lod], m->idx_type,
+                      (void *)m->index_off[m->cur_lod]));
+    render_stats_draw(m->nr_faces[m->cur_lod], 1, m->cur_lod);
+}
+
+static bool model3d_is_skinned(struct model3d *m)
+{
+    return m->nr_joints && m->anis.da.nr_el;
+}
+
+/*
+ * Instanced drawing: entities that don't need per-entity uniforms (not in
+ * focus) only differ in their transformation matrix and the offset of their
+ * joint transforms, so those go into a per-instance attribute buffer and
+ * the whole model is drawn with one glDrawElementsInstanced() per LOD, or
+ * one multi-draw for all of them where there is one. Programs that take
+ * the entity's color as uniforms draw them one by one.
+ */
+static bool model3d_can_instance(struct model3d *m)
+{
+    struct shader_prog *p = m->prog;
+
+    if (p->instance_trans < 0 || p->data.use_instancing < 0)
+        return false;
+
+    if (p->data.color >= 0 || p->data.colorpt >= 0)
+        return false;
+
+    return !model3d_is_skinned(m) || p->instance_joint_off >= 0;
+}
+
+static void model3d_instance_add(struct model3d *m, unsigned int lod, struct entity3d *e)
+{
+    struct model_instance *inst;
+
+    if (lod >= m->nr_lods)
+        lod = max(0, m->nr_lods - 1);
+
+    inst = darray_add(&m->instances[lod].da);
+    if (!inst)
+        return;
+
+    memcpy(inst->mx, e->mx->m, sizeof(inst->mx));
+    inst->joint_off = e->joint_off;
+    inst->layer     = e->tex_layer;
+}
+
+static void model3d_instances_bind(struct model3d *m, size_t off)
+{
+    struct shader_prog *p = m->prog;
+    size_t stride = sizeof(struct model_instance);
+    int i;
+
+    /* mat4 attribute takes 4 consecutive locations, one per column */
+    for (i = 0; i < 4; i++) {
+        GL(glVertexAttribPointer(p->instance_trans + i, 4, GL_FLOAT, GL_FALSE, stride,
+                                 (void *)(off + offsetof(struct model_instance, mx) + i * sizeof(vec4))));
+        GL(glEnableVertexAttribArray(p->instance_trans + i));
+        GL(glVertexAttribDivisor(p->instance_trans + i, 1));
+    }
+
+    if (p->instance_joint_off >= 0) {
+        GL(glVertexAttribPointer(p->instance_joint_off, 1, GL_FLOAT, GL_FALSE, stride,
+                                 (void *)(off + offsetof(struct model_instance, joint_off))));
+        GL(glEnableVertexAttribArray(p->instance_joint_off));
+        GL(glVertexAttribDivisor(p->instance_joint_off, 1));
+    }
+
+    if (p->instance_layer >= 0) {
+        GL(glVertexAttribPointer(p->instance_layer, 1, GL_FLOAT, GL_FALSE, stride,
+                                 (void *)(off + offsetof(struct model_instance, layer))));
+        GL(glEnableVertexAttribArray(p->instance_layer));
+        GL(glVertexAttribDivisor(p->instance_layer, 1));
+    }
+}
+
+static void model3d_instances_unbind(struct model3d *m)
+{
+    struct shader_prog *p = m->prog;
+    int i;
+
+    /* without VAOs, divisors are global state, don't leak them to other models */
+    for (i = 0; i < 4; i++) {
+        GL(glVertexAttribDivisor(p->instance_trans + i, 0));
+        GL(glDisableVertexAttribArray(p->instance_trans + i));
+    }
+
+    if (p->instance_joint_off >= 0) {
+        GL(glVertexAttribDivisor(p->instance_joint_off, 0));
+        GL(glDisableVertexAttribArray(p->instance_joint_off));
+    }
+
+    if (p->instance_layer >= 0) {
+        GL(glVertexAttribDivisor(p->instance_layer, 0));
+        GL(glDisableVertexAttribArray(p->instance_layer));
+    }
+}
+
+/*
+ * All of the LODs' instances in one go: the instance attributes of one LOD
+ * after another in the stream buffer, and a draw command per LOD, whose
+ * base_instance is where its instances start.
+ */
+static unsigned long model3d_draw_indirect(struct model3d *m)
+{
+    struct render_draw_cmd cmds[LOD_MAX];
+    unsigned int lods[LOD_MAX];
+    const void *data[LOD_MAX];
+    size_t sizes[LOD_MAX];
+    unsigned int nr = 0, nr_inst, base = 0, lod;
+    ssize_t off;
+    GLuint obj;
+
+    for (lod = 0; lod < LOD_MAX; lod++) {
+        nr_inst = m->instances[lod].da.nr_el;
+        if (!nr_inst)
+            continue;
+
+        /* model3d_instance_add() only uses the LODs that there are */
+        cmds[nr] = (struct render_draw_cmd) {
+            .count          = m->nr_faces[lod],
+            .nr_instances   = nr_inst,
+            .first_index    = m->index_off[lod] / idx_type_size(m->idx_type),
+            .base_instance  = base,
+        };
+        data[nr] = m->instances[lod].x;
+        lods[nr] = lod;
+        sizes[nr++] = nr_inst * sizeof(struct model_instance);
+        base += nr_inst;
+    }
+
+    /* binds @obj for model3d_instances_bind() */
+    off = render_stream_writev(data, sizes, nr, &obj);
+    for (lod = 0; lod < LOD_MAX; lod++)
+        darray_resize(&m->instances[lod].da, 0);
+    if (off < 0)
+        return 0;
+
+    model3d_instances_bind(m, off);
+    model3d_set_lod(m, 0);
+    render_multi_draw_indirect(m->draw_type, m->idx_type, cmds, nr);
+    for (lod = 0; lod < nr; lod++)
+        render_stats_draw(cmds[lod].count, cmds[lod].nr_instances, lods[lod]);
+
+    return base;
+}
+
+static unsigned long model3dtx_draw_instanced(struct model3dtx *txm)
+{
+    struct model3d *m = txm->model;
+    size_t total = 0;
+    unsigned long nr = 0;
+    unsigned int nr_inst;
+    ssize_t off;
+    GLuint obj;
+    int lod;
+
+    for (lod = 0; lod < LOD_MAX; lod++)
+        total += m->instances[lod].da.nr_el;
+
+    if (!total)
+        return 0;
+
+    UNIFORM(glUniform1f(m->prog->data.use_instancing, 1.0));
+
+    /* the darrays are reset either way */
+    if (render_has_multi_draw_indirect())
+        nr = model3d_draw_indirect(m);
+
+    for (lod = 0; lod < LOD_MAX; lod++) {
+        nr_inst = m->instances[lod].da.nr_el;
+        if (!nr_inst)
+            continue;
+
+        /* binds @obj for model3d_instances_bind() */
+        off = render_stream_write(m->instances[lod].x, nr_inst * sizeof(struct model_instance),
+                                  &obj);
+        if (off >= 0) {
+            model3d_instances_bind(m, off);
+            model3d_set_lod(m, lod);
+
+            GL(glDrawElementsInstanced(m->draw_type, m->nr_faces[m->cur_lod], m->idx_type,
+                                       (void *)m->index_off[m->cur_lod], nr_inst));
+            render_stats_draw(m->nr_faces[m->cur_lod], nr_inst, m->cur_lod);
+            nr += nr_inst;
+        }
+        /* keeps the allocation for the next frame */
+        darray_resize(&m->instances[lod].da, 0);
+    }
+
+    model3d_instances_unbind(m);
+    UNIFORM(glUniform1f(m->prog->data.use_instancing, 0.0));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    return nr;
+}
+
+/*
+ * Batched drawing: for the UIs, which are mostly quads with a handful of
+ * vertices each. The visible entities of the small models (see
+ * model3d_keep_vectors()) whose program takes pre-transformed vertices get
+ * their vertices transformed on the CPU into one streaming buffer, uploaded
+ * once per models_render(); each model then draws its range of it with one
+ * glDrawArrays() instead of one draw call per entity. The draw list order
+ * stays as it is, because without the depth test, it's also the layering.
+ */
+static bool model3d_can_batch(struct model3d *m)
+{
+    struct shader_prog *p = m->prog;
+
+    return m->batch_vx && m->draw_type == GL_TRIANGLES &&
+           p->data.use_batching >= 0 && p->batch_color >= 0;
+}
+
+static void mq_batch_collect(struct mq *mq, struct sort_item *draw_list, size_t nr_draws)
+{
+    struct batch_vertex *v;
+    struct model3dtx *txm;
+    struct entity3d *e;
+    struct model3d *m;
+    unsigned int j, k;
+    size_t i;
+    vec4 pos;
+
+    darray_resize(&mq->batch.da, 0);
+    for (i = 0; i < nr_draws; i++) {
+        txm = draw_list[i].data;
+        m = txm->model;
+        txm->nr_batch = 0;
+        if (!model3d_can_batch(m))
+            continue;
+
+        txm->batch_first = mq->batch.da.nr_el;
+        list_for_each_entry(e, &txm->entities, entry) {
+            if (!e->visible)
+                continue;
+
+            for (j = 0; j < m->nr_batch_idx; j++) {
+                GLushort idx = m->batch_idx[j];
+                vec4 vx = { m->batch_vx[idx * 3], m->batch_vx[idx * 3 + 1],
+                            m->batch_vx[idx * 3 + 2], 1.0 };
+
+                v = darray_add(&mq->batch.da);
+                if (!v)
+                    goto out;
+
+                mat4x4_mul_vec4(pos, e->mx->m, vx);
+                for (k = 0; k < 3; k++)
+                    v->pos[k] = pos[k] / pos[3];
+                v->tx[0] = m->batch_tx[idx * 2];
+                v->tx[1] = m->batch_tx[idx * 2 + 1];
+                memcpy(v->color, e->color, sizeof(v->color));
+                v->color_pt = 0.5 * e->color_pt;
+                txm->nr_batch++;
+            }
+        }
+    }
+
+out:
+    if (!mq->batch.da.nr_el)
+        return;
+
+    if (!mq->batch_vao && gl_does_vao())
+        GL(glGenVertexArrays(1, &mq->batch_vao));
+
+    mq->batch_off = render_stream_write(mq->batch.x,
+                                        mq->batch.da.nr_el * sizeof(struct batch_vertex),
+                                        &mq->batch_obj);
+    GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
+
+static void batch_attrib(GLint loc, GLint size, size_t off)
+{
+    if (loc < 0)
+        return;
+
+    GL(glVertexAttribPointer(loc, size, GL_FLOAT, GL_FALSE, sizeof(struct batch_vertex), (void *)off));
+    GL(glEnableVertexAttribArray(loc));
+}
+
+static unsigned long model3dtx_draw_batch(struct model3dtx *txm, struct mq *mq)
+{
+    struct shader_prog *p = txm->model->prog;
+
+    if (!txm->nr_batch || mq->batch_off < 0)
+        return 0;
+
+    if (gl_does_vao())
+        render_bind_vao(mq->batch_vao);
+    GL(glBindBuffer(GL_ARRAY_BUFFER, mq->batch_obj));
+    batch_attrib(p->pos, 3, mq->batch_off + offsetof(struct batch_vertex, pos));
+    batch_attrib(p->tex, 2, mq->batch_off + offsetof(struct batch_vertex, tx));
+    batch_attrib(p->batch_color, 4, mq->batch_off + offsetof(struct batch_vertex, color));
+    batch_attrib(p->batch_color_pt, 1, mq->batch_off + offsetof(struct batch_vertex, color_pt));
+
+    if (texture_loaded(txm->texture))
+        texture_used(txm->texture);
+    render_bind_texture(0, texture_loaded(txm->texture) ? texture_id(txm->texture) : 0);
+    if (p->texture_map >= 0)
+        UNIFORM(glUniform1i(p->texture_map, 0));
+
+    UNIFORM(glUniform1f(p->data.use_batching, 1.0));
+    GL(glDrawArrays(GL_TRIANGLES, txm->batch_first, txm->nr_batch));
+    render_stats_draw(txm->nr_batch, 1, 0);
+    UNIFORM(glUniform1f(p->data.use_batching, 0.0));
+
+    GL(glDisableVertexAttribArray(p->pos));
+    if (p->tex >= 0)
+        GL(glDisableVertexAttribArray(p->tex));
+    GL(glDisableVertexAttribArray(p->batch_color));
+    if (p->batch_color_pt >= 0)
+        GL(glDisableVertexAttribArray(p->batch_color_pt));
+    render_bind_texture(0, 0);
+    GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    return txm->nr_batch / txm->model->nr_batch_idx;
 }
 
 static void model3d_done(struct model3d *m)
@@ -554,9 +1525,9 @@ static void model3d_done(struct model3d *m)
     struct shader_prog *p = m->prog;
 
     GL(glDisableVertexAttribArray(p->pos));
-    if (m->norm_obj && p->norm >= 0)
+    if ((m->norm_obj || (m->packed & MESH_NORM_BIT)) && p->norm >= 0)
         GL(glDisableVertexAttribArray(p->norm));
-    if (m->tangent_obj && p->tangent >= 0)
+    if ((m->tangent_obj || (m->packed & MESH_TANGENTS_BIT)) && p->tangent >= 0)
         GL(glDisableVertexAttribArray(p->tangent));
     if (m->nr_joints && p->joints >= 0) {
         GL(glDisableVertexAttribArray(p->joints));
@@ -567,7 +1538,7 @@ static void model3d_done(struct model3d *m)
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
     GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
     if (gl_does_vao())
-        GL(glBindVertexArray(0));
+        render_bind_vao(0);
     m->cur_lod = -1;
 }
 
@@ -575,14 +1546,12 @@ void model3dtx_done(struct model3dtx *txm)
 {
     struct shader_prog *p = txm->model->prog;
 
-    if (p->tex >= 0 && txm->model->tex_obj) {
+    if (p->tex >= 0 && (txm->model->tex_obj || (txm->model->packed & MESH_TX_BIT))) {
         GL(glDisableVertexAttribArray(p->tex));
-        GL(glActiveTexture(GL_TEXTURE0));
-        GL(glBindTexture(GL_TEXTURE_2D, 0));
+        render_bind_texture(0, 0);
     }
     if (txm->normals) {
-        GL(glActiveTexture(GL_TEXTURE1));
-        GL(glBindTexture(GL_TEXTURE_2D, 0));
+        render_bind_texture(1, 0);
     }
 
     model3d_done(txm->model);
@@ -657,7 +1626,7 @@ void fbo_resize(struct fbo *fbo, int width, int height)
     texture_resize(&fbo->tex, width, height);
     texture_resize(&fbo->depth, width, height);
 
-    if (fbo->depth_buf) {
+    if (fbo->depth_buf >= 0) {
         GL(glBindRenderbuffer(GL_RENDERBUFFER, fbo->depth_buf));
         GL(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, fbo->width, fbo->height));
         GL(glBindRenderbuffer(GL_RENDERBUFFER, 0));
@@ -667,6 +1636,7 @@ void fbo_resize(struct fbo *fbo, int width, int height)
 void fbo_prepare(struct fbo *fbo)
 {
     GL(glBindFramebuffer(GL_FRAMEBUFFER, fbo->fbo));
+    render_stats_fbo();
     GL(glViewport(0, 0, fbo->width, fbo->height));
     if (fbo->ms) {
         GLenum buffers[] = { GL_COLOR_ATTACHMENT0 };
@@ -676,7 +1646,8 @@ void fbo_prepare(struct fbo *fbo)
 
 void fbo_done(struct fbo *fbo, int width, int height)
 {
-    GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, gl_screen_fbo()));
+    render_stats_fbo();
     GL(glViewport(0, 0, width, height));
 }
 
@@ -706,7 +1677,7 @@ static void fbo_drop(struct ref *ref)
 }
 DECLARE_REFCLASS2(fbo);
 
-static void fbo_init(struct fbo *fbo)
+static void fbo_init(struct fbo *fbo, bool depth)
 {
     int err;
 
@@ -717,14 +1688,15 @@ static void fbo_init(struct fbo *fbo)
         fbo_texture_init(fbo);
     }
     //fbo->depth_tex = fbo_depth_texture(fbo);
-    fbo->depth_buf = fbo_depth_buffer(fbo);
+    if (depth)
+        fbo->depth_buf = fbo_depth_buffer(fbo);
     err = glCheckFramebufferStatus(GL_FRAMEBUFFER);
     if (err != GL_FRAMEBUFFER_COMPLETE)
         dbg("## framebuffer status: %d\n", err);
-    GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    GL(glBindFramebuffer(GL_FRAMEBUFFER, gl_screen_fbo()));
 }
 
-struct fbo *fbo_new_ms(int width, int height, bool ms)
+struct fbo *fbo_new_ms_depth(int width, int height, bool ms, bool depth)
 {
     struct fbo *fbo;
     int ret;
@@ -733,11 +1705,16 @@ struct fbo *fbo_new_ms(int width, int height, bool ms)
     fbo->width = width;
     fbo->height = height;
     fbo->ms = ms;
-    fbo_init(fbo);
+    fbo_init(fbo, depth);
 
     return fbo;
 }
 
+struct fbo *fbo_new_ms(int width, int height, bool ms)
+{
+    return fbo_new_ms_depth(width, height, ms, true);
+}
+
 struct fbo *fbo_new(int width, int height)
 {
     return fbo_new_ms(width, height, false);
@@ -750,11 +1727,12 @@ static void animation_destroy(struct animation *an)
     ref_put(an->model);
 }
 
-struct animation *animation_new(struct model3d *model, const char *name, unsigned int nr_channels)
+static struct animation *__animation_new(struct darray *anis, struct model3d *model,
+                                        const char *name, unsigned int nr_channels)
 {
     struct animation *an;
 
-    CHECK(an = darray_add(&model->anis.da));
+    CHECK(an = darray_add(anis));
     an->name = strdup(name);
     an->model = model;
     an->nr_channels = nr_channels;
@@ -764,6 +1742,104 @@ struct animation *animation_new(struct model3d *model, const char *name, unsigne
     return an;
 }
 
+struct animation *animation_new(struct model3d *model, const char *name, unsigned int nr_channels)
+{
+    return __animation_new(&model->anis.da, model, name, nr_channels);
+}
+
+struct animation *model3d_anis_new(struct model3d_anis *pending, const char *name,
+                                   unsigned int nr_channels)
+{
+    return __animation_new(&pending->anis.da, pending->model, name, nr_channels);
+}
+
+static void model3d_anis_job(void *data)
+{
+    struct model3d_anis *pending = data;
+
+    pending->build(pending, pending->data);
+}
+
+int model3d_add_animations(struct model3d *m, model3d_anis_fn build, void (*release)(void *data),
+                           void *data)
+{
+    struct model3d_anis *pending;
+
+    if (m->pending_anis)
+        return -EBUSY;
+
+    pending = calloc(1, sizeof(*pending));
+    if (!pending)
+        return -ENOMEM;
+
+    job_counter_init(&pending->counter);
+    darray_init(&pending->anis);
+    pending->model   = m;
+    pending->build   = build;
+    pending->release = release;
+    pending->data    = data;
+    m->pending_anis  = pending;
+    if (jobs_submit(model3d_anis_job, pending, &pending->counter))
+        model3d_anis_job(pending);
+
+    return 0;
+}
+
+/* main thread: the model's animations only change here */
+static void model3d_anis_poll(struct model3d *m, bool wait)
+{
+    struct model3d_anis *pending = m->pending_anis;
+    struct animation *an, *new;
+
+    if (!pending)
+        return;
+
+    if (!job_counter_done(&pending->counter)) {
+        if (!wait)
+            return;
+        jobs_wait(&pending->counter);
+    }
+
+    darray_for_each(an, &pending->anis) {
+        CHECK(new = darray_add(&m->anis.da));
+        *new = *an;
+    }
+    /* the channels are the model's now */
+    darray_clearout(&pending->anis.da);
+    m->pending_anis = NULL;
+    model3d_anis_free(pending);
+
+    /*
+     * Until now it's been drawn in its bind pose, without skinning; the
+     * attributes are set up from m->prog on every draw, see model3d_prepare()
+     */
+    if (m->skin_prog && model3d_is_skinned(m)) {
+        ref_put(m->prog);
+        m->prog = m->skin_prog;
+        m->skin_prog = NULL;
+    }
+}
+
+/* returns the key interval if all the keys are (nearly) evenly spaced, 0 otherwise */
+static float channel_uniform_dt(float *time, size_t frames)
+{
+    float dt;
+    int i;
+
+    if (frames < 2)
+        return 0;
+
+    dt = (time[frames - 1] - time[0]) / (frames - 1);
+    if (dt <= 0)
+        return 0;
+
+    for (i = 1; i < frames; i++)
+        if (fabsf(time[i] - time[0] - i * dt) > dt * 1e-3)
+            return 0;
+
+    return dt;
+}
+
 void animation_add_channel(struct animation *an, size_t frames, float *time, float *data,
                            size_t data_stride, unsigned int target, unsigned int path)
 {
@@ -776,210 +1852,757 @@ void animation_add_channel(struct animation *an, size_t frames, float *time, flo
     an->channels[an->cur_channel].stride = data_stride;
     an->channels[an->cur_channel].target = target;
     an->channels[an->cur_channel].path = path;
+    an->channels[an->cur_channel].dt = channel_uniform_dt(time, frames);
+    mem_account(MEM_ANIMATION, channel_bytes(&an->channels[an->cur_channel]));
     an->cur_channel++;
 
     an->time_end = max(an->time_end, time[frames - 1]/* + time[1] - time[0]*/);
 }
 
-void models_render(struct mq *mq, struct light *light, struct camera *camera,
-                   struct matrix4f *proj_mx, struct entity3d *focus, int width, int height,
-                   unsigned long *count)
+static uint64_t depth_bits(float depth)
 {
-    struct entity3d *e;
-    struct shader_prog *prog = NULL;
-    struct model3d *model;
-    struct model3dtx *txmodel;
-    struct matrix4f *view_mx, *inv_view_mx;
-    unsigned long nr_txms = 0, nr_ents = 0, culled = 0;
-
-    if (camera) {
-        view_mx = camera->view_mx;
-        inv_view_mx = camera->inv_view_mx;
-    }
+    union {
+        float       f;
+        uint32_t    u;
+    } d = { .f = depth };
 
-    list_for_each_entry(txmodel, &mq->txmodels, entry) {
-        // err_on(list_empty(&txmodel->entities), "txm '%s' has no entities\n",
-        //        txmodel_name(txmodel));
-        model = txmodel->model;
-        model->cur_lod = 0;
-        /* XXX: model-specific draw method */
-        if (model->cull_face) {
-            GL(glEnable(GL_CULL_FACE));
-            GL(glCullFace(GL_BACK));
-        } else {
-            GL(glDisable(GL_CULL_FACE));
-        }
-        /* XXX: only for UIs */
-        if (model->alpha_blend) {
-            GL(glEnable(GL_BLEND));
-            GL(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
-        } else {
-            GL(glDisable(GL_BLEND));
-        }
-        if (model->debug || !model->cull_face)
-            GL(glDisable(GL_DEPTH_TEST));
-        else
-            GL(glEnable(GL_DEPTH_TEST));
+    /* non-negative floats sort the same as their bits, keep the top 22 */
+    return d.u >> 9;
+}
 
-        //dbg("rendering model '%s'\n", model->name);
-        if (model->prog != prog) {
-            if (prog)
-                shader_prog_done(prog);
+/* squared distance from @eye to the nearest or the farthest visible entity */
+static float txmodel_depth(struct model3dtx *txm, vec3 eye, bool nearest)
+{
+    float depth = nearest ? INFINITY : 0.0, d;
+    struct entity3d *e;
 
-            prog = model->prog;
-            shader_prog_use(prog);
-            trace("rendering model '%s' using '%s'\n", model->name, prog->name);
+    list_for_each_entry(e, &txm->entities, entry) {
+        vec3 dist = { e->dx, e->dy, e->dz };
 
-            if (prog->data.width >= 0)
-                GL(glUniform1f(prog->data.width, width));
-            if (prog->data.height >= 0)
-                GL(glUniform1f(prog->data.height, height));
+        if (!e->visible)
+            continue;
 
-            if (light && prog->data.lightp >= 0 && prog->data.lightc >= 0) {
-                GL(glUniform3fv(prog->data.lightp, 1, light->pos));
-                GL(glUniform3fv(prog->data.lightc, 1, light->color));
-            }
+        vec3_sub(dist, dist, eye);
+        d = vec3_mul_inner(dist, dist);
+        depth = nearest ? min(depth, d) : max(depth, d);
+    }
 
-            if (view_mx && prog->data.viewmx >= 0)
-                /* View matrix is the same for all entities and models */
-                GL(glUniformMatrix4fv(prog->data.viewmx, 1, GL_FALSE, view_mx->cell));
-            if (inv_view_mx && prog->data.inv_viewmx >= 0)
-                GL(glUniformMatrix4fv(prog->data.inv_viewmx, 1, GL_FALSE, inv_view_mx->cell));
+    return depth;
+}
 
-            /* Projection matrix is the same for everything, but changes on resize */
-            if (proj_mx && prog->data.projmx >= 0)
-                GL(glUniformMatrix4fv(prog->data.projmx, 1, GL_FALSE, proj_mx->cell));
-        }
+/*
+ * Draw list sort key:
+ *  - depth tested opaque geometry goes first, grouped by program, then
+ *    texture, then front to back to cut down on overdraw;
+ *  - blended and non-depth-tested geometry goes on top, back to front,
+ *    or, without a camera (UIs), in the mq order, which the radix sort
+ *    preserves, because it's stable.
+ */
+static uint64_t txmodel_sort_key(struct model3dtx *txm, float *eye)
+{
+    struct model3d *m = txm->model;
+    uint64_t depth = 0;
 
-        model3dtx_prepare(txmodel);
-        if (prog->data.use_normals >= 0 && txmodel->normals)
-            GL(glUniform1f(prog->data.use_normals, texture_id(txmodel->normals) ? 1.0 : 0.0));
+    if (m->cull_face && !m->debug && !m->alpha_blend) {
+        if (eye)
+            depth = depth_bits(txmodel_depth(txm, eye, true));
 
-        if (prog->data.shine_damper >= 0 && prog->data.reflectivity >= 0) {
-            GL(glUniform1f(prog->data.shine_damper, txmodel->roughness));
-            GL(glUniform1f(prog->data.reflectivity, txmodel->metallic));
-        }
+        return ((uint64_t)(m->prog->prog & 0xff) << 55) |
+               ((uint64_t)(texture_id(txm->texture) & 0xffff) << 39) |
+               (depth << 17);
+    }
 
-        list_for_each_entry (e, &txmodel->entities, entry) {
-            float hc[] = { 0.7, 0.7, 0.0, 1.0 }, nohc[] = { 0.0, 0.0, 0.0, 0.0 };
-            if (!e->visible) {
-                //dbg("skipping element of '%s'\n", entity_name(e));
-                continue;
-            }
+    if (eye)
+        depth = ~depth_bits(txmodel_depth(txm, eye, false)) & 0x3fffff;
 
-            dbg_on(!e->visible, "rendering an invisible entity!\n");
+    return (1ull << 63) | (depth << 41);
+}
 
-            if (!e->skip_culling &&
-                camera && !camera_entity_in_frustum(camera, e)) {
-                culled++;
-                continue;
-            }
+static struct sort_item *mq_draw_list(struct mq *mq, float *eye, size_t *pnr)
+{
+    struct model3dtx *txmodel;
+    struct sort_item *item;
+    size_t nr;
 
-            if (camera && camera->ch) {
-                vec3 dist = { e->dx, e->dy, e->dz };
-                unsigned int lod;
+    darray_resize(&mq->draw_list.da, 0);
+    list_for_each_entry(txmodel, &mq->txmodels, entry) {
+        if (list_empty(&txmodel->entities))
+            continue;
 
-                vec3_sub(dist, dist, camera->ch->pos);
-                lod = vec3_len(dist) / 80;
-                model3d_set_lod(model, lod);
-            }
-#ifndef EGL_EGL_PROTOTYPES
-            if (focus == e) {
-                GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
-            } else {
-                GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
-            }
-#endif
-            if (prog->data.color >= 0)
-                GL(glUniform4fv(prog->data.color, 1, e->color));
-            if (prog->data.colorpt >= 0)
-                GL(glUniform1f(prog->data.colorpt, 0.5 * e->color_pt));
-            if (focus && prog->data.highlight >= 0)
-                GL(glUniform4fv(prog->data.highlight, 1, focus == e ? (GLfloat *)hc : (GLfloat *)nohc));
-
-            if (model->nr_joints && model->anis.da.nr_el && prog->data.joint_transforms >= 0) {
-                GL(glUniform1f(prog->data.use_skinning, 1.0));
-                GL(glUniformMatrix4fv(prog->data.joint_transforms, model->nr_joints,
-                                      GL_FALSE, (GLfloat *)e->joint_transforms));
-            } else {
-                GL(glUniform1f(prog->data.use_skinning, 0.0));
-            }
-            if (prog->data.ray >= 0) {
-                vec3 ray = { 0, 0, 0 };
-                if (focus) {
-                    ray[0] = focus->dx;
-                    ray[1] = focus->dz;
-                    ray[2] = 1.0;
-                }
-                GL(glUniform3fv(prog->data.ray, 1, ray));
-            }
-            if (prog->data.transmx >= 0) {
-                /* Transformation matrix is different for each entity */
-                GL(glUniformMatrix4fv(prog->data.transmx, 1, GL_FALSE, (GLfloat *)e->mx));
-            }
+        item = darray_add(&mq->draw_list.da);
+        if (!item)
+            break;
 
-            model3dtx_draw(txmodel);
-            nr_ents++;
-        }
-        model3dtx_done(txmodel);
-        nr_txms++;
-        //dbg("RENDERED model '%s': %lu\n", txmodel->model->name, nr_ents);
+        item->key = txmodel_sort_key(txmodel, eye);
+        item->data = txmodel;
     }
 
-    //dbg("RENDERED: %lu/%lu\n", nr_txms, nr_ents);
-    if (count)
-        *count = nr_txms;
-    if (prog)
-        shader_prog_done(prog);
-    if (camera && culled)
-        ui_debug_printf("culled entities: %lu", culled);
+    nr = mq->draw_list.da.nr_el;
+    *pnr = nr;
+    /* unsorted is still better than nothing */
+    if (!nr || !darray_resize(&mq->draw_tmp.da, nr))
+        return mq->draw_list.x;
+
+    return radix_sort(mq->draw_list.x, mq->draw_tmp.x, nr);
 }
 
-static void model_obj_loaded(struct lib_handle *h, void *data)
+struct frustum_query {
+    struct camera   *camera;
+    unsigned long   seq;
+    /* the view being drawn and all of their frustums */
+    unsigned int    view;
+    float           (*planes[RENDER_VIEWS_MAX])[4];
+};
+
+static void entity3d_mark_visible(void *data, unsigned int mask, unsigned int inside, void *priv)
 {
-    struct shader_prog *prog;
-    struct scene *s = data;
-    struct model_data * md;
-    struct model3d *m;
+    struct frustum_query *fq = priv;
+    struct entity3d *e = data;
+    unsigned int i;
 
-    prog = shader_prog_find(s->prog, "model");
-    dbg("loaded '%s' %p %zu %d\n", h->name, h->buf, h->size, h->state);
-    if (!h->buf)
-        return;
+    /* the leaf's AABB is fattened, check the real one if it's on the edge */
+    for (i = 0; i < RENDER_VIEWS_MAX; i++)
+        if ((mask & ~inside & (1u << i)) && !bvh_aabb_in_frustum(e->aabb, fq->planes[i]))
+            mask &= ~(1u << i);
 
-    md = model_data_new_from_obj(h->buf, h->size);
-    if (!md)
-        return;
+    e->view_mask = mask;
+    e->frustum_seq = fq->seq;
+}
 
-    m = model3d_new_from_model_data(h->name, prog, md);
-    ref_put(prog); /* matches shader_prog_find() above */
-    ref_put(h);
+static bool entity3d_in_frustum(struct entity3d *e, struct mq *mq, struct frustum_query *fq)
+{
+    if (mq->spatial && e->bvh == &mq->bvh && e->bvh_node >= 0)
+        return e->frustum_seq == fq->seq && (e->view_mask & (1u << fq->view));
 
-    //scene_add_model(s, m);
-    s->_model = m;
+    return camera_entity_in_frustum(fq->camera, e);
 }
 
-static void model_bin_vec_loaded(struct lib_handle *h, void *data)
+/*
+ * Joint transforms of all skinned entities go into one RGBA32F texture, one
+ * texel per matrix column, JOINTS_PER_ROW matrices per row, and are uploaded
+ * in one go; draws find theirs via entity3d::joint_off. A texture rather
+ * than a uniform buffer, because the latter isn't there on GLES2/WebGL.
+ * Keep in sync with joint_transform() in model.vert.
+ */
+#define JOINTS_PER_ROW  256
+#define JOINT_TEX_UNIT  2
+
+static unsigned int mq_joints_upload(struct mq *mq, struct sort_item *draw_list, size_t nr_draws)
 {
-    struct shader_prog *prog;
-    struct scene *s = data;
-    struct model3d *m;
-    struct bin_vec_header *hdr = h->buf;
-    float *vx, *tx, *norm;
-    unsigned short *idx;
+    struct model3dtx *txmodel;
+    struct entity3d *e;
+    unsigned int rows;
+    size_t i, nr = 0;
 
-    prog = shader_prog_find(s->prog, "model");
+    for (i = 0; i < nr_draws; i++) {
+        txmodel = draw_list[i].data;
+        if (!model3d_is_skinned(txmodel->model))
+            continue;
 
-    dbg("loaded '%s' nr_vertices: %" PRIu64 "\n", h->name, hdr->nr_vertices);
-    vx   = h->buf + sizeof(*hdr);
-    tx   = h->buf + sizeof(*hdr) + hdr->vxsz;
-    norm = h->buf + sizeof(*hdr) + hdr->vxsz + hdr->txsz;
-    idx  = h->buf + sizeof(*hdr) + hdr->vxsz + hdr->txsz + hdr->vxsz;
-    m = model3d_new_from_vectors(h->name, prog, vx, hdr->vxsz, idx, hdr->idxsz, tx, hdr->txsz, norm, hdr->vxsz);
-    ref_put(prog);  /* matches shader_prog_find() above */
-    ref_put(h);
+        list_for_each_entry (e, &txmodel->entities, entry) {
+            if (!e->visible)
+                continue;
 
-    //scene_add_model(s, m);
+            if (!darray_resize(&mq->joints.da, nr + txmodel->model->nr_joints))
+                return 0;
+
+            e->joint_off = nr;
+            memcpy(&mq->joints.x[nr], e->joint_transforms,
+                   txmodel->model->nr_joints * sizeof(mat4x4));
+            nr += txmodel->model->nr_joints;
+        }
+    }
+
+    if (!nr)
+        return 0;
+
+    /* the texture is whole rows */
+    rows = (nr + JOINTS_PER_ROW - 1) / JOINTS_PER_ROW;
+    if (!darray_resize(&mq->joints.da, rows * JOINTS_PER_ROW))
+        return 0;
+
+    if (!texture_loaded(&mq->joint_tex)) {
+        texture_init_target(&mq->joint_tex, GL_TEXTURE0 + JOINT_TEX_UNIT);
+        texture_filters(&mq->joint_tex, GL_CLAMP_TO_EDGE, GL_NEAREST);
+        texture_data_type(&mq->joint_tex, GL_FLOAT);
+    }
+
+    texture_load(&mq->joint_tex, GL_RGBA, JOINTS_PER_ROW * 4, rows, mq->joints.x);
+    /* keeps the allocation for the next frame */
+    darray_resize(&mq->joints.da, 0);
+
+    return rows;
+}
+
+/*
+ * LOD from the screen space error: how many pixels the simplification error
+ * of each LOD would take at the entity's distance from the eye; the coarsest
+ * LOD that stays under LOD_ERROR_PX wins. It takes a smaller error to go to a
+ * coarser LOD than it does to come back, so that an entity sitting on the
+ * edge doesn't flip between the two every frame. @lod_scale is pixels per
+ * world unit at the distance of one.
+ */
+#define LOD_ERROR_PX    1.0
+#define LOD_HYSTERESIS  0.75
+
+static unsigned int entity3d_lod(struct entity3d *e, const float *eye, float lod_scale)
+{
+    struct model3d *model = e->txmodel->model;
+    float dist = 0, extent = 0, d, px;
+    unsigned int lod, i;
+
+    /* to the closest point of the world space AABB, which also has the scale in it */
+    for (i = 0; i < 3; i++) {
+        d = max(e->aabb[i * 2] - eye[i], eye[i] - e->aabb[i * 2 + 1]);
+        if (d > 0)
+            dist += d * d;
+        extent = max(extent, e->aabb[i * 2 + 1] - e->aabb[i * 2]);
+    }
+
+    /* inside the box */
+    if (!dist) {
+        e->screen_px = FLT_MAX;
+        return e->lod = 0;
+    }
+
+    dist = sqrtf(dist);
+    /* the animation LOD goes by this, see entity3d_ani_rate() */
+    e->screen_px = extent * lod_scale / dist;
+    if (model->nr_lods < 2)
+        return e->lod = 0;
+
+    for (lod = model->nr_lods - 1; lod > 0; lod--) {
+        px = model->lod_error[lod] * extent * lod_scale / dist;
+        if (px <= (lod > e->lod ? LOD_ERROR_PX * LOD_HYSTERESIS : LOD_ERROR_PX))
+            break;
+    }
+
+    return e->lod = lod;
+}
+
+/* opaque and depth tested, with a program that can skip the shading */
+static bool model3d_depth_prepass(struct model3d *m)
+{
+    return !m->alpha_blend && !m->debug && m->cull_face && m->prog->data.depth_only >= 0;
+}
+
+/*
+ * Occlusion culling: after the depth pre-pass, each opaque entity that's in
+ * the frustum gets a query of its AABB against that depth; a later frame
+ * skips it if none of the box passed. The results aren't waited for: a query
+ * that isn't in yet leaves its entity with the previous result, for up to
+ * OCCLUSION_MAX_AGE frames, after that, or from the inside of its box, it's
+ * visible. What comes into view behind a corner can be late by that much.
+ * The conservative query is good enough for a yes/no and cheaper, where
+ * there is one: GLES3, WebGL2.
+ */
+#define OCCLUSION_MAX_AGE   3
+#if defined(CONFIG_BROWSER) || defined(CONFIG_GLES)
+#define OCCLUSION_QUERY     GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+#else
+#define OCCLUSION_QUERY     GL_ANY_SAMPLES_PASSED
+#endif
+
+/* corners as bits: 1 is max X, 2 is max Y, 4 is max Z */
+static const unsigned char occlusion_box_corners[36] = {
+    0, 2, 1,  1, 2, 3,
+    4, 5, 6,  5, 7, 6,
+    0, 1, 4,  1, 5, 4,
+    2, 6, 3,  3, 6, 7,
+    0, 4, 2,  2, 4, 6,
+    1, 3, 5,  3, 7, 5,
+};
+
+static bool entity3d_occluded(struct entity3d *e, struct mq *mq, const float *eye)
+{
+    GLuint available, samples;
+    unsigned int i;
+
+    for (i = 0; i < 3; i++)
+        if (eye[i] < e->aabb[i * 2] || eye[i] > e->aabb[i * 2 + 1])
+            break;
+
+    /* the box's faces are behind the near plane */
+    if (i == 3) {
+        e->occlusion_result = false;
+        return false;
+    }
+
+    if (e->occlusion_pending) {
+        GL(glGetQueryObjectuiv(e->occlusion_query, GL_QUERY_RESULT_AVAILABLE, &available));
+        if (available) {
+            GL(glGetQueryObjectuiv(e->occlusion_query, GL_QUERY_RESULT, &samples));
+            e->occlusion_result = !samples;
+            e->occlusion_pending = false;
+        }
+    }
+
+    return e->occlusion_result && mq->occlusion_frame - e->occlusion_frame <= OCCLUSION_MAX_AGE;
+}
+
+static void mq_occlusion_queries(struct mq *mq, struct camera *camera, struct matrix4f *proj_mx)
+{
+    struct shader_prog *p = mq->occlusion_prog;
+    size_t nr = mq->occlusion_ents.da.nr_el;
+    struct occlusion_box *box;
+    struct entity3d **pe, *e;
+    unsigned int i, c;
+    ssize_t off;
+    GLuint obj;
+
+    if (!nr || !darray_resize(&mq->occlusion_boxes.da, nr))
+        goto out;
+
+    for (i = 0; i < nr; i++) {
+        e = mq->occlusion_ents.x[i];
+        box = &mq->occlusion_boxes.x[i];
+        for (c = 0; c < array_size(occlusion_box_corners); c++) {
+            box->vx[c][0] = e->aabb[0 + !!(occlusion_box_corners[c] & 1)];
+            box->vx[c][1] = e->aabb[2 + !!(occlusion_box_corners[c] & 2)];
+            box->vx[c][2] = e->aabb[4 + !!(occlusion_box_corners[c] & 4)];
+        }
+    }
+
+    if (gl_does_vao()) {
+        if (!mq->occlusion_vao)
+            GL(glGenVertexArrays(1, &mq->occlusion_vao));
+        render_bind_vao(mq->occlusion_vao);
+    }
+
+    /* binds @obj */
+    off = render_stream_write(mq->occlusion_boxes.x, nr * sizeof(*box), &obj);
+    if (off < 0)
+        goto out_vao;
+
+    shader_prog_use(p);
+    /* the boxes don't go into the depth either, the entities do */
+    render_depth_test(true);
+    render_cull_face(false);
+    render_blend(false);
+    GL(glDepthMask(GL_FALSE));
+    if (p->data.viewmx >= 0)
+        UNIFORM(glUniformMatrix4fv(p->data.viewmx, 1, GL_FALSE, camera->view_mx->cell));
+    if (p->data.projmx >= 0)
+        UNIFORM(glUniformMatrix4fv(p->data.projmx, 1, GL_FALSE, proj_mx->cell));
+    GL(glVertexAttribPointer(p->pos, 3, GL_FLOAT, GL_FALSE, 0, (void *)off));
+    GL(glEnableVertexAttribArray(p->pos));
+
+    i = 0;
+    darray_for_each(pe, &mq->occlusion_ents) {
+        e = *pe;
+        if (!e->occlusion_query)
+            GL(glGenQueries(1, &e->occlusion_query));
+
+        GL(glBeginQuery(OCCLUSION_QUERY, e->occlusion_query));
+        GL(glDrawArrays(GL_TRIANGLES, i++ * array_size(occlusion_box_corners),
+                        array_size(occlusion_box_corners)));
+        render_stats_draw(array_size(occlusion_box_corners), 1, 0);
+        GL(glEndQuery(OCCLUSION_QUERY));
+        e->occlusion_frame = mq->occlusion_frame;
+        e->occlusion_pending = true;
+    }
+
+    GL(glDisableVertexAttribArray(p->pos));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    GL(glDepthMask(GL_TRUE));
+    shader_prog_done(p);
+
+out_vao:
+    if (gl_does_vao())
+        render_bind_vao(0);
+out:
+    /* keeps the allocations for the next frame */
+    darray_resize(&mq->occlusion_ents.da, 0);
+    darray_resize(&mq->occlusion_boxes.da, 0);
+}
+
+/* the "frame" uniform block; what's not there is identities and zeroes */
+static void frame_upload(struct light *light, struct matrix4f *view_mx, struct matrix4f *inv_view_mx,
+                         struct matrix4f *proj_mx, int width, int height)
+{
+    static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    struct render_frame frame = { .width = width, .height = height };
+
+    memcpy(frame.proj, proj_mx ? proj_mx->cell : identity, sizeof(frame.proj));
+    memcpy(frame.view, view_mx ? view_mx->cell : identity, sizeof(frame.view));
+    memcpy(frame.inverse_view, inv_view_mx ? inv_view_mx->cell : identity,
+           sizeof(frame.inverse_view));
+    if (light) {
+        memcpy(frame.light_pos, light->pos, sizeof(frame.light_pos));
+        memcpy(frame.light_color, light->color, sizeof(frame.light_color));
+    }
+
+    render_frame_upload(&frame);
+}
+
+/*
+ * All @views draw the same @mq from their own cameras, into their own parts
+ * of the framebuffer: split screen, picture-in-picture. The frustum culling
+ * is one BVH traversal for all of them, which rejects what's outside of all
+ * the views at once and leaves each entity with a bitmask of the views it's
+ * in; the draw list, joints and LODs (picked for the first view) are also
+ * done once. Only the draws themselves are per view.
+ */
+void models_render_views(struct mq *mq, struct light *light, struct render_view *views,
+                         unsigned int nr_views, struct entity3d *focus, unsigned long *count)
+{
+    PROF_SCOPE("models_render");
+    struct entity3d *e, **pe;
+    struct shader_prog *prog = NULL;
+    struct model3d *model;
+    struct model3dtx *txmodel;
+    struct matrix4f *view_mx = NULL, *inv_view_mx = NULL, *proj_mx;
+    struct camera *camera = views[0].camera;
+    unsigned long nr_txms = 0, nr_ents = 0, culled = 0, occluded = 0;
+    float hc[] = { 0.7, 0.7, 0.0, 1.0 }, nohc[] = { 0.0, 0.0, 0.0, 0.0 };
+    struct sort_item *draw_list;
+    static unsigned long frustum_seq;
+    struct frustum_query fq = { .camera = camera };
+    struct render_view *view;
+    vec3 ray = { 0, 0, 0 };
+    float *eye = NULL, lod_scale = 0;
+    size_t i, nr_draws;
+    unsigned int joint_rows, lod, v;
+    bool instanced, batching, prepass, depth_only, occlusion;
+    int pass, width, height;
+
+    nr_views = min(nr_views, RENDER_VIEWS_MAX);
+    if (camera) {
+        /* camera position in the world space */
+        eye = camera->inv_view_mx->m[3];
+        /* cell[5] is the cotangent of half the vertical FOV */
+        if (views[0].proj_mx)
+            lod_scale = views[0].proj_mx->cell[5] * views[0].height / 2;
+
+        /* mark the visible entities, rejecting whole subtrees at a time */
+        if (mq->spatial) {
+            for (v = 0; v < nr_views; v++)
+                fq.planes[v] = views[v].camera->frustum_planes;
+            fq.seq = ++frustum_seq;
+            bvh_query_frustums(&mq->bvh, fq.planes, nr_views, entity3d_mark_visible, &fq);
+            /* entity3d_lod() fills in the screen sizes for the animation LOD */
+            mq->frustum_seq = lod_scale ? fq.seq : 0;
+        }
+    }
+
+    /* the ray only depends on the focus, same for all entities */
+    if (focus) {
+        ray[0] = focus->dx;
+        ray[1] = focus->dz;
+        ray[2] = 1.0;
+    }
+
+    draw_list = mq_draw_list(mq, eye, &nr_draws);
+    joint_rows = mq_joints_upload(mq, draw_list, nr_draws);
+    /* only the UIs, there's no culling them */
+    batching = !camera;
+    if (batching)
+        mq_batch_collect(mq, draw_list, nr_draws);
+    if (joint_rows)
+        render_bind_texture(JOINT_TEX_UNIT, texture_id(&mq->joint_tex));
+
+    /*
+     * With the depth pre-pass, the opaque models first go in with only the
+     * depth writes and a trivial fragment shader, then again with the full
+     * one, which then only runs for the fragments that are on the screen.
+     */
+    prepass = mq->depth_prepass && camera && !batching;
+    occlusion = prepass && mq->occlusion_prog && mq->spatial && nr_views == 1;
+    if (occlusion)
+        mq->occlusion_frame++;
+    for (v = 0; v < nr_views; v++) {
+        view = &views[v];
+        width = view->width;
+        height = view->height;
+        proj_mx = view->proj_mx;
+        fq.camera = camera = view->camera;
+        fq.view = v;
+        if (camera) {
+            view_mx = camera->view_mx;
+            inv_view_mx = camera->inv_view_mx;
+        }
+        /* a single view keeps the viewport that the caller set up */
+        if (nr_views > 1)
+            GL(glViewport(view->x, view->y, width, height));
+        frame_upload(light, view_mx, inv_view_mx, proj_mx, width, height);
+
+        for (pass = prepass ? 0 : 1; pass < 2; pass++) {
+            depth_only = !pass;
+            if (prog)
+                shader_prog_done(prog);
+            prog = NULL;
+
+            /* against all of the pre-pass' depth, for the next frames */
+            if (occlusion && !depth_only)
+                mq_occlusion_queries(mq, camera, proj_mx);
+
+            if (depth_only) {
+                GL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
+            } else if (prepass) {
+                GL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+                /* the same depth that the pre-pass left there is a pass */
+                GL(glDepthFunc(GL_LEQUAL));
+            }
+
+            for (i = 0; i < nr_draws; i++) {
+                txmodel = draw_list[i].data;
+                model = txmodel->model;
+                model3d_lods_poll(model);
+                model->cur_lod = 0;
+                if (depth_only && !model3d_depth_prepass(model))
+                    continue;
+                /* XXX: model-specific draw method */
+                render_cull_face(model->cull_face);
+                /* XXX: only for UIs */
+                render_blend(model->alpha_blend);
+                render_depth_test(!model->debug && model->cull_face);
+
+                //dbg("rendering model '%s'\n", model->name);
+                if (model->prog != prog) {
+                    if (prog)
+                        shader_prog_done(prog);
+
+                    prog = model->prog;
+                    shader_prog_use(prog);
+                    trace("rendering model '%s' using '%s'\n", model->name, prog->name);
+
+                    /* the frame block's members are -1, only GLSL ES 1.00 has these */
+                    if (prog->data.width >= 0)
+                        UNIFORM(glUniform1f(prog->data.width, width));
+                    if (prog->data.height >= 0)
+                        UNIFORM(glUniform1f(prog->data.height, height));
+
+                    if (light && prog->data.lightp >= 0 && prog->data.lightc >= 0) {
+                        UNIFORM(glUniform3fv(prog->data.lightp, 1, light->pos));
+                        UNIFORM(glUniform3fv(prog->data.lightc, 1, light->color));
+                    }
+
+                    if (view_mx && prog->data.viewmx >= 0)
+                        /* View matrix is the same for all entities and models */
+                        UNIFORM(glUniformMatrix4fv(prog->data.viewmx, 1, GL_FALSE, view_mx->cell));
+                    if (inv_view_mx && prog->data.inv_viewmx >= 0)
+                        UNIFORM(glUniformMatrix4fv(prog->data.inv_viewmx, 1, GL_FALSE, inv_view_mx->cell));
+
+                    /* Projection matrix is the same for everything, but changes on resize */
+                    if (proj_mx && prog->data.projmx >= 0)
+                        UNIFORM(glUniformMatrix4fv(prog->data.projmx, 1, GL_FALSE, proj_mx->cell));
+
+                    if (joint_rows && prog->data.joint_tex >= 0) {
+                        UNIFORM(glUniform1i(prog->data.joint_tex, JOINT_TEX_UNIT));
+                        UNIFORM(glUniform1f(prog->data.joint_rows, joint_rows));
+                    }
+
+                    if (prog->data.depth_only >= 0)
+                        UNIFORM(glUniform1f(prog->data.depth_only, depth_only ? 1.0 : 0.0));
+                }
+
+                if (batching && model3d_can_batch(model)) {
+                    nr_ents += model3dtx_draw_batch(txmodel, mq);
+                    nr_txms++;
+                    continue;
+                }
+
+                model3dtx_prepare(txmodel);
+                if (prog->data.use_normals >= 0 && txmodel->normals)
+                    UNIFORM(glUniform1f(prog->data.use_normals, texture_id(txmodel->normals) ? 1.0 : 0.0));
+
+                if (prog->data.shine_damper >= 0 && prog->data.reflectivity >= 0) {
+                    UNIFORM(glUniform1f(prog->data.shine_damper, txmodel->roughness));
+                    UNIFORM(glUniform1f(prog->data.reflectivity, txmodel->metallic));
+                }
+
+                instanced = model3d_can_instance(model);
+                list_for_each_entry (e, &txmodel->entities, entry) {
+                    if (!e->visible) {
+                        //dbg("skipping element of '%s'\n", entity_name(e));
+                        continue;
+                    }
+
+                    dbg_on(!e->visible, "rendering an invisible entity!\n");
+
+                    if (!e->skip_culling &&
+                        camera && !entity3d_in_frustum(e, mq, &fq)) {
+                        culled += !depth_only;
+                        continue;
+                    }
+
+                    if (occlusion && !e->skip_culling) {
+                        if (depth_only) {
+                            e->occluded = entity3d_occluded(e, mq, eye);
+                            pe = e->occlusion_pending ? NULL : darray_add(&mq->occlusion_ents.da);
+                            if (pe)
+                                *pe = e;
+                        }
+                        if (e->occluded) {
+                            occluded += !depth_only;
+                            continue;
+                        }
+                    }
+
+                    lod = lod_scale ? (v ? e->lod : entity3d_lod(e, eye, lod_scale)) : 0;
+
+                    /* focus needs its own polygon mode and highlight */
+                    if (instanced && e != focus) {
+                        model3d_instance_add(model, lod, e);
+                        continue;
+                    }
+
+                    /* the LODs are drawn one after another, each index buffer bound once */
+                    pe = darray_add(&mq->lod_ents[lod].da);
+                    if (pe)
+                        *pe = e;
+                }
+
+                for (lod = 0; lod < LOD_MAX; lod++) {
+                    if (!mq->lod_ents[lod].da.nr_el)
+                        continue;
+
+                    model3d_set_lod(model, lod);
+                    darray_for_each(pe, &mq->lod_ents[lod]) {
+                        e = *pe;
+#ifndef EGL_EGL_PROTOTYPES
+                        render_polygon_mode(focus == e ? GL_LINE : GL_FILL);
+#endif
+                        if (prog->data.color >= 0)
+                            UNIFORM(glUniform4fv(prog->data.color, 1, e->color));
+                        if (prog->data.colorpt >= 0)
+                            UNIFORM(glUniform1f(prog->data.colorpt, 0.5 * e->color_pt));
+                        if (focus && prog->data.highlight >= 0)
+                            UNIFORM(glUniform4fv(prog->data.highlight, 1,
+                                                 focus == e ? (GLfloat *)hc : (GLfloat *)nohc));
+
+                        if (joint_rows && model3d_is_skinned(model) && prog->data.joint_tex >= 0) {
+                            if (prog->data.use_skinning >= 0)
+                                UNIFORM(glUniform1f(prog->data.use_skinning, 1.0));
+                            UNIFORM(glUniform1f(prog->data.joint_off, e->joint_off));
+                        } else if (prog->data.use_skinning >= 0) {
+                            UNIFORM(glUniform1f(prog->data.use_skinning, 0.0));
+                        }
+                        if (prog->data.ray >= 0)
+                            UNIFORM(glUniform3fv(prog->data.ray, 1, ray));
+                        if (prog->data.tex_layer >= 0)
+                            UNIFORM(glUniform1f(prog->data.tex_layer, e->tex_layer));
+                        if (prog->data.transmx >= 0) {
+                            /* Transformation matrix is different for each entity */
+                            UNIFORM(glUniformMatrix4fv(prog->data.transmx, 1, GL_FALSE, (GLfloat *)e->mx));
+                        }
+
+                        model3dtx_draw(txmodel);
+                        nr_ents += !depth_only;
+                    }
+                    darray_resize(&mq->lod_ents[lod].da, 0);
+                }
+
+                if (instanced) {
+#ifndef EGL_EGL_PROTOTYPES
+                    render_polygon_mode(GL_FILL);
+#endif
+                    if (focus && prog->data.highlight >= 0)
+                        UNIFORM(glUniform4fv(prog->data.highlight, 1, nohc));
+                    if (prog->data.use_skinning >= 0)
+                        UNIFORM(glUniform1f(prog->data.use_skinning,
+                                            joint_rows && model3d_is_skinned(model) ? 1.0 : 0.0));
+                    if (prog->data.ray >= 0)
+                        UNIFORM(glUniform3fv(prog->data.ray, 1, ray));
+                    nr_ents += model3dtx_draw_instanced(txmodel) * !depth_only;
+                }
+                model3dtx_done(txmodel);
+                nr_txms += !depth_only;
+                //dbg("RENDERED model '%s': %lu\n", txmodel->model->name, nr_ents);
+            }
+        }
+    }
+
+    if (prepass)
+        GL(glDepthFunc(GL_LESS));
+
+    //dbg("RENDERED: %lu/%lu\n", nr_txms, nr_ents);
+    if (count)
+        *count = nr_txms;
+    if (prog)
+        shader_prog_done(prog);
+    if (joint_rows)
+        render_bind_texture(JOINT_TEX_UNIT, 0);
+    render_stats_cull(culled, occluded);
+}
+
+void models_render(struct mq *mq, struct light *light, struct camera *camera,
+                   struct matrix4f *proj_mx, struct entity3d *focus, int width, int height,
+                   unsigned long *count)
+{
+    struct render_view view = {
+        .camera  = camera,
+        .proj_mx = proj_mx,
+        .width   = width,
+        .height  = height,
+    };
+
+    models_render_views(mq, light, &view, 1, focus, count);
+}
+
+static void model_obj_loaded(struct lib_handle *h, void *data)
+{
+    struct shader_prog *prog;
+    struct scene *s = data;
+    struct model_data * md;
+    struct model3d *m;
+
+    prog = shader_prog_find(s->prog, "model");
+    dbg("loaded '%s' %p %zu %d\n", h->name, h->buf, h->size, h->state);
+    if (!h->buf)
+        return;
+
+    md = model_data_new_from_obj(h->buf, h->size);
+    if (!md)
+        return;
+
+    m = model3d_new_from_model_data(h->name, prog, md);
+    ref_put(prog); /* matches shader_prog_find() above */
+    ref_put(h);
+
+    //scene_add_model(s, m);
+    s->_model = m;
+}
+
+/* straight from the (mapped) buffer, see bin_vec in objfile.h */
+static void model_bin_vec_loaded(struct lib_handle *h, void *data)
+{
+    struct shader_prog *prog;
+    struct scene *s = data;
+    struct model3d *m;
+    struct bin_vec bv;
+    unsigned int lod;
+    int err;
+
+    if (!h->buf)
+        return;
+
+    err = bin_vec_parse(h->buf, h->size, &bv);
+    if (err) {
+        warn("couldn't load '%s': %d\n", h->name, err);
+        ref_put(h);
+        return;
+    }
+
+    prog = shader_prog_find(s->prog, "model");
+
+    dbg("loaded '%s' nr_vertices: %u lods: %u\n", h->name, bv.nr_vertices, bv.nr_lods);
+    m = model3d_new_from_vectors(h->name, prog, (GLfloat *)bv.data[BV_POSITION], bv.size[BV_POSITION],
+                                 (GLushort *)bv.idx[0], bv.idxsz[0],
+                                 (GLfloat *)bv.data[BV_TEXCOORD], bv.size[BV_TEXCOORD],
+                                 (GLfloat *)bv.data[BV_NORMAL], bv.size[BV_NORMAL]);
+    if (bv.data[BV_TANGENT])
+        model3d_add_tangents(m, (float *)bv.data[BV_TANGENT], bv.size[BV_TANGENT]);
+    if (bv.data[BV_JOINTS] && bv.data[BV_WEIGHTS] && bv.data[BV_INVMX])
+        model3d_add_skinning(m, (unsigned char *)bv.data[BV_JOINTS], bv.size[BV_JOINTS],
+                             (float *)bv.data[BV_WEIGHTS], bv.size[BV_WEIGHTS],
+                             bv.size[BV_INVMX] / sizeof(mat4x4), (mat4x4 *)bv.data[BV_INVMX]);
+    for (lod = 1; lod < bv.nr_lods; lod++)
+        model3d_add_lod(m, (GLushort *)bv.idx[lod], bv.idxsz[lod], bv.error[lod]);
+    ref_put(prog);  /* matches shader_prog_find() above */
+    ref_put(h);
+
+    //scene_add_model(s, m);
     s->_model = m;
 }
 
@@ -1017,6 +2640,9 @@ float entity3d_aabb_Z(struct entity3d *e)
     return model3d_aabb_Z(e->txmodel->model) * e->scale;
 }
 
+/* set while the workers are running the pure updates in mq_update() */
+static bool mq_update_parallel;
+
 void entity3d_aabb_update(struct entity3d *e)
 {
     struct model3d *m = e->txmodel->model;
@@ -1033,7 +2659,7 @@ void entity3d_aabb_update(struct entity3d *e)
     vec4 v;
     int i;
 
-    e->aabb[0] = e->aabb[2] = e->aabb[3] = INFINITY;
+    e->aabb[0] = e->aabb[2] = e->aabb[4] = INFINITY;
     e->aabb[1] = e->aabb[3] = e->aabb[5] = -INFINITY;
     for (i = 0; i < array_size(corners); i++) {
         mat4x4_mul_vec4(v, e->mx->m, corners[i]);
@@ -1044,6 +2670,15 @@ void entity3d_aabb_update(struct entity3d *e)
         e->aabb[4] = min(v[2], e->aabb[4]);
         e->aabb[5] = max(v[2], e->aabb[5]);
     }
+
+    if (!e->bvh)
+        return;
+
+    /* the tree is shared, mq_update() moves these after the workers are done */
+    if (mq_update_parallel)
+        e->bvh_dirty = true;
+    else
+        bvh_move(e->bvh, e->bvh_node, e->aabb);
 }
 
 void entity3d_aabb_min(struct entity3d *e, vec3 min)
@@ -1073,23 +2708,44 @@ void entity3d_aabb_center(struct entity3d *e, vec3 center)
 void model3d_skeleton_add(struct model3d *model, int joint, int parent)
 {}
 
+/*
+ * Find the keys around @time: evenly spaced keys are indexed directly,
+ * otherwise try the cursor (@start) and the key after it, which is where
+ * the next frame usually lands, and fall back to a binary search, so that
+ * looping or jumping around the timeline doesn't need a linear rescan
+ */
 static void channel_time_to_idx(struct channel *chan, float time, int start, int *prev, int *next)
 {
-    int i;
+    int lo, hi, i;
 
-    if (time < chan->time[0])
+    if (chan->nr < 2 || time < chan->time[0] || time > chan->time[chan->nr - 1])
         goto tail;
 
-    if (time < chan->time[start])
-        start = 0;
+    if (chan->dt > 0) {
+        i = (time - chan->time[0]) / chan->dt;
+        *prev = min(i, (int)chan->nr - 2);
+        *next = *prev + 1;
+        return;
+    }
+
+    for (i = start; i < start + 2 && i < chan->nr - 1; i++)
+        if (time >= chan->time[i] && time <= chan->time[i + 1])
+            goto found;
 
-    for (i = start; i < chan->nr && time > chan->time[i]; i++)
-        ;
-    if (i == chan->nr)
-        goto tail;
+    /* the first key at or after @time */
+    for (lo = 0, hi = chan->nr - 1; lo < hi;) {
+        int mid = (lo + hi) / 2;
+
+        if (chan->time[mid] < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    i = max(lo - 1, 0);
 
-    *prev = max(i - 1, 0);
-    *next = *prev + 1;
+found:
+    *prev = i;
+    *next = i + 1;
     return;
 
 tail:
@@ -1163,47 +2819,283 @@ static void quat_slerp(quat res, quat a, quat b, float fac)
     quat_add(res, scaled_a, scaled_b);
 }
 
-static void channel_transform(struct entity3d *e, struct channel *chan, float time)
+/*
+ * Smallest three: the largest component of a unit quaternion can be had
+ * from the other three, which are then within +-1/sqrt(2). That's 2 bits
+ * for its index and 15 bits for each of the rest, 47 bits in 3 uint16_t.
+ * The sign goes away: q and -q are the same rotation.
+ */
+#define QUAT_PACK_MAX 0x7fff
+
+static void quat_pack(uint16_t *out, const quat q)
 {
-    struct model3d *model = e->txmodel->model;
-    void *p_data, *n_data;
-    struct joint *joint = &e->joints[chan->target];
-    float p_time, n_time, fac;
-    int prev, next;
-    mat4x4 rot;
+    unsigned int i, j, big = 0;
+    uint64_t bits;
+    float sign;
 
-    channel_time_to_idx(chan, time, joint->off[chan->path], &prev, &next);
-    joint->off[chan->path] = min(prev, next);
+    for (i = 1; i < 4; i++)
+        if (fabsf(q[i]) > fabsf(q[big]))
+            big = i;
+
+    sign = q[big] < 0 ? -1 : 1;
+    bits = big;
+    for (i = 0; i < 4; i++) {
+        float v;
+
+        if (i == big)
+            continue;
+
+        v = (sign * q[i] * (float)M_SQRT2 + 1) / 2;
+        j = clampf(v, 0, 1) * QUAT_PACK_MAX + 0.5f;
+        bits = bits << 15 | j;
+    }
+
+    out[0] = bits >> 32;
+    out[1] = bits >> 16;
+    out[2] = bits;
+}
+
+static void quat_unpack(quat q, const uint16_t *in)
+{
+    uint64_t bits = (uint64_t)in[0] << 32 | (uint64_t)in[1] << 16 | in[2];
+    unsigned int big = bits >> 45, shift = 45, i;
+    float sum = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (i == big)
+            continue;
+
+        shift -= 15;
+        q[i] = ((float)((bits >> shift) & QUAT_PACK_MAX) / QUAT_PACK_MAX * 2 - 1) * (float)M_SQRT1_2;
+        sum += q[i] * q[i];
+    }
+    q[big] = sqrtf(max(1 - sum, 0.f));
+}
+
+/* interpolate @chan's value at @time between the keys @prev and @next into @out */
+static void channel_sample(struct channel *chan, float time, int prev, int next, void *out)
+{
+    float p_time, n_time, fac;
+    void *p_data, *n_data;
+    quat p_rot, n_rot;
 
     p_time = chan->time[prev];
     n_time = chan->time[next];
-    if (p_time > n_time)
+    if (prev == next)
+        fac = 0;
+    else if (p_time > n_time)
         fac = time < n_time ? 1 : 0;
     else
         fac = (time - p_time) / (n_time - p_time);
 
-    p_data = (void *)chan->data + prev * chan->stride;
-    n_data = (void *)chan->data + next * chan->stride;
+    p_data = chan->data + prev * chan->stride;
+    n_data = chan->data + next * chan->stride;
+    if (chan->packed) {
+        quat_unpack(p_rot, p_data);
+        quat_unpack(n_rot, n_data);
+        p_data = p_rot;
+        n_data = n_rot;
+    }
 
     switch (chan->path) {
-    case PATH_TRANSLATION: {
-        vec3 *p_pos = p_data, *n_pos = n_data;
-
-        vec3_interp(joint->translation, *p_pos, *n_pos, fac);
+    case PATH_TRANSLATION:
+    case PATH_SCALE:
+        vec3_interp(out, p_data, n_data, fac);
+        break;
+    case PATH_ROTATION:
+        quat_slerp(out, p_data, n_data, fac);
         break;
     }
-    case PATH_ROTATION: {
-        quat *n_rot = n_data, *p_rot = p_data;
+}
 
-        quat_slerp(joint->rotation, *p_rot, *n_rot, fac);
+static void channel_transform(struct entity3d *e, struct channel *chan, float time)
+{
+    struct joint *joint = &e->joints[chan->target];
+    int prev, next;
+
+    channel_time_to_idx(chan, time, joint->off[chan->path], &prev, &next);
+    joint->off[chan->path] = min(prev, next);
+
+    switch (chan->path) {
+    case PATH_TRANSLATION:
+        channel_sample(chan, time, prev, next, e->joint_translation[chan->target]);
         break;
-    }
-    case PATH_SCALE: {
-        vec3 *n_scale = n_data, *p_scale = p_data;
-        vec3_interp(joint->scale, *p_scale, *n_scale, fac);
+    case PATH_ROTATION:
+        channel_sample(chan, time, prev, next, e->joint_rotation[chan->target]);
+        break;
+    case PATH_SCALE:
+        channel_sample(chan, time, prev, next, e->joint_scale[chan->target]);
         break;
     }
+}
+
+/*
+ * Resample the channels whose keys aren't evenly spaced at @rate keys per
+ * second, so that the key lookup becomes a direct index
+ */
+int animation_resample(struct animation *an, float rate)
+{
+    int ch;
+
+    for (ch = 0; ch < an->cur_channel; ch++) {
+        struct channel *chan = &an->channels[ch];
+        float start, end, dt, *time;
+        unsigned int nr, i;
+        void *data;
+
+        if (chan->dt > 0 || chan->nr < 2)
+            continue;
+
+        start = chan->time[0];
+        end = chan->time[chan->nr - 1];
+        nr = (end - start) * rate + 1;
+        if (nr < 2)
+            continue;
+
+        dt = (end - start) / (nr - 1);
+        time = malloc(nr * sizeof(*time));
+        data = malloc(nr * chan->stride);
+        if (!time || !data) {
+            free(time);
+            free(data);
+            return -ENOMEM;
+        }
+
+        for (i = 0; i < nr; i++) {
+            int prev, next;
+
+            /* the last key goes in as is, avoid the rounding error */
+            time[i] = i == nr - 1 ? end : start + i * dt;
+            channel_time_to_idx(chan, time[i], 0, &prev, &next);
+            channel_sample(chan, time[i], prev, next, data + i * chan->stride);
+        }
+
+        mem_account(MEM_ANIMATION, -(ssize_t)channel_bytes(chan));
+        free(chan->time);
+        free(chan->data);
+        chan->time = time;
+        chan->data = data;
+        chan->nr = nr;
+        chan->dt = dt;
+        mem_account(MEM_ANIMATION, channel_bytes(chan));
     }
+
+    return 0;
+}
+
+static unsigned int channel_components(struct channel *chan)
+{
+    return chan->path == PATH_ROTATION ? 4 : 3;
+}
+
+/* how far off is the key @i from what the keys @a and @b interpolate to */
+static float channel_key_error(struct channel *chan, int a, int b, int i)
+{
+    float *key = chan->data + i * chan->stride;
+    float v[4], err = 0, sign = 1;
+    unsigned int c;
+
+    channel_sample(chan, chan->time[i], a, b, v);
+    if (chan->path == PATH_ROTATION && quat_dot(v, key) < 0)
+        sign = -1;
+
+    for (c = 0; c < channel_components(chan); c++)
+        err = max(err, fabsf(sign * v[c] - key[c]));
+
+    return err;
+}
+
+/*
+ * Shrink the channels that animation_resample() left with float keys:
+ * tracks that don't move within @error become a single key, keys that are
+ * within @error of what their neighbours interpolate to are dropped, and
+ * the rotations get packed into 48 bits. Happens on the loading job, the
+ * channels are sampled in the compressed form, see channel_sample().
+ */
+int animation_compress(struct animation *an, float error)
+{
+    size_t before = 0, after = 0;
+    int ch;
+
+    for (ch = 0; ch < an->cur_channel; ch++) {
+        struct channel *chan = &an->channels[ch];
+        unsigned int nr, comps, i, j, a, b;
+        float *time;
+        void *data;
+
+        before += channel_bytes(chan);
+        if (chan->packed || !chan->nr)
+            goto account;
+
+        comps = channel_components(chan);
+        time = malloc(chan->nr * sizeof(*time));
+        data = malloc(chan->nr * comps * sizeof(float));
+        if (!time || !data) {
+            free(time);
+            free(data);
+            return -ENOMEM;
+        }
+
+        /* constant track: everything is within @error of the first key */
+        for (i = 1; i < chan->nr; i++)
+            if (channel_key_error(chan, 0, 0, i) > error)
+                break;
+
+        if (i == chan->nr) {
+            time[0] = chan->time[0];
+            memcpy(data, chan->data, comps * sizeof(float));
+            nr = 1;
+        } else {
+            /* extend each segment for as long as the keys inside it are redundant */
+            time[0] = chan->time[0];
+            memcpy(data, chan->data, comps * sizeof(float));
+            for (a = 0, nr = 1; a < chan->nr - 1; a = b - 1) {
+                for (b = a + 2; b < chan->nr; b++) {
+                    for (j = a + 1; j < b; j++)
+                        if (channel_key_error(chan, a, b, j) > error)
+                            break;
+                    if (j < b)
+                        break;
+                }
+
+                time[nr] = chan->time[b - 1];
+                memcpy(data + nr * comps * sizeof(float), chan->data + (b - 1) * chan->stride,
+                       comps * sizeof(float));
+                nr++;
+            }
+        }
+
+        mem_account(MEM_ANIMATION, -(ssize_t)channel_bytes(chan));
+        free(chan->time);
+        free(chan->data);
+        chan->time = time;
+        chan->data = data;
+        chan->stride = comps * sizeof(float);
+        chan->nr = nr;
+        chan->dt = channel_uniform_dt(time, nr);
+
+        if (chan->path == PATH_ROTATION) {
+            uint16_t *packed = data;
+
+            /* packs in place, 6 bytes per key over the 16 that were there */
+            for (i = 0; i < nr; i++)
+                quat_pack(packed + i * 3, data + i * chan->stride);
+
+            chan->stride = 3 * sizeof(uint16_t);
+            chan->packed = true;
+        }
+
+        /* the tail is wasted space until realloc shrinks it */
+        chan->time = realloc(chan->time, nr * sizeof(float)) ? : chan->time;
+        chan->data = realloc(chan->data, nr * chan->stride) ? : chan->data;
+        mem_account(MEM_ANIMATION, channel_bytes(chan));
+account:
+        after += channel_bytes(chan);
+    }
+
+    dbg("animation '%s': %zu -> %zu bytes\n", an->name, before, after);
+
+    return 0;
 }
 
 static void channels_transform(struct entity3d *e, struct animation *an, float time)
@@ -1214,47 +3106,109 @@ static void channels_transform(struct entity3d *e, struct animation *an, float t
         channel_transform(e, &an->channels[ch], time);
 }
 
-static void one_joint_transform(struct entity3d *e, int joint, int parent)
+/*
+ * Flatten the skeleton, breadth first from the joint 0, so that the pose
+ * can be evaluated in a single pass, parents before children
+ */
+static int model3d_joint_order(struct model3d *m)
 {
-    struct model3d *model = e->txmodel->model;
-    mat4x4 *parentjt = NULL, R, *invglobal;
-    struct joint *j = &e->joints[joint];
-    mat4x4 *jt, T;
+    unsigned int i, nr = 0;
     int *child;
 
-    /* inverse bind matrix */
-    invglobal = &model->joints[joint].invmx;
+    CHECK(m->joint_order = calloc(m->nr_joints, sizeof(*m->joint_order)));
+    CHECK(m->joint_parent = calloc(m->nr_joints, sizeof(*m->joint_parent)));
 
-    jt = &j->global;
-    mat4x4_identity(*jt);
+    m->joint_order[nr++] = 0;
+    m->joint_parent[0] = -1;
+    for (i = 0; i < nr; i++) {
+        int joint = m->joint_order[i];
 
-    if (parent >= 0)
-        parentjt = &e->joints[parent].global;
-    else
-        parentjt = &model->root_pose;
-    if (parentjt)
-        mat4x4_mul(*jt, *parentjt, *jt);
-
-    mat4x4_translate(T,
-                     j->translation[0],
-                     j->translation[1],
-                     j->translation[2]);
-    mat4x4_mul(*jt, *jt, T);
-    mat4x4_from_quat(R, j->rotation);
-    mat4x4_mul(*jt, *jt, R);
-    mat4x4_scale_aniso(*jt, *jt,
-                       j->scale[0],
-                       j->scale[1],
-                       j->scale[2]);
+        darray_for_each(child, &m->joints[joint].children) {
+            if (nr == m->nr_joints) {
+                err("model '%s': skeleton is not a tree\n", m->name);
+                return -EINVAL;
+            }
+            m->joint_parent[*child] = joint;
+            m->joint_order[nr++] = *child;
+        }
+    }
+    m->nr_joint_order = nr;
 
-    /*
-     * jt = parentjt * T * R * S
-     * joint_transform = invglobal * jt
-     */
-    mat4x4_mul(e->joint_transforms[joint], *jt, *invglobal);
+    return 0;
+}
+
+static void pose_evaluate(struct entity3d *e)
+{
+    struct model3d *model = e->txmodel->model;
+    mat4x4 *jt = e->joint_transforms;
+    unsigned int i;
+
+    /* local = T * R * S of every joint, in one go */
+    mat4x4_from_trs_n(jt, e->joint_translation, e->joint_rotation, e->joint_scale,
+                      model->nr_joints);
+
+    /* global = parent * local, parents come first and are global already */
+    for (i = 0; i < model->nr_joint_order; i++) {
+        int joint = model->joint_order[i], parent = model->joint_parent[joint];
+
+        mat4x4_mul(jt[joint], parent >= 0 ? jt[parent] : model->root_pose, jt[joint]);
+    }
+
+    /* joint_transform = global * inverse bind matrix */
+    mat4x4_mul_n(jt, jt, model->joint_invmx, model->nr_joints);
+}
+
+/*
+ * Find the pose for @animation at @frame if someone has already evaluated
+ * it this frame (@hit), or a slot to store it in otherwise. This assumes
+ * that animations drive all the joints they care about, so that the pose
+ * doesn't depend on what the entity was playing before.
+ */
+static struct pose_cache *pose_cache_get(struct model3d *m, int animation, long frame,
+                                         unsigned long frames_total, bool *hit)
+{
+    struct pose_cache *pose;
+    int i;
+
+    for (i = 0; i < POSE_CACHE_MAX; i++) {
+        pose = &m->poses[i];
+        if (pose->joint_transforms && pose->frames_total == frames_total &&
+            pose->animation == animation && pose->frame == frame) {
+            *hit = true;
+            return pose;
+        }
+    }
 
-    darray_for_each(child, &model->joints[joint].children)
-        one_joint_transform(e, *child, joint);
+    *hit = false;
+    pose = &m->poses[m->pose_next];
+    m->pose_next = (m->pose_next + 1) % POSE_CACHE_MAX;
+    if (!pose->joint_transforms) {
+        pose->translation = calloc(m->nr_joints, sizeof(vec3));
+        pose->rotation = calloc(m->nr_joints, sizeof(quat));
+        pose->scale = calloc(m->nr_joints, sizeof(vec3));
+        if (!pose->translation || !pose->rotation || !pose->scale)
+            goto err;
+
+        pose->joint_transforms = calloc(m->nr_joints, sizeof(mat4x4));
+        if (!pose->joint_transforms)
+            goto err;
+    }
+
+    pose->animation = animation;
+    pose->frame = frame;
+    pose->frames_total = frames_total;
+
+    return pose;
+
+err:
+    free(pose->translation);
+    free(pose->rotation);
+    free(pose->scale);
+    pose->translation = NULL;
+    pose->rotation = NULL;
+    pose->scale = NULL;
+
+    return NULL;
 }
 
 void animation_start(struct entity3d *e, unsigned long start_frame, int ani)
@@ -1275,18 +3229,33 @@ void animation_start(struct entity3d *e, unsigned long start_frame, int ani)
         e->joints[chan->target].off[chan->path] = 0;
     }
     e->ani_frame = start_frame;
+    /* don't blend into the previous animation's pose */
+    e->ani_lod_span = 0;
 }
 
 int animation_by_name(struct model3d *m, const char *name)
 {
     int i;
 
+    model3d_anis_poll(m, true);
+
     for (i = 0; i < m->anis.da.nr_el; i++)
         if (!strcmp(name, m->anis.x[i].name))
             return i;
     return -1;
 }
 
+/*
+ * gl_refresh_rate() may only be called from the main thread; mq_update()
+ * samples it for the updates that run on the workers
+ */
+static unsigned long refresh_rate;
+
+static unsigned long ani_framerate(void)
+{
+    return refresh_rate ? refresh_rate : gl_refresh_rate();
+}
+
 static struct queued_animation *ani_current(struct entity3d *e)
 {
     if (e->animation >= e->aniq.da.nr_el)
@@ -1306,7 +3275,7 @@ static void animation_next(struct entity3d *e, struct scene *s)
         /* randomize phase, should probably be in instantiate instead */
         qa = ani_current(e);
         an = &model->anis.x[qa->animation];
-        e->ani_frame = (long)s->frames_total - an->time_end * gl_refresh_rate() * drand48();
+        e->ani_frame = (long)s->frames_total - an->time_end * ani_framerate() * erand48(e->rand48);
         return;
     }
     qa = ani_current(e);
@@ -1337,64 +3306,186 @@ void animation_push_by_name(struct entity3d *e, struct scene *s, const char *nam
     }
 }
 
+/* pose @e at @frame of its current animation */
+static void animated_evaluate(struct entity3d *e, struct scene *s, long frame)
+{
+    struct model3d *model = e->txmodel->model;
+    struct queued_animation *qa = ani_current(e);
+    struct animation *an = &model->anis.x[qa->animation];
+    struct pose_cache *pose;
+    bool hit;
+
+    /* a hit leaves @e as evaluating it would have, sampled joints and all */
+    pose = pose_cache_get(model, qa->animation, frame, s->frames_total, &hit);
+    if (hit) {
+        memcpy(e->joint_transforms, pose->joint_transforms, model->nr_joints * sizeof(mat4x4));
+        memcpy(e->joint_translation, pose->translation, model->nr_joints * sizeof(vec3));
+        memcpy(e->joint_rotation, pose->rotation, model->nr_joints * sizeof(quat));
+        memcpy(e->joint_scale, pose->scale, model->nr_joints * sizeof(vec3));
+    } else {
+        channels_transform(e, an, (float)frame / ani_framerate());
+        pose_evaluate(e);
+        if (pose) {
+            memcpy(pose->joint_transforms, e->joint_transforms, model->nr_joints * sizeof(mat4x4));
+            memcpy(pose->translation, e->joint_translation, model->nr_joints * sizeof(vec3));
+            memcpy(pose->rotation, e->joint_rotation, model->nr_joints * sizeof(quat));
+            memcpy(pose->scale, e->joint_scale, model->nr_joints * sizeof(vec3));
+        }
+    }
+}
+
+/*
+ * How often to evaluate @e's animation, going by what the last
+ * models_render() saw of it: 1 is every frame, 0 is never
+ */
+static unsigned int entity3d_ani_rate(struct entity3d *e, bool *visible)
+{
+    struct mq *mq = e->txmodel->mq;
+    unsigned int i, rate = 1;
+
+    *visible = true;
+    if (!mq || !mq->frustum_seq || !e->bvh || e->skip_culling)
+        return 1;
+
+    if (e->frustum_seq != mq->frustum_seq || !e->view_mask) {
+        *visible = false;
+        return mq->ani_culled_rate;
+    }
+
+    for (i = 0; i < ANI_LOD_MAX && mq->ani_lods[i].rate; i++)
+        if (e->screen_px < mq->ani_lods[i].px)
+            rate = mq->ani_lods[i].rate;
+
+    return rate;
+}
+
+static void joints_interp(mat4x4 *res, mat4x4 *a, mat4x4 *b, unsigned int nr, float fac)
+{
+    float *r = (float *)res, *pa = (float *)a, *pb = (float *)b;
+    unsigned int i;
+
+    for (i = 0; i < nr * 16; i++)
+        r[i] = pa[i] + (pb[i] - pa[i]) * fac;
+}
+
+/*
+ * At reduced rates, the visible entities evaluate the pose @rate frames
+ * ahead and blend the joint matrices towards it, starting from where they
+ * are; the ones out of view just skip frames.
+ */
 static void animated_update(struct entity3d *e, struct scene *s)
 {
     struct model3d *model = e->txmodel->model;
     struct queued_animation *qa;
     struct animation *an;
-    unsigned long framerate = gl_refresh_rate();
-    int i;
+    unsigned long framerate = ani_framerate();
+    size_t size = model->nr_joints * sizeof(mat4x4);
+    unsigned int rate;
+    long frame, end;
+    bool visible;
 
     if (e->animation < 0)
         animation_next(e, s);
     qa = ani_current(e);
     an = &model->anis.x[qa->animation];
-    channels_transform(e, an, (float)(s->frames_total - e->ani_frame) / framerate);
-    one_joint_transform(e, 0, -1);
 
-    if (s->frames_total - e->ani_frame >= an->time_end * framerate)
+    if (!model->joint_order && model3d_joint_order(model))
+        return;
+
+    frame = s->frames_total - e->ani_frame;
+    end = an->time_end * framerate;
+    rate = entity3d_ani_rate(e, &visible);
+    if (!rate) {
+        e->ani_lod_span = 0;
+        return;
+    }
+
+    if (rate > 1 && visible) {
+        /* in between the evaluations */
+        if (e->ani_lod_span && s->frames_total - e->ani_lod_start < e->ani_lod_span) {
+            joints_interp(e->joint_transforms, e->ani_from, e->ani_to, model->nr_joints,
+                          (float)(s->frames_total - e->ani_lod_start) / e->ani_lod_span);
+            return;
+        }
+
+        if (!e->ani_from)
+            e->ani_from = malloc(size);
+        if (!e->ani_to)
+            e->ani_to = malloc(size);
+        if (e->ani_from && e->ani_to && frame + 1 < end) {
+            /* coming from the full rate or a different animation */
+            if (!e->ani_lod_span)
+                animated_evaluate(e, s, frame);
+            memcpy(e->ani_from, e->joint_transforms, size);
+
+            e->ani_lod_start = s->frames_total;
+            e->ani_lod_span = min(frame + rate, end) - frame;
+            animated_evaluate(e, s, frame + e->ani_lod_span);
+            memcpy(e->ani_to, e->joint_transforms, size);
+            memcpy(e->joint_transforms, e->ani_from, size);
+            return;
+        }
+    } else if (rate > 1 && (s->frames_total + e->xform) % rate) {
+        /* out of view, spread out over the frames by the xform slot */
+        e->ani_lod_span = 0;
+        return;
+    }
+
+    e->ani_lod_span = 0;
+    animated_evaluate(e, s, frame);
+
+    if (frame >= end)
         animation_next(e, s);
 }
 
-static bool needs_update(struct entity3d *e)
+/*
+ * Entities whose dx..rz or scale have changed since their last mq_update();
+ * whatever changes those has to call this, or the matrix stays as it was.
+ * New entities start out dirty. Main thread only.
+ */
+static DECLARE_LIST(dirty_entities);
+
+void entity3d_dirty(struct entity3d *e)
 {
-    /*
-     * Cache TRS data, this should cut out a lot of matrix multiplications
-     * especially on stationaly entities.
-     */
-    if (e->dx != e->_dx ||
-        e->dy != e->_dy ||
-        e->dz != e->_dz ||
-        e->rx != e->_rx ||
-        e->ry != e->_ry ||
-        e->rz != e->_rz ||
-        e->scale != e->_scale) {
-        e->_dx = e->dx;
-        e->_dy = e->dy;
-        e->_dz = e->dz;
-        e->_rx = e->rx;
-        e->_ry = e->ry;
-        e->_rz = e->rz;
-        e->_scale = e->scale;
-        return true;
-    }
-    return false;
+    if (e->xform_dirty)
+        return;
+
+    e->xform_dirty = true;
+    list_append(&dirty_entities, &e->dirty_entry);
 }
 
-static int default_update(struct entity3d *e, void *data)
+/*
+ * Only rebuild the matrix if something did change; physics bodies are drawn
+ * in between their last two steps, see phys_advance()
+ */
+static void entity3d_commit(struct entity3d *e)
 {
-    struct scene *scene = data;
+    float pos[3] = { e->dx, e->dy, e->dz };
+
+    e->xform_dirty = false;
+    list_del(&e->dirty_entry);
 
-    if (needs_update(e)) {
-        mat4x4_identity(e->mx->m);
-        mat4x4_translate_in_place(e->mx->m, e->dx, e->dy, e->dz);
-        mat4x4_rotate_X(e->mx->m, e->mx->m, e->rx);
-        mat4x4_rotate_Y(e->mx->m, e->mx->m, e->ry);
-        mat4x4_rotate_Z(e->mx->m, e->mx->m, e->rz);
-        mat4x4_scale_aniso(e->mx->m, e->mx->m, e->scale, e->scale, e->scale);
+    if (e->phys_body && phys_body_has_body(e->phys_body)) {
+        dReal p[3];
 
+        phys_body_interp_position(e->phys_body, p);
+        pos[0] = p[0];
+        pos[1] = p[1] - e->phys_body->yoffset;
+        pos[2] = p[2];
+    }
+
+    if (xform_commit(e->xform, pos, (float []){ e->rx, e->ry, e->rz }, e->scale)) {
+        xform_rebuild(e->xform);
         entity3d_aabb_update(e);
     }
+}
+
+static int default_update(struct entity3d *e, void *data)
+{
+    struct scene *scene = data;
+
+    if (e->xform_dirty)
+        entity3d_commit(e);
     if (entity_animated(e))
         animated_update(e, scene);
     // if (e->phys_body)
@@ -1405,6 +3496,7 @@ static int default_update(struct entity3d *e, void *data)
 
 void entity3d_reset(struct entity3d *e)
 {
+    entity3d_dirty(e);
     default_update(e, NULL);
 }
 
@@ -1413,24 +3505,39 @@ static void entity3d_drop(struct ref *ref)
     struct entity3d *e = container_of(ref, struct entity3d, ref);
     trace("dropping entity3d\n");
     list_del(&e->entry);
-    ref_put(e->txmodel);
+    list_del(&e->dirty_entry);
 
     darray_clearout(&e->aniq.da);
+    if (e->bvh)
+        bvh_remove(e->bvh, e->bvh_node);
     if (e->phys_body) {
         phys_body_done(e->phys_body);
         e->phys_body = NULL;
     }
+    /* the geom is gone, the model's trimesh can go */
+    ref_put(e->txmodel);
     free(e->joints);
+    free(e->joint_translation);
+    free(e->joint_rotation);
+    free(e->joint_scale);
     free(e->joint_transforms);
-    free(e->mx);
+    free(e->ani_from);
+    free(e->ani_to);
+    if (e->occlusion_query)
+        GL(glDeleteQueries(1, &e->occlusion_query));
+    xform_free(e->xform);
 }
 
-DECLARE_REFCLASS(entity3d);
+DECLARE_REFCLASS(entity3d, .pooled = true);
+
+/* entities are made on the main thread */
+static unsigned int entity_seed;
 
 struct entity3d *entity3d_new(struct model3dtx *txm)
 {
     struct model3d *model = txm->model;
     struct entity3d *e;
+    int xform;
 
     /*
      * XXX this is ef'ed up
@@ -1439,19 +3546,38 @@ struct entity3d *entity3d_new(struct model3dtx *txm)
      * making it impossible to continue. Fixing that.
      */
     // ref_shared(txm);
+    xform = xform_alloc();
+    if (xform < 0)
+        return NULL;
+
     e = ref_new(entity3d);
-    if (!e)
+    if (!e) {
+        xform_free(xform);
         return NULL;
+    }
 
+    /* like srand48() does it, with a different seed for each */
+    e->rand48[0] = 0x330e;
+    e->rand48[1] = entity_seed;
+    e->rand48[2] = entity_seed++ >> 16;
     e->txmodel = ref_get(txm);
-    e->mx = mx_new();
+    e->xform = xform;
+    e->mx = xform_mx(xform);
+    e->aabb = xform_aabb(xform);
+    list_init(&e->dirty_entry);
+    entity3d_dirty(e);
     e->update  = default_update;
+    e->bvh_node = -1;
     entity3d_aabb_update(e);
-    if (model->anis.da.nr_el) {
+    /* the animations may still be on their way, see model3d_add_animations() */
+    if (model->anis.da.nr_el || model->pending_anis) {
         CHECK(e->joints = calloc(model->nr_joints, sizeof(*e->joints)));
+        CHECK(e->joint_translation = calloc(model->nr_joints, sizeof(vec3)));
+        CHECK(e->joint_rotation = calloc(model->nr_joints, sizeof(quat)));
+        CHECK(e->joint_scale = calloc(model->nr_joints, sizeof(vec3)));
         CHECK(e->joint_transforms = calloc(model->nr_joints, sizeof(mat4x4)));
     }
-    darray_init(&e->aniq);
+    darray_init_small(&e->aniq);
     e->animation = -1;
 
     return e;
@@ -1469,7 +3595,7 @@ void entity3d_update(struct entity3d *e, void *data)
         e->update(e, data);
 }
 
-void entity3d_add_physics(struct entity3d *e, double mass, int class, int type, double geom_off, double geom_radius, double geom_length)
+void entity3d_add_physics(struct entity3d *e, struct phys *phys, double mass, int class, int type, double geom_off, double geom_radius, double geom_length)
 {
     struct model3d *m = e->txmodel->model;
 
@@ -1481,7 +3607,9 @@ void entity3d_position(struct entity3d *e, float x, float y, float z)
     e->dx = x;
     e->dy = y;
     e->dz = z;
+    entity3d_dirty(e);
     if (e->phys_body) {
+        phys_body_wake(e->phys_body);
         dBodySetPosition(e->phys_body->body, e->dx, e->dy + e->phys_body->yoffset, e->dz);
         // dBodySetLinearVel(e->phys_body->body, 0, 0, 0);
         // dBodySetAngularVel(e->phys_body->body, 0, 0, 0);
@@ -1494,9 +3622,27 @@ void entity3d_move(struct entity3d *e, float dx, float dy, float dz)
     entity3d_position(e, e->dx + dx, e->dy + dy, e->dz + dz);
 }
 
+/*
+ * Into the spatial index of its model's mq, if it has one, with the aabb
+ * it has now; entity3d_aabb_update() moves it from there
+ */
+static void entity3d_bvh_join(struct entity3d *e)
+{
+    struct mq *mq = e->txmodel->mq;
+
+    if (e->bvh || !mq || !mq->spatial)
+        return;
+
+    e->bvh_node = bvh_insert(&mq->bvh, e->aabb, e);
+    if (e->bvh_node >= 0)
+        e->bvh = &mq->bvh;
+}
+
 void model3dtx_add_entity(struct model3dtx *txm, struct entity3d *e)
 {
     list_append(&txm->entities, &e->entry);
+    /* instantiated ones are already committed, they won't be dirty again */
+    entity3d_bvh_join(e);
 }
 
 struct entity3d *instantiate_entity(struct model3dtx *txm, struct instantiator *instor,
@@ -1508,9 +3654,9 @@ struct entity3d *instantiate_entity(struct model3dtx *txm, struct instantiator *
     e->dy = instor->dy;
     e->dz = instor->dz;
     if (randomize_yrot)
-        e->ry = drand48() * 360;
+        e->ry = erand48(e->rand48) * 360;
     if (randomize_scale)
-        e->scale = 1 + randomize_scale * (1 - drand48() * 2);
+        e->scale = 1 + randomize_scale * (1 - erand48(e->rand48) * 2);
     default_update(e, scene);
     e->update = default_update;
     e->visible = 1;
@@ -1518,6 +3664,306 @@ struct entity3d *instantiate_entity(struct model3dtx *txm, struct instantiator *
     return e;
 }
 
+struct batch_item {
+    int             x;
+    int             z;
+    struct entity3d *e;
+};
+
+static int batch_item_cmp(const void *a, const void *b)
+{
+    const struct batch_item *ia = a, *ib = b;
+
+    if (ia->x != ib->x)
+        return ia->x < ib->x ? -1 : 1;
+    if (ia->z != ib->z)
+        return ia->z < ib->z ? -1 : 1;
+    return 0;
+}
+
+/* bodies move, collision geoms don't */
+static bool entity3d_is_static(struct entity3d *e)
+{
+    return e->visible && e->update == default_update && !entity_animated(e) &&
+           (!e->phys_body || !phys_body_has_body(e->phys_body));
+}
+
+static int model3dtx_batch(struct model3dtx *txm, struct mesh *mesh, struct batch_item *items,
+                           size_t nr)
+{
+    static const int attrs[] = { MESH_VX, MESH_TX, MESH_NORM, MESH_TANGENTS };
+    struct model3d *model = txm->model, *m;
+    struct model3dtx *btxm;
+    struct entity3d *e;
+    struct mesh *me;
+    size_t i;
+
+    me = mesh_new(model->name);
+    for (i = 0; i < array_size(attrs); i++)
+        if (mesh_nr(mesh, attrs[i]))
+            mesh_attr_alloc(me, attrs[i], mesh_stride(mesh, attrs[i]), mesh_nr(mesh, attrs[i]) * nr);
+    mesh_attr_alloc(me, MESH_IDX,
+                    mesh_nr_vx(mesh) * nr > USHRT_MAX ? sizeof(unsigned int) : sizeof(unsigned short),
+                    mesh_nr_idx(mesh) * nr);
+
+    for (i = 0; i < nr; i++)
+        mesh_push_mesh_mx(me, mesh, items[i].e->mx->m);
+
+    m = model3d_new_from_mesh(model->name, model->prog, me);
+    ref_put(me);
+    if (!m)
+        return -ENOMEM;
+
+    m->cull_face = model->cull_face;
+    m->alpha_blend = model->alpha_blend;
+
+    btxm = ref_new(model3dtx);
+    if (!btxm) {
+        ref_put(m);
+        return -ENOMEM;
+    }
+
+    btxm->model     = m;
+    btxm->texture   = txm->texture;
+    btxm->normals   = txm->normals;
+    btxm->heights   = txm->heights;
+    btxm->metallic  = txm->metallic;
+    btxm->roughness = txm->roughness;
+    btxm->tex_owner = ref_get(txm);
+    /* in front of @txm, so that mq_release() gets to them first */
+    mq_add_model_tail(txm->mq, btxm);
+
+    /* the vertices are in the world space already */
+    e = entity3d_new(btxm);
+    if (!e)
+        return -ENOMEM;
+
+    e->scale = 1.0;
+    e->visible = 1;
+    model3dtx_add_entity(btxm, e);
+
+    for (i = 0; i < nr; i++) {
+        if (items[i].e->phys_body)
+            items[i].e->visible = 0;
+        else
+            ref_put(items[i].e);
+    }
+
+    return 0;
+}
+
+int model3dtx_batch_static(struct model3dtx *txm, struct mesh *mesh, float cell)
+{
+    struct batch_item *items;
+    struct entity3d *e;
+    size_t nr = 0, i, j;
+    int ret, nr_batches = 0;
+
+    if (cell <= 0 || !txm->mq || model3d_is_skinned(txm->model) || !mesh_nr_idx(mesh))
+        return -EINVAL;
+
+    /* one entity per batch, of one layer */
+    if (txm->model->prog->data.tex_layer >= 0)
+        return -EINVAL;
+
+    list_for_each_entry(e, &txm->entities, entry)
+        nr++;
+
+    items = calloc(nr, sizeof(*items));
+    if (!items)
+        return -ENOMEM;
+
+    nr = 0;
+    list_for_each_entry(e, &txm->entities, entry) {
+        if (!entity3d_is_static(e))
+            continue;
+
+        /* the entities of this frame don't have their matrices yet */
+        if (e->xform_dirty)
+            entity3d_commit(e);
+        items[nr].x = floorf(e->dx / cell);
+        items[nr].z = floorf(e->dz / cell);
+        items[nr++].e = e;
+    }
+
+    qsort(items, nr, sizeof(*items), batch_item_cmp);
+    for (i = 0; i < nr; i = j) {
+        for (j = i + 1; j < nr && !batch_item_cmp(&items[i], &items[j]); j++)
+            ;
+
+        /* one on its own is as good as it gets */
+        if (j - i < 2)
+            continue;
+
+        ret = model3dtx_batch(txm, mesh, items + i, j - i);
+        if (ret) {
+            free(items);
+            return ret;
+        }
+        nr_batches++;
+    }
+
+    dbg("'%s': %zu static entities in %d batches\n", txmodel_name(txm), nr, nr_batches);
+    free(items);
+
+    return nr_batches;
+}
+
+int model3d_texture_layers(struct mq *mq, struct model3d *m, struct shader_prog *prog)
+{
+    struct model3dtx *txm, *ltxm, **txms = NULL;
+    texture_t **texs = NULL, **norms = NULL, *tex = NULL, *norm = NULL;
+    struct entity3d *e, *it;
+    unsigned int nr = 0, nr_ents = 0, i;
+    bool normals = true;
+    int ret = -EINVAL;
+
+    if (prog->data.tex_layer < 0 || prog->instance_layer < 0 ||
+        model3d_is_skinned(m) || m->skin_prog)
+        return -EINVAL;
+
+    list_for_each_entry(txm, &mq->txmodels, entry) {
+        /* the batches borrow their owners' textures */
+        if (txm->tex_owner && txm->tex_owner->model == m)
+            return -EINVAL;
+        if (txm->model != m)
+            continue;
+        if (txm->tex_owner)
+            return -EINVAL;
+
+        if (!texture_ready(txm->texture) ||
+            (txm->normals && texture_loaded(txm->normals) && !texture_ready(txm->normals)))
+            return -EAGAIN;
+
+        normals = normals && txm->normals && texture_loaded(txm->normals);
+        list_for_each_entry(e, &txm->entities, entry)
+            nr_ents++;
+        nr++;
+    }
+
+    if (nr < 2 || !nr_ents)
+        return -EINVAL;
+
+    txms = calloc(nr, sizeof(*txms));
+    texs = calloc(nr, sizeof(*texs));
+    norms = calloc(nr, sizeof(*norms));
+    if (!txms || !texs || !norms) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    i = 0;
+    list_for_each_entry(txm, &mq->txmodels, entry)
+        if (txm->model == m) {
+            txms[i] = txm;
+            texs[i] = txm->texture;
+            norms[i++] = txm->normals;
+        }
+
+    /* NULL if they're not of the same size or format, or compressed */
+    tex = texture_array_new(GL_TEXTURE0, texs, nr);
+    if (normals)
+        norm = texture_array_new(GL_TEXTURE1, norms, nr);
+    ltxm = tex && (norm || !normals) ? ref_new(model3dtx) : NULL;
+    if (!ltxm) {
+        texture_done(tex);
+        texture_done(norm);
+        goto out;
+    }
+
+    model3dtx_set_model(ltxm, m);
+    ltxm->texture     = tex;
+    ltxm->normals     = norm;
+    ltxm->external_tex = true;
+    ltxm->metallic    = txms[0]->metallic;
+    ltxm->roughness   = txms[0]->roughness;
+    mq_add_model(mq, ltxm);
+
+    /* each txmodel goes with the last of its entities */
+    for (i = 0; i < nr; i++) {
+        txm = ref_get(txms[i]);
+        list_for_each_entry_iter(e, it, &txm->entities, entry) {
+            list_del(&e->entry);
+            model3dtx_add_entity(ltxm, e);
+            e->txmodel = ref_get(ltxm);
+            e->tex_layer = i;
+            ref_put(txm);
+        }
+        ref_put(txm);
+    }
+
+    ref_put(m->prog);
+    m->prog = ref_get(prog);
+    dbg("'%s': %u textures in one array, %u entities\n", m->name, nr, nr_ents);
+    ret = 0;
+
+out:
+    free(txms);
+    free(texs);
+    free(norms);
+
+    return ret;
+}
+
+struct model3d *mq_model_by_mesh(struct mq *mq, uint64_t hash, struct shader_prog *prog)
+{
+    struct model3dtx *txm;
+
+    if (!hash)
+        return NULL;
+
+    list_for_each_entry(txm, &mq->txmodels, entry)
+        if (txm->model->mesh_hash == hash && txm->model->prog == prog &&
+            !txm->model->skin_prog && !model3d_is_skinned(txm->model))
+            return txm->model;
+
+    return NULL;
+}
+
+int mq_texture_layers(struct mq *mq, struct shader_prog *progs)
+{
+    struct shader_prog *prog;
+    struct model3dtx *txm;
+    struct model3d **m;
+    darray(struct model3d *, models);
+    int ret = 0, err;
+
+    /* each model once, by its first txmodel; the merges reshuffle the list */
+    darray_init(&models);
+    list_for_each_entry(txm, &mq->txmodels, entry) {
+        struct model3d *model = txm->model;
+
+        if (txm->tex_owner || model->txmodels.next == model->txmodels.prev ||
+            &txm->model_entry != model->txmodels.next)
+            continue;
+
+        m = darray_add(&models.da);
+        if (!m) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        *m = ref_get(model);
+    }
+
+    darray_for_each(m, &models) {
+        prog = shader_prog_find_variant(progs, "model", (*m)->prog->features | SHADER_LAYERS);
+        if (!prog)
+            continue;
+
+        err = model3d_texture_layers(mq, *m, prog);
+        ref_put(prog);
+        if (err == -EAGAIN)
+            ret = -EAGAIN;
+    }
+
+out:
+    darray_for_each(m, &models)
+        ref_put(*m);
+    darray_clearout(&models.da);
+
+    return ret;
+}
+
 void create_entities(struct model3dtx *txmodel)
 {
     long i;
@@ -1555,75 +4001,186 @@ void create_entities(struct model3dtx *txmodel)
     }
 }
 
-static void debug_draw_drop(struct ref *ref)
+static const float debug_red[] = { 1.0, 0.0, 0.0, 1.0 };
+
+static void debug_draw_vertex(struct scene *scene, const float *pos, const float *color)
 {
-    struct debug_draw *dd = container_of(ref, struct debug_draw, ref);
+    struct debug_vertex *v = darray_add(&scene->debug_vx.da);
 
-    ref_put(dd->entity);
+    if (!v)
+        return;
+
+    memcpy(v->pos, pos, sizeof(v->pos));
+    memcpy(v->color, color ? color : debug_red, sizeof(v->color));
 }
-DECLARE_REFCLASS(debug_draw);
 
-struct debug_draw *__debug_draw_new(struct scene *scene, float *vx, size_t vxsz,
-                                    unsigned short *idx, size_t idxsz, float *tx, mat4x4 *rot)
+static void debug_draw_segment(struct scene *scene, const float *a, const float *b,
+                               const float *color)
 {
-    struct shader_prog *p;
-    struct debug_draw *dd;
-    struct model3dtx *txm;
-    struct model3d *m;
+    debug_draw_vertex(scene, a, color);
+    debug_draw_vertex(scene, b, color);
+}
 
-    p = shader_prog_find(scene->prog, "debug");
-    CHECK(dd = ref_new(debug_draw));
-    CHECK(m = model3d_new_from_vectors("debug", p, vx, vxsz, idx, idxsz, tx, vxsz / 3 * 2, NULL, 0));
-    m->debug = true;
-    m->draw_type = GL_LINES;
-    ref_put(p);
+void debug_draw_line(struct scene *scene, vec3 a, vec3 b, mat4x4 *rot)
+{
+    vec4 va = { a[0], a[1], a[2], 1.0 }, vb = { b[0], b[1], b[2], 1.0 }, wa, wb;
 
-    CHECK(txm = ref_new(model3dtx));
-    txm->model = m;
-    list_init(&txm->entities);
-    mq_add_model(&scene->mq, txm);
-    CHECK(dd->entity = entity3d_new(txm));
-    model3dtx_add_entity(txm, dd->entity);
-    dd->entity->visible = 1;
-    dd->entity->update = NULL;
-    dd->entity->color_pt = COLOR_PT_ALL;
-    dd->entity->color[0] = 1.0;
-    dd->entity->color[3] = 1.0;
-    if (rot)
-        memcpy(dd->entity->mx->m, rot, sizeof(mat4x4));
-    else
-        mat4x4_identity(dd->entity->mx->m);
-    list_append(&scene->debug_draws, &dd->entry);
+    if (!scene->debug_draws_enabled)
+        return;
+
+    if (!rot) {
+        debug_draw_segment(scene, a, b, NULL);
+        return;
+    }
 
-    return dd;
+    mat4x4_mul_vec4(wa, *rot, va);
+    mat4x4_mul_vec4(wb, *rot, vb);
+    debug_draw_segment(scene, wa, wb, NULL);
 }
 
-struct debug_draw *__debug_draw_line(struct scene *scene, vec3 a, vec3 b, mat4x4 *rot)
+void debug_draw_aabb(struct scene *scene, const float *aabb, const float *color)
 {
-    float vx[] = { a[0], a[1], a[2], b[0], b[1], b[2] };
-    unsigned short idx[] = { 0, 1 };
-    return __debug_draw_new(scene, vx, sizeof(vx), idx, sizeof(idx), NULL, rot);
+    float c[8][3];
+    int i, j;
+
+    if (!scene->debug_draws_enabled)
+        return;
+
+    /* bit 0 picks x max, bit 1 y max, bit 2 z max */
+    for (i = 0; i < 8; i++)
+        for (j = 0; j < 3; j++)
+            c[i][j] = aabb[j * 2 + !!(i & (1 << j))];
+
+    /* the edges join the corners that differ in one bit */
+    for (i = 0; i < 8; i++)
+        for (j = 0; j < 3; j++)
+            if (!(i & (1 << j)))
+                debug_draw_segment(scene, c[i], c[i | (1 << j)], color);
 }
 
-void debug_draw_line(struct scene *scene, vec3 a, vec3 b, mat4x4 *rot)
+#define DEBUG_SPHERE_SEGMENTS 16
+
+void debug_draw_sphere(struct scene *scene, vec3 center, float radius, const float *color)
 {
-    if (scene->debug_draws_enabled)
-        (void)__debug_draw_line(scene, a, b, rot);
+    float prev[3], cur[3], a, ca, sa;
+    int axis, i;
+
+    if (!scene->debug_draws_enabled)
+        return;
+
+    /* a circle around each axis */
+    for (axis = 0; axis < 3; axis++) {
+        for (i = 0; i <= DEBUG_SPHERE_SEGMENTS; i++) {
+            a = 2 * M_PI * i / DEBUG_SPHERE_SEGMENTS;
+            ca = radius * cosf(a);
+            sa = radius * sinf(a);
+            cur[axis] = center[axis];
+            cur[(axis + 1) % 3] = center[(axis + 1) % 3] + ca;
+            cur[(axis + 2) % 3] = center[(axis + 2) % 3] + sa;
+            if (i)
+                debug_draw_segment(scene, prev, cur, color);
+            memcpy(prev, cur, sizeof(prev));
+        }
+    }
 }
 
-void debug_draw_clearout(struct scene *scene)
+void debug_draws_render(struct scene *scene, struct camera *camera, struct matrix4f *proj_mx)
 {
-    while (!list_empty(&scene->debug_draws)) {
-        struct debug_draw *dd = list_first_entry(&scene->debug_draws, struct debug_draw, entry);
+    size_t nr = scene->debug_vx.da.nr_el;
+    size_t stride = sizeof(struct debug_vertex);
+    struct shader_prog *p;
+    ssize_t off;
+    GLuint obj;
+
+    if (!nr || !camera || !proj_mx)
+        return;
+
+    p = shader_prog_find(scene->prog, "debug");
+    if (!p)
+        return;
 
-        list_del(&dd->entry);
-        ref_put(dd);
+    if (p->batch_color < 0)
+        goto out;
+
+    /* before the vertices: it binds the stream buffer, maybe a new one */
+    frame_upload(NULL, camera->view_mx, camera->inv_view_mx, proj_mx, 0, 0);
+    if (gl_does_vao()) {
+        if (!scene->debug_vao)
+            GL(glGenVertexArrays(1, &scene->debug_vao));
+        render_bind_vao(scene->debug_vao);
     }
+
+    /* binds @obj */
+    off = render_stream_write(scene->debug_vx.x, nr * stride, &obj);
+    if (off < 0)
+        goto out;
+
+    shader_prog_use(p);
+    render_depth_test(false);
+    render_cull_face(false);
+    render_blend(false);
+    if (p->data.viewmx >= 0)
+        UNIFORM(glUniformMatrix4fv(p->data.viewmx, 1, GL_FALSE, camera->view_mx->cell));
+    if (p->data.projmx >= 0)
+        UNIFORM(glUniformMatrix4fv(p->data.projmx, 1, GL_FALSE, proj_mx->cell));
+
+    GL(glVertexAttribPointer(p->pos, 3, GL_FLOAT, GL_FALSE, stride,
+                             (void *)(off + offsetof(struct debug_vertex, pos))));
+    GL(glEnableVertexAttribArray(p->pos));
+    GL(glVertexAttribPointer(p->batch_color, 4, GL_FLOAT, GL_FALSE, stride,
+                             (void *)(off + offsetof(struct debug_vertex, color))));
+    GL(glEnableVertexAttribArray(p->batch_color));
+
+    GL(glDrawArrays(GL_LINES, 0, nr));
+    render_stats_draw(nr, 1, 0);
+
+    GL(glDisableVertexAttribArray(p->pos));
+    GL(glDisableVertexAttribArray(p->batch_color));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    shader_prog_done(p);
+
+out:
+    if (gl_does_vao())
+        render_bind_vao(0);
+    ref_put(p);
 }
 
+void debug_draw_clearout(struct scene *scene)
+{
+    /* keeps the allocation for the next frame */
+    darray_resize(&scene->debug_vx.da, 0);
+}
+
+static const struct ani_lod ani_lods_default[ANI_LOD_MAX] = {
+    { .px = 150, .rate = 2 },
+    { .px = 75,  .rate = 4 },
+    { .px = 30,  .rate = 8 },
+};
+
 void mq_init(struct mq *mq, void *priv)
 {
+    int i;
+
     list_init(&mq->txmodels);
+    darray_init(&mq->draw_list);
+    darray_init(&mq->draw_tmp);
+    bvh_init(&mq->bvh, 1.0);
+    mq->spatial = false;
+    darray_init(&mq->joints);
+    darray_init(&mq->update_models);
+    darray_init(&mq->batch);
+    mq->batch_obj = mq->batch_vao = 0;
+    for (i = 0; i < LOD_MAX; i++)
+        darray_init(&mq->lod_ents[i]);
+    memset(&mq->joint_tex, 0, sizeof(mq->joint_tex));
+    mq->frustum_seq = 0;
+    memcpy(mq->ani_lods, ani_lods_default, sizeof(mq->ani_lods));
+    mq->ani_culled_rate = ANI_CULLED_RATE;
+    mq->occlusion_prog = NULL;
+    mq->occlusion_frame = 0;
+    darray_init(&mq->occlusion_ents);
+    darray_init(&mq->occlusion_boxes);
+    mq->occlusion_vao = 0;
     mq->priv = priv;
 }
 
@@ -1631,6 +4188,7 @@ void mq_release(struct mq *mq)
 {
     struct model3dtx *txmodel;
     struct entity3d *ent;
+    int i;
 
     while (!list_empty(&mq->txmodels)) {
         bool done = false;
@@ -1653,6 +4211,27 @@ void mq_release(struct mq *mq)
                 ref_put(ent);
         } while (!done);
     }
+
+    darray_clearout(&mq->draw_list.da);
+    darray_clearout(&mq->draw_tmp.da);
+    darray_clearout(&mq->joints.da);
+    darray_clearout(&mq->update_models.da);
+    darray_clearout(&mq->batch.da);
+    for (i = 0; i < LOD_MAX; i++)
+        darray_clearout(&mq->lod_ents[i].da);
+    if (mq->batch_vao)
+        render_delete_vao(mq->batch_vao);
+    mq->batch_obj = mq->batch_vao = 0;
+    darray_clearout(&mq->occlusion_ents.da);
+    darray_clearout(&mq->occlusion_boxes.da);
+    if (mq->occlusion_vao)
+        render_delete_vao(mq->occlusion_vao);
+    mq->occlusion_vao = 0;
+    if (mq->occlusion_prog)
+        ref_put(mq->occlusion_prog);
+    mq->occlusion_prog = NULL;
+    texture_deinit(&mq->joint_tex);
+    bvh_done(&mq->bvh);
 }
 
 void mq_for_each(struct mq *mq, void (*cb)(struct entity3d *, void *), void *data)
@@ -1667,9 +4246,162 @@ void mq_for_each(struct mq *mq, void (*cb)(struct entity3d *, void *), void *dat
     }
 }
 
+struct mq_query {
+    const float     *center;
+    float           r2;
+    unsigned long   tags;
+    void            (*cb)(struct entity3d *, void *);
+    void            *data;
+};
+
+static float entity3d_query_dist(void *data, const float *point, void *priv)
+{
+    struct entity3d *e = data;
+    unsigned long *tags = priv;
+    float dx = e->dx - point[0], dy = e->dy - point[1], dz = e->dz - point[2];
+
+    if (!(e->txmodel->model->tags & *tags))
+        return -1;
+
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static void mq_query_radius_cb(void *data, bool inside, void *priv)
+{
+    struct mq_query *q = priv;
+    float d = entity3d_query_dist(data, q->center, &q->tags);
+
+    if (d >= 0 && d <= q->r2)
+        q->cb(data, q->data);
+}
+
+void mq_query_radius(struct mq *mq, const vec3 center, float radius, unsigned long tags,
+                     void (*cb)(struct entity3d *, void *), void *data)
+{
+    struct mq_query q = {
+        .center = center,
+        .r2     = radius * radius,
+        .tags   = tags,
+        .cb     = cb,
+        .data   = data,
+    };
+
+    if (mq->spatial)
+        bvh_query_sphere(&mq->bvh, center, radius, mq_query_radius_cb, &q);
+}
+
+unsigned int mq_query_nearest(struct mq *mq, const vec3 center, float radius, unsigned long tags,
+                              struct bvh_hit *hits, unsigned int nr)
+{
+    if (!mq->spatial)
+        return 0;
+
+    return bvh_nearest(&mq->bvh, center, radius, entity3d_query_dist, &tags, hits, nr);
+}
+
+/*
+ * default_update() only touches its entity and its model's pose cache, so
+ * it can run on the workers; anything else (physics, messages, UI) may
+ * have side effects and stays on the main thread.
+ */
+static bool entity3d_update_is_pure(struct entity3d *e)
+{
+    return e->update == default_update;
+}
+
+/* one job per model, so that its pose cache is only used by one thread */
+static void mq_update_model(unsigned int idx, void *priv)
+{
+    struct mq *mq = priv;
+    struct model3d *model = mq->update_models.x[idx];
+    struct model3dtx *txmodel;
+    struct entity3d *ent;
+
+    list_for_each_entry(txmodel, &model->txmodels, model_entry) {
+        if (txmodel->mq != mq)
+            continue;
+
+        list_for_each_entry(ent, &txmodel->entities, entry)
+            if (entity3d_update_is_pure(ent))
+                entity3d_update(ent, mq->priv);
+    }
+}
+
+static void mq_update_models_collect(struct mq *mq)
+{
+    struct model3dtx *txmodel;
+    struct model3d **pmodel;
+
+    darray_resize(&mq->update_models.da, 0);
+    list_for_each_entry(txmodel, &mq->txmodels, entry) {
+        model3d_anis_poll(txmodel->model, false);
+        /* the rest only needs updating when it moves, see mq_update_dirty() */
+        if (list_empty(&txmodel->entities) || !txmodel->model->anis.da.nr_el)
+            continue;
+
+        darray_for_each(pmodel, &mq->update_models)
+            if (*pmodel == txmodel->model)
+                break;
+
+        if (pmodel != &mq->update_models.x[mq->update_models.da.nr_el])
+            continue;
+
+        pmodel = darray_add(&mq->update_models.da);
+        if (pmodel)
+            *pmodel = txmodel->model;
+    }
+}
+
+/*
+ * New and moved entities of this mq: new ones join the spatial index,
+ * after that entity3d_aabb_update() keeps them up to date. Those that
+ * don't use default_update() keep their flag, in case their update
+ * chains to it (characters); their entries go, either way.
+ */
+static void mq_update_dirty(struct mq *mq)
+{
+    struct entity3d *ent, *itent;
+
+    list_for_each_entry_iter(ent, itent, &dirty_entities, dirty_entry) {
+        if (ent->txmodel->mq != mq)
+            continue;
+
+        entity3d_bvh_join(ent);
+        if (entity3d_update_is_pure(ent))
+            entity3d_commit(ent);
+        else
+            list_del(&ent->dirty_entry);
+    }
+}
+
 void mq_update(struct mq *mq)
 {
-    mq_for_each(mq, entity3d_update, mq->priv);
+    struct model3dtx *txmodel;
+    struct entity3d *ent, *itent;
+
+    refresh_rate = gl_refresh_rate();
+
+    /* static entities cost nothing here */
+    mq_update_dirty(mq);
+
+    /* animated models only, nothing on the workers marks entities dirty */
+    mq_update_models_collect(mq);
+    mq_update_parallel = true;
+    jobs_parallel_for(mq->update_models.da.nr_el, mq_update_model, mq);
+    mq_update_parallel = false;
+
+    /* the rest may add or drop entities */
+    list_for_each_entry(txmodel, &mq->txmodels, entry) {
+        list_for_each_entry_iter(ent, itent, &txmodel->entities, entry) {
+            if (ent->bvh_dirty) {
+                bvh_move(ent->bvh, ent->bvh_node, ent->aabb);
+                ent->bvh_dirty = false;
+            }
+
+            if (!entity3d_update_is_pure(ent))
+                entity3d_update(ent, mq->priv);
+        }
+    }
 }
 
 struct model3dtx *mq_model_first(struct mq *mq)
@@ -1682,16 +4414,29 @@ struct model3dtx *mq_model_last(struct mq *mq)
     return list_last_entry(&mq->txmodels, struct model3dtx, entry);
 }
 
+/* the entities that were added before their model joined the mq */
+static void mq_model_entities_join(struct model3dtx *txmodel)
+{
+    struct entity3d *e;
+
+    list_for_each_entry(e, &txmodel->entities, entry)
+        entity3d_bvh_join(e);
+}
+
 void mq_add_model(struct mq *mq, struct model3dtx *txmodel)
 {
     txmodel = ref_pass(txmodel);
+    txmodel->mq = mq;
     list_append(&mq->txmodels, &txmodel->entry);
+    mq_model_entities_join(txmodel);
 }
 
 void mq_add_model_tail(struct mq *mq, struct model3dtx *txmodel)
 {
     txmodel = ref_pass(txmodel);
+    txmodel->mq = mq;
     list_prepend(&mq->txmodels, &txmodel->entry);
+    mq_model_entities_join(txmodel);
 }
 
 struct model3dtx *mq_nonempty_txm_next(struct mq *mq, struct model3dtx *txm, bool fwd)
@@ -12,6 +12,7 @@
 #include "matrix.h"
 #include "mesh.h"
 #include "render.h"
+#include "bvh.h"
 
 struct scene;
 struct camera;
@@ -25,7 +26,6 @@ struct light {
 struct model_joint {
     darray(int, children);
     char        *name;
-    mat4x4      invmx;
     int         id;
 };
 
@@ -36,21 +36,23 @@ enum chan_path {
     PATH_NONE,
 };
 
+/* an entity's key cursors into its animation's channels, per joint */
 struct joint {
-    vec3    translation;
-    quat    rotation;
-    vec3    scale;
-    mat4x4  global;
     int     off[PATH_NONE];
 };
 
 struct channel {
     float           *time;
-    float           *data;
+    /* floats, or 3 uint16_t per key if @packed, see animation_compress() */
+    void            *data;
+    /* key interval if the keys are evenly spaced, 0 otherwise */
+    float           dt;
     unsigned int    nr;
     unsigned int    stride;
     unsigned int    target;
     unsigned int    path;
+    /* rotations in the smallest three form */
+    bool            packed;
 };
 
 struct animation {
@@ -66,16 +68,72 @@ struct animation {
 struct animation *animation_new(struct model3d *model, const char *name, unsigned int nr_channels);
 void animation_add_channel(struct animation *an, size_t frames, float *time, float *data,
                            size_t data_stride, unsigned int target, unsigned int path);
+/* keys per second for channels with unevenly spaced keys */
+#define ANIMATION_RESAMPLE_RATE 60
+int animation_resample(struct animation *an, float rate);
+/* largest error of the keys dropped by animation_compress() */
+#define ANIMATION_KEY_ERROR 1e-4f
+int animation_compress(struct animation *an, float error);
 void animation_start(struct entity3d *e, unsigned long start_frame, int ani);
 void animation_push_by_name(struct entity3d *e, struct scene *s, const char *name,
                             bool clear, bool repeat);
 int animation_by_name(struct model3d *m, const char *name);
 
-#define LOD_MAX 4
+/*
+ * Animations that take a while to build, like glTF's: @build runs on a
+ * job, making them with model3d_anis_new() and animation_add_channel(),
+ * and they're attached to the model once mq_update() finds the job done,
+ * or as soon as animation_by_name() or animation_push_by_name() want them.
+ * Until then, the model isn't animated. @release(@data) is called on the
+ * main thread once @build is done with @data.
+ */
+struct model3d_anis;
+typedef void (*model3d_anis_fn)(struct model3d_anis *pending, void *data);
+int model3d_add_animations(struct model3d *m, model3d_anis_fn build, void (*release)(void *data),
+                           void *data);
+struct animation *model3d_anis_new(struct model3d_anis *pending, const char *name,
+                                   unsigned int nr_channels);
+
+/* per-instance attributes for instanced draws, see models_render() */
+struct model_instance {
+    mat4x4  mx;
+    float   joint_off;
+    float   layer;
+};
+
+/* pre-transformed vertex of the batched draws, see models_render() */
+struct batch_vertex {
+    GLfloat pos[3];
+    GLfloat tx[2];
+    GLfloat color[4];
+    GLfloat color_pt;
+};
+
+/*
+ * A pose evaluated this frame, shared by the entities at the same point of
+ * an animation: the joint transforms and the sampled joints they came from
+ */
+struct pose_cache {
+    int             animation;
+    long            frame;
+    unsigned long   frames_total;
+    mat4x4          *joint_transforms;
+    vec3            *translation;
+    quat            *rotation;
+    vec3            *scale;
+};
+
+#define POSE_CACHE_MAX 8
+#define LOD_MAX 8
+
+struct model3d_lods;
+
 struct model3d {
     char                *name;
     struct ref          ref;
     struct shader_prog  *prog;
+    /* takes over from prog once the animations are in, see model3d_anis_poll() */
+    struct shader_prog  *skin_prog;
     bool                cull_face;
     bool                alpha_blend;
     bool                debug;
@@ -84,27 +142,78 @@ struct model3d {
     unsigned int        root_joint;
     unsigned int        nr_lods;
     int                 cur_lod;
+    /* simplification error of each LOD, relative to the model's extents */
+    float               lod_error[LOD_MAX];
+    /* LODs in the making, until model3d_lods_poll() picks them up */
+    struct model3d_lods *lods;
+    /* animations in the making, see model3d_add_animations() */
+    struct model3d_anis *pending_anis;
     float               aabb[6];
+    /* what its entities are to the game, see mq_query_radius() */
+    unsigned long       tags;
+    /* links model3dtx::model_entry */
+    struct list         txmodels;
+    /* mesh_hash() of what it's made of, for the loads of the same mesh to share */
+    uint64_t            mesh_hash;
     darray(struct animation, anis);
     mat4x4              root_pose;
     GLuint              vao;
+    /* each buffer's size is what load_gl_buffer() accounted for it */
     GLuint              vertex_obj;
-    GLuint              index_obj[LOD_MAX];
+    size_t              vertex_size;
+    /* all the LODs' indices, see model3d_lod_append() */
+    GLuint              index_obj;
+    size_t              index_size;
+    size_t              index_off[LOD_MAX];
     GLuint              tex_obj;
+    size_t              tex_size;
     GLuint              norm_obj;
+    size_t              norm_size;
     GLuint              tangent_obj;
+    size_t              tangent_size;
     GLuint              joints_obj;
+    size_t              joints_size;
     GLuint              weights_obj;
+    size_t              weights_size;
+    /* MESH_*_BIT of what's interleaved in vertex_obj, see struct packed_vertex */
+    unsigned int        packed;
+    /* undo the position quantization: pos_scale * vx + pos_offset */
+    float               pos_scale[3];
+    float               pos_offset[3];
     GLuint              nr_vertices;
     GLuint              nr_faces[LOD_MAX];
+    /* GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, the same for all LODs */
+    GLenum              idx_type;
+    /* instanced entities' data, bucketed by LOD, rebuilt every frame */
+    darray(struct model_instance, instances[LOD_MAX]);
     struct model_joint  *joints;
+    /* inverse bind matrices, by joint */
+    mat4x4              *joint_invmx;
+    /* joints in the evaluation order: parents before children */
+    int                 *joint_order;
+    int                 *joint_parent;
+    unsigned int        nr_joint_order;
+    struct pose_cache   poses[POSE_CACHE_MAX];
+    unsigned int        pose_next;
     /* Collision mesh, if needed */
     float               *collision_vx;
     size_t              collision_vxsz;
-    unsigned short      *collision_idx;
+    /* u16, unless @collision_idx_stride says otherwise */
+    void                *collision_idx;
     size_t              collision_idxsz;
+    unsigned int        collision_idx_stride;
+    /* ODE's version of the above, see phys_geom_trimesh_new() */
+    struct phys_trimesh *trimesh;
+    /* CPU copy of small models for the batched draws, see model3d_keep_vectors() */
+    GLfloat             *batch_vx;
+    GLfloat             *batch_tx;
+    GLushort            *batch_idx;
+    unsigned int        nr_batch_idx;
 };
 
+/* terrain.vert's heights, see terrain_set_vtf() */
+#define HEIGHT_MAP_TEX_UNIT 3
+
 struct model3dtx {
     struct model3d *model;
     // GLuint         texture_id;
@@ -112,19 +221,32 @@ struct model3dtx {
     texture_t      _normals;
     texture_t      *texture;
     texture_t      *normals;
+    /* not theirs, the owner keeps it */
+    texture_t      *heights;
     // GLuint         normals_id;
     float          metallic;
     float          roughness;
     bool           external_tex;
+    /* the textures are this one's, see model3dtx_batch_static() */
+    struct model3dtx *tex_owner;
     struct ref     ref;
     struct list    entry;              /* link to scene/ui->txmodels */
     struct list    entities;           /* links entity3d->entry */
+    struct list    model_entry;        /* link to model->txmodels */
+    /* the one it was added to, see mq_add_model() */
+    struct mq      *mq;
+    /* this frame's range of mq's batch, see models_render() */
+    size_t         batch_first;
+    size_t         nr_batch;
 };
 
 struct model3d *model3d_new_from_vectors(const char *name, struct shader_prog *p, GLfloat *vx, size_t vxsz,
                                          GLushort *idx, size_t idxsz, GLfloat *tx, size_t txsz, GLfloat *norm,
                                          size_t normsz);
 struct model3d *model3d_new_from_mesh(const char *name, struct shader_prog *p, struct mesh *mesh);
+void model3d_update_vectors(struct model3d *m, GLfloat *vx, GLfloat *tx, unsigned int first,
+                            unsigned int nr, unsigned int nr_idx);
+int model3d_add_lod(struct model3d *m, GLushort *idx, size_t idxsz, float error);
 struct model3d *model3d_new_from_model_data(const char *name, struct shader_prog *p, struct model_data *md);
 void model3d_add_tangents(struct model3d *m, float *tg, size_t tgsz);
 int model3d_add_skinning(struct model3d *m, unsigned char *joints, size_t jointssz,
@@ -139,6 +261,44 @@ struct model3dtx *model3dtx_new_from_buffer(struct model3d *model, void *buffer,
 struct model3dtx *model3dtx_new_from_buffers(struct model3d *model, void *tex, size_t texsz, void *norm, size_t normsz);
 struct model3dtx *model3dtx_new_txid(struct model3d *model, unsigned int txid);
 struct model3dtx *model3dtx_new_texture(struct model3d *model, texture_t *tex);
+/*
+ * Static batching: the entities of @txm that never move on their own (no
+ * physics bodies, no animations, no updates of their own) become one entity
+ * per @cell by @cell square of the XZ plane, of a model made of @mesh as
+ * each of them would draw it, with @txm's textures: one draw, one AABB and
+ * one set of LODs for the lot. @mesh is @txm's geometry, which models don't
+ * keep around. Those with collision geoms stay in @txm, hidden, for the
+ * physics and the spatial queries, the rest go. Returns the number of batches
+ * or a negative error.
+ */
+int model3dtx_batch_static(struct model3dtx *txm, struct mesh *mesh, float cell);
+/*
+ * Texture arrays: the txmodels of @m in @mq that only differ in their
+ * textures become one, whose textures (and normal maps, if they all have
+ * them) are the layers of a GL_TEXTURE_2D_ARRAY each, and whose entities
+ * know their layer, so the lot is one instanced draw instead of one per
+ * txmodel. @prog is the "layers" variant of @m's program, see
+ * shader_prog_find_variant(), which @m switches to; the old txmodels go.
+ * -EAGAIN while the textures are still loading, -EINVAL if they don't fit
+ * in one array (sizes, formats, compressed ones) or there's nothing to win.
+ */
+int model3d_texture_layers(struct mq *mq, struct model3d *m, struct shader_prog *prog);
+/*
+ * The unskinned model in @mq made of @hash's mesh with @prog, which a new
+ * load of the same mesh can add its textures to rather than make another
+ */
+struct model3d *mq_model_by_mesh(struct mq *mq, uint64_t hash, struct shader_prog *prog);
+/*
+ * model3d_texture_layers() for the models in @mq that have more than one
+ * txmodel, with the "layers" variants of their programs from @progs;
+ * -EAGAIN if any of them are still waiting for their textures
+ */
+int mq_texture_layers(struct mq *mq, struct shader_prog *progs);
+/* @txm is one of several loads of its model's mesh, see mq_model_by_mesh() */
+static inline bool model3dtx_shares_model(struct model3dtx *txm)
+{
+    return txm->model->txmodels.next != &txm->model_entry;
+}
 struct model3d *model3d_new_cube(struct shader_prog *p);
 struct model3d *model3d_new_quad(struct shader_prog *p, float x, float y, float z, float w, float h);
 struct model3d *model3d_new_frame(struct shader_prog *p, float x, float y, float z, float w, float h, float t);
@@ -153,8 +313,65 @@ static inline const char *txmodel_name(struct model3dtx *txm)
     return txm->model->name;
 }
 
+/*
+ * Animated entities that take up less than @px pixels on the screen are
+ * evaluated every @rate frames, and their joint matrices are interpolated
+ * in between; the entries go from the largest @px to the smallest, @rate
+ * of 0 ends the list. Entities that are out of view are evaluated every
+ * mq::ani_culled_rate frames without the interpolation, or never, if it's
+ * 0, until they're back in view.
+ */
+#define ANI_LOD_MAX     4
+#define ANI_CULLED_RATE 16
+
+struct ani_lod {
+    float           px;
+    unsigned int    rate;
+};
+
+/* a query's AABB as 12 triangles */
+struct occlusion_box {
+    float           vx[36][3];
+};
+
 struct mq {
     struct list     txmodels;
+    /* per-frame draw list sorted by render state, see models_render() */
+    darray(struct sort_item, draw_list);
+    darray(struct sort_item, draw_tmp);
+    /* spatial index of the entities for culling, if @spatial is set */
+    struct bvh      bvh;
+    bool            spatial;
+    /* all skinned entities' joint transforms, uploaded once per models_render() */
+    darray(mat4x4,  joints);
+    texture_t       joint_tex;
+    /* distinct models, one update job each, see mq_update() */
+    darray(struct model3d *, update_models);
+    /* batched models' vertices, this frame's part of render_stream_write() */
+    darray(struct batch_vertex, batch);
+    GLuint          batch_obj;
+    ssize_t         batch_off;
+    GLuint          batch_vao;
+    /* a model's non-instanced visible entities by LOD, see models_render() */
+    darray(struct entity3d *, lod_ents[LOD_MAX]);
+    /* lay down the depth of the opaque models before shading them */
+    bool            depth_prepass;
+    /* the last models_render() that culled and measured the entities */
+    unsigned long   frustum_seq;
+    /* animation update rates, see entity3d_ani_rate() */
+    struct ani_lod  ani_lods[ANI_LOD_MAX];
+    unsigned int    ani_culled_rate;
+    /*
+     * Occlusion culling, with the depth pre-pass and one view: this program
+     * draws the boxes of the queries, world space positions with "proj" and
+     * "view", like "debug" does; mq_release() puts it. The frame counter is
+     * that of the models_render_views() that issued the queries.
+     */
+    struct shader_prog *occlusion_prog;
+    unsigned long   occlusion_frame;
+    darray(struct entity3d *, occlusion_ents);
+    darray(struct occlusion_box, occlusion_boxes);
+    GLuint          occlusion_vao;
     void            *priv;
 };
 
@@ -162,6 +379,15 @@ void mq_init(struct mq *mq, void *priv);
 void mq_release(struct mq *mq);
 void mq_update(struct mq *mq);
 void mq_for_each(struct mq *mq, void (*cb)(struct entity3d *, void *), void *data);
+/*
+ * Entities of models with any of @tags, by their position, as of the last
+ * mq_update(); only in @spatial mqs. The radius one is in no particular
+ * order, the nearest one is nearest first, hits[].data are the entities.
+ */
+void mq_query_radius(struct mq *mq, const vec3 center, float radius, unsigned long tags,
+                     void (*cb)(struct entity3d *, void *), void *data);
+unsigned int mq_query_nearest(struct mq *mq, const vec3 center, float radius, unsigned long tags,
+                              struct bvh_hit *hits, unsigned int nr);
 struct model3dtx *mq_model_first(struct mq *mq);
 struct model3dtx *mq_model_last(struct mq *mq);
 void mq_add_model(struct mq *mq, struct model3dtx *txmodel);
@@ -176,6 +402,11 @@ static inline float cos_interp(float a, float b, float blend)
     return a * (1.f - f) + b * f;
 }
 
+static inline float lin_interp(float a, float b, float blend)
+{
+    return a * (1.f - blend) + b * blend;
+}
+
 static inline float barrycentric(vec3 p1, vec3 p2, vec3 p3, vec2 pos)
 {
     float det = (p2[2] - p3[2]) * (p1[0] - p3[0]) + (p3[0] - p2[0]) * (p1[2] - p3[2]);
@@ -198,6 +429,8 @@ struct fbo {
 };
 struct fbo *fbo_new(int width, int height);
 struct fbo *fbo_new_ms(int width, int height, bool ms);
+/* without a depth buffer, if it's not going to be used */
+struct fbo *fbo_new_ms_depth(int width, int height, bool ms, bool depth);
 void fbo_prepare(struct fbo *fbo);
 void fbo_done(struct fbo *fbo, int width, int height);
 void fbo_resize(struct fbo *fbo, int width, int height);
@@ -223,10 +456,20 @@ struct entity3d {
     unsigned int     visible;
     int              animation;
     long             ani_frame;
-    darray(struct queued_animation, aniq);
-    /* these both have model->nr_joints elements */
+    darray_small(struct queued_animation, aniq, 4);
+    /*
+     * these all have model->nr_joints elements; the local transforms are
+     * split by field for mat4x4_from_trs_n()
+     */
     struct joint     *joints;
+    vec3             *joint_translation;
+    quat             *joint_rotation;
+    vec3             *joint_scale;
     mat4x4           *joint_transforms;
+    /* where this frame's joint_transforms are in mq::joint_tex */
+    unsigned int     joint_off;
+    /* into the txmodel's texture arrays, see model3d_texture_layers() */
+    unsigned int     tex_layer;
 
     struct phys_body *phys_body;
     GLfloat color[4];
@@ -234,11 +477,38 @@ struct entity3d {
     GLfloat dx, dy, dz;
     GLfloat rx, ry, rz;
     GLfloat scale;
-    GLfloat _dx, _dy, _dz;
-    GLfloat _rx, _ry, _rz;
-    GLfloat _scale;
     bool    skip_culling;
-    float   aabb[6];
+    /* handle in the transform store, which has @mx and @aabb, see xform.h */
+    int              xform;
+    float            *aabb;
+    /* transform changed since mq_update(), see entity3d_dirty() */
+    bool             xform_dirty;
+    struct list      dirty_entry;
+    /* leaf in mq's spatial index, see mq_update() */
+    struct bvh       *bvh;
+    int              bvh_node;
+    /* moved during the parallel part of mq_update(), the leaf is stale */
+    bool             bvh_dirty;
+    unsigned long    frustum_seq;
+    /* views that it's in, as of frustum_seq */
+    unsigned int     view_mask;
+    /* erand48() state: updates run on the job workers, see mq_update() */
+    unsigned short   rand48[3];
+    /* last frame's LOD and size on the screen, see entity3d_lod() */
+    unsigned int     lod;
+    float            screen_px;
+    /* joints going from @ani_from to @ani_to, see animated_update() */
+    mat4x4           *ani_from;
+    mat4x4           *ani_to;
+    unsigned long    ani_lod_start;
+    unsigned int     ani_lod_span;
+    /* occlusion query of mq::occlusion_frame, its last result, see entity3d_occluded() */
+    GLuint           occlusion_query;
+    unsigned long    occlusion_frame;
+    bool             occlusion_pending;
+    bool             occlusion_result;
+    /* hidden in this frame, both passes go by it */
+    bool             occluded;
     int (*update)(struct entity3d *e, void *data);
     int (*contact)(struct entity3d *e1, struct entity3d *e2);
     void (*destroy)(struct entity3d *e);
@@ -250,6 +520,19 @@ void models_render(struct mq *mq, struct light *light, struct camera *camera,
                    struct matrix4f *proj_mx, struct entity3d *focus, int width, int height,
                    unsigned long *count);
 
+#define RENDER_VIEWS_MAX 4
+
+/* a camera and its part of the framebuffer */
+struct render_view {
+    struct camera   *camera;
+    struct matrix4f *proj_mx;
+    int             x, y;
+    int             width, height;
+};
+
+void models_render_views(struct mq *mq, struct light *light, struct render_view *views,
+                         unsigned int nr_views, struct entity3d *focus, unsigned long *count);
+
 static inline const char *entity_name(struct entity3d *e)
 {
     return e ? txmodel_name(e->txmodel) : "<none>";
@@ -262,6 +545,7 @@ static inline bool entity_animated(struct entity3d *e)
 
 struct entity3d *entity3d_new(struct model3dtx *txm);
 void entity3d_reset(struct entity3d *e);
+void entity3d_dirty(struct entity3d *e);
 float entity3d_aabb_X(struct entity3d *e);
 float entity3d_aabb_Y(struct entity3d *e);
 float entity3d_aabb_Z(struct entity3d *e);
@@ -272,21 +556,28 @@ void entity3d_update(struct entity3d *e, void *data);
 void entity3d_put(struct entity3d *e);
 void entity3d_move(struct entity3d *e, float dx, float dy, float dz);
 void entity3d_position(struct entity3d *e, float x, float y, float z);
-void entity3d_add_physics(struct entity3d *e, double mass, int class, int type, double geom_off, double geom_radius, double geom_length);
+void entity3d_add_physics(struct entity3d *e, struct phys *phys, double mass, int class, int type, double geom_off, double geom_radius, double geom_length);
 void create_entities(struct model3dtx *txmodel);
 
 struct instantiator;
 struct entity3d *instantiate_entity(struct model3dtx *txm, struct instantiator *instor,
                                     bool randomize_yrot, float randomize_scale, struct scene *scene);
 
-struct debug_draw {
-    struct ref      ref;
-    struct entity3d *entity;
-    struct list     entry;
+struct debug_vertex {
+    float   pos[3];
+    float   color[4];
 };
 
-struct debug_draw *__debug_draw_line(struct scene *scene, vec3 a, vec3 b, mat4x4 *rot);
+/*
+ * Immediate mode debug drawing, when scene::debug_draws_enabled: the
+ * primitives are appended to the scene's vertex array as lines, which
+ * debug_draws_render() draws in one go, and debug_draw_clearout() empties
+ * at the end of the frame. Lines are red, for the rest, @color NULL is red.
+ */
 void debug_draw_line(struct scene *scene, vec3 a, vec3 b, mat4x4 *rot);
+void debug_draw_aabb(struct scene *scene, const float *aabb, const float *color);
+void debug_draw_sphere(struct scene *scene, vec3 center, float radius, const float *color);
+void debug_draws_render(struct scene *scene, struct camera *camera, struct matrix4f *proj_mx);
 void debug_draw_clearout(struct scene *scene);
 
 #endif /* __CLAP_MODEL_H__ */
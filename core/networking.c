@@ -2,17 +2,21 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
 #include "common.h" /* XXX: for EM_ASM(): factor out */
 #include "clap.h"
 #include "util.h"
@@ -20,11 +24,22 @@
 #include "object.h"
 #include "networking.h"
 #include "messagebus.h"
-#include "sha1.c" /* XXX */
+#include "input-delta.h"
+#include "snapshot.h"
+#include "sha1.h"
 #include "base64.c"
 #include "base64.h"
 
-static DECLARE_LIST(nodes);
+/*
+ * epoll(7) where there is one: nodes are registered once instead of the
+ * pollfd array being rebuilt on every connect and disconnect, and only the
+ * ones that have something going on come back; poll(2) otherwise
+ */
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#define CONFIG_NET_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 enum {
     ST_INIT = 0,
@@ -35,20 +50,60 @@ enum {
 };
 
 /*
- * Data queued for sending on the node, could use a better name
+ * Outgoing data, shared between all the nodes it's queued on, so that a
+ * broadcast doesn't copy it for each of them
  */
+struct net_payload {
+    struct ref  ref;
+    void        *data;
+    size_t      size;
+};
+
+static void net_payload_drop(struct ref *ref)
+{
+    struct net_payload *p = container_of(ref, struct net_payload, ref);
+
+    free(p->data);
+}
+
+DECLARE_REFCLASS(net_payload);
+
+/* the longest websocket frame header: 2 bytes + 64 bit length */
+#define WS_HDR_MAX 10
+
+/* websocket frame header, if any, goes out in front of the payload */
 struct queued {
-    void        *out;
-    size_t      outsz;
-    struct list entry;
+    uint8_t             hdr[WS_HDR_MAX];
+    size_t              hdrsz;
+    struct net_payload  *payload;
+    struct list         entry;
+};
+
+/*
+ * Input buffering: data goes in at @len and gets consumed from @off; the
+ * consumed part is only reclaimed when the next chunk doesn't fit, so the
+ * data moves once in a while instead of on every packet, and what's in
+ * there can be parsed in place. Past NET_BUF_HIGH, something is wrong on
+ * the other end.
+ */
+struct net_buf {
+    uint8_t     *data;
+    size_t      off;
+    size_t      len;
+    size_t      cap;
 };
 
+#define NET_BUF_MIN     4096
+#define NET_BUF_HIGH    (4 * 1024 * 1024)
+
 /*
  * Client or server or listener.
  */
 struct network_node {
     struct ref             ref;
+    /* on its reactor's nodes */
     struct list            entry;
+    struct net_reactor     *reactor;
     struct network_node    *parent;
     struct message_source  *src;
     struct sockaddr_in     sa;
@@ -61,12 +116,11 @@ struct network_node {
     struct timespec        remote_delta;
 
     /*
-     * Buffered input data, in case of partial packets
+     * Buffered input data, in case of partial packets: messages and,
+     * for websockets, the frames they come in
      */
-    void                   *input;
-    size_t                 inputsz;
-    void                   *wsinput;
-    size_t                 wsinputsz;
+    struct net_buf         input;
+    struct net_buf         wsinput;
 
     socklen_t              addrlen;
     /*
@@ -76,24 +130,130 @@ struct network_node {
     void                   *data;
     /* chain of struct queued */
     struct list            out_queue;
+    /* bytes of out_queue's head (header included) already sent */
+    size_t                 out_off;
+    /* on out_pending */
+    struct list            out_entry;
     /* mode is who we are, not who we're talking to */
     enum mode              mode;
     int                    fd;
     int                    state;
     /* file for dumping remote's log messages */
     FILE                   *log_f;
+    /* client: input states sent; server: received */
+    struct input_history   *inputs;
+    /* client: the last one sent; server: the last one received */
+    uint16_t               input_seq;
+    /* client: the last one the server has seen, -1 for none */
+    int                    input_acked;
+    /* server: received since the last ack went out */
+    unsigned int           input_unacked;
+    /* server: snapshots sent; client: received */
+    struct snapshot_history *snapshots;
+    uint16_t               snapshot_seq;
+    /* server: the last one the client has seen, -1 for none */
+    int                    snapshot_acked;
     /* poll(2) */
     short                  events;
+    /* epoll(7), edge triggered: read until there's nothing left */
+    bool                   edge;
     /* carry out websocket handshake */
     int (*handshake)(struct network_node *n, const uint8_t *buf);
 };
 
+struct wsheader {
+    char *key;
+    int  version;
+};
+
+/*
+ * Server side, there can be a reactor per thread, each with its own
+ * listeners, bound with SO_REUSEPORT for the kernel to spread the
+ * connections between them, and nodes, which only it ever touches.
+ * The first one is the caller's, see networking_poll(); the others have
+ * their own threads, see net_reactor_thread(). What has to go to the other
+ * reactors' nodes (broadcasts, snapshots) gets posted to their inboxes,
+ * what the clients send goes to the main thread via message_post().
+ */
+#define NET_REACTORS_MAX 16
+
+/*
+ * The server acks inputs in the snapshots (snapshot::input_seq); without
+ * those, it sends an input_ack every this many, well within INPUT_HISTORY
+ */
+#define INPUT_ACK_BATCH 8
+
+struct net_job;
+
+/* on a reactor's inbox, one per reactor that @job is posted to */
+struct net_post {
+    struct net_post *next;
+    struct net_job  *job;
+};
+
+struct net_reactor {
+    struct list         nodes;
+    /* nodes with something in their out_queue, see networking_epoll() */
+    struct list         out_pending;
+    /* poll(2), the first reactor only */
+    struct pollfd       *pollfds;
+    unsigned int        nr_nodes;
+    unsigned int        need_polling_alloc;
+    /* websocket listeners' handshake */
+    struct wsheader     wsh;
+#ifdef CONFIG_NET_EPOLL
+    int                 epfd;
+    /* eventfd(2): something's been posted */
+    int                 wakefd;
+#endif
+    _Atomic(struct net_post *) inbox;
+    pthread_t           thread;
+    atomic_bool         stop;
+};
+
+static struct net_reactor reactors[NET_REACTORS_MAX] = {
+    [0] = {
+        .nodes          = EMPTY_LIST(reactors[0].nodes),
+        .out_pending    = EMPTY_LIST(reactors[0].out_pending),
+#ifdef CONFIG_NET_EPOLL
+        .epfd           = -1,
+        .wakefd         = -1,
+#endif
+    },
+};
+static unsigned int nr_reactors = 1;
+/* NULL on the caller's thread, which has the first one */
+static _Thread_local struct net_reactor *net_self;
+
+static inline struct net_reactor *net_reactor_self(void)
+{
+    return net_self ? net_self : &reactors[0];
+}
+
+static inline bool net_reactor_is_main(struct net_reactor *r)
+{
+    return r == &reactors[0];
+}
+
+/*
+ * A client connection's message source: the messages posted from the
+ * other reactors may still point at it after the node is gone, so those
+ * are freed on the main thread, after a drain, see networking_poll()
+ */
+struct net_source {
+    struct message_source   src;
+    struct net_source       *next;
+};
+
+static _Atomic(struct net_source *) net_graves;
+
 static struct networking_config  *_ncfg;
-static struct pollfd *pollfds;
-static unsigned int  nr_nodes;
-static unsigned int  need_polling_alloc;
 
 static void queue_outmsg(struct network_node *n, void *data, size_t size);
+static void queue_flush(struct network_node *n);
+static struct net_payload *net_payload_new(void *data, size_t size);
+static void queue_payload(struct network_node *n, struct net_payload *p,
+                          const uint8_t *hdr, size_t hdrsz);
 
 static void log_flush(struct log_entry *e, void *data)
 {
@@ -135,43 +295,103 @@ static void log_flush(struct log_entry *e, void *data)
     //fprintf(stderr, "===> %s <===\n", e->msg);
 }
 
-static void polling_alloc()
+static void polling_alloc(struct net_reactor *r)
 {
     struct network_node *n;
 
-    nr_nodes = 0;
-    list_for_each_entry(n, &nodes, entry) {
-        nr_nodes++;
+    r->nr_nodes = 0;
+    list_for_each_entry(n, &r->nodes, entry) {
+        r->nr_nodes++;
     }
 
-    dbg("pollfds: %d\n", nr_nodes);
-    free(pollfds);
-    pollfds = NULL;
+    dbg("pollfds: %d\n", r->nr_nodes);
+    free(r->pollfds);
+    r->pollfds = NULL;
 
-    if (nr_nodes)
-        CHECK(pollfds = calloc(nr_nodes, sizeof(struct pollfd)));
-    need_polling_alloc = 0;
+    if (r->nr_nodes)
+        CHECK(r->pollfds = calloc(r->nr_nodes, sizeof(struct pollfd)));
+    r->need_polling_alloc = 0;
 }
 
-static void polling_update(void)
+static void polling_update(struct net_reactor *r)
 {
     struct network_node *n;
     unsigned int        i = 0;
 
-    if (need_polling_alloc)
-        polling_alloc();
+    if (r->need_polling_alloc)
+        polling_alloc(r);
 
-    list_for_each_entry(n, &nodes, entry) {
-        if (i == nr_nodes) {
-            err("i > nr_nodes: %d %d\n", i, nr_nodes);
+    list_for_each_entry(n, &r->nodes, entry) {
+        if (i == r->nr_nodes) {
+            err("i > nr_nodes: %d %d\n", i, r->nr_nodes);
             return;
         }
-        pollfds[i].events = n->events;
-        pollfds[i].fd     = n->fd;
+        r->pollfds[i].events = n->events;
+        r->pollfds[i].fd     = n->fd;
         i++;
     }
 }
 
+/*
+ * Connections are edge triggered, so they need to be non-blocking; the
+ * listeners stay level triggered and accept one connection per round,
+ * same as with poll(2)
+ */
+static void network_node_watch(struct network_node *n)
+{
+#ifdef CONFIG_NET_EPOLL
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = n };
+    int epfd = n->reactor->epfd;
+
+    if (epfd < 0)
+        return;
+
+    if (n->mode != LISTEN) {
+        ev.events |= EPOLLOUT | EPOLLET;
+        fcntl(n->fd, F_SETFL, fcntl(n->fd, F_GETFL) | O_NONBLOCK);
+        n->edge = true;
+    }
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, n->fd, &ev))
+        err("epoll_ctl on fd %d: %m\n", n->fd);
+#endif /* CONFIG_NET_EPOLL */
+}
+
+static void net_source_free(struct message_source *src)
+{
+    struct net_source *ns;
+
+    if (!src)
+        return;
+
+    ns = container_of(src, struct net_source, src);
+    free(ns->src.name);
+    free(ns);
+}
+
+static void net_source_bury(struct message_source *src)
+{
+    struct net_source *ns = container_of(src, struct net_source, src);
+
+    ns->next = atomic_load_explicit(&net_graves, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&net_graves, &ns->next, ns,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+}
+
+/* what's buried before the drain is safe to free after it */
+static void net_sources_reap(void)
+{
+    struct net_source *ns, *next;
+
+    ns = atomic_exchange_explicit(&net_graves, NULL, memory_order_acquire);
+    messagebus_drain();
+    for (; ns; ns = next) {
+        next = ns->next;
+        net_source_free(&ns->src);
+    }
+}
+
 static void network_node_drop(struct ref *ref)
 {
     struct network_node *n = container_of(ref, struct network_node, ref);
@@ -184,33 +404,46 @@ static void network_node_drop(struct ref *ref)
     if (n->mode == CLIENT)
         rb_sink_del(n);
 
-    free(n->input);
-    free(n->src);
+    free(n->input.data);
+    free(n->wsinput.data);
+    free(n->inputs);
+    free(n->snapshots);
+    if (n->src && !net_reactor_is_main(n->reactor))
+        net_source_bury(n->src);
+    else
+        net_source_free(n->src);
+    queue_flush(n);
     list_del(&n->entry);
+    list_del(&n->out_entry);
+    /* also takes it out of the epoll set */
     close(n->fd);
     shutdown(n->fd, SHUT_RDWR);
-    need_polling_alloc++;
+    n->reactor->need_polling_alloc++;
 }
 
 DECLARE_REFCLASS(network_node);
 
-static struct network_node *network_node_new(int mode)
+static struct network_node *network_node_new(struct net_reactor *r, int mode)
 {
     struct network_node *n;
 
     CHECK(n = ref_new(network_node));
+    n->reactor = r;
     n->mode = mode;
     n->events = POLLIN | POLLHUP | POLLNVAL | POLLOUT;
     n->state  = ST_INIT;
-    list_append(&nodes, &n->entry);
+    n->input_acked = -1;
+    n->snapshot_acked = -1;
+    list_append(&r->nodes, &n->entry);
     list_init(&n->out_queue);
+    list_init(&n->out_entry);
 
     return n;
 }
 
 static struct network_node *network_node_new_parent(struct network_node *parent)
 {
-    struct network_node *n = network_node_new(parent->mode);
+    struct network_node *n = network_node_new(parent->reactor, parent->mode);
     n->parent            = parent;
     n->handshake         = parent->handshake;
     n->data              = parent->data;
@@ -219,9 +452,10 @@ static struct network_node *network_node_new_parent(struct network_node *parent)
     return n;
 }
 
-static struct network_node *network_node_new_socket(const char *ip, unsigned int port, int mode)
+static struct network_node *network_node_new_socket(struct net_reactor *r, const char *ip,
+                                                    unsigned int port, int mode)
 {
-    struct network_node *n = network_node_new(mode);
+    struct network_node *n = network_node_new(r, mode);
 
     n->addrlen = sizeof(n->sa);
     memset(&n->sa, 0, sizeof(struct sockaddr_in));
@@ -232,6 +466,11 @@ static struct network_node *network_node_new_socket(const char *ip, unsigned int
     if (mode == LISTEN) {
         int val = 1;
         setsockopt(n->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+#ifdef SO_REUSEPORT
+        /* each reactor has its own listeners on the same port */
+        if (nr_reactors > 1)
+            setsockopt(n->fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+#endif
     }
     fcntl(n->fd, F_SETFL, O_NONBLOCK);
 
@@ -242,7 +481,8 @@ static int network_node_listen(struct network_node *n)
 {
     CHECK0(bind(n->fd, (struct sockaddr *)&n->sa, n->addrlen));
     CHECK0(listen(n->fd, 1));
-    need_polling_alloc++;
+    network_node_watch(n);
+    n->reactor->need_polling_alloc++;
 
     return 0;
 }
@@ -263,23 +503,21 @@ static int network_node_connect(struct network_node *n)
 static struct network_node *network_node_accept(struct network_node *n)
 {
     struct network_node *child = network_node_new_parent(n);
+    struct net_source *ns;
+
     child->mode         = SERVER;
     CHECK(child->fd = accept(n->fd, (struct sockaddr *)&n->sa, &n->addrlen));
-    CHECK(child->src = calloc(1, sizeof(*child->src)));
+    CHECK(ns = calloc(1, sizeof(*ns)));
+    child->src = &ns->src;
     child->src->type = MST_CLIENT;
     CHECK(asprintf(&child->src->name, "%s", inet_ntoa(n->sa.sin_addr)));
     dbg("new client '%s'\n", child->src->name);
     child->src->desc = "remote client";
     child->state     = ST_HANDSHAKE;
-    need_polling_alloc++;
+    child->reactor->need_polling_alloc++;
     return child;
 }
 
-struct wsheader {
-    char *key;
-    int  version;
-};
-
 const char *wsguid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 static int websocket_parse(struct network_node *n, const uint8_t *_buf)
@@ -342,13 +580,37 @@ struct ws_header {
     unsigned mask   : 1;
 };
 
-static size_t ws_decode(uint8_t *input, size_t size, uint8_t **poutput, size_t *poutsz, int *popcode)
+/* 8 bytes at a time, the mask is the same in both halves of the word */
+static void ws_unmask(uint8_t *buf, size_t len, const uint8_t *mask)
+{
+    uint64_t word, mask64;
+    uint32_t mask32;
+    size_t   i;
+
+    memcpy(&mask32, mask, sizeof(mask32));
+    mask64 = (uint64_t)mask32 << 32 | mask32;
+
+    for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, buf + i, sizeof(word));
+        word ^= mask64;
+        memcpy(buf + i, &word, sizeof(word));
+    }
+
+    for (; i < len; i++)
+        buf[i] ^= mask[i % 4];
+}
+
+/*
+ * Decode a frame in place: *@poutput points into @input, past the header,
+ * at the unmasked payload. Returns the size of the whole frame or -2 if
+ * it's not all there yet.
+ */
+static ssize_t ws_decode(uint8_t *input, size_t size, uint8_t **poutput, size_t *poutsz, int *popcode)
 {
     struct ws_header *h = (void *)input;
     uint8_t          *mask = NULL;
     size_t           len, off = 2;
-    uint8_t          *output;
-    int              op;
+    int              i, op;
 
     if (size < sizeof(*h))
         return -2;
@@ -357,99 +619,67 @@ static size_t ws_decode(uint8_t *input, size_t size, uint8_t **poutput, size_t *
     len = h->length;
     op  = h->opcode;
 
-    if (len <= 125) {
-        off = 2;
-    } else if (len == 126) {
+    /* the extended length and the mask */
+    if (size < off + (len == 126 ? 2 : len == 127 ? 8 : 0) + (h->mask ? 4 : 0))
+        return -2;
+
+    if (len == 126) {
         len = input[off++] << 8;
         len |= input[off++];
     } else if (len == 127) {
-        len  = input[off++] << 24;
-        len |= input[off++] << 16;
-        len |= input[off++] << 8;
-        len |= input[off++];
+        for (len = 0, i = 0; i < 8; i++)
+            len = len << 8 | input[off++];
     }
     if (h->mask) {
         mask = &input[off];
         off += 4;
     }
 
-    if (len + off > size) {
+    if (len > size - off) {
         dbg("## packet larger than input buffer: %zu/%zu\n", len, size);
         return -2;
     }
 
-    CHECK(output = calloc(1, len + 1));
-    if (!h->mask) {
-        memcpy(output, &input[off], len);
-    } else {
-        int i;
-
-        for (i = 0; i < len; i++)
-            output[i] = input[off + i] ^ mask[i % 4];
-    }
-    output[len] = 0;
+    /* the frame gets consumed right after this, nobody looks at it twice */
+    if (h->mask)
+        ws_unmask(&input[off], len, mask);
 
-    *poutput = output;
+    *poutput = &input[off];
     *poutsz  = len;
     *popcode = op;
 
     return off + len;
 }
 
-static int ws_encode(uint8_t *input, size_t inputsz, uint8_t **poutput, size_t *poutsz)
+/* binary frame header for @size bytes of payload, in network byte order */
+static size_t ws_encode_header(uint8_t *hdr, size_t size)
 {
-    size_t            length = inputsz + 2, off = 2;
-    uint8_t           *output = NULL;
-    struct ws_header  *h;
-    uint16_t          len16;
-    uint64_t          len64;
-    int               lensz;
-
-    if (inputsz < 125) {
-        lensz = 0;
-        //length += 2;
-        //dbg("header: %02x\n", output[0]);
-    } else if (inputsz < UINT16_MAX) {
-        lensz = 2;
-        len16 = (uint16_t)inputsz;
+    size_t off = 2;
+    int    i;
+
+    hdr[0] = 0x80 | WSOP_BIN; /* FIN */
+    if (size < 126) {
+        hdr[1] = size;
+    } else if (size <= UINT16_MAX) {
+        hdr[1] = 126;
+        hdr[off++] = size >> 8;
+        hdr[off++] = size;
     } else {
-        lensz = 8;
-        len64 = (uint64_t)inputsz;
-    }
-    length += lensz;
-    off += lensz;
-
-    CHECK(output = calloc(1, length));
-    h         = (void *)output;
-    h->fin    = 1;
-    h->opcode = WSOP_BIN;
-    switch (lensz) {
-    case 0:
-        h->length = (uint8_t)inputsz;
-        break;
-    case 2:
-        h->length = 126;
-        memcpy(&output[2], &len16, lensz);
-        break;
-    case 8:
-        h->length = 127;
-        memcpy(&output[2], &len64, lensz);
-        break;
+        hdr[1] = 127;
+        for (i = 7; i >= 0; i--)
+            hdr[off++] = (uint64_t)size >> (i * 8);
     }
-    memcpy(&output[off], input, inputsz);
 
-    *poutput = output;
-    *poutsz  = length;
-    return 0;
+    return off;
 }
 
-static struct network_node *server_setup(const char *server_ip, unsigned int port)
+static struct network_node *server_setup(struct net_reactor *r, const char *server_ip, unsigned int port)
 {
     struct network_node *n;
 
-    CHECK(n = network_node_new_socket(server_ip, port, LISTEN));
+    CHECK(n = network_node_new_socket(r, server_ip, port, LISTEN));
     CHECK0(network_node_listen(n));
-    need_polling_alloc++;
+    r->need_polling_alloc++;
 
     return n;
 }
@@ -458,11 +688,12 @@ static struct network_node *_client_setup(struct networking_config *cfg, unsigne
 {
     struct network_node *n;
 
-    CHECK(n = network_node_new_socket(cfg->server_ip, port, CLIENT));
+    CHECK(n = network_node_new_socket(&reactors[0], cfg->server_ip, port, CLIENT));
     network_node_connect(n);
+    network_node_watch(n);
     if (cfg->logger)
         rb_sink_add(log_flush, n, VDBG, 1);
-    need_polling_alloc++;
+    n->reactor->need_polling_alloc++;
 
     return n;
 }
@@ -493,21 +724,122 @@ static const char *node_name(struct network_node *n)
     return "<unknown>";
 }
 
-void networking_broadcast(int mode, void *data, size_t size)
+enum {
+    NET_JOB_BROADCAST = 0,
+    NET_JOB_SNAPSHOT,
+};
+
+/* for the other reactors, shared by them; the last one to be done frees it */
+struct net_job {
+    atomic_uint             refs;
+    int                     type;
+    /* NET_JOB_BROADCAST: to the nodes of @mode */
+    int                     mode;
+    /* NET_JOB_SNAPSHOT: to the node of @src */
+    struct message_source   *src;
+    size_t                  size;
+    /* the broadcast's data or the struct snapshot */
+    uint8_t                 data[];
+};
+
+static struct net_job *net_job_new(int type, const void *data, size_t size)
+{
+    struct net_job *job;
+
+    job = malloc(offsetof(struct net_job, data) + size);
+    if (!job)
+        return NULL;
+
+    atomic_init(&job->refs, 1);
+    job->type = type;
+    job->size = size;
+    memcpy(job->data, data, size);
+
+    return job;
+}
+
+static void net_job_put(struct net_job *job)
+{
+    if (atomic_fetch_sub_explicit(&job->refs, 1, memory_order_acq_rel) == 1)
+        free(job);
+}
+
+static void net_reactor_wake(struct net_reactor *r)
+{
+#ifdef CONFIG_NET_EPOLL
+    uint64_t one = 1;
+
+    if (write(r->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        err("eventfd write: %m\n");
+#endif /* CONFIG_NET_EPOLL */
+}
+
+/* to all the reactors but the caller's; drops the caller's reference to @job */
+static void net_post_others(struct net_job *job)
+{
+    struct net_reactor *r, *self = net_reactor_self();
+    struct net_post *post;
+    unsigned int i;
+
+    for (i = 0; i < nr_reactors; i++) {
+        r = &reactors[i];
+        if (r == self)
+            continue;
+
+        post = malloc(sizeof(*post));
+        if (!post) {
+            warn("reactor %u: dropping a post\n", i);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&job->refs, 1, memory_order_relaxed);
+        post->job = job;
+        post->next = atomic_load_explicit(&r->inbox, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&r->inbox, &post->next, post,
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+        net_reactor_wake(r);
+    }
+
+    net_job_put(job);
+}
+
+static void net_reactor_broadcast(struct net_reactor *r, int mode, void *data, size_t size)
 {
+    uint8_t hdr[WS_HDR_MAX];
+    struct net_payload *p;
     struct network_node *n;
+    size_t hdrsz;
 
     dbg("sending broadcast\n");
-    list_for_each_entry(n, &nodes, entry) {
-        void *out;
+    CHECK(p = net_payload_new(memdup(data, size), size));
+    hdrsz = ws_encode_header(hdr, size);
 
+    list_for_each_entry(n, &r->nodes, entry) {
         if (n->mode == mode && n->state == ST_RUNNING) {
             dbg("sending to node '%s'\n", node_name(n));
-            out = memdup(data, size);
-            queue_outmsg(n, out, size);
-            n->events |= POLLOUT;
+            queue_payload(n, p, hdr, n->websocket ? hdrsz : 0);
+        }
+    }
+
+    ref_put(p);
+}
+
+void networking_broadcast(int mode, void *data, size_t size)
+{
+    struct net_job *job;
+
+    if (nr_reactors > 1) {
+        job = net_job_new(NET_JOB_BROADCAST, data, size);
+        if (job) {
+            job->mode = mode;
+            net_post_others(job);
+        } else {
+            warn("broadcast only goes to this reactor's nodes\n");
         }
     }
+
+    net_reactor_broadcast(net_reactor_self(), mode, data, size);
 }
 
 void networking_broadcast_restart(void)
@@ -520,6 +852,223 @@ void networking_broadcast_restart(void)
     networking_broadcast(CLIENT, &mcmd, sizeof(mcmd));
 }
 
+/*
+ * Input goes to the server as a delta against the last state it has
+ * acknowledged, or in full if there's no such state in the history
+ */
+void networking_send_input(struct message_input *mi)
+{
+    struct message_command *mcmd;
+    struct input_state st, *base;
+    struct network_node *n;
+    uint8_t *buf;
+    size_t size;
+
+    input_state_pack(&st, mi);
+    list_for_each_entry(n, &reactors[0].nodes, entry) {
+        if (n->mode != CLIENT || n->state != ST_RUNNING)
+            continue;
+
+        if (!n->inputs && !(n->inputs = calloc(1, sizeof(*n->inputs))))
+            continue;
+
+        st.seq = ++n->input_seq;
+        base = NULL;
+        if (n->input_acked >= 0 && (uint16_t)(st.seq - n->input_acked) < INPUT_HISTORY)
+            base = input_history_find(n->inputs, n->input_acked);
+
+        CHECK(buf = calloc(1, sizeof(*mcmd) + INPUT_DELTA_MAX));
+        mcmd = (void *)buf;
+        mcmd->input_follows = 1;
+        size = sizeof(*mcmd) + input_delta_encode(buf + sizeof(*mcmd), &st, base);
+        input_history_add(n->inputs, &st);
+        queue_outmsg(n, buf, size);
+    }
+}
+
+/*
+ * The server's view of the world for the client behind @src, as a delta
+ * against the last snapshot it has acknowledged, like the input above;
+ * sets @snap->seq
+ */
+static int net_reactor_send_snapshot(struct net_reactor *r, struct message_source *src,
+                                     struct snapshot *snap)
+{
+    struct message_command *mcmd;
+    struct snapshot *base = NULL;
+    struct network_node *n;
+    uint8_t *buf;
+    size_t size;
+
+    list_for_each_entry(n, &r->nodes, entry)
+        if (n->mode == SERVER && n->src == src && n->state == ST_RUNNING)
+            goto found;
+
+    return -ENOENT;
+
+found:
+    if (!n->snapshots && !(n->snapshots = calloc(1, sizeof(*n->snapshots))))
+        return -ENOMEM;
+
+    snap->seq = ++n->snapshot_seq;
+    /* inputs go into the simulation as they arrive; this also acks them */
+    snap->input_seq = n->input_seq;
+    n->input_unacked = 0;
+    if (n->snapshot_acked >= 0 && (uint16_t)(snap->seq - n->snapshot_acked) < SNAPSHOT_HISTORY)
+        base = snapshot_history_find(n->snapshots, n->snapshot_acked);
+
+    buf = calloc(1, sizeof(*mcmd) + SNAPSHOT_DELTA_MAX);
+    if (!buf)
+        return -ENOMEM;
+
+    mcmd = (void *)buf;
+    mcmd->snapshot_follows = 1;
+    size = sizeof(*mcmd) + snapshot_encode(buf + sizeof(*mcmd), snap, base);
+    snapshot_history_add(n->snapshots, snap);
+    queue_outmsg(n, buf, size);
+
+    return 0;
+}
+
+int networking_send_snapshot(struct message_source *src, struct snapshot *snap)
+{
+    struct net_job *job;
+    int ret;
+
+    /* @src is never dereferenced, the node may be gone, so it's anyone's */
+    ret = net_reactor_send_snapshot(net_reactor_self(), src, snap);
+    if (ret != -ENOENT || nr_reactors < 2)
+        return ret;
+
+    job = net_job_new(NET_JOB_SNAPSHOT, snap, sizeof(*snap));
+    if (!job)
+        return -ENOMEM;
+
+    job->src = src;
+    net_post_others(job);
+
+    return 0;
+}
+
+static void net_reactor_inbox(struct net_reactor *r)
+{
+    struct net_post *post, *next, *list;
+    struct net_job *job;
+
+    /* in the order they were posted */
+    post = atomic_exchange_explicit(&r->inbox, NULL, memory_order_acquire);
+    for (list = NULL; post; post = next) {
+        next = post->next;
+        post->next = list;
+        list = post;
+    }
+
+    for (post = list; post; post = next) {
+        next = post->next;
+        job = post->job;
+
+        switch (job->type) {
+        case NET_JOB_BROADCAST:
+            net_reactor_broadcast(r, job->mode, job->data, job->size);
+            break;
+        case NET_JOB_SNAPSHOT:
+            /* only one reactor has it, the rest don't touch the copy */
+            net_reactor_send_snapshot(r, job->src, (struct snapshot *)job->data);
+            break;
+        }
+
+        net_job_put(job);
+        free(post);
+    }
+}
+
+uint16_t networking_input_seq(void)
+{
+    struct network_node *n;
+
+    list_for_each_entry(n, &reactors[0].nodes, entry)
+        if (n->mode == CLIENT && n->state == ST_RUNNING)
+            return n->input_seq;
+
+    return 0;
+}
+
+static int forward_input(struct message *m, void *data)
+{
+    /* only the local input, not what the server may be sending back */
+    if (m->source && m->source->type == MST_CLIENT)
+        return 0;
+
+    networking_send_input(&m->input);
+
+    return 0;
+}
+
+static int forward_status(struct message *m, void *data)
+{
+    struct network_node *n;
+
+    /* only the local status, clap_fps_calc() */
+    if (!m->cmd.status || m->source)
+        return 0;
+
+    list_for_each_entry(n, &reactors[0].nodes, entry) {
+        if (n->mode != CLIENT || n->state != ST_RUNNING)
+            continue;
+
+        queue_outmsg(n, memdup(&m->cmd, sizeof(m->cmd)), sizeof(m->cmd));
+    }
+
+    return 0;
+}
+
+/* a snapshot's input_seq, or an input_ack every INPUT_ACK_BATCH inputs */
+static void input_ack(struct network_node *n, uint16_t seq)
+{
+    if (n->input_acked < 0 || (int16_t)(seq - n->input_acked) > 0)
+        n->input_acked = seq;
+}
+
+/* snapshot following a command, see networking_send_snapshot() */
+static ssize_t handle_client_snapshot(struct network_node *n, uint8_t *buf, size_t size)
+{
+    struct message_command *ack;
+    struct snapshot *snap;
+    ssize_t len;
+
+    if (!n->snapshots && !(n->snapshots = calloc(1, sizeof(*n->snapshots)))) {
+        n->state = ST_ERROR;
+        return 0;
+    }
+
+    CHECK(snap = malloc(sizeof(*snap)));
+    len = snapshot_decode(buf, size, snap, n->snapshots);
+    if (len == -EAGAIN)
+        goto out;
+
+    /* a base we don't have: skip it, the server falls back to a full one */
+    if (len < 0) {
+        dbg("snapshot: %zd\n", len);
+        len = snapshot_size(buf, size);
+        goto out;
+    }
+
+    /* no input yet: there's no 0 in the history, it's a full state next */
+    input_ack(n, snap->input_seq);
+    if (_ncfg->snapshot)
+        _ncfg->snapshot(snap, _ncfg->snapshot_data);
+
+    CHECK(ack = calloc(1, sizeof(*ack)));
+    ack->snapshot_ack = 1;
+    ack->snapshot_seq = snap->seq;
+    queue_outmsg(n, ack, sizeof(*ack));
+
+out:
+    free(snap);
+
+    return len == -EAGAIN ? -1 : len;
+}
+
 static ssize_t handle_client_input(struct network_node *n, uint8_t *buf, size_t size)
 {
     struct message_command *mcmd;
@@ -534,11 +1083,19 @@ static ssize_t handle_client_input(struct network_node *n, uint8_t *buf, size_t
     if (mcmd->restart) {
 #ifdef __EMSCRIPTEN__
         networking_done();
-        EM_ASM({ location.reload(); });
+        MAIN_THREAD_EM_ASM({ location.reload(); });
 #else
         clap_restart(_ncfg->clap);
 #endif
     }
+    if (mcmd->input_ack)
+        input_ack(n, mcmd->input_seq);
+    if (mcmd->snapshot_follows) {
+        ssize_t len = handle_client_snapshot(n, buf + sizeof(*mcmd), size - sizeof(*mcmd));
+
+        return len < 0 ? len : (ssize_t)sizeof(*mcmd) + len;
+    }
+
     return sizeof(*mcmd);
 }
 
@@ -609,6 +1166,58 @@ static ssize_t handle_server_handshake(struct network_node *n, uint8_t *buf, siz
     return sizeof(*mcmd);
 }
 
+/* the subscribers are the main thread's, the other reactors post to them */
+static void network_node_message(struct network_node *n, struct message *m)
+{
+    if (net_reactor_is_main(n->reactor))
+        message_send(m);
+    else if (message_post(m))
+        warn("'%s': dropping a message\n", node_name(n));
+}
+
+/* input delta following a command, see networking_send_input() */
+static ssize_t handle_server_input_delta(struct network_node *n, uint8_t *buf, size_t size)
+{
+    struct message_command *ack;
+    struct input_state st;
+    struct message m;
+    ssize_t len;
+
+    if (!n->inputs && !(n->inputs = calloc(1, sizeof(*n->inputs)))) {
+        n->state = ST_ERROR;
+        return 0;
+    }
+
+    len = input_delta_decode(buf, size, &st, n->inputs);
+    if (len == -EAGAIN)
+        return -1;
+
+    /* a base we don't have: skip it, the client falls back to a full state */
+    if (len == -ENOENT) {
+        dbg("input %u: no base\n", st.seq);
+        return input_delta_size(buf, size);
+    }
+
+    n->input_seq = st.seq;
+    memset(&m, 0, sizeof(m));
+    m.type   = MT_INPUT;
+    m.source = n->src;
+    input_state_unpack(&st, &m.input);
+    network_node_message(n, &m);
+
+    /* the next snapshot acks it, unless there are none to speak of */
+    if (++n->input_unacked < INPUT_ACK_BATCH)
+        return len;
+
+    CHECK(ack = calloc(1, sizeof(*ack)));
+    ack->input_ack = 1;
+    ack->input_seq = st.seq;
+    queue_outmsg(n, ack, sizeof(*ack));
+    n->input_unacked = 0;
+
+    return len;
+}
+
 /*
  * Handle one command message; return number of bytes consumed.
  */
@@ -645,6 +1254,23 @@ static ssize_t handle_server_command(struct network_node *n, uint8_t *buf, size_
             fprintf(n->log_f, "[%" PRItvsec ".%09" PRItvsec "] %-*s", ml->ts.tv_sec, ml->ts.tv_nsec, ml->length, ml->msg);
         }
     }
+    if (mcmd->status && n->log_f) {
+        struct frame_stats *ft = &mcmd->frame_time, *st = &mcmd->session_frame_time;
+
+        fprintf(n->log_f, "[status] fps %u frame us p50 %u p95 %u p99 %u max %u; "
+                "session p50 %u p95 %u p99 %u max %u\n", mcmd->fps,
+                ft->p50, ft->p95, ft->p99, ft->max, st->p50, st->p95, st->p99, st->max);
+    }
+    if (mcmd->snapshot_ack) {
+        if (n->snapshot_acked < 0 || (int16_t)(mcmd->snapshot_seq - n->snapshot_acked) > 0)
+            n->snapshot_acked = (uint16_t)mcmd->snapshot_seq;
+        return ret;
+    }
+    if (mcmd->input_follows) {
+        ssize_t len = handle_server_input_delta(n, buf + sizeof(*mcmd), size - sizeof(*mcmd));
+
+        return len < 0 ? len : (ssize_t)sizeof(*mcmd) + len;
+    }
 
     /*
      * This is for the future; the condition needs to be
@@ -654,7 +1280,7 @@ static ssize_t handle_server_command(struct network_node *n, uint8_t *buf, size_
         m.type   = MT_COMMAND;
         m.source = n->src;
         memcpy(&m.cmd, mcmd, sizeof(m.cmd));
-        message_send(&m);
+        network_node_message(n, &m);
     }
 
     return ret;
@@ -683,75 +1309,172 @@ static ssize_t handle_input(struct network_node *n, uint8_t *buf, size_t size)
     return handle_server_input(n, buf, size);
 }
 
-struct wsheader _wsh;
+static struct net_payload *net_payload_new(void *data, size_t size)
+{
+    struct net_payload *p;
 
-static void queue_outmsg(struct network_node *n, void *data, size_t size)
+    if (!data)
+        return NULL;
+
+    p = ref_new(net_payload);
+    if (!p) {
+        free(data);
+        return NULL;
+    }
+
+    p->data = data;
+    p->size = size;
+
+    return p;
+}
+
+/* @p gets a reference for each node it's queued on */
+static void queue_payload(struct network_node *n, struct net_payload *p,
+                          const uint8_t *hdr, size_t hdrsz)
 {
     struct queued *qd;
 
+    CHECK(qd = calloc(1, sizeof(*qd)));
+
+    memcpy(qd->hdr, hdr, hdrsz);
+    qd->hdrsz   = hdrsz;
+    qd->payload = ref_get(p);
+    list_append(&n->out_queue, &qd->entry);
+    if (list_empty(&n->out_entry))
+        list_append(&n->reactor->out_pending, &n->out_entry);
+
+    n->events |= POLLOUT;
+}
+
+/* takes over @data */
+static void queue_outmsg(struct network_node *n, void *data, size_t size)
+{
+    uint8_t hdr[WS_HDR_MAX];
+    struct net_payload *p;
+    size_t hdrsz = 0;
+
     if (!size)
         size = strlen(data) + 1;
 
-    CHECK(qd = calloc(1, sizeof(*qd)));
+    CHECK(p = net_payload_new(data, size));
+    if (n->websocket)
+        hdrsz = ws_encode_header(hdr, size);
 
-    if (n->websocket) {
-        uint8_t *frame;
-        size_t  framesz;
+    queue_payload(n, p, hdr, hdrsz);
+    ref_put(p);
+}
 
-        CHECK0(ws_encode(data, size, &frame, &framesz));
+static void queue_flush(struct network_node *n)
+{
+    struct queued *qd, *_qd;
 
-        free(data); /* XXX: unless it's static; don't queue static stuff */
-        data = frame;
-        size = framesz;
+    list_for_each_entry_iter(qd, _qd, &n->out_queue, entry) {
+        list_del(&qd->entry);
+        ref_put(qd->payload);
+        free(qd);
     }
+    n->out_off = 0;
+}
 
-    qd->out    = (void *)data;
-    qd->outsz  = size;
-    list_append(&n->out_queue, &qd->entry);
+/* unconsumed data */
+static inline uint8_t *net_buf_head(struct net_buf *b)
+{
+    return b->data + b->off;
+}
 
-    n->events |= POLLOUT;
+static inline size_t net_buf_size(struct net_buf *b)
+{
+    return b->len - b->off;
 }
 
-static void network_node_cache(struct network_node *n, size_t off)
+static int net_buf_append(struct net_buf *b, const void *data, size_t size)
 {
-    void *xx;
-    CHECK(xx = memdup(n->input + off, n->inputsz - off));
-    free(n->input);
-    n->input = xx;
-    n->inputsz -= off;
+    size_t cap, used = net_buf_size(b);
+    uint8_t *buf;
+
+    if (b->len + size > b->cap && b->off) {
+        memmove(b->data, net_buf_head(b), used);
+        b->off = 0;
+        b->len = used;
+    }
+
+    if (b->len + size > b->cap) {
+        if (used + size > NET_BUF_HIGH)
+            return -ENOSPC;
+
+        for (cap = max(b->cap, NET_BUF_MIN); cap < used + size; cap *= 2)
+            ;
+        buf = realloc(b->data, cap);
+        if (!buf)
+            return -ENOMEM;
+        b->data = buf;
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->len, data, size);
+    b->len += size;
+
+    return 0;
 }
 
-static size_t network_node_uncache(struct network_node *n, uint8_t *buf, size_t size)
+static void net_buf_consume(struct net_buf *b, size_t size)
 {
-    CHECK(n->input = realloc(n->input, n->inputsz + size));
-    memcpy(n->input + n->inputsz, buf, size);
-    n->inputsz += size;
-    return n->inputsz;
+    b->off += size;
+    if (b->off == b->len)
+        b->off = b->len = 0;
 }
 
-static void network_node_wscache(struct network_node *n, size_t off)
+/* hand over all the complete messages, returns the size of those */
+static size_t handle_messages(struct network_node *n, uint8_t *buf, size_t size)
 {
-    void *xx;
-    CHECK(xx = memdup(n->wsinput + off, n->wsinputsz - off));
-    free(n->wsinput);
-    n->wsinput = xx;
-    n->wsinputsz -= off;
+    ssize_t handled;
+    size_t done = 0;
+
+    while (done < size) {
+        handled = handle_input(n, buf + done, size - done);
+        dbg("<== handled %zd of %zu\n", handled, size - done);
+        if (handled <= 0 || n->state == ST_ERROR)
+            break;
+
+        done += handled;
+    }
+
+    return done;
 }
 
-static size_t network_node_wsuncache(struct network_node *n, uint8_t *buf, size_t size)
+/*
+ * Without anything left over from before, the messages are handled where
+ * they are and only the partial one at the end gets buffered
+ */
+static int network_node_input(struct network_node *n, uint8_t *buf, size_t size)
 {
-    CHECK(n->wsinput = realloc(n->wsinput, n->wsinputsz + size));
-    memcpy(n->wsinput + n->wsinputsz, buf, size);
-    n->wsinputsz += size;
-    return n->wsinputsz;
+    size_t done;
+    int    ret;
+
+    if (!net_buf_size(&n->input)) {
+        done = handle_messages(n, buf, size);
+        if (done == size || n->state == ST_ERROR)
+            return 0;
+
+        return net_buf_append(&n->input, buf + done, size - done);
+    }
+
+    ret = net_buf_append(&n->input, buf, size);
+    if (ret)
+        return ret;
+
+    done = handle_messages(n, net_buf_head(&n->input), net_buf_size(&n->input));
+    net_buf_consume(&n->input, done);
+
+    return 0;
 }
 
+/* 0: all done, 1: short read, waiting for more; -1: @n is gone */
 static int process_input(struct network_node *n, uint8_t *buf, size_t size)
 {
-    size_t total, handled = 0;
-    size_t xsz, done = 0;
     ssize_t ret;
     int    op = -1;
+    size_t xsz;
     uint8_t *x;
 
     /*
@@ -762,188 +1485,331 @@ static int process_input(struct network_node *n, uint8_t *buf, size_t size)
      *          - short read -> more ws data
      * If socket is not ws, only one stage.
      */
+    if (!n->websocket) {
+        if (network_node_input(n, buf, size))
+            goto overflow;
+        return 0;
+    }
 
-    if (n->websocket)
-        total = network_node_wsuncache(n, buf, size);
-    else
-        total = size;
+    if (net_buf_append(&n->wsinput, buf, size))
+        goto overflow;
 
     /* decode all complete frames */
-    while (total > 0) {
-        x = n->input;
-        xsz = total;
-        if (n->websocket) {
-            ret = ws_decode(n->wsinput + done, total, &x, &xsz, &op);
-            /* incomplete packet: cache what we have for the next round */
-            if (ret < 0) {
-                network_node_wscache(n, done);
-                goto out_short;
-            }
-
-            /* paste what we decoded with what was cached from before */
-            network_node_uncache(n, x, xsz);
-            size = ret;
-        } else {
-            network_node_uncache(n, buf, size);
-        }
+    while (net_buf_size(&n->wsinput)) {
+        ret = ws_decode(net_buf_head(&n->wsinput), net_buf_size(&n->wsinput), &x, &xsz, &op);
+        /* incomplete frame: it stays buffered for the next round */
+        if (ret < 0)
+            goto out_short;
 
-        handled = 0;
+        /* @x stays valid: consuming doesn't move the data */
+        net_buf_consume(&n->wsinput, ret);
 
         /*
-         * making it handle multiple messages, if in fact, one WS frame
-         * contains multiple messages
+         * XXX: what does a data short look like?
+         * if it comes wrapped in a ws frame;
+         * messages shouldn't span multiple ws frames
          */
-        do {
-            ssize_t xhandled;
-
-            xhandled = handle_input(n, n->input + handled, n->inputsz - handled);
-
-            /*
-             * XXX: what does a data short look like?
-             * if it comes wrapped in a ws frame;
-             * messages shouldn't span multiple ws frames
-             */
-            dbg("<== handled / xhandled: %zu / %zd\n", handled, xhandled);
-            if (xhandled < 0) {
-                network_node_cache(n, handled);
-                break;
-            }
-            if (n->state == ST_ERROR) {
-                // ref_put(n);
-                return 0;
-            }
-            handled += xhandled;
-        } while (handled > 0 && handled < n->inputsz);
-
-        if (handled == n->inputsz) {
-            free(n->input);
-            n->input = NULL;
-            n->inputsz = 0;
-        }
-        total -= size;
-        done += size;
-
-        if (n->websocket)
-            free(x);
-    }
-
-    if (n->websocket) {
-        free(n->wsinput);
-        n->wsinput = NULL;
-        n->wsinputsz = 0;
+        if (network_node_input(n, x, xsz))
+            goto overflow;
+        if (n->state == ST_ERROR)
+            return 0;
     }
 
     return 0;
 
 out_short:
-    if (n->websocket) {
-        if (op == WSOP_FIN) {
-            ref_put(n);
-        }
+    if (op == WSOP_FIN) {
+        ref_put(n);
+        return -1;
     }
 
     return 1;
+
+overflow:
+    err("'%s': more than %d bytes of incomplete input\n", node_name(n), NET_BUF_HIGH);
+    n->state = ST_ERROR;
+    return 0;
 }
 
-void networking_poll(void)
+/*
+ * Sends out as much of the queue as the socket takes; a frame stays queued
+ * until all of it is out, and a short write carries on from @out_off next
+ * time the node is writable, with POLLOUT still armed
+ */
+static void network_node_flush(struct network_node *n)
 {
-    struct network_node *n, *it, *child;
-    int                 i = 0, events;
-    uint8_t             buf[4096];
-    ssize_t             ret;
+    struct queued *qd, *_qd;
+    ssize_t ret;
 
-    memset(buf, 0, sizeof(buf));
-    polling_update();
-    if (nr_nodes == 0) {
-        n = client_setup(_ncfg);
-    }
+    if (n->state == ST_INIT)
+        n->state = ST_HANDSHAKE;
+    list_for_each_entry_iter(qd, _qd, &n->out_queue, entry) {
+        size_t total = qd->hdrsz + qd->payload->size;
+        size_t off = n->out_off;
+        struct iovec iov[2];
+        struct msghdr msg = {
+            .msg_name       = &n->sa,
+            .msg_namelen    = n->addrlen,
+            .msg_iov        = iov,
+        };
+
+        if (off < qd->hdrsz) {
+            iov[0] = (struct iovec){ .iov_base = qd->hdr + off, .iov_len = qd->hdrsz - off };
+            iov[1] = (struct iovec){ .iov_base = qd->payload->data, .iov_len = qd->payload->size };
+            msg.msg_iovlen = 2;
+        } else {
+            off -= qd->hdrsz;
+            iov[0] = (struct iovec){
+                .iov_base   = (uint8_t *)qd->payload->data + off,
+                .iov_len    = qd->payload->size - off
+            };
+            msg.msg_iovlen = 1;
+        }
 
-    ret = poll(pollfds, nr_nodes, _ncfg->timeout);
-    if (ret <= 0)
-        goto state;
+        //dbg("sending[%d]: <-- %zu+%zu @%zu\n", n->fd, qd->hdrsz, qd->payload->size, n->out_off);
+        ret = sendmsg(n->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0) {
+            /* the socket is full, try again when it's writable */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+
+            err("'%s': sendmsg: %m\n", node_name(n));
+            n->state = ST_ERROR;
+            queue_flush(n);
+            break;
+        }
 
-    //dbg("polled: %d\n", ret);
-    list_for_each_entry_iter(n, it, &nodes, entry) {
-        events = pollfds[i].revents;
-        // dbg("pollfd[%d]: %x\n", i, events);
-        pollfds[i].revents = 0;
-        /* First, new incoming connections */
-        if (n->mode == LISTEN && (events & POLLIN)) {
-            CHECK(child = network_node_accept(n));
-            dbg("accepted client connection\n");
-            ret = recvfrom(child->fd, buf, sizeof(buf), 0, (struct sockaddr *)&child->sa, &child->addrlen);
-            //dbg("Handshake: '%s'\n", buf);
-            if (ret < 0)
-                continue;
-            if (child->handshake)
-                child->handshake(child, buf);
-            else
-                process_input(child, buf, ret);
-
-            if (child->state == ST_ERROR)
-                ref_put(child);
-            else
-                child->events |= POLLOUT;
+        n->out_off += ret;
+        if (n->out_off < total)
+            return;
 
-            continue;
+        n->out_off = 0;
+        list_del(&qd->entry);
+        ref_put(qd->payload);
+        free(qd);
+
+        //n->outsz = asprintf(&n->out, "PING");
+        if (n->handshake) {
+            n->websocket = true;
+            n->handshake = NULL;
         }
-        /* Second, new data on existing connections */
-        if (events & POLLIN) {
-            memset(buf, 0, sizeof(buf));
-            ret = recvfrom(n->fd, buf, sizeof(buf), 0, (struct sockaddr *)&n->sa, &n->addrlen);
+    }
+    n->events &= ~POLLOUT;
+    list_del(&n->out_entry);
+}
+
+/* @events are poll(2)'s; returns false if @n is gone */
+static bool network_node_events(struct network_node *n, int events, uint8_t *buf, size_t bufsz)
+{
+    struct network_node *child;
+    ssize_t ret;
+    int short_read;
+
+    /* First, new incoming connections */
+    if (n->mode == LISTEN && (events & POLLIN)) {
+        CHECK(child = network_node_accept(n));
+        dbg("accepted client connection\n");
+        memset(buf, 0, bufsz);
+        ret = recvfrom(child->fd, buf, bufsz, 0, (struct sockaddr *)&child->sa, &child->addrlen);
+        //dbg("Handshake: '%s'\n", buf);
+        /* after the handshake's blocking read */
+        network_node_watch(child);
+        if (ret < 0)
+            return true;
+        if (child->handshake)
+            child->handshake(child, buf);
+        else if (process_input(child, buf, ret) < 0)
+            return true;
+
+        if (child->state == ST_ERROR)
+            ref_put(child);
+        else
+            child->events |= POLLOUT;
+
+        return true;
+    }
+    /* Second, new data on existing connections */
+    if (events & POLLIN) {
+        do {
+            memset(buf, 0, bufsz);
+            ret = recvfrom(n->fd, buf, bufsz, 0, (struct sockaddr *)&n->sa, &n->addrlen);
             if (!ret) {
-                dbg("pollfd[%d]: shutting down\n", i);
+                dbg("fd %d: shutting down\n", n->fd);
                 ref_put(n);
-                continue;
+                return false;
             }
             if (ret > 0) {
-                dbg("new data on %d: %zd bytes (+ %zu/%zu bytes left over):\n", i, ret, n->inputsz, n->wsinputsz);
+                dbg("new data on %d: %zd bytes (+ %zu/%zu bytes left over):\n", n->fd, ret,
+                    net_buf_size(&n->input), net_buf_size(&n->wsinput));
 
-                if (process_input(n, buf, ret))
-                    goto next;
+                short_read = process_input(n, buf, ret);
+                if (short_read < 0)
+                    return false;
+                /* more data is coming, unless there's no telling */
+                if (short_read && !n->edge)
+                    return true;
 
                 if (n->state == ST_ERROR) {
                     ref_put(n);
-                    continue;
+                    return false;
                 }
-            } else if (ret < 0) {
-                err("recvfrom[%d] returned %zd: %m // %x\n", i, ret, events);
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                err("recvfrom[%d] returned %zd: %m // %x\n", n->fd, ret, events);
             }
-        }
-        /* Third, hangups */
-        if (events & POLLHUP) {
-            ref_put(n);
+        } while (ret > 0 && n->edge);
+    }
+    /* Third, hangups */
+    if (events & POLLHUP) {
+        ref_put(n);
+        return false;
+    }
+    /* Fourth, send out queued data */
+    if (events & POLLOUT)
+        network_node_flush(n);
+
+    return true;
+}
+
+#ifdef CONFIG_NET_EPOLL
+#define NET_EPOLL_EVENTS 64
+
+/*
+ * With edge triggering, EPOLLOUT only comes when a connection becomes
+ * writable (connects, for one), so whatever got queued in the meantime
+ * goes out before waiting
+ */
+static void networking_epoll(struct net_reactor *r, uint8_t *buf, size_t bufsz)
+{
+    struct epoll_event evs[NET_EPOLL_EVENTS];
+    struct network_node *n, *it;
+    uint64_t posted;
+    int i, nr;
+
+    net_reactor_inbox(r);
+    list_for_each_entry_iter(n, it, &r->out_pending, out_entry)
+        if (n->state != ST_INIT)
+            network_node_flush(n);
+
+    nr = epoll_wait(r->epfd, evs, array_size(evs), _ncfg->timeout);
+    for (i = 0; i < nr; i++) {
+        uint32_t ev = evs[i].events;
+        int events = (ev & EPOLLIN ? POLLIN : 0) | (ev & EPOLLOUT ? POLLOUT : 0) |
+                     (ev & (EPOLLHUP | EPOLLERR) ? POLLHUP : 0);
+
+        /* the wakeup, the posts are picked up on the next round */
+        if (!evs[i].data.ptr) {
+            if (read(r->wakefd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+                err("eventfd read: %m\n");
             continue;
         }
-        /* Fourth, send out queued data */
-        if (events & POLLOUT) {
-            struct queued *qd, *_qd;
-
-            if (n->state == ST_INIT)
-                n->state = ST_HANDSHAKE;
-            list_for_each_entry_iter(qd, _qd, &n->out_queue, entry) {
-                //dbg("sending[%d]: <-- %zd\n", i, qd->outsz);
-                ret = sendto(n->fd, qd->out, qd->outsz, MSG_NOSIGNAL, (struct sockaddr *)&n->sa, n->addrlen);
-                free(qd->out);
-
-                list_del(&qd->entry);
-                free(qd);
-
-                //n->outsz = asprintf(&n->out, "PING");
-                if (n->handshake) {
-                    n->websocket = true;
-                    n->handshake = NULL;
-                }
-            }
-            n->events &= ~POLLOUT;
-        }
 
-next:
-        i++;
+        network_node_events(evs[i].data.ptr, events, buf, bufsz);
+    }
+}
+
+static int net_reactor_init(struct net_reactor *r)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    if (r != &reactors[0]) {
+        list_init(&r->nodes);
+        list_init(&r->out_pending);
+    }
+    atomic_init(&r->inbox, NULL);
+    atomic_init(&r->stop, false);
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0)
+        return -errno;
+
+    r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wakefd < 0 || epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev)) {
+        if (r->wakefd >= 0)
+            close(r->wakefd);
+        close(r->epfd);
+        r->epfd = r->wakefd = -1;
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void net_reactor_done(struct net_reactor *r)
+{
+    if (r->epfd >= 0)
+        close(r->epfd);
+    if (r->wakefd >= 0)
+        close(r->wakefd);
+    r->epfd = r->wakefd = -1;
+}
+
+static void *net_reactor_thread(void *data)
+{
+    struct net_reactor *r = data;
+    struct network_node *n, *it;
+    uint8_t buf[4096];
+
+    net_self = r;
+    while (!atomic_load_explicit(&r->stop, memory_order_acquire))
+        networking_epoll(r, buf, sizeof(buf));
+
+    /* networking_done()'s restart, what's queued goes out as far as it can */
+    net_reactor_inbox(r);
+    list_for_each_entry_iter(n, it, &r->out_pending, out_entry)
+        if (n->state != ST_INIT)
+            network_node_flush(n);
+
+    list_for_each_entry_iter(n, it, &r->nodes, entry)
+        ref_put(n);
+
+    return NULL;
+}
+#endif /* CONFIG_NET_EPOLL */
+
+void networking_poll(void)
+{
+    struct net_reactor  *r = &reactors[0];
+    struct network_node *n, *it;
+    unsigned int        i = 0;
+    uint8_t             buf[4096];
+    int                 events;
+    ssize_t             ret;
+
+    if (list_empty(&r->nodes))
+        n = client_setup(_ncfg);
+
+    /* whatever the other threads have logged goes out with this round */
+    log_rb_flush();
+    /* and what the other reactors' clients have sent */
+    if (nr_reactors > 1)
+        net_sources_reap();
+
+#ifdef CONFIG_NET_EPOLL
+    if (r->epfd >= 0) {
+        networking_epoll(r, buf, sizeof(buf));
+        goto state;
+    }
+#endif /* CONFIG_NET_EPOLL */
+
+    polling_update(r);
+    ret = poll(r->pollfds, r->nr_nodes, _ncfg->timeout);
+    if (ret <= 0)
+        goto state;
+
+    //dbg("polled: %d\n", ret);
+    list_for_each_entry_iter(n, it, &r->nodes, entry) {
+        /* accepted in this round, not polled yet */
+        if (i == r->nr_nodes)
+            break;
+
+        events = r->pollfds[i].revents;
+        // dbg("pollfd[%d]: %x\n", i, events);
+        r->pollfds[i++].revents = 0;
+        network_node_events(n, events, buf, sizeof(buf));
     }
 
 state:
-    list_for_each_entry(n, &nodes, entry) {
+    list_for_each_entry(n, &r->nodes, entry) {
         //dbg_on(n->mode == CLIENT, "n->state: %d\n", n->state);
         if (n->mode == CLIENT && n->state == ST_HANDSHAKE) {
             struct message_command *mcmd;
@@ -968,21 +1834,127 @@ static void socket_callback(int fd, void *data)
 }
 #endif /* __EMSCRIPTEN__ */
 
+/* subscribers can't be removed, so these outlive networking_done() */
+static bool input_subscribed, status_subscribed;
+
+/* the kernel spreads the connections between the reactors' listeners */
+static int net_reactor_listen(struct net_reactor *r)
+{
+    struct network_node *n;
+
+    n = server_setup(r, _ncfg->server_ip, _ncfg->server_port);
+    if (!n)
+        return -EINVAL;
+
+    n = server_setup(r, _ncfg->server_ip, _ncfg->server_wsport);
+    if (!n)
+        return -EINVAL;
+
+    n->data      = &r->wsh;
+    n->handshake = websocket_parse;
+    r->need_polling_alloc++;
+
+    return 0;
+}
+
+static void net_reactor_drop_nodes(struct net_reactor *r)
+{
+    struct network_node *n, *it;
+
+    list_for_each_entry_iter(n, it, &r->nodes, entry)
+        ref_put(n);
+}
+
+#ifdef CONFIG_NET_EPOLL
+/* the server's reactors beyond the first one, on their own threads */
+static void net_reactors_start(void)
+{
+    unsigned int i, nr = nr_reactors;
+
+    for (i = 1; i < nr; i++)
+        if (net_reactor_init(&reactors[i]) || net_reactor_listen(&reactors[i])) {
+            warn("couldn't set up reactor %u: %m\n", i);
+            net_reactor_drop_nodes(&reactors[i]);
+            net_reactor_done(&reactors[i]);
+            break;
+        }
+    nr = i;
+
+    /*
+     * ref classes are set up by their first object, which can't race with
+     * the other threads; network_node's already is, by the listeners
+     */
+    ref_put(net_payload_new(memdup("", 1), 1));
+
+    for (i = 1; i < nr; i++)
+        if (pthread_create(&reactors[i].thread, NULL, net_reactor_thread, &reactors[i])) {
+            warn("couldn't start reactor %u\n", i);
+            break;
+        }
+
+    nr_reactors = i;
+    for (; i < nr; i++) {
+        net_reactor_drop_nodes(&reactors[i]);
+        net_reactor_done(&reactors[i]);
+    }
+    msg("networking: %u reactors\n", nr_reactors);
+}
+#endif /* CONFIG_NET_EPOLL */
+
+static void net_reactors_stop(void)
+{
+#ifdef CONFIG_NET_EPOLL
+    unsigned int i;
+
+    for (i = 1; i < nr_reactors; i++) {
+        atomic_store_explicit(&reactors[i].stop, true, memory_order_release);
+        net_reactor_wake(&reactors[i]);
+    }
+
+    for (i = 1; i < nr_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+        net_reactor_done(&reactors[i]);
+    }
+#endif /* CONFIG_NET_EPOLL */
+}
+
 int networking_init(struct networking_config *cfg, enum mode mode)
 {
     struct network_node *n;
 
     _ncfg = memdup(cfg, sizeof(*cfg));
+#ifdef CONFIG_NET_EPOLL
+    if (net_reactor_init(&reactors[0]))
+        warn("epoll_create1 failed: %m, falling back to poll()\n");
+#endif /* CONFIG_NET_EPOLL */
     switch (mode) {
     case CLIENT:
         CHECK(n = client_setup(_ncfg));
+        if (cfg->input && !input_subscribed) {
+            subscribe(MT_INPUT, forward_input, NULL);
+            input_subscribed = true;
+        }
+        if (cfg->status && !status_subscribed) {
+            subscribe_mask(MT_COMMAND, forward_status, NULL, MSG_COMMAND(status));
+            status_subscribed = true;
+        }
         break;
     case SERVER:
-        CHECK(n = server_setup(_ncfg->server_ip, _ncfg->server_port));
-        CHECK(n = server_setup(_ncfg->server_ip, _ncfg->server_wsport));
-        n->data      = &_wsh;
-        n->handshake = websocket_parse;
-        need_polling_alloc++;
+        /* before any of the listeners, they all need SO_REUSEPORT */
+        if (cfg->reactors > NET_REACTORS_MAX)
+            warn("%u reactors requested, making %u\n", cfg->reactors, NET_REACTORS_MAX);
+#ifdef CONFIG_NET_EPOLL
+        if (reactors[0].epfd >= 0)
+            nr_reactors = clamp(cfg->reactors, 1, NET_REACTORS_MAX);
+#endif /* CONFIG_NET_EPOLL */
+        if (cfg->reactors > 1 && nr_reactors == 1)
+            warn("no epoll, running a single reactor\n");
+
+        CHECK0(net_reactor_listen(&reactors[0]));
+#ifdef CONFIG_NET_EPOLL
+        if (nr_reactors > 1)
+            net_reactors_start();
+#endif /* CONFIG_NET_EPOLL */
         break;
     default:
         break;
@@ -999,14 +1971,23 @@ void networking_done(void)
 {
     struct network_node *n, *it;
 
+    /* the other reactors send it out on their way down */
     networking_broadcast_restart();
+    net_reactors_stop();
 not_empty:
     networking_poll();
 
-    list_for_each_entry_iter(n, it, &nodes, entry) {
+    list_for_each_entry_iter(n, it, &reactors[0].nodes, entry) {
         if (!list_empty(&n->out_queue))
             goto not_empty;
         ref_put(n);
     }
+
+    if (nr_reactors > 1)
+        net_sources_reap();
+    nr_reactors = 1;
     free(_ncfg);
+#ifdef CONFIG_NET_EPOLL
+    net_reactor_done(&reactors[0]);
+#endif /* CONFIG_NET_EPOLL */
 }
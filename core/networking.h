@@ -8,6 +8,10 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+struct message_input;
+struct message_source;
+struct snapshot;
+
 enum mode {
     CLIENT = 0,
     SERVER,
@@ -20,7 +24,21 @@ struct networking_config {
     unsigned int server_port;
     unsigned int server_wsport;
     unsigned long   logger  : 1;
+    /* client: forward local input to the server */
+    unsigned long   input   : 1;
+    /* client: send the status (fps, frame times) to the server */
+    unsigned long   status  : 1;
     int             timeout;
+    /*
+     * server: the number of reactors, each with its own thread, listeners
+     * (SO_REUSEPORT) and connections; the first one is networking_poll()'s.
+     * The messages from the others' clients are posted, see message_post(),
+     * and networking_poll() drains them. 0 is 1.
+     */
+    unsigned int    reactors;
+    /* client: a world snapshot from the server, see snapshot.h */
+    void            (*snapshot)(const struct snapshot *snap, void *data);
+    void            *snapshot_data;
 };
 
 int networking_init(struct networking_config *cfg, enum mode mode);
@@ -28,5 +46,13 @@ void networking_poll(void);
 void networking_done(void);
 void networking_broadcast_restart(void);
 void networking_broadcast(int mode, void *data, size_t size);
+void networking_send_input(struct message_input *mi);
+/* client: the last input sent to the server, 0 if none */
+uint16_t networking_input_seq(void);
+/*
+ * server: sets @snap->seq if @src is the caller's reactor's; the others
+ * get a copy, later
+ */
+int networking_send_snapshot(struct message_source *src, struct snapshot *snap);
 
 #endif /* __CLAP_NETWORKING_H__ */
@@ -1,38 +1,120 @@
 // SPDX-License-Identifier: Apache-2.0
 #include <stdarg.h>
+#include <stdatomic.h>
 #include "common.h"
 #include "object.h"
 #include "json.h"
+#include "jobs.h"
+
+#ifdef CONFIG_JOBS_THREADED
+#include <pthread.h>
+#endif
 
 static DECLARE_LIST(ref_classes);
 static char ref_classes_string[4096];
 static bool ref_classes_updated;
 
+static struct mem_tag_stats {
+    atomic_size_t   live;
+    atomic_size_t   peak;
+} mem_tags[MEM_TAG_MAX];
+/* ref_classes_updated, but for the jobs */
+static atomic_bool mem_updated;
+
+static const char *mem_tag_names[MEM_TAG_MAX] = {
+    [MEM_MESH]          = "mesh",
+    [MEM_ANIMATION]     = "animation",
+    [MEM_LIB]           = "lib",
+    [MEM_GPU_BUFFER]    = "gpu buffers",
+    [MEM_GPU_TEXTURE]   = "gpu textures",
+};
+
+static bool mem_tag_is_gpu(enum mem_tag tag)
+{
+    return tag == MEM_GPU_BUFFER || tag == MEM_GPU_TEXTURE;
+}
+
+void mem_account(enum mem_tag tag, ssize_t bytes)
+{
+    struct mem_tag_stats *mt = &mem_tags[tag];
+    size_t live, peak;
+
+    live = atomic_fetch_add(&mt->live, bytes) + bytes;
+    peak = atomic_load(&mt->peak);
+    while (live > peak && !atomic_compare_exchange_weak(&mt->peak, &peak, live))
+        ;
+    atomic_store(&mem_updated, true);
+}
+
+void mem_stats_get(enum mem_tag tag, struct mem_stats *stats)
+{
+    stats->live = atomic_load(&mem_tags[tag].live);
+    stats->peak = atomic_load(&mem_tags[tag].peak);
+}
+
+/* the peaks add up to the worst case, they needn't have been at once */
+void mem_stats_total(struct mem_stats *cpu, struct mem_stats *gpu)
+{
+    struct mem_stats ms, *dst;
+    struct ref_class *rc;
+    int tag;
+
+    memset(cpu, 0, sizeof(*cpu));
+    memset(gpu, 0, sizeof(*gpu));
+    list_for_each_entry(rc, &ref_classes, entry) {
+        cpu->live += atomic_load(&rc->nr_active) * rc->size;
+        cpu->peak += atomic_load(&rc->nr_peak) * rc->size;
+    }
+
+    for (tag = 0; tag < MEM_TAG_MAX; tag++) {
+        mem_stats_get(tag, &ms);
+        dst = mem_tag_is_gpu(tag) ? gpu : cpu;
+        dst->live += ms.live;
+        dst->peak += ms.peak;
+    }
+}
+
 static void ref_classes_update(void)
 {
     size_t size, total = 0;
     struct ref_class *rc;
-    char buf[256];
+    struct mem_stats ms;
     unsigned long counter = 0;
+    int tag;
 
     list_for_each_entry(rc, &ref_classes, entry) {
+        unsigned long active = atomic_load(&rc->nr_active);
+
         size = snprintf(&ref_classes_string[total], sizeof(ref_classes_string) - total,
-                        " -> '%s': %lu\n", rc->name, rc->nr_active);
+                        " -> '%s': %lu, %zuk peak %zuk\n", rc->name, active,
+                        active * rc->size / 1024, atomic_load(&rc->nr_peak) * rc->size / 1024);
         if (total + size >= sizeof(ref_classes_string))
-            break;
+            goto out;
         total += size;
         counter++;
     }
 
+    for (tag = 0; tag < MEM_TAG_MAX; tag++) {
+        mem_stats_get(tag, &ms);
+        size = snprintf(&ref_classes_string[total], sizeof(ref_classes_string) - total,
+                        " [%s]: %zuk peak %zuk\n", mem_tag_names[tag], ms.live / 1024,
+                        ms.peak / 1024);
+        if (total + size >= sizeof(ref_classes_string))
+            goto out;
+        total += size;
+    }
+
+out:
     size = snprintf(&ref_classes_string[total], sizeof(ref_classes_string) - total,
                     " total: %lu", counter);
     ref_classes_string[total+size] = 0;
     ref_classes_updated = false;
+    atomic_store(&mem_updated, false);
 }
 
 const char *ref_classes_get_string(void)
 {
-    if (ref_classes_updated)
+    if (ref_classes_updated || atomic_load(&mem_updated))
         ref_classes_update();
     return ref_classes_string;
 }
@@ -56,15 +138,20 @@ void ref_class_add(struct ref *ref)
     if (ref_class_needs_init(rc))
         ref_class_init_lazy(rc);
 
-    if (!ref_is_static(ref))
-        rc->nr_active++;
+    if (!ref_is_static(ref)) {
+        unsigned long active = atomic_fetch_add(&rc->nr_active, 1) + 1;
+        unsigned long peak = atomic_load(&rc->nr_peak);
+
+        while (active > peak && !atomic_compare_exchange_weak(&rc->nr_peak, &peak, active))
+            ;
+    }
     ref_classes_updated = true;
 }
 
 static void ref_class_unuse(struct ref *ref)
 {
     /* not deleting the class itself */
-    ref->refclass->nr_active--;
+    atomic_fetch_sub(&ref->refclass->nr_active, 1);
     ref_classes_updated = true;
 }
 
@@ -74,3 +161,191 @@ void _ref_drop(struct ref *ref)
     ref->refclass->drop(ref);
     ref_free(ref);
 }
+
+/*
+ * Pools: one free list per size class, objects are chained through their
+ * first word while they're on it; slabs are carved up as needed and stay
+ * around after that
+ */
+#define REF_POOL_GRANULE    16
+#define REF_POOL_MAX        1024
+#define REF_POOL_SLAB       (64 * 1024)
+
+struct ref_pool {
+    void            *free;
+#ifdef CONFIG_JOBS_THREADED
+    /* loaders allocate handles off the main thread */
+    pthread_mutex_t lock;
+#endif
+};
+
+static struct ref_pool ref_pools[REF_POOL_MAX / REF_POOL_GRANULE] = {
+#ifdef CONFIG_JOBS_THREADED
+    [0 ... REF_POOL_MAX / REF_POOL_GRANULE - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+#endif
+};
+
+static inline void ref_pool_lock(struct ref_pool *pool)
+{
+#ifdef CONFIG_JOBS_THREADED
+    pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static inline void ref_pool_unlock(struct ref_pool *pool)
+{
+#ifdef CONFIG_JOBS_THREADED
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+static inline struct ref_pool *ref_pool(size_t size)
+{
+    return &ref_pools[(size - 1) / REF_POOL_GRANULE];
+}
+
+static void *ref_pool_alloc(size_t size)
+{
+    struct ref_pool *pool = ref_pool(size);
+    size_t i, obj_size;
+    void **obj;
+    char *slab;
+
+    ref_pool_lock(pool);
+    if (!pool->free) {
+        slab = malloc(REF_POOL_SLAB);
+        if (!slab) {
+            ref_pool_unlock(pool);
+            return NULL;
+        }
+
+        obj_size = ((size - 1) / REF_POOL_GRANULE + 1) * REF_POOL_GRANULE;
+        for (i = 0; i + obj_size <= REF_POOL_SLAB; i += obj_size) {
+            obj = (void **)(slab + i);
+            *obj = pool->free;
+            pool->free = obj;
+        }
+    }
+
+    obj = pool->free;
+    pool->free = *obj;
+    ref_pool_unlock(pool);
+
+    return obj;
+}
+
+static void ref_pool_free(void *p, size_t size)
+{
+    struct ref_pool *pool = ref_pool(size);
+    void **obj = p;
+
+    ref_pool_lock(pool);
+    *obj = pool->free;
+    pool->free = obj;
+    ref_pool_unlock(pool);
+}
+
+/*
+ * Frame arena: bump allocation from a list of chunks, which are kept for
+ * the next frames once everything in them is gone
+ */
+#define REF_FRAME_CHUNK     (64 * 1024)
+#define REF_FRAME_ALIGN     16
+
+struct ref_frame_chunk {
+    struct ref_frame_chunk  *next;
+    size_t                  used;
+    _Alignas(REF_FRAME_ALIGN) char data[REF_FRAME_CHUNK];
+};
+
+static struct ref_frame {
+    struct ref_frame_chunk  *head;
+    struct ref_frame_chunk  *cur;
+    unsigned long           nr_live;
+} ref_frame;
+
+static void *ref_frame_alloc(size_t size)
+{
+    struct ref_frame_chunk *chunk = ref_frame.cur;
+    void *ret;
+
+    size = (size + REF_FRAME_ALIGN - 1) & ~(size_t)(REF_FRAME_ALIGN - 1);
+    if (size > REF_FRAME_CHUNK)
+        return NULL;
+
+    if (!chunk || REF_FRAME_CHUNK - chunk->used < size) {
+        /* the next one is either left over from the previous frames or new */
+        if (chunk && chunk->next) {
+            chunk = chunk->next;
+        } else {
+            struct ref_frame_chunk *new = malloc(sizeof(*new));
+
+            if (!new)
+                return NULL;
+
+            new->next = NULL;
+            if (chunk)
+                chunk->next = new;
+            else
+                ref_frame.head = new;
+            chunk = new;
+        }
+
+        chunk->used = 0;
+        ref_frame.cur = chunk;
+    }
+
+    ret = chunk->data + chunk->used;
+    chunk->used += size;
+    ref_frame.nr_live++;
+
+    return ret;
+}
+
+bool ref_frame_end(void)
+{
+    if (ref_frame.nr_live)
+        return false;
+
+    ref_frame.cur = ref_frame.head;
+    if (ref_frame.cur)
+        ref_frame.cur->used = 0;
+
+    return true;
+}
+
+void *ref_alloc(struct ref_class *rc, bool frame)
+{
+    enum ref_alloc alloc = REF_ALLOC_HEAP;
+    void *obj = NULL;
+
+    if (frame) {
+        obj = ref_frame_alloc(rc->size);
+        alloc = REF_ALLOC_FRAME;
+    } else if (rc->pooled && rc->size <= REF_POOL_MAX) {
+        obj = ref_pool_alloc(rc->size);
+        alloc = REF_ALLOC_POOL;
+    }
+
+    if (!obj) {
+        obj = malloc(rc->size);
+        alloc = REF_ALLOC_HEAP;
+        if (!obj)
+            return NULL;
+    }
+
+    memset(obj, 0, rc->size);
+    ((struct ref *)(obj + rc->offset))->alloc = alloc;
+
+    return obj;
+}
+
+void _ref_free_mem(struct ref *ref)
+{
+    if (ref->alloc == REF_ALLOC_POOL)
+        ref_pool_free(ref_obj(ref), ref->refclass->size);
+    else if (ref->alloc == REF_ALLOC_FRAME)
+        ref_frame.nr_live--;
+    else
+        free(ref_obj(ref));
+}
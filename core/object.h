@@ -2,10 +2,12 @@
 #ifndef __CLAP_OBJECT_H__
 #define __CLAP_OBJECT_H__
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/types.h>
 #include "util.h"
 #include "logger.h"
 #include "json.h" /* XXX: factor out ser/deser code */
@@ -25,7 +27,10 @@ typedef void (*drop_t)(struct ref *ref);
  * @drop:       destructor
  * @size:       object size
  * @offset:     offset of struct ref in an object (see ref_obj())
- * @nr_active:  nr of active objects; not thread-safe
+ * @nr_active:  nr of active objects
+ * @nr_peak:    the most there have been at once; their bytes are these
+ *              times @size
+ * @pooled:     allocate from size class free lists instead of malloc()
  */
 struct ref_class {
     struct list     entry;
@@ -34,11 +39,18 @@ struct ref_class {
     drop_t          drop;
     size_t          size;
     size_t          offset;
-    unsigned long   nr_active;
+    atomic_ulong    nr_active;
+    atomic_ulong    nr_peak;
+    bool            pooled;
 };
 
+/*
+ * Extra arguments are initializers for the rest of the class, like
+ * DECLARE_REFCLASS(entity3d, .pooled = true) for objects that come and
+ * go all the time
+ */
 #define REFCLASS_NAME(struct_name) ref_class_ ## struct_name
-#define DECLARE_REFCLASS_MAKE_DROP(struct_name, makefn, dropfn) \
+#define DECLARE_REFCLASS_MAKE_DROP(struct_name, makefn, dropfn, ...) \
 struct ref_class ref_class_ ## struct_name = { \
     .name   = __stringify(struct struct_name), \
     .make   = makefn, \
@@ -46,28 +58,66 @@ struct ref_class ref_class_ ## struct_name = { \
     .size   = sizeof(struct struct_name), \
     .offset = offsetof(struct struct_name, ref), \
     .entry  = EMPTY_LIST(REFCLASS_NAME(struct_name).entry), \
+    __VA_ARGS__ \
 }
-#define DECLARE_REFCLASS_DROP(struct_name, dropfn) \
-    DECLARE_REFCLASS_MAKE_DROP(struct_name, NULL, dropfn)
-#define DECLARE_REFCLASS(struct_name)   DECLARE_REFCLASS_DROP(struct_name, struct_name ## _drop)
-#define DECLARE_REFCLASS2(struct_name) \
-    DECLARE_REFCLASS_MAKE_DROP(struct_name, struct_name ## _make, struct_name ## _drop)
+#define DECLARE_REFCLASS_DROP(struct_name, dropfn, ...) \
+    DECLARE_REFCLASS_MAKE_DROP(struct_name, NULL, dropfn, __VA_ARGS__)
+#define DECLARE_REFCLASS(struct_name, ...) \
+    DECLARE_REFCLASS_DROP(struct_name, struct_name ## _drop, __VA_ARGS__)
+#define DECLARE_REFCLASS2(struct_name, ...) \
+    DECLARE_REFCLASS_MAKE_DROP(struct_name, struct_name ## _make, struct_name ## _drop, __VA_ARGS__)
+
+/* where an object's memory comes from, see ref_alloc() */
+enum ref_alloc {
+    REF_ALLOC_HEAP = 0,
+    REF_ALLOC_POOL,
+    REF_ALLOC_FRAME,
+};
 
 /*
  * Reference counting
  * @refclass:   class aka type descriptor
  * @count:      the number of active references
  * @consume:    set by ref_pass() so that next ref_get() gets caller's reference
+ * @alloc:      enum ref_alloc
  */
 struct ref {
     struct ref_class    *refclass;
     int		count;
     bool    consume;
+    unsigned char   alloc;
 };
 
 void ref_class_add(struct ref *ref);
+/* the classes' counts and bytes, then the mem_account() tags' */
 const char *ref_classes_get_string(void);
 
+/*
+ * Memory accounting for what the ref classes don't see: the buffers that
+ * hang off of the objects, by what they are, and estimates of what the GL
+ * driver holds on our behalf. mem_account() adds (or, negative, takes away)
+ * @bytes to @tag's live total and keeps track of its peak; it can be called
+ * from the jobs.
+ */
+enum mem_tag {
+    MEM_MESH = 0,
+    MEM_ANIMATION,
+    MEM_LIB,
+    MEM_GPU_BUFFER,
+    MEM_GPU_TEXTURE,
+    MEM_TAG_MAX,
+};
+
+struct mem_stats {
+    size_t  live;
+    size_t  peak;
+};
+
+void mem_account(enum mem_tag tag, ssize_t bytes);
+void mem_stats_get(enum mem_tag tag, struct mem_stats *stats);
+/* all of the ref classes' and the CPU side tags', and the GPU side tags' */
+void mem_stats_total(struct mem_stats *cpu, struct mem_stats *gpu);
+
 static inline const char *_ref_name(struct ref *ref)
 {
     return ref->refclass->name;
@@ -97,12 +147,33 @@ static inline bool ref_is_static(struct ref *ref)
     return ref->count == _REF_STATIC || ref->count == _REF_EMBEDDED;
 }
 
+/*
+ * Zeroed memory for an object of class @rc: pooled classes come from the
+ * size class free lists, @frame objects from the frame arena, the rest
+ * (and whatever doesn't fit) from malloc(); nr_active counts them all
+ * the same
+ */
+void *ref_alloc(struct ref_class *rc, bool frame);
+void _ref_free_mem(struct ref *ref);
+
+/*
+ * Objects from the frame arena (ref_new_frame()) are for things that only
+ * live for a frame, like debug draws. At the end of the frame, if they're
+ * all gone, the arena starts over; if some are still around, it carries on
+ * and tries again next time. Returns true if it did start over.
+ * Main thread only.
+ */
+bool ref_frame_end(void);
+
 #define ref_free(_ref) do { \
     struct ref *__ref = (_ref); \
     if (!ref_is_static(__ref)) { \
         err_on(__ref->count != 0, "freeing object '%s' with refcount %d\n", \
                __ref->refclass->name, __ref->count); \
-        free(ref_obj(__ref)); \
+        if (__ref->alloc == REF_ALLOC_HEAP) \
+            free(ref_obj(__ref)); \
+        else \
+            _ref_free_mem(__ref); \
     } \
 } while (0)
 
@@ -196,11 +267,10 @@ static inline void _ref_put(struct ref *ref)
 /*
  * Dynamically allocate an object
  */
-#define ref_new(struct_name) ({ \
+#define __ref_new(struct_name, frame) ({ \
     struct ref_class *__rc = &ref_class_ ## struct_name; \
-    struct struct_name *__v = malloc(__rc->size); \
+    struct struct_name *__v = ref_alloc(__rc, (frame)); \
     if (__v) { \
-        memset(__v, 0, __rc->size); \
         __v->ref.refclass = __rc; \
         ref_init(&__v->ref); \
         if (__rc->make) __rc->make(&__v->ref); \
@@ -208,6 +278,10 @@ static inline void _ref_put(struct ref *ref)
     __v; \
 })
 
+#define ref_new(struct_name) __ref_new(struct_name, false)
+/* same, from the frame arena, see ref_frame_end() */
+#define ref_new_frame(struct_name) __ref_new(struct_name, true)
+
 /*
  * Initialize a static/embedded object
  */
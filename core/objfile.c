@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -18,205 +19,372 @@
  * Model data
  * Vertices, faces, normal vectors, etc
  ****************************************************************************/
-int model_data_init(struct model_data *md,
-                    unsigned long nr_v,
-                    unsigned long nr_vt,
-                    unsigned long nr_vn,
-                    unsigned long nr_f)
+
+/*
+ * One pass counts the lines of each kind and the face corners, so that
+ * everything is allocated once, at its final size or one upper bound,
+ * the other one parses them. Numbers are parsed by hand, the locale
+ * aware strtod()/sscanf() are most of the time spent otherwise.
+ */
+struct obj_counts {
+    unsigned long   v, vt, vn, idx;
+};
+
+static inline bool obj_space(char c)
 {
-    if (!nr_v)
-        return -EINVAL;
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-    memset(md, 0, sizeof(*md));
+static inline const char *obj_skip_space(const char *p, const char *end)
+{
+    for (; p < end && obj_space(*p); p++)
+        ;
+    return p;
+}
 
-    md->v = malloc(sizeof(float) * nr_v * 3);
-    if (!md->v)
-        return -ENOMEM;
+static inline const char *obj_skip_token(const char *p, const char *end)
+{
+    for (; p < end && !obj_space(*p); p++)
+        ;
+    return p;
+}
 
-    if (nr_vt) {
-        md->vt = malloc(sizeof(float) * nr_vt * 2);
-        if (!md->vt)
-            goto err_vt;
-    }
+static const double pow10_tab[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-    if (nr_vn) {
-        md->vn = malloc(sizeof(float) * nr_vn * 3);
-        if (!md->vn)
-            goto err_vn;
-    }
+static double pow10_int(int e)
+{
+    double r = 1;
 
-    if (nr_f) {
-        md->f = malloc(sizeof(int) * nr_f * 9);
-        if (!md->f)
-            goto err_f;
+    for (; e > 22; e -= 22)
+        r *= 1e22;
+
+    return r * pow10_tab[e];
+}
+
+/* [-+]digits[.digits][(e|E)[-+]digits], NULL if it isn't a number */
+static const char *obj_parse_float(const char *p, const char *end, float *out)
+{
+    int frac = 0, exp = 0, digits = 0, esign = 1;
+    bool neg = false;
+    uint64_t m = 0;
+    double v;
+
+    p = obj_skip_space(p, end);
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        /* past 19 digits, they don't matter to a float */
+        if (m < 1000000000000000000ull)
+            m = m * 10 + *p - '0';
+        else
+            exp++;
+
+    if (p < end && *p == '.')
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+            if (m < 1000000000000000000ull) {
+                m = m * 10 + *p - '0';
+                frac++;
+            }
+
+    if (!digits)
+        return NULL;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int e = 0;
+
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+            esign = *p++ == '-' ? -1 : 1;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            if (e < 1000)
+                e = e * 10 + *p - '0';
+        exp += esign * e;
     }
 
-    md->nr_v  = nr_v  * 3;
-    md->nr_vt = nr_vt * 2;
-    md->nr_vn = nr_vn * 3;
-    md->nr_f  = nr_f  * 9;
-    dbg("nr_v %lu/%lu nr_vt %lu/%lu nr_vn %lu/%lu nr_f %lu/%lu\n",
-        nr_v, md->nr_v, nr_vt, md->nr_vt, nr_vn, md->nr_vn, nr_f, md->nr_f);
+    exp -= frac;
+    v = (double)m;
+    if (exp < 0)
+        v /= pow10_int(min(-exp, 400));
+    else if (exp > 0)
+        v *= pow10_int(min(exp, 400));
 
-    return 0;
-err_f:
-    free(md->vn);
-err_vn:
-    free(md->vt);
-err_vt:
-    free(md->v);
-    return -ENOMEM;
+    *out = neg ? -v : v;
+
+    return p;
 }
 
-int model_data_push_v(struct model_data *md, float v0, float v1, float v2)
+static const char *obj_parse_int(const char *p, const char *end, long *out)
 {
-    if (md->loaded_v >= md->nr_v)
-        return -ENOSPC;
+    bool neg = false;
+    long v = 0;
 
-    md->v[md->loaded_v++] = v0;
-    md->v[md->loaded_v++] = v1;
-    md->v[md->loaded_v++] = v2;
+    if (p < end && *p == '-')
+        neg = *p++ == '-';
 
-    return 0;
+    if (p == end || *p < '0' || *p > '9')
+        return NULL;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        if (v < LONG_MAX / 10)
+            v = v * 10 + *p - '0';
+
+    *out = neg ? -v : v;
+
+    return p;
 }
 
-int model_data_push_vt(struct model_data *md, float v0, float v1)
+/* 1-based, negative from the end, to 0-based; -1 if it's out of range */
+static inline long obj_index(long idx, unsigned long nr)
 {
-    if (md->loaded_vt >= md->nr_vt)
-        return -ENOSPC;
+    if (idx < 0)
+        idx += nr;
+    else
+        idx--;
 
-    md->vt[md->loaded_vt++] = v0;
-    md->vt[md->loaded_vt++] = v1;
+    return idx >= 0 && idx < nr ? idx : -1;
+}
 
-    return 0;
+static void obj_count(const char *p, const char *end, struct obj_counts *c)
+{
+    const char *eol;
+    unsigned int corners;
+
+    memset(c, 0, sizeof(*c));
+    for (; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+
+        if (eol - p < 2)
+            continue;
+
+        if (p[0] == 'v' && obj_space(p[1]))
+            c->v++;
+        else if (p[0] == 'v' && p[1] == 't')
+            c->vt++;
+        else if (p[0] == 'v' && p[1] == 'n')
+            c->vn++;
+        else if (p[0] == 'f' && obj_space(p[1])) {
+            for (corners = 0, p = obj_skip_space(p + 1, eol); p < eol;
+                 p = obj_skip_space(obj_skip_token(p, eol), eol))
+                corners++;
+            if (corners >= 3)
+                c->idx += (corners - 2) * 3;
+        }
+    }
 }
 
-int model_data_push_vn(struct model_data *md, float v0, float v1, float v2)
+struct obj_parser {
+    struct model_data   *md;
+    struct obj_counts   nr;
+    float               *v, *vt, *vn;
+    /* v/vt/vn of each vertex, to tell hash collisions apart */
+    long                (*triples)[3];
+    struct hashmap      vertices;
+};
+
+/*
+ * The index of the vertex for this corner, adding it if it's new; the
+ * key is a hash of the triple, so a collision only means a duplicate
+ * vertex, not a wrong one
+ */
+static int obj_vertex(struct obj_parser *op, long triple[3])
 {
-    if (md->loaded_vn >= md->nr_vn)
-        return -ENOSPC;
+    struct model_data *md = op->md;
+    unsigned int key = triple[0] + triple[1] * 0x9e3779b1u + triple[2] * 0x85ebca6bu;
+    unsigned long vx;
+    void *found;
+
+    found = hashmap_find(&op->vertices, key);
+    if (found) {
+        vx = (uintptr_t)found - 1;
+        if (!memcmp(op->triples[vx], triple, sizeof(op->triples[vx])))
+            return vx;
+    }
 
-    md->vn[md->loaded_vn++] = v0;
-    md->vn[md->loaded_vn++] = v1;
-    md->vn[md->loaded_vn++] = v2;
+    if (md->nr_vx > USHRT_MAX)
+        return -E2BIG;
 
-    return 0;
+    vx = md->nr_vx++;
+    memcpy(op->triples[vx], triple, sizeof(op->triples[vx]));
+    memcpy(&md->v[vx * 3], &op->v[triple[0] * 3], sizeof(float) * 3);
+    if (md->vt && triple[1] >= 0) {
+        md->vt[vx * 2]     = op->vt[triple[1] * 2];
+        md->vt[vx * 2 + 1] = 1 - op->vt[triple[1] * 2 + 1];
+    }
+    if (triple[2] >= 0)
+        memcpy(&md->vn[vx * 3], &op->vn[triple[2] * 3], sizeof(float) * 3);
+
+    if (!found)
+        hashmap_insert(&op->vertices, key, (void *)(uintptr_t)(vx + 1));
+
+    return vx;
 }
 
-int model_data_push_f(struct model_data *md, int f[9])
+/* v, v/vt, v//vn or v/vt/vn */
+static const char *obj_parse_corner(struct obj_parser *op, const char *p, const char *end,
+                                    unsigned long nr_v, unsigned long nr_vt, unsigned long nr_vn,
+                                    long triple[3])
 {
-    int i;
+    long idx;
+
+    triple[1] = triple[2] = -1;
+    p = obj_parse_int(p, end, &idx);
+    if (!p || (triple[0] = obj_index(idx, nr_v)) < 0)
+        return NULL;
+
+    if (p < end && *p == '/') {
+        p++;
+        if (p < end && *p != '/') {
+            p = obj_parse_int(p, end, &idx);
+            if (!p || (triple[1] = obj_index(idx, nr_vt)) < 0)
+                return NULL;
+        }
 
-    if (md->loaded_f >= md->nr_f)
-        return -ENOSPC;
+        if (p < end && *p == '/') {
+            p = obj_parse_int(p + 1, end, &idx);
+            if (!p || (triple[2] = obj_index(idx, nr_vn)) < 0)
+                return NULL;
+        }
+    }
+
+    return p;
+}
 
-    for (i = 0; i < 9; i++)
-        md->f[md->loaded_f++] = f[i] - 1;
+static int obj_parse(struct obj_parser *op, const char *p, const char *end)
+{
+    unsigned long nr_v = 0, nr_vt = 0, nr_vn = 0, corner;
+    struct model_data *md = op->md;
+    long triple[3];
+    int first, prev, vx;
+    const char *eol;
+    float *f;
+
+    for (; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+
+        if (eol - p < 2)
+            continue;
+
+        if (p[0] == 'v' && obj_space(p[1])) {
+            f = &op->v[nr_v++ * 3];
+            if (!(p = obj_parse_float(p + 1, eol, &f[0])) ||
+                !(p = obj_parse_float(p, eol, &f[1])) ||
+                !(p = obj_parse_float(p, eol, &f[2])))
+                return -EINVAL;
+        } else if (p[0] == 'v' && p[1] == 't') {
+            f = &op->vt[nr_vt++ * 2];
+            if (!(p = obj_parse_float(p + 2, eol, &f[0])))
+                return -EINVAL;
+            /* the second one is optional */
+            if (!obj_parse_float(p, eol, &f[1]))
+                f[1] = 0;
+        } else if (p[0] == 'v' && p[1] == 'n') {
+            f = &op->vn[nr_vn++ * 3];
+            if (!(p = obj_parse_float(p + 2, eol, &f[0])) ||
+                !(p = obj_parse_float(p, eol, &f[1])) ||
+                !(p = obj_parse_float(p, eol, &f[2])))
+                return -EINVAL;
+        } else if (p[0] == 'f' && obj_space(p[1])) {
+            /* fan out of the first corner */
+            first = prev = -1;
+            for (corner = 0, p = obj_skip_space(p + 1, eol); p < eol;
+                 p = obj_skip_space(p, eol), corner++) {
+                p = obj_parse_corner(op, p, eol, nr_v, nr_vt, nr_vn, triple);
+                if (!p)
+                    return -EINVAL;
+
+                vx = obj_vertex(op, triple);
+                if (vx < 0)
+                    return vx;
+
+                if (corner >= 2) {
+                    md->idx[md->nr_idx++] = first;
+                    md->idx[md->nr_idx++] = prev;
+                    md->idx[md->nr_idx++] = vx;
+                }
+
+                if (!corner)
+                    first = vx;
+                prev = vx;
+            }
+        }
+        /* o, g, s, usemtl, mtllib, comments: nothing to do with those here */
+    }
 
     return 0;
 }
 
 struct model_data *model_data_new_from_obj(const char *base, size_t size)
 {
-    const char *p, *pend;
-    int s, vecs = 0, other = 0, vts = 0, vns = 0, fs = 0, pass = 0;
+    const char *end = base + size;
+    struct obj_parser op = {};
     struct model_data *md;
+    unsigned long nr, buckets;
+    int err = -ENOMEM;
 
     if (!size)
         return NULL;
 
-    md = malloc(sizeof(*md));
+    obj_count(base, end, &op.nr);
+    if (!op.nr.v || !op.nr.idx)
+        return NULL;
+
+    /* no more vertices than there are corners */
+    nr = min(op.nr.idx, USHRT_MAX + 1ul);
+
+    md = calloc(1, sizeof(*md));
     if (!md)
         return NULL;
 
-again:
-    for (s = 0, p = base; p - base < size;) {
-        float r0, r1, r2;
-        int f[9];
-
-        pend = strchr(p, '\n');
-        if (!pend)
-            pend = p + strlen(p);
-
-        switch (*p++) {
-        case '#':
-            //sscanf(p, "%m[^\n]", &str);
-            //trace("comment '%s'\n", str);
-            //free(str);
-            break;
-        case 'o':
-            p = skip_space(p);
-            /* not sure what to do with this yet */
-            p = skip_nonspace(p);
-            break;
-        case 's':
-            p = skip_space(p);
-            sscanf(p, "%d", &s);
-            break;
-        case 'f':
-            if (!pass) {
-                fs++;
-            } else {
-                p = skip_space(p);
-                /* XXX: not good enough, there may be gaps, see f-16.obj */
-                sscanf(p, "%d/%d/%d %d/%d/%d %d/%d/%d",
-                       &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7], &f[8]);
-                model_data_push_f(md, f);
-            }
-            break;
-
-        case 'v': {
-            switch (*p++) {
-                case ' ':
-                    if (!pass) {
-                        vecs++;
-                        break;
-                    }
-                    p = skip_space(p);
-                    sscanf(p, "%f %f %f", &r0, &r1, &r2);
-                    model_data_push_v(md, r0, r1, r2);
-                    //if (!vecs)
-                        //trace(" => %f %f %f\n", r0, r1, r2);
-                    break;
-                case 'n':
-                    if (!pass) {
-                        vns++;
-                        break;
-                    }
-                    p = skip_space(p);
-                    sscanf(p, "%f %f %f", &r0, &r1, &r2);
-                    model_data_push_vn(md, r0, r1, r2);
-                    //if (!vns)
-                        //trace(" => %f %f %f\n", r0, r1, r2);
-                    break;
-                case 't':
-                    if (!pass) {
-                        vts++;
-                        break;
-                    }
-                    p = skip_space(p);
-                    s = sscanf(p, "%f %f", &r0, &r1);
-                    model_data_push_vt(md, r0, r1);
-                    //if (!vts)
-                        //trace(" => %f %f, %d\n", r0, r1, s);
-                    break;
-            }
-            break;
-        }
-        default:
-            //sscanf(p, "%m[^ ]", &str);
-            other++;
-            break;
-        }
-        p = pend + 1;
+    op.md = md;
+    op.v = malloc(sizeof(float) * op.nr.v * 3);
+    op.vt = op.nr.vt ? malloc(sizeof(float) * op.nr.vt * 2) : NULL;
+    op.vn = op.nr.vn ? malloc(sizeof(float) * op.nr.vn * 3) : NULL;
+    op.triples = malloc(sizeof(*op.triples) * nr);
+    md->v = malloc(sizeof(float) * nr * 3);
+    md->vt = op.nr.vt ? calloc(nr * 2, sizeof(float)) : NULL;
+    md->vn = calloc(nr * 3, sizeof(float));
+    md->idx = malloc(sizeof(*md->idx) * op.nr.idx);
+    if (!op.v || (op.nr.vt && (!op.vt || !md->vt)) || (op.nr.vn && !op.vn) ||
+        !op.triples || !md->v || !md->vn || !md->idx)
+        goto out;
+
+    for (buckets = 2; buckets < nr * 2 && buckets < 1ul << 18; buckets <<= 1)
+        ;
+    if (hashmap_init(&op.vertices, buckets))
+        goto out;
+
+    err = obj_parse(&op, base, end);
+    hashmap_done(&op.vertices);
+    if (err)
+        goto out;
+
+    dbg("got %lu vs %lu vts %lu vns, %lu vertices %lu indices\n",
+        op.nr.v, op.nr.vt, op.nr.vn, md->nr_vx, md->nr_idx);
+
+    /* the indices were exact, the vertices less than that if they're shared */
+    if (md->nr_vx < nr) {
+        float *v = realloc(md->v, sizeof(float) * md->nr_vx * 3);
+        md->v = v ? : md->v;
     }
 
-    if (!pass) {
-        model_data_init(md, vecs, vts, vns, fs);
-        pass++;
-        goto again;
+out:
+    free(op.v);
+    free(op.vt);
+    free(op.vn);
+    free(op.triples);
+    if (err) {
+        dbg("broken OBJ: %d\n", err);
+        model_data_free(md);
+        return NULL;
     }
-    dbg("got vecs: %d vts: %d vns: %d fs: %d other: %d\n", vecs, vts, vns, fs, other);
 
     return md;
 }
@@ -226,7 +394,7 @@ void model_data_free(struct model_data *md)
     free(md->v);
     free(md->vn);
     free(md->vt);
-    free(md->f);
+    free(md->idx);
     free(md);
 }
 
@@ -235,64 +403,191 @@ int model_data_to_vectors(struct model_data *md,
                           float **normp, size_t *vxszp,
                           unsigned short **idxp, size_t *idxszp)
 {
-    unsigned long i = 0, f, fx;
-    unsigned long fidx;
-    unsigned long vidx;
-    unsigned long vtidx;
-    unsigned long vnidx;
-    unsigned short *idx;
-    float *tx, *norm;
+    *vxszp  = sizeof(float) * md->nr_vx * 3;
+    *txszp  = md->vt ? sizeof(float) * md->nr_vx * 2 : 0;
+    *idxszp = sizeof(*md->idx) * md->nr_idx;
+    *txp    = md->vt;
+    *normp  = md->vn;
+    *idxp   = md->idx;
+    md->vt  = md->vn = NULL;
+    md->idx = NULL;
 
-    *vxszp  = sizeof(*norm) * md->nr_v;
-    *txszp  = md->nr_vt ? sizeof(*tx) * md->nr_v : 0;
-    *idxszp = sizeof(*idx)  * md->nr_f / 3;
-    norm = malloc(*vxszp);
-    tx   = *txszp ? malloc(*txszp) : NULL;
-    idx  = malloc(*idxszp);
-
-    /*
-     * face is v0[f]/t0[f]/n0[f] v1[f]/t1[f]/n1[f] v2[f]/t2[f]/n2[f], so
-     * vertex[v0[f]] <- md_v[v0[f]]: unchanged
-     * normal[v0[f]] <- md_vn[n0[f]] (3f)
-     * tex[v0[f]] <- md_vt[t0[f]]    (2f)
-     * index <- [v0, v1, v2]
-     */
-    for (f = 0; f < md->nr_f; f += 9) {
-        for (fx = 0; fx < 3; fx++) {
-            fidx  = f + fx*3;
-            //dbg("nr_v %lu nr_f %lu fidx %lu\n", md->nr_v, md->nr_f, fidx);
-            vidx  = md->f[fidx];
-            vtidx = md->f[fidx+1];
-            vnidx = md->f[fidx+2];
-
-            if (tx) {
-                tx[vidx * 2]     = md->vt[vtidx * 2];
-                tx[vidx * 2 + 1] = 1 - md->vt[vtidx * 2 + 1];
-            }
+    return 0;
+}
 
-            norm[vidx * 3]     = md->vn[vnidx * 3];
-            norm[vidx * 3 + 1] = md->vn[vnidx * 3 + 1];
-            norm[vidx * 3 + 2] = md->vn[vnidx * 3 + 2];
+/****************************************************************************
+ * bin_vec
+ * Baked vertex data, see objfile.h
+ ****************************************************************************/
+
+/* bytes per vertex, per joint for BV_INVMX */
+static const size_t bin_vec_stride[BV_MAX] = {
+    [BV_POSITION]   = 3 * sizeof(float),
+    [BV_TEXCOORD]   = 2 * sizeof(float),
+    [BV_NORMAL]     = 3 * sizeof(float),
+    [BV_TANGENT]    = 4 * sizeof(float),
+    [BV_JOINTS]     = 4,
+    [BV_WEIGHTS]    = 4 * sizeof(float),
+    [BV_INVMX]      = 16 * sizeof(float),
+    [BV_INDEX]      = sizeof(uint16_t),
+};
+
+static inline size_t bin_vec_align(size_t off)
+{
+    return (off + BIN_VEC_ALIGN - 1) & ~(size_t)(BIN_VEC_ALIGN - 1);
+}
 
-            idx[i++] = vidx;
+static int bin_vec_parse_v1(const void *buf, size_t size, struct bin_vec *bv)
+{
+    const struct bin_vec_header *hdr = buf;
+    size_t off = sizeof(*hdr);
+
+    if (size < sizeof(*hdr) || hdr->vxsz > size || hdr->txsz > size || hdr->idxsz > size ||
+        off + 2 * hdr->vxsz + hdr->txsz + hdr->idxsz > size)
+        return -EINVAL;
+
+    bv->nr_vertices         = hdr->vxsz / bin_vec_stride[BV_POSITION];
+    bv->data[BV_POSITION]   = buf + off;
+    bv->size[BV_POSITION]   = hdr->vxsz;
+    off += hdr->vxsz;
+    bv->data[BV_TEXCOORD]   = hdr->txsz ? buf + off : NULL;
+    bv->size[BV_TEXCOORD]   = hdr->txsz;
+    off += hdr->txsz;
+    bv->data[BV_NORMAL]     = buf + off;
+    bv->size[BV_NORMAL]     = hdr->vxsz;
+    off += hdr->vxsz;
+    bv->idx[0]              = buf + off;
+    bv->idxsz[0]            = hdr->idxsz;
+    bv->nr_lods             = 1;
+
+    return 0;
+}
+
+int bin_vec_parse(const void *buf, size_t size, struct bin_vec *bv)
+{
+    const struct bin_vec_header2 *hdr = buf;
+    const struct bin_vec_section *sec;
+    unsigned int i;
+
+    memset(bv, 0, sizeof(*bv));
+    if (size < sizeof(*hdr) || hdr->magic != BIN_VEC_MAGIC)
+        return -EINVAL;
+
+    if (hdr->ver == 1)
+        return bin_vec_parse_v1(buf, size, bv);
+    if (hdr->ver != BIN_VEC_VERSION)
+        return -ENOTSUP;
+
+    if (hdr->nr_sections > (size - sizeof(*hdr)) / sizeof(*sec))
+        return -EINVAL;
+
+    bv->nr_vertices = hdr->nr_vertices;
+    for (i = 0, sec = buf + sizeof(*hdr); i < hdr->nr_sections; i++, sec++) {
+        /* newer sections are for newer code */
+        if (sec->type >= BV_MAX)
+            continue;
+
+        if (sec->off % BIN_VEC_ALIGN || sec->off > size || sec->size > size - sec->off ||
+            sec->size % bin_vec_stride[sec->type])
+            return -EINVAL;
+
+        if (sec->type == BV_INDEX) {
+            /* in order, no gaps */
+            if (sec->level != bv->nr_lods || sec->level == BIN_VEC_LODS)
+                return -EINVAL;
+
+            bv->idx[sec->level]   = buf + sec->off;
+            bv->idxsz[sec->level] = sec->size;
+            bv->error[sec->level] = sec->error;
+            bv->nr_lods++;
+            continue;
         }
+
+        if (sec->type != BV_INVMX &&
+            sec->size != (size_t)bv->nr_vertices * bin_vec_stride[sec->type])
+            return -EINVAL;
+
+        bv->data[sec->type] = buf + sec->off;
+        bv->size[sec->type] = sec->size;
     }
-    //fprintf(stderr, "fidx %lu vidx %lu vtidx %lu vnidx %lu\n", fidx, vidx, vtidx, vnidx);
-    *txp   = tx;
-    *normp = norm;
-    *idxp = idx;
+
+    if (!bv->data[BV_POSITION] || !bv->nr_lods)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int bin_vec_pad(FILE *f, size_t *off)
+{
+    static const char zeroes[BIN_VEC_ALIGN];
+    size_t pad = bin_vec_align(*off) - *off;
+
+    if (pad && fwrite(zeroes, pad, 1, f) != 1)
+        return -EIO;
+
+    *off += pad;
 
     return 0;
 }
 
+int bin_vec_write(FILE *f, const struct bin_vec *bv)
+{
+    struct bin_vec_section secs[BV_MAX + BIN_VEC_LODS], *sec;
+    struct bin_vec_header2 hdr = {
+        .magic          = BIN_VEC_MAGIC,
+        .ver            = BIN_VEC_VERSION,
+        .nr_vertices    = bv->nr_vertices,
+    };
+    const void *data[array_size(secs)];
+    unsigned int i;
+    size_t off;
+
+    memset(secs, 0, sizeof(secs));
+    for (i = 0; i < BV_MAX; i++) {
+        if (i == BV_INDEX || !bv->data[i] || !bv->size[i])
+            continue;
+
+        sec = &secs[hdr.nr_sections];
+        sec->type = i;
+        sec->size = bv->size[i];
+        data[hdr.nr_sections++] = bv->data[i];
+    }
+
+    for (i = 0; i < bv->nr_lods; i++) {
+        sec = &secs[hdr.nr_sections];
+        sec->type = BV_INDEX;
+        sec->level = i;
+        sec->error = bv->error[i];
+        sec->size = bv->idxsz[i];
+        data[hdr.nr_sections++] = bv->idx[i];
+    }
+
+    off = bin_vec_align(sizeof(hdr) + hdr.nr_sections * sizeof(*sec));
+    for (i = 0; i < hdr.nr_sections; i++) {
+        secs[i].off = off;
+        off = bin_vec_align(off + secs[i].size);
+    }
+
+    off = sizeof(hdr) + hdr.nr_sections * sizeof(*sec);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(secs, sizeof(*sec), hdr.nr_sections, f) != hdr.nr_sections)
+        return -EIO;
+
+    for (i = 0; i < hdr.nr_sections; i++) {
+        if (bin_vec_pad(f, &off) ||
+            (secs[i].size && fwrite(data[i], secs[i].size, 1, f) != 1))
+            return -EIO;
+        off += secs[i].size;
+    }
+
+    return bin_vec_pad(f, &off);
+}
+
 #ifdef OBJ2BIN
 int main(int argc, char **argv)
 {
-    struct bin_vec_header H = {
-        .magic  = 0x12345678,
-        .ver    = 1,
-    };
     struct model_data *md;
+    struct bin_vec bv = {};
     float *tx, *norm;
     unsigned short *idx;
     size_t vxsz, txsz, idxsz;
@@ -321,24 +616,25 @@ int main(int argc, char **argv)
     fread(inbuf, st.st_size, 1, in);
     fclose(in);
     md = model_data_new_from_obj(inbuf, st.st_size);
-    fprintf(stderr, "nr_v %d/%d nr_vn %d/%d nr_vt %d/%d nr_f %d/%d\n",
-            md->nr_v, md->loaded_v,
-            md->nr_vn, md->loaded_vn,
-            md->nr_vt, md->loaded_vt,
-            md->nr_f, md->loaded_f
-           );
+    if (!md)
+        return EXIT_FAILURE;
+
+    fprintf(stderr, "vertices %lu indices %lu\n", md->nr_vx, md->nr_idx);
     model_data_to_vectors(md, &tx, &txsz, &norm, &vxsz, &idx, &idxsz);
-    fprintf(stderr, "vxsz: %zu txsz: %zu idxsz: %d\n", vxsz, txsz, idxsz);
-    H.nr_vertices = idxsz / sizeof(*idx);
-    H.vxsz = vxsz;
-    H.txsz = txsz;
-    H.idxsz = idxsz;
-    fwrite(&H, sizeof(H), 1, out);
-    fwrite(md->v,   vxsz, 1, out);
-    fwrite(tx,      txsz, 1, out);
-    fwrite(norm,    vxsz, 1, out);
-    fwrite(idx,    idxsz, 1, out);
-    fclose(out);
+    fprintf(stderr, "vxsz: %zu txsz: %zu idxsz: %zu\n", vxsz, txsz, idxsz);
+    bv.nr_vertices          = md->nr_vx;
+    bv.data[BV_POSITION]    = md->v;
+    bv.size[BV_POSITION]    = vxsz;
+    bv.data[BV_TEXCOORD]    = tx;
+    bv.size[BV_TEXCOORD]    = txsz;
+    bv.data[BV_NORMAL]      = norm;
+    bv.size[BV_NORMAL]      = vxsz;
+    bv.idx[0]               = idx;
+    bv.idxsz[0]             = idxsz;
+    bv.nr_lods              = 1;
+    if (bin_vec_write(out, &bv) || fclose(out))
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }
 #endif /* OBJ2BIN */
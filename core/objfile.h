@@ -2,43 +2,106 @@
 #ifndef __CLAP_OBJFILE_H__
 #define __CLAP_OBJFILE_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <stdio.h>
+
+#define BIN_VEC_MAGIC       0x12345678
+/* v1: positions, texture coordinates, normals and indices, in that order */
 struct bin_vec_header {
     uint64_t   magic;
     uint64_t   ver;
+    /* that's indices */
     uint64_t   nr_vertices;
     uint64_t   vxsz;
     uint64_t   txsz;
     uint64_t   idxsz;
 };
 
+/*
+ * v2: the same magic and version, then a table of sections, each at a
+ * BIN_VEC_ALIGN offset, so that the vertex data can be used straight
+ * from the mapped file. Only the positions and LOD 0 indices have to be
+ * there; more LODs are more index sections with higher @level.
+ */
+#define BIN_VEC_VERSION     2
+#define BIN_VEC_ALIGN       16
+#define BIN_VEC_LODS        8
+
+enum bin_vec_type {
+    /* 3 floats per vertex */
+    BV_POSITION = 0,
+    /* 2 floats */
+    BV_TEXCOORD,
+    /* 3 floats */
+    BV_NORMAL,
+    /* 4 floats */
+    BV_TANGENT,
+    /* 4 bytes */
+    BV_JOINTS,
+    /* 4 floats */
+    BV_WEIGHTS,
+    /* 16 floats per joint, the inverse bind matrices */
+    BV_INVMX,
+    /* unsigned shorts, per @level */
+    BV_INDEX,
+    BV_MAX,
+};
+
+struct bin_vec_header2 {
+    uint64_t    magic;
+    uint64_t    ver;
+    uint32_t    nr_vertices;
+    uint32_t    nr_sections;
+};
+
+struct bin_vec_section {
+    uint32_t    type;
+    uint32_t    level;
+    /* BV_INDEX: the LOD's error, see model3d_add_lod() */
+    float       error;
+    uint32_t    __pad;
+    uint64_t    off;
+    uint64_t    size;
+};
+
+/* v1 or v2, unpacked; points into the buffer it came from */
+struct bin_vec {
+    unsigned int    nr_vertices;
+    const void      *data[BV_MAX];
+    size_t          size[BV_MAX];
+    unsigned int    nr_lods;
+    const uint16_t  *idx[BIN_VEC_LODS];
+    size_t          idxsz[BIN_VEC_LODS];
+    float           error[BIN_VEC_LODS];
+};
+
+/* -EINVAL if it's broken, -ENOTSUP if it's not a version we know */
+int bin_vec_parse(const void *buf, size_t size, struct bin_vec *bv);
+/* as v2; BV_INDEX sections come from @bv->idx[] */
+int bin_vec_write(FILE *f, const struct bin_vec *bv);
+
+/*
+ * An OBJ, indexed: one vertex per distinct v/vt/vn triple that the faces
+ * use, polygons are triangle fans
+ */
 struct model_data {
-    unsigned long   nr_v;
-    unsigned long   nr_vt;
-    unsigned long   nr_vn;
-    unsigned long   nr_f;
-    unsigned long   loaded_v;
-    unsigned long   loaded_vt;
-    unsigned long   loaded_vn;
-    unsigned long   loaded_f;
+    unsigned long   nr_vx;
+    unsigned long   nr_idx;
+    /* 3 floats per vertex */
     float           *v;
+    /* 2 per vertex, flipped for GL; NULL if there aren't any */
     float           *vt;
+    /* 3 per vertex, zeroes where there aren't any */
     float           *vn;
-    int             *f;
+    unsigned short  *idx;
 };
 
-int model_data_init(struct model_data *md,
-                    unsigned long nr_v,
-                    unsigned long nr_vt,
-                    unsigned long nr_vn,
-                    unsigned long nr_f);
-int model_data_push_v(struct model_data *md, float v0, float v1, float v2);
-int model_data_push_vt(struct model_data *md, float v0, float v1);
-int model_data_push_vn(struct model_data *md, float v0, float v1, float v2);
-int model_data_push_f(struct model_data *md, int f[9]);
+/* NULL if it's broken or has more vertices than the 16 bit indices take */
 struct model_data *model_data_new_from_obj(const char *base, size_t size);
 void model_data_free(struct model_data *md);
+/* hands over the texture coordinates, normals and indices; the caller frees them */
 int model_data_to_vectors(struct model_data *md,
                           float **tx, size_t *txszp,
                           float **norm, size_t *vxszp,
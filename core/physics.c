@@ -1,15 +1,16 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
 #include <ode/ode.h>
 #include "common.h"
 #include "character.h"
 #include "linmath.h"
 #include "model.h"
 #include "physics.h"
+#include "profiler.h"
+#include "settings.h"
 #include "ui-debug.h"
 
-static struct phys _phys;
-struct phys *phys = &_phys; /* XXX */
-static DECLARE_LIST(phys_bodies);
+static unsigned int default_rate, default_max_substeps;
 
 struct entity3d *phys_body_entity(struct phys_body *body)
 {
@@ -30,6 +31,24 @@ const dReal *phys_body_rotation(struct phys_body *body)
     return dGeomGetRotation(body->geom);
 }
 
+/*
+ * Unless something else has moved the body since the last step (a teleport,
+ * entity3d_position()), in which case it's just where it is now
+ */
+void phys_body_interp_position(struct phys_body *body, dReal *pos)
+{
+    const dReal *now = phys_body_position(body);
+    int i;
+
+    if (!phys_body_has_body(body) || memcmp(now, body->cur_pos, 3 * sizeof(dReal))) {
+        memcpy(pos, now, 3 * sizeof(dReal));
+        return;
+    }
+
+    for (i = 0; i < 3; i++)
+        pos[i] = body->prev_pos[i] + (body->cur_pos[i] - body->prev_pos[i]) * body->phys->alpha;
+}
+
 /*
  * Separate thread? Emscripten won't be happy.
  */
@@ -84,7 +103,7 @@ void phys_body_stick(struct phys_body *body, dContact *contact)
         c->normal[2] = contact->geom.normal[2];
     }
 
-    j = dJointCreateContact(phys->world, phys->contact, contact);
+    j = dJointCreateContact(body->phys->world, body->phys->contact, contact);
     dJointAttach(j, body->body, NULL);
 
     if (dJointGetBody(body->lmotor, 0))
@@ -138,6 +157,12 @@ static const char *class_str(int class)
     return "<unknown>";
 }
 
+/* what phys_step() hands to near_callback() */
+struct near {
+    struct phys *phys;
+    struct list *pen;
+};
+
 static void near_callback(void *data, dGeomID o1, dGeomID o2)
 {
     bool ground;
@@ -145,14 +170,18 @@ static void near_callback(void *data, dGeomID o1, dGeomID o2)
     dBodyID b1 = dGeomGetBody(o1);
     dBodyID b2 = dGeomGetBody(o2);
     dReal bounce = 0.0, bounce_vel = 0.0;
-    struct list *pen = data;
+    struct near *near = data;
+    struct phys *phys = near->phys;
+    struct list *pen = near->pen;
     dJointID j;
     int i, nc;
 
     phys_contact_surface(NULL, NULL, contact, MAX_CONTACTS);
 
+    phys->stats.pairs++;
     nc = dCollide(o1, o2, MAX_CONTACTS, &contact[0].geom, sizeof(dContact));
-    if (nc) {
+    if (nc > 0) {
+        phys->stats.contacts += nc;
         for (i = 0; i < nc; i++) {
             dGeomID g1 = contact[i].geom.g1;
             dGeomID g2 = contact[i].geom.g2;
@@ -219,68 +248,233 @@ static void got_contact(void *data, dGeomID o1, dGeomID o2)
     c->nc = dCollide(o1, o2, 1, c->contact ? &c->contact->geom : &contact.geom, sizeof(dContact));
 }
 
-struct entity3d *phys_ray_cast(struct entity3d *e, vec3 start, vec3 dir, double *pdist)
+struct ray_hit {
+    struct phys_ray *ray;
+    struct entity3d *entity;
+    dContactGeom    geom;
+};
+
+/* keep the closest hit that isn't @ignore, descending into the subspaces */
+static void ray_hit(void *data, dGeomID o1, dGeomID o2)
 {
-    struct entity3d *target = NULL;
-    dGeomID ray = NULL;
-    dContact contact;
-    struct contact c = { .contact = &contact };
-    vec3 _start = { start[0], start[1], start[2] };
-    vec3 comp;
-    int try = 0;
+    dGeomID other = dGeomGetClass(o1) == dRayClass ? o2 : o1;
+    dGeomID ray = other == o1 ? o2 : o1;
+    struct ray_hit *rh = data;
+    struct entity3d *e;
+    dContactGeom geom;
+
+    if (dGeomIsSpace(other)) {
+        dSpaceCollide2(ray, other, data, ray_hit);
+        return;
+    }
 
-    ray = dCreateRay(phys->space, *pdist);
-retry:
-    dGeomRaySetClosestHit(ray, 1);
-    /* avoid self-intersections as much as possible */
-    dGeomRaySetBackfaceCull(ray, 1);
-    phys_contact_surface(NULL, NULL, &contact, 1);
-    dGeomRaySet(ray, _start[0], _start[1], _start[2], dir[0], dir[1], dir[2]);
-    dSpaceCollide2(ray, (dGeomID)phys->space, &c, &got_contact);
-    if (c.nc) {
-        target = dGeomGetData(dGeomGetClass(contact.geom.g1) == dRayClass ? contact.geom.g2 : contact.geom.g1);
-        if (target) {
-            if (e == target && try++ < 10) {
-                vec3_scale(comp, dir, contact.geom.depth + 1e-3);
-                vec3_add(_start, _start, comp);
-                goto retry;
-            }
-        }
+    e = dGeomGetData(other);
+    if (!e || e == rh->ray->ignore)
+        return;
+
+    if (dCollide(ray, other, 1, &geom, sizeof(geom)) < 1)
+        return;
+
+    if (!rh->entity || geom.depth < rh->geom.depth) {
+        rh->entity = e;
+        rh->geom = geom;
+    }
+}
 
-        vec3_sub(comp, _start, start);
-        *pdist = contact.geom.depth + vec3_len(comp);
+static void phys_bodies_ground_reset(struct phys *phys)
+{
+    struct phys_body *pb;
+
+    list_for_each_entry(pb, &phys->bodies, entry)
+        pb->ground_valid = false;
+}
+
+void phys_set_heightfield(struct phys *phys, struct entity3d *e, const float *aabb,
+                          float (*height)(void *priv, float x, float z), void *priv)
+{
+    struct phys_heightfield *hf = &phys->heightfield;
+
+    phys_bodies_ground_reset(phys);
+    hf->entity = e;
+    hf->height = height;
+    hf->priv = priv;
+    if (aabb)
+        memcpy(hf->aabb, aabb, sizeof(hf->aabb));
+}
+
+/* how far apart the heightfield is sampled for the normal */
+#define PHYS_HF_SLOPE_DIST 0.1f
+
+/* true if the heightfield has the answer, whether it's a hit or not */
+static bool phys_ray_heightfield(struct phys *phys, struct phys_ray *r)
+{
+    struct phys_heightfield *hf = &phys->heightfield;
+    float height;
+
+    if (!hf->height || r->dir[0] || r->dir[2] || r->dir[1] >= 0)
+        return false;
+    if (r->start[0] < hf->aabb[0] || r->start[0] >= hf->aabb[1] ||
+        r->start[2] < hf->aabb[4] || r->start[2] >= hf->aabb[5])
+        return false;
+
+    height = hf->height(hf->priv, r->start[0], r->start[2]);
+    /* below the ground, let the geoms sort it out */
+    if (r->start[1] < height)
+        return false;
+
+    if (r->start[1] - height <= r->dist) {
+        const float d = PHYS_HF_SLOPE_DIST;
+
+        r->hit = hf->entity;
+        r->dist = r->start[1] - height;
+        r->pos[0] = r->start[0];
+        r->pos[1] = height;
+        r->pos[2] = r->start[2];
+        /* from the slopes around the hit: what the geom would've said */
+        r->normal[0] = hf->height(hf->priv, r->start[0] - d, r->start[2]) -
+                       hf->height(hf->priv, r->start[0] + d, r->start[2]);
+        r->normal[1] = 2 * d;
+        r->normal[2] = hf->height(hf->priv, r->start[0], r->start[2] - d) -
+                       hf->height(hf->priv, r->start[0], r->start[2] + d);
+        vec3_norm(r->normal, r->normal);
     }
-    dGeomDestroy(ray);
 
-    // if (nc)
-    //     ui_debug_printf("[%f,%f,%f]->[%f,%f,%f] %s@%f(-%f)(%d) [%f,%f,%f] try %d", _start[0], _start[1], _start[2],
-    //                     dir[0], dir[1], dir[2], entity_name(target), *pdist, vec3_len(comp), nc,
-    //                     contact.geom.pos[0], contact.geom.pos[1], contact.geom.pos[2], try);
-    return c.nc ? target : NULL;
+    return true;
+}
+
+void phys_ray_cast_batch(struct phys *phys, struct phys_ray *rays, unsigned int nr)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr; i++) {
+        struct phys_ray *r = &rays[i];
+        struct ray_hit rh = { .ray = r };
+
+        r->hit = NULL;
+        if ((r->flags & PHYS_RAY_GROUND) && phys_ray_heightfield(phys, r))
+            continue;
+
+        dGeomRaySetLength(phys->ray, r->dist);
+        dGeomRaySet(phys->ray, r->start[0], r->start[1], r->start[2],
+                    r->dir[0], r->dir[1], r->dir[2]);
+        dSpaceCollide2(phys->ray,
+                       (dGeomID)(r->flags & PHYS_RAY_GROUND ? phys->ground_space : phys->space),
+                       &rh, ray_hit);
+        if (!rh.entity)
+            continue;
+
+        r->hit = rh.entity;
+        r->dist = rh.geom.depth;
+        r->pos[0] = rh.geom.pos[0];
+        r->pos[1] = rh.geom.pos[1];
+        r->pos[2] = rh.geom.pos[2];
+        r->normal[0] = rh.geom.normal[0];
+        r->normal[1] = rh.geom.normal[1];
+        r->normal[2] = rh.geom.normal[2];
+    }
+}
+
+struct entity3d *phys_ray_cast(struct phys *phys, struct entity3d *e, vec3 start, vec3 dir,
+                               double *pdist)
+{
+    struct phys_ray ray = { .dist = *pdist, .ignore = e };
+
+    memcpy(ray.start, start, sizeof(ray.start));
+    memcpy(ray.dir, dir, sizeof(ray.dir));
+    phys_ray_cast_batch(phys, &ray, 1);
+    if (ray.hit)
+        *pdist = ray.dist;
+
+    return ray.hit;
 }
 
-void phys_ground_entity(struct entity3d *e)
+void phys_ground_entity(struct phys *phys, struct entity3d *e)
 {
     struct entity3d *collision;
     vec3 start = { e->dx, e->dy, e->dz };
     vec3 dir = { 0, -1, 0 };
     double dist = 1e6;
 
-    collision = phys_ray_cast(e, start, dir, &dist);
+    collision = phys_ray_cast(phys, e, start, dir, &dist);
     /* floating in space? */
     if (!collision)
         return;
 
     e->dy -= dist;
+    entity3d_dirty(e);
+}
+
+/* a bit past the capsule's bottom */
+static const dReal phys_ground_epsilon = 1e-3;
+
+/* straight down from the capsule cap, see phys_body::ray_off */
+static void phys_body_ground_ray_init(struct phys_body *body, struct phys_ray *r)
+{
+    const dReal *pos = phys_body_position(body);
+
+    memset(r, 0, sizeof(*r));
+    r->start[0] = pos[0];
+    r->start[1] = pos[1] - body->ray_off;
+    r->start[2] = pos[2];
+    r->dir[1]   = -1;
+    r->dist     = body->yoffset - body->ray_off + phys_ground_epsilon;
+    r->ignore   = phys_body_entity(body);
+    r->flags    = PHYS_RAY_GROUND;
+}
+
+/* phys_advance()'s batched ray if @body is still where it was cast from */
+static void phys_body_ground_ray(struct phys_body *body, struct phys_ray *r)
+{
+    phys_body_ground_ray_init(body, r);
+    if (body->ground_valid && !memcmp(r->start, body->ground.start, sizeof(r->start))) {
+        *r = body->ground;
+        return;
+    }
+
+    phys_ray_cast_batch(body->phys, r, 1);
+}
+
+static bool phys_body_ground_stale(struct phys_body *body)
+{
+    return phys_body_has_body(body) && !(body->ground_valid && phys_body_is_asleep(body));
+}
+
+/* all the bodies that might have moved, one batch */
+static void phys_bodies_ground(struct phys *phys)
+{
+    struct phys_body *pb;
+    struct phys_ray *rays;
+    unsigned int nr = 0, i = 0;
+
+    list_for_each_entry(pb, &phys->bodies, entry)
+        nr += phys_body_ground_stale(pb);
+
+    if (!nr)
+        return;
+
+    rays = darray_resize(&phys->ground_rays.da, nr);
+    if (!rays)
+        return;
+
+    list_for_each_entry(pb, &phys->bodies, entry)
+        if (phys_body_ground_stale(pb))
+            phys_body_ground_ray_init(pb, &rays[i++]);
+
+    phys_ray_cast_batch(phys, rays, nr);
+
+    i = 0;
+    list_for_each_entry(pb, &phys->bodies, entry)
+        if (phys_body_ground_stale(pb)) {
+            pb->ground = rays[i++];
+            pb->ground_valid = true;
+        }
 }
 
 bool phys_body_is_grounded(struct phys_body *body)
 {
-    struct entity3d *e = phys_body_entity(body);
-    dVector3 dir = { 0, -1, 0 };
-    dGeomID ray, *ground;
-    const dReal *pos, epsilon = 1e-3;
+    struct phys *phys = body->phys;
     struct contact contact = {};
+    struct phys_ray ray;
 
     if (!phys_body_has_body(body))
         return true;
@@ -292,26 +486,20 @@ bool phys_body_is_grounded(struct phys_body *body)
     if (contact.nc)
         return true;
 
-    pos = phys_body_position(body);
-    ray = dCreateRay(phys->space, body->yoffset - body->ray_off + epsilon);
-    dGeomRaySet(ray, pos[0], pos[1] - body->ray_off, pos[2], dir[0], dir[1], dir[2]);
-    dSpaceCollide2(ray, (dGeomID)phys->ground_space, &contact, got_contact);
-    dGeomDestroy(ray);
+    phys_body_ground_ray(body, &ray);
 
-    return !!contact.nc;
+    return !!ray.hit;
 }
 
 bool phys_body_ground_collide(struct phys_body *body)
 {
     struct entity3d *e = phys_body_entity(body);
-    dReal epsilon = 1e-3;
-    dReal ray_len = body->yoffset - body->ray_off + epsilon;
-    dVector3 dir = { 0, -ray_len, 0 };
+    struct phys *phys = body->phys;
+    dReal ray_len = body->yoffset - body->ray_off + phys_ground_epsilon;
     //struct character *ch = e->priv;
     dContact contact;
     struct contact c = { .contact = &contact };
-    dGeomID ray, *ground;
-    const dReal *pos;
+    struct phys_ray ray;
 
     if (!phys_body_has_body(body))
         return true;
@@ -335,43 +523,49 @@ bool phys_body_ground_collide(struct phys_body *body)
         }
     }
 
-    pos = phys_body_position(body);
-    ray = dCreateRay(phys->space, ray_len);
-    dGeomRaySet(ray, pos[0], pos[1] - body->ray_off, pos[2], dir[0], dir[1], dir[2]);
-    //dGeomSetBody(ray, body->body);
-    // nc = dCollide(ray, *ground, 1, &contact.geom, sizeof(dContact));
-    dSpaceCollide2(ray, (dGeomID)phys->ground_space, &c, got_contact);
-    dGeomDestroy(ray);
-    if (c.nc)
-        goto got_it;
-
-    return false;
+    phys_body_ground_ray(body, &ray);
+    if (!ray.hit)
+        return false;
 
-got_it:
-    if (ray_len - c.contact->geom.depth > epsilon) {
-        entity3d_move(e, 0, ray_len - c.contact->geom.depth, 0);
-        ui_debug_printf("RAY '%s' collides with %s at %f/%f (%f,%f,%f) normal %f,%f,%f\n", entity_name(e), class_str(dGeomGetClass(contact.geom.g2)),
-            contact.geom.depth, ray_len, e->dx, e->dy, e->dz,
-            contact.geom.normal[0], contact.geom.normal[1], contact.geom.normal[2]);
+    /* what colliding the ray with the ground geom would've given */
+    phys_contact_surface(NULL, ray.hit, &contact, 1);
+    contact.geom.pos[0]    = ray.pos[0];
+    contact.geom.pos[1]    = ray.pos[1];
+    contact.geom.pos[2]    = ray.pos[2];
+    contact.geom.normal[0] = ray.normal[0];
+    contact.geom.normal[1] = ray.normal[1];
+    contact.geom.normal[2] = ray.normal[2];
+    contact.geom.depth     = ray.dist;
+    contact.geom.g1        = phys->ray;
+
+    if (ray_len - ray.dist > phys_ground_epsilon) {
+        entity3d_move(e, 0, ray_len - ray.dist, 0);
+        ui_debug_printf("RAY '%s' collides with %s '%s' at %f/%f (%f,%f,%f) normal %f,%f,%f\n",
+                        entity_name(e),
+                        ray.hit->phys_body ? class_str(dGeomGetClass(ray.hit->phys_body->geom)) : "",
+                        entity_name(ray.hit), ray.dist, ray_len, e->dx, e->dy, e->dz,
+                        ray.normal[0], ray.normal[1], ray.normal[2]);
     }
     phys_body_stick(e->phys_body, &contact);
 
     return true;
 }
 
-void phys_step(unsigned long frame_count)
+void phys_step(struct phys *phys, unsigned long frame_count)
 {
     struct phys_body *pb, *itpb;
     DECLARE_LIST(pen);
+    struct near near = { .phys = phys, .pen = &pen };
 
     /* this is instead called in character update */
-    // list_for_each_entry(pb, &phys_bodies, entry) {
+    // list_for_each_entry(pb, &phys->bodies, entry) {
     //     if (phys_body_ground_collide(pb)) {
     //     }
     // }
 
+    memset(&phys->stats, 0, sizeof(phys->stats));
     dSpaceCollide2((dGeomID)phys->ground_space, (dGeomID)phys->character_space,
-                   &pen, near_callback);
+                   &near, near_callback);
 
     list_for_each_entry_iter(pb, itpb, &pen, pen_entry) {
         const dReal     *pos = phys_body_position(pb);
@@ -410,10 +604,171 @@ void phys_step(unsigned long frame_count)
     }
 
     /* XXX: quick step fails in quickstep.cpp:3267 */
-    dWorldQuickStep(phys->world, 0.01 * frame_count);
+    if (phys->exact)
+        dWorldStep(phys->world, phys->step * frame_count);
+    else
+        dWorldQuickStep(phys->world, phys->step * frame_count);
     dJointGroupEmpty(phys->contact);
 }
 
+void phys_set_rate(struct phys *phys, unsigned int rate, unsigned int max_substeps)
+{
+    phys->step = 1.0 / (rate ? rate : PHYS_DEFAULT_RATE);
+    phys->max_substeps = max_substeps ? max_substeps : PHYS_DEFAULT_SUBSTEPS;
+}
+
+static void phys_threading_done(struct phys *phys)
+{
+    if (!phys->threading)
+        return;
+
+    dWorldSetStepThreadingImplementation(phys->world, NULL, NULL);
+    dThreadingImplementationShutdownProcessing(phys->threading);
+    dThreadingFreeThreadPool(phys->pool);
+    dThreadingFreeImplementation(phys->threading);
+    phys->threading = NULL;
+    phys->pool = NULL;
+}
+
+/* islands that don't touch each other get solved on different threads */
+static int phys_threading_init(struct phys *phys, unsigned int threads)
+{
+    phys->threading = dThreadingAllocateMultiThreadedImplementation();
+    if (!phys->threading)
+        return -ENOTSUP;
+
+    phys->pool = dThreadingAllocateThreadPool(threads, 0, dAllocateFlagBasicData, NULL);
+    if (!phys->pool) {
+        dThreadingFreeImplementation(phys->threading);
+        phys->threading = NULL;
+        return -ENOMEM;
+    }
+
+    dThreadingThreadPoolServeMultiThreadedImplementation(phys->pool, phys->threading);
+    dWorldSetStepIslandsProcessingMaxThreadCount(phys->world, threads);
+    dWorldSetStepThreadingImplementation(phys->world,
+                                         dThreadingImplementationGetFunctions(phys->threading),
+                                         phys->threading);
+
+    return 0;
+}
+
+int phys_set_config(struct phys *phys, const struct phys_config *cfg)
+{
+    int ret = 0;
+
+    phys->exact = cfg->exact;
+    dWorldSetQuickStepNumIterations(phys->world, cfg->iterations ? : PHYS_DEFAULT_ITERATIONS);
+    phys_set_rate(phys, cfg->rate ? : default_rate, cfg->max_substeps ? : default_max_substeps);
+
+    phys_threading_done(phys);
+    dWorldSetStepIslandsProcessingMaxThreadCount(phys->world, 1);
+    if (cfg->threads > 1) {
+        ret = phys_threading_init(phys, cfg->threads);
+        if (ret)
+            warn("physics: can't have %u threads: %d\n", cfg->threads, ret);
+    }
+
+    return ret;
+}
+
+void phys_config_from_settings(struct phys_config *cfg, struct settings *rs)
+{
+    JsonNode *root = settings_get(rs, "physics"), *node;
+
+    if (!root || root->tag != JSON_OBJECT)
+        return;
+
+    node = json_find_member(root, "solver");
+    if (node && node->tag == JSON_STRING)
+        cfg->exact = !strcmp(node->string_, "exact");
+
+#define PHYS_CONFIG_NUM(_key, _field) \
+    node = json_find_member(root, _key); \
+    if (node && node->tag == JSON_NUMBER && node->number_ >= 0) \
+        cfg->_field = node->number_;
+
+    PHYS_CONFIG_NUM("iterations", iterations);
+    PHYS_CONFIG_NUM("rate", rate);
+    PHYS_CONFIG_NUM("substeps", max_substeps);
+    PHYS_CONFIG_NUM("threads", threads);
+#undef PHYS_CONFIG_NUM
+}
+
+/*
+ * Hash space cells go from 2^minlevel to 2^maxlevel; make the biggest ones
+ * cover the whole of the static geometry, so that the terrain's trimesh
+ * lands in one cell instead of being hashed into a multitude of small ones,
+ * and let the small ones go down to about a character's size
+ */
+#define PHYS_HASH_MIN_LEVEL -2
+
+void phys_set_bounds(struct phys *phys, const float *aabb)
+{
+    float extent = max(aabb[1] - aabb[0], max(aabb[3] - aabb[2], aabb[5] - aabb[4]));
+    int maxlevel = extent > 1 ? (int)ceilf(log2f(extent)) : 0;
+
+    maxlevel = max(maxlevel, PHYS_HASH_MIN_LEVEL + 1);
+    dHashSpaceSetLevels(phys->ground_space, PHYS_HASH_MIN_LEVEL, maxlevel);
+    dHashSpaceSetLevels(phys->space, PHYS_HASH_MIN_LEVEL, maxlevel);
+}
+
+static void phys_bodies_save(struct phys *phys, bool cur)
+{
+    struct phys_body *pb;
+
+    list_for_each_entry(pb, &phys->bodies, entry)
+        if (phys_body_has_body(pb))
+            memcpy(cur ? pb->cur_pos : pb->prev_pos, dBodyGetPosition(pb->body),
+                   3 * sizeof(dReal));
+}
+
+/*
+ * The interpolated position moves with alpha on frames without a step too,
+ * so everything that's still in motion needs a new transform every frame
+ */
+static void phys_bodies_dirty(struct phys *phys)
+{
+    struct phys_body *pb;
+
+    list_for_each_entry(pb, &phys->bodies, entry) {
+        if (!phys_body_has_body(pb))
+            continue;
+        if (phys_body_is_asleep(pb) && !memcmp(pb->prev_pos, pb->cur_pos, 3 * sizeof(dReal)))
+            continue;
+
+        entity3d_dirty(phys_body_entity(pb));
+    }
+}
+
+/*
+ * The simulation advances in steps of the same size regardless of the
+ * frame rate; if it falls behind by more than @max_substeps, the rest of
+ * the time is dropped rather than spiralling into ever longer frames
+ */
+unsigned int phys_advance(struct phys *phys, double dt)
+{
+    PROF_SCOPE("phys_advance");
+    unsigned int steps;
+
+    phys->accumulator += dt;
+    for (steps = 0; phys->accumulator >= phys->step && steps < phys->max_substeps; steps++) {
+        phys_bodies_save(phys, false);
+        phys_step(phys, 1);
+        phys_bodies_save(phys, true);
+        phys->accumulator -= phys->step;
+    }
+
+    if (phys->accumulator >= phys->step)
+        phys->accumulator = fmod(phys->accumulator, phys->step);
+    phys->alpha = phys->accumulator / phys->step;
+    phys_bodies_dirty(phys);
+    if (steps)
+        phys_bodies_ground(phys);
+
+    return steps;
+}
+
 static void dGetEulerAngleFromRot(const dMatrix3 mRot, dReal *rX, dReal *rY, dReal *rZ)
 {
     *rY = asin(mRot[0 * 4 + 2]);
@@ -433,6 +788,12 @@ static void dGetEulerAngleFromRot(const dMatrix3 mRot, dReal *rX, dReal *rY, dRe
     }
 }
 
+void phys_body_wake(struct phys_body *body)
+{
+    if (phys_body_has_body(body))
+        dBodyEnable(body->body);
+}
+
 int phys_body_update(struct entity3d *e)
 {
     const dReal *pos;
@@ -443,10 +804,15 @@ int phys_body_update(struct entity3d *e)
     if (!e->phys_body || !phys_body_has_body(e->phys_body))
         return 0;
 
+    /* hasn't moved since it fell asleep, the entity stays clean */
+    if (phys_body_is_asleep(e->phys_body))
+        return 0;
+
     pos = phys_body_position(e->phys_body);
     e->dx = pos[0];
     e->dy = pos[1] - e->phys_body->yoffset;
     e->dz = pos[2];
+    entity3d_dirty(e);
     vel = dBodyGetLinearVel(e->phys_body->body);
 
     return dCalcVectorLength3(vel) > 1e-3 ? 1 : 0;
@@ -521,66 +887,107 @@ dGeomID phys_geom_capsule_new(struct phys *phys, struct phys_body *body, struct
     return g;
 }
 
-dGeomID phys_geom_trimesh_new(struct phys *phys, struct phys_body *body, struct entity3d *e, double mass)
+void phys_trimesh_free(struct phys_trimesh *tm)
+{
+    struct phys_trimesh *next;
+
+    for (; tm; tm = next) {
+        next = tm->next;
+        dGeomTriMeshDataDestroy(tm->data);
+        free(tm->vx);
+        free(tm->idx);
+        free(tm);
+    }
+}
+
+/* @m's collision mesh scaled by @scale, built on the first use */
+static struct phys_trimesh *phys_trimesh_get(struct model3d *m, float scale)
 {
-    dTriMeshDataID meshdata = dGeomTriMeshDataCreate();
-    struct model3d *m = e->txmodel->model;
-    unsigned short *idx = m->collision_idx;
+    unsigned int stride = m->collision_idx_stride ? : sizeof(unsigned short);
     size_t idxsz = m->collision_idxsz;
     size_t vxsz = m->collision_vxsz;
     float *vx = m->collision_vx;
-    dGeomID trimesh = NULL;
-    dReal *tnorm = NULL;
-    dReal *tvx = NULL;
-    dTriIndex *tidx;
+    struct phys_trimesh *tm;
     int i;
 
-    idxsz /= sizeof(unsigned short);
-    CHECK(tidx = calloc(idxsz, sizeof(*tidx))); /* XXX: refcounting, or tied to model? */
+    for (tm = m->trimesh; tm; tm = tm->next)
+        if (tm->scale == scale)
+            return tm;
+
+    CHECK(tm = calloc(1, sizeof(*tm)));
+    tm->scale = scale;
+
+    idxsz /= stride;
+    CHECK(tm->idx = calloc(idxsz, sizeof(*tm->idx)));
     for (i = 0; i < idxsz; i += 3) {
         /* swap i+1 and i+2 on either side to switch winding */
-        tidx[i + 0] = idx[i + 0];
-        tidx[i + 1] = idx[i + 1];
-        tidx[i + 2] = idx[i + 2];
+        if (stride == sizeof(unsigned int)) {
+            unsigned int *idx = m->collision_idx;
+
+            tm->idx[i + 0] = idx[i + 0];
+            tm->idx[i + 1] = idx[i + 1];
+            tm->idx[i + 2] = idx[i + 2];
+        } else {
+            unsigned short *idx = m->collision_idx;
+
+            tm->idx[i + 0] = idx[i + 0];
+            tm->idx[i + 1] = idx[i + 1];
+            tm->idx[i + 2] = idx[i + 2];
+        }
     }
 
+    /* the scale has to be in the vertices, the rotation goes to the geom */
     vxsz /= sizeof(GLfloat);
-    CHECK(tvx = calloc(vxsz, sizeof(*tvx)));
-    for (i = 0; i < vxsz; i += 3) {
-        /* apply rotation and scale */
-        mat4x4 trans;
-        vec4 pos = { vx[i + 0], vx[i + 1], vx[i + 2], 1 };
-        vec4 res;
-        mat4x4_identity(trans);
-        mat4x4_rotate_X(trans, trans, e->rx);
-        mat4x4_rotate_Y(trans, trans, e->ry);
-        mat4x4_rotate_Z(trans, trans, e->rz);
-        mat4x4_scale_aniso(trans, trans, e->scale, e->scale, e->scale);
-        mat4x4_mul_vec4(res, trans, pos);
-        tvx[i + 0] = res[0];
-        tvx[i + 1] = res[1];
-        tvx[i + 2] = res[2];
-    }
-    /*if (m->norm) {
-        CHECK(tnorm = calloc(vxsz, sizeof(*tnorm)));
-        for (i = 0; i < vxsz; i += 3) {
-            //vec3_norm(&norm[i], &norm[i]);
-            tnorm[i + 0] = m->norm[i + 0];
-            tnorm[i + 1] = m->norm[i + 1];
-            tnorm[i + 2] = m->norm[i + 2];
-            dNormalize3(&tnorm[i]);
-        }
-    }*/
+    CHECK(tm->vx = calloc(vxsz, sizeof(*tm->vx)));
+    for (i = 0; i < vxsz; i++)
+        tm->vx[i] = vx[i] * scale;
+
+    tm->data = dGeomTriMeshDataCreate();
 #ifdef dDOUBLE
-    dGeomTriMeshDataBuildDouble(meshdata, tvx, 3 * sizeof(dReal), vxsz / 3, tidx, idxsz, 3 * sizeof(dTriIndex));
+    dGeomTriMeshDataBuildDouble(tm->data, tm->vx, 3 * sizeof(dReal), vxsz / 3, tm->idx, idxsz,
+                                3 * sizeof(dTriIndex));
 #else
-    dGeomTriMeshDataBuildSingle1(meshdata, tvx, 3 * sizeof(float), vxsz / 3, tidx, idxsz, 3 * sizeof(dTriIndex), NULL);
+    dGeomTriMeshDataBuildSingle1(tm->data, tm->vx, 3 * sizeof(float), vxsz / 3, tm->idx, idxsz,
+                                 3 * sizeof(dTriIndex), NULL);
 #endif
-    //dGeomTriMeshDataBuildSimple(meshdata, tvx, vxsz, tidx, idxsz);
-    dGeomTriMeshDataPreprocess2(meshdata, (1U << dTRIDATAPREPROCESS_BUILD_FACE_ANGLES), NULL);
-    //dGeomTriMeshDataPreprocess2(meshdata, (1U << dTRIDATAPREPROCESS_BUILD_CONCAVE_EDGES), NULL);
-    CHECK(trimesh = dCreateTriMesh(phys->space, meshdata, NULL, NULL, NULL));
+    dGeomTriMeshDataPreprocess2(tm->data, (1U << dTRIDATAPREPROCESS_BUILD_FACE_ANGLES), NULL);
+    //dGeomTriMeshDataPreprocess2(tm->data, (1U << dTRIDATAPREPROCESS_BUILD_CONCAVE_EDGES), NULL);
+
+    tm->next = m->trimesh;
+    m->trimesh = tm;
+
+    return tm;
+}
+
+/* entity's rotation, in the same order as xform_rebuild() applies it */
+static void phys_entity_rotation(struct entity3d *e, dMatrix3 rot)
+{
+    mat4x4 trans;
+    int i, j;
+
+    mat4x4_identity(trans);
+    mat4x4_rotate_X(trans, trans, e->rx);
+    mat4x4_rotate_Y(trans, trans, e->ry);
+    mat4x4_rotate_Z(trans, trans, e->rz);
+
+    /* dMatrix3 is row major, with a padding column */
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++)
+            rot[i * 4 + j] = trans[j][i];
+        rot[i * 4 + 3] = 0;
+    }
+}
+
+dGeomID phys_geom_trimesh_new(struct phys *phys, struct phys_body *body, struct entity3d *e, double mass)
+{
+    struct phys_trimesh *tm = phys_trimesh_get(e->txmodel->model, e->scale);
+    dGeomID trimesh = NULL;
+    dMatrix3 rot;
+
+    CHECK(trimesh = dCreateTriMesh(phys->space, tm->data, NULL, NULL, NULL));
     //dGeomSetData(trimesh, e);
+    phys_entity_rotation(e, rot);
+    dGeomSetRotation(trimesh, rot);
 
     /*
      * XXX: terrain.c corner case, calls here directly with body==NULL
@@ -589,6 +996,7 @@ dGeomID phys_geom_trimesh_new(struct phys *phys, struct phys_body *body, struct
     if (body) {
         body->geom = trimesh;
         if (phys_body_has_body(body)) {
+            /* with the geom's rotation, same as phys_body_new()'s offset */
             dMassSetTrimeshTotal(&body->mass, mass, body->geom);
             dGeomSetPosition(body->geom, -body->mass.c[0], -body->mass.c[1], -body->mass.c[2]);
             dMassTranslate(&body->mass, -body->mass.c[0], -body->mass.c[1], -body->mass.c[2]);
@@ -599,6 +1007,13 @@ dGeomID phys_geom_trimesh_new(struct phys *phys, struct phys_body *body, struct
     return trimesh;
 }
 
+/* static against static never makes a contact */
+static void phys_geom_set_static(dGeomID geom)
+{
+    dGeomSetCategoryBits(geom, PHYS_CAT_STATIC);
+    dGeomSetCollideBits(geom, ~PHYS_CAT_STATIC);
+}
+
 struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int class,
                                 double geom_radius, double geom_offset, int type, double mass)
 {
@@ -630,7 +1045,12 @@ struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int
         dBodySetRotation(body->body, rot);
         dGeomSetBody(body->geom, body->body);
         dBodySetData(body->body, entity);
-        if (class == dCapsuleClass) {
+        if (class == dTriMeshClass) {
+            /* the trimesh data is shared, the entity's rotation is the geom's */
+            dMatrix3 R;
+            phys_entity_rotation(entity, R);
+            dGeomSetOffsetRotation(body->geom, R);
+        } else if (class == dCapsuleClass) {
             // Capsule geometry assumes that Z goes upwards,
             // so cylinder's axis is parallel to Z axis.
             // We need to rotate the local geometry so that
@@ -639,6 +1059,7 @@ struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int
             dRFromAxisAndAngle(R, 1.0, 1.0, 1.0, -M_PI * 2.0 / 3.0);
             dGeomSetOffsetRotation(body->geom, R);
         }
+        dGeomSetCategoryBits(body->geom, PHYS_CAT_DYNAMIC);
         dSpaceRemove(phys->space, body->geom);
         dSpaceAdd(phys->character_space, body->geom);
     } else {
@@ -649,14 +1070,17 @@ struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int
             // we can just set its rotation, since it is not
             // going to change.
             dRFromAxisAndAngle(rot, 1.0, 1.0, 1.0, -M_PI * 2.0 / 3.0);
+        } else if (class == dTriMeshClass) {
+            phys_entity_rotation(entity, rot);
         }
         
         dGeomSetRotation(body->geom, rot);
+        phys_geom_set_static(body->geom);
         dSpaceRemove(phys->space, body->geom);
         dSpaceAdd(phys->ground_space, body->geom);
     }
     dGeomSetData(body->geom, entity);
-    list_append(&phys_bodies, &body->entry);
+    list_append(&phys->bodies, &body->entry);
 
     if (has_body) {
         body->lmotor = dJointCreateLMotor(phys->world, 0);
@@ -672,13 +1096,62 @@ struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int
     return body;
 }
 
+#define PHYS_HEIGHTFIELD_THICKNESS 1.0
+
+/* ODE's @x goes along X and @z along Z, same as terrain.c's */
+static dReal phys_heightfield_sample(void *data, int x, int z)
+{
+    struct phys_body *body = data;
+
+    return body->hf_map[x * body->hf_nr + z];
+}
+
+struct phys_body *phys_body_new_heightfield(struct phys *phys, struct entity3d *entity,
+                                            const float *map, unsigned int nr, float side,
+                                            const float *pos)
+{
+    float hmin = INFINITY, hmax = -INFINITY;
+    struct phys_body *body;
+    unsigned int i;
+
+    CHECK(body = calloc(1, sizeof(*body)));
+    list_init(&body->pen_entry);
+    body->phys = phys;
+    body->hf_map = map;
+    body->hf_nr = nr;
+
+    for (i = 0; i < nr * nr; i++) {
+        hmin = min(hmin, map[i]);
+        hmax = max(hmax, map[i]);
+    }
+
+    CHECK(body->hf_data = dGeomHeightfieldDataCreate());
+    dGeomHeightfieldDataBuildCallback(body->hf_data, body, phys_heightfield_sample,
+                                      side, side, nr, nr, 1.0, 0.0,
+                                      PHYS_HEIGHTFIELD_THICKNESS, 0);
+    dGeomHeightfieldDataSetBounds(body->hf_data, hmin, hmax);
+
+    CHECK(body->geom = dCreateHeightfield(phys->ground_space, body->hf_data, 1));
+    /* ODE's heightfields are centered around their origin */
+    dGeomSetPosition(body->geom, pos[0] + side / 2, pos[1], pos[2] + side / 2);
+    phys_geom_set_static(body->geom);
+    dGeomSetData(body->geom, entity);
+    list_append(&phys->bodies, &body->entry);
+
+    return body;
+}
+
 void phys_body_done(struct phys_body *body)
 {
     list_del(&body->entry);
+    /* the others' grounding rays may have hit it */
+    phys_bodies_ground_reset(body->phys);
     if (body->geom)
         dGeomDestroy(body->geom);
     if (body->body)
         dBodyDestroy(body->body);
+    if (body->hf_data)
+        dGeomHeightfieldDataDestroy(body->hf_data);
     body->geom = NULL;
     body->body = NULL;
     free(body);
@@ -702,34 +1175,74 @@ static void ode_message(int errnum, const char *msg, va_list ap)
     vlogg(NORMAL, "ODE", -1, "\n", msg, ap);
 }
 
-int phys_init(void)
+static void phys_drop(struct ref *ref)
 {
-    dInitODE2(0);
-    // dSetErrorHandler(ode_error);
-    dSetDebugHandler(ode_debug);
-    dSetMessageHandler(ode_message);
+    struct phys *phys = container_of(ref, struct phys, ref);
+
+    err_on(!list_empty(&phys->bodies), "world still has bodies\n");
+    phys_threading_done(phys);
+    dGeomDestroy(phys->ray);
+    darray_clearout(&phys->ground_rays.da);
+    dSpaceDestroy(phys->ground_space);
+    dSpaceDestroy(phys->character_space);
+    dSpaceDestroy(phys->collision);
+    dSpaceDestroy(phys->space);
+    dJointGroupDestroy(phys->contact);
+    dWorldDestroy(phys->world);
+}
+
+DECLARE_REFCLASS(phys);
+
+struct phys *phys_new(void)
+{
+    struct phys *phys;
+
+    phys = ref_new(phys);
+    if (!phys)
+        return NULL;
+
+    list_init(&phys->bodies);
+    darray_init(&phys->ground_rays);
     phys->world = dWorldCreate();
     phys->space = dHashSpaceCreate(0);
     phys->collision = dHashSpaceCreate(phys->space);
-    phys->character_space = dHashSpaceCreate(phys->space);
+    /* few of them, all moving: sweep and prune along X and Z, Y is up */
+    phys->character_space = dSweepAndPruneSpaceCreate(phys->space, dSAP_AXES_XZY);
     phys->ground_space = dHashSpaceCreate(phys->space);
     phys->contact = dJointGroupCreate(0);
+    phys->ray = dCreateRay(0, 1);
+    dGeomRaySetClosestHit(phys->ray, 1);
+    /* avoid self-intersections as much as possible */
+    dGeomRaySetBackfaceCull(phys->ray, 1);
     dWorldSetGravity(phys->world, 0, -9.8, 0);
     // dWorldSetCFM(phys->world, 1e-5);
     // dWorldSetERP(phys->world, 0.8);
     //dWorldSetContactSurfaceLayer(phys->world, 0.001);
     dWorldSetLinearDamping(phys->world, 0.001);
+    dWorldSetAutoDisableFlag(phys->world, 1);
+    dWorldSetAutoDisableLinearThreshold(phys->world, PHYS_SLEEP_LINEAR);
+    dWorldSetAutoDisableAngularThreshold(phys->world, PHYS_SLEEP_ANGULAR);
+    dWorldSetAutoDisableSteps(phys->world, PHYS_SLEEP_STEPS);
+    dWorldSetAutoDisableTime(phys->world, 0);
+    phys_set_rate(phys, default_rate, default_max_substeps);
+
+    return phys;
+}
+
+int phys_init(unsigned int rate, unsigned int max_substeps)
+{
+    dInitODE2(0);
+    // dSetErrorHandler(ode_error);
+    dSetDebugHandler(ode_debug);
+    dSetMessageHandler(ode_message);
+    default_rate = rate;
+    default_max_substeps = max_substeps;
 
     return 0;
 }
 
 void phys_done(void)
 {
-    dSpaceDestroy(phys->ground_space);
-    dSpaceDestroy(phys->character_space);
-    dSpaceDestroy(phys->collision);
-    dSpaceDestroy(phys->space);
-    dWorldDestroy(phys->world);
     dCloseODE();
 }
 
@@ -9,12 +9,34 @@
 #endif
 #include <ode/ode.h>
 #include "linmath.h"
+#include "object.h"
+#include "util.h"
 
 enum {
     PHYS_BODY = 0,
     PHYS_GEOM,
 };
 
+/*
+ * Batched ray casts: @start, @dir (normalized), @dist (ray's length) and
+ * @ignore (usually whoever's casting) go in; @hit, @dist to it, @pos and
+ * surface @normal of it come out, @hit is NULL if the ray hit nothing.
+ * With PHYS_RAY_GROUND, the ray only looks at the ground, and one going
+ * straight down over the heightfield doesn't need the geoms for it.
+ */
+#define PHYS_RAY_GROUND 1
+
+struct phys_ray {
+    vec3            start;
+    vec3            dir;
+    double          dist;
+    struct entity3d *ignore;
+    unsigned int    flags;
+    struct entity3d *hit;
+    vec3            pos;
+    vec3            normal;
+};
+
 struct phys_body {
     struct phys *phys;
     /* geom is always set */
@@ -37,6 +59,11 @@ struct phys_body {
     /* contact.surface parameters */
     dReal       bounce;
     dReal       bounce_vel;
+    /* heightfield specific, see phys_body_new_heightfield() */
+    dHeightfieldDataID  hf_data;
+    const float *hf_map;
+    unsigned int hf_nr;
+
     /* not sure we even need to store the mass */
     dMass       mass;
     struct list entry;
@@ -45,9 +72,22 @@ struct phys_body {
     struct list pen_entry;
     vec3        pen_norm;
     dReal       pen_depth;
+
+    /* body position before and after the last step, see phys_advance() */
+    dVector3    prev_pos;
+    dVector3    cur_pos;
+
+    /* the grounding ray from the last phys_advance() that took a step */
+    struct phys_ray ground;
+    bool        ground_valid;
 };
 
+/*
+ * A physics world: scenes own one each (scene::phys), so that independent
+ * ones can be simulated side by side; bodies know theirs (phys_body::phys)
+ */
 struct phys {
+    struct ref  ref;
     dWorldID    world;
     dSpaceID    space;
     dSpaceID    character_space;
@@ -55,31 +95,158 @@ struct phys {
     dSpaceID    collision;
     dJointGroupID contact;
     void        (*ground_contact)(void *priv, float x, float y, float z);
+    /* phys_body::entry */
+    struct list bodies;
+
+    /*
+     * Fixed timestep: phys_advance() runs as many steps of @step seconds
+     * as fit in the time that passed, up to @max_substeps per call; @alpha
+     * is how far into the next step the leftover time is, for interpolating
+     * between the last two states
+     */
+    double      step;
+    double      accumulator;
+    unsigned int max_substeps;
+    float       alpha;
+
+    /* see phys_set_config() */
+    bool        exact;
+    dThreadingImplementationID  threading;
+    dThreadingThreadPoolID      pool;
+
+    /* reused by all ray casts; isn't in any space */
+    dGeomID     ray;
+    /* all bodies' grounding rays go out in one batch */
+    darray(struct phys_ray, ground_rays);
+
+    /* regular grid ground, for PHYS_RAY_GROUND ray casts */
+    struct phys_heightfield {
+        struct entity3d *entity;
+        float           (*height)(void *priv, float x, float z);
+        void            *priv;
+        float           aabb[6];
+    } heightfield;
+
+    /* last phys_step(): geom pairs out of the broadphase, contacts they made */
+    struct phys_stats {
+        unsigned long   pairs;
+        unsigned long   contacts;
+    } stats;
 };
 
-extern struct phys *phys;
+/*
+ * Geoms without bodies don't move, so they only ever need testing against
+ * the ones that do; see phys_body_new()
+ */
+#define PHYS_CAT_STATIC         (1ul << 0)
+#define PHYS_CAT_DYNAMIC        (1ul << 1)
+
+#define PHYS_DEFAULT_RATE       100
+#define PHYS_DEFAULT_SUBSTEPS   8
+#define PHYS_DEFAULT_ITERATIONS 20
+
+/*
+ * Bodies slower than these for PHYS_SLEEP_STEPS steps in a row get disabled
+ * by ODE (along with their island) until something touches or moves them
+ */
+#define PHYS_SLEEP_LINEAR       0.01
+#define PHYS_SLEEP_ANGULAR      0.01
+#define PHYS_SLEEP_STEPS        10
 
 struct entity3d;
+struct settings;
+
+/*
+ * How a world steps, zeroes mean defaults:
+ * @exact:        dWorldStep(), the big matrix solver, instead of the
+ *                iterative dWorldQuickStep(); slower, stiffer stacks
+ * @iterations:   dWorldQuickStep() iterations, ODE's own 20 by default
+ * @rate:         fixed steps per second, see phys_set_rate()
+ * @max_substeps: steps per phys_advance() at most
+ * @threads:      ODE's threaded islands solver with this many threads
+ *                in its own pool; 0 and 1 step on the caller's thread
+ */
+struct phys_config {
+    bool            exact;
+    unsigned int    iterations;
+    unsigned int    rate;
+    unsigned int    max_substeps;
+    unsigned int    threads;
+};
+
+/*
+ * The "physics" object of the settings: { "solver": "quick" or "exact",
+ * "iterations", "rate", "substeps", "threads" }; what's missing stays as
+ * it is in @cfg
+ */
+void phys_config_from_settings(struct phys_config *cfg, struct settings *rs);
+/* -ENOTSUP if ODE is built without threading, and stays single threaded */
+int phys_set_config(struct phys *phys, const struct phys_config *cfg);
 
-void phys_step(unsigned long frame_count);
-int  phys_init(void);
+/* ODE itself; the rate and substeps are the defaults for phys_new() */
+int  phys_init(unsigned int rate, unsigned int max_substeps);
 void phys_done(void);
+/* a new world after phys_init(), ref_put() it after its bodies are gone */
+struct phys *phys_new(void);
+void phys_step(struct phys *phys, unsigned long frame_count);
+/* @rate: steps per second; zeroes mean defaults */
+void phys_set_rate(struct phys *phys, unsigned int rate, unsigned int max_substeps);
+/* size the broadphase for the static geometry inside @aabb (laid out like entity3d::aabb) */
+void phys_set_bounds(struct phys *phys, const float *aabb);
+/* advance the simulation by @dt seconds, returns the number of steps taken */
+unsigned int phys_advance(struct phys *phys, double dt);
 void phys_ground_add(struct entity3d *e);
-struct entity3d *phys_ray_cast(struct entity3d *e, vec3 start, vec3 dir, double *pdist);
+struct entity3d *phys_ray_cast(struct phys *phys, struct entity3d *e, vec3 start, vec3 dir,
+                               double *pdist);
+
+/* see struct phys_ray */
+void phys_ray_cast_batch(struct phys *phys, struct phys_ray *rays, unsigned int nr);
+/* @height: ground height at (x, z), within @aabb; NULL @height to unset */
+void phys_set_heightfield(struct phys *phys, struct entity3d *e, const float *aabb,
+                          float (*height)(void *priv, float x, float z), void *priv);
 static inline bool phys_body_has_body(struct phys_body *body) { return !!body->body; }
+static inline bool phys_body_is_asleep(struct phys_body *body)
+{
+    return phys_body_has_body(body) && !dBodyIsEnabled(body->body);
+}
+void phys_body_wake(struct phys_body *body);
 struct entity3d *phys_body_entity(struct phys_body *body);
 const dReal *phys_body_position(struct phys_body *body);
 const dReal *phys_body_rotation(struct phys_body *body);
+/* between the last two steps, for rendering */
+void phys_body_interp_position(struct phys_body *body, dReal *pos);
 dGeomID phys_geom_capsule_new(struct phys *phys, struct phys_body *body, struct entity3d *e,
                               double mass, double geom_radius, double geom_offset);
+/*
+ * A model's collision mesh at one scale, built once and shared by all
+ * of its entities' trimesh geoms, which only add their own position and
+ * rotation; model3d::trimesh has a list of them, one per scale in use.
+ */
+struct phys_trimesh {
+    struct phys_trimesh *next;
+    dTriMeshDataID      data;
+    dReal               *vx;
+    dTriIndex           *idx;
+    float               scale;
+};
+
+void phys_trimesh_free(struct phys_trimesh *tm);
 dGeomID phys_geom_trimesh_new(struct phys *phys, struct phys_body *body, struct entity3d *e, double mass);
 struct phys_body *phys_body_new(struct phys *phys, struct entity3d *entity, int class,
                                 double geom_radius, double geom_offset, int type, double mass);
+/*
+ * Static terrain: @nr by @nr samples of @map[x * @nr + z] spanning @side
+ * along X and Z from @pos, which is the minimum corner; the heights are on
+ * top of pos[1]. @map isn't copied and has to outlive the body.
+ */
+struct phys_body *phys_body_new_heightfield(struct phys *phys, struct entity3d *entity,
+                                            const float *map, unsigned int nr, float side,
+                                            const float *pos);
 int phys_body_update(struct entity3d *e);
 void phys_body_done(struct phys_body *body);
 bool phys_body_ground_collide(struct phys_body *body);
 bool phys_body_is_grounded(struct phys_body *body);
-void phys_ground_entity(struct entity3d *e);
+void phys_ground_entity(struct phys *phys, struct entity3d *e);
 
 struct scene;
 void phys_debug_draw(struct scene *scene, struct phys_body *body);
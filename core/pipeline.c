@@ -1,27 +1,193 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <math.h>
+#include <stdio.h>
 #include "model.h"
 #include "pipeline.h"
+#include "profiler.h"
+#include "render.h"
 #include "scene.h"
 #include "shader.h"
+#include "ui-debug.h"
 
 struct render_pass {
     struct render_pass  *src;
     struct fbo          *fbo;
     struct mq           mq;
+    struct model3dtx    *txm;
     struct list         entry;
+    /* for the profiler */
+    const char          *name;
+    /* multisampled, resolved into the next pass */
     bool                blit;
+    /* renders the scene, the only one that needs depth */
+    bool                depth;
+    /* nothing reads what it renders */
+    bool                culled;
+    /* the last step that reads its fbo */
+    int                 last_read;
+    unsigned int        slot;
+    /* the last pipeline_render()'s */
+    struct render_stats stats;
 };
 
+/*
+ * FBOs are shared between all pipelines: nothing is expected to survive
+ * a pipeline_render(), so slot N of one pipeline is the same FBO as slot
+ * N of the other ones with the same size and attachments. Within a
+ * pipeline, passes whose FBOs aren't in use at the same time share slots.
+ */
+struct fbo_slot {
+    struct list     entry;
+    struct fbo      *fbo;
+    int             width;
+    int             height;
+    bool            ms;
+    bool            depth;
+    unsigned int    nr;
+    unsigned int    users;
+};
+
+static DECLARE_LIST(fbo_slots);
+
+static struct fbo *fbo_slot_get(int width, int height, bool ms, bool depth, unsigned int nr)
+{
+    struct fbo_slot *slot;
+
+    list_for_each_entry(slot, &fbo_slots, entry)
+        if (slot->width == width && slot->height == height && slot->ms == ms &&
+            slot->depth == depth && slot->nr == nr) {
+            slot->users++;
+            return slot->fbo;
+        }
+
+    CHECK(slot = calloc(1, sizeof(*slot)));
+    CHECK(slot->fbo = fbo_new_ms_depth(width, height, ms, depth));
+    slot->width  = width;
+    slot->height = height;
+    slot->ms     = ms;
+    slot->depth  = depth;
+    slot->nr     = nr;
+    slot->users  = 1;
+    list_append(&fbo_slots, &slot->entry);
+
+    return slot->fbo;
+}
+
+static void fbo_slot_put(struct fbo *fbo)
+{
+    struct fbo_slot *slot;
+
+    list_for_each_entry(slot, &fbo_slots, entry)
+        if (slot->fbo == fbo) {
+            if (!--slot->users) {
+                list_del(&slot->entry);
+                ref_put(slot->fbo);
+                free(slot);
+            }
+            return;
+        }
+}
+
+static void pipeline_release(struct pipeline *pl)
+{
+    struct render_pass *pass;
+
+    list_for_each_entry(pass, &pl->passes, entry) {
+        if (pass->fbo)
+            fbo_slot_put(pass->fbo);
+        pass->fbo = NULL;
+        if (pass->txm)
+            pass->txm->texture = NULL;
+    }
+    pl->width = pl->height = 0;
+}
+
+/*
+ * The last pass goes to the screen, the rest only matter if something
+ * downstream reads them. Then, every surviving pass gets an FBO slot that
+ * isn't read by anything at or after its step.
+ */
+static void pipeline_compile(struct pipeline *pl)
+{
+    struct render_pass *pass, *other, *last;
+    struct scene *s = pl->scene;
+    unsigned int nr;
+    int step, nr_steps = 0;
+    bool taken;
+
+    pipeline_release(pl);
+    if (list_empty(&pl->passes))
+        return;
+
+    list_for_each_entry(pass, &pl->passes, entry) {
+        pass->culled = true;
+        pass->last_read = -1;
+        nr_steps++;
+    }
+
+    /* src always comes before the pass that reads it */
+    last = list_last_entry(&pl->passes, struct render_pass, entry);
+    last->culled = false;
+    last->last_read = nr_steps;
+    step = nr_steps - 1;
+    for (pass = last;; pass = list_prev_entry(pass, entry), step--) {
+        if (!pass->culled && pass->src) {
+            pass->src->culled = false;
+            pass->src->last_read = max(pass->src->last_read, step);
+        }
+        if (pass == list_first_entry(&pl->passes, struct render_pass, entry))
+            break;
+    }
+
+    step = 0;
+    list_for_each_entry(pass, &pl->passes, entry) {
+        if (pass->culled) {
+            dbg("pipeline: culling pass '%s'\n", pass->name);
+            step++;
+            continue;
+        }
+
+        /* the lowest slot of this kind that no one still needs */
+        for (nr = 0;; nr++) {
+            taken = false;
+            list_for_each_entry(other, &pl->passes, entry) {
+                if (other == pass)
+                    break;
+                if (!other->culled && other->slot == nr && other->last_read >= step &&
+                    other->blit == pass->blit && other->depth == pass->depth) {
+                    taken = true;
+                    break;
+                }
+            }
+            if (!taken)
+                break;
+        }
+
+        pass->slot = nr;
+        pass->fbo = fbo_slot_get(s->width, s->height, pass->blit, pass->depth, nr);
+        if (pass->txm)
+            pass->txm->texture = &pass->fbo->tex;
+        step++;
+    }
+
+    pl->width  = s->width;
+    pl->height = s->height;
+    /* the quads' texture coordinates are relative to the size */
+    pl->tx_scale = 0;
+}
+
 static void pipeline_drop(struct ref *ref)
 {
     struct pipeline *pl = container_of(ref, struct pipeline, ref);
     struct render_pass *pass, *iter;
 
+    pipeline_release(pl);
     list_for_each_entry_iter(pass, iter, &pl->passes, entry) {
         mq_release(&pass->mq);
-        ref_put(pass->fbo);
         free(pass);
     }
+    if (pl->timers[0][0])
+        GL(glDeleteQueries(PIPELINE_TIMERS * 2, &pl->timers[0][0]));
 }
 DECLARE_REFCLASS(pipeline);
 
@@ -32,10 +198,92 @@ struct pipeline *pipeline_new(struct scene *s)
     CHECK(pl = ref_new(pipeline));
     list_init(&pl->passes);
     pl->scene = s;
+    pl->scale = 1;
 
     return pl;
 }
 
+void pipeline_set_gpu_target(struct pipeline *pl, float target_ms, float min_scale)
+{
+    if (target_ms > 0 && !render_has_timer_queries()) {
+        warn("pipeline: no timer queries, no dynamic resolution\n");
+        target_ms = 0;
+    }
+
+    if (target_ms > 0 && !pl->timers[0][0])
+        GL(glGenQueries(PIPELINE_TIMERS * 2, &pl->timers[0][0]));
+
+    pl->target_ms = target_ms;
+    pl->min_scale = clampf(min_scale, 0.1, 1);
+    pl->gpu_ms = 0;
+    if (!target_ms)
+        pl->scale = 1;
+}
+
+/*
+ * The GPU time goes with the number of pixels, so the scale that would hit
+ * the target is sqrt(target / time) of the current one. It goes there a step
+ * at a time, because the measurements that follow a change are still of the
+ * old scale, and within PIPELINE_SLACK of the target, it stays where it is.
+ */
+#define PIPELINE_SLACK      0.1
+#define PIPELINE_MAX_STEP   0.05
+#define PIPELINE_SMOOTH     0.2
+
+static void pipeline_scale_update(struct pipeline *pl, float ms)
+{
+    float ratio;
+
+    pl->gpu_ms = pl->gpu_ms ? pl->gpu_ms + (ms - pl->gpu_ms) * PIPELINE_SMOOTH : ms;
+    if (fabsf(pl->gpu_ms - pl->target_ms) < pl->target_ms * PIPELINE_SLACK)
+        return;
+
+    ratio = clampf(sqrtf(pl->target_ms / pl->gpu_ms), 1 - PIPELINE_MAX_STEP, 1 + PIPELINE_MAX_STEP);
+    pl->scale = clampf(pl->scale * ratio, pl->min_scale, 1);
+}
+
+static void pipeline_timers_collect(struct pipeline *pl)
+{
+    uint64_t start, end;
+    unsigned int i;
+
+    for (i = 0; i < PIPELINE_TIMERS; i++) {
+        if (!(pl->pending & (1u << i)))
+            continue;
+
+        if (!render_timestamp_get(pl->timers[i][1], &end) ||
+            !render_timestamp_get(pl->timers[i][0], &start))
+            continue;
+
+        pl->pending &= ~(1u << i);
+        if (end > start)
+            pipeline_scale_update(pl, (end - start) / 1e6);
+    }
+}
+
+/* the quads sample the part of their FBOs that was rendered to */
+static void pipeline_scale_quads(struct pipeline *pl, int width, int height)
+{
+    struct render_pass *pass;
+    struct model3d *m;
+    GLfloat tx[8];
+    int i;
+
+    list_for_each_entry(pass, &pl->passes, entry) {
+        if (!pass->txm)
+            continue;
+
+        m = pass->txm->model;
+        for (i = 0; i < array_size(tx); i += 2) {
+            tx[i]     = m->batch_tx[i] * width / pl->width;
+            tx[i + 1] = m->batch_tx[i + 1] * height / pl->height;
+        }
+        model3d_update_vectors(m, m->batch_vx, tx, 0, 4, m->nr_faces[0]);
+    }
+
+    pl->tx_scale = pl->scale;
+}
+
 struct render_pass *pipeline_add_pass(struct pipeline *pl, struct render_pass *src, const char *prog_name, bool ms)
 {
     struct render_pass *pass;
@@ -46,11 +294,14 @@ struct render_pass *pipeline_add_pass(struct pipeline *pl, struct render_pass *s
 
     CHECK(pass = calloc(1, sizeof(*pass)));
     list_append(&pl->passes, &pass->entry);
-    CHECK(pass->fbo = fbo_new_ms(pl->scene->width, pl->scene->height, ms));
 
     pass->src = src;
     pass->blit = ms;
+    pass->depth = !src;
+    pass->name = prog_name ? prog_name : ms ? "scene" : "pass";
     mq_init(&pass->mq, NULL);
+    /* the graph changed */
+    pl->width = pl->height = 0;
 
     if (!prog_name)
         return pass;
@@ -59,57 +310,137 @@ struct render_pass *pipeline_add_pass(struct pipeline *pl, struct render_pass *s
     m = model3d_new_quad(p, -1, 1, 0.1, 2, -2);
     m->cull_face = false;
     m->alpha_blend = false;
-    txm = model3dtx_new_texture(ref_pass(m), &pass->fbo->tex);
+    /* the texture is the pass' fbo, once pipeline_compile() picks it */
+    txm = model3dtx_new_texture(ref_pass(m), NULL);
     mq_add_model(&pass->mq, txm);
     e = entity3d_new(txm);
     list_append(&txm->entities, &e->entry);
     e->visible = true;
     mat4x4_identity(e->mx->m);
     ref_put(p);
+    pass->txm = txm;
 
     return pass;
 }
 
+/* the last frame's, per pass, on the debug overlay */
+static void pipeline_stats_show(struct pipeline *pl, struct render_stats *screen)
+{
+    struct render_pass *pass;
+    char buf[2048];
+    size_t len = 0;
+
+    len += snprintf(buf + len, sizeof(buf) - len, "%-16s ", "pipeline");
+    len += render_stats_print(buf + len, sizeof(buf) - len, &pl->stats);
+    list_for_each_entry(pass, &pl->passes, entry) {
+        if (pass->culled || len >= sizeof(buf))
+            continue;
+
+        len += snprintf(buf + len, sizeof(buf) - len, "\n%-16s ", pass->name);
+        len += render_stats_print(buf + min(len, sizeof(buf)), sizeof(buf) - min(len, sizeof(buf)),
+                                  &pass->stats);
+    }
+
+    if (len < sizeof(buf)) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\n%-16s ", "screen");
+        render_stats_print(buf + min(len, sizeof(buf)), sizeof(buf) - min(len, sizeof(buf)), screen);
+    }
+
+    ui_debug_printf("%s", buf);
+}
+
 void pipeline_render(struct pipeline *pl)
 {
     struct scene *s = pl->scene;
-    struct render_pass *first_pass = list_first_entry(&pl->passes, struct render_pass, entry);
     struct render_pass *last_pass = list_last_entry(&pl->passes, struct render_pass, entry);
-    struct render_pass *pass = first_pass;
+    struct render_pass *pass;
     struct render_pass *ppass = NULL;
+    struct render_stats start, pass_start, now, screen;
+    unsigned int slot = 0;
+    int width, height;
+    bool timed = false;
+
+    PROF_SCOPE("pipeline_render");
+    render_stats(&start, false);
+
+    if (pl->width != s->width || pl->height != s->height)
+        pipeline_compile(pl);
+
+    if (pl->target_ms > 0) {
+        pipeline_timers_collect(pl);
+        /* if it's still not in, this frame goes untimed */
+        slot = pl->frame++ % PIPELINE_TIMERS;
+        timed = !(pl->pending & (1u << slot));
+        if (timed)
+            render_timestamp(pl->timers[slot][0]);
+    }
+
+    /* the part of the FBOs that the passes render to */
+    width = max((int)(pl->width * pl->scale), 1);
+    height = max((int)(pl->height * pl->scale), 1);
+    if (pl->tx_scale != pl->scale)
+        pipeline_scale_quads(pl, width, height);
 
     list_for_each_entry(pass, &pl->passes, entry) {
+        if (pass->culled)
+            continue;
+
+        PROF_SCOPE(pass->name);
+        render_stats(&pass_start, false);
+
         ppass = pass->src;
+        prof_gpu_begin(pass->name);
         /*
          * This renders the contents of @ppass, using its shader into
          * @pass texture.
          */
         if (ppass && ppass->blit) {
+            /* a resolve, the quads downstream don't need depth */
             fbo_prepare(pass->fbo);
             GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pass->fbo->fbo));
             GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, ppass->fbo->fbo));
-            GL(glBlitFramebuffer(0, 0, ppass->fbo->width, ppass->fbo->height,
-                                 0, 0, pass->fbo->width, pass->fbo->height,
-                                 GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+            render_stats_fbo();
+            GL(glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                                 GL_COLOR_BUFFER_BIT, GL_NEAREST));
              fbo_done(pass->fbo, s->width, s->height);
         } else {
             fbo_prepare(pass->fbo);
-            GL(glDisable(GL_DEPTH_TEST));
-            GL(glClearColor(0.2f, 0.2f, 0.6f, 1.0f));
-            GL(glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT));
-            if (pass == first_pass)
+            if (pl->scale < 1)
+                GL(glViewport(0, 0, width, height));
+            render_depth_test(false);
+            /* full screen quads cover all of it */
+            if (!ppass) {
+                GL(glClearColor(0.2f, 0.2f, 0.6f, 1.0f));
+                GL(glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT));
                 models_render(&s->mq, &s->light, &s->cameras[0], s->proj_mx, s->focus, s->width, s->height, NULL);
-            else
+                debug_draws_render(s, &s->cameras[0], s->proj_mx);
+            } else {
                 models_render(&ppass->mq, NULL, NULL, NULL, NULL, s->width, s->height, NULL);
+            }
 
             fbo_done(pass->fbo, s->width, s->height);
         }
+        prof_gpu_end();
+        render_stats(&now, false);
+        render_stats_diff(&pass->stats, &pass_start, &now);
     }
 
     /* render the last pass to the screen */
-    GL(glEnable(GL_DEPTH_TEST));
+    render_stats(&pass_start, false);
+    prof_gpu_begin("screen");
+    render_depth_test(true);
     GL(glClearColor(0.2f, 0.2f, 0.6f, 1.0f));
     GL(glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT));
     models_render(&last_pass->mq, NULL, NULL, NULL, NULL, s->width, s->height, NULL);
-}
+    prof_gpu_end();
+
+    render_stats(&now, false);
+    render_stats_diff(&screen, &pass_start, &now);
+    render_stats_diff(&pl->stats, &start, &now);
+    pipeline_stats_show(pl, &screen);
 
+    if (timed) {
+        render_timestamp(pl->timers[slot][1]);
+        pl->pending |= 1u << slot;
+    }
+}
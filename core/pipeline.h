@@ -2,17 +2,53 @@
 #ifndef __CLAP_PIPELINE_H__
 #define __CLAP_PIPELINE_H__
 
+#include "render.h"
+
 struct render_pass;
 
+#define PIPELINE_TIMERS 4
+
+/*
+ * A render graph: each pass reads its @src (or renders the scene, if
+ * there's none) and renders into an FBO, the last one onto the screen.
+ * The first pipeline_render() after the graph or the scene size changes
+ * culls the passes that nothing reads and gives the rest FBOs, shared
+ * between the passes that don't need them at the same time and with the
+ * other pipelines; only the passes that render the scene get depth.
+ */
 struct pipeline {
     // darray(struct render_pass, pass);
     struct scene        *scene;
     struct ref          ref;
     struct list         passes; 
+    /* what the FBOs are sized for, 0 if they're not there */
+    int                 width;
+    int                 height;
+    /* dynamic resolution, see pipeline_set_gpu_target() */
+    float               target_ms;
+    float               min_scale;
+    float               scale;
+    float               gpu_ms;
+    /* what the quads sample, last set for @scale */
+    float               tx_scale;
+    /* start and end timestamps of the last PIPELINE_TIMERS renders */
+    unsigned int        timers[PIPELINE_TIMERS][2];
+    unsigned int        pending;
+    unsigned long       frame;
+    /* the last pipeline_render()'s, see render_stats() */
+    struct render_stats stats;
 };
 
 struct pipeline *pipeline_new(struct scene *s);
 struct render_pass *pipeline_add_pass(struct pipeline *pl, struct render_pass *src, const char *prog_name, bool ms);
 void pipeline_render(struct pipeline *pl);
+/*
+ * Dynamic resolution: aim for @target_ms of GPU time per pipeline_render()
+ * by rendering into a part of the FBOs, which the last pass scales up to
+ * the screen. The part's width and height are a scale of the FBOs' down to
+ * @min_scale, which follows the GPU timer measurements a few frames late. It
+ * needs timer queries; a @target_ms of 0 is the full resolution.
+ */
+void pipeline_set_gpu_target(struct pipeline *pl, float target_ms, float min_scale);
 
 #endif /* __CLAP_PIPELINE_H__ */
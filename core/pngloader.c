@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,9 +10,11 @@
 #include "util.h"
 #include "librarian.h"
 #include "logger.h"
+#include "pngloader.h"
 
+/* into @dst of @dstsz bytes, if there is one, or into a new buffer */
 static unsigned char *parse_png(png_structp png, png_infop info, int *width, int *height,
-                                int *has_alpha)
+                                int *has_alpha, void *dst, size_t dstsz, size_t *szp)
 {
     png_bytep *row_pointers;
     png_byte  *buffer = NULL;
@@ -19,6 +22,7 @@ static unsigned char *parse_png(png_structp png, png_infop info, int *width, int
     png_byte bit_depth;
     int y, rowsz;
 
+    *szp = 0;
     png_set_sig_bytes(png, 8);
     png_read_info(png, info);
 
@@ -33,6 +37,11 @@ static unsigned char *parse_png(png_structp png, png_infop info, int *width, int
     //number_of_passes = png_set_interlace_handling(png);
     png_read_update_info(png, info);
 
+    if (dst && (size_t)*height * rowsz != dstsz) {
+        err("PNG is %dx%d, %d bytes per row, doesn't fit in %zu\n", *width, *height, rowsz, dstsz);
+        goto out;
+    }
+
     /* read file */
     if (setjmp(png_jmpbuf(png))) {
         err("[read_png_file] Error during read_image\n");
@@ -40,11 +49,12 @@ static unsigned char *parse_png(png_structp png, png_infop info, int *width, int
     }
 
     row_pointers = malloc(sizeof(png_bytep) * *height);
-    buffer = malloc(sizeof(png_byte) * *height * rowsz);
+    buffer = dst ? : malloc(sizeof(png_byte) * *height * rowsz);
     for (y = 0; y < *height; y++)
         row_pointers[y] = &buffer[rowsz * y];
 
     png_read_image(png, row_pointers);
+    *szp = (size_t)*height * rowsz;
 
     png_destroy_read_struct(&png, &info, NULL);
     free(row_pointers);
@@ -55,45 +65,23 @@ out:
 
 unsigned char *fetch_png(const char *file_name, int *width, int *height, int *has_alpha)
 {
-    LOCAL(FILE, fp);
-    LOCAL(char, uri);
-    unsigned char header[8];
-    png_structp png;
-    png_infop info;
-
-    uri = lib_figure_uri(RES_ASSET, file_name);
-    if (!uri)
-        return NULL;
-
-    fp = fopen(uri, "rb");
-    if (!fp) {
-        err("file '%s' could not be opened for reading", file_name);
-        return NULL;
-    }
-
-    if (fread(header, 1, 8, fp) != 8) {
-        fclose(fp);
-        return NULL;
-    }
-
-    if (png_sig_cmp(header, 0, 8)) {
-        err("file %s is not recognized as a PNG file", file_name);
-        fclose(fp);
-        return NULL;
-    }
-
-    /* initialize stuff */
-    CHECK(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL));
-    CHECK(info = png_create_info_struct(png));
+    unsigned char *buffer;
+    struct lib_handle *lh;
+    size_t size;
+    void *buf;
 
-    if (setjmp(png_jmpbuf(png))) {
-        err("error during init_io\n");
+    lh = lib_map_file(RES_ASSET, file_name, &buf, &size);
+    if (!lh) {
+        err("file '%s' could not be opened for reading\n", file_name);
         return NULL;
     }
 
-    png_init_io(png, fp);
+    buffer = decode_png(buf, size, width, height, has_alpha);
+    if (!buffer)
+        err("couldn't decode '%s'\n", file_name);
+    ref_put(lh);
 
-    return parse_png(png, info, width, height, has_alpha);
+    return buffer;
 }
 
 struct png_cursor {
@@ -113,14 +101,67 @@ static void png_read_mem(png_structp png, png_bytep data, png_size_t length)
     c->offset += length;
 }
 
-unsigned char *decode_png(void *buf, size_t length, int *width, int *height, int *has_alpha)
+/* bump when the decoded layout changes */
+#define PNG_CACHE_VERSION 1
+
+/* in front of the pixels in the cache entry */
+struct png_cache_hdr {
+    int32_t     width;
+    int32_t     height;
+    int32_t     has_alpha;
+    uint32_t    size;
+};
+
+static unsigned char *png_cache_get(const char *key, int *width, int *height, int *has_alpha)
+{
+    struct png_cache_hdr hdr;
+    size_t size;
+    void *buf;
+
+    if (lib_cache_get(key, &buf, &size))
+        return NULL;
+
+    memcpy(&hdr, buf, min(size, sizeof(hdr)));
+    if (size < sizeof(hdr) || size - sizeof(hdr) != hdr.size) {
+        free(buf);
+        return NULL;
+    }
+
+    /* the pixels go to the caller, who will free() them */
+    memmove(buf, buf + sizeof(hdr), hdr.size);
+    *width     = hdr.width;
+    *height    = hdr.height;
+    *has_alpha = hdr.has_alpha;
+
+    return buf;
+}
+
+static void png_cache_put(const char *key, unsigned char *buffer, size_t size, int width,
+                          int height, int has_alpha)
+{
+    struct png_cache_hdr hdr = {
+        .width      = width,
+        .height     = height,
+        .has_alpha  = has_alpha,
+        .size       = size,
+    };
+    struct iovec iov[] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = buffer, .iov_len = hdr.size },
+    };
+
+    lib_cache_put(key, iov, array_size(iov));
+}
+
+static unsigned char *decode_png_uncached(void *buf, size_t length, int *width, int *height,
+                                          int *has_alpha, void *dst, size_t dstsz, size_t *szp)
 {
     struct png_cursor cursor = { .buf = buf, .offset = 8, .length = length - 8 };
     unsigned char *header = buf;
     png_structp png;
     png_infop info;
 
-    if (png_sig_cmp(header, 0, 8)) {
+    if (length < 8 || png_sig_cmp(header, 0, 8)) {
         err("buffer is not recognized as a PNG file\n");
         return NULL;
     }
@@ -136,5 +177,79 @@ unsigned char *decode_png(void *buf, size_t length, int *width, int *height, int
 
     png_set_read_fn(png, &cursor, png_read_mem);
 
-    return parse_png(png, info, width, height, has_alpha);
+    return parse_png(png, info, width, height, has_alpha, dst, dstsz, szp);
+}
+
+static void png_cache_key(char *key, void *buf, size_t length)
+{
+    SHA1_CTX ctx;
+
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, buf, length);
+    lib_cache_key(key, "png", PNG_CACHE_VERSION, &ctx);
+}
+
+unsigned char *decode_png(void *buf, size_t length, int *width, int *height, int *has_alpha)
+{
+    char key[LIB_CACHE_KEY_MAX];
+    unsigned char *buffer;
+    size_t size;
+
+    png_cache_key(key, buf, length);
+    buffer = png_cache_get(key, width, height, has_alpha);
+    if (buffer)
+        return buffer;
+
+    buffer = decode_png_uncached(buf, length, width, height, has_alpha, NULL, 0, &size);
+    if (buffer && size)
+        png_cache_put(key, buffer, size, *width, *height, *has_alpha);
+
+    return buffer;
+}
+
+int png_get_header(const void *buf, size_t length, int *width, int *height, int *has_alpha)
+{
+    const unsigned char *p = buf;
+
+    /* the signature, then IHDR is always the first chunk */
+    if (length < 33 || png_sig_cmp(p, 0, 8) || memcmp(p + 12, "IHDR", 4))
+        return -EINVAL;
+
+    /* only what decode_png() turns into GL_RGB or GL_RGBA as it is */
+    if (p[24] != 8 || p[28] ||
+        (p[25] != PNG_COLOR_TYPE_RGB && p[25] != PNG_COLOR_TYPE_RGB_ALPHA))
+        return -ENOTSUP;
+
+    *width     = png_get_uint_32(p + 16);
+    *height    = png_get_uint_32(p + 20);
+    *has_alpha = p[25] == PNG_COLOR_TYPE_RGB_ALPHA;
+
+    return 0;
+}
+
+int decode_png_into(void *buf, size_t length, void *dst, size_t dstsz)
+{
+    int width, height, has_alpha;
+    char key[LIB_CACHE_KEY_MAX];
+    unsigned char *cached;
+    size_t size;
+
+    png_cache_key(key, buf, length);
+    cached = png_cache_get(key, &width, &height, &has_alpha);
+    if (cached) {
+        size = (size_t)width * height * (has_alpha ? 4 : 3);
+        if (size == dstsz)
+            memcpy(dst, cached, size);
+        free(cached);
+        if (size == dstsz)
+            return 0;
+    }
+
+    /* a broken one may have left some of @dst written, but not all */
+    if (!decode_png_uncached(buf, length, &width, &height, &has_alpha, dst, dstsz, &size) || !size)
+        return -EINVAL;
+
+    png_cache_put(key, dst, size, width, height, has_alpha);
+
+    return 0;
 }
@@ -15,6 +15,14 @@ static inline unsigned char *fetch_png(const char *name, int *width, int *height
 #else
 unsigned char *fetch_png(const char *file_name, int *width, int *height, int *has_alpha);
 unsigned char *decode_png(void *buf, size_t length, int *width, int *height, int *has_alpha);
+/*
+ * For decoding into memory that's already there, like a pixel unpack
+ * buffer: the header says how much that is, without decoding anything;
+ * -ENOTSUP for the ones decode_png() doesn't turn into 8 bit RGB(A).
+ * decode_png_into() is fine to call from a job.
+ */
+int png_get_header(const void *buf, size_t length, int *width, int *height, int *has_alpha);
+int decode_png_into(void *buf, size_t length, void *dst, size_t dstsz);
 #endif
 
 #endif /* __CLAP_PNGLOADER_H__ */
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "prediction.h"
+
+void prediction_record(struct prediction *p, uint16_t seq, const float *pos, bool local)
+{
+    unsigned int slot = seq % PREDICTION_HISTORY;
+    struct prediction_state *st = &p->states[slot];
+    int i;
+
+    /* several frames can go by on one input, any local motion in them counts */
+    if (!(p->valid & (1ull << slot)) || st->seq != seq)
+        st->local = false;
+    st->local |= local;
+
+    /* where the character is going to be once corrected */
+    st->seq = seq;
+    for (i = 0; i < 3; i++)
+        st->pos[i] = pos[i] + p->error[i];
+    p->valid |= 1ull << slot;
+}
+
+int prediction_reconcile(struct prediction *p, uint16_t seq, const float *pos)
+{
+    unsigned int slot = seq % PREDICTION_HISTORY;
+    struct prediction_state *st = &p->states[slot];
+    float error[3], len2 = 0;
+    bool local = false;
+    int i;
+
+    if (!(p->valid & (1ull << slot)) || st->seq != seq)
+        return -ENOENT;
+
+    for (i = 0; i < 3; i++) {
+        error[i] = pos[i] - p->offset[i] - st->pos[i];
+        len2 += error[i] * error[i];
+    }
+
+    /* the server has seen everything up to @seq, the older ones can go */
+    for (slot = 0; slot < PREDICTION_HISTORY; slot++) {
+        if (!(p->valid & (1ull << slot)) || (int16_t)(p->states[slot].seq - seq) > 0)
+            continue;
+
+        local |= p->states[slot].local;
+        p->states[slot].local = false;
+        if (p->states[slot].seq != seq)
+            p->valid &= ~(1ull << slot);
+    }
+
+    /* nothing the server can tell us about, it's just somewhere else */
+    if (local) {
+        for (i = 0; i < 3; i++)
+            p->offset[i] += error[i];
+        return 0;
+    }
+
+    if (len2 < PREDICTION_DEADZONE * PREDICTION_DEADZONE)
+        return 0;
+
+    /* replay what came after @seq from the server's position */
+    for (slot = 0; slot < PREDICTION_HISTORY; slot++)
+        if (p->valid & (1ull << slot))
+            for (i = 0; i < 3; i++)
+                p->states[slot].pos[i] += error[i];
+
+    for (i = 0; i < 3; i++)
+        p->error[i] += error[i];
+
+    return 0;
+}
+
+void prediction_smooth(struct prediction *p, float dt, float *delta)
+{
+    float len2 = 0, k = 1;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        len2 += p->error[i] * p->error[i];
+
+    if (len2 < PREDICTION_SNAP * PREDICTION_SNAP)
+        k = 1 - expf(-dt / PREDICTION_SMOOTH);
+
+    for (i = 0; i < 3; i++) {
+        delta[i] = p->error[i] * k;
+        p->error[i] -= delta[i];
+    }
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_PREDICTION_H__
+#define __CLAP_PREDICTION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Client side prediction of the controlled character: it moves locally
+ * right away, and its position is recorded against the last input sent
+ * to the server (see networking_input_seq()). When a snapshot says where
+ * the server has it after that input, the difference is the prediction
+ * error. Replaying the inputs that the server hasn't seen yet on top of
+ * its position is the same as shifting the recorded positions after it
+ * by the error, so that's what happens; the character itself is moved by
+ * the error a bit at a time, so corrections don't show as jumps, unless
+ * they are too big to hide.
+ *
+ * The server's rooms only move players on the ground plane by their
+ * inputs: no gravity, no collisions. Where the local physics had a say
+ * (recorded as @local), the server's position can't be checked against
+ * ours, so instead of correcting it, reconciling takes the difference
+ * as the new @offset between the two, and only what the server says
+ * past that counts as an error.
+ */
+
+/* power of 2 */
+#define PREDICTION_HISTORY      64
+/* errors below this are just latency */
+#define PREDICTION_DEADZONE     0.25f
+/* errors above this aren't smoothed */
+#define PREDICTION_SNAP         4.0f
+/* seconds for the error to go down by e */
+#define PREDICTION_SMOOTH       0.1f
+
+struct prediction_state {
+    uint16_t    seq;
+    float       pos[3];
+    bool        local;
+};
+
+struct prediction {
+    struct prediction_state states[PREDICTION_HISTORY];
+    uint64_t                valid;
+    /* what's left of the correction */
+    float                   error[3];
+    /* the server's position minus ours, as of the last local motion */
+    float                   offset[3];
+    bool                    enabled;
+};
+
+/*
+ * The position of the character at @seq, the last one wins; @local if
+ * it got there by something other than the input, like a wall or a fall
+ */
+void prediction_record(struct prediction *p, uint16_t seq, const float *pos, bool local);
+/*
+ * The server has the character at @pos after @seq; -ENOENT if @seq is
+ * not in the history any more. If any motion up to @seq was local, the
+ * difference goes into @offset instead of being corrected
+ */
+int prediction_reconcile(struct prediction *p, uint16_t seq, const float *pos);
+/* how much to move the character by over @dt seconds to correct it */
+void prediction_smooth(struct prediction *p, float dt, float *delta);
+
+#endif /* __CLAP_PREDICTION_H__ */
@@ -142,9 +142,15 @@ struct model3d *model3d_new_quad(struct shader_prog *p, float x, float y, float
     GLfloat quad_vx[] = {
         x, y + h, z, x, y, z, x + w, y, z, x + w, y + h, z,
     };
+    struct model3d *m;
 
-    return model3d_new_from_vectors("quad", p, quad_vx, sizeof(quad_vx), quad_idx, sizeof(quad_idx),
-                                    quad_tx, sizeof(quad_tx), NULL, 0);
+    m = model3d_new_from_vectors("quad", p, quad_vx, sizeof(quad_vx), quad_idx, sizeof(quad_idx),
+                                 quad_tx, sizeof(quad_tx), NULL, 0);
+    if (m)
+        model3d_keep_vectors(m, quad_vx, sizeof(quad_vx), quad_tx, sizeof(quad_tx),
+                             quad_idx, sizeof(quad_idx));
+
+    return m;
 }
 
 static GLushort frame_idx[] = {
@@ -171,6 +177,13 @@ struct model3d *model3d_new_frame(struct shader_prog *p, float x, float y, float
         x + t, y + h - t, z, x + t, y + t, z, x + w - t, y + t, z, x + w - t, y + h - t, z,
     };
 
-    return model3d_new_from_vectors("frame", p, frame_vx, sizeof(frame_vx), frame_idx, sizeof(frame_idx),
-                                    frame_tx, sizeof(frame_tx), NULL, 0);    
+    struct model3d *m;
+
+    m = model3d_new_from_vectors("frame", p, frame_vx, sizeof(frame_vx), frame_idx, sizeof(frame_idx),
+                                 frame_tx, sizeof(frame_tx), NULL, 0);
+    if (m)
+        model3d_keep_vectors(m, frame_vx, sizeof(frame_vx), frame_tx, sizeof(frame_tx),
+                             frame_idx, sizeof(frame_idx));
+
+    return m;
 }
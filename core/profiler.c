@@ -0,0 +1,327 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "display.h"
+#include "profiler.h"
+#include "render.h"
+#include "ui-debug.h"
+
+#ifndef CONFIG_FINAL
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+/* power of 2 */
+#define PROF_FRAMES     64
+#define PROF_MAX_SCOPES 128
+#define PROF_MAX_DEPTH  16
+#define PROF_MAX_GPU    16
+/* GPU timings are picked up this many frames later, when they're likely in */
+#define PROF_GPU_LAG    3
+/* width of the overlay's bars */
+#define PROF_BAR        32
+
+struct prof_scope {
+    const char      *name;
+    uint64_t        start;
+    uint64_t        end;
+    unsigned int    depth;
+};
+
+struct prof_gpu {
+    const char      *name;
+    /* CPU time at prof_gpu_begin(), to place it on the trace */
+    uint64_t        start;
+    uint64_t        ns;
+    GLuint          query;
+    bool            pending;
+};
+
+struct prof_frame {
+    uint64_t            start;
+    uint64_t            end;
+    struct prof_scope   scopes[PROF_MAX_SCOPES];
+    unsigned int        nr_scopes;
+    struct prof_gpu     gpu[PROF_MAX_GPU];
+    unsigned int        nr_gpu;
+    /* GPU timings are garbage */
+    bool                disjoint;
+};
+
+static struct prof {
+    struct prof_frame   frames[PROF_FRAMES];
+    /* frames[nr % PROF_FRAMES] is the current one */
+    unsigned long       nr;
+    /* of the open scopes */
+    unsigned int        depth;
+    bool                gpu_active;
+    bool                gpu_timers;
+    bool                up;
+} prof;
+
+static _Thread_local bool prof_thread;
+
+static inline uint64_t prof_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct prof_frame *prof_frame_get(unsigned long nr)
+{
+    return &prof.frames[nr % PROF_FRAMES];
+}
+
+void prof_init(void)
+{
+    prof_thread = true;
+    prof.gpu_timers = render_has_timer_queries();
+    prof.up = true;
+    prof_frame_get(0)->start = prof_now();
+    dbg("profiler: GPU timers %savailable\n", prof.gpu_timers ? "" : "not ");
+}
+
+void prof_done(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < PROF_FRAMES; i++)
+        for (j = 0; j < PROF_MAX_GPU; j++)
+            if (prof.frames[i].gpu[j].query)
+                glDeleteQueries(1, &prof.frames[i].gpu[j].query);
+
+    memset(&prof, 0, sizeof(prof));
+}
+
+struct prof_handle prof_scope_begin(const char *name)
+{
+    struct prof_frame *f = prof_frame_get(prof.nr);
+    struct prof_handle h = { .frame = prof.nr, .scope = -1 };
+    struct prof_scope *s;
+
+    if (!prof_thread || f->nr_scopes == PROF_MAX_SCOPES || prof.depth == PROF_MAX_DEPTH)
+        return h;
+
+    s = &f->scopes[f->nr_scopes];
+    s->name  = name;
+    s->depth = prof.depth;
+    s->start = prof_now();
+    s->end   = 0;
+    prof.depth++;
+    h.scope = f->nr_scopes++;
+
+    return h;
+}
+
+void prof_scope_end(struct prof_handle h)
+{
+    struct prof_frame *f = prof_frame_get(h.frame);
+
+    /* or its frame is gone from the ring */
+    if (h.scope < 0 || !prof_thread || prof.nr - h.frame >= PROF_FRAMES ||
+        (unsigned int)h.scope >= f->nr_scopes)
+        return;
+
+    /*
+     * It spans a prof_frame(), which already reset the depth: it's cut
+     * off at the end of the frame it started in
+     */
+    if (h.frame != prof.nr) {
+        f->scopes[h.scope].end = f->end;
+        return;
+    }
+
+    f->scopes[h.scope].end = prof_now();
+    /* scopes are blocks, they close in order */
+    prof.depth = f->scopes[h.scope].depth;
+}
+
+void prof_gpu_begin(const char *name)
+{
+    struct prof_frame *f = prof_frame_get(prof.nr);
+    struct prof_gpu *g;
+
+    if (!prof.gpu_timers || prof.gpu_active || f->nr_gpu == PROF_MAX_GPU)
+        return;
+
+    g = &f->gpu[f->nr_gpu++];
+    if (!g->query)
+        glGenQueries(1, &g->query);
+
+    g->name    = name;
+    g->start   = prof_now();
+    g->ns      = 0;
+    g->pending = true;
+    glBeginQuery(GL_TIME_ELAPSED, g->query);
+    prof.gpu_active = true;
+}
+
+void prof_gpu_end(void)
+{
+    if (!prof.gpu_active)
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+    prof.gpu_active = false;
+}
+
+/* @wait: the slot is about to be reused, there's no later */
+static void prof_gpu_collect(struct prof_frame *f, bool wait)
+{
+    GLuint available, ns;
+    unsigned int i;
+
+    for (i = 0; i < f->nr_gpu; i++) {
+        struct prof_gpu *g = &f->gpu[i];
+
+        if (!g->pending)
+            continue;
+
+        if (!wait) {
+            glGetQueryObjectuiv(g->query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue;
+        }
+
+        /* 32 bits of nanoseconds is over 4 seconds, plenty for a pass */
+        glGetQueryObjectuiv(g->query, GL_QUERY_RESULT, &ns);
+        g->ns = ns;
+        g->pending = false;
+    }
+}
+
+static void prof_show(struct prof_frame *f)
+{
+    uint64_t frame_ns = max(f->end - f->start, 1), gpu_ns = 0, ns;
+    char buf[2048], bar[PROF_BAR + 1];
+    unsigned int i, w;
+    size_t len = 0;
+
+    for (i = 0; i < f->nr_gpu; i++)
+        gpu_ns += f->gpu[i].ns;
+
+    len += snprintf(buf + len, sizeof(buf) - len, "frame %.2fms gpu %.2fms%s\n",
+                    frame_ns / 1e6, gpu_ns / 1e6, f->disjoint ? " (disjoint)" : "");
+
+    /* each scope's bar is its share of the frame */
+    for (i = 0; i < f->nr_scopes && len < sizeof(buf); i++) {
+        struct prof_scope *s = &f->scopes[i];
+
+        ns = s->end > s->start ? s->end - s->start : 0;
+        w = min(ns * PROF_BAR / frame_ns, PROF_BAR);
+        memset(bar, '#', w);
+        bar[w] = 0;
+        len += snprintf(buf + len, sizeof(buf) - len, "%*s%-*s %6.2fms %s\n", s->depth * 2, "",
+                        24 - s->depth * 2, s->name, ns / 1e6, bar);
+    }
+
+    for (i = 0; i < f->nr_gpu && len < sizeof(buf); i++) {
+        struct prof_gpu *g = &f->gpu[i];
+
+        w = min(g->ns * PROF_BAR / frame_ns, PROF_BAR);
+        memset(bar, '=', w);
+        bar[w] = 0;
+        len += snprintf(buf + len, sizeof(buf) - len, "gpu %-20s %6.2fms %s\n", g->name,
+                        g->ns / 1e6, bar);
+    }
+
+    ui_debug_printf("%s", buf);
+}
+
+void prof_frame(void)
+{
+    struct prof_frame *f = prof_frame_get(prof.nr), *next;
+    GLint disjoint = 0;
+    uint64_t now;
+
+    if (!prof.up)
+        return;
+
+    now = prof_now();
+    f->end = now;
+    prof_gpu_end();
+
+#ifdef GL_GPU_DISJOINT_EXT
+    /* something got in the way of the timers, throw away what's in flight */
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+#endif
+    if (prof.nr >= PROF_GPU_LAG) {
+        struct prof_frame *done = prof_frame_get(prof.nr - PROF_GPU_LAG);
+
+        prof_gpu_collect(done, false);
+        done->disjoint = !!disjoint;
+        prof_show(done);
+    }
+
+    next = prof_frame_get(++prof.nr);
+    prof_gpu_collect(next, true);
+    next->start     = now;
+    next->end       = 0;
+    next->nr_scopes = 0;
+    next->nr_gpu    = 0;
+    next->disjoint  = false;
+    prof.depth      = 0;
+}
+
+static void prof_export_event(FILE *f, bool *first, const char *name, int tid,
+                              uint64_t start, uint64_t dur)
+{
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f}", *first ? "" : ",", name, tid, start / 1e3, dur / 1e3);
+    *first = false;
+}
+
+/*
+ * Complete frames only; GPU passes are on their own track, placed where
+ * the CPU issued them, which is not where they really ran
+ */
+int prof_export(const char *path)
+{
+    unsigned long nr, first_nr;
+    bool first = true;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+
+    fprintf(f, "{\"traceEvents\":[");
+    first_nr = prof.nr >= PROF_FRAMES - 1 ? prof.nr - PROF_FRAMES + 1 : 0;
+    for (nr = first_nr; nr < prof.nr; nr++) {
+        struct prof_frame *fr = prof_frame_get(nr);
+
+        prof_export_event(f, &first, "frame", 0, fr->start, fr->end - fr->start);
+        for (i = 0; i < fr->nr_scopes; i++) {
+            struct prof_scope *s = &fr->scopes[i];
+
+            if (s->end >= s->start)
+                prof_export_event(f, &first, s->name, 0, s->start, s->end - s->start);
+        }
+
+        for (i = 0; i < fr->nr_gpu; i++) {
+            struct prof_gpu *g = &fr->gpu[i];
+
+            if (!g->pending && !fr->disjoint)
+                prof_export_event(f, &first, g->name, 1, g->start, g->ns);
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(f))
+        return -EIO;
+
+    msg("wrote %lu frames of profile to '%s'\n", prof.nr - first_nr, path);
+
+    return 0;
+}
+
+#endif /* CONFIG_FINAL */
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_PROFILER_H__
+#define __CLAP_PROFILER_H__
+
+#include "config.h"
+
+/*
+ * Frame profiler: CPU scopes, nested, and GPU timings of render passes,
+ * kept for the last PROF_FRAMES frames. The last complete frame is shown
+ * on the "profiler.c" ui_debug page; prof_export() writes all of them out
+ * as a Chrome trace (chrome://tracing, ui.perfetto.dev).
+ *
+ *   void models_render(...)
+ *   {
+ *       PROF_SCOPE("models_render");
+ *       ...
+ *   }
+ *
+ * Main thread only, scopes from other threads are ignored. GPU timings
+ * can't nest, and come from the GL_TIME_ELAPSED queries, which need
+ * EXT_disjoint_timer_query in GLES/WebGL. Compiles out in CONFIG_FINAL.
+ */
+#ifndef CONFIG_FINAL
+
+void prof_init(void);
+void prof_done(void);
+/* end the current frame and start the next one */
+void prof_frame(void);
+
+/* the frame it was opened in, and its index there; scope < 0 if it wasn't */
+struct prof_handle {
+    unsigned long   frame;
+    int             scope;
+};
+
+struct prof_handle prof_scope_begin(const char *name);
+void prof_scope_end(struct prof_handle h);
+
+static inline void prof_scope_cleanup(struct prof_handle *h)
+{
+    prof_scope_end(*h);
+}
+
+#define __PROF_VAR(_l) __prof_scope_ ## _l
+#define _PROF_VAR(_l) __PROF_VAR(_l)
+/* until the end of the enclosing block */
+#define PROF_SCOPE(_name) \
+    struct prof_handle _PROF_VAR(__LINE__) __attribute__((cleanup(prof_scope_cleanup))) = \
+        prof_scope_begin(_name)
+
+void prof_gpu_begin(const char *name);
+void prof_gpu_end(void);
+
+int prof_export(const char *path);
+
+#else /* CONFIG_FINAL */
+
+static inline void prof_init(void) {}
+static inline void prof_done(void) {}
+static inline void prof_frame(void) {}
+#define PROF_SCOPE(_name) do {} while (0)
+static inline void prof_gpu_begin(const char *name) {}
+static inline void prof_gpu_end(void) {}
+static inline int prof_export(const char *path) { return 0; }
+
+#endif /* CONFIG_FINAL */
+
+#endif /* __CLAP_PROFILER_H__ */
@@ -1,5 +1,10 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
 #include "display.h"
+#include "ktx2.h"
 #include "logger.h"
 #include "object.h"
 
@@ -7,27 +12,337 @@
 #include "render.h"
 #undef IMPLEMENTOR
 
+#define NR_TEXTURE_UNITS 8
+
+/* -1 means "unknown", which never matches, so the first call always goes through */
+static struct render_state {
+    int                         cull_face;
+    int                         blend;
+    int                         depth_test;
+    GLint                       polygon_mode;
+    GLint                       program;
+    GLint                       vao;
+    GLint                       active_unit;
+    GLint                       texture[NR_TEXTURE_UNITS];
+    struct render_state_stats   stats;
+    struct render_stats         frame;
+} rs = {
+    .cull_face      = -1,
+    .blend          = -1,
+    .depth_test     = -1,
+    .polygon_mode   = -1,
+    .program        = -1,
+    .vao            = -1,
+    .active_unit    = -1,
+    .texture        = { [0 ... NR_TEXTURE_UNITS - 1] = -1 },
+};
+
+void render_state_invalidate(void)
+{
+    int i;
+
+    rs.cull_face = rs.blend = rs.depth_test = -1;
+    rs.polygon_mode = rs.program = rs.vao = rs.active_unit = -1;
+    for (i = 0; i < NR_TEXTURE_UNITS; i++)
+        rs.texture[i] = -1;
+}
+
+void render_state_stats(struct render_state_stats *stats, bool reset)
+{
+    if (stats)
+        *stats = rs.stats;
+    if (reset)
+        rs.stats.calls = rs.stats.avoided = 0;
+}
+
+/* all of struct render_stats, keep in sync */
+#define RENDER_STATS_FOR_EACH(_op) \
+    _op(draws) _op(instances) _op(culled) _op(occluded) _op(programs) _op(textures) \
+    _op(vaos) _op(uniforms) _op(fbos) _op(upload_bytes)
+
+void render_stats(struct render_stats *stats, bool reset)
+{
+    if (stats)
+        *stats = rs.frame;
+    if (reset)
+        memset(&rs.frame, 0, sizeof(rs.frame));
+}
+
+void render_stats_diff(struct render_stats *diff, const struct render_stats *from,
+                       const struct render_stats *to)
+{
+    int i;
+
+#define RENDER_STATS_DIFF(_f) diff->_f = to->_f - from->_f;
+    RENDER_STATS_FOR_EACH(RENDER_STATS_DIFF)
+#undef RENDER_STATS_DIFF
+    for (i = 0; i < RENDER_STATS_LODS; i++)
+        diff->triangles[i] = to->triangles[i] - from->triangles[i];
+}
+
+void render_stats_add(struct render_stats *sum, const struct render_stats *stats)
+{
+    int i;
+
+#define RENDER_STATS_ADD(_f) sum->_f += stats->_f;
+    RENDER_STATS_FOR_EACH(RENDER_STATS_ADD)
+#undef RENDER_STATS_ADD
+    for (i = 0; i < RENDER_STATS_LODS; i++)
+        sum->triangles[i] += stats->triangles[i];
+}
+
+unsigned long render_stats_triangles(const struct render_stats *stats)
+{
+    unsigned long nr = 0;
+    int i;
+
+    for (i = 0; i < RENDER_STATS_LODS; i++)
+        nr += stats->triangles[i];
+
+    return nr;
+}
+
+int render_stats_print(char *buf, size_t size, const struct render_stats *stats)
+{
+    size_t len;
+    int i, ret;
+
+    ret = snprintf(buf, size,
+                   "draws %lu inst %lu tris %lu culled %lu occluded %lu "
+                   "binds prog %lu tex %lu vao %lu fbo %lu uniforms %lu upload %lu",
+                   stats->draws, stats->instances, render_stats_triangles(stats),
+                   stats->culled, stats->occluded, stats->programs, stats->textures,
+                   stats->vaos, stats->fbos, stats->uniforms, stats->upload_bytes);
+
+    /* the LODs that were drawn at all */
+    for (i = 0, len = ret; i < RENDER_STATS_LODS && ret >= 0; i++) {
+        if (!stats->triangles[i])
+            continue;
+
+        ret = snprintf(buf + min(len, size), size - min(len, size), " lod%d %lu", i,
+                       stats->triangles[i]);
+        len += ret;
+    }
+
+    return ret < 0 ? ret : len;
+}
+
+void render_stats_draw(unsigned long nr_idx, unsigned long nr_inst, unsigned int lod)
+{
+    rs.frame.draws++;
+    rs.frame.instances += nr_inst;
+    rs.frame.triangles[min(lod, RENDER_STATS_LODS - 1)] += nr_idx / 3 * nr_inst;
+}
+
+void render_stats_cull(unsigned long culled, unsigned long occluded)
+{
+    rs.frame.culled += culled;
+    rs.frame.occluded += occluded;
+}
+
+void render_stats_upload(size_t bytes)
+{
+    rs.frame.upload_bytes += bytes;
+}
+
+void render_stats_fbo(void)
+{
+    rs.frame.fbos++;
+}
+
+void render_stats_uniform(void)
+{
+    rs.frame.uniforms++;
+}
+
+static bool render_state_update(int *cached, int value)
+{
+    if (*cached == value) {
+        rs.stats.avoided++;
+        return false;
+    }
+
+    *cached = value;
+    rs.stats.calls++;
+
+    return true;
+}
+
+static void render_cap(int *cached, GLenum cap, bool enable)
+{
+    if (!render_state_update(cached, enable))
+        return;
+
+    if (enable)
+        GL(glEnable(cap));
+    else
+        GL(glDisable(cap));
+}
+
+void render_cull_face(bool enable)
+{
+    static bool cull_back;
+
+    render_cap(&rs.cull_face, GL_CULL_FACE, enable);
+
+    /* nobody culls front faces */
+    if (enable && !cull_back) {
+        GL(glCullFace(GL_BACK));
+        cull_back = true;
+    }
+}
+
+void render_blend(bool enable)
+{
+    static bool blend_func;
+
+    render_cap(&rs.blend, GL_BLEND, enable);
+
+    /* XXX: only for UIs, the same blend function for everybody */
+    if (enable && !blend_func) {
+        GL(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+        blend_func = true;
+    }
+}
+
+void render_depth_test(bool enable)
+{
+    render_cap(&rs.depth_test, GL_DEPTH_TEST, enable);
+}
+
+#ifndef EGL_EGL_PROTOTYPES
+void render_polygon_mode(GLenum mode)
+{
+    if (render_state_update(&rs.polygon_mode, mode))
+        GL(glPolygonMode(GL_FRONT_AND_BACK, mode));
+}
+#endif
+
+void render_use_program(GLuint prog)
+{
+    if (render_state_update(&rs.program, prog)) {
+        GL(glUseProgram(prog));
+        rs.frame.programs++;
+    }
+}
+
+void render_bind_vao(GLuint vao)
+{
+    if (render_state_update(&rs.vao, vao)) {
+        GL(glBindVertexArray(vao));
+        rs.frame.vaos++;
+    }
+}
+
+/* deleted names come back with the next glGen*(), the cache mustn't have them */
+void render_delete_program(GLuint prog)
+{
+    if (rs.program == (GLint)prog)
+        rs.program = -1;
+    GL(glDeleteProgram(prog));
+}
+
+void render_delete_vao(GLuint vao)
+{
+    if (rs.vao == (GLint)vao)
+        rs.vao = -1;
+    GL(glDeleteVertexArrays(1, &vao));
+}
+
+static void render_active_texture(unsigned int unit)
+{
+    if (render_state_update(&rs.active_unit, unit))
+        GL(glActiveTexture(GL_TEXTURE0 + unit));
+}
+
+void render_bind_texture(unsigned int unit, GLuint id)
+{
+    if (unit >= NR_TEXTURE_UNITS) {
+        rs.active_unit = -1;
+        rs.stats.calls++;
+        rs.frame.textures++;
+        GL(glActiveTexture(GL_TEXTURE0 + unit));
+        GL(glBindTexture(GL_TEXTURE_2D, id));
+        return;
+    }
+
+    if (!render_state_update(&rs.texture[unit], id))
+        return;
+
+    render_active_texture(unit);
+    GL(glBindTexture(GL_TEXTURE_2D, id));
+    rs.frame.textures++;
+}
+
+/* deleting a bound texture unbinds it behind our back */
+static void render_texture_deleted(GLuint id)
+{
+    int i;
+
+    for (i = 0; i < NR_TEXTURE_UNITS; i++)
+        if (rs.texture[i] == id)
+            rs.texture[i] = -1;
+}
+
+struct texture_source {
+    struct list         entry;
+    texture_t           *tex;
+    texture_load_fn     load;
+    char                name[];
+};
+
+static struct textures {
+    struct list     resident;
+    struct list     sources;
+    size_t          size;
+    size_t          budget;
+    unsigned long   frame;
+} textures = {
+    .resident   = EMPTY_LIST(textures.resident),
+    .sources    = EMPTY_LIST(textures.sources),
+};
+
 static void texture_drop(struct ref *ref)
 {
     struct texture *tex = container_of(ref, struct texture, ref);
     texture_deinit(tex);
+    if (tex->src) {
+        list_del(&tex->src->entry);
+        free(tex->src);
+    }
 }
 DECLARE_REFCLASS(texture);
 
-int texture_init_target(texture_t *tex, GLuint target)
+static void __texture_init(texture_t *tex, GLuint target)
 {
-    ref_embed(texture, tex);
+    list_init(&tex->entry);
     tex->type = GL_UNSIGNED_BYTE;
     tex->wrap = GL_CLAMP_TO_EDGE;
     tex->filter = GL_LINEAR;
     tex->target = target;
     GL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
-    GL(glActiveTexture(tex->target));
+    render_active_texture(tex->target - GL_TEXTURE0);
     GL(glGenTextures(1, &tex->id));
+}
+
+int texture_init_target(texture_t *tex, GLuint target)
+{
+    ref_embed(texture, tex);
+    __texture_init(tex, target);
 
     return 0;
 }
 
+texture_t *texture_new(GLuint target)
+{
+    texture_t *tex = ref_new(texture);
+
+    if (tex)
+        __texture_init(tex, target);
+
+    return tex;
+}
+
 int texture_init(texture_t *tex)
 {
     return texture_init_target(tex, GL_TEXTURE0);
@@ -38,6 +353,7 @@ texture_t *texture_clone(texture_t *tex)
     texture_t *ret = ref_new(texture);
 
     if (ret) {
+        list_init(&ret->entry);
         ret->id     = tex->id;
         ret->wrap   = tex->wrap; 
         ret->type   = tex->type;
@@ -46,19 +362,74 @@ texture_t *texture_clone(texture_t *tex)
         ret->width  = tex->width;
         ret->height = tex->height;
         ret->format = tex->format;
+        ret->mipmaps = tex->mipmaps;
+        ret->layers = tex->layers;
         ret->loaded = tex->loaded;
+        ret->size   = tex->size;
+        ret->used   = tex->used;
         tex->loaded = false;
+        tex->size   = 0;
+        /* the clone is what's resident now */
+        if (!list_empty(&tex->entry)) {
+            list_del(&tex->entry);
+            list_append(&textures.resident, &ret->entry);
+        }
     }
 
     return ret;
 }
 
+/* resident size of what's been uploaded to @tex is now @size */
+static void texture_account(texture_t *tex, size_t size)
+{
+    textures.size = textures.size - tex->size + size;
+    mem_account(MEM_GPU_TEXTURE, (ssize_t)size - (ssize_t)tex->size);
+    tex->size     = size;
+    tex->used     = textures.frame;
+    if (list_empty(&tex->entry))
+        list_append(&textures.resident, &tex->entry);
+}
+
+static size_t texture_bytes(texture_t *tex, unsigned int width, unsigned int height)
+{
+    size_t size = (size_t)width * height * (tex->type == GL_FLOAT ? 4 : 1);
+
+    switch (tex->format) {
+    case GL_RGBA:
+    case GL_DEPTH_COMPONENT:
+        return size * 4;
+    case GL_RGB:
+        return size * 3;
+    case GL_RG:
+        return size * 2;
+    default:
+        return size;
+    }
+}
+
 void texture_deinit(texture_t *tex)
 {
-    if (!tex->loaded)
+    /* an upload in progress already has the storage */
+    if (!tex->loaded && !tex->size)
         return;
     GL(glDeleteTextures(1, &tex->id));
+    render_texture_deleted(tex->id);
     tex->loaded = false;
+    textures.size -= tex->size;
+    mem_account(MEM_GPU_TEXTURE, -(ssize_t)tex->size);
+    tex->size = 0;
+    list_del(&tex->entry);
+}
+
+/* float data needs a float internal format, or it gets squashed into bytes */
+static GLint texture_internal_format(texture_t *tex)
+{
+    if (tex->format == GL_RGBA && tex->type == GL_FLOAT)
+        return GL_RGBA32F;
+    if (tex->format == GL_RED && tex->type == GL_FLOAT)
+        return GL_R32F;
+
+    return tex->format;
 }
 
 void texture_resize(texture_t *tex, unsigned int width, unsigned int height)
@@ -66,10 +437,13 @@ void texture_resize(texture_t *tex, unsigned int width, unsigned int height)
     if (!tex->loaded || (tex->width == width && tex->height == height))
         return;
 
-    GL(glBindTexture(GL_TEXTURE_2D, tex->id));
-    GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, width, height,
+    render_bind_texture(tex->target - GL_TEXTURE0, tex->id);
+    GL(glTexImage2D(GL_TEXTURE_2D, 0, texture_internal_format(tex), width, height,
                  0, tex->format, tex->type, NULL));
-    GL(glBindTexture(GL_TEXTURE_2D, 0));
+    render_bind_texture(tex->target - GL_TEXTURE0, 0);
+    tex->width  = width;
+    tex->height = height;
+    texture_account(tex, texture_bytes(tex, width, height));
 }
 
 void texture_filters(texture_t *tex, GLint wrap, GLint filter)
@@ -78,23 +452,44 @@ void texture_filters(texture_t *tex, GLint wrap, GLint filter)
     tex->filter = filter;
 }
 
+void texture_data_type(texture_t *tex, GLenum type)
+{
+    tex->type = type;
+}
+
+void texture_mipmaps(texture_t *tex, bool mipmaps)
+{
+    tex->mipmaps = mipmaps;
+}
+
 static void texture_setup_begin(texture_t *tex, void *buf)
 {
+    size_t size;
+
     if (tex->format == GL_DEPTH_COMPONENT)
         tex->type = GL_FLOAT;
-    GL(glActiveTexture(tex->target));
-    GL(glBindTexture(GL_TEXTURE_2D, tex->id));
+    render_bind_texture(tex->target - GL_TEXTURE0, tex->id);
     GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tex->wrap));
     GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tex->wrap));
-    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex->filter));
+    if (tex->mipmaps)
+        GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                           tex->filter == GL_LINEAR ?
+                           GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST));
+    else
+        GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex->filter));
     GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, tex->filter));
-    GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->width, tex->height,
+    GL(glTexImage2D(GL_TEXTURE_2D, 0, texture_internal_format(tex), tex->width, tex->height,
                  0, tex->format, tex->type, buf));
+    size = texture_bytes(tex, tex->width, tex->height);
+    if (buf)
+        render_stats_upload(size);
+    /* the whole chain is a third more */
+    texture_account(tex, tex->mipmaps ? size + size / 3 : size);
 }
 
 static void texture_setup_end(texture_t *tex)
 {
-    GL(glBindTexture(GL_TEXTURE_2D, 0));
+    render_bind_texture(tex->target - GL_TEXTURE0, 0);
 }
 
 void texture_load(texture_t *tex, GLenum format, unsigned int width, unsigned int height,
@@ -104,10 +499,148 @@ void texture_load(texture_t *tex, GLenum format, unsigned int width, unsigned in
     tex->width  = width;
     tex->height = height;
     texture_setup_begin(tex, buf);
+    if (tex->mipmaps)
+        GL(glGenerateMipmap(GL_TEXTURE_2D));
     texture_setup_end(tex);
     tex->loaded = true;
 }
 
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT             0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT            0x83F1
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT            0x83F3
+#endif
+#ifndef GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT            0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT      0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT      0x8C4F
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM               0x8E8C
+#define GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM         0x8E8D
+#endif
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2                     0x9274
+#define GL_COMPRESSED_SRGB8_ETC2                    0x9275
+#define GL_COMPRESSED_RGBA8_ETC2_EAC                0x9278
+#define GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC         0x9279
+#endif
+#ifndef GL_COMPRESSED_RGBA_ASTC_4x4_KHR
+#define GL_COMPRESSED_RGBA_ASTC_4x4_KHR             0x93B0
+#define GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR     0x93D0
+#endif
+
+static const struct {
+    GLenum      internal[2]; /* linear, sRGB */
+    const char  *ext[2];
+} ktx2_gl_formats[KTX2_FORMAT_MAX] = {
+    [KTX2_BC1_RGB]  = {
+        { GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT },
+        { "texture_compression_s3tc", "compressed_texture_s3tc" } },
+    [KTX2_BC1_RGBA] = {
+        { GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT },
+        { "texture_compression_s3tc", "compressed_texture_s3tc" } },
+    [KTX2_BC3]      = {
+        { GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT },
+        { "texture_compression_s3tc", "compressed_texture_s3tc" } },
+    [KTX2_BC7]      = {
+        { GL_COMPRESSED_RGBA_BPTC_UNORM, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM },
+        { "texture_compression_bptc", NULL } },
+    [KTX2_ETC2_RGB] = {
+        { GL_COMPRESSED_RGB8_ETC2, GL_COMPRESSED_SRGB8_ETC2 },
+        { "compressed_texture_etc", "ES3_compatibility" } },
+    [KTX2_ETC2_RGBA] = {
+        { GL_COMPRESSED_RGBA8_ETC2_EAC, GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC },
+        { "compressed_texture_etc", "ES3_compatibility" } },
+    [KTX2_ASTC_4x4] = {
+        { GL_COMPRESSED_RGBA_ASTC_4x4_KHR, GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR },
+        { "texture_compression_astc", "compressed_texture_astc" } },
+};
+
+/* -1: not looked yet */
+static int ktx2_supported[KTX2_FORMAT_MAX] = { [0 ... KTX2_FORMAT_MAX - 1] = -1 };
+
+static bool texture_format_supported(enum ktx2_format format)
+{
+    GLint nr_exts = 0, i, j;
+    const char *ext;
+
+    if (ktx2_supported[format] >= 0)
+        return ktx2_supported[format];
+
+    ktx2_supported[format] = 0;
+#ifdef EGL_EGL_PROTOTYPES
+    /* ETC2 is core in GLES3 */
+    if (format == KTX2_ETC2_RGB || format == KTX2_ETC2_RGBA)
+        return (ktx2_supported[format] = 1);
+#endif
+
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nr_exts);
+    for (i = 0; i < nr_exts; i++) {
+        ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (!ext)
+            continue;
+
+        for (j = 0; j < array_size(ktx2_gl_formats[format].ext); j++)
+            if (ktx2_gl_formats[format].ext[j] &&
+                strstr(ext, ktx2_gl_formats[format].ext[j]))
+                return (ktx2_supported[format] = 1);
+    }
+
+    return false;
+}
+
+int texture_load_ktx2(texture_t *tex, const struct ktx2_image *img)
+{
+    GLenum internal;
+    unsigned int i;
+    size_t size;
+
+    if (img->format >= KTX2_FORMAT_MAX || !texture_format_supported(img->format))
+        return -ENOTSUP;
+
+    internal    = ktx2_gl_formats[img->format].internal[img->srgb];
+    tex->format = internal;
+    tex->width  = img->width;
+    tex->height = img->height;
+
+    render_bind_texture(tex->target - GL_TEXTURE0, tex->id);
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tex->wrap));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tex->wrap));
+    if (img->nr_levels > 1)
+        GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                           tex->filter == GL_LINEAR ?
+                           GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST));
+    else
+        GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, tex->filter));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, tex->filter));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, img->nr_levels - 1));
+    for (i = 0, size = 0; i < img->nr_levels; i++) {
+        GL(glCompressedTexImage2D(GL_TEXTURE_2D, i, internal,
+                                  max(img->width >> i, 1), max(img->height >> i, 1), 0,
+                                  img->levels[i].size, img->levels[i].data));
+        size += img->levels[i].size;
+    }
+    render_stats_upload(size);
+    texture_account(tex, size);
+    texture_setup_end(tex);
+    tex->loaded = true;
+
+    return 0;
+}
+
+void texture_update(texture_t *tex, unsigned int x, unsigned int y, unsigned int width,
+                    unsigned int height, void *buf)
+{
+    if (!tex->loaded)
+        return;
+
+    render_bind_texture(tex->target - GL_TEXTURE0, tex->id);
+    GL(glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, tex->format, tex->type, buf));
+    render_stats_upload(texture_bytes(tex, width, height));
+    texture_setup_end(tex);
+}
+
 void texture_fbo(texture_t *tex, GLuint attachment, GLenum format, unsigned int width,
                  unsigned int height)
 {
@@ -122,7 +655,13 @@ void texture_fbo(texture_t *tex, GLuint attachment, GLenum format, unsigned int
 
 void texture_done(struct texture *tex)
 {
-    if (!ref_is_static(&tex->ref))
+    if (!tex)
+        return;
+
+    /* shared ones go when the last user does */
+    if (tex->src)
+        ref_put(tex);
+    else if (!ref_is_static(&tex->ref))
         ref_put_last(tex);
 }
 
@@ -137,3 +676,643 @@ bool texture_loaded(struct texture *tex)
 {
     return tex->loaded;
 }
+
+void texture_bind(texture_t *tex, unsigned int unit)
+{
+    if (!tex->layers) {
+        render_bind_texture(unit, tex->id);
+        return;
+    }
+
+    /* the cache is of the GL_TEXTURE_2D bindings, this one leaves them be */
+    render_active_texture(unit);
+    GL(glBindTexture(GL_TEXTURE_2D_ARRAY, tex->id));
+}
+
+int texture_set_source(texture_t *tex, const char *name, texture_load_fn load)
+{
+    struct texture_source *src;
+
+    if (ref_is_static(&tex->ref) || tex->src)
+        return -EINVAL;
+
+    src = malloc(sizeof(*src) + strlen(name) + 1);
+    if (!src)
+        return -ENOMEM;
+
+    strcpy(src->name, name);
+    src->tex  = tex;
+    src->load = load;
+    tex->src  = src;
+    list_append(&textures.sources, &src->entry);
+
+    return 0;
+}
+
+texture_t *texture_get(const char *name)
+{
+    struct texture_source *src;
+
+    list_for_each_entry(src, &textures.sources, entry)
+        if (!strcmp(src->name, name))
+            return ref_get(src->tex);
+
+    return NULL;
+}
+
+void texture_used(texture_t *tex)
+{
+    if (tex->used == textures.frame)
+        return;
+
+    tex->used = textures.frame;
+    /* most recently used go to the back */
+    if (!list_empty(&tex->entry)) {
+        list_del(&tex->entry);
+        list_append(&textures.resident, &tex->entry);
+    }
+
+    if (tex->lod && tex->src && !tex->src->load(tex, tex->src->name, 0))
+        tex->lod = 0;
+}
+
+void textures_set_budget(size_t bytes)
+{
+    textures.budget = bytes;
+}
+
+size_t textures_resident(void)
+{
+    return textures.size;
+}
+
+/* a few per frame, each one is a reload */
+#define TEXTURE_EVICT_MAX 4
+
+void textures_evict(void)
+{
+    texture_t *tex, *it;
+    int nr = 0;
+
+    textures.frame++;
+    if (!textures.budget)
+        return;
+
+    list_for_each_entry_iter(tex, it, &textures.resident, entry) {
+        if (textures.size <= textures.budget || nr == TEXTURE_EVICT_MAX)
+            break;
+        /* the rest have been used more recently */
+        if (tex->used + TEXTURE_IDLE_FRAMES > textures.frame)
+            break;
+        if (!tex->src)
+            continue;
+
+        nr++;
+        if (!tex->src->load(tex, tex->src->name, tex->lod + 1))
+            tex->lod++;
+        /* either way, leave it be for a while */
+        tex->used = textures.frame;
+        list_del(&tex->entry);
+        list_append(&textures.resident, &tex->entry);
+    }
+}
+
+struct texture_upload {
+    struct list     entry;
+    texture_t       *tex;
+    /* the unpack buffer's mapping, until the first upload, or malloc()ed */
+    void            *pixels;
+    GLuint          pbo;
+    size_t          stride;
+    unsigned int    row;
+    void            (*done)(void *data);
+    void            *data;
+    /* 0 while the job's at it, then 1 or -1 if it failed */
+    atomic_int      state;
+};
+
+static DECLARE_LIST(texture_uploads);
+
+struct texture_upload *texture_upload_begin(texture_t *tex, GLenum format, unsigned int width,
+                                            unsigned int height, void **pixels,
+                                            void (*done)(void *data), void *data)
+{
+    struct texture_upload *upl;
+    size_t size;
+
+    if (ref_is_static(&tex->ref))
+        return NULL;
+
+    upl = calloc(1, sizeof(*upl));
+    if (!upl)
+        return NULL;
+
+    tex->format = format;
+    tex->width  = width;
+    tex->height = height;
+    /* not loaded until the last row is in, see textures_upload() */
+    texture_setup_begin(tex, NULL);
+    texture_setup_end(tex);
+
+    upl->stride = texture_bytes(tex, width, 1);
+    size = upl->stride * height;
+#ifndef CONFIG_BROWSER
+    GL(glGenBuffers(1, &upl->pbo));
+    GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upl->pbo));
+    GL(glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW));
+    /* stays mapped while the job writes it, nothing else uses it */
+    upl->pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                   GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    if (!upl->pixels) {
+        GL(glDeleteBuffers(1, &upl->pbo));
+        upl->pbo = 0;
+    }
+#endif
+    if (!upl->pixels)
+        upl->pixels = malloc(size);
+    if (!upl->pixels) {
+        free(upl);
+        return NULL;
+    }
+
+    upl->tex  = ref_get(tex);
+    upl->done = done;
+    upl->data = data;
+    list_append(&texture_uploads, &upl->entry);
+    *pixels = upl->pixels;
+
+    return upl;
+}
+
+void texture_upload_ready(struct texture_upload *upl, bool ok)
+{
+    atomic_store(&upl->state, ok ? 1 : -1);
+}
+
+static void texture_upload_free(struct texture_upload *upl)
+{
+    list_del(&upl->entry);
+    /* deleting a mapped buffer unmaps it */
+    if (upl->pbo)
+        GL(glDeleteBuffers(1, &upl->pbo));
+    else
+        free(upl->pixels);
+    ref_put(upl->tex);
+    free(upl);
+}
+
+bool texture_ready(texture_t *tex)
+{
+    struct texture_upload *upl;
+
+    if (!tex->loaded)
+        return false;
+
+    list_for_each_entry(upl, &texture_uploads, entry)
+        if (upl->tex == tex)
+            return false;
+
+    return true;
+}
+
+texture_t *texture_array_new(GLuint target, texture_t **layers, unsigned int nr)
+{
+    GLint draw_fbo = 0, read_fbo = 0;
+    texture_t *tex, *l;
+    GLuint fbo[2];
+    unsigned int i;
+    size_t size;
+
+    if (!nr)
+        return NULL;
+
+    /* compressed ones can't be blitted */
+    l = layers[0];
+    if (texture_bytes(l, 1, 1) == 1 && l->format != GL_RED)
+        return NULL;
+
+    for (i = 0; i < nr; i++)
+        if (!texture_ready(layers[i]) || layers[i]->layers ||
+            layers[i]->width != l->width || layers[i]->height != l->height ||
+            layers[i]->format != l->format || layers[i]->type != l->type)
+            return NULL;
+
+    tex = texture_new(target);
+    if (!tex)
+        return NULL;
+
+    tex->format  = l->format;
+    tex->type    = l->type;
+    tex->wrap    = l->wrap;
+    tex->filter  = l->filter;
+    tex->mipmaps = l->mipmaps;
+    tex->width   = l->width;
+    tex->height  = l->height;
+    tex->layers  = nr;
+
+    texture_bind(tex, tex->target - GL_TEXTURE0);
+    GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, tex->wrap));
+    GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, tex->wrap));
+    GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                       !tex->mipmaps ? tex->filter :
+                       tex->filter == GL_LINEAR ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST_MIPMAP_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, tex->filter));
+    GL(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, texture_internal_format(tex), tex->width, tex->height,
+                    nr, 0, tex->format, tex->type, NULL));
+
+    /* layer by layer, from one framebuffer into the other */
+    GL(glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_fbo));
+    GL(glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_fbo));
+    GL(glGenFramebuffers(2, fbo));
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo[0]));
+    GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[1]));
+    for (i = 0; i < nr; i++) {
+        GL(glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                                  layers[i]->id, 0));
+        GL(glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex->id, 0, i));
+        GL(glBlitFramebuffer(0, 0, tex->width, tex->height, 0, 0, tex->width, tex->height,
+                             GL_COLOR_BUFFER_BIT, GL_NEAREST));
+    }
+    GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo));
+    GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_fbo));
+    GL(glDeleteFramebuffers(2, fbo));
+
+    if (tex->mipmaps)
+        GL(glGenerateMipmap(GL_TEXTURE_2D_ARRAY));
+    GL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+    tex->loaded = true;
+
+    size = texture_bytes(tex, tex->width, tex->height) * nr;
+    texture_account(tex, tex->mipmaps ? size + size / 3 : size);
+
+    return tex;
+}
+
+void textures_upload(size_t budget)
+{
+    struct texture_upload *upl, *it;
+    unsigned int rows;
+    texture_t *tex;
+    int state;
+    void *src;
+
+    list_for_each_entry_iter(upl, it, &texture_uploads, entry) {
+        state = atomic_load(&upl->state);
+        if (!state)
+            continue;
+
+        if (upl->done) {
+            upl->done(upl->data);
+            upl->done = NULL;
+        }
+
+        tex = upl->tex;
+        if (state < 0) {
+            warn("texture %d: nothing to upload\n", tex->id);
+            texture_upload_free(upl);
+            continue;
+        }
+
+        /* always some, so a budget smaller than a row still gets there */
+        if (!budget)
+            break;
+        rows = min(max(budget / upl->stride, 1), tex->height - upl->row);
+        budget -= min(budget, rows * upl->stride);
+
+        render_bind_texture(tex->target - GL_TEXTURE0, tex->id);
+        src = upl->pixels + upl->row * upl->stride;
+#ifndef CONFIG_BROWSER
+        if (upl->pbo) {
+            GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upl->pbo));
+            if (upl->pixels) {
+                GL(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+                upl->pixels = NULL;
+            }
+            /* an offset into the unpack buffer */
+            src = (void *)(uintptr_t)(upl->row * upl->stride);
+        }
+#endif
+        GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, upl->row, tex->width, rows, tex->format,
+                           tex->type, src));
+        render_stats_upload(rows * upl->stride);
+#ifndef CONFIG_BROWSER
+        if (upl->pbo)
+            GL(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+#endif
+        upl->row += rows;
+        if (upl->row == tex->height && tex->mipmaps)
+            GL(glGenerateMipmap(GL_TEXTURE_2D));
+        texture_setup_end(tex);
+
+        if (upl->row == tex->height) {
+            tex->loaded = true;
+            texture_upload_free(upl);
+        }
+    }
+}
+
+#define RENDER_STREAM_ALIGN 16
+
+static struct render_stream {
+    GLuint          obj;
+    /* outgrown, still in use by this frame's draws */
+    GLuint          old_obj;
+    size_t          old_size;
+    /* of one frame's part */
+    size_t          size;
+    /* within this frame's part */
+    size_t          off;
+    unsigned int    frame;
+#ifndef CONFIG_BROWSER
+    GLsync          fence[RENDER_STREAM_FRAMES];
+#endif
+} stream;
+
+#ifndef CONFIG_BROWSER
+static void render_stream_fence_wait(unsigned int part)
+{
+    GLsync fence = stream.fence[part];
+    GLenum ret;
+
+    if (!fence)
+        return;
+
+    /* RENDER_STREAM_FRAMES frames later, this hardly ever blocks */
+    ret = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+    if (ret == GL_TIMEOUT_EXPIRED || ret == GL_WAIT_FAILED)
+        warn("stream buffer fence: %#x\n", ret);
+    GL(glDeleteSync(fence));
+    stream.fence[part] = NULL;
+}
+#endif /* CONFIG_BROWSER */
+
+static unsigned int render_stream_parts(void)
+{
+#ifndef CONFIG_BROWSER
+    return RENDER_STREAM_FRAMES;
+#else
+    return 1;
+#endif
+}
+
+static void render_stream_grow(size_t size)
+{
+    size_t new_size = max(stream.size * 2, RENDER_STREAM_SIZE);
+#ifndef CONFIG_BROWSER
+    unsigned int i;
+
+    for (i = 0; i < RENDER_STREAM_FRAMES; i++) {
+        if (stream.fence[i])
+            GL(glDeleteSync(stream.fence[i]));
+        stream.fence[i] = NULL;
+    }
+#endif
+
+    /*
+     * The draws issued so far still use the old one, it goes away in
+     * render_stream_advance(); outgrowing it twice in a frame is unlikely
+     */
+    if (stream.old_obj) {
+        GL(glDeleteBuffers(1, &stream.old_obj));
+        mem_account(MEM_GPU_BUFFER, -(ssize_t)stream.old_size);
+    }
+    stream.old_obj = stream.obj;
+    stream.old_size = stream.size * render_stream_parts();
+
+    while (new_size < size)
+        new_size *= 2;
+
+    GL(glGenBuffers(1, &stream.obj));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, stream.obj));
+    GL(glBufferData(GL_ARRAY_BUFFER, new_size * render_stream_parts(), NULL, GL_STREAM_DRAW));
+    mem_account(MEM_GPU_BUFFER, new_size * render_stream_parts());
+    stream.size = new_size;
+    stream.off = 0;
+}
+
+ssize_t render_stream_writev(const void **data, const size_t *sizes, unsigned int nr,
+                             GLuint *obj)
+{
+    size_t off, base, size = 0, pos;
+    void *dst = NULL;
+    unsigned int i;
+
+    for (i = 0; i < nr; i++)
+        size += sizes[i];
+
+    if (!stream.obj || stream.off + size > stream.size)
+        render_stream_grow(stream.off + size);
+    else
+        GL(glBindBuffer(GL_ARRAY_BUFFER, stream.obj));
+
+    if (!stream.obj)
+        return -ENOMEM;
+
+#ifndef CONFIG_BROWSER
+    base = (stream.frame % RENDER_STREAM_FRAMES) * stream.size;
+    if (!stream.off)
+        render_stream_fence_wait(stream.frame % RENDER_STREAM_FRAMES);
+    dst = glMapBufferRange(GL_ARRAY_BUFFER, base + stream.off, size,
+                           GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                           GL_MAP_UNSYNCHRONIZED_BIT);
+#else
+    base = 0;
+    /* the previous frame's storage goes to the driver, no waiting for it */
+    if (!stream.off)
+        GL(glBufferData(GL_ARRAY_BUFFER, stream.size, NULL, GL_STREAM_DRAW));
+#endif
+
+    off = base + stream.off;
+    for (i = 0, pos = 0; i < nr; pos += sizes[i++])
+        if (dst)
+            memcpy(dst + pos, data[i], sizes[i]);
+        else
+            GL(glBufferSubData(GL_ARRAY_BUFFER, off + pos, sizes[i], data[i]));
+    if (dst)
+        GL(glUnmapBuffer(GL_ARRAY_BUFFER));
+    render_stats_upload(size);
+
+    stream.off = (stream.off + size + RENDER_STREAM_ALIGN - 1) & ~(RENDER_STREAM_ALIGN - 1);
+    *obj = stream.obj;
+
+    return off;
+}
+
+ssize_t render_stream_write(const void *data, size_t size, GLuint *obj)
+{
+    return render_stream_writev(&data, &size, 1, obj);
+}
+
+void render_stream_advance(void)
+{
+    if (stream.old_obj) {
+        GL(glDeleteBuffers(1, &stream.old_obj));
+        mem_account(MEM_GPU_BUFFER, -(ssize_t)stream.old_size);
+    }
+    stream.old_obj = 0;
+
+    if (!stream.off)
+        return;
+
+#ifndef CONFIG_BROWSER
+    stream.fence[stream.frame % RENDER_STREAM_FRAMES] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+    stream.frame++;
+    stream.off = 0;
+}
+
+void render_stream_done(void)
+{
+#ifndef CONFIG_BROWSER
+    unsigned int i;
+
+    for (i = 0; i < RENDER_STREAM_FRAMES; i++)
+        if (stream.fence[i])
+            GL(glDeleteSync(stream.fence[i]));
+#endif
+
+    if (stream.old_obj) {
+        GL(glDeleteBuffers(1, &stream.old_obj));
+        mem_account(MEM_GPU_BUFFER, -(ssize_t)stream.old_size);
+    }
+    if (stream.obj) {
+        GL(glDeleteBuffers(1, &stream.obj));
+        mem_account(MEM_GPU_BUFFER, -(ssize_t)(stream.size * render_stream_parts()));
+    }
+    memset(&stream, 0, sizeof(stream));
+}
+
+_Static_assert(offsetof(struct render_frame, width) == 220 && sizeof(struct render_frame) == 240,
+               "struct render_frame doesn't match the std140 frame block");
+
+void render_frame_upload(const struct render_frame *frame)
+{
+#if !defined(CONFIG_GLES) && !defined(CONFIG_BROWSER)
+    static GLint align;
+    ssize_t off;
+    GLuint obj;
+
+    if (!align) {
+        GL(glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align));
+        align = max(align, RENDER_STREAM_ALIGN);
+    }
+
+    /* the frames' parts are RENDER_STREAM_SIZE multiples, aligned already */
+    stream.off = (stream.off + align - 1) / align * align;
+    off = render_stream_write(frame, sizeof(*frame), &obj);
+    if (off < 0)
+        return;
+
+    GL(glBindBufferRange(GL_UNIFORM_BUFFER, RENDER_FRAME_BINDING, obj, off, sizeof(*frame)));
+#endif
+}
+
+bool render_has_timer_queries(void)
+{
+    GLint nr_exts = 0, i;
+    const char *ext;
+
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nr_exts);
+    for (i = 0; i < nr_exts; i++) {
+        ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        /* ARB_timer_query, EXT_disjoint_timer_query{,_webgl2} */
+        if (ext && strstr(ext, "timer_query"))
+            return true;
+    }
+
+    return false;
+}
+
+_Static_assert(sizeof(struct render_draw_cmd) == 5 * sizeof(GLuint),
+               "struct render_draw_cmd is DrawElementsIndirectCommand");
+
+#if defined(CONFIG_BROWSER) || defined(CONFIG_GLES)
+bool render_has_multi_draw_indirect(void)
+{
+    return false;
+}
+
+void render_multi_draw_indirect(GLenum mode, GLenum type, const struct render_draw_cmd *cmds,
+                                unsigned int nr)
+{
+}
+#else
+bool render_has_multi_draw_indirect(void)
+{
+    static int has_mdi = -1;
+    GLint nr_exts = 0, i;
+    const char *ext;
+    int found = 0;
+
+    if (has_mdi >= 0)
+        return has_mdi;
+
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nr_exts);
+    for (i = 0; i < nr_exts; i++) {
+        ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && (!strcmp(ext, "GL_ARB_multi_draw_indirect") ||
+                    !strcmp(ext, "GL_ARB_base_instance")))
+            found++;
+    }
+
+    return (has_mdi = found == 2);
+}
+
+void render_multi_draw_indirect(GLenum mode, GLenum type, const struct render_draw_cmd *cmds,
+                                unsigned int nr)
+{
+    ssize_t off;
+    GLuint obj;
+
+    off = render_stream_write(cmds, nr * sizeof(*cmds), &obj);
+    if (off < 0)
+        return;
+
+    GL(glBindBuffer(GL_DRAW_INDIRECT_BUFFER, obj));
+    GL(glMultiDrawElementsIndirect(mode, type, (void *)off, nr, 0));
+    GL(glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0));
+}
+#endif /* CONFIG_BROWSER || CONFIG_GLES */
+
+/* GLES and WebGL only have them in EXT_disjoint_timer_query */
+#if defined(CONFIG_BROWSER) || defined(CONFIG_GLES)
+void render_timestamp(GLuint query)
+{
+    GL(glQueryCounterEXT(query, GL_TIMESTAMP_EXT));
+}
+
+static void render_query_result64(GLuint query, uint64_t *res)
+{
+    GLuint64 v;
+
+    GL(glGetQueryObjectui64vEXT(query, GL_QUERY_RESULT, &v));
+    *res = v;
+}
+#else
+void render_timestamp(GLuint query)
+{
+    GL(glQueryCounter(query, GL_TIMESTAMP));
+}
+
+static void render_query_result64(GLuint query, uint64_t *res)
+{
+    GLuint64 v;
+
+    GL(glGetQueryObjectui64v(query, GL_QUERY_RESULT, &v));
+    *res = v;
+}
+#endif
+
+bool render_timestamp_get(GLuint query, uint64_t *ns)
+{
+    GLuint available = 0;
+
+    GL(glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available));
+    if (!available)
+        return false;
+
+    render_query_result64(query, ns);
+    return true;
+}
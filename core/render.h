@@ -2,14 +2,23 @@
 #ifndef __CLAP_RENDER_H__
 #define __CLAP_RENDER_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 #include "display.h"
 #include "logger.h"
 #include "object.h"
 #include "typedef.h"
 
+struct texture_source;
+
 TYPE(texture,
     struct ref      ref;
+    /* resident textures, oldest first */
+    struct list     entry;
+    struct texture_source *src;
+    size_t          size;
+    unsigned long   used;
+    unsigned int    lod;
     GLuint          id;
     GLenum          format;
     GLenum          type;
@@ -17,8 +26,11 @@ TYPE(texture,
     GLint           filter;
     GLint           target;
     bool            loaded;
+    bool            mipmaps;
     unsigned int    width;
     unsigned int    height;
+    /* a GL_TEXTURE_2D_ARRAY of these many, see texture_array_new() */
+    unsigned int    layers;
 );
 
 static inline bool __gl_check_error(const char *str)
@@ -44,18 +56,239 @@ static inline bool __gl_check_error(const char *str)
 #define GL(__x) __x
 #endif
 
+/*
+ * Render state cache: remembers the state set through the helpers below
+ * and skips the GL calls that wouldn't change it. For this to work, the
+ * state in question must only ever be changed via these helpers.
+ */
+struct render_state_stats {
+    unsigned long   calls;
+    unsigned long   avoided;
+};
+
+void render_cull_face(bool enable);
+void render_blend(bool enable);
+void render_depth_test(bool enable);
+#ifndef EGL_EGL_PROTOTYPES
+void render_polygon_mode(GLenum mode);
+#endif
+void render_use_program(GLuint prog);
+void render_bind_vao(GLuint vao);
+/* instead of glDelete*(), which the cache wouldn't know about */
+void render_delete_program(GLuint prog);
+void render_delete_vao(GLuint vao);
+void render_bind_texture(unsigned int unit, GLuint id);
+void render_state_invalidate(void);
+
+/*
+ * GPU timestamps, if there are timer queries: render_timestamp() has the GPU
+ * write its clock into @query when it gets there, render_timestamp_get()
+ * reads it in nanoseconds, or returns false if it isn't there yet.
+ */
+bool render_has_timer_queries(void);
+void render_timestamp(GLuint query);
+bool render_timestamp_get(GLuint query, uint64_t *ns);
+void render_state_stats(struct render_state_stats *stats, bool reset);
+
+/*
+ * Render stats: what went to the GPU, counted as it goes. The binds are
+ * the ones that the state helpers above let through, the draws are
+ * counted by their callers (models_render_views()) and the uploads are the
+ * buffer and texture data, the streaming buffer's included. Triangles are
+ * by the LOD that they're drawn at; the strips, fans and lines count as
+ * triangles too, by the number of indices divided by 3. Each of a
+ * multi-draw's commands counts as a draw.
+ *
+ * render_stats() resets them with @reset, which the frame owns; the
+ * pieces of a frame (pipeline_render()'s passes, the benchmark) take
+ * render_stats_diff()s of them instead.
+ */
+#define RENDER_STATS_LODS 8
+
+struct render_stats {
+    unsigned long   draws;
+    unsigned long   instances;
+    unsigned long   triangles[RENDER_STATS_LODS];
+    unsigned long   culled;
+    unsigned long   occluded;
+    unsigned long   programs;
+    unsigned long   textures;
+    unsigned long   vaos;
+    unsigned long   uniforms;
+    unsigned long   fbos;
+    unsigned long   upload_bytes;
+};
+
+void render_stats(struct render_stats *stats, bool reset);
+/* @diff = @to - @from */
+void render_stats_diff(struct render_stats *diff, const struct render_stats *from,
+                       const struct render_stats *to);
+void render_stats_add(struct render_stats *sum, const struct render_stats *stats);
+unsigned long render_stats_triangles(const struct render_stats *stats);
+/* "draws %lu inst ..." into @buf of @size, for the overlays and reports */
+int render_stats_print(char *buf, size_t size, const struct render_stats *stats);
+
+/* @nr_idx indices, @nr_inst times, at @lod */
+void render_stats_draw(unsigned long nr_idx, unsigned long nr_inst, unsigned int lod);
+void render_stats_cull(unsigned long culled, unsigned long occluded);
+void render_stats_upload(size_t bytes);
+void render_stats_fbo(void);
+void render_stats_uniform(void);
+
+/* GL() for the glUniform*()s, to count them */
+#define UNIFORM(__x) do {       \
+    GL(__x);                    \
+    render_stats_uniform();     \
+} while (0)
+
+/*
+ * Multi-draw indirect: @nr glDrawElementsInstancedBaseInstance()s' worth of
+ * struct render_draw_cmd in one call, the commands going through the stream
+ * buffer. Desktop GL with ARB_multi_draw_indirect and ARB_base_instance
+ * only (both core in 4.3); the rest draw one by one.
+ */
+struct render_draw_cmd {
+    GLuint  count;
+    GLuint  nr_instances;
+    GLuint  first_index;
+    GLint   base_vertex;
+    GLuint  base_instance;
+};
+
+bool render_has_multi_draw_indirect(void);
+void render_multi_draw_indirect(GLenum mode, GLenum type, const struct render_draw_cmd *cmds,
+                                unsigned int nr);
+
 int texture_init(texture_t *tex);
 int texture_init_target(texture_t *tex, GLuint target);
+/* refcounted, for sharing via texture_set_source() */
+texture_t *texture_new(GLuint target);
 void texture_deinit(texture_t *tex);
 void texture_filters(texture_t *tex, GLint wrap, GLint filter);
+void texture_data_type(texture_t *tex, GLenum type);
+/* generate the mip chain on every load from here on */
+void texture_mipmaps(texture_t *tex, bool mipmaps);
 void texture_done(texture_t *tex);
 void texture_load(texture_t *tex, GLenum format, unsigned int width, unsigned int height,
                   void *buf);
+struct ktx2_image;
+/* upload a compressed mip chain as it is; -ENOTSUP if the GPU can't take it */
+int texture_load_ktx2(texture_t *tex, const struct ktx2_image *img);
+/* replace a @width x @height rectangle at @x,@y, in @tex's format */
+void texture_update(texture_t *tex, unsigned int x, unsigned int y, unsigned int width,
+                    unsigned int height, void *buf);
 void texture_fbo(texture_t *tex, GLuint attachment, GLenum format, unsigned int width,
                  unsigned int height);
 void texture_resize(texture_t *tex, unsigned int width, unsigned int height);
 GLuint texture_id(texture_t *tex);
 bool texture_loaded(texture_t *tex);
+/* loaded, and the pixels are in, see texture_upload_begin() */
+bool texture_ready(texture_t *tex);
 texture_t *texture_clone(texture_t *tex);
+/* as a GL_TEXTURE_2D or a GL_TEXTURE_2D_ARRAY, whichever it is */
+void texture_bind(texture_t *tex, unsigned int unit);
+
+/*
+ * @nr ready textures of the same size and format as the layers of a new
+ * GL_TEXTURE_2D_ARRAY, copied over on the GPU, so that draws that only
+ * differ in those can sample them all by the layer index; the originals
+ * can go afterwards. NULL if they don't match.
+ */
+texture_t *texture_array_new(GLuint target, texture_t **layers, unsigned int nr);
+
+/*
+ * Texture residency: every loaded texture counts towards the resident
+ * size. Textures that come from an asset have a source: a name, which
+ * texture_get() finds them by, so each asset is loaded once, and a @load
+ * callback that (re)loads it into @tex with @lod top mip levels dropped.
+ *
+ * Once the resident size is over the budget, textures_evict() drops a mip
+ * level from the ones that haven't been texture_used() the longest, and
+ * for at least TEXTURE_IDLE_FRAMES; texture_used() brings back the full
+ * size one. A budget of 0 means no budget.
+ */
+#define TEXTURE_IDLE_FRAMES 300
+
+typedef int (*texture_load_fn)(texture_t *tex, const char *name, unsigned int lod);
+
+int texture_set_source(texture_t *tex, const char *name, texture_load_fn load);
+/* a reference to an already loaded @name or NULL */
+texture_t *texture_get(const char *name);
+void texture_used(texture_t *tex);
+void textures_set_budget(size_t bytes);
+size_t textures_resident(void);
+/* once a frame */
+void textures_evict(void);
+
+/*
+ * Deferred uploads, for decoding on a job: texture_upload_begin() sizes
+ * @tex's storage, @width x @height of @format, and hands out *@pixels for
+ * the job to fill in. On native GL that's a mapping of a pixel unpack
+ * buffer, so the decoder writes straight into what the GPU copies from.
+ * The job calls texture_upload_ready() when it's done, then, on the main
+ * thread, textures_upload() calls @done(@data), because the pixels are in
+ * and whatever they came from can go, and uploads up to @budget bytes of
+ * rows of them per frame, making the mips in the end if texture_mipmaps().
+ * Until then, the texture is loaded, but its contents are undefined.
+ * @tex has to be refcounted, texture_new(); it's kept until it's done.
+ */
+#define TEXTURE_UPLOAD_BUDGET (8 << 20)
+
+struct texture_upload;
+struct texture_upload *texture_upload_begin(texture_t *tex, GLenum format, unsigned int width,
+                                            unsigned int height, void **pixels,
+                                            void (*done)(void *data), void *data);
+/* any thread */
+void texture_upload_ready(struct texture_upload *upl, bool ok);
+/* once a frame */
+void textures_upload(size_t budget);
+
+/*
+ * Streaming buffer: for the vertex data that changes every frame, like the
+ * instances and the UI batches. One GL_ARRAY_BUFFER, split in
+ * RENDER_STREAM_FRAMES parts, written one part per frame, so that the CPU
+ * doesn't overwrite what the GPU is still drawing from: the writes are
+ * unsynchronized mappings, and each part gets a fence when its frame is
+ * done, which is waited on before it's written again. WebGL has neither,
+ * there it orphans the whole buffer every frame instead.
+ *
+ * It starts at RENDER_STREAM_SIZE per frame and doubles when a frame runs
+ * out of it. Whatever is written is only good until render_stream_advance().
+ */
+#define RENDER_STREAM_FRAMES    3
+#define RENDER_STREAM_SIZE      (1024 * 1024)
+
+/* copy @size bytes in, returns the offset into *@obj or -ENOMEM */
+ssize_t render_stream_write(const void *data, size_t size, GLuint *obj);
+/* same, @nr pieces back to back */
+ssize_t render_stream_writev(const void **data, const size_t *sizes, unsigned int nr,
+                             GLuint *obj);
+/* once a frame */
+void render_stream_advance(void);
+void render_stream_done(void);
+
+/*
+ * The "frame" uniform block of shaders/frame.glsl, std140: what's the same
+ * for all the draws from one view, written once per view into the stream
+ * buffer and bound to RENDER_FRAME_BINDING, so switching programs doesn't
+ * re-upload any of it. GLSL ES 1.00 has no uniform blocks, the GLES and
+ * WebGL programs set these one by one, see models_render_views().
+ */
+#define RENDER_FRAME_BINDING    0
+
+struct render_frame {
+    float   proj[16];
+    float   view[16];
+    float   inverse_view[16];
+    float   light_pos[3];
+    float   __pad0;
+    float   light_color[3];
+    /* std140 packs these into the vec3's padding */
+    float   width;
+    float   height;
+    float   __pad1[3];
+};
+
+void render_frame_upload(const struct render_frame *frame);
 
 #endif /* __CLAP_RENDER_H__ */
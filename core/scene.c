@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
 #include "messagebus.h"
 #include "character.h"
 #include "gltf.h"
 #include "physics.h"
+#include "profiler.h"
 #include "shader.h"
 #include "terrain.h"
 #include "model.h"
@@ -319,11 +321,21 @@ static void scene_light_update(struct scene *scene)
 
 void scene_update(struct scene *scene)
 {
+    PROF_SCOPE("scene_update");
     struct model3dtx *txm;
     struct entity3d  *ent;
 
     scene_light_update(scene);
+    if (scene->camera) {
+        struct matrix4f *mx = scene->camera->inv_view_mx;
+        vec3 at = { -mx->m[2][0], -mx->m[2][1], -mx->m[2][2] };
 
+        sound_set_listener(mx->m[3], at, mx->m[1]);
+        if (scene->terrain)
+            terrain_update(scene->terrain, mx->m[3]);
+    }
+
+    scene_load_step(scene, SCENE_LOAD_BUDGET_NS);
     mq_update(&scene->mq);
 }
 
@@ -336,12 +348,16 @@ int scene_init(struct scene *scene)
     scene->near_plane   = 0.1;
     scene->far_plane    = 1000.0;
     mq_init(&scene->mq, scene);
+    scene->mq.spatial = true;
     list_init(&scene->characters);
     list_init(&scene->instor);
-    list_init(&scene->debug_draws);
+    darray_init(&scene->debug_vx);
+    darray_init(&scene->load_models);
+    darray_init(&scene->load_queue);
 
     subscribe(MT_INPUT, scene_handle_input, scene);
-    subscribe(MT_COMMAND, scene_handle_command, scene);
+    subscribe_mask(MT_COMMAND, scene_handle_command, scene,
+                   MSG_COMMAND(toggle_modality) | MSG_COMMAND(toggle_autopilot));
 
     return 0;
 }
@@ -360,14 +376,68 @@ struct scene_model_queue {
     struct scene      *scene;
 };
 
-static int model_new_from_json(struct scene *scene, JsonNode *node)
+/* one of @sm's entities, for model_new_from_json() or scene_load_step() */
+static struct entity3d *scene_entity_new(struct scene *scene, struct scene_model *sm, float *pos,
+                                         float scale, bool character)
+{
+    struct character *c = NULL;
+    struct entity3d  *e;
+
+    if (character) {
+        c = character_new(sm->txm, scene);
+        // if (!scene->control)
+        //     scene->control = c;
+        e = c->entity;
+        e->skip_culling = true;
+    } else {
+        e = entity3d_new(sm->txm);
+    }
+
+    e->dx = pos[0];
+    e->dy = pos[1];
+    e->dz = pos[2];
+    e->scale = scale;
+
+    if (sm->terrain_clamp)
+        phys_ground_entity(scene->phys, e);
+
+    if (c) {
+        c->pos[0] = e->dx;
+        c->pos[1] = e->dy;
+        c->pos[2] = e->dz;
+        c->speed  = sm->speed;
+    }
+
+    mat4x4_translate_in_place(e->mx->m, e->dx, e->dy, e->dz);
+    mat4x4_scale_aniso(e->mx->m, e->mx->m, e->scale, e->scale, e->scale);
+    e->visible        = 1;
+    model3dtx_add_entity(sm->txm, e);
+
+    /*
+     * XXX: This kinda requires that "physics" goes before "entity"
+     */
+    if (sm->phys) {
+        entity3d_add_physics(e, scene->phys, sm->mass, sm->class, sm->ptype, sm->geom_off,
+                             sm->geom_radius, sm->geom_length);
+        e->phys_body->bounce = sm->bounce;
+        e->phys_body->bounce_vel = sm->bounce_vel;
+    }
+    trace("added '%s' entity at %f,%f,%f scale %f\n", txmodel_name(sm->txm), e->dx, e->dy, e->dz, e->scale);
+
+    return e;
+}
+
+/* @gd: the model's glTF, or NULL for the other kinds; this gltf_free()s it */
+static int model_from_json(struct scene *scene, JsonNode *node, struct gltf_data *gd)
 {
     double mass = 1.0, bounce = 0.0, bounce_vel = dInfinity, geom_off = 0.0, geom_radius = 1.0, geom_length = 1.0, speed = 0.75;
+    double batch = 0, proxy_error = 0.05;
+    enum collision_proxy proxy = COLLISION_FULL;
     char *name = NULL, *obj = NULL, *binvec = NULL, *gltf = NULL, *tex = NULL;
-    bool terrain_clamp = false, cull_face = true, alpha_blend = false;
+    bool terrain_clamp = false, cull_face = true, alpha_blend = false, shared = false;
     JsonNode *p, *ent = NULL, *ch = NULL, *phys = NULL, *anis = NULL;
-    int class = dSphereClass, collision = -1, ptype = PHYS_BODY;
-    struct gltf_data *gd = NULL;
+    int class = dSphereClass, collision = -1, ptype = PHYS_BODY, mesh = 0;
+    struct scene_model sm, *sm_load = NULL;
     struct lib_handle *libh;
     struct model3dtx  *txm;
 
@@ -403,6 +473,8 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
             anis = p;
         else if (p->tag == JSON_NUMBER && !strcmp(p->key, "speed"))
             speed = p->number_;
+        else if (p->tag == JSON_NUMBER && !strcmp(p->key, "batch"))
+            batch = p->number_;
     }
 
     if (!name || (!obj && !binvec && !gltf)) {
@@ -427,35 +499,56 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
         scene_add_model(scene, txm);
         ref_put_last(libh);
     } else if (gltf) {
-        gd = gltf_load(scene, gltf);
+        void (*instantiate)(struct gltf_data *gd, int mesh) = gltf_instantiate_one;
+
         if (!gd) {
             warn("Error loading GLTF '%s'\n", gltf);
             return -1;
         }
 
+        /*
+         * Plain scenery can go on a model that another glTF has made of the
+         * same mesh, as a texture variant; the rest look their models up by
+         * name or need them for themselves
+         */
+        if (ent && !ch && batch <= 0)
+            instantiate = gltf_instantiate_shared;
+
+        /* the scene's names for the animations */
+        for (p = anis ? anis->children.head : NULL; p; p = p->next)
+            if (p->tag == JSON_STRING && !gltf_rename_animation(gd, p->string_, p->key))
+                dbg("action '%s': animation '%s'\n", p->key, p->string_);
+
         if (gltf_get_meshes(gd) > 1) {
             int i, root = gltf_root_mesh(gd);
 
             collision = gltf_mesh_by_name(gd, "collision");
+            mesh = -1;
             if (root < 0)
                 for (i = 0; i < gltf_get_meshes(gd); i++)
                     if (i != collision) {
-                        gltf_instantiate_one(gd, i);
+                        instantiate(gd, i);
+                        mesh = i;
                         break; /* XXX: why? */
                     }
             /* In the absence of a dedicated collision mesh, use the main one */
             if (collision < 0)
                 collision = 0;
         } else {
-            gltf_instantiate_one(gd, 0);
+            instantiate(gd, 0);
             collision = 0;
         }
         txm = mq_model_last(&scene->mq);
-        txm->model->cull_face = cull_face;
-        txm->model->alpha_blend = alpha_blend;
+        /* the model is the first one's, and so are its name and settings */
+        shared = model3dtx_shares_model(txm);
+        if (!shared) {
+            txm->model->cull_face = cull_face;
+            txm->model->alpha_blend = alpha_blend;
+        }
     }
 
-    model3d_set_name(txm->model, name);
+    if (!shared)
+        model3d_set_name(txm->model, name);
 
     if (phys) {
         for (p = phys->children.head; p; p = p->next) {
@@ -478,6 +571,16 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
                     class = dSphereClass;
                 else if (!strcmp(p->string_, "capsule"))
                     class = dCapsuleClass;
+            } else if (p->tag == JSON_STRING && !strcmp(p->key, "collision")) {
+                /* trimesh only: what to collide with instead of the whole thing */
+                if (!strcmp(p->string_, "full"))
+                    proxy = COLLISION_FULL;
+                else if (!strcmp(p->string_, "simplified"))
+                    proxy = COLLISION_SIMPLIFIED;
+                else if (!strcmp(p->string_, "box"))
+                    proxy = COLLISION_BOX;
+            } else if (p->tag == JSON_NUMBER && !strcmp(p->key, "collision_error")) {
+                proxy_error = p->number_;
             } else if (p->tag == JSON_STRING && !strcmp(p->key, "type")) {
                 if (!strcmp(p->string_, "body"))
                     ptype = PHYS_BODY;
@@ -487,88 +590,66 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
         }
 
         /* XXX: if it's not a gltf, we won't have TriMesh collision data any more */
-        if (gd && class == dTriMeshClass) {
+        if (gd && class == dTriMeshClass && (!shared || !txm->model->collision_vx)) {
             gltf_mesh_data(gd, collision, &txm->model->collision_vx, &txm->model->collision_vxsz,
                            &txm->model->collision_idx, &txm->model->collision_idxsz, NULL, NULL, NULL, NULL);
+            txm->model->collision_idx_stride = gltf_idx_stride(gd, collision);
+            if (mesh_collision_proxy(proxy, proxy_error, &txm->model->collision_vx,
+                                     &txm->model->collision_vxsz, &txm->model->collision_idx,
+                                     &txm->model->collision_idxsz, &txm->model->collision_idx_stride))
+                dbg("model '%s': keeping the full collision mesh\n", name);
         }
     }
 
+    sm.txm           = txm;
+    sm.mass          = mass;
+    sm.bounce        = bounce;
+    sm.bounce_vel    = bounce_vel;
+    sm.geom_off      = geom_off;
+    sm.geom_radius   = geom_radius;
+    sm.geom_length   = geom_length;
+    sm.speed         = speed;
+    sm.class         = class;
+    sm.ptype         = ptype;
+    sm.phys          = !!phys;
+    sm.terrain_clamp = terrain_clamp;
+
     if (ent || ch) {
         JsonNode *it = ent ? ent : ch;
+        struct scene_load_item *item;
+        float pos[3], scale = 1;
+        unsigned int i;
+
+        /* the batches need all of their entities up front */
+        if (ent && batch <= 0)
+            CHECK(sm_load = darray_add(&scene->load_models.da));
+        if (sm_load)
+            *sm_load = sm;
+
         for (; it; it = it->next) {
-            struct character *c = NULL;
-            struct entity3d  *e;
-            JsonNode *pos;
+            JsonNode *n;
 
             if (it->tag != JSON_ARRAY)
                 continue; /* XXX: in fact, no */
 
-            if (ch) {
-                c = character_new(txm, scene);
-                // if (!scene->control)
-                //     scene->control = c;
-                e = c->entity;
-                e->skip_culling = true;
-            } else {
-                e = entity3d_new(txm);
-            }
-            pos = it->children.head;
-            if (pos->tag != JSON_NUMBER)
-                continue; /* XXX */
-            e->dx = pos->number_;
-            pos = pos->next;      
-            if (!pos || pos->tag != JSON_NUMBER)
+            /* x, y, z, scale */
+            for (i = 0, n = it->children.head; i < 4 && n && n->tag == JSON_NUMBER; i++, n = n->next)
+                if (i < 3)
+                    pos[i] = n->number_;
+                else
+                    scale = n->number_;
+            if (i < 4)
                 continue; /* XXX */
-            e->dy = pos->number_;
-            pos = pos->next;
-            if (!pos || pos->tag != JSON_NUMBER)
-                continue; /* XXX */
-            e->dz = pos->number_;
-            pos = pos->next;
-            if (!pos || pos->tag != JSON_NUMBER)
-                continue; /* XXX */
-            e->scale = pos->number_;
-
-            if (terrain_clamp)
-                phys_ground_entity(e);
 
-            if (c) {
-                c->pos[0] = e->dx;
-                c->pos[1] = e->dy;
-                c->pos[2] = e->dz;
-                c->speed  = speed;
+            if (!sm_load) {
+                scene_entity_new(scene, &sm, pos, scale, !!ch);
+                continue;
             }
 
-            mat4x4_translate_in_place(e->mx->m, e->dx, e->dy, e->dz);
-            mat4x4_scale_aniso(e->mx->m, e->mx->m, e->scale, e->scale, e->scale);
-            e->visible        = 1;
-            model3dtx_add_entity(txm, e);
-
-            /*
-             * XXX: This kinda requires that "physics" goes before "entity"
-             */
-            if (phys) {
-                entity3d_add_physics(e, mass, class, ptype, geom_off, geom_radius, geom_length);
-                e->phys_body->bounce = bounce;
-                e->phys_body->bounce_vel = bounce_vel;
-            }
-            trace("added '%s' entity at %f,%f,%f scale %f\n", name, e->dx, e->dy, e->dz, e->scale);
-
-            if (entity_animated(e) && anis) {
-                for (p = anis->children.head; p; p = p->next) {
-                    if (p->tag != JSON_STRING)
-                        continue;
-
-                    struct model3d *m = e->txmodel->model;
-                    int idx = animation_by_name(m, p->string_);
-
-                    if (idx < 0)
-                        continue;
-                    dbg("action '%s': animation '%s'\n", p->key, p->string_);
-                    free(m->anis.x[idx].name);
-                    m->anis.x[idx].name = strdup(p->key);
-                }
-            }
+            CHECK(item = darray_add(&scene->load_queue.da));
+            item->model = scene->load_models.da.nr_el - 1;
+            memcpy(item->pos, pos, sizeof(item->pos));
+            item->scale = scale;
         }
     } else {
         struct instantiator *instor, *iter;
@@ -581,7 +662,7 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
                 free(instor);
 
                 if (phys) {
-                    entity3d_add_physics(e, mass, class, ptype, geom_off, geom_radius, geom_length);
+                    entity3d_add_physics(e, scene->phys, mass, class, ptype, geom_off, geom_radius, geom_length);
                     e->phys_body->bounce = bounce;
                     e->phys_body->bounce_vel = bounce_vel;
                 }
@@ -589,6 +670,17 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
         }
     }
 
+    /* scenery: merge the ones close to each other into one draw per @batch square */
+    if (gd && batch > 0) {
+        struct mesh *me = gltf_mesh_new(gd, mesh);
+        int err = me ? model3dtx_batch_static(txm, me, batch) : -ENOENT;
+
+        if (err < 0)
+            warn("couldn't batch '%s': %d\n", name, err);
+        if (me)
+            ref_put(me);
+    }
+
     if (gd)
         gltf_free(gd);
 
@@ -597,14 +689,191 @@ static int model_new_from_json(struct scene *scene, JsonNode *node)
     return 0;
 }
 
+/* the rest of model_new_from_json(), once its glTF is in */
+struct scene_model_load {
+    struct scene    *scene;
+    JsonNode        *node;
+};
+
+static void scene_loaded(struct scene *scene);
+
+/* model_new_from_json()'s and scene_onload()'s own */
+static void scene_models_done(struct scene *scene)
+{
+    if (!--scene->load_pending)
+        scene_loaded(scene);
+}
+
+static void scene_model_loaded(struct gltf_data *gd, void *data)
+{
+    struct scene_model_load *sml = data;
+
+    model_from_json(sml->scene, sml->node, gd);
+    scene_models_done(sml->scene);
+    free(sml);
+}
+
+/*
+ * The glTF ones are read and parsed in the background, the characters
+ * first, the batched scenery last; the rest is made as they come in
+ */
+static int model_new_from_json(struct scene *scene, JsonNode *node)
+{
+    enum lib_priority prio = LIB_PRIO_NORMAL;
+    struct scene_model_load *sml;
+    const char *name = NULL, *gltf = NULL;
+    JsonNode *p;
+
+    if (node->tag != JSON_OBJECT)
+        return model_from_json(scene, node, NULL);
+
+    for (p = node->children.head; p; p = p->next)
+        if (p->tag == JSON_STRING && !strcmp(p->key, "name"))
+            name = p->string_;
+        else if (p->tag == JSON_STRING && !strcmp(p->key, "gltf"))
+            gltf = p->string_;
+        else if (p->tag == JSON_ARRAY && !strcmp(p->key, "character"))
+            prio = LIB_PRIO_HIGH;
+        else if (p->tag == JSON_NUMBER && !strcmp(p->key, "batch") && p->number_ > 0 &&
+                 prio != LIB_PRIO_HIGH)
+            prio = LIB_PRIO_LOW;
+
+    if (!name || !gltf)
+        return model_from_json(scene, node, NULL);
+
+    sml = calloc(1, sizeof(*sml));
+    if (!sml)
+        return -ENOMEM;
+
+    sml->scene = scene;
+    sml->node  = node;
+    scene->load_pending++;
+    if (gltf_load_async(scene, gltf, prio, scene_model_loaded, sml)) {
+        warn("Error loading GLTF '%s'\n", gltf);
+        scene->load_pending--;
+        free(sml);
+        return -1;
+    }
+
+    return 0;
+}
+
+static vec3 load_origin;
+
+static int scene_load_item_cmp(const void *a, const void *b)
+{
+    const struct scene_load_item *ia = a, *ib = b;
+    vec3 da, db;
+
+    vec3_sub(da, (float *)ia->pos, load_origin);
+    vec3_sub(db, (float *)ib->pos, load_origin);
+
+    return (vec3_mul_inner(da, da) > vec3_mul_inner(db, db)) -
+           (vec3_mul_inner(da, da) < vec3_mul_inner(db, db));
+}
+
+/* the ones around where the camera starts go first */
+static void scene_load_sort(struct scene *scene)
+{
+    struct entity3d *e = scene->control ? scene->control->entity : NULL;
+    unsigned int next = scene->load_next;
+
+    if (e) {
+        load_origin[0] = e->dx;
+        load_origin[1] = e->dy;
+        load_origin[2] = e->dz;
+    } else {
+        memset(load_origin, 0, sizeof(load_origin));
+    }
+
+    qsort(scene->load_queue.x + next, scene->load_queue.da.nr_el - next,
+          sizeof(*scene->load_queue.x), scene_load_item_cmp);
+    scene->load_total = scene->load_queue.da.nr_el;
+}
+
+static void scene_load_progress(struct scene *scene)
+{
+    struct message m = {
+        .type = MT_COMMAND,
+        .cmd  = {
+            .load_progress = 1,
+            .load_done     = scene->load_next,
+            .load_total    = scene->load_total,
+        },
+    };
+
+    message_send(&m);
+}
+
+static void scene_load_clear(struct scene *scene)
+{
+    darray_clearout(&scene->load_queue.da);
+    darray_clearout(&scene->load_models.da);
+    scene->load_next = scene->load_total = 0;
+}
+
+/* after the entity queue, which holds on to the txmodels that the merges drop */
+static void scene_load_layers(struct scene *scene)
+{
+    if (scene->load_layers && mq_texture_layers(&scene->mq, scene->prog) != -EAGAIN)
+        scene->load_layers = false;
+}
+
+void scene_load_step(struct scene *scene, uint64_t budget_ns)
+{
+    struct scene_load_item *item;
+    struct timespec start, now, diff;
+
+    if (scene->load_next == scene->load_total) {
+        scene_load_layers(scene);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (scene->load_next < scene->load_total) {
+        item = &scene->load_queue.x[scene->load_next++];
+        scene_entity_new(scene, &scene->load_models.x[item->model], item->pos, item->scale, false);
+
+        if (!budget_ns)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timespec_diff(&start, &now, &diff);
+        if ((uint64_t)diff.tv_sec * 1000000000 + diff.tv_nsec >= budget_ns)
+            break;
+    }
+
+    scene_load_progress(scene);
+    if (scene->load_next == scene->load_total) {
+        dbg("scene '%s': %u entities loaded\n", scene->name, scene->load_total);
+        scene_load_clear(scene);
+    }
+}
+
+/* all the models are in; the document goes, their entities are queued */
+static void scene_loaded(struct scene *scene)
+{
+    json_free(scene->load_json);
+    scene->load_json = NULL;
+    dbg("loaded scene: '%s'\n", scene->name);
+    scene_control_next(scene);
+    scene_load_sort(scene);
+    scene->load_layers = true;
+}
+
+static void scene_models_wait(struct scene *scene)
+{
+    while (scene->load_pending)
+        librarian_poll(LIB_POLL_BUDGET_US);
+}
+
 static void scene_onload(struct lib_handle *h, void *buf)
 {
     struct scene *scene = buf;
     char         msg[256];
-    LOCAL(JsonNode, node);
-    JsonNode     *p, *m;
+    JsonNode     *node, *p, *m;
 
-    node = json_decode(h->buf);
+    node = json_decode_arena(h->buf);
     if (!node) {
         err("couldn't parse '%s'\n", h->name);
         return;
@@ -612,25 +881,30 @@ static void scene_onload(struct lib_handle *h, void *buf)
 
     if (!json_check(node, msg)) {
         err("error parsing '%s': '%s'\n", h->name, msg);
+        json_free(node);
         return;
     }
 
     if (node->tag != JSON_OBJECT) {
         err("parse error in '%s'\n", h->name);
+        json_free(node);
         return;
     }
 
+    /* the models' nodes are used until they're all loaded */
+    scene->load_json = node;
+    scene->load_pending++;
     for (p = node->children.head; p; p = p->next) {
         if (!strcmp(p->key, "name")) {
             if (p->tag != JSON_STRING) {
                 err("parse error in '%s'\n", h->name);
-                return;
+                break;
             }
             scene->name = strdup(p->string_);
         } else if (!strcmp(p->key, "model")) {
             if (p->tag != JSON_ARRAY) {
                 err("parse error in '%s'\n", h->name);
-                return;
+                break;
             }
 
             for (m = p->children.head; m; m = m->next) {
@@ -638,9 +912,8 @@ static void scene_onload(struct lib_handle *h, void *buf)
             }
         }
     }
-    dbg("loaded scene: '%s'\n", scene->name);
     ref_put(h);
-    scene_control_next(scene);
+    scene_models_done(scene);
 }
 
 int scene_load(struct scene *scene, const char *name)
@@ -654,21 +927,36 @@ int scene_load(struct scene *scene, const char *name)
     return 0;
 }
 
+void scene_load_finish(struct scene *scene)
+{
+    scene_models_wait(scene);
+    scene_load_step(scene, 0);
+}
+
 void scene_done(struct scene *scene)
 {
     struct model3dtx *txmodel, *ittxm;
     struct entity3d  *ent, *itent;
     struct instantiator *instor;
 
+    /* their completions still point here */
+    scene_models_wait(scene);
     while (!list_empty(&scene->instor)) {
         instor = list_first_entry(&scene->instor, struct instantiator, entry);
         list_del(&instor->entry);
         free(instor);
     }
 
+    scene_load_clear(scene);
     if (scene->terrain)
         terrain_done(scene->terrain);
     ref_put_last(scene->camera->ch);
 
     mq_release(&scene->mq);
+    darray_clearout(&scene->debug_vx.da);
+    if (scene->debug_vao)
+        render_delete_vao(scene->debug_vao);
+    /* after the entities, which take their bodies with them */
+    if (scene->phys)
+        ref_put(scene->phys);
 }
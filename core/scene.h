@@ -19,6 +19,26 @@ struct instantiator {
     float           dx, dy, dz;
 };
 
+/* what a model's entities are made with, see scene_load_step() */
+struct scene_model {
+    struct model3dtx    *txm;
+    double              mass, bounce, bounce_vel;
+    double              geom_off, geom_radius, geom_length;
+    double              speed;
+    int                 class, ptype;
+    bool                phys;
+    bool                terrain_clamp;
+};
+
+struct scene_load_item {
+    unsigned int    model;
+    float           pos[3];
+    float           scale;
+};
+
+/* per frame, for making the scene's entities; the rest waits for the next one */
+#define SCENE_LOAD_BUDGET_NS    (4 * 1000 * 1000)
+
 struct scene {
     char                *name;
     int                 width;
@@ -27,12 +47,26 @@ struct scene {
     struct mq           mq;
     struct list         characters;
     struct list         instor;
-    struct list         debug_draws;
+    /* see debug_draw_line() */
+    darray(struct debug_vertex, debug_vx);
+    /* the entities that are still to be made, nearest first, see scene_load_step() */
+    darray(struct scene_model, load_models);
+    darray(struct scene_load_item, load_queue);
+    unsigned int        load_next;
+    unsigned int        load_total;
+    /* the scene's document, until the models it's loading are in */
+    struct JsonNode     *load_json;
+    unsigned int        load_pending;
+    /* the texture variants are still to be merged, see mq_texture_layers() */
+    bool                load_layers;
+    GLuint              debug_vao;
     struct entity3d     *focus;
     struct character    *control;
     struct shader_prog  *prog;
     struct matrix4f     *proj_mx;
     struct terrain      *terrain;
+    /* phys_new() after clap_init(); released in scene_done() */
+    struct phys         *phys;
     struct camera       *camera;
     struct camera       cameras[NR_CAMERAS_MAX];
     struct light        light;
@@ -61,7 +95,17 @@ void scene_cameras_calc(struct scene *s);
 int scene_add_model(struct scene *s, struct model3dtx *txm);
 int scene_init(struct scene *scene);
 void scene_done(struct scene *scene);
+/*
+ * Loads the scene and starts on its models: the glTF ones come in from
+ * librarian_poll(), with their characters; the rest of their entities
+ * are queued for scene_update(), which makes them in @budget_ns slices of
+ * scene_load_step() and sends out MT_COMMAND load_progress after each
+ */
 int  scene_load(struct scene *scene, const char *name);
+/* @budget_ns of 0 is all of them, now */
+void scene_load_step(struct scene *scene, uint64_t budget_ns);
+/* waits for the models, then makes all of their entities */
+void scene_load_finish(struct scene *scene);
 void scene_update(struct scene *scene);
 bool scene_camera_follows(struct scene *s, struct character *ch);
 void scene_characters_move(struct scene *s);
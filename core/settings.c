@@ -35,7 +35,8 @@ struct settings {
 #ifdef CONFIG_BROWSER
 static void settings_sync(void)
 {
-    EM_ASM(
+    /* FS is the page's, also in the worker build */
+    MAIN_THREAD_ASYNC_EM_ASM(
         if (!Module.fs_syncing) {
             Module.fs_syncing = true;
             FS.syncfs(false, function(err) {
@@ -204,8 +205,19 @@ void settings_set_string(struct settings *settings, const char *key, const char
 }
 
 #ifdef __EMSCRIPTEN__
+#ifdef CONFIG_BROWSER_WORKER
+static pthread_t settings_thread;
+#endif /* CONFIG_BROWSER_WORKER */
+
+/* called from the page's syncfs() callback */
 EMSCRIPTEN_KEEPALIVE void settings_ready(void)
 {
+#ifdef CONFIG_BROWSER_WORKER
+    if (!pthread_equal(pthread_self(), settings_thread)) {
+        emscripten_dispatch_to_thread_async(settings_thread, EM_FUNC_SIG_V, settings_ready, NULL);
+        return;
+    }
+#endif /* CONFIG_BROWSER_WORKER */
     settings_load(&_settings);
     _settings.ready = true;
     _settings.on_ready(&_settings, _settings.on_ready_data);
@@ -220,7 +232,10 @@ struct settings *settings_init(void *cb, void *data)
     _settings.on_ready_data = data;
 #ifdef __EMSCRIPTEN__
     settings_file = SETTINGS_FILE;
-    EM_ASM(
+#ifdef CONFIG_BROWSER_WORKER
+    settings_thread = pthread_self();
+#endif /* CONFIG_BROWSER_WORKER */
+    MAIN_THREAD_EM_ASM(
         FS.mkdir("/settings");
         FS.mount(IDBFS, {}, "/settings");
         FS.syncfs(true, function(err) {
@@ -25,6 +25,21 @@ A million repetitions of "a"
 
 #include "sha1.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SHA1_X86 1
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define SHA1_ARM 1
+#define SHA1_ARM_TARGET
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define SHA1_ARM 1
+#define SHA1_ARM_HWCAP 1
+#define SHA1_ARM_TARGET __attribute__((target("+crypto")))
+#endif
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
@@ -193,30 +208,157 @@ void SHA1Init(
 }
 
 
-/* Run your data through this. */
+#ifdef SHA1_X86
+/*
+ * SHA-NI: 4 rounds per sha1rnds4, whose round function is an immediate,
+ * hence the macro; w[] is the message schedule, 4 words at a time.
+ */
+#define SHA1_NI_ROUNDS(g, f) do {                                               \
+    if ((g) >= 4)                                                               \
+        w[(g) % 4] = _mm_sha1msg2_epu32(                                        \
+            _mm_xor_si128(_mm_sha1msg1_epu32(w[(g) % 4], w[((g) + 1) % 4]),     \
+                          w[((g) + 2) % 4]),                                    \
+            w[((g) + 3) % 4]);                                                  \
+    e1 = (g) ? _mm_sha1nexte_epu32(e0, w[(g) % 4]) : _mm_add_epi32(e0, w[0]);   \
+    e0 = abcd;                                                                  \
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, (f));                                  \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_ni(uint32_t state[5], const unsigned char *data, size_t nr)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ull, 0x08090a0b0c0d0e0full);
+    __m128i abcd, abcd_save, e0, e0_save, e1, w[4];
+    int i;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; nr; nr--, data += 64) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        for (i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), bswap);
+
+        SHA1_NI_ROUNDS(0, 0);  SHA1_NI_ROUNDS(1, 0);  SHA1_NI_ROUNDS(2, 0);
+        SHA1_NI_ROUNDS(3, 0);  SHA1_NI_ROUNDS(4, 0);  SHA1_NI_ROUNDS(5, 1);
+        SHA1_NI_ROUNDS(6, 1);  SHA1_NI_ROUNDS(7, 1);  SHA1_NI_ROUNDS(8, 1);
+        SHA1_NI_ROUNDS(9, 1);  SHA1_NI_ROUNDS(10, 2); SHA1_NI_ROUNDS(11, 2);
+        SHA1_NI_ROUNDS(12, 2); SHA1_NI_ROUNDS(13, 2); SHA1_NI_ROUNDS(14, 2);
+        SHA1_NI_ROUNDS(15, 3); SHA1_NI_ROUNDS(16, 3); SHA1_NI_ROUNDS(17, 3);
+        SHA1_NI_ROUNDS(18, 3); SHA1_NI_ROUNDS(19, 3);
+
+        /* e0 is a from before the last 4 rounds */
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif /* SHA1_X86 */
+
+#ifdef SHA1_ARM
+SHA1_ARM_TARGET
+static void sha1_blocks_arm(uint32_t state[5], const unsigned char *data, size_t nr)
+{
+    static const uint32_t k[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd, abcd_save, tmp, w[4];
+    uint32_t e0, e0_save, e1;
+    int g;
+
+    abcd = vld1q_u32(state);
+    e0 = state[4];
+
+    for (; nr; nr--, data += 64) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        for (g = 0; g < 4; g++)
+            w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + g * 16)));
+
+        for (g = 0; g < 20; g++) {
+            if (g >= 4)
+                w[g % 4] = vsha1su1q_u32(vsha1su0q_u32(w[g % 4], w[(g + 1) % 4], w[(g + 2) % 4]),
+                                         w[(g + 3) % 4]);
+            tmp = vaddq_u32(w[g % 4], vdupq_n_u32(k[g / 5]));
+            e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5)
+                abcd = vsha1cq_u32(abcd, e0, tmp);
+            else if (g >= 10 && g < 15)
+                abcd = vsha1mq_u32(abcd, e0, tmp);
+            else
+                abcd = vsha1pq_u32(abcd, e0, tmp);
+            e0 = e1;
+        }
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e0 += e0_save;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+#endif /* SHA1_ARM */
+
+/* Hash @nr consecutive blocks, with whatever the CPU has for it */
+
+static void sha1_blocks(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t nr
+)
+{
+#if defined(SHA1_X86)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+    {
+        sha1_blocks_ni(state, data, nr);
+        return;
+    }
+#elif defined(SHA1_ARM_HWCAP)
+    if (getauxval(AT_HWCAP) & HWCAP_SHA1)
+    {
+        sha1_blocks_arm(state, data, nr);
+        return;
+    }
+#elif defined(SHA1_ARM)
+    sha1_blocks_arm(state, data, nr);
+    return;
+#endif
+    for (; nr; nr--, data += 64)
+        SHA1Transform(state, data);
+}
+
+
+/*
+ * Run your data through this. It's a stream: feed it whatever arrived so
+ * far, in pieces of any size, the partial block waits in the context.
+ */
 
 void SHA1Update(
     SHA1_CTX * context,
     const unsigned char *data,
-    uint32_t len
+    size_t len
 )
 {
-    uint32_t i;
+    size_t i;
 
     uint32_t j;
 
     j = context->count[0];
-    if ((context->count[0] += len << 3) < j)
+    if ((context->count[0] += (uint32_t)(len << 3)) < j)
         context->count[1]++;
-    context->count[1] += (len >> 29);
+    context->count[1] += (uint32_t)(len >> 29);
     j = (j >> 3) & 63;
     if ((j + len) > 63)
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
-        SHA1Transform(context->state, context->buffer);
-        for (; i + 63 < len; i += 64)
+        sha1_blocks(context->state, context->buffer, 1);
+        if (len - i >= 64)
         {
-            SHA1Transform(context->state, &data[i]);
+            sha1_blocks(context->state, &data[i], (len - i) / 64);
+            i += (len - i) & ~(size_t)63;
         }
         j = 0;
     }
@@ -285,11 +427,9 @@ void SHA1(
     int len)
 {
     SHA1_CTX ctx;
-    unsigned int ii;
 
     SHA1Init(&ctx);
-    for (ii=0; ii<len; ii+=1)
-        SHA1Update(&ctx, (const unsigned char*)str + ii, 1);
+    SHA1Update(&ctx, (const unsigned char*)str, len);
     SHA1Final((unsigned char *)hash_out, &ctx);
     hash_out[20] = '\0';
 }
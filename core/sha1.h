@@ -7,6 +7,7 @@
    100% Public Domain
  */
 
+#include <stddef.h>
 #include "stdint.h"
 
 typedef struct
@@ -25,10 +26,14 @@ void SHA1Init(
     SHA1_CTX * context
     );
 
+/*
+ * Incremental: call it as the data comes in, in any size of pieces; full
+ * blocks go through SHA-NI or ARMv8 crypto extensions if the CPU has them
+ */
 void SHA1Update(
     SHA1_CTX * context,
     const unsigned char *data,
-    uint32_t len
+    size_t len
     );
 
 void SHA1Final(
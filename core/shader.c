@@ -9,75 +9,188 @@
 #include "util.h"
 #include "object.h"
 #include "shader.h"
+#include "render.h"
 #include "common.h"
 #include "librarian.h"
 #include "scene.h"
 
-static GLuint loadShader(GLenum shaderType, const char *shaderSource)
+/* what's in flight between shader_prog_begin() and shader_prog_finish() */
+struct shader_build {
+    GLuint  vsh;
+    GLuint  fsh;
+#ifndef CONFIG_BROWSER
+    char    key[LIB_CACHE_KEY_MAX];
+#endif
+};
+
+static bool parallel_compile;
+
+/*
+ * With KHR_parallel_shader_compile, the driver compiles and links in its
+ * own threads; without it, it may still defer the work, as long as no one
+ * asks for the results. Either way, all programs are started before any
+ * of them are looked at, see shader_prog_find().
+ */
+static void shader_compile_init(void)
+{
+    static bool done;
+    GLint nr_exts = 0, i;
+    const char *ext;
+
+    if (done)
+        return;
+
+    done = true;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nr_exts);
+    for (i = 0; i < nr_exts; i++) {
+        ext = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && strstr(ext, "parallel_shader_compile"))
+            parallel_compile = true;
+    }
+
+#ifndef CONFIG_BROWSER
+    /* as many as it likes */
+    if (parallel_compile)
+        GL(glMaxShaderCompilerThreadsKHR(0xffffffff));
+#endif
+}
+
+static GLuint shader_compile(GLenum type, const char *src)
 {
-    GLuint shader = glCreateShader(shaderType);
+    GLuint shader = glCreateShader(type);
+
     if (!shader) {
         err("couldn't create shader\n");
-        return -1;
+        return 0;
     }
-    glShaderSource(shader, 1, &shaderSource, NULL);
-    glCompileShader(shader);
-    GLint compiled = 0;
+
+    GL(glShaderSource(shader, 1, &src, NULL));
+    GL(glCompileShader(shader));
+
+    return shader;
+}
+
+static bool shader_compiled(const char *name, GLuint shader)
+{
+    GLint compiled = 0, len = 0;
+    LOCAL(char, buf);
+
     glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-    if (!compiled) {
-        GLint infoLen = 0;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
-        if (infoLen) {
-            char *buf = malloc(infoLen);
-            if (buf) {
-                glGetShaderInfoLog(shader, infoLen, NULL, buf);
-                err("Could not Compile Shader %d:\n%s\n", shaderType, buf);
-                free(buf);
-                err("--> %s <--\n", shaderSource);
-            }
-            glDeleteShader(shader);
-            shader = 0;
-        }
+    if (compiled)
+        return true;
+
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
+    if (len && (buf = malloc(len))) {
+        glGetShaderInfoLog(shader, len, NULL, buf);
+        err("couldn't compile '%s' shader %d:\n%s\n", name, shader, buf);
     }
-    return shader;
+
+    return false;
 }
 
-static GLuint createProgram(const char* vertexSource, const char * fragmentSource)
+static bool shader_prog_linked(struct shader_prog *p, bool quiet)
 {
-    GLuint vertexShader = loadShader(GL_VERTEX_SHADER, vertexSource);
-    GLuint fragmentShader = loadShader(GL_FRAGMENT_SHADER, fragmentSource);
-    GLuint program = glCreateProgram();
-    GLint linkStatus = GL_FALSE;
-
-    if (!vertexShader || !fragmentShader || !program) {
-        err("vshader: %d fshader: %d program: %d\n",
-            vertexShader, fragmentShader, program);
-        return 0;
+    GLint linked = GL_FALSE, len = 0;
+    LOCAL(char, buf);
+
+    glGetProgramiv(p->prog, GL_LINK_STATUS, &linked);
+    if (linked == GL_TRUE)
+        return true;
+
+    glGetProgramiv(p->prog, GL_INFO_LOG_LENGTH, &len);
+    if (!quiet && len && (buf = malloc(len))) {
+        glGetProgramInfoLog(p->prog, len, NULL, buf);
+        err("couldn't link program '%s':\n%s\n", p->name, buf);
     }
 
-    glAttachShader(program, vertexShader);
-    glAttachShader(program, fragmentShader);
-    glLinkProgram(program);
-    glGetProgramiv(program, GL_LINK_STATUS, &linkStatus);
-    if (linkStatus != GL_TRUE) {
-        GLint bufLength = 0;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &bufLength);
-        if (bufLength) {
-            char *buf = malloc(bufLength);
-            if (buf) {
-                glGetProgramInfoLog(program, bufLength, NULL, buf);
-                err("Could not link program:\n%s\n", buf);
-                free(buf);
-            }
-        }
-        glDeleteProgram(program);
-        program = 0;
+    return false;
+}
+
+#ifndef CONFIG_BROWSER
+/*
+ * Linked program binaries, cached in the librarian cache. They only work
+ * with the same driver, so what the driver says it is is a part of the key;
+ * if a driver update doesn't change that, glProgramBinary() fails and it's
+ * compiled from the source again.
+ */
+#define SHADER_CACHE_VERSION 1
+
+static bool shader_cache_supported(void)
+{
+    static int supported = -1;
+    GLint nr_formats = 0;
+
+    if (supported < 0) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nr_formats);
+        supported = nr_formats > 0;
+    }
+
+    return supported;
+}
+
+static void shader_cache_key(char *key, const char *vsh, const char *fsh)
+{
+    const char *strs[] = {
+        vsh, fsh,
+        (const char *)glGetString(GL_VENDOR),
+        (const char *)glGetString(GL_RENDERER),
+        (const char *)glGetString(GL_VERSION),
+    };
+    SHA1_CTX ctx;
+    int i;
+
+    SHA1Init(&ctx);
+    for (i = 0; i < array_size(strs); i++)
+        if (strs[i])
+            SHA1Update(&ctx, (const unsigned char *)strs[i], strlen(strs[i]) + 1);
+    lib_cache_key(key, "shader-binary", SHADER_CACHE_VERSION, &ctx);
+}
+
+/* entry: the binary format, then the binary */
+static int shader_cache_get(struct shader_prog *p, const char *key)
+{
+    void *buf;
+    size_t size;
+    GLenum format;
+
+    if (lib_cache_get(key, &buf, &size))
+        return -ENOENT;
+
+    if (size <= sizeof(format)) {
+        free(buf);
+        return -EINVAL;
     }
-    dbg("vshader: %d fshader: %d program: %d link: %d\n",
-        vertexShader, fragmentShader, program, linkStatus);
 
-    return program;
+    memcpy(&format, buf, sizeof(format));
+    GL(glProgramBinary(p->prog, format, buf + sizeof(format), size - sizeof(format)));
+    free(buf);
+
+    return shader_prog_linked(p, true) ? 0 : -EINVAL;
+}
+
+static void shader_cache_put(struct shader_prog *p, const char *key)
+{
+    GLint len = 0;
+    GLsizei size = 0;
+    GLenum format = 0;
+    struct iovec iov[2];
+    LOCAL(char, buf);
+
+    glGetProgramiv(p->prog, GL_PROGRAM_BINARY_LENGTH, &len);
+    if (len <= 0 || !(buf = malloc(len)))
+        return;
+
+    GL(glGetProgramBinary(p->prog, len, &size, &format, buf));
+    if (!size)
+        return;
+
+    iov[0].iov_base = &format;
+    iov[0].iov_len  = sizeof(format);
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = size;
+    lib_cache_put(key, iov, array_size(iov));
 }
+#endif /* CONFIG_BROWSER */
 
 struct shader_var {
     char *name;
@@ -96,68 +209,77 @@ GLint shader_prog_find_var(struct shader_prog *p, const char *var)
     return -1;
 }
 
-static int shader_prog_scan(struct shader_prog *p, const char *txt)
+static int shader_prog_add_var(struct shader_prog *p, char *name, bool attr)
 {
-    static const char *vars[] = {"in", "uniform", "attribute"};/* "varying"? */
-    const char *pos, *pend;
     struct shader_var *v;
-    int i;
+    char *bracket;
 
-    for (i = 0; i < array_size(vars); i++) {
-        for (pos = txt;;) {
-            pos = strstr(pos, vars[i]);
-            if (!pos)
-                break;
-
-            pos += strlen(vars[i]);
-            if (!isspace(*pos))
-                continue;
-
-            /* skip the variable qualifier */
-            pos = skip_nonspace(pos);
-            /* whitespace */
-            pos = skip_space(pos);
-            /* skip the type */
-            pos = skip_nonspace(pos);
-            /* whitespace */
-            pos = skip_space(pos);
-            /* the actual variable */
-            for (pend = pos; *pend && !isspace(*pend) && *pend != ';' && *pend != '['; pend++)
-                ;
-            v = malloc(sizeof(*v));
-            if (!v)
-                return -ENOMEM;
-            v->name = strndup(pos, pend - pos);
-            switch (i) {
-                case 0:
-                case 2:
-                    v->loc = glGetAttribLocation(p->prog, v->name);
-                    break;
-                case 1:
-                    v->loc = glGetUniformLocation(p->prog, v->name);
-                    break;
-            }
-            //dbg("# found var '%s' @%d\n", v->name, v->loc);
-            v->next = p->var;
-            p->var = v;
-            pos = pend;
-        }
-    }
+    /* arrays come as "foo[0]"; they are found as "foo" */
+    bracket = strchr(name, '[');
+    if (bracket)
+        *bracket = 0;
+
+    v = malloc(sizeof(*v));
+    if (!v)
+        return -ENOMEM;
+
+    v->name = strdup(name);
+    v->loc  = attr ? glGetAttribLocation(p->prog, name) : glGetUniformLocation(p->prog, name);
+    v->next = p->var;
+    p->var  = v;
 
     return 0;
 }
 
+/* what the linker left in, as opposed to what the source mentions */
+static int shader_prog_query(struct shader_prog *p)
+{
+    GLint nr_attrs = 0, nr_uniforms = 0, attr_len = 0, uniform_len = 0, i, size;
+    LOCAL(char, name);
+    GLsizei len;
+    GLenum type;
+    int ret = 0;
+
+    glGetProgramiv(p->prog, GL_ACTIVE_ATTRIBUTES, &nr_attrs);
+    glGetProgramiv(p->prog, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &attr_len);
+    glGetProgramiv(p->prog, GL_ACTIVE_UNIFORMS, &nr_uniforms);
+    glGetProgramiv(p->prog, GL_ACTIVE_UNIFORM_MAX_LENGTH, &uniform_len);
+
+    name = malloc(max(attr_len, uniform_len) + 1);
+    if (!name)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_attrs && !ret; i++) {
+        glGetActiveAttrib(p->prog, i, attr_len + 1, &len, &size, &type, name);
+        ret = shader_prog_add_var(p, name, true);
+    }
+
+    for (i = 0; i < nr_uniforms && !ret; i++) {
+        glGetActiveUniform(p->prog, i, uniform_len + 1, &len, &size, &type, name);
+        ret = shader_prog_add_var(p, name, false);
+    }
+
+    return ret;
+}
+
 static void shader_prog_drop(struct ref *ref)
 {
     struct shader_prog *p = container_of(ref, struct shader_prog, ref);
 
     dbg("dropping shader '%s'\n", p->name);
+    free((void *)p->name);
 }
 
 DECLARE_REFCLASS(shader_prog);
 
 static void shader_prog_link(struct shader_prog *p)
 {
+    GLuint frame = glGetUniformBlockIndex(p->prog, "frame");
+
+    /* its members don't have locations, so the below are -1 for those */
+    if (frame != GL_INVALID_INDEX)
+        GL(glUniformBlockBinding(p->prog, frame, RENDER_FRAME_BINDING));
+
     p->data.width        = shader_prog_find_var(p, "width");
     p->data.height       = shader_prog_find_var(p, "height");
     p->data.projmx       = shader_prog_find_var(p, "proj");
@@ -174,58 +296,149 @@ static void shader_prog_link(struct shader_prog *p)
     p->data.colorpt      = shader_prog_find_var(p, "color_passthrough");
     p->data.use_normals  = shader_prog_find_var(p, "use_normals");
     p->data.use_skinning  = shader_prog_find_var(p, "use_skinning");
-    p->data.joint_transforms = shader_prog_find_var(p, "joint_transforms");
+    p->data.joint_tex    = shader_prog_find_var(p, "joint_tex");
+    p->data.joint_off    = shader_prog_find_var(p, "joint_off");
+    p->data.joint_rows   = shader_prog_find_var(p, "joint_rows");
+    p->data.use_instancing = shader_prog_find_var(p, "use_instancing");
+    p->data.use_batching = shader_prog_find_var(p, "use_batching");
+    p->data.pos_scale    = shader_prog_find_var(p, "pos_scale");
+    p->data.pos_offset   = shader_prog_find_var(p, "pos_offset");
+    p->data.depth_only   = shader_prog_find_var(p, "depth_only");
+    p->data.tex_layer    = shader_prog_find_var(p, "tex_layer");
+    p->data.use_height_map = shader_prog_find_var(p, "use_height_map");
+    p->data.height_map   = shader_prog_find_var(p, "height_map");
+    p->data.height_map_rect = shader_prog_find_var(p, "height_map_rect");
 }
 
-struct shader_prog *
-shader_prog_from_strings(const char *name, const char *vsh, const char *fsh)
+/* start compiling and linking, or loading the binary if it's in the cache */
+static struct shader_prog *shader_prog_begin(const char *name, const char *vsh, const char *fsh)
 {
+    struct shader_build *b;
     struct shader_prog *p;
 
+    shader_compile_init();
+
     p = ref_new(shader_prog);
     if (!p)
         return NULL;
 
-    p->name = name;
-    p->prog = createProgram(vsh, fsh);
-    if (!p->prog) {
+    b = calloc(1, sizeof(*b));
+    p->name = strdup(name);
+    p->prog = glCreateProgram();
+    if (!b || !p->name || !p->prog) {
         err("couldn't create program '%s'\n", name);
-        free(p);
+        free(b);
+        ref_put_last(p);
         return NULL;
     }
 
-    shader_prog_use(p);
-    shader_prog_scan(p, vsh);
-    shader_prog_scan(p, fsh);
-    shader_prog_done(p);
-    p->pos         = shader_prog_find_var(p, "position");
-    p->norm        = shader_prog_find_var(p, "normal");
-    p->tex         = shader_prog_find_var(p, "tex");
-    p->tangent     = shader_prog_find_var(p, "tangent");
-    p->texture_map = shader_prog_find_var(p, "model_tex");
-    p->normal_map  = shader_prog_find_var(p, "normal_map");
-    p->joints      = shader_prog_find_var(p, "joints");
-    p->weights     = shader_prog_find_var(p, "weights");
-    dbg("model '%s' %d/%d/%d/%d/%d/%d/%d/%d\n",
-        p->name, p->pos, p->norm, p->tex, p->tangent,
-        p->texture_map, p->normal_map, p->joints, p->weights);
-    if (p->pos < 0) {
+    p->build = b;
+#ifndef CONFIG_BROWSER
+    if (shader_cache_supported()) {
+        shader_cache_key(b->key, vsh, fsh);
+        if (!shader_cache_get(p, b->key)) {
+            b->key[0] = 0;
+            return p;
+        }
+
+        GL(glProgramParameteri(p->prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+    }
+#endif
+
+    b->vsh = shader_compile(GL_VERTEX_SHADER, vsh);
+    b->fsh = shader_compile(GL_FRAGMENT_SHADER, fsh);
+    if (b->vsh)
+        GL(glAttachShader(p->prog, b->vsh));
+    if (b->fsh)
+        GL(glAttachShader(p->prog, b->fsh));
+    GL(glLinkProgram(p->prog));
+
+    return p;
+}
+
+/* wait for the link and look up the attributes and uniforms */
+static int shader_prog_finish(struct shader_prog *p)
+{
+    struct shader_build *b = p->build;
+    bool linked = true;
+
+    if (!b)
+        return p->prog ? 0 : -EINVAL;
+
+    p->build = NULL;
+    if (b->vsh || b->fsh) {
+        /* a compile error makes for a link error too, but is more to the point */
+        linked = b->vsh && b->fsh &&
+                 shader_compiled(p->name, b->vsh) && shader_compiled(p->name, b->fsh) &&
+                 shader_prog_linked(p, false);
+        if (b->vsh)
+            glDeleteShader(b->vsh);
+        if (b->fsh)
+            glDeleteShader(b->fsh);
+#ifndef CONFIG_BROWSER
+        if (linked && b->key[0])
+            shader_cache_put(p, b->key);
+#endif
+    }
+    free(b);
+
+    if (linked) {
+        shader_prog_use(p);
+        shader_prog_query(p);
         shader_prog_done(p);
-	return NULL;
+
+        p->pos         = shader_prog_find_var(p, "position");
+        p->norm        = shader_prog_find_var(p, "normal");
+        p->tex         = shader_prog_find_var(p, "tex");
+        p->tangent     = shader_prog_find_var(p, "tangent");
+        p->texture_map = shader_prog_find_var(p, "model_tex");
+        p->normal_map  = shader_prog_find_var(p, "normal_map");
+        p->joints      = shader_prog_find_var(p, "joints");
+        p->weights     = shader_prog_find_var(p, "weights");
+        p->instance_trans = shader_prog_find_var(p, "instance_trans");
+        p->instance_joint_off = shader_prog_find_var(p, "instance_joint_off");
+        p->instance_layer = shader_prog_find_var(p, "instance_layer");
+        p->batch_color = shader_prog_find_var(p, "batch_color");
+        p->batch_color_pt = shader_prog_find_var(p, "batch_color_pt");
+        dbg("model '%s' %d/%d/%d/%d/%d/%d/%d/%d\n",
+            p->name, p->pos, p->norm, p->tex, p->tangent,
+            p->texture_map, p->normal_map, p->joints, p->weights);
+    }
+
+    if (!linked) {
+        err("couldn't create program '%s'\n", p->name);
+        render_delete_program(p->prog);
+        p->prog = 0;
+        return -EINVAL;
     }
+
     shader_prog_link(p);
+
+    return 0;
+}
+
+struct shader_prog *
+shader_prog_from_strings(const char *name, const char *vsh, const char *fsh)
+{
+    struct shader_prog *p = shader_prog_begin(name, vsh, fsh);
+
+    if (p && shader_prog_finish(p)) {
+        ref_put_last(p);
+        return NULL;
+    }
+
     return p;
 }
 
 void shader_prog_use(struct shader_prog *p)
 {
     ref_get(p);
-    glUseProgram(p->prog);
+    render_use_program(p->prog);
 }
 
 void shader_prog_done(struct shader_prog *p)
 {
-    glUseProgram(0);
+    render_use_program(0);
     ref_put(p);
 }
 
@@ -233,7 +446,7 @@ struct shader_prog *shader_prog_find(struct shader_prog *prog, const char *name)
 {
     for (; prog; prog = prog->next)
         if (!strcmp(prog->name, name))
-            return ref_get(prog);
+            return shader_prog_finish(prog) ? NULL : ref_get(prog);
 
     return NULL;
 }
@@ -257,14 +470,84 @@ int lib_request_shaders(const char *name, struct shader_prog **progp)
     if (!hv || !hf || hv->state == RES_ERROR || hf->state == RES_ERROR)
         return -1;
 
-    p = shader_prog_from_strings(name, vert, frag);
+    /* finished by the first shader_prog_find(), while the others compile */
+    p = shader_prog_begin(name, vert, frag);
+    ref_put_last(hv);
+    ref_put_last(hf);
     if (!p)
         return -1;
 
     p->next = *progp;
     *progp = p;
-    ref_put_last(hv);
-    ref_put_last(hf);
 
     return 0;
 }
+
+/* the suffixes of the variants' names, in the order of enum shader_feature */
+static const char *shader_feature_names[] = { "skinning", "normals", "highlight", "alpha",
+                                              "layers" };
+
+static char *shader_variant_name(const char *name, unsigned int features)
+{
+    size_t len = strlen(name) + 1;
+    unsigned int f;
+    char *vname;
+
+    for (f = 0; f < array_size(shader_feature_names); f++)
+        if (features & (1u << f))
+            len += strlen(shader_feature_names[f]) + 1;
+
+    vname = malloc(len);
+    if (!vname)
+        return NULL;
+
+    strcpy(vname, name);
+    for (f = 0; f < array_size(shader_feature_names); f++)
+        if (features & (1u << f)) {
+            strcat(vname, "+");
+            strcat(vname, shader_feature_names[f]);
+        }
+
+    return vname;
+}
+
+int lib_request_shader_variants(const char *name, unsigned int features,
+                                struct shader_prog **progp)
+{
+    unsigned int variant;
+    char *vname;
+    int ret = 0;
+
+    for (variant = 1; variant < (1u << array_size(shader_feature_names)); variant++) {
+        if ((variant & features) != variant)
+            continue;
+
+        vname = shader_variant_name(name, variant);
+        if (!vname)
+            return -ENOMEM;
+
+        if (lib_request_shaders(vname, progp))
+            ret = -1;
+        else
+            (*progp)->features = variant;
+        free(vname);
+    }
+
+    return ret;
+}
+
+struct shader_prog *shader_prog_find_variant(struct shader_prog *prog, const char *name,
+                                             unsigned int features)
+{
+    struct shader_prog *p = NULL;
+    char *vname;
+
+    if (features) {
+        vname = shader_variant_name(name, features);
+        if (vname)
+            p = shader_prog_find(prog, vname);
+        free(vname);
+    }
+
+    return p ? p : shader_prog_find(prog, name);
+}
@@ -10,10 +10,16 @@ struct shader_data {
     GLint viewmx, transmx, lightp, lightc, projmx;
     GLint inv_viewmx, shine_damper, reflectivity;
     GLint highlight, color, ray, colorpt, use_normals;
-    GLint use_skinning, joint_transforms, width, height;
+    GLint use_skinning, joint_tex, joint_off, joint_rows, width, height;
+    GLint use_instancing, use_batching;
+    GLint pos_scale, pos_offset;
+    GLint depth_only;
+    GLint tex_layer;
+    GLint use_height_map, height_map, height_map_rect;
 };
 
 struct shader_var;
+struct shader_build;
 struct shader_prog {
     const char  *name;
     GLuint      prog;
@@ -25,18 +31,56 @@ struct shader_prog {
     GLint       joints;
     GLint       weights;
     GLint       tex;
+    GLint       instance_trans;
+    GLint       instance_joint_off;
+    GLint       instance_layer;
+    GLint       batch_color;
+    GLint       batch_color_pt;
     struct ref  ref;
     struct shader_var *var;
+    struct shader_build *build;
     struct shader_data data;
+    /* enum shader_feature, of the variants, see lib_request_shader_variants() */
+    unsigned int features;
     struct shader_prog *next;
 };
 
+/*
+ * Variants of a program with features compiled in (or out) instead of the
+ * use_skinning/use_normals/highlight_color uniforms: "model+skinning+normals"
+ * is what compile-time/preprocess_shaders -p skinning,normals makes of
+ * "model", in this order. Those without a feature don't have its uniforms,
+ * which is how the draws know not to upload them.
+ */
+enum shader_feature {
+    SHADER_SKINNING     = 1 << 0,
+    SHADER_NORMALS      = 1 << 1,
+    SHADER_HIGHLIGHT    = 1 << 2,
+    SHADER_ALPHA        = 1 << 3,
+    /* sampler2DArray textures, see model3d_texture_layers() */
+    SHADER_LAYERS       = 1 << 4,
+};
+
+#ifndef CONFIG_FINAL
+/* the focus highlight is a debugging aid */
+#define SHADER_DEFAULT_FEATURES SHADER_HIGHLIGHT
+#else
+#define SHADER_DEFAULT_FEATURES 0
+#endif
+
 struct shader_prog *
 shader_prog_from_strings(const char *name, const char *vsh, const char *fsh);
 GLint shader_prog_find_var(struct shader_prog *p, const char *var);
 void shader_prog_use(struct shader_prog *p);
 void shader_prog_done(struct shader_prog *p);
+/* the first lookup waits for the compilation that lib_request_shaders() started */
 struct shader_prog *shader_prog_find(struct shader_prog *prog, const char *name);
 int lib_request_shaders(const char *name, struct shader_prog **progp);
+/* every variant of @name with some of the @features, but not @name itself */
+int lib_request_shader_variants(const char *name, unsigned int features,
+                                struct shader_prog **progp);
+/* the variant with exactly @features, or @name itself if there isn't one */
+struct shader_prog *shader_prog_find_variant(struct shader_prog *prog, const char *name,
+                                             unsigned int features);
 
 #endif /* __CLAP_SHADER_H__ */
@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "snapshot.h"
+#include "util.h"
+
+static inline uint16_t quantize_pos(float v)
+{
+    return (int16_t)clampf(roundf(v * SNAPSHOT_POS_SCALE), INT16_MIN, INT16_MAX);
+}
+
+void snapshot_entity_pack(struct snapshot_entity *se, uint16_t id, const float *pos, float yaw,
+                          int animation, unsigned long frame, unsigned int kind)
+{
+    int i;
+
+    se->id = id;
+    for (i = 0; i < 3; i++)
+        se->fields[SNAPSHOT_X + i] = quantize_pos(pos[i]);
+
+    yaw = fmodf(yaw, 360);
+    if (yaw < 0)
+        yaw += 360;
+    se->fields[SNAPSHOT_YAW]       = (uint16_t)lroundf(yaw * 65536 / 360);
+    se->fields[SNAPSHOT_ANIMATION] = animation < 0 ? SNAPSHOT_NO_ANIMATION : animation;
+    se->fields[SNAPSHOT_FRAME]     = frame;
+    se->fields[SNAPSHOT_KIND]      = kind;
+}
+
+void snapshot_entity_unpack(const struct snapshot_entity *se, float *pos, float *yaw,
+                            int *animation, unsigned long *frame, unsigned int *kind)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        pos[i] = (float)(int16_t)se->fields[SNAPSHOT_X + i] / SNAPSHOT_POS_SCALE;
+
+    *yaw       = (float)se->fields[SNAPSHOT_YAW] * 360 / 65536;
+    *animation = se->fields[SNAPSHOT_ANIMATION] == SNAPSHOT_NO_ANIMATION ?
+                 -1 : se->fields[SNAPSHOT_ANIMATION];
+    *frame     = se->fields[SNAPSHOT_FRAME];
+    *kind      = se->fields[SNAPSHOT_KIND];
+}
+
+/* where @id is or would go */
+static unsigned int snapshot_lookup(const struct snapshot *snap, uint16_t id)
+{
+    unsigned int lo = 0, hi = snap->nr_ents, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (snap->ents[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* like strchr(), the caller knows if it can write to it */
+struct snapshot_entity *snapshot_find(const struct snapshot *snap, uint16_t id)
+{
+    unsigned int i = snapshot_lookup(snap, id);
+
+    return i < snap->nr_ents && snap->ents[i].id == id ? (void *)&snap->ents[i] : NULL;
+}
+
+int snapshot_add(struct snapshot *snap, const struct snapshot_entity *se)
+{
+    unsigned int i = snapshot_lookup(snap, se->id);
+
+    if (i < snap->nr_ents && snap->ents[i].id == se->id)
+        return -EEXIST;
+
+    if (snap->nr_ents == SNAPSHOT_MAX_ENTITIES)
+        return -ENOSPC;
+
+    memmove(&snap->ents[i + 1], &snap->ents[i], (snap->nr_ents - i) * sizeof(*se));
+    snap->ents[i] = *se;
+    snap->nr_ents++;
+
+    return 0;
+}
+
+static void snapshot_remove(struct snapshot *snap, uint16_t id)
+{
+    unsigned int i = snapshot_lookup(snap, id);
+
+    if (i == snap->nr_ents || snap->ents[i].id != id)
+        return;
+
+    snap->nr_ents--;
+    memmove(&snap->ents[i], &snap->ents[i + 1], (snap->nr_ents - i) * sizeof(snap->ents[0]));
+}
+
+void snapshot_filter(struct snapshot *out, const struct snapshot *in, const float *center,
+                     float radius)
+{
+    float r2 = radius * radius, d, d2;
+    unsigned int i, j;
+
+    out->seq = in->seq;
+    out->input_seq = in->input_seq;
+    out->self = in->self;
+    out->nr_ents = 0;
+    for (i = 0; i < in->nr_ents; i++) {
+        for (j = 0, d2 = 0; j < 3; j++) {
+            d = (float)(int16_t)in->ents[i].fields[SNAPSHOT_X + j] / SNAPSHOT_POS_SCALE - center[j];
+            d2 += d * d;
+        }
+
+        /* sorted in, sorted out */
+        if (d2 <= r2)
+            out->ents[out->nr_ents++] = in->ents[i];
+    }
+}
+
+void snapshot_history_add(struct snapshot_history *h, const struct snapshot *snap)
+{
+    unsigned int slot = snap->seq % SNAPSHOT_HISTORY;
+
+    h->snaps[slot] = *snap;
+    h->valid |= 1u << slot;
+}
+
+struct snapshot *snapshot_history_find(struct snapshot_history *h, uint16_t seq)
+{
+    unsigned int slot = seq % SNAPSHOT_HISTORY;
+
+    if (!(h->valid & (1u << slot)) || h->snaps[slot].seq != seq)
+        return NULL;
+
+    return &h->snaps[slot];
+}
+
+static inline uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    *p++ = v;
+    *p++ = v >> 8;
+    return p;
+}
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint8_t *snapshot_encode_entity(uint8_t *p, const struct snapshot_entity *se,
+                                       const struct snapshot_entity *base)
+{
+    static const struct snapshot_entity zero;
+    unsigned int mask = 0, i;
+    uint8_t *pmask;
+
+    if (!base)
+        base = &zero;
+
+    for (i = 0; i < SNAPSHOT_NR_FIELDS; i++)
+        if (se->fields[i] != base->fields[i])
+            mask |= 1u << i;
+
+    /* a new one that's all zeroes still needs to be there */
+    if (!mask && base != &zero)
+        return p;
+
+    p = put16(p, se->id);
+    pmask = p++;
+    *pmask = mask;
+    for (i = 0; i < SNAPSHOT_NR_FIELDS; i++)
+        if (mask & (1u << i))
+            p = put16(p, se->fields[i]);
+
+    return p;
+}
+
+size_t snapshot_encode(uint8_t *buf, const struct snapshot *snap, const struct snapshot *base)
+{
+    static const struct snapshot empty;
+    unsigned int i = 0, j = 0, nr_removed = 0, nr_changed = 0;
+    uint8_t *p = buf, *counts, *next;
+
+    *p++ = base ? 0 : SNAPSHOT_FULL;
+    p = put16(p, snap->seq);
+    p = put16(p, snap->input_seq);
+    p = put16(p, snap->self);
+    if (base)
+        p = put16(p, base->seq);
+    else
+        base = &empty;
+
+    counts = p;
+    p += 2;
+
+    /* both sorted: what's only in @base is gone */
+    for (i = 0, j = 0; j < base->nr_ents; j++) {
+        while (i < snap->nr_ents && snap->ents[i].id < base->ents[j].id)
+            i++;
+        if (i == snap->nr_ents || snap->ents[i].id != base->ents[j].id) {
+            p = put16(p, base->ents[j].id);
+            nr_removed++;
+        }
+    }
+
+    for (i = 0, j = 0; i < snap->nr_ents; i++) {
+        while (j < base->nr_ents && base->ents[j].id < snap->ents[i].id)
+            j++;
+        next = snapshot_encode_entity(p, &snap->ents[i],
+                                      j < base->nr_ents && base->ents[j].id == snap->ents[i].id ?
+                                      &base->ents[j] : NULL);
+        nr_changed += next != p;
+        p = next;
+    }
+
+    counts[0] = nr_removed;
+    counts[1] = nr_changed;
+
+    return p - buf;
+}
+
+ssize_t snapshot_size(const uint8_t *buf, size_t size)
+{
+    size_t len = 1 + 3 * sizeof(uint16_t);
+    unsigned int nr_changed, i;
+
+    if (size < len)
+        return -EAGAIN;
+
+    if (!(buf[0] & SNAPSHOT_FULL))
+        len += sizeof(uint16_t);
+
+    if (size < len + 2)
+        return -EAGAIN;
+
+    nr_changed = buf[len + 1];
+    len += 2 + buf[len] * sizeof(uint16_t);
+
+    for (i = 0; i < nr_changed; i++) {
+        if (size < len + sizeof(uint16_t) + 1)
+            return -EAGAIN;
+        len += sizeof(uint16_t) + 1 +
+               __builtin_popcount(buf[len + sizeof(uint16_t)] & ((1u << SNAPSHOT_NR_FIELDS) - 1)) *
+               sizeof(uint16_t);
+    }
+
+    return size < len ? -EAGAIN : len;
+}
+
+ssize_t snapshot_decode(const uint8_t *buf, size_t size, struct snapshot *snap,
+                        struct snapshot_history *h)
+{
+    unsigned int nr_removed, nr_changed, mask, i, f;
+    struct snapshot_entity se, *pse;
+    const uint8_t *p = buf + 1;
+    struct snapshot *base;
+    ssize_t len;
+
+    len = snapshot_size(buf, size);
+    if (len < 0)
+        return len;
+
+    snap->nr_ents = 0;
+    snap->seq = get16(p);
+    snap->input_seq = get16(p + sizeof(uint16_t));
+    snap->self = get16(p + 2 * sizeof(uint16_t));
+    p += 3 * sizeof(uint16_t);
+
+    if (!(buf[0] & SNAPSHOT_FULL)) {
+        base = snapshot_history_find(h, get16(p));
+        if (!base)
+            return -ENOENT;
+
+        snap->nr_ents = base->nr_ents;
+        memcpy(snap->ents, base->ents, base->nr_ents * sizeof(snap->ents[0]));
+        p += sizeof(uint16_t);
+    }
+
+    nr_removed = *p++;
+    nr_changed = *p++;
+    for (i = 0; i < nr_removed; i++, p += sizeof(uint16_t))
+        snapshot_remove(snap, get16(p));
+
+    for (i = 0; i < nr_changed; i++) {
+        memset(&se, 0, sizeof(se));
+        se.id = get16(p);
+        pse = snapshot_find(snap, se.id);
+        if (!pse) {
+            if (snapshot_add(snap, &se))
+                return -EINVAL;
+            pse = snapshot_find(snap, se.id);
+        }
+
+        mask = p[sizeof(uint16_t)];
+        p += sizeof(uint16_t) + 1;
+        for (f = 0; f < SNAPSHOT_NR_FIELDS; f++)
+            if (mask & (1u << f)) {
+                pse->fields[f] = get16(p);
+                p += sizeof(uint16_t);
+            }
+    }
+
+    snapshot_history_add(h, snap);
+
+    return len;
+}
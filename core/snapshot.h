@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_SNAPSHOT_H__
+#define __CLAP_SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * World state for replicating from the server: entities by their @id,
+ * each a few quantized fields: position in 1/SNAPSHOT_POS_SCALE steps,
+ * clamped to int16_t, yaw in 1/65536 of a turn, the animation (0xffff
+ * for none), its frame and what kind of thing it is.
+ *
+ * Like the input states (input-delta.h), a snapshot goes out as a delta
+ * against one that the client has acknowledged, or in full:
+ *
+ *   u8  flags        SNAPSHOT_FULL
+ *   u16 seq
+ *   u16 input_seq    the receiver's last input that went into it
+ *   u16 self         the receiver's own entity, SNAPSHOT_NO_ENTITY if none
+ *   u16 base         unless SNAPSHOT_FULL
+ *   u8  nr_removed
+ *   u8  nr_changed
+ *   u16 removed[]    ids that aren't there any more
+ *   changed[]:
+ *     u16 id
+ *     u8  mask       which fields follow, new ones are against zeroes
+ *     u16 fields[]
+ *
+ * all little endian. Entities that didn't change cost nothing.
+ */
+enum snapshot_field {
+    SNAPSHOT_X = 0,
+    SNAPSHOT_Y,
+    SNAPSHOT_Z,
+    SNAPSHOT_YAW,
+    SNAPSHOT_ANIMATION,
+    SNAPSHOT_FRAME,
+    SNAPSHOT_KIND,
+    SNAPSHOT_NR_FIELDS,
+};
+
+#define SNAPSHOT_POS_SCALE      32
+#define SNAPSHOT_NO_ANIMATION   0xffff
+#define SNAPSHOT_NO_ENTITY      0xffff
+/* per client, after the interest filter; fits the u8 counts */
+#define SNAPSHOT_MAX_ENTITIES   64
+#define SNAPSHOT_FULL           (1u << 0)
+
+struct snapshot_entity {
+    uint16_t    id;
+    uint16_t    fields[SNAPSHOT_NR_FIELDS];
+};
+
+/* @ents are sorted by id */
+struct snapshot {
+    uint16_t                seq;
+    uint16_t                input_seq;
+    uint16_t                self;
+    unsigned int            nr_ents;
+    struct snapshot_entity  ents[SNAPSHOT_MAX_ENTITIES];
+};
+
+#define SNAPSHOT_DELTA_MAX \
+    (1 + 4 * sizeof(uint16_t) + 2 + SNAPSHOT_MAX_ENTITIES * sizeof(uint16_t) + \
+     SNAPSHOT_MAX_ENTITIES * (sizeof(uint16_t) + 1 + SNAPSHOT_NR_FIELDS * sizeof(uint16_t)))
+
+/* power of 2 */
+#define SNAPSHOT_HISTORY 32
+
+/* the last SNAPSHOT_HISTORY snapshots sent or received, by their @seq */
+struct snapshot_history {
+    struct snapshot     snaps[SNAPSHOT_HISTORY];
+    uint32_t            valid;
+};
+
+void snapshot_entity_pack(struct snapshot_entity *se, uint16_t id, const float *pos, float yaw,
+                          int animation, unsigned long frame, unsigned int kind);
+/* -1 for no animation */
+void snapshot_entity_unpack(const struct snapshot_entity *se, float *pos, float *yaw,
+                            int *animation, unsigned long *frame, unsigned int *kind);
+
+/* -ENOSPC if it's full, -EEXIST if @se->id is already there */
+int snapshot_add(struct snapshot *snap, const struct snapshot_entity *se);
+struct snapshot_entity *snapshot_find(const struct snapshot *snap, uint16_t id);
+/* interest management: what of @in is within @radius of @center */
+void snapshot_filter(struct snapshot *out, const struct snapshot *in, const float *center,
+                     float radius);
+
+void snapshot_history_add(struct snapshot_history *h, const struct snapshot *snap);
+struct snapshot *snapshot_history_find(struct snapshot_history *h, uint16_t seq);
+
+/* @base NULL: encode in full; returns the size, @buf is SNAPSHOT_DELTA_MAX */
+size_t snapshot_encode(uint8_t *buf, const struct snapshot *snap, const struct snapshot *base);
+/* size of the encoded delta at @buf, -EAGAIN if it's not all there */
+ssize_t snapshot_size(const uint8_t *buf, size_t size);
+/*
+ * Decode a delta against its base from @h and add the result to @h;
+ * returns the size consumed, -EAGAIN if it's short, -ENOENT if the base
+ * is not in @h, -EINVAL if it doesn't make sense (snapshot_size() tells
+ * how much to skip either way)
+ */
+ssize_t snapshot_decode(const uint8_t *buf, size_t size, struct snapshot *snap,
+                        struct snapshot_history *h);
+
+#endif /* __CLAP_SNAPSHOT_H__ */
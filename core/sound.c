@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <math.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -32,44 +34,154 @@ ALuint  environment[NUM_ENVIRONMENTS];
 
 static DECLARE_LIST(sounds);
 
+/*
+ * Sounds loaded from the same file share one buffer: it's the decoded PCM,
+ * which a UI click or a footstep has no business having more than one of.
+ * Streaming sounds have their own decoder instead.
+ */
+struct sound_buffer {
+    struct ref      ref;
+    struct list     entry;
+    char            *name;
+    ALuint          id;
+};
+
+static DECLARE_LIST(sound_buffers);
+
+static void sound_buffer_drop(struct ref *ref)
+{
+    struct sound_buffer *sb = container_of(ref, struct sound_buffer, ref);
+
+    list_del(&sb->entry);
+    alDeleteBuffers(1, &sb->id);
+    free(sb->name);
+}
+DECLARE_REFCLASS(sound_buffer);
+
+static struct sound_buffer *sound_buffer_get(const char *name)
+{
+    struct sound_buffer *sb;
+
+    list_for_each_entry(sb, &sound_buffers, entry)
+        if (!strcmp(sb->name, name))
+            return ref_get(sb);
+
+    return NULL;
+}
+
+/*
+ * Voices: a fixed pool of sources that all the non-streaming sounds play
+ * on, so a sound can overlap itself. A sound plays on up to max_voices at
+ * once, past that its oldest one starts over. With all the voices busy,
+ * it takes over the oldest one of the lowest priority that isn't higher
+ * than its own, or doesn't play. A 3D sound that's quieter than
+ * SOUND_GAIN_MIN at its distance from the listener doesn't take a voice.
+ */
+#define SOUND_VOICES        32
+#define SOUND_MAX_VOICES    4
+#define SOUND_GAIN_MIN      0.01
+
+struct voice {
+    ALuint          source;
+    struct sound    *sound;
+    unsigned long   started;
+};
+
+static struct voice voices[SOUND_VOICES];
+static unsigned int nr_voices;
+static unsigned long voice_seq;
+
+static bool voice_busy(struct voice *v)
+{
+    ALint state;
+
+    if (!v->sound)
+        return false;
+
+    alGetSourcei(v->source, AL_SOURCE_STATE, &state);
+    if (state == AL_PLAYING || state == AL_PAUSED)
+        return true;
+
+    v->sound = NULL;
+    return false;
+}
+
+static struct voice *voice_get(struct sound *sound)
+{
+    struct voice *v, *own = NULL, *idle = NULL, *victim = NULL;
+    unsigned int i, nr_own = 0;
+
+    for (i = 0; i < nr_voices; i++) {
+        v = &voices[i];
+        if (!voice_busy(v)) {
+            if (!idle)
+                idle = v;
+        } else if (v->sound == sound) {
+            nr_own++;
+            if (!own || v->started < own->started)
+                own = v;
+        } else if (v->sound->priority <= sound->priority) {
+            if (!victim || v->sound->priority < victim->sound->priority ||
+                (v->sound->priority == victim->sound->priority && v->started < victim->started))
+                victim = v;
+        }
+    }
+
+    if (nr_own >= sound->max_voices)
+        return own;
+
+    return idle ? : victim;
+}
+
+/* the default AL_INVERSE_DISTANCE_CLAMPED, reference distance 1, rolloff 1 */
+static float sound_distance_gain(const float *pos)
+{
+    float d = 0;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        d += (pos[i] - listenerPos[i]) * (pos[i] - listenerPos[i]);
+
+    d = sqrtf(d);
+    return d > 1 ? 1 / d : 1;
+}
+
 /* ffmpeg -i asset/morning.wav -codec:a libvorbis -ar 44100 asset/morning.ogg */
 
+/*
+ * Music: long enough that decoding all of it upfront takes seconds and tens
+ * of MB. Anything over SOUND_STREAM_MIN of PCM is decoded as it plays
+ * instead: SOUND_STREAM_BUFFERS buffers of SOUND_STREAM_CHUNK bytes are
+ * queued on its source, and refilled in sound_update() as the source is
+ * done with them. Looping is the decoder's business then, AL_LOOPING would
+ * loop the queue.
+ */
+#define SOUND_STREAM_MIN        (1024 * 1024)
+#define SOUND_STREAM_BUFFERS    4
+#define SOUND_STREAM_CHUNK      (64 * 1024)
+
+struct sound_stream {
+    OggVorbis_File  vf;
+    FILE            *f;
+    ALuint          buffers[SOUND_STREAM_BUFFERS];
+    char            chunk[SOUND_STREAM_CHUNK];
+    bool            looping;
+    bool            playing;
+};
+
 /* Non-stdio load: https://xiph.org/vorbis/doc/vorbisfile/callbacks.html */
 #define BUFSZ (4096*1024)
-static int parse_ogg(struct sound *sound, const char *uri)
+static int ogg_decode(struct sound *sound, OggVorbis_File *vf)
 {
     int eof = 0, current_section;
     long ret, offset = 0, bufsz = 0;
-    OggVorbis_File vf;
-    vorbis_info *vi;
-    LOCAL(FILE, f);
-    char **ptr;
-
-    CHECK(f = fopen(uri, "r"));
-    if (ov_open_callbacks(f, &vf, NULL, 0, OV_CALLBACKS_NOCLOSE) < 0) {
-        err("can't open '%s'\n", uri);
-        return -1;
-    }
-    
-    ptr = ov_comment(&vf, -1)->user_comments;
-    vi = ov_info(&vf,-1);
-    while (*ptr) {
-        dbg(" => %s\n", *ptr);
-        ++ptr;
-    }
-
-    dbg("bitstream is %d channel, %ldHz\n", vi->channels, vi->rate);
-    dbg("Encoded by: %s\n", ov_comment(&vf,-1)->vendor);
 
-    sound->nr_channels = vi->channels;
-    sound->freq = vi->rate;
-    sound->format = AL_FORMAT_STEREO16; /* XXX */
     while (!eof) {
         if (!bufsz) {
             bufsz = BUFSZ;
             sound->buf = realloc(sound->buf, sound->size + BUFSZ);
         }
-        ret = ov_read(&vf, (char *)sound->buf + offset, bufsz, 0, 2, 1, &current_section);
+        ret = ov_read(vf, (char *)sound->buf + offset, bufsz, 0, 2, 1, &current_section);
         sound->size += ret;
         offset += ret;
         bufsz -= ret;
@@ -82,7 +194,147 @@ static int parse_ogg(struct sound *sound, const char *uri)
                  sound->size, sound->freq);
     free(sound->buf);
     sound->buf = NULL;
-    ov_clear(&vf);
+
+    return 0;
+}
+
+/* the next chunk into @buffer; 0 at the end, unless it's looping */
+static long sound_stream_fill(struct sound *sound, ALuint buffer)
+{
+    struct sound_stream *st = sound->stream;
+    int current_section;
+    long ret, size = 0;
+    bool rewound = false;
+
+    while (size < SOUND_STREAM_CHUNK) {
+        ret = ov_read(&st->vf, st->chunk + size, SOUND_STREAM_CHUNK - size, 0, 2, 1,
+                      &current_section);
+        if (ret < 0)
+            break;
+        if (ret > 0) {
+            size += ret;
+            rewound = false;
+            continue;
+        }
+        /* twice in a row means there's nothing in it */
+        if (!st->looping || rewound || ov_pcm_seek(&st->vf, 0))
+            break;
+        rewound = true;
+    }
+
+    if (size)
+        alBufferData(buffer, sound->format, st->chunk, size, sound->freq);
+
+    return size;
+}
+
+/* from the top, with all the buffers queued */
+static void sound_stream_start(struct sound *sound)
+{
+    struct sound_stream *st = sound->stream;
+    int i;
+
+    alSourceStop(sound->source_idx);
+    /* unqueues everything */
+    alSourcei(sound->source_idx, AL_BUFFER, 0);
+    ov_pcm_seek(&st->vf, 0);
+
+    for (i = 0; i < SOUND_STREAM_BUFFERS; i++)
+        if (sound_stream_fill(sound, st->buffers[i]) > 0)
+            alSourceQueueBuffers(sound->source_idx, 1, &st->buffers[i]);
+}
+
+static void sound_stream_update(struct sound *sound)
+{
+    struct sound_stream *st = sound->stream;
+    ALint processed = 0, queued = 0, state;
+    ALuint buffer;
+
+    if (!st->playing)
+        return;
+
+    alGetSourcei(sound->source_idx, AL_BUFFERS_PROCESSED, &processed);
+    while (processed-- > 0) {
+        alSourceUnqueueBuffers(sound->source_idx, 1, &buffer);
+        if (sound_stream_fill(sound, buffer) > 0)
+            alSourceQueueBuffers(sound->source_idx, 1, &buffer);
+    }
+
+    alGetSourcei(sound->source_idx, AL_BUFFERS_QUEUED, &queued);
+    if (!queued) {
+        /* played to the end */
+        st->playing = false;
+        return;
+    }
+
+    /* if it ran dry before the refill, the source stopped */
+    alGetSourcei(sound->source_idx, AL_SOURCE_STATE, &state);
+    if (state != AL_PLAYING)
+        alSourcePlay(sound->source_idx);
+}
+
+static void sound_stream_done(struct sound *sound)
+{
+    struct sound_stream *st = sound->stream;
+
+    alSourceStop(sound->source_idx);
+    alSourcei(sound->source_idx, AL_BUFFER, 0);
+    alDeleteBuffers(SOUND_STREAM_BUFFERS, st->buffers);
+    ov_clear(&st->vf);
+    fclose(st->f);
+    free(st);
+    sound->stream = NULL;
+}
+
+static int parse_ogg(struct sound *sound, const char *uri)
+{
+    struct sound_stream *st;
+    ogg_int64_t pcm_size;
+    vorbis_info *vi;
+    char **ptr;
+
+    CHECK(st = calloc(1, sizeof(*st)));
+    st->f = fopen(uri, "r");
+    if (!st->f) {
+        err("can't open '%s'\n", uri);
+        free(st);
+        return -1;
+    }
+
+    if (ov_open_callbacks(st->f, &st->vf, NULL, 0, OV_CALLBACKS_NOCLOSE) < 0) {
+        err("can't open '%s'\n", uri);
+        fclose(st->f);
+        free(st);
+        return -1;
+    }
+    
+    ptr = ov_comment(&st->vf, -1)->user_comments;
+    vi = ov_info(&st->vf,-1);
+    while (*ptr) {
+        dbg(" => %s\n", *ptr);
+        ++ptr;
+    }
+
+    dbg("bitstream is %d channel, %ldHz\n", vi->channels, vi->rate);
+    dbg("Encoded by: %s\n", ov_comment(&st->vf,-1)->vendor);
+
+    sound->nr_channels = vi->channels;
+    sound->freq = vi->rate;
+    sound->format = vi->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16;
+
+    /* 16 bit samples; negative if it's not seekable, which can't loop anyway */
+    pcm_size = ov_pcm_total(&st->vf, -1) * vi->channels * 2;
+    if (pcm_size > SOUND_STREAM_MIN) {
+        dbg("streaming '%s': %lld bytes\n", uri, (long long)pcm_size);
+        alGenBuffers(SOUND_STREAM_BUFFERS, st->buffers);
+        sound->stream = st;
+        return 0;
+    }
+
+    ogg_decode(sound, &st->vf);
+    ov_clear(&st->vf);
+    fclose(st->f);
+    free(st);
 
     return 0;
 }
@@ -148,8 +400,17 @@ static int parse_wav(struct sound *sound, const char *uri)
 
 void sound_set_gain(struct sound *sound, float gain)
 {
+    unsigned int i;
+
     sound->gain = gain;
-    alSourcef(sound->source_idx, AL_GAIN, sound->gain);
+    if (sound->stream) {
+        alSourcef(sound->source_idx, AL_GAIN, sound->gain);
+        return;
+    }
+
+    for (i = 0; i < nr_voices; i++)
+        if (voices[i].sound == sound)
+            alSourcef(voices[i].source, AL_GAIN, sound->gain);
 }
 
 float sound_get_gain(struct sound *sound)
@@ -160,8 +421,22 @@ float sound_get_gain(struct sound *sound)
 static void sound_drop(struct ref *ref)
 {
     struct sound *sound = container_of(ref, struct sound, ref);
-    alDeleteBuffers(1, &sound->buffer_idx);
-    alDeleteSources(1, &sound->source_idx);
+    unsigned int i;
+
+    for (i = 0; i < nr_voices; i++)
+        if (voices[i].sound == sound) {
+            alSourceStop(voices[i].source);
+            alSourcei(voices[i].source, AL_BUFFER, 0);
+            voices[i].sound = NULL;
+        }
+
+    if (sound->stream) {
+        sound_stream_done(sound);
+        alDeleteSources(1, &sound->source_idx);
+    }
+    if (sound->buffer)
+        ref_put(sound->buffer);
+    list_del(&sound->entry);
     free(sound->buf);
 }
 
@@ -169,14 +444,28 @@ DECLARE_REFCLASS(sound);
 
 struct sound *sound_load(const char *name)
 {
+    struct sound_buffer *sb;
     struct sound *sound;
     LOCAL(char, uri);
 
     CHECK(sound = ref_new(sound));
     CHECK(uri = lib_figure_uri(RES_ASSET, name));
+    list_init(&sound->entry);
+    sound->gain = 1.0;
+    sound->max_voices = SOUND_MAX_VOICES;
 
     alcMakeContextCurrent(context);
-    alGenBuffers(1, &sound->buffer_idx);
+    sound->buffer = sound_buffer_get(uri);
+    if (sound->buffer) {
+        sound->buffer_idx = sound->buffer->id;
+        goto out;
+    }
+
+    CHECK(sb = ref_new(sound_buffer));
+    list_init(&sb->entry);
+    CHECK(sb->name = strdup(uri));
+    alGenBuffers(1, &sb->id);
+    sound->buffer_idx = sb->id;
     //CHECK_VAL(alGetError(), AL_NO_ERROR);
 
     if (str_endswith(uri, ".wav"))
@@ -184,11 +473,22 @@ struct sound *sound_load(const char *name)
     else if (str_endswith(uri, ".ogg"))
         CHECK_VAL(parse_ogg(sound, uri), 0);
 
-    alGenSources(1, &sound->source_idx);
-    alSourcei(sound->source_idx, AL_BUFFER, sound->buffer_idx);
-    alSourcei(sound->source_idx, AL_LOOPING, AL_FALSE);
-    alSourceQueueBuffers(sound->source_idx, 1, &sound->buffer_idx);
+    if (sound->stream) {
+        /* has its own buffers */
+        ref_put(sb);
+        sound->buffer_idx = 0;
+
+        alGenSources(1, &sound->source_idx);
+        alSourcei(sound->source_idx, AL_LOOPING, AL_FALSE);
+        /* music goes wherever the listener goes */
+        alSourcei(sound->source_idx, AL_SOURCE_RELATIVE, AL_TRUE);
+        sound_stream_start(sound);
+    } else {
+        list_append(&sound_buffers, &sb->entry);
+        sound->buffer = sb;
+    }
 
+out:
     list_append(&sounds, &sound->entry);
 
     return sound;
@@ -196,18 +496,102 @@ struct sound *sound_load(const char *name)
 
 void sound_set_looping(struct sound *sound, bool looping)
 {
-    alSourcei(sound->source_idx, AL_LOOPING, looping ? AL_TRUE : AL_FALSE);
+    unsigned int i;
+
+    if (sound->stream) {
+        sound->stream->looping = looping;
+        return;
+    }
+
+    sound->looping = looping;
+    for (i = 0; i < nr_voices; i++)
+        if (voices[i].sound == sound)
+            alSourcei(voices[i].source, AL_LOOPING, looping ? AL_TRUE : AL_FALSE);
 }
 
-void sound_play(struct sound *sound)
+void sound_set_priority(struct sound *sound, int priority, unsigned int max_voices)
+{
+    sound->priority = priority;
+    sound->max_voices = max(max_voices, 1);
+}
+
+static void sound_stream_play(struct sound *sound)
 {
+    ALint queued = 0;
     int state;
 
+    alGetSourcei(sound->source_idx, AL_BUFFERS_QUEUED, &queued);
+    /* played to the end, start over */
+    if (!queued)
+        sound_stream_start(sound);
+    sound->stream->playing = true;
+
     alSourcePlay(sound->source_idx);
     alGetSourcei(sound->source_idx, AL_SOURCE_STATE, &state);
     dbg_on(state != AL_PLAYING, "source state: %d\n", state);
 }
 
+static void sound_voice_play(struct sound *sound, const float *pos)
+{
+    static const ALfloat origin[] = { 0.0, 0.0, 0.0 };
+    struct voice *v;
+
+    if (sound->stream) {
+        sound_stream_play(sound);
+        return;
+    }
+
+    /* nobody would hear it */
+    if (pos && sound->gain * sound_distance_gain(pos) < SOUND_GAIN_MIN)
+        return;
+
+    v = voice_get(sound);
+    if (!v)
+        return;
+
+    alSourceStop(v->source);
+    alSourcei(v->source, AL_BUFFER, sound->buffer_idx);
+    alSourcef(v->source, AL_GAIN, sound->gain);
+    alSourcei(v->source, AL_LOOPING, sound->looping ? AL_TRUE : AL_FALSE);
+    /* the 2D ones are where the listener is */
+    alSourcei(v->source, AL_SOURCE_RELATIVE, pos ? AL_FALSE : AL_TRUE);
+    alSourcefv(v->source, AL_POSITION, pos ? pos : origin);
+    v->sound = sound;
+    v->started = ++voice_seq;
+    alSourcePlay(v->source);
+}
+
+void sound_play(struct sound *sound)
+{
+    sound_voice_play(sound, NULL);
+}
+
+void sound_play_at(struct sound *sound, const float *pos)
+{
+    sound_voice_play(sound, pos);
+}
+
+void sound_set_listener(const float *pos, const float *at, const float *up)
+{
+    memcpy(listenerPos, pos, sizeof(listenerPos));
+    memcpy(listenerOri, at, sizeof(float) * 3);
+    memcpy(listenerOri + 3, up, sizeof(float) * 3);
+    if (!context)
+        return;
+
+    alListenerfv(AL_POSITION, listenerPos);
+    alListenerfv(AL_ORIENTATION, listenerOri);
+}
+
+void sound_update(void)
+{
+    struct sound *sound;
+
+    list_for_each_entry(sound, &sounds, entry)
+        if (sound->stream)
+            sound_stream_update(sound);
+}
+
 void sound_init(void)
 {
     int major, minor;
@@ -225,6 +609,14 @@ void sound_init(void)
 	alListenerfv(AL_ORIENTATION,listenerOri);
     CHECK_VAL(alGetError(), AL_NO_ERROR); // clear any error messages
 
+    /* as many as the implementation gives us */
+    for (nr_voices = 0; nr_voices < SOUND_VOICES; nr_voices++) {
+        alGenSources(1, &voices[nr_voices].source);
+        if (alGetError() != AL_NO_ERROR)
+            break;
+    }
+    dbg("sound voices: %u\n", nr_voices);
+
     //intro_sound = sound_load("the_entertainer.ogg");
 
     //alSourcef(intro_sound->source_idx, AL_PITCH, 1.0f);
@@ -240,6 +632,9 @@ void sound_done(void)
         ref_put(sound);
     }
 
+    for (; nr_voices; nr_voices--)
+        alDeleteSources(1, &voices[nr_voices - 1].source);
+
     alcDestroyContext(context);
     alcCloseDevice(device);
 }
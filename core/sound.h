@@ -14,14 +14,25 @@
 
 #include "object.h"
 
+struct sound_stream;
+struct sound_buffer;
+
 struct sound {
     unsigned int    nr_channels;
     ALsizei         size, freq;
     ALenum          format;
+    /* shared with the other sounds from the same file */
+    struct sound_buffer *buffer;
     ALuint          buffer_idx;
+    /* only the streaming ones, the rest play on the pooled voices */
     ALuint          source_idx;
     float           gain;
+    int             priority;
+    unsigned int    max_voices;
+    bool            looping;
     uchar           *buf;
+    /* decoded as it plays, see sound_update() */
+    struct sound_stream *stream;
     struct list     entry;
     struct ref      ref;
 };
@@ -33,5 +44,12 @@ float sound_get_gain(struct sound *sound);
 void sound_set_gain(struct sound *sound, float gain);
 void sound_set_looping(struct sound *sound, bool looping);
 void sound_play(struct sound *sound);
+/* positional, see sound_set_listener() */
+void sound_play_at(struct sound *sound, const float *pos);
+/* at most @max_voices at once; takes over voices of the same or lower @priority */
+void sound_set_priority(struct sound *sound, int priority, unsigned int max_voices);
+void sound_set_listener(const float *pos, const float *at, const float *up);
+/* once a frame, keeps the streaming sounds fed */
+void sound_update(void);
 
 #endif /* __CLAP_SOUND_H__ */
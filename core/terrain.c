@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: Apache-2.0
 #include <errno.h>
+#include <limits.h>
 #include "ca2d.h"
+#include "jobs.h"
 #include "model.h"
 #include "physics.h"
 #include "scene.h"
@@ -52,43 +54,10 @@ static float get_avg_height(struct terrain *t, int x, int z)
     return corners + sides + self;
 }
 
-static float get_interp_height(struct terrain *t, float x, float z)
-{
-    int intx = floor(x);
-    int intz = floor(z);
-    float fracx = x - intx;
-    float fracz = z - intz;
-    float v1    = get_avg_height(t, intx, intz);
-    float v2    = get_avg_height(t, intx + 1, intz);
-    float v3    = get_avg_height(t, intx, intz + 1);
-    float v4    = get_avg_height(t, intx + 1, intz + 1);
-    float i1    = cos_interp(v1, v2, fracx);
-    float i2    = cos_interp(v3, v4, fracx);
-    //dbg("#### %f,%f => %f => %f; %f,%f => %f => %f\n", v1, v2, fracx, i1, v3, v4, fracx, i2);
-
-    return cos_interp(i1, i2, fracz);
-}
-
 #define OCTAVES 4
 #define ROUGHNESS 0.5f
 #define AMPLITUDE 8
 
-static float get_height(struct terrain *t, int x, int z, float _amp, int _oct)
-{
-    float total = 0;
-    float d = pow(2, _oct - 1);
-    int i;
-
-    for (i = 0; i < _oct; i++) {
-        float freq = pow(2, i) / d;
-        float amp  = pow(ROUGHNESS, i) * _amp;
-
-        total += get_interp_height(t, x * freq, z * freq) * amp;
-    }
-
-    return t->y + total;
-}
-
 static void calc_normal(struct terrain *t, vec3 n, int x, int z)
 {
     /* Torus */
@@ -391,12 +360,514 @@ float terrain_height(struct terrain *t, float x, float z)
     return height;
 }
 
+/* for the ray casts: in world coordinates */
+static float terrain_ground_height(void *priv, float x, float z)
+{
+    struct terrain *t = priv;
+
+    return t->y + terrain_height(t, x, z);
+}
+
+/*
+ * The mesh is in chunks of TERRAIN_CHUNK quads a side, each with its own
+ * model and entity: each has an AABB for the culling, u16 indices, and a
+ * LOD chain where LOD n takes every 2^n-th vertex, with the error that it
+ * makes in the heights, so entity3d_lod() can pick per chunk. Around the
+ * edges, every LOD has a skirt that hangs down past that error, to cover
+ * the cracks between neighbors at different LODs. Only the chunks within
+ * TERRAIN_LOAD_CHUNKS of the camera have meshes, see terrain_update().
+ */
+#define TERRAIN_CHUNK           32
+#define TERRAIN_LOAD_CHUNKS     4
+/* a little further, so that going back and forth doesn't rebuild them */
+#define TERRAIN_EVICT_CHUNKS    5
+/* per frame, after the first ones */
+#define TERRAIN_LOADS_MAX       2
+
+static inline float terrain_map(struct terrain *t, unsigned int x, unsigned int z)
+{
+    return t->map[x * t->nr_vert + z];
+}
+
+/* grid lines of a LOD: every @stride-th of @n quads, and the last one */
+static unsigned int terrain_lod_lines(unsigned int n, unsigned int stride, unsigned int *line)
+{
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < n; i += stride)
+        line[nr++] = i;
+    line[nr++] = n;
+
+    return nr;
+}
+
+/* the most that the heights of a chunk's grid stray from a LOD's quads */
+static float terrain_lod_error(struct terrain *t, unsigned int x0, unsigned int z0,
+                               const unsigned int *lu, unsigned int nu,
+                               const unsigned int *lw, unsigned int nw)
+{
+    unsigned int a, b, u, w;
+    float err = 0, fu, fw, h;
+
+    for (b = 0; b < nw - 1; b++)
+        for (a = 0; a < nu - 1; a++)
+            for (w = lw[b]; w <= lw[b + 1]; w++)
+                for (u = lu[a]; u <= lu[a + 1]; u++) {
+                    fu = (float)(u - lu[a]) / (lu[a + 1] - lu[a]);
+                    fw = (float)(w - lw[b]) / (lw[b + 1] - lw[b]);
+                    h  = lin_interp(lin_interp(terrain_map(t, x0 + lu[a], z0 + lw[b]),
+                                               terrain_map(t, x0 + lu[a + 1], z0 + lw[b]), fu),
+                                    lin_interp(terrain_map(t, x0 + lu[a], z0 + lw[b + 1]),
+                                               terrain_map(t, x0 + lu[a + 1], z0 + lw[b + 1]), fu),
+                                    fw);
+                    err = max(err, fabsf(h - terrain_map(t, x0 + u, z0 + w)));
+                }
+
+    return err;
+}
+
+static void terrain_vertex(struct terrain *t, unsigned int x, unsigned int z, float drop,
+                           float *vx, float *norm, float *tx)
+{
+    vx[0] = t->x + (float)x / ((float)t->nr_vert - 1) * t->side;
+    vx[1] = t->y + terrain_map(t, x, z) - drop;
+    vx[2] = t->z + (float)z / ((float)t->nr_vert - 1) * t->side;
+    memcpy(norm, &t->norm[(x * t->nr_vert + z) * 3], sizeof(vec3));
+    tx[0] = (float)x * 32 / ((float)t->nr_vert - 1);
+    tx[1] = (float)z * 32 / ((float)t->nr_vert - 1);
+}
+
+/* both sides, it can be seen from either */
+static unsigned int terrain_skirt(unsigned short *idx, unsigned short g0, unsigned short g1,
+                                  unsigned short s0, unsigned short s1)
+{
+    unsigned short quad[] = { g0, s0, g1, g1, s0, s1, g0, g1, s0, g1, s1, s0 };
+
+    memcpy(idx, quad, sizeof(quad));
+    return array_size(quad);
+}
+
+/*
+ * The vertices are the (nu + 1) x (nw + 1) grid by rows of Z, then the
+ * skirts' along Z = 0, Z = nw, X = 0 and X = nu.
+ */
+static unsigned int terrain_lod_idx(unsigned short *idx, unsigned int nu, unsigned int nw,
+                                    const unsigned int *lu, unsigned int nr_lu,
+                                    const unsigned int *lw, unsigned int nr_lw)
+{
+    unsigned int a, b, it = 0, row = nu + 1;
+    unsigned int skirt = row * (nw + 1);
+
+#define GRID(u, w) ((w) * row + (u))
+    for (b = 0; b < nr_lw - 1; b++)
+        for (a = 0; a < nr_lu - 1; a++) {
+            idx[it++] = GRID(lu[a], lw[b]);
+            idx[it++] = GRID(lu[a], lw[b + 1]);
+            idx[it++] = GRID(lu[a + 1], lw[b]);
+            idx[it++] = GRID(lu[a + 1], lw[b]);
+            idx[it++] = GRID(lu[a], lw[b + 1]);
+            idx[it++] = GRID(lu[a + 1], lw[b + 1]);
+        }
+
+    for (a = 0; a < nr_lu - 1; a++) {
+        it += terrain_skirt(&idx[it], GRID(lu[a], 0), GRID(lu[a + 1], 0),
+                            skirt + lu[a], skirt + lu[a + 1]);
+        it += terrain_skirt(&idx[it], GRID(lu[a], nw), GRID(lu[a + 1], nw),
+                            skirt + row + lu[a], skirt + row + lu[a + 1]);
+    }
+    skirt += 2 * row;
+    for (b = 0; b < nr_lw - 1; b++) {
+        it += terrain_skirt(&idx[it], GRID(0, lw[b]), GRID(0, lw[b + 1]),
+                            skirt + lw[b], skirt + lw[b + 1]);
+        it += terrain_skirt(&idx[it], GRID(nu, lw[b]), GRID(nu, lw[b + 1]),
+                            skirt + nw + 1 + lw[b], skirt + nw + 1 + lw[b + 1]);
+    }
+#undef GRID
+
+    return it;
+}
+
+/*
+ * With vertex textures, the map goes to the GPU as it is, in an R32F
+ * texture, and the chunks are all entities of one flat grid model, which
+ * terrain.vert displaces and lights from the texture. The chunks then only
+ * cost a transform each, and edits only upload the texels that changed,
+ * see terrain_map_changed(). The grid's LOD errors and skirts are those of
+ * the worst chunk at the time it is made.
+ */
+static void terrain_vtf_init(struct terrain *t)
+{
+    unsigned int n = TERRAIN_CHUNK, row = n + 1, nr_vx = row * row + 4 * row;
+    unsigned int line[LOD_MAX][TERRAIN_CHUNK + 1], nr_line[LOD_MAX];
+    unsigned int lu[TERRAIN_CHUNK + 1], lw[TERRAIN_CHUNK + 1], nr_lu, nr_lw;
+    unsigned int nr_lods, level, cx, cz, nu, nw, u, w, v, nr_idx;
+    float square = (float)t->side / (t->nr_vert - 1);
+    float err[LOD_MAX] = {}, hmin = INFINITY, hmax = -INFINITY, drop, extent;
+    size_t vxsz = nr_vx * sizeof(float) * 3, txsz = nr_vx * sizeof(float) * 2, idxsz;
+    struct shader_prog *p = t->prog;
+    struct model3d *model;
+    unsigned short *idx;
+    float *vx, *tx;
+
+    for (nr_lods = 0; nr_lods < LOD_MAX; nr_lods++) {
+        if (nr_lods && nr_line[nr_lods - 1] == 2)
+            break;
+        nr_line[nr_lods] = terrain_lod_lines(n, 1 << nr_lods, line[nr_lods]);
+    }
+
+    for (cz = 0; cz < t->nr_chunks; cz++)
+        for (cx = 0; cx < t->nr_chunks; cx++) {
+            nu = min(n, t->nr_vert - 1 - cx * n);
+            nw = min(n, t->nr_vert - 1 - cz * n);
+            for (level = 1; level < nr_lods; level++) {
+                nr_lu = terrain_lod_lines(nu, 1 << level, lu);
+                nr_lw = terrain_lod_lines(nw, 1 << level, lw);
+                err[level] = max(err[level], terrain_lod_error(t, cx * n, cz * n, lu, nr_lu,
+                                                               lw, nr_lw));
+            }
+        }
+
+    for (v = 0; v < t->nr_vert * t->nr_vert; v++) {
+        hmin = min(hmin, t->map[v]);
+        hmax = max(hmax, t->map[v]);
+    }
+    drop = err[nr_lods - 1] + square;
+
+    idxsz = (6 * n * n + 12 * 4 * n) * sizeof(*idx);
+    CHECK(vx  = calloc(nr_vx, sizeof(*vx) * 3));
+    CHECK(tx  = calloc(nr_vx, sizeof(*tx) * 2));
+    CHECK(idx = malloc(idxsz));
+
+    /* .y is the skirts' drop */
+    for (v = 0, w = 0; w <= n; w++)
+        for (u = 0; u <= n; u++, v++) {
+            vx[v * 3 + 0] = u * square;
+            vx[v * 3 + 2] = w * square;
+        }
+    for (u = 0; u <= n; u++, v++) {
+        vx[v * 3 + 0] = u * square;
+        vx[v * 3 + 1] = -drop;
+    }
+    for (u = 0; u <= n; u++, v++) {
+        vx[v * 3 + 0] = u * square;
+        vx[v * 3 + 1] = -drop;
+        vx[v * 3 + 2] = n * square;
+    }
+    for (w = 0; w <= n; w++, v++) {
+        vx[v * 3 + 1] = -drop;
+        vx[v * 3 + 2] = w * square;
+    }
+    for (w = 0; w <= n; w++, v++) {
+        vx[v * 3 + 0] = n * square;
+        vx[v * 3 + 1] = -drop;
+        vx[v * 3 + 2] = w * square;
+    }
+
+    /* terrain.vert doesn't use them, but without them there's no model_tex */
+    nr_idx = terrain_lod_idx(idx, n, n, line[0], nr_line[0], line[0], nr_line[0]);
+    model = model3d_new_from_vectors("terrain", p, vx, vxsz, idx, nr_idx * sizeof(*idx),
+                                     tx, txsz, NULL, 0);
+    free(tx);
+    free(vx);
+
+    /* the heights come from the texture */
+    model->aabb[2] = hmin - drop;
+    model->aabb[3] = hmax;
+    extent = max(n * square, hmax - hmin + drop);
+    for (level = 1; level < nr_lods; level++) {
+        nr_idx = terrain_lod_idx(idx, n, n, line[level], nr_line[level], line[level], nr_line[level]);
+        if (model3d_add_lod(model, idx, nr_idx * sizeof(*idx), err[level] / extent))
+            break;
+    }
+    free(idx);
+
+    CHECK(t->heights = texture_new(GL_TEXTURE0 + HEIGHT_MAP_TEX_UNIT));
+    texture_filters(t->heights, GL_CLAMP_TO_EDGE, GL_NEAREST);
+    texture_data_type(t->heights, GL_FLOAT);
+    /* by X, then Z: X is the texture's rows */
+    texture_load(t->heights, GL_RED, t->nr_vert, t->nr_vert, t->map);
+
+    t->vtf_txm = model3dtx_new(ref_pass(model), "terrain.png");
+    t->vtf_txm->heights = t->heights;
+    scene_add_model(t->scene, t->vtf_txm);
+
+    shader_prog_use(p);
+    UNIFORM(glUniform1f(p->data.use_height_map, 1));
+    UNIFORM(glUniform4f(p->data.height_map_rect, t->x, t->z, t->side, t->nr_vert));
+    shader_prog_done(p);
+}
+
+static void terrain_vtf_done(struct terrain *t)
+{
+    shader_prog_use(t->prog);
+    UNIFORM(glUniform1f(t->prog->data.use_height_map, 0));
+    shader_prog_done(t->prog);
+
+    /* the mq's reference, the chunks are gone by now */
+    ref_put(t->vtf_txm);
+    t->vtf_txm = NULL;
+    texture_done(t->heights);
+    t->heights = NULL;
+}
+
+static void terrain_vtf_chunk_load(struct terrain *t, struct terrain_chunk *c,
+                                   unsigned int x0, unsigned int z0)
+{
+    c->entity = entity3d_new(t->vtf_txm);
+    c->entity->visible = 1;
+    c->entity->scale = 1;
+    c->entity->dx = t->x + (float)x0 / (t->nr_vert - 1) * t->side;
+    c->entity->dy = t->y;
+    c->entity->dz = t->z + (float)z0 / (t->nr_vert - 1) * t->side;
+    entity3d_reset(c->entity);
+    model3dtx_add_entity(t->vtf_txm, c->entity);
+    t->nr_resident++;
+}
+
+static void terrain_chunk_load(struct terrain *t, unsigned int cx, unsigned int cz)
+{
+    struct terrain_chunk *c = &t->chunks[cz * t->nr_chunks + cx];
+    unsigned int x0 = cx * TERRAIN_CHUNK, z0 = cz * TERRAIN_CHUNK;
+    unsigned int nu = min(TERRAIN_CHUNK, t->nr_vert - 1 - x0);
+    unsigned int nw = min(TERRAIN_CHUNK, t->nr_vert - 1 - z0);
+    unsigned int lu[LOD_MAX][TERRAIN_CHUNK + 1], lw[LOD_MAX][TERRAIN_CHUNK + 1];
+    unsigned int nr_lu[LOD_MAX], nr_lw[LOD_MAX], nr_lods, level, u, w, v, nr_idx;
+    unsigned int nr_vx = (nu + 1) * (nw + 1) + 2 * (nu + 1) + 2 * (nw + 1);
+    float err[LOD_MAX], drop, extent = 0;
+    size_t vxsz, txsz, idxsz;
+    struct model3d *model;
+    float *vx, *norm, *tx;
+    unsigned short *idx;
+    int i;
+
+    if (t->vtf_txm) {
+        terrain_vtf_chunk_load(t, c, x0, z0);
+        return;
+    }
+
+    /* until the one that is a single quad */
+    for (nr_lods = 0; nr_lods < LOD_MAX; nr_lods++) {
+        if (nr_lods && nr_lu[nr_lods - 1] == 2 && nr_lw[nr_lods - 1] == 2)
+            break;
+        nr_lu[nr_lods] = terrain_lod_lines(nu, 1 << nr_lods, lu[nr_lods]);
+        nr_lw[nr_lods] = terrain_lod_lines(nw, 1 << nr_lods, lw[nr_lods]);
+        err[nr_lods] = nr_lods ? terrain_lod_error(t, x0, z0, lu[nr_lods], nr_lu[nr_lods],
+                                                   lw[nr_lods], nr_lw[nr_lods]) : 0;
+    }
+    drop = err[nr_lods - 1] + (float)t->side / (t->nr_vert - 1);
+
+    vxsz  = nr_vx * sizeof(*vx) * 3;
+    txsz  = nr_vx * sizeof(*tx) * 2;
+    /* LOD0 is the largest */
+    idxsz = (6 * nu * nw + 12 * 2 * (nu + nw)) * sizeof(*idx);
+    CHECK(vx   = malloc(vxsz));
+    CHECK(norm = malloc(vxsz));
+    CHECK(tx   = malloc(txsz));
+    CHECK(idx  = malloc(idxsz));
+
+    for (v = 0, w = 0; w <= nw; w++)
+        for (u = 0; u <= nu; u++, v++)
+            terrain_vertex(t, x0 + u, z0 + w, 0, &vx[v * 3], &norm[v * 3], &tx[v * 2]);
+    for (u = 0; u <= nu; u++, v++)
+        terrain_vertex(t, x0 + u, z0, drop, &vx[v * 3], &norm[v * 3], &tx[v * 2]);
+    for (u = 0; u <= nu; u++, v++)
+        terrain_vertex(t, x0 + u, z0 + nw, drop, &vx[v * 3], &norm[v * 3], &tx[v * 2]);
+    for (w = 0; w <= nw; w++, v++)
+        terrain_vertex(t, x0, z0 + w, drop, &vx[v * 3], &norm[v * 3], &tx[v * 2]);
+    for (w = 0; w <= nw; w++, v++)
+        terrain_vertex(t, x0 + nu, z0 + w, drop, &vx[v * 3], &norm[v * 3], &tx[v * 2]);
+
+    nr_idx = terrain_lod_idx(idx, nu, nw, lu[0], nr_lu[0], lw[0], nr_lw[0]);
+    model = model3d_new_from_vectors("terrain", t->prog, vx, vxsz, idx, nr_idx * sizeof(*idx),
+                                     tx, txsz, norm, vxsz);
+    free(tx);
+    free(norm);
+    free(vx);
+
+    /* lod_error[] is relative to the extents, same as the simplifier's */
+    for (i = 0; i < 3; i++)
+        extent = max(extent, model->aabb[i * 2 + 1] - model->aabb[i * 2]);
+    for (level = 1; level < nr_lods; level++) {
+        nr_idx = terrain_lod_idx(idx, nu, nw, lu[level], nr_lu[level], lw[level], nr_lw[level]);
+        if (model3d_add_lod(model, idx, nr_idx * sizeof(*idx), err[level] / extent))
+            break;
+    }
+    free(idx);
+
+    c->txm = model3dtx_new(ref_pass(model), "terrain.png");
+    scene_add_model(t->scene, c->txm);
+    c->entity = entity3d_new(c->txm);
+    c->entity->visible = 1;
+    c->entity->scale = 1;
+    entity3d_reset(c->entity);
+    model3dtx_add_entity(c->txm, c->entity);
+    t->nr_resident++;
+}
+
+static void terrain_chunk_unload(struct terrain *t, struct terrain_chunk *c)
+{
+    ref_put(c->entity);
+    /* the mq's reference, which takes it off the list; not the shared grid's */
+    if (c->txm)
+        ref_put(c->txm);
+    c->entity = NULL;
+    c->txm = NULL;
+    t->nr_resident--;
+}
+
+/* in chunks, from @eye to the closest point of the chunk, along X or Z */
+static float terrain_chunk_dist(struct terrain *t, unsigned int cx, unsigned int cz, const float *eye)
+{
+    float size = (float)t->side * TERRAIN_CHUNK / (t->nr_vert - 1);
+    float x = t->x + cx * size, z = t->z + cz * size;
+    float dx = max(max(x - eye[0], eye[0] - x - size), 0);
+    float dz = max(max(z - eye[2], eye[2] - z - size), 0);
+
+    return max(dx, dz) / size;
+}
+
+/*
+ * On the first call, all of the chunks in range get built right away, after
+ * that, the closest TERRAIN_LOADS_MAX a frame, so walking doesn't stutter.
+ */
+void terrain_update(struct terrain *t, const float *eye)
+{
+    unsigned int cx, cz, best, nr_loads;
+    bool first = !t->nr_resident;
+    float dist, best_dist;
+
+    for (cz = 0; cz < t->nr_chunks; cz++)
+        for (cx = 0; cx < t->nr_chunks; cx++) {
+            struct terrain_chunk *c = &t->chunks[cz * t->nr_chunks + cx];
+
+            dist = terrain_chunk_dist(t, cx, cz, eye);
+            if (c->entity && dist > TERRAIN_EVICT_CHUNKS)
+                terrain_chunk_unload(t, c);
+            else if (first && !c->entity && dist <= TERRAIN_LOAD_CHUNKS)
+                terrain_chunk_load(t, cx, cz);
+        }
+
+    if (first)
+        return;
+
+    for (nr_loads = 0; nr_loads < TERRAIN_LOADS_MAX; nr_loads++) {
+        best = UINT_MAX;
+        best_dist = TERRAIN_LOAD_CHUNKS;
+        for (cz = 0; cz < t->nr_chunks; cz++)
+            for (cx = 0; cx < t->nr_chunks; cx++) {
+                if (t->chunks[cz * t->nr_chunks + cx].entity)
+                    continue;
+
+                dist = terrain_chunk_dist(t, cx, cz, eye);
+                if (dist <= best_dist) {
+                    best = cz * t->nr_chunks + cx;
+                    best_dist = dist;
+                }
+            }
+
+        if (best == UINT_MAX)
+            break;
+        terrain_chunk_load(t, best % t->nr_chunks, best / t->nr_chunks);
+    }
+}
+
+static void terrain_unload_all(struct terrain *t)
+{
+    unsigned int i;
+
+    for (i = 0; i < t->nr_chunks * t->nr_chunks; i++)
+        if (t->chunks[i].entity)
+            terrain_chunk_unload(t, &t->chunks[i]);
+}
+
+int terrain_set_vtf(struct terrain *t, bool vtf)
+{
+    struct shader_data *d = &t->prog->data;
+
+    if (vtf == !!t->vtf_txm)
+        return 0;
+    if (vtf && (!gl_does_vertex_textures() || d->use_height_map < 0 || d->height_map < 0 ||
+                d->height_map_rect < 0))
+        return -ENOTSUP;
+
+    /* terrain_update() brings them back in the new mode */
+    terrain_unload_all(t);
+    if (vtf)
+        terrain_vtf_init(t);
+    else
+        terrain_vtf_done(t);
+
+    return 0;
+}
+
+void terrain_map_changed(struct terrain *t, unsigned int x, unsigned int z, unsigned int w,
+                         unsigned int h)
+{
+    unsigned int nr_v = t->nr_vert, i, j, cx, cz, x0, z0;
+    float *buf;
+
+    if (x >= nr_v || z >= nr_v)
+        return;
+    w = min(w, nr_v - x);
+    h = min(h, nr_v - z);
+
+    /* the normals have their neighbors' heights in them */
+    for (i = x ? x - 1 : 0; i < min(x + w + 1, nr_v); i++)
+        for (j = z ? z - 1 : 0; j < min(z + h + 1, nr_v); j++)
+            calc_normal(t, &t->norm[(i * nr_v + j) * 3], i, j);
+
+    if (t->vtf_txm) {
+        /* X is the texture's rows, whole ones are already in one piece */
+        if (h == nr_v) {
+            texture_update(t->heights, 0, x, nr_v, w, &t->map[x * nr_v]);
+            return;
+        }
+
+        CHECK(buf = malloc(w * h * sizeof(*buf)));
+        for (i = 0; i < w; i++)
+            memcpy(&buf[i * h], &t->map[(x + i) * nr_v + z], h * sizeof(*buf));
+        texture_update(t->heights, z, x, h, w, buf);
+        free(buf);
+        return;
+    }
+
+    /* chunks' points go from their first line to their last one, plus a normal's reach */
+    for (cz = 0; cz < t->nr_chunks; cz++)
+        for (cx = 0; cx < t->nr_chunks; cx++) {
+            x0 = cx * TERRAIN_CHUNK;
+            z0 = cz * TERRAIN_CHUNK;
+            if (!t->chunks[cz * t->nr_chunks + cx].entity ||
+                x0 > x + w || x0 + TERRAIN_CHUNK + 1 < x ||
+                z0 > z + h || z0 + TERRAIN_CHUNK + 1 < z)
+                continue;
+
+            terrain_chunk_unload(t, &t->chunks[cz * t->nr_chunks + cx]);
+            terrain_chunk_load(t, cx, cz);
+        }
+}
+
 static void terrain_drop(struct ref *ref)
 {
     struct terrain *terrain = container_of(ref, struct terrain, ref);
 
+    if (terrain->phys->heightfield.priv == terrain)
+        phys_set_heightfield(terrain->phys, NULL, NULL, NULL, NULL);
+    /* its heightfield reads from terrain->map; the entity goes later, with the mq */
+    if (terrain->entity && terrain->entity->phys_body) {
+        phys_body_done(terrain->entity->phys_body);
+        terrain->entity->phys_body = NULL;
+    }
+
+    terrain_unload_all(terrain);
+    if (terrain->vtf_txm)
+        terrain_vtf_done(terrain);
+    free(terrain->chunks);
+
     // ref_put_last(terrain->entity);
     free(terrain->map);
+    free(terrain->norm);
+    ref_put(terrain->prog);
+    ref_put(terrain->phys);
 }
 
 DECLARE_REFCLASS(terrain);
@@ -428,25 +899,145 @@ const struct cell_automaton ca_instors[] = {
 };
 
 #define MAZE_FAC 8
+
+/*
+ * The heights are octaves of cos_interp() between the points of a lattice
+ * of get_avg_height(), which only depends on the point, and the blend of
+ * an octave only depends on the coordinate, so both are computed once, up
+ * front. What's left for each point is the amplitude from the maze and
+ * OCTAVES bilinear blends, a row at a time on the workers. The normals are
+ * a stencil over the finished map, in another pass.
+ */
+struct terrain_gen {
+    struct terrain  *t;
+    unsigned char   *maze;
+    int             mside;
+    /* (nr_vert + 1)^2 points, the octaves' cells go up to nr_vert */
+    float           *avg;
+    /* OCTAVES x nr_vert: for each coordinate, its cell and the cos blend in it */
+    int             *cell;
+    float           *blend;
+};
+
+static void terrain_gen_avg(unsigned int x, void *priv)
+{
+    struct terrain_gen *gen = priv;
+    unsigned int z, nr = gen->t->nr_vert + 1;
+
+    for (z = 0; z < nr; z++)
+        gen->avg[x * nr + z] = get_avg_height(gen->t, x, z);
+}
+
+static void terrain_gen_octaves(struct terrain_gen *gen)
+{
+    unsigned int nr_v = gen->t->nr_vert, c;
+    float d = pow(2, OCTAVES - 1);
+    int i;
+
+    for (i = 0; i < OCTAVES; i++) {
+        float freq = pow(2, i) / d;
+
+        for (c = 0; c < nr_v; c++) {
+            float v = c * freq;
+            int cell = floor(v);
+
+            gen->cell[i * nr_v + c] = cell;
+            gen->blend[i * nr_v + c] = (1.f - cosf((v - cell) * M_PI)) / 2.f;
+        }
+    }
+}
+
+/* the sum of the octaves at (x, z), without the amplitude */
+static float terrain_gen_noise(struct terrain_gen *gen, unsigned int x, unsigned int z)
+{
+    unsigned int nr_v = gen->t->nr_vert, nr = nr_v + 1;
+    float total = 0, amp = 1, fx, fz, i1, i2;
+    const float *row;
+    int i;
+
+    for (i = 0; i < OCTAVES; i++) {
+        row = gen->avg + gen->cell[i * nr_v + x] * nr + gen->cell[i * nr_v + z];
+        fx  = gen->blend[i * nr_v + x];
+        fz  = gen->blend[i * nr_v + z];
+        /* same as cos_interp() across, then along */
+        i1  = row[0] * (1.f - fx) + row[nr] * fx;
+        i2  = row[1] * (1.f - fx) + row[nr + 1] * fx;
+        total += (i1 * (1.f - fz) + i2 * fz) * amp;
+        amp   *= ROUGHNESS;
+    }
+
+    return total;
+}
+
+static void terrain_gen_row(unsigned int i, void *priv)
+{
+    struct terrain_gen *gen = priv;
+    struct terrain *t = gen->t;
+    unsigned char *maze = gen->maze;
+    int j, mside = gen->mside, nr_v = t->nr_vert;
+
+    for (j = 0; j < nr_v; j++) {
+        float xfrac = fmodf(i, MAZE_FAC) / MAZE_FAC;
+        float yfrac = fmodf(j, MAZE_FAC) / MAZE_FAC;
+        int xpos = i / MAZE_FAC, ypos = j / MAZE_FAC;
+        unsigned char cn = xyarray_get(maze, mside, xpos, ypos);
+        unsigned char xn = xyarray_get(maze, mside, xfrac >= 0.5 ? xpos + 1 : xpos - 1, ypos);
+        unsigned char yn = xyarray_get(maze, mside, xpos, yfrac >= 0.5 ? ypos + 1 : ypos - 1);
+        float xavg  = cn > xn ? cn : cos_interp(cn, xn, 2 * xfrac - 1);
+        float yavg  = cn > yn ? cn : cos_interp(cn, yn, 2 * yfrac - 1);
+        float avg   = cos_interp(xavg, yavg, fabsf(xfrac - yfrac));
+
+        t->map[i * nr_v + j] = t->y + terrain_gen_noise(gen, i, j) * powf(1.5, avg) + avg;
+    }
+}
+
+static void terrain_gen_normals(unsigned int x, void *priv)
+{
+    struct terrain *t = priv;
+    unsigned int z, nr_v = t->nr_vert;
+    const float *h = t->map + x * nr_v, *hl = h - nr_v, *hr = h + nr_v;
+    float *n = t->norm + x * nr_v * 3;
+    float nx, nz, l;
+
+    /* the edges are calc_normal()'s, with its torus */
+    if (!x || x == nr_v - 1) {
+        for (z = 0; z < nr_v; z++)
+            calc_normal(t, &n[z * 3], x, z);
+        return;
+    }
+
+    calc_normal(t, &n[0], x, 0);
+    for (z = 1; z < nr_v - 1; z++) {
+        nx = hl[z] - hr[z];
+        nz = h[z - 1] - h[z + 1];
+        l  = 1.f / sqrtf(nx * nx + 4.f + nz * nz);
+        n[z * 3 + 0] = nx * l;
+        n[z * 3 + 1] = 2.f * l;
+        n[z * 3 + 2] = nz * l;
+    }
+    calc_normal(t, &n[(nr_v - 1) * 3], x, nr_v - 1);
+}
 struct terrain *terrain_init_square_landscape(struct scene *s, float x, float y, float z, float side, unsigned int nr_v)
 {
     struct terrain *t;
     struct model3d *model;
     struct model3dtx *txm;
     struct shader_prog *prog = shader_prog_find(s->prog, "terrain"); /* XXX */
-    unsigned long total = nr_v * nr_v, it, bottom;
-    size_t vxsz, txsz, idxsz;
-    float *vx, *norm, *tx;
-    unsigned short *idx;
+    unsigned long total = nr_v * nr_v, i;
+    float hmin = INFINITY, hmax = -INFINITY;
     struct bsp_part *bsp_root;
     struct timespec ts;
+    struct terrain_gen gen;
     struct circ_maze *m;
     unsigned char *maze;
-    int i, j, mside = nr_v / MAZE_FAC;
+    int j, mside = nr_v / MAZE_FAC;
 
     maze = ca2d_generate(&ca_test, mside, 4);
 
     CHECK(t = ref_new(terrain));
+    gen.t     = t;
+    gen.maze  = maze;
+    gen.mside = mside;
     clock_gettime(CLOCK_REALTIME, &ts);
     t->seed  = ts.tv_nsec ^ ts.tv_sec;
 
@@ -457,38 +1048,23 @@ struct terrain *terrain_init_square_landscape(struct scene *s, float x, float y,
     t->x       = x;
     t->y       = y;
     t->z       = z;
+    t->phys    = ref_get(s->phys);
     CHECK(t->map0 = calloc(nr_v * nr_v, sizeof(float)));
     for (i = 0; i < nr_v; i++)
         for (j = 0; j < nr_v; j++)
             t->map0[i * nr_v + j] = get_rand_height(t, i, j);
-    t->map  = calloc(nr_v * nr_v, sizeof(float));
-    for (i = 0; i < nr_v; i++)
-        for (j = 0; j < nr_v; j++) {
-            struct bsp_part *bp = bsp_find(bsp_root, i, j);
-            struct bsp_part *bpx = bsp_xneigh(bsp_root, i, j);
-            struct bsp_part *bpy = bsp_yneigh(bsp_root, i, j);
-            float xfrac = bsp_xfrac(bp, i);
-            float yfrac = bsp_yfrac(bp, j);
-            float xamp  = cos_interp(bp->amp, bpx->amp, fabsf(xfrac));
-            float yamp  = cos_interp(bp->amp, bpy->amp, fabsf(yfrac));
-            float amp   = cos_interp(xamp, yamp, fabs(xfrac - yfrac));
-            xfrac = fmodf(i, MAZE_FAC) / MAZE_FAC;
-            yfrac = fmodf(j, MAZE_FAC) / MAZE_FAC;
-            int xpos = i / MAZE_FAC, ypos = j / MAZE_FAC;
-            unsigned char cn = xyarray_get(maze, mside, xpos, ypos);
-            unsigned char xn = xyarray_get(maze, mside, xfrac >= 0.5 ? xpos + 1 : xpos - 1, ypos);
-            unsigned char yn = xyarray_get(maze, mside, xpos, yfrac >= 0.5 ? ypos + 1 : ypos - 1);
-            float xavg  = cn > xn ? cn : cos_interp(cn, xn, 2 * xfrac - 1);
-            float yavg  = cn > yn ? cn : cos_interp(cn, yn, 2 * yfrac - 1);
-            float avg   = cos_interp(xavg, yavg, fabsf(xfrac - yfrac));
-            // dbg("### (%d,%d)/(%f,%f) amp: %f bpx amp: %f bpy amp: %f xamp: %f yamp: %f\n",
-            //     i, j, xfrac, yfrac, amp, bpx->amp, bpy->amp, xamp, yamp);
-            //if (fabsf(xfrac) > 0.985 || fabsf(yfrac) > 0.985)
-            // if (i == bp->x || j == bp->y)
-            //     t->map[i * nr_v + j] = -20;
-            // else
-            t->map[i * nr_v + j] = get_height(t, i, j, powf(1.5, avg), OCTAVES) + avg;
-        }
+    CHECK(t->map  = calloc(nr_v * nr_v, sizeof(float)));
+    CHECK(t->norm = calloc(nr_v * nr_v, sizeof(float) * 3));
+    CHECK(gen.avg = malloc((nr_v + 1) * (nr_v + 1) * sizeof(*gen.avg)));
+    CHECK(gen.cell = malloc(OCTAVES * nr_v * sizeof(*gen.cell)));
+    CHECK(gen.blend = malloc(OCTAVES * nr_v * sizeof(*gen.blend)));
+    jobs_parallel_for(nr_v + 1, terrain_gen_avg, &gen);
+    terrain_gen_octaves(&gen);
+    jobs_parallel_for(nr_v, terrain_gen_row, &gen);
+    jobs_parallel_for(nr_v, terrain_gen_normals, t);
+    free(gen.blend);
+    free(gen.cell);
+    free(gen.avg);
     free(t->map0);
     t->map0 = NULL;
     bsp_cleanup(bsp_root);
@@ -500,73 +1076,37 @@ struct terrain *terrain_init_square_landscape(struct scene *s, float x, float y,
         // xyarray_print(maze, mside, mside);
     }
 
-    vxsz  = total * sizeof(*vx) * 3;
-    txsz  = total * sizeof(*tx) * 2;
-
-    idxsz = 6 * (nr_v - 1) * (nr_v - 1) * sizeof(*idx);
-
-    CHECK(vx    = malloc(vxsz));
-    CHECK(norm  = malloc(vxsz));
-    CHECK(tx    = malloc(txsz));
-    CHECK(idx   = malloc(idxsz));
-    if (!vx || !norm || !tx || !idx)
-        return NULL;
-
-    for (it = 0, i = 0; i < nr_v; i++)
-        for (j = 0; j < nr_v; j++) {
-            vec3 normal;
-
-            vx[it * 3 + 0] = x + (float)j / ((float)nr_v - 1) * side;
-            vx[it * 3 + 1] = y + t->map[j * nr_v + i];
-            vx[it * 3 + 2] = z + (float)i / ((float)nr_v - 1) * side;
-            calc_normal(t, normal, j, i);
-            norm[it * 3 + 0] = normal[0];
-            norm[it * 3 + 1] = normal[1];
-            norm[it * 3 + 2] = normal[2];
-            tx[it * 2 + 0] = (float)j*32 / ((float)nr_v - 1);
-            tx[it * 2 + 1] = (float)i*32 / ((float)nr_v - 1);
-            it++;
-        }
+    for (i = 0; i < total; i++) {
+        hmin = min(hmin, t->map[i]);
+        hmax = max(hmax, t->map[i]);
+    }
 
-    bottom = it;
-
-    for (it = 0, i = 0; i < nr_v - 1; i++)
-        for (j = 0; j < nr_v - 1; j++) {
-            int top_left = i * nr_v + j;
-            int top_right = top_left + 1;
-            int bottom_left = (i + 1) * nr_v + j;
-            int bottom_right = bottom_left + 1;
-            idx[it++] = top_left;
-            idx[it++] = bottom_left;
-            idx[it++] = top_right;
-            idx[it++] = top_right;
-            idx[it++] = bottom_left;
-            idx[it++] = bottom_right;
-        }
-    
-    model = model3d_new_from_vectors("terrain", prog, vx, vxsz, idx, idxsz,
-                                     tx, txsz, norm, vxsz);
-    free(tx);
-    free(norm);
+    /* only there for the bounds and the heightfield, the chunks are what's drawn */
+    float vx[] = {
+        x, y + hmin, z,         x + side, y + hmin, z,
+        x, y + hmax, z + side,  x + side, y + hmax, z + side,
+    };
+    unsigned short idx[] = { 0, 2, 1, 1, 2, 3 };
 
-    //dbg("##### rand height(5,14): %f\n", get_avg_height(5, 14));
-    //dbg("##### rand height(5,14): %f\n", get_avg_height(5, 14));
-    //dbg("##### rand height(6,15): %f\n", get_avg_height(6, 15));
+    model = model3d_new_from_vectors("terrain", prog, vx, sizeof(vx), idx, sizeof(idx),
+                                     NULL, 0, NULL, 0);
     txm = model3dtx_new(ref_pass(model), "terrain.png");
     scene_add_model(s, txm);
     t->entity = entity3d_new(txm);
-    t->entity->txmodel->model->collision_vx = vx;
-    t->entity->txmodel->model->collision_vxsz = vxsz;
-    t->entity->txmodel->model->collision_idx = idx;
-    t->entity->txmodel->model->collision_idxsz = idxsz;
-    t->entity->visible = 1;
+    t->entity->visible = 0;
     t->entity->update  = NULL;
     t->entity->scale = 1;
-    t->entity->skip_culling = true;
     entity3d_reset(t->entity);
     model3dtx_add_entity(txm, t->entity);
-    entity3d_add_physics(t->entity, 0, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
-    ref_put(prog); /* matches shader_prog_find() above */
+    t->entity->phys_body = phys_body_new_heightfield(t->phys, t->entity, t->map, nr_v, side,
+                                                     (vec3){ x, y, z });
+    phys_set_bounds(t->phys, model->aabb);
+    phys_set_heightfield(t->phys, t->entity, model->aabb, terrain_ground_height, t);
+
+    t->scene     = s;
+    t->prog      = prog; /* from shader_prog_find() above */
+    t->nr_chunks = (nr_v - 1 + TERRAIN_CHUNK - 1) / TERRAIN_CHUNK;
+    CHECK(t->chunks = calloc(t->nr_chunks * t->nr_chunks, sizeof(*t->chunks)));
 
     for (i = 0; i < mside; i++)
         for (j = 0; j < mside; j++) {
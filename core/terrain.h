@@ -3,41 +3,52 @@
 #define __CLAP_TERRAIN_H__
 
 #include "object.h"
+#include "render.h"
+
+struct scene;
+struct shader_prog;
+
+/* a piece of the mesh, see terrain_update() */
+struct terrain_chunk {
+    struct model3dtx    *txm;
+    struct entity3d     *entity;
+};
 
 struct terrain {
     struct ref     ref;
+    /* the heightfield's body, never drawn */
     struct entity3d *entity;
+    struct phys    *phys;
+    struct scene   *scene;
+    struct shader_prog *prog;
     long           seed;
-    float *vx, *norm, *tx;
-    unsigned short *idx;
-    size_t         nr_vx;
-    size_t         nr_idx;
 
     float          *map, *map0;
+    /* 3 a point of the map, see terrain_gen_normals() */
+    float          *norm;
     float x, y, z;
     unsigned int   side;
     unsigned int   nr_vert;
+    /* nr_chunks x nr_chunks, by Z then X; those near the camera have meshes */
+    struct terrain_chunk *chunks;
+    unsigned int   nr_chunks;
+    unsigned int   nr_resident;
+    /* the map in a texture and the chunks' shared grid, see terrain_set_vtf() */
+    texture_t      *heights;
+    struct model3dtx *vtf_txm;
 };
 
-static inline size_t terrain_vxsz(struct terrain *t)
-{
-    return t->nr_vx * sizeof(*t->vx) * 3;
-}
-
-static inline size_t terrain_txsz(struct terrain *t)
-{
-    return t->nr_vx * sizeof(*t->vx) * 2;
-}
-
-static inline size_t terrain_idxsz(struct terrain *t)
-{
-    return t->nr_idx * sizeof(*t->idx);
-}
-
 float terrain_height(struct terrain *t, float x, float z);
 void terrain_normal(struct terrain *t, float x, float z, vec3 n);
 struct terrain *terrain_init_square_landscape(struct scene *s, float x, float y, float z, float side, unsigned int nr_v);
 struct terrain *terrain_init_circular_maze(struct scene *s, float x, float y, float z, float side, unsigned int nr_v, unsigned int nr_levels);
+/* build the chunks around @eye, drop the ones far from it */
+void terrain_update(struct terrain *t, const float *eye);
+/* draw the chunks from the map in a texture, -ENOTSUP without vertex textures */
+int terrain_set_vtf(struct terrain *t, bool vtf);
+/* after changing map[x, x + w) by [z, z + h): redo what's drawn from it */
+void terrain_map_changed(struct terrain *t, unsigned int x, unsigned int z, unsigned int w,
+                         unsigned int h);
 void terrain_done(struct terrain *terrain);
 
 #endif /* __CLAP_TERRAIN_H__ */
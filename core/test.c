@@ -1,9 +1,30 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "object.h"
 #include "common.h"
 #include "util.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "librarian.h"
+#include "lib-pack.h"
+#include "json.h"
+#include "xform.h"
+#include "input-delta.h"
+#include "input-record.h"
+#include "histogram.h"
+#include "ktx2.h"
+#include "ca2d.h"
+#include "voxel.h"
+#include "snapshot.h"
+#include "prediction.h"
+#include "objfile.h"
+#include "base64.h"
 
 #define TEST_MAGIC0 0xdeadbeef
 
@@ -105,6 +126,109 @@ static int refcount_test3(void)
     return EXIT_SUCCESS;
 }
 
+struct x1 {
+    struct ref  ref;
+    char        payload[40];
+};
+
+static void x1_drop(struct ref *ref)
+{
+    dropcount++;
+}
+
+DECLARE_REFCLASS(x1, .pooled = true);
+
+static int refcount_test4(void)
+{
+    struct x1 *a, *b, *c;
+
+    reset_counters();
+    a = ref_new(x1);
+    b = ref_new(x1);
+    if (!a || !b || a->ref.alloc != REF_ALLOC_POOL || ref_class_x1.nr_active != 2)
+        return EXIT_FAILURE;
+
+    /* the free list hands the last one freed back first, zeroed */
+    memset(b->payload, 0xff, sizeof(b->payload));
+    ref_put(b);
+    c = ref_new(x1);
+    if (c != b || c->payload[0] || ref_class_x1.nr_active != 2)
+        return EXIT_FAILURE;
+
+    ref_put(a);
+    ref_put(c);
+    if (ref_class_x1.nr_active || dropcount != 3)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int refcount_test5(void)
+{
+    struct x0 *a, *b;
+
+    reset_counters();
+    a = ref_new_frame(x0);
+    b = ref_new_frame(x0);
+    if (!a || !b || a->ref.alloc != REF_ALLOC_FRAME || b == a)
+        return EXIT_FAILURE;
+    a->magic = b->magic = TEST_MAGIC0;
+
+    /* @b is still around, so the arena carries on */
+    ref_put(a);
+    if (ref_frame_end())
+        return EXIT_FAILURE;
+
+    ref_put(b);
+    if (!ref_frame_end() || dropcount != 2 || failcount)
+        return EXIT_FAILURE;
+
+    /* and starts over */
+    b = ref_new_frame(x0);
+    if (b != a)
+        return EXIT_FAILURE;
+    b->magic = TEST_MAGIC0;
+    ref_put(b);
+
+    return ref_frame_end() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int refcount_test6(void)
+{
+    struct mem_stats ms, cpu, gpu, cpu0, gpu0;
+    struct x1 *a, *b;
+
+    reset_counters();
+    mem_stats_total(&cpu0, &gpu0);
+    mem_stats_get(MEM_ANIMATION, &ms);
+    a = ref_new(x1);
+    b = ref_new(x1);
+    ref_put(b);
+    if (ref_class_x1.nr_active != 1 || ref_class_x1.nr_peak < 2)
+        return EXIT_FAILURE;
+
+    /* the peak stays where it got to */
+    mem_account(MEM_ANIMATION, 1000);
+    mem_account(MEM_ANIMATION, -600);
+    mem_account(MEM_GPU_TEXTURE, 4096);
+    mem_stats_total(&cpu, &gpu);
+    if (cpu.live != cpu0.live + sizeof(*a) + 400 || gpu.live != gpu0.live + 4096)
+        return EXIT_FAILURE;
+
+    mem_account(MEM_ANIMATION, -400);
+    mem_account(MEM_GPU_TEXTURE, -4096);
+    mem_stats_get(MEM_ANIMATION, &cpu);
+    if (cpu.live != ms.live || cpu.peak < ms.live + 1000)
+        return EXIT_FAILURE;
+
+    if (!strstr(ref_classes_get_string(), "[animation]"))
+        return EXIT_FAILURE;
+
+    ref_put(a);
+
+    return EXIT_SUCCESS;
+}
+
 struct list_entry {
     struct list entry;
     unsigned int i;
@@ -269,6 +393,47 @@ static int darray_test2(void)
     return EXIT_SUCCESS;
 }
 
+static int darray_test3(void)
+{
+    darray_small(int, da, 4);
+    int i, *small;
+
+    darray_init_small(&da);
+    small = da.x;
+    for (i = 0; i < 4; i++)
+        *(int *)darray_add(&da.da) = i;
+
+    /* still inline */
+    if (da.x != small)
+        return EXIT_FAILURE;
+
+    for (; i < 100; i++)
+        *(int *)darray_add(&da.da) = i;
+
+    if (da.x == small || da.da.nr_alloc < 100 || da.da.nr_alloc >= 200)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < 100; i++)
+        if (da.x[i] != i)
+            return EXIT_FAILURE;
+
+    /* shrinking keeps the memory, growing back zeroes the new elements */
+    darray_resize(&da.da, 10);
+    if (!darray_resize(&da.da, 20) || da.x[9] != 9 || da.x[10])
+        return EXIT_FAILURE;
+
+    darray_clearout(&da.da);
+    if (da.x != small || da.da.nr_el)
+        return EXIT_FAILURE;
+
+    if (darray_reserve(&da.da, 1000) || da.da.nr_alloc != 1000 || da.da.nr_el)
+        return EXIT_FAILURE;
+
+    darray_clearout(&da.da);
+
+    return EXIT_SUCCESS;
+}
+
 static int hashmap_test0(void)
 {
     struct hashmap hm;
@@ -288,7 +453,7 @@ static int hashmap_test0(void)
 
     hashmap_done(&hm);
 
-    if (!list_empty(&hm.list) || hm.nr_buckets)
+    if (hm.nr_items || hm.nr_buckets)
         return EXIT_FAILURE;
 
     return EXIT_SUCCESS;
@@ -329,6 +494,63 @@ static int hashmap_test1(void)
     return EXIT_SUCCESS;
 }
 
+/* growth from a tiny index, deletes in the middle of runs, string keys */
+static int hashmap_test2(void)
+{
+    struct hashmap_test_data ctx = {};
+    struct hashmap hm;
+    char name[16];
+    long i;
+
+    if (!hashmap_init(&hm, 3))
+        return EXIT_FAILURE;
+
+    hashmap_init(&hm, 2);
+    for (i = 1; i < 4096; i++)
+        if (hashmap_insert(&hm, i, (void *)i))
+            return EXIT_FAILURE;
+
+    if (hashmap_insert(&hm, 1, (void *)1) != -EBUSY)
+        return EXIT_FAILURE;
+
+    for (i = 1; i < 4096; i += 2)
+        hashmap_delete(&hm, i);
+
+    for (i = 1; i < 4096; i++)
+        if (hashmap_find(&hm, i) != (i & 1 ? NULL : (void *)i))
+            return EXIT_FAILURE;
+
+    /* emptied out and refilled, still in insertion order */
+    ctx.value = 0;
+    for (i = 2; i < 4096; i += 2)
+        hashmap_delete(&hm, i);
+    for (i = 1; i < 4096; i++)
+        hashmap_insert(&hm, i, (void *)i);
+    hashmap_for_each(&hm, hashmap_cb, &ctx);
+    if (ctx.broken || ctx.value != 4095 || hm.nr_items != 4095)
+        return EXIT_FAILURE;
+
+    hashmap_done(&hm);
+
+    hashmap_init(&hm, 16);
+    for (i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "name%ld", i);
+        if (hashmap_insert_str(&hm, name, (void *)(i + 1)))
+            return EXIT_FAILURE;
+    }
+
+    hashmap_delete_str(&hm, "name50");
+    if (hashmap_find_str(&hm, "name50") || hashmap_find_str(&hm, "name") ||
+        hashmap_find_str(&hm, "name49") != (void *)50 ||
+        hashmap_find_str(&hm, "name99") != (void *)100 ||
+        hashmap_insert_str(&hm, "name0", NULL) != -EBUSY)
+        return EXIT_FAILURE;
+
+    hashmap_done(&hm);
+
+    return EXIT_SUCCESS;
+}
+
 static int bitmap_test0(void)
 {
     struct bitmap b0, b1;
@@ -362,6 +584,1636 @@ static int bitmap_test0(void)
     return EXIT_SUCCESS;
 }
 
+#define SORT_MAX 1000
+static int radix_sort_test0(void)
+{
+    struct sort_item items[SORT_MAX], tmp[SORT_MAX], *res;
+    unsigned long i;
+
+    for (i = 0; i < SORT_MAX; i++) {
+        /* few distinct keys spread across all the bytes */
+        items[i].key = ((uint64_t)(i * 7919 % 13) << 56) | ((i * 31) % 5) << 8;
+        items[i].data = (void *)i;
+    }
+
+    res = radix_sort(items, tmp, SORT_MAX);
+    for (i = 1; i < SORT_MAX; i++) {
+        if (res[i - 1].key > res[i].key)
+            return EXIT_FAILURE;
+        /* stable: equal keys keep their original order */
+        if (res[i - 1].key == res[i].key && res[i - 1].data > res[i].data)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int histogram_test0(void)
+{
+    static struct histogram h;
+    uint64_t p50, p99;
+    unsigned int i;
+
+    if (histogram_percentile(&h, 50))
+        return EXIT_FAILURE;
+
+    /* small values are exact */
+    for (i = 1; i <= 10; i++)
+        histogram_add(&h, i);
+    if (histogram_percentile(&h, 50) != 5 || histogram_percentile(&h, 100) != 10)
+        return EXIT_FAILURE;
+
+    /* 16.6ms frames with a 100ms hitch every 100 */
+    histogram_reset(&h);
+    for (i = 0; i < 1000; i++)
+        histogram_add(&h, i % 100 ? 16667 : 100000);
+
+    p50 = histogram_percentile(&h, 50);
+    p99 = histogram_percentile(&h, 99);
+    if (p50 < 16667 || p50 > 16667 + 16667 / HIST_SUB)
+        return EXIT_FAILURE;
+    if (p99 != p50 || histogram_percentile(&h, 99.5) != 100000 || h.max != 100000)
+        return EXIT_FAILURE;
+
+    /* off the scale still counts, and the max is exact */
+    histogram_add(&h, 1ull << 40);
+    if (histogram_percentile(&h, 100) != 1ull << 40 || h.count != 1001)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+#define BVH_MAX 256
+static void bvh_test_cb(void *data, bool inside, void *priv)
+{
+    int *hits = priv;
+
+    hits[(long)data]++;
+}
+
+static void bvh_test_views_cb(void *data, unsigned int mask, unsigned int inside, void *priv)
+{
+    int *masks = priv;
+
+    masks[(long)data] |= mask;
+}
+
+static int bvh_test0(void)
+{
+    /* x in [-10, 10], everything else wide open */
+    float planes[6][4] = {
+        { 1, 0, 0, 10 }, { -1, 0, 0, 10 },
+        { 0, 1, 0, 1000 }, { 0, -1, 0, 1000 },
+        { 0, 0, 1, 1000 }, { 0, 0, -1, 1000 },
+    };
+    int nodes[BVH_MAX], hits[BVH_MAX];
+    struct bvh bvh;
+    long i;
+
+    bvh_init(&bvh, 0.5);
+    /* unit boxes along x: [-128, 128) */
+    for (i = 0; i < BVH_MAX; i++) {
+        float aabb[6] = { i - 128, i - 127, 0, 1, 0, 1 };
+
+        nodes[i] = bvh_insert(&bvh, aabb, (void *)i);
+        if (nodes[i] < 0)
+            return EXIT_FAILURE;
+    }
+
+    memset(hits, 0, sizeof(hits));
+    bvh_query_frustum(&bvh, planes, bvh_test_cb, hits);
+    /* fattened boxes may let one more in on either side, not fewer */
+    for (i = 0; i < BVH_MAX; i++)
+        if (i >= 118 && i < 138 && hits[i] != 1)
+            return EXIT_FAILURE;
+        else if ((i < 117 || i > 138) && hits[i])
+            return EXIT_FAILURE;
+
+    /* move the first one into the frustum, drop the one in the middle */
+    float aabb[6] = { 0, 1, 0, 1, 0, 1 };
+    bvh_move(&bvh, nodes[0], aabb);
+    bvh_remove(&bvh, nodes[128]);
+
+    memset(hits, 0, sizeof(hits));
+    bvh_query_frustum(&bvh, planes, bvh_test_cb, hits);
+    if (hits[0] != 1 || hits[128])
+        return EXIT_FAILURE;
+
+    if (bvh.nr_leaves != BVH_MAX - 1)
+        return EXIT_FAILURE;
+
+    /* the same, plus x in [50, 60], in one go */
+    float other[6][4] = {
+        { 1, 0, 0, -50 }, { -1, 0, 0, 60 },
+        { 0, 1, 0, 1000 }, { 0, -1, 0, 1000 },
+        { 0, 0, 1, 1000 }, { 0, 0, -1, 1000 },
+    };
+    float (*views[])[4] = { planes, other };
+
+    memset(hits, 0, sizeof(hits));
+    bvh_query_frustums(&bvh, views, 2, bvh_test_views_cb, hits);
+    if (hits[0] != 1 || hits[128])
+        return EXIT_FAILURE;
+    for (i = 1; i < BVH_MAX; i++)
+        if (i >= 118 && i < 138 && i != 128 && !(hits[i] & 1))
+            return EXIT_FAILURE;
+        else if (i >= 179 && i < 188 && hits[i] != 2)
+            return EXIT_FAILURE;
+        else if ((i < 117 || (i > 138 && i < 177) || i > 189) && hits[i])
+            return EXIT_FAILURE;
+
+    bvh_done(&bvh);
+    return EXIT_SUCCESS;
+}
+
+/* the center of bvh_test0's boxes, odd ones are skipped */
+static float bvh_test_dist(void *data, const float *point, void *priv)
+{
+    long i = (long)data;
+    float dx = i - 127.5 - point[0], dy = 0.5 - point[1], dz = 0.5 - point[2];
+
+    if (priv && (i & 1))
+        return -1;
+
+    return dx * dx + dy * dy + dz * dz;
+}
+
+static int bvh_test1(void)
+{
+    float point[3] = { 0.3, 0.5, 0.5 };
+    struct bvh_hit hits[3];
+    int sphere[BVH_MAX];
+    struct bvh bvh;
+    long i;
+
+    bvh_init(&bvh, 0.5);
+    for (i = 0; i < BVH_MAX; i++) {
+        float aabb[6] = { i - 128, i - 127, 0, 1, 0, 1 };
+
+        if (bvh_insert(&bvh, aabb, (void *)i) < 0)
+            return EXIT_FAILURE;
+    }
+
+    if (bvh_nearest(&bvh, point, 10, bvh_test_dist, NULL, hits, 3) != 3 ||
+        (long)hits[0].data != 128 || (long)hits[1].data != 127 || (long)hits[2].data != 129 ||
+        hits[0].dist > hits[1].dist || hits[1].dist > hits[2].dist)
+        return EXIT_FAILURE;
+
+    /* the filter, and the radius */
+    if (bvh_nearest(&bvh, point, 10, bvh_test_dist, &bvh, hits, 3) != 3 ||
+        (long)hits[0].data != 128 || (long)hits[1].data != 126 || (long)hits[2].data != 130)
+        return EXIT_FAILURE;
+
+    if (bvh_nearest(&bvh, point, 1, bvh_test_dist, NULL, hits, 3) != 2)
+        return EXIT_FAILURE;
+
+    /* centers within 2 of x = 0.5 are 126..130 */
+    point[0] = 0.5;
+    memset(sphere, 0, sizeof(sphere));
+    bvh_query_sphere(&bvh, point, 2, bvh_test_cb, sphere);
+    for (i = 0; i < BVH_MAX; i++)
+        if (i >= 126 && i <= 130 && sphere[i] != 1)
+            return EXIT_FAILURE;
+        else if ((i < 124 || i > 132) && sphere[i])
+            return EXIT_FAILURE;
+
+    bvh_done(&bvh);
+    return EXIT_SUCCESS;
+}
+
+#define JOBS_MAX 1000
+static void jobs_test_fn(unsigned int idx, void *priv)
+{
+    atomic_int *hits = priv;
+
+    atomic_fetch_add(&hits[idx], 1);
+}
+
+static int jobs_test0(void)
+{
+    static atomic_int hits[JOBS_MAX];
+    int i, round;
+
+    if (jobs_init(3))
+        return EXIT_FAILURE;
+
+    /* back to back batches, each index exactly once per batch */
+    for (round = 1; round <= 10; round++) {
+        jobs_parallel_for(JOBS_MAX, jobs_test_fn, hits);
+        for (i = 0; i < JOBS_MAX; i++)
+            if (atomic_load(&hits[i]) != round)
+                return EXIT_FAILURE;
+    }
+
+    jobs_done();
+    return EXIT_SUCCESS;
+}
+
+struct jobs_dep_test {
+    atomic_int  stage;
+    atomic_int  order_ok;
+};
+
+static void jobs_dep_first(void *priv)
+{
+    struct jobs_dep_test *t = priv;
+
+    atomic_fetch_add(&t->stage, 1);
+}
+
+static void jobs_dep_second(void *priv)
+{
+    struct jobs_dep_test *t = priv;
+
+    /* all of the first stage must be done by now */
+    if (atomic_load(&t->stage) == JOBS_MAX / 10)
+        atomic_fetch_add(&t->order_ok, 1);
+}
+
+static int jobs_test1(void)
+{
+    struct jobs_dep_test t;
+    struct job_counter first, second;
+    int i;
+
+    if (jobs_init(3))
+        return EXIT_FAILURE;
+
+    atomic_init(&t.stage, 0);
+    atomic_init(&t.order_ok, 0);
+    job_counter_init(&first);
+    job_counter_init(&second);
+
+    for (i = 0; i < JOBS_MAX / 10; i++)
+        if (jobs_submit(jobs_dep_first, &t, &first))
+            return EXIT_FAILURE;
+
+    for (i = 0; i < JOBS_MAX / 10; i++)
+        if (jobs_submit_after(jobs_dep_second, &t, &second, &first))
+            return EXIT_FAILURE;
+
+    jobs_wait(&second);
+    if (!job_counter_done(&first) || atomic_load(&t.order_ok) != JOBS_MAX / 10)
+        return EXIT_FAILURE;
+
+    jobs_done();
+    return EXIT_SUCCESS;
+}
+
+#define JOBS_STRESS_SEEDS 64
+#define JOBS_STRESS_MAX   20000
+
+struct jobs_stress_test {
+    struct job_counter  counter;
+    atomic_int          spawned;
+    atomic_int          ran;
+    atomic_int          broken;
+};
+
+/* each one queues the next, for the workers to steal as soon as it's there */
+static void jobs_stress_fn(void *priv)
+{
+    struct jobs_stress_test *t = priv;
+    int i;
+
+    /* more than was ever submitted: it went below zero */
+    for (i = 0; i < 100; i++)
+        if (jobs_nr_queued() > JOBS_STRESS_SEEDS + JOBS_STRESS_MAX)
+            atomic_store(&t->broken, 1);
+
+    if (atomic_fetch_add(&t->spawned, 1) < JOBS_STRESS_MAX &&
+        jobs_submit(jobs_stress_fn, t, &t->counter))
+        atomic_store(&t->broken, 1);
+
+    atomic_fetch_add(&t->ran, 1);
+}
+
+static int jobs_test2(void)
+{
+    struct jobs_stress_test t;
+    int i;
+
+    if (jobs_init(3))
+        return EXIT_FAILURE;
+
+    job_counter_init(&t.counter);
+    atomic_init(&t.spawned, 0);
+    atomic_init(&t.ran, 0);
+    atomic_init(&t.broken, 0);
+
+    for (i = 0; i < JOBS_STRESS_SEEDS; i++)
+        if (jobs_submit(jobs_stress_fn, &t, &t.counter))
+            return EXIT_FAILURE;
+
+    jobs_wait(&t.counter);
+    if (atomic_load(&t.broken) || jobs_nr_queued() ||
+        atomic_load(&t.ran) != JOBS_STRESS_SEEDS + JOBS_STRESS_MAX)
+        return EXIT_FAILURE;
+
+    jobs_done();
+    return EXIT_SUCCESS;
+}
+
+struct messagebus_test {
+    atomic_int      nr;
+    int             nr_cmds;
+    int             nr_inputs;
+    unsigned int    last_x;
+    float           wheel;
+    bool            broken;
+};
+
+static struct messagebus_test mb_test;
+
+static void messagebus_post_fn(unsigned int idx, void *priv)
+{
+    struct message m = { .type = MT_COMMAND, .cmd.fps = idx };
+
+    if (message_post(&m))
+        mb_test.broken = true;
+    atomic_fetch_add(&mb_test.nr, 1);
+}
+
+static int messagebus_test_cmd(struct message *m, void *data)
+{
+    mb_test.nr_cmds++;
+    return MSG_HANDLED;
+}
+
+static int messagebus_test_input(struct message *m, void *data)
+{
+    mb_test.nr_inputs++;
+    mb_test.last_x = m->input.x;
+    mb_test.wheel += m->input.delta_ly;
+    if (m->input.left && m->input.mouse_move)
+        mb_test.broken = true;
+    return MSG_HANDLED;
+}
+
+static int messagebus_test0(void)
+{
+    struct message_source kbd = { .type = MST_KEYBOARD, .name = "keyboard" };
+    struct message m = { .type = MT_INPUT };
+    int i;
+
+    subscribe(MT_COMMAND, messagebus_test_cmd, NULL);
+    subscribe(MT_INPUT, messagebus_test_input, NULL);
+
+    if (jobs_init(3))
+        return EXIT_FAILURE;
+
+    /* nothing gets there before the drain */
+    jobs_parallel_for(JOBS_MAX, messagebus_post_fn, NULL);
+    jobs_done();
+    if (mb_test.nr_cmds || atomic_load(&mb_test.nr) != JOBS_MAX)
+        return EXIT_FAILURE;
+
+    messagebus_drain();
+    if (mb_test.nr_cmds != JOBS_MAX)
+        return EXIT_FAILURE;
+
+    /* 3 moves, a click, 2 moves: the moves merge into the last of each run */
+    for (i = 1; i <= 6; i++) {
+        memset(&m.input, 0, sizeof(m.input));
+        m.input.mouse_move = i != 4;
+        m.input.left = i == 4;
+        m.input.x = i;
+        message_post(&m);
+    }
+
+    messagebus_drain();
+    if (mb_test.nr_inputs != 3 || mb_test.last_x != 6 || mb_test.broken)
+        return EXIT_FAILURE;
+
+    /* wheel clicks are relative, none of them get lost */
+    memset(&m.input, 0, sizeof(m.input));
+    m.source = &kbd;
+    m.input.delta_ly = 1;
+    for (i = 0; i < 2; i++)
+        message_post(&m);
+
+    messagebus_drain();
+    if (mb_test.nr_inputs != 5 || mb_test.wheel != 2)
+        return EXIT_FAILURE;
+
+    /* and the synchronous path is still there */
+    m.input.delta_ly = 0;
+    message_send(&m);
+    if (mb_test.nr_inputs != 6)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int messagebus_filter_hits;
+
+static int messagebus_test_filter(struct message *m, void *data)
+{
+    messagebus_filter_hits++;
+    return MSG_HANDLED;
+}
+
+static int messagebus_test1(void)
+{
+    struct message m = { .type = MT_INPUT };
+
+    subscribe_mask(MT_INPUT, messagebus_test_filter, NULL, MSG_INPUT(pad_lb) | MSG_INPUT_TRIGGERS);
+    subscribe_mask(MT_COMMAND, messagebus_test_filter, NULL, MSG_COMMAND(restart));
+
+    /* analog motion and other buttons go past it */
+    m.input.delta_lx = 0.5;
+    m.input.pad_a = 1;
+    message_send(&m);
+    if (messagebus_filter_hits ||
+        message_mask(&m) != (MSG_INPUT(pad_a) | MSG_INPUT_DELTA_L))
+        return EXIT_FAILURE;
+
+    m.input.trigger_r = 0.1;
+    message_send(&m);
+    m.input.trigger_r = 0;
+    m.input.pad_lb = 2;
+    message_send(&m);
+    if (messagebus_filter_hits != 2)
+        return EXIT_FAILURE;
+
+    m = (struct message){ .type = MT_COMMAND, .cmd.status = 1 };
+    message_send(&m);
+    m.cmd.restart = 1;
+    message_send(&m);
+    if (messagebus_filter_hits != 3)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int lib_cache_test0(void)
+{
+    char dir[] = "/tmp/clap-test-XXXXXX", base[PATH_MAX];
+    char key[LIB_CACHE_KEY_MAX], key2[LIB_CACHE_KEY_MAX];
+    const char src[] = "source", a[] = "processed", b[] = " asset";
+    struct iovec iov[] = {
+        { .iov_base = (void *)a, .iov_len = sizeof(a) - 1 },
+        { .iov_base = (void *)b, .iov_len = sizeof(b) },
+    };
+    int ret = EXIT_FAILURE;
+    SHA1_CTX ctx;
+    size_t size;
+    void *buf;
+
+    if (!mkdtemp(dir))
+        return EXIT_FAILURE;
+    snprintf(base, sizeof(base), "%s/", dir);
+    librarian_init(base);
+
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (void *)src, sizeof(src));
+    lib_cache_key(key, "test", 1, &ctx);
+
+    /* a different version is a different entry */
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (void *)src, sizeof(src));
+    lib_cache_key(key2, "test", 2, &ctx);
+    if (!strcmp(key, key2))
+        goto out;
+
+    if (lib_cache_get(key, &buf, &size) != -ENOENT)
+        goto out;
+
+    if (lib_cache_put(key, iov, array_size(iov)))
+        goto out;
+
+    if (lib_cache_get(key, &buf, &size))
+        goto out;
+
+    if (size == sizeof(a) + sizeof(b) - 1 && !strcmp(buf, "processed asset") &&
+        lib_cache_get(key2, &buf, &size) == -ENOENT)
+        ret = EXIT_SUCCESS;
+    free(buf);
+
+out:
+    snprintf(base, sizeof(base), "%s/state/cache/%s", dir, key);
+    unlink(base);
+    snprintf(base, sizeof(base), "%s/state/cache", dir);
+    rmdir(base);
+    snprintf(base, sizeof(base), "%s/state", dir);
+    rmdir(base);
+    if (rmdir(dir))
+        ret = EXIT_FAILURE;
+    librarian_init("./");
+
+    return ret;
+}
+
+static int lib_pack_test0(void)
+{
+    char dir[] = "/tmp/clap-test-XXXXXX", base[PATH_MAX];
+    const char names[] = "asset/a.json\0asset/glsl/b.vert";
+    char plain[] = "{}", text[4096], zbuf[4096];
+    struct lib_pack_hdr hdr = {
+        .magic      = LIB_PACK_MAGIC,
+        .version    = LIB_PACK_VERSION,
+        .nr_entries = 2,
+        .names_off  = sizeof(hdr) + 2 * sizeof(struct lib_pack_entry),
+        .names_size = sizeof(names),
+    };
+    struct lib_pack_entry entries[2] = {
+        { .offset = 256, .packed_size = sizeof(plain) - 1, .size = sizeof(plain) - 1 },
+        { .offset = 272, .size = sizeof(text), .name_off = 13, .compression = LIB_PACK_ZLIB },
+    };
+    uLongf zsize = sizeof(zbuf);
+    struct lib_handle *h;
+    int ret = EXIT_FAILURE;
+    struct stat st;
+    size_t size;
+    void *buf;
+    FILE *f;
+
+    memset(text, 'x', sizeof(text));
+    if (!mkdtemp(dir) || compress((Bytef *)zbuf, &zsize, (Bytef *)text, sizeof(text)) != Z_OK)
+        return EXIT_FAILURE;
+    entries[1].packed_size = zsize;
+
+    snprintf(base, sizeof(base), "%s/" LIB_PACK_NAME, dir);
+    f = fopen(base, "w");
+    if (!f)
+        goto out;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(entries, sizeof(entries), 1, f);
+    fwrite(names, sizeof(names), 1, f);
+    fseek(f, entries[0].offset, SEEK_SET);
+    fwrite(plain, entries[0].packed_size, 1, f);
+    fseek(f, entries[1].offset, SEEK_SET);
+    fwrite(zbuf, zsize, 1, f);
+    fclose(f);
+
+    /* there's no asset/ directory, everything comes from the pack */
+    snprintf(base, sizeof(base), "%s/", dir);
+    librarian_init(base);
+
+    h = lib_read_file(RES_ASSET, "a.json", &buf, &size);
+    if (!h || size != 2 || strcmp(buf, "{}"))
+        goto out_init;
+    ref_put(h);
+
+    h = lib_read_file(RES_ASSET, "glsl/b.vert", &buf, &size);
+    if (!h || size != sizeof(text) || memcmp(buf, text, size))
+        goto out_init;
+    ref_put(h);
+
+    if (lib_stat(RES_ASSET, "glsl/b.vert", &st) || st.st_size != sizeof(text) ||
+        lib_stat(RES_ASSET, "c.png", &st) != -ENOENT)
+        goto out_init;
+
+    ret = EXIT_SUCCESS;
+
+out_init:
+    librarian_init("./");
+out:
+    snprintf(base, sizeof(base), "%s/" LIB_PACK_NAME, dir);
+    unlink(base);
+    if (rmdir(dir))
+        ret = EXIT_FAILURE;
+
+    return ret;
+}
+
+struct lib_async_test {
+    char            order[8];
+    unsigned int    nr;
+};
+
+static void lib_async_test_done(struct lib_handle *h, void *data)
+{
+    struct lib_async_test *t = data;
+
+    if (h->state == RES_LOADED && t->nr < sizeof(t->order) - 1)
+        t->order[t->nr++] = *(char *)h->buf;
+    ref_put(h);
+}
+
+static int lib_async_test_decode(struct lib_handle *h, void *data)
+{
+    *(char *)h->buf -= 'a' - 'A';
+    return 0;
+}
+
+static int lib_async_test0(void)
+{
+    char dir[] = "/tmp/clap-test-XXXXXX", base[PATH_MAX];
+    const char *names[] = { "a", "b", "c", "d" };
+    struct lib_async_test t = {};
+    struct lib_handle *h;
+    int i, ret = EXIT_FAILURE;
+    unsigned int before;
+    FILE *f;
+
+    if (!mkdtemp(dir))
+        return EXIT_FAILURE;
+    snprintf(base, sizeof(base), "%s/asset", dir);
+    if (mkdir(base, 0700))
+        goto out_dir;
+
+    for (i = 0; i < array_size(names); i++) {
+        snprintf(base, sizeof(base), "%s/asset/%s", dir, names[i]);
+        f = fopen(base, "w");
+        if (!f)
+            goto out;
+        fputs(names[i], f);
+        fclose(f);
+    }
+
+    snprintf(base, sizeof(base), "%s/", dir);
+    librarian_init(base);
+
+    /*
+     * No workers: one read at a time, right when it's dispatched, so the
+     * queue order shows; a second request for "b" rides along with the first
+     */
+    if (jobs_nr_workers())
+        goto out_init;
+
+    h = lib_request_async(RES_ASSET, "a", LIB_PRIO_LOW, NULL, lib_async_test_done, &t);
+    ref_put(h);
+    h = lib_request_async(RES_ASSET, "b", LIB_PRIO_NORMAL, NULL, lib_async_test_done, &t);
+    ref_put(h);
+    h = lib_request_async(RES_ASSET, "c", LIB_PRIO_HIGH, NULL, lib_async_test_done, &t);
+    ref_put(h);
+    h = lib_request_async(RES_ASSET, "d", LIB_PRIO_NORMAL, NULL, lib_async_test_done, &t);
+    ref_put(h);
+    h = lib_request_async(RES_ASSET, "b", LIB_PRIO_HIGH, NULL, lib_async_test_done, &t);
+    ref_put(h);
+
+    /* nothing is delivered outside of librarian_poll() */
+    if (t.nr)
+        goto out_init;
+
+    for (i = 0; i < 10 && t.nr < 5; i++)
+        librarian_poll(LIB_POLL_BUDGET_US);
+    if (strcmp(t.order, "acbbd"))
+        goto out_init;
+
+    /* with workers, and a budget of nothing: one completion per poll */
+    if (jobs_init(3))
+        goto out_init;
+
+    memset(&t, 0, sizeof(t));
+    for (i = 0; i < array_size(names); i++) {
+        h = lib_request_async(RES_ASSET, names[i], LIB_PRIO_NORMAL, lib_async_test_decode,
+                              lib_async_test_done, &t);
+        ref_put(h);
+    }
+
+    for (i = 0; i < 100000 && t.nr < array_size(names); i++) {
+        before = t.nr;
+        librarian_poll(0);
+        if (t.nr - before > 1)
+            goto out_jobs;
+        if (t.nr == before)
+            usleep(100);
+    }
+
+    /* decoded on the workers */
+    if (t.nr == array_size(names) && strspn(t.order, "ABCD") == array_size(names))
+        ret = EXIT_SUCCESS;
+
+out_jobs:
+    jobs_done();
+out_init:
+    librarian_init("./");
+out:
+    for (i = 0; i < array_size(names); i++) {
+        snprintf(base, sizeof(base), "%s/asset/%s", dir, names[i]);
+        unlink(base);
+    }
+    snprintf(base, sizeof(base), "%s/asset", dir);
+    rmdir(base);
+out_dir:
+    if (rmdir(dir))
+        ret = EXIT_FAILURE;
+
+    return ret;
+}
+
+static const char json_doc[] =
+    "{\"name\": \"t\\u00e9st \\\"quoted\\\"\", \"n\": [1, 2.5, -3e2, true, false, null],"
+    " \"nested\": {\"empty\": {}, \"list\": []}}";
+
+static int json_test0(void)
+{
+    JsonNode *root, *ref, *n;
+    int i, ret = EXIT_FAILURE;
+    char *a, *b, *big;
+    size_t off = 0;
+
+    root = json_decode_arena(json_doc);
+    ref = json_decode(json_doc);
+    if (!root || !ref || !json_check(root, NULL))
+        goto out;
+
+    a = json_encode(root);
+    b = json_encode(ref);
+    if (!strcmp(a, b) &&
+        (n = json_find_member(root, "name")) && !strcmp(n->string_, "t\xc3\xa9st \"quoted\"") &&
+        (n = json_find_member(root, "nested")) && n->parent == root)
+        ret = EXIT_SUCCESS;
+    free(a);
+    free(b);
+
+    /* only unlinks it */
+    json_delete(json_find_member(root, "n"));
+    if (json_find_member(root, "n"))
+        ret = EXIT_FAILURE;
+
+    /* enough for a few chunks */
+    big = malloc(200000);
+    off += sprintf(big, "[");
+    for (i = 0; i < 10000; i++)
+        off += sprintf(big + off, "%s\"%d\"", i ? "," : "", i);
+    sprintf(big + off, "]");
+    json_free(root);
+    root = json_decode_arena(big);
+    free(big);
+    if (!root || json_arraysz(root) != 10000 ||
+        strcmp(json_find_element(root, 9999)->string_, "9999"))
+        ret = EXIT_FAILURE;
+
+    if (json_decode_arena("[1, 2") || json_decode_arena("{\"a\": 1} x"))
+        ret = EXIT_FAILURE;
+
+out:
+    json_free(root);
+    json_free(ref);
+
+    return ret;
+}
+
+struct json_sax_test {
+    unsigned int    values;
+    unsigned int    max_depth;
+    unsigned int    starts, ends;
+    double          sum;
+    bool            found;
+    unsigned int    stop_after;
+};
+
+static bool json_sax_test_cb(const struct json_sax_event *ev, void *priv)
+{
+    struct json_sax_test *t = priv;
+
+    if (ev->tag == JSON_ARRAY || ev->tag == JSON_OBJECT) {
+        if (ev->end)
+            t->ends++;
+        else
+            t->starts++;
+    } else {
+        t->values++;
+    }
+
+    t->max_depth = max(t->max_depth, ev->depth);
+    if (ev->tag == JSON_NUMBER)
+        t->sum += ev->number_;
+    if (ev->tag == JSON_STRING && ev->key && !strcmp(ev->key, "name") && ev->depth == 1)
+        t->found = !strcmp(ev->string_, "t\xc3\xa9st \"quoted\"");
+
+    return !t->stop_after || t->values < t->stop_after;
+}
+
+static int json_test1(void)
+{
+    struct json_sax_test t = {};
+
+    if (!json_sax(json_doc, json_sax_test_cb, &t))
+        return EXIT_FAILURE;
+
+    /* the root, "n", "nested", "empty" and "list" */
+    if (t.values != 7 || t.starts != 5 || t.ends != 5 || t.max_depth != 2 ||
+        t.sum != 1 + 2.5 - 300 || !t.found)
+        return EXIT_FAILURE;
+
+    if (json_sax("[1, 2", json_sax_test_cb, &t))
+        return EXIT_FAILURE;
+
+    /* the callback can stop it */
+    memset(&t, 0, sizeof(t));
+    t.stop_after = 2;
+    if (json_sax(json_doc, json_sax_test_cb, &t) || t.values != 2)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int xform_test0(void)
+{
+    int h[XFORM_CHUNK + 2], i, ret = EXIT_FAILURE;
+    float pos[] = { 1, 2, 3 }, rot[] = { 0, 0, 0 };
+    struct matrix4f *mx;
+
+    for (i = 0; i < array_size(h); i++)
+        if ((h[i] = xform_alloc()) < 0)
+            goto out;
+
+    /* the first chunk stays put while the store grows */
+    mx = xform_mx(h[1]);
+    if (xforms.nr_chunks != 2 || mx != xform_mx(h[1]) || mx->cell[0] != 1)
+        goto out;
+
+    if (!xform_commit(h[1], pos, rot, 2) || xform_commit(h[1], pos, rot, 2))
+        goto out;
+
+    xform_rebuild(h[1]);
+    if (mx->m[3][0] != 1 || mx->m[3][1] != 2 || mx->m[3][2] != 3 || mx->m[0][0] != 2)
+        goto out;
+
+    /* freed handles come back first, reset */
+    xform_free(h[1]);
+    if (xform_alloc() != h[1] || mx->m[3][0] != 0 || xform_chunk(h[1])->scale[1] != 0)
+        goto out;
+
+    ret = EXIT_SUCCESS;
+out:
+    xform_store_done();
+    return ret;
+}
+
+/* the one from before the SIMD kernels */
+static void mat4x4_mul_ref(mat4x4 M, mat4x4 a, mat4x4 b)
+{
+    int k, r, c;
+
+    for (c = 0; c < 4; c++)
+        for (r = 0; r < 4; r++)
+            for (M[c][r] = 0, k = 0; k < 4; k++)
+                M[c][r] += a[k][r] * b[c][k];
+}
+
+static bool mat4x4_near(mat4x4 a, mat4x4 b)
+{
+    int i, j;
+
+    for (i = 0; i < 4; i++)
+        for (j = 0; j < 4; j++)
+            if (fabsf(a[i][j] - b[i][j]) > 1e-5)
+                return false;
+
+    return true;
+}
+
+static int linmath_test0(void)
+{
+    vec3 t[2] = { { 1, 2, 3 }, { -1, 0, 5 } }, s[2] = { { 1, 2, 0.5 }, { 3, 3, 3 } };
+    quat r[2] = { { 0, 0, 0, 1 } };
+    mat4x4 a, b, ref, res, rot, trs[2], tmp;
+    vec4 v = { 1, 2, 3, 1 }, vr;
+
+    mat4x4_translate(a, 1, 2, 3);
+    mat4x4_rotate(a, a, 1, 1, 0, 0.7);
+    mat4x4_scale_aniso(a, a, 1, 2, 3);
+    mat4x4_rotate(b, a, 0, 1, 1, -1.3);
+
+    /* in place, either way */
+    mat4x4_mul_ref(ref, a, b);
+    mat4x4_dup(res, a);
+    mat4x4_mul(res, res, b);
+    if (!mat4x4_near(res, ref))
+        return EXIT_FAILURE;
+    mat4x4_dup(res, b);
+    mat4x4_mul(res, a, res);
+    if (!mat4x4_near(res, ref))
+        return EXIT_FAILURE;
+
+    mat4x4_mul_vec4(vr, a, v);
+    if (fabsf(vr[0] - (a[0][0] + a[1][0] * 2 + a[2][0] * 3 + a[3][0])) > 1e-5)
+        return EXIT_FAILURE;
+
+    /* the two column ones against the general rotation */
+    mat4x4_rotate_X(res, a, 0.4);
+    mat4x4_rotate(ref, a, 1, 0, 0, 0.4);
+    if (!mat4x4_near(res, ref))
+        return EXIT_FAILURE;
+    mat4x4_rotate_Y(res, a, 0.4);
+    mat4x4_rotate(ref, a, 0, 1, 0, 0.4);
+    if (!mat4x4_near(res, ref))
+        return EXIT_FAILURE;
+    mat4x4_dup(res, a);
+    mat4x4_rotate_Z(res, res, 0.4);
+    mat4x4_rotate(ref, a, 0, 0, 1, 0.4);
+    if (!mat4x4_near(res, ref))
+        return EXIT_FAILURE;
+
+    /* T * R * S */
+    quat_rotate(r[1], 0.9, (vec3){ 0, 0.6, 0.8 });
+    mat4x4_from_trs_n(trs, t, r, s, 2);
+    mat4x4_translate(ref, t[1][0], t[1][1], t[1][2]);
+    mat4x4_from_quat(rot, r[1]);
+    mat4x4_mul_ref(tmp, ref, rot);
+    mat4x4_identity(rot);
+    rot[0][0] = s[1][0];
+    rot[1][1] = s[1][1];
+    rot[2][2] = s[1][2];
+    mat4x4_mul_ref(ref, tmp, rot);
+    if (!mat4x4_near(trs[1], ref) || trs[0][1][1] != 2 || trs[0][3][2] != 3)
+        return EXIT_FAILURE;
+
+    mat4x4_mul_ref(ref, trs[1], trs[1]);
+    mat4x4_mul_n(trs, trs, trs, 2);
+    if (!mat4x4_near(trs[1], ref))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static struct input_record_test {
+    unsigned int    nr_inputs, nr_cmds;
+    unsigned int    last_x;
+} ir_test;
+
+static int input_record_test_msg(struct message *m, void *data)
+{
+    if (!m->source || m->source->type != MST_REPLAY)
+        return MSG_HANDLED;
+
+    if (m->type == MT_INPUT) {
+        ir_test.nr_inputs++;
+        ir_test.last_x = m->input.x;
+    } else {
+        ir_test.nr_cmds++;
+    }
+
+    return MSG_HANDLED;
+}
+
+static int input_record_test0(void)
+{
+    struct message_source src = { .type = MST_CLIENT, .name = "test" };
+    char path[] = "/tmp/clap-input-XXXXXX";
+    struct message m = { .type = MT_INPUT };
+    int fd, i, ret = EXIT_FAILURE;
+    unsigned long r0, r1;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        return EXIT_FAILURE;
+    close(fd);
+
+    subscribe(MT_INPUT, input_record_test_msg, NULL);
+    subscribe(MT_COMMAND, input_record_test_msg, NULL);
+
+    if (input_record_start(path, 1234))
+        goto out;
+    r0 = rand();
+
+    /* frame 1: an input; frame 3: another one and a command from the network */
+    input_record_frame();
+    m.input.pad_a = 1;
+    m.input.x = 1;
+    message_send(&m);
+    input_record_frame();
+    input_record_frame();
+    m.input.x = 3;
+    message_send(&m);
+    m = (struct message){ .type = MT_COMMAND, .source = &src, .cmd.connect = 1 };
+    message_send(&m);
+    /* the engine's own commands are left out */
+    m.source = NULL;
+    message_send(&m);
+    input_record_stop();
+
+    if (input_replay_start(path) != 4 || !input_replay_active())
+        goto out;
+    /* same seed */
+    r1 = rand();
+
+    for (i = 1; i <= 4; i++) {
+        input_record_frame();
+        messagebus_drain();
+        if ((i == 1 && (ir_test.nr_inputs != 1 || ir_test.last_x != 1)) ||
+            (i == 2 && ir_test.nr_inputs != 1) ||
+            (i == 3 && (ir_test.nr_inputs != 2 || ir_test.last_x != 3 || ir_test.nr_cmds != 1)))
+            goto out;
+    }
+
+    if (r0 == r1 && !input_replay_active() && ir_test.nr_cmds == 1)
+        ret = EXIT_SUCCESS;
+
+out:
+    input_replay_stop();
+    unlink(path);
+
+    return ret;
+}
+
+static int input_delta_test0(void)
+{
+    struct message_input mi = { .left = 1, .pad_a = 2, .exit = 1, .delta_lx = 0.5, .x = 100 };
+    struct input_history sent = {}, received = {};
+    struct input_state st, out;
+    uint8_t buf[INPUT_DELTA_MAX];
+    unsigned int i;
+    size_t len;
+
+    /* nothing to go against yet: full state */
+    input_state_pack(&st, &mi);
+    st.seq = 1;
+    len = input_delta_encode(buf, &st, NULL);
+    input_history_add(&sent, &st);
+    if (input_delta_decode(buf, len - 1, &out, &received) != -EAGAIN ||
+        input_delta_decode(buf, len, &out, &received) != len)
+        return EXIT_FAILURE;
+
+    input_state_unpack(&out, &mi);
+    if (mi.left != 1 || mi.pad_a != 2 || mi.exit != 1 || mi.delta_lx != 0.5 || mi.x != 100)
+        return EXIT_FAILURE;
+
+    /* one button changes against the acknowledged state */
+    mi.left = 2;
+    input_state_pack(&st, &mi);
+    st.seq = 2;
+    len = input_delta_encode(buf, &st, input_history_find(&sent, 1));
+    if (len > sizeof(struct message_input) / 8 ||
+        input_delta_decode(buf, len, &out, &received) != len)
+        return EXIT_FAILURE;
+
+    input_state_unpack(&out, &mi);
+    if (mi.left != 2 || mi.pad_a != 2 || mi.delta_lx != 0.5 || mi.x != 100)
+        return EXIT_FAILURE;
+
+    /* against a state the receiver never saw */
+    st.seq = 3;
+    len = input_delta_encode(buf, &st, &(struct input_state){ .seq = 40 });
+    if (input_delta_decode(buf, len, &out, &received) != -ENOENT ||
+        input_delta_size(buf, len) != len)
+        return EXIT_FAILURE;
+
+    /* whatever is in the padding after debug_action is not a button */
+    memset(&mi, 0xff, sizeof(mi));
+    memset(&mi, 0, offsetof(struct message_input, debug_action) + 1);
+    input_state_pack(&st, &mi);
+    for (i = 0; i < INPUT_BUTTON_BYTES; i++)
+        if (st.buttons[i])
+            return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int snapshot_test0(void)
+{
+    struct snapshot_history sent = {}, received = {};
+    struct snapshot snap = {}, near, out;
+    uint8_t buf[SNAPSHOT_DELTA_MAX];
+    struct snapshot_entity se;
+    float pos[3], yaw;
+    unsigned long frame;
+    unsigned int kind;
+    int animation;
+    size_t len;
+
+    /* added out of order, come out sorted */
+    snapshot_entity_pack(&se, 7, (float[]){ 1.5, 0, -2 }, 90, 3, 12, 1);
+    if (snapshot_add(&snap, &se))
+        return EXIT_FAILURE;
+    snapshot_entity_pack(&se, 2, (float[]){ 100, 0, 0 }, -90, -1, 0, 2);
+    if (snapshot_add(&snap, &se) || snapshot_add(&snap, &se) != -EEXIST ||
+        snap.ents[0].id != 2 || snap.ents[1].id != 7)
+        return EXIT_FAILURE;
+
+    /* interest management: only #7 is close enough */
+    snap.seq = 1;
+    snap.input_seq = 5;
+    snap.self = 7;
+    snapshot_filter(&near, &snap, (float[]){ 0, 0, 0 }, 10);
+    if (near.nr_ents != 1 || near.ents[0].id != 7)
+        return EXIT_FAILURE;
+
+    /* nothing acknowledged yet: in full */
+    len = snapshot_encode(buf, &snap, NULL);
+    snapshot_history_add(&sent, &snap);
+    if (snapshot_decode(buf, len - 1, &out, &received) != -EAGAIN ||
+        snapshot_decode(buf, len, &out, &received) != len || out.nr_ents != 2 ||
+        out.input_seq != 5 || out.self != 7)
+        return EXIT_FAILURE;
+
+    snapshot_entity_unpack(&out.ents[1], pos, &yaw, &animation, &frame, &kind);
+    if (pos[0] != 1.5 || pos[2] != -2 || fabsf(yaw - 90) > 0.01 || animation != 3 ||
+        frame != 12 || kind != 1)
+        return EXIT_FAILURE;
+
+    snapshot_entity_unpack(&out.ents[0], pos, &yaw, &animation, &frame, &kind);
+    if (pos[0] != 100 || fabsf(yaw - 270) > 0.01 || animation != -1)
+        return EXIT_FAILURE;
+
+    /* #7 moves, #2 goes away, #9 shows up */
+    snapshot_filter(&snap, &near, (float[]){ 0, 0, 0 }, 10);
+    snap.seq = 2;
+    snapshot_find(&snap, 7)->fields[SNAPSHOT_X] += SNAPSHOT_POS_SCALE;
+    snapshot_entity_pack(&se, 9, (float[]){ 0, 0, 0 }, 0, 0, 0, 0);
+    snapshot_add(&snap, &se);
+    len = snapshot_encode(buf, &snap, snapshot_history_find(&sent, 1));
+    /* flags, seq, input_seq, self, base, counts, removed, #7's x, #9 */
+    if (len != 1 + 2 + 2 + 2 + 2 + 2 + 2 + 5 + 3 ||
+        snapshot_decode(buf, len, &out, &received) != len ||
+        out.nr_ents != 2 || memcmp(out.ents, snap.ents, sizeof(out.ents[0]) * 2) ||
+        !snapshot_history_find(&received, 2))
+        return EXIT_FAILURE;
+
+    /* against a snapshot the receiver never saw */
+    snap.seq = 3;
+    len = snapshot_encode(buf, &snap, &(struct snapshot){ .seq = 40 });
+    if (snapshot_decode(buf, len, &out, &received) != -ENOENT ||
+        snapshot_size(buf, len) != len)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int prediction_test0(void)
+{
+    struct prediction p = {};
+    float delta[3], moved = 0;
+    int i;
+
+    /* moving along x, one unit per input */
+    for (i = 1; i <= 10; i++)
+        prediction_record(&p, i, (float[]){ i, 0, 0 }, false);
+
+    /* the server agrees with 5 within the dead zone: nothing to correct */
+    if (prediction_reconcile(&p, 5, (float[]){ 5.1, 0, 0 }))
+        return EXIT_FAILURE;
+    prediction_smooth(&p, 0.1, delta);
+    if (delta[0] || delta[1] || delta[2])
+        return EXIT_FAILURE;
+
+    /* it has 6 one unit further along z */
+    if (prediction_reconcile(&p, 6, (float[]){ 6, 0, 1 }))
+        return EXIT_FAILURE;
+
+    /* 7..10 are already corrected, no need to do it again */
+    if (prediction_reconcile(&p, 8, (float[]){ 8, 0, 1 }) || p.error[2] != 1)
+        return EXIT_FAILURE;
+
+    /* 5 is gone, it's older than the correction */
+    if (prediction_reconcile(&p, 5, (float[]){ 5, 0, 0 }) != -ENOENT)
+        return EXIT_FAILURE;
+
+    /* smoothed out, not all at once */
+    prediction_smooth(&p, 1.0 / 60, delta);
+    if (delta[2] <= 0 || delta[2] >= 0.5)
+        return EXIT_FAILURE;
+    for (moved = delta[2], i = 0; i < 120; i++, moved += delta[2])
+        prediction_smooth(&p, 1.0 / 60, delta);
+    if (fabsf(moved - 1) > 0.001)
+        return EXIT_FAILURE;
+
+    /* too far off to hide */
+    prediction_record(&p, 11, (float[]){ 11, 0, 1 }, false);
+    if (prediction_reconcile(&p, 11, (float[]){ 11, 0, 11 }))
+        return EXIT_FAILURE;
+    prediction_smooth(&p, 1.0 / 60, delta);
+    if (fabsf(delta[2] - 10) > 0.001)
+        return EXIT_FAILURE;
+
+    /* stopped by a wall at 2 that the server doesn't have, then turned to z */
+    memset(&p, 0, sizeof(p));
+    prediction_record(&p, 1, (float[]){ 0, 0, 0 }, false);
+    prediction_record(&p, 2, (float[]){ 0, 0, 0 }, true);
+    prediction_record(&p, 3, (float[]){ 0, 0, 1 }, false);
+    prediction_record(&p, 4, (float[]){ 0, 0, 2 }, false);
+    if (prediction_reconcile(&p, 2, (float[]){ 2, 0, 0 }) || p.error[0] || p.offset[0] != 2)
+        return EXIT_FAILURE;
+
+    /* past the wall, the server's word counts again, on top of the offset */
+    if (prediction_reconcile(&p, 3, (float[]){ 2, 0, 1 }) || p.error[0] || p.error[2])
+        return EXIT_FAILURE;
+    if (prediction_reconcile(&p, 4, (float[]){ 2, 0, 4 }) || p.error[0] || p.error[2] != 2)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int objfile_test0(void)
+{
+    /* a quad and a triangle sharing an edge, in a few of the face syntaxes */
+    static const char obj[] =
+        "# comment\n"
+        "o quad\n"
+        "v 0 0 0\n"
+        "v 1.5 0 0\r\n"
+        "v 1.5 1e1 -2.5E-1\n"
+        "v 0 1 0\n"
+        "vt 0 0\n"
+        "vt 1 0.25\n"
+        "vn 0 0 1\n"
+        "s off\n"
+        "f 1/1/1 2/2/1 3/2/1 4/1/1\n"
+        "f -4/1/1 -2/2/1 -1/1/1\n"
+        "f 2//1 3//1 4//1";
+    float *tx, *norm;
+    unsigned short *idx;
+    size_t txsz, vxsz, idxsz;
+    struct model_data *md;
+
+    md = model_data_new_from_obj(obj, sizeof(obj) - 1);
+    if (!md)
+        return EXIT_FAILURE;
+
+    /* the quad's 4 corners, 3 of them again, then 3 more without the vt */
+    if (md->nr_idx != 12 || md->nr_vx != 7)
+        goto err;
+
+    if (md->v[6] != 1.5 || md->v[7] != 10 || md->v[8] != -0.25 || md->vt[3] != 0.75)
+        goto err;
+
+    model_data_to_vectors(md, &tx, &txsz, &norm, &vxsz, &idx, &idxsz);
+    if (vxsz != 7 * 3 * sizeof(float) || txsz != 7 * 2 * sizeof(float) ||
+        idxsz != 12 * sizeof(*idx) || norm[2] != 1 ||
+        idx[3] != 0 || idx[4] != 2 || idx[5] != 3 || idx[6] != 0 || idx[7] != 2 || idx[8] != 3 ||
+        idx[9] != 4 || idx[11] != 6)
+        goto err_vectors;
+
+    free(tx);
+    free(norm);
+    free(idx);
+    model_data_free(md);
+
+    /* out of range */
+    if (model_data_new_from_obj("v 0 0 0\nf 1 2 3\n", 16))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+
+err_vectors:
+    free(tx);
+    free(norm);
+    free(idx);
+err:
+    model_data_free(md);
+    return EXIT_FAILURE;
+}
+
+static int bin_vec_test0(void)
+{
+    float vx[] = { 0, 0, 0, 1, 0, 0, 0, 1, 0 }, norm[] = { 0, 0, 1, 0, 0, 1, 0, 0, 1 };
+    unsigned short idx[] = { 0, 1, 2 }, lod[] = { 0, 1, 2 };
+    struct bin_vec bv = {
+        .nr_vertices    = 3,
+        .data           = { [BV_POSITION] = vx, [BV_NORMAL] = norm },
+        .size           = { [BV_POSITION] = sizeof(vx), [BV_NORMAL] = sizeof(norm) },
+        .nr_lods        = 2,
+        .idx            = { idx, lod },
+        .idxsz          = { sizeof(idx), sizeof(lod) },
+        .error          = { 0, 0.5 },
+    };
+    struct bin_vec_header v1 = { .magic = BIN_VEC_MAGIC, .ver = 1, .vxsz = sizeof(vx),
+                                 .idxsz = sizeof(idx) };
+    unsigned char *buf = NULL;
+    struct bin_vec out;
+    size_t size = 0;
+    unsigned int i;
+    FILE *f;
+
+    f = open_memstream((char **)&buf, &size);
+    if (!f || bin_vec_write(f, &bv) || fclose(f))
+        return EXIT_FAILURE;
+
+    if (size % BIN_VEC_ALIGN || bin_vec_parse(buf, size, &out) || out.nr_vertices != 3 ||
+        out.nr_lods != 2 || out.error[1] != 0.5 || out.data[BV_TEXCOORD] ||
+        memcmp(out.data[BV_NORMAL], norm, sizeof(norm)) || memcmp(out.idx[1], lod, sizeof(lod)))
+        goto err;
+
+    for (i = 0; i < BV_MAX; i++)
+        if ((uintptr_t)out.data[i] % BIN_VEC_ALIGN)
+            goto err;
+
+    /* truncated */
+    if (bin_vec_parse(buf, size - BIN_VEC_ALIGN, &out) != -EINVAL)
+        goto err;
+    free(buf);
+
+    /* v1 still loads */
+    buf = malloc(sizeof(v1) + 2 * sizeof(vx) + sizeof(idx));
+    memcpy(buf, &v1, sizeof(v1));
+    memcpy(buf + sizeof(v1), vx, sizeof(vx));
+    memcpy(buf + sizeof(v1) + sizeof(vx), norm, sizeof(norm));
+    memcpy(buf + sizeof(v1) + 2 * sizeof(vx), idx, sizeof(idx));
+    if (bin_vec_parse(buf, sizeof(v1) + 2 * sizeof(vx) + sizeof(idx), &out) ||
+        out.nr_vertices != 3 || out.idxsz[0] != sizeof(idx) ||
+        memcmp(out.data[BV_NORMAL], norm, sizeof(norm)))
+        goto err;
+
+    free(buf);
+
+    return EXIT_SUCCESS;
+
+err:
+    free(buf);
+    return EXIT_FAILURE;
+}
+
+static int base64_test0(void)
+{
+    char raw[300], enc[base64_encoded_length(sizeof(raw)) + 1], dec[sizeof(raw) + 3];
+    unsigned int len, pos;
+    ssize_t elen, dlen;
+
+    for (len = 0; len < sizeof(raw); len++)
+        raw[len] = len * 37 + (len >> 3);
+
+    /* every length, so the vector blocks end everywhere in the tail */
+    for (len = 0; len < sizeof(raw); len++) {
+        elen = base64_encode(enc, sizeof(enc), raw, len);
+        dlen = base64_decode(dec, sizeof(dec), enc, elen);
+        if (dlen != len || memcmp(dec, raw, len))
+            return EXIT_FAILURE;
+    }
+
+    /* a character that's not in the alphabet anywhere, including the blocks */
+    elen = base64_encode(enc, sizeof(enc), raw, sizeof(raw));
+    for (pos = 0; pos < elen - 4; pos += 7) {
+        char c = enc[pos];
+
+        enc[pos] = pos & 1 ? '\x80' : '-';
+        if (base64_decode(dec, sizeof(dec), enc, elen) != -1)
+            return EXIT_FAILURE;
+        enc[pos] = c;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int sha1_test0(void)
+{
+    static const char abc56[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    static const unsigned char digest_a[20] = {
+        0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+        0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f,
+    };
+    static const unsigned char digest_abc56[20] = {
+        0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+        0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1,
+    };
+    unsigned char buf[640], digest[21];
+    size_t done, len;
+    uint32_t state[5];
+    SHA1_CTX ctx;
+    int i;
+
+    SHA1((char *)digest, abc56, sizeof(abc56) - 1);
+    if (memcmp(digest, digest_abc56, sizeof(digest_abc56)))
+        return EXIT_FAILURE;
+
+    /* a million 'a's, in pieces that never line up with the blocks */
+    memset(buf, 'a', sizeof(buf));
+    SHA1Init(&ctx);
+    for (done = 0, i = 0; done < 1000000; done += len, i++) {
+        len = min((size_t)(i * 37) % 600 + 1, 1000000 - done);
+        SHA1Update(&ctx, buf, len);
+    }
+    SHA1Final(digest, &ctx);
+    if (memcmp(digest, digest_a, sizeof(digest_a)))
+        return EXIT_FAILURE;
+
+    /* whatever does the blocks agrees with the portable transform */
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = i * 131 + (i >> 5);
+    SHA1Init(&ctx);
+    memcpy(state, ctx.state, sizeof(state));
+    SHA1Update(&ctx, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i += 64)
+        SHA1Transform(state, buf + i);
+    if (memcmp(state, ctx.state, sizeof(state)))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+static int hash64_test0(void)
+{
+    unsigned char buf[200];
+    struct hash64 h;
+    unsigned int len, split;
+    uint64_t one;
+
+    if (hash64("", 0, 0) != 0xef46db3751d8e999ull ||
+        hash64("abc", 3, 0) != 0x44bc2cf5ad770999ull)
+        return EXIT_FAILURE;
+
+    for (len = 0; len < sizeof(buf); len++)
+        buf[len] = len * 73 + 1;
+
+    /* in two pieces split anywhere, it's the same hash as in one go */
+    for (len = 0; len < sizeof(buf); len += 7) {
+        one = hash64(buf, len, len);
+        for (split = 0; split <= len; split++) {
+            hash64_init(&h, len);
+            hash64_update(&h, buf, split);
+            hash64_update(&h, buf + split, len - split);
+            if (hash64_final(&h) != one)
+                return EXIT_FAILURE;
+        }
+        if (len && hash64(buf, len - 1, len) == one)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int ktx2_test0(void)
+{
+    /* 8x8 BC7 sRGB with 2 mips: header, level index, 64 + 16 bytes of blocks */
+    static const unsigned char magic[12] = {
+        0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'
+    };
+    uint32_t hdr[] = { 146, 1, 8, 8, 0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    uint64_t index[] = { 176, 64, 64, 240, 16, 16 };
+    unsigned char buf[256] = {};
+    struct ktx2_image img;
+
+    memcpy(buf, magic, sizeof(magic));
+    memcpy(buf + sizeof(magic), hdr, sizeof(hdr));
+    memcpy(buf + 80, index, sizeof(index));
+
+    if (!ktx2_is_ktx2(buf, sizeof(buf)) || ktx2_parse(buf, sizeof(buf), &img))
+        return EXIT_FAILURE;
+
+    if (img.format != KTX2_BC7 || !img.srgb || img.width != 8 || img.nr_levels != 2 ||
+        img.levels[0].data != buf + 176 || img.levels[1].size != 16)
+        return EXIT_FAILURE;
+
+    /* truncated */
+    if (ktx2_parse(buf, 250, &img) != -EINVAL)
+        return EXIT_FAILURE;
+
+    /* wrong size for the mip */
+    index[4] = 32;
+    memcpy(buf + 80, index, sizeof(index));
+    if (ktx2_parse(buf, sizeof(buf), &img) != -EINVAL)
+        return EXIT_FAILURE;
+
+    /* Basis: vkFormat 0, supercompressed */
+    hdr[0] = 0;
+    hdr[8] = 1;
+    memcpy(buf + sizeof(magic), hdr, sizeof(hdr));
+    if (ktx2_parse(buf, sizeof(buf), &img) != -ENOTSUP)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/* the same rules through ca->neigh, which the fast paths don't recognize */
+static const struct cell_automaton *ca2d_test_ca;
+
+static int ca2d_test_neigh(unsigned char *arr, int side, int x, int y)
+{
+    return ca2d_test_ca->neigh(arr, side, x, y);
+}
+
+static int ca2d_test0(void)
+{
+    int (*neighs[])(unsigned char *, int, int, int) = {
+        ca2d_neigh_vn1, ca2d_neigh_m1, ca2d_neigh_vnv, ca2d_neigh_mv,
+    };
+    /* bit-packed, across words, and bytes */
+    static const unsigned int states[] = { 1, 1, 4 };
+    static const int sides[] = { 70, 64, 33 };
+    unsigned char a[70 * 70], b[70 * 70];
+    struct cell_automaton ca, ref;
+    int i, j, k, d, step, side;
+
+    srand48(1);
+    for (i = 0; i < array_size(neighs); i++)
+        for (j = 0; j < array_size(states); j++)
+            for (d = 0; d < 2; d++) {
+                side = sides[j];
+                ca.decay = d;
+                ca.born = 3 << 2 | (i & 1) << 5;
+                ca.surv = 3 << 2 | (j & 1);
+                ca.nr_states = states[j];
+                ca.neigh = neighs[i];
+                ref = ca;
+                ref.neigh = ca2d_test_neigh;
+                ca2d_test_ca = &ca;
+
+                for (k = 0; k < side * side; k++)
+                    a[k] = b[k] = lrand48() % 3 ? 0 : ca.nr_states;
+
+                for (step = 0; step < 4; step++) {
+                    ca2d_step(&ca, a, side);
+                    ca2d_step(&ref, b, side);
+                    if (memcmp(a, b, side * side))
+                        return EXIT_FAILURE;
+                }
+            }
+
+    return EXIT_SUCCESS;
+}
+
+static struct xyzarray *voxel_test_xyz(int x, int y, int z)
+{
+    struct xyzarray *xyz;
+
+    xyz = calloc(1, offsetof(struct xyzarray, arr[x * y * z]));
+    if (xyz) {
+        xyz->dim[0] = x;
+        xyz->dim[1] = y;
+        xyz->dim[2] = z;
+    }
+
+    return xyz;
+}
+
+/* faces of @quads add up to the exposed ones, each of them exposed */
+static int voxel_test_check(struct xyzarray *xyz, bool inv, ssize_t expect)
+{
+    struct voxel_quad *quads, *q;
+    int a, ua, va, u, v, c[3], n[3];
+    struct voxel_mask vm;
+    long area = 0, faces = 0;
+    ssize_t nr, i;
+
+    if (voxel_mask_init(&vm, xyz, inv))
+        return EXIT_FAILURE;
+
+    nr = voxel_quads(&vm, &quads);
+    if (nr < 0 || (expect >= 0 && nr != expect))
+        goto fail;
+
+    for (i = 0, q = quads; i < nr; i++, q++) {
+        a = q->axis;
+        ua = (a + 1) % 3;
+        va = (a + 2) % 3;
+        for (v = 0; v < q->h; v++)
+            for (u = 0; u < q->w; u++) {
+                memcpy(c, q->pos, sizeof(c));
+                c[ua] += u;
+                c[va] += v;
+                memcpy(n, c, sizeof(n));
+                n[a] += q->positive ? 1 : -1;
+                if (!voxel_mask_get(&vm, c[0], c[1], c[2]) || voxel_mask_get(&vm, n[0], n[1], n[2]))
+                    goto fail;
+                area++;
+            }
+    }
+
+    for (c[2] = 0; c[2] < xyz->dim[2]; c[2]++)
+        for (c[1] = 0; c[1] < xyz->dim[1]; c[1]++)
+            for (c[0] = 0; c[0] < xyz->dim[0]; c[0]++) {
+                if (!voxel_mask_get(&vm, c[0], c[1], c[2]))
+                    continue;
+                for (a = 0; a < 6; a++) {
+                    memcpy(n, c, sizeof(n));
+                    n[a / 2] += a & 1 ? 1 : -1;
+                    faces += !voxel_mask_get(&vm, n[0], n[1], n[2]);
+                }
+            }
+
+    free(quads);
+    voxel_mask_done(&vm);
+    return area == faces ? EXIT_SUCCESS : EXIT_FAILURE;
+
+fail:
+    free(quads);
+    voxel_mask_done(&vm);
+    return EXIT_FAILURE;
+}
+
+static int voxel_test0(void)
+{
+    struct xyzarray *xyz;
+    int i, ret = EXIT_FAILURE;
+
+    if (jobs_init(3))
+        return EXIT_FAILURE;
+
+    /* empty, then one cell, then a box across words and slabs */
+    xyz = voxel_test_xyz(3, 3, 3);
+    if (!xyz || voxel_test_check(xyz, false, 0))
+        goto out;
+
+    xyz->arr[13] = 1;
+    if (voxel_test_check(xyz, false, 6))
+        goto out;
+    free(xyz);
+
+    xyz = voxel_test_xyz(70, 5, 2 * VOXEL_CHUNK + 8);
+    if (!xyz)
+        goto out;
+    /* z faces whole, x and y ones cut at the 3 slabs */
+    if (voxel_test_check(xyz, true, 2 + 4 * 3))
+        goto out;
+
+    srand48(1);
+    for (i = 0; i < 70 * 5 * (2 * VOXEL_CHUNK + 8); i++)
+        xyz->arr[i] = lrand48() % 3 ? 0 : 1;
+    if (voxel_test_check(xyz, false, -1) || voxel_test_check(xyz, true, -1))
+        goto out;
+
+    ret = EXIT_SUCCESS;
+out:
+    free(xyz);
+    jobs_done();
+
+    return ret;
+}
+
 static struct test {
     const char	*name;
     int			(*test)(void);
@@ -370,14 +2222,47 @@ static struct test {
     { .name = "refcount get/put", .test = refcount_test1 },
     { .name = "refcount static", .test = refcount_test2 },
     { .name = "refcount cleanup", .test = refcount_test3 },
+    { .name = "refcount pool", .test = refcount_test4 },
+    { .name = "refcount frame arena", .test = refcount_test5 },
+    { .name = "memory accounting", .test = refcount_test6 },
     { .name = "list_for_each", .test = list_test0 },
     { .name = "list_for_each_iter", .test = list_test1 },
     { .name = "darray basic", .test = darray_test0 },
     { .name = "darray insert", .test = darray_test1 },
     { .name = "darray delete", .test = darray_test2 },
+    { .name = "darray growth", .test = darray_test3 },
     { .name = "hashmap basic", .test = hashmap_test0 },
     { .name = "hashmap for each", .test = hashmap_test1 },
+    { .name = "hashmap growth and string keys", .test = hashmap_test2 },
     { .name = "bitmap basic", .test = bitmap_test0 },
+    { .name = "radix sort", .test = radix_sort_test0 },
+    { .name = "histogram percentiles", .test = histogram_test0 },
+    { .name = "bvh frustum query", .test = bvh_test0 },
+    { .name = "bvh nearest and radius queries", .test = bvh_test1 },
+    { .name = "jobs parallel for", .test = jobs_test0 },
+    { .name = "jobs dependencies", .test = jobs_test1 },
+    { .name = "jobs queue stress", .test = jobs_test2 },
+    { .name = "librarian cache", .test = lib_cache_test0 },
+    { .name = "librarian asset pack", .test = lib_pack_test0 },
+    { .name = "librarian async requests", .test = lib_async_test0 },
+    { .name = "json arena", .test = json_test0 },
+    { .name = "json sax", .test = json_test1 },
+    { .name = "xform store", .test = xform_test0 },
+    { .name = "linmath kernels", .test = linmath_test0 },
+    { .name = "input delta", .test = input_delta_test0 },
+    { .name = "input record and replay", .test = input_record_test0 },
+    { .name = "snapshot delta", .test = snapshot_test0 },
+    { .name = "client prediction", .test = prediction_test0 },
+    { .name = "OBJ parser", .test = objfile_test0 },
+    { .name = "bin_vec v2", .test = bin_vec_test0 },
+    { .name = "base64 decode", .test = base64_test0 },
+    { .name = "sha1 vectors and streaming", .test = sha1_test0 },
+    { .name = "hash64", .test = hash64_test0 },
+    { .name = "messagebus post and drain", .test = messagebus_test0 },
+    { .name = "messagebus filters", .test = messagebus_test1 },
+    { .name = "ktx2 parse", .test = ktx2_test0 },
+    { .name = "ca2d fast paths", .test = ca2d_test0 },
+    { .name = "voxel mesher", .test = voxel_test0 },
 };
 
 int main()
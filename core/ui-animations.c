@@ -1,273 +1,294 @@
 // SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
 #include "ui.h"
 
-static void ui_animation_done(struct ui_animation *uia)
+void uia_init(struct ui *ui)
 {
-    list_del(&uia->entry);
-    free(uia);
+    darray_init(&ui->uia_steps);
+    memset(&ui->tweens, 0, sizeof(ui->tweens));
 }
 
-void ui_element_animations_done(struct ui_element *uie)
+/* keep in sync with struct uia_tweens */
+#define UIA_TWEENS_FOR_EACH_ARRAY(_op) \
+    _op(uie) _op(target) _op(setter) _op(curve) _op(start) _op(end) \
+    _op(param) _op(shift) _op(start_frame) _op(nr_frames)
+
+void uia_done(struct ui *ui)
 {
-    struct ui_animation *ua, *itua;
-    list_for_each_entry_iter (ua, itua, &uie->animation, entry) {
-        ui_animation_done(ua);
-    }
+    struct uia_tweens *tw = &ui->tweens;
+
+#define UIA_FREE(_f) free(tw->_f);
+    UIA_TWEENS_FOR_EACH_ARRAY(UIA_FREE)
+#undef UIA_FREE
+    memset(tw, 0, sizeof(*tw));
+    darray_clearout(&ui->uia_steps.da);
 }
 
-static int ui_animation_update(struct entity3d *e, void *data)
+static int uia_tweens_grow(struct uia_tweens *tw)
 {
-    struct ui_element   *uie = e->priv;
-    struct ui           *ui = data;
-    struct ui_animation *ua;
-
-    if (list_empty(&uie->animation)) {
-        e->update = ui_element_update;
-        goto out;
+    unsigned int nr_alloc = max(tw->nr_alloc * 2, 16u);
+    int ret = 0;
+    void *p;
+
+    /* the ones that did get reallocated are still good with the old nr_alloc */
+#define UIA_GROW(_f) \
+    if (!ret) { \
+        p = realloc(tw->_f, nr_alloc * sizeof(*tw->_f)); \
+        if (p) \
+            tw->_f = p; \
+        else \
+            ret = -ENOMEM; \
     }
+    UIA_TWEENS_FOR_EACH_ARRAY(UIA_GROW)
+#undef UIA_GROW
 
-    ua = list_first_entry(&uie->animation, struct ui_animation, entry);
-    ua->trans(ua);
+    if (!ret)
+        tw->nr_alloc = nr_alloc;
 
-out:
-    return ui_element_update(e, data);
+    return ret;
 }
 
-static void ui_animation_next(struct ui_animation *ua)
+static void uia_tween_start(struct ui *ui, struct ui_element *uie, struct uia_tween *t)
 {
-    struct ui_animation *next;
+    struct uia_tweens *tw = &ui->tweens;
+    unsigned int i = tw->nr;
 
-    if (ua == list_last_entry(&ua->uie->animation, struct ui_animation, entry))
+    if (tw->nr == tw->nr_alloc && uia_tweens_grow(tw))
         return;
 
-    next = list_next_entry(ua, entry);
-    next->trans(next);
+    tw->uie[i]         = uie;
+    tw->target[i]      = t->target;
+    tw->setter[i]      = t->setter;
+    tw->curve[i]       = t->curve;
+    tw->start[i]       = t->start;
+    tw->end[i]         = t->end;
+    tw->param[i]       = t->param;
+    tw->shift[i]       = t->shift;
+    tw->start_frame[i] = ui->frames_total;
+    tw->nr_frames[i]   = t->nr_frames;
+    tw->nr++;
+    uie->nr_tweens++;
 }
 
-static struct ui_animation *ui_animation(struct ui_element *uie)
+/* an element is going away: its steps and tweens get dropped in uia_update() */
+void ui_element_animations_done(struct ui_element *uie)
 {
-    struct ui_animation *ua;
+    struct ui *ui = uie->ui;
+    struct uia_step *step;
+    unsigned int i;
 
-    CHECK(ua = calloc(1, sizeof(struct ui_animation)));
-    ua->uie = uie;
-    list_append(&uie->animation, &ua->entry);
-    uie->entity->update = ui_animation_update;
+    darray_for_each(step, &ui->uia_steps)
+        if (step->uie == uie)
+            step->uie = NULL;
 
-    return ua;
-}
-
-/* ------------------------------ ANIMATIONS ------------------------------- */
-static void __uia_skip_frames(struct ui_animation *ua)
-{
-    if (ua->uie->ui->frames_total < ua->start_frame)
-        return;
+    for (i = 0; i < ui->tweens.nr; i++)
+        if (ui->tweens.uie[i] == uie)
+            ui->tweens.uie[i] = NULL;
 
-    ui_animation_next(ua);
-    ui_animation_done(ua);
+    uie->nr_tweens = 0;
 }
 
-void uia_skip_frames(struct ui_element *uie, unsigned long frames)
+/* false if @step has to wait, which holds back the rest of its element's */
+static bool uia_step_run(struct ui *ui, struct uia_step *step)
 {
-    struct ui_animation *uia;
+    struct ui_element *uie = step->uie;
+
+    switch (step->type) {
+    case UIA_STEP_SKIP:
+        return ui->frames_total >= step->until;
+    case UIA_STEP_ACTION:
+        if (uie->nr_tweens)
+            return false;
+        step->action(uie);
+        return true;
+    case UIA_STEP_VISIBLE:
+        ui_element_set_visibility(uie, step->visible);
+        return true;
+    case UIA_STEP_TWEEN:
+        uia_tween_start(ui, uie, &step->tween);
+        return true;
+    }
 
-    CHECK(uia = ui_animation(uie));
-    uia->start_frame = uie->ui->frames_total + frames;
-    uia->trans       = __uia_skip_frames;
+    return true;
 }
 
-static void __uia_action(struct ui_animation *ua)
+static void uia_steps_update(struct ui *ui)
 {
-    struct ui_element *uie  = ua->uie;
-    bool              done = false;
-
-    if (ua == list_first_entry(&uie->animation, struct ui_animation, entry)) {
-        done = true;
-        ua->iter(ua);
+    struct uia_step *step, copy;
+    unsigned int i, nr;
+
+    ui->uia_pass++;
+    /* actions can queue more steps, which can move the array */
+    for (i = 0; i < ui->uia_steps.da.nr_el; i++) {
+        step = &ui->uia_steps.x[i];
+        if (!step->uie || step->uie->uia_blocked == ui->uia_pass)
+            continue;
+
+        copy = *step;
+        if (!uia_step_run(ui, &copy)) {
+            copy.uie->uia_blocked = ui->uia_pass;
+            continue;
+        }
+
+        ui->uia_steps.x[i].uie = NULL;
     }
 
-    ui_animation_next(ua);
-
-    if (done)
-        ui_animation_done(ua);
+    for (i = 0, nr = 0; i < ui->uia_steps.da.nr_el; i++)
+        if (ui->uia_steps.x[i].uie)
+            ui->uia_steps.x[nr++] = ui->uia_steps.x[i];
+    darray_resize(&ui->uia_steps.da, nr);
 }
 
-void uia_action(struct ui_element *uie, void (*callback)(struct ui_animation *))
+static void uia_tweens_update(struct ui *ui)
 {
-    struct ui_animation *uia;
+    struct uia_tweens *tw = &ui->tweens;
+    unsigned int i, nr;
+    unsigned long n;
+    float t, v;
+    bool done;
+
+    for (i = 0; i < tw->nr; i++) {
+        if (!tw->uie[i])
+            continue;
+
+        n = ui->frames_total - tw->start_frame[i];
+        t = tw->nr_frames[i] ? min((float)n / tw->nr_frames[i], 1.0) : 0;
+
+        switch (tw->curve[i]) {
+        case UIA_LIN:
+            v = lin_interp(tw->start[i], tw->end[i], t);
+            break;
+        case UIA_QUAD:
+            v = tw->start[i] + tw->param[i] * n * n / 2;
+            break;
+        case UIA_COS:
+            v = cos_interp(tw->start[i], tw->end[i], tw->shift[i] + tw->param[i] * t);
+            break;
+        default:
+            v = tw->end[i];
+            break;
+        }
+
+        done = (tw->nr_frames[i] && n >= tw->nr_frames[i]) ||
+               (tw->start[i] < tw->end[i] && v >= tw->end[i]) ||
+               (tw->start[i] > tw->end[i] && v <= tw->end[i]);
+        /* clamp, in case it overshoots */
+        if (done)
+            v = tw->end[i];
+
+        if (tw->target[i])
+            *tw->target[i] = v;
+        else
+            tw->setter[i](tw->uie[i], v);
+
+        /* the setter may have taken the element down with it */
+        if (done && tw->uie[i]) {
+            tw->uie[i]->nr_tweens--;
+            tw->uie[i] = NULL;
+        }
+    }
+
+    for (i = 0, nr = 0; i < tw->nr; i++) {
+        if (!tw->uie[i])
+            continue;
 
-    CHECK(uia = ui_animation(uie));
-    uia->trans = __uia_action;
-    uia->iter  = callback;
+        if (nr != i) {
+#define UIA_MOVE(_f) tw->_f[nr] = tw->_f[i];
+            UIA_TWEENS_FOR_EACH_ARRAY(UIA_MOVE)
+#undef UIA_MOVE
+        }
+        nr++;
+    }
+    tw->nr = nr;
 }
 
-static void __uia_set_visible(struct ui_animation *ua)
+void uia_update(struct ui *ui)
 {
-    ui_element_set_visibility(ua->uie, ua->int0);
-
-    ui_animation_next(ua);
-    ui_animation_done(ua);
+    uia_steps_update(ui);
+    uia_tweens_update(ui);
 }
 
-void uia_set_visible(struct ui_element *uie, int visible)
+static struct uia_step *uia_step(struct ui_element *uie, enum uia_step_type type)
 {
-    struct ui_animation *uia;
+    struct uia_step *step;
 
-    CHECK(uia = ui_animation(uie));
-    uia->int0  = visible;
-    uia->trans = __uia_set_visible;
-}
+    CHECK(step = darray_add(&uie->ui->uia_steps.da));
+    step->uie  = uie;
+    step->type = type;
 
-static unsigned long ua_frames(struct ui_animation *ua)
-{
-    struct ui *ui = ua->uie->ui;
-    return ui->frames_total - ua->start_frame;
+    return step;
 }
 
-static bool ua_frames_done(struct ui_animation *ua)
+/* ------------------------------ ANIMATIONS ------------------------------- */
+void uia_skip_frames(struct ui_element *uie, unsigned long frames)
 {
-    return ua_frames(ua) > ua->nr_frames;
+    uia_step(uie, UIA_STEP_SKIP)->until = uie->ui->frames_total + frames;
 }
 
-/*
- * Updaters
- */
-static void __uia_lin_float(struct ui_animation *ua)
+void uia_action(struct ui_element *uie, uia_action_fn callback)
 {
-    ua->float0 += ua->float_delta * ua_frames(ua);
+    uia_step(uie, UIA_STEP_ACTION)->action = callback;
 }
 
-static void __uia_quad_float(struct ui_animation *ua)
+void uia_set_visible(struct ui_element *uie, int visible)
 {
-    unsigned long frame;
-
-    for (frame = 0; frame < ua_frames(ua); frame++) {
-        ua->float0 += ua->float_delta;
-        ua->float_delta += ua->float_delta;
-    }
+    uia_step(uie, UIA_STEP_VISIBLE)->visible = visible;
 }
 
-static void __uia_float(struct ui_animation *ua)
+static void uia_tween(struct ui_element *uie, const struct uia_tween *t)
 {
-    void (*float_setter)(struct ui_element *, float) = ua->setter;
-    bool done = false;
-
-    if (!ua->int0) {
-        ua->float0 = ua->float_start;
-        ua->int0++;
-    } else {
-        ua->iter(ua);
-    }
-
-    if ((ua->float_start < ua->float_end && ua->float0 >= ua->float_end) ||
-        (ua->float_start > ua->float_end && ua->float0 <= ua->float_end) ||
-        ua_frames_done(ua)) {
-        done = true;
-        /* clamp, in case we overshoot */
-        ua->float0 = ua->float_end;
-    }
-
-    (*float_setter)(ua->uie, ua->float0);
-    ui_animation_next(ua);
-
-    if (done)
-        ui_animation_done(ua);
+    uia_step(uie, UIA_STEP_TWEEN)->tween = *t;
 }
 
 void uia_lin_float(struct ui_element *uie, void *setter, float start, float end, unsigned long frames)
 {
-    struct ui_animation *uia;
-    float               len = end - start;
-
-    CHECK(uia = ui_animation(uie));
-    uia->float_start = start;
-    uia->float_end   = end;
-    uia->float_delta = len / frames;
-    uia->setter      = setter;
-    uia->iter        = __uia_lin_float;
-    uia->trans       = __uia_float;
+    uia_tween(uie, &(struct uia_tween){
+        .setter    = setter,
+        .curve     = UIA_LIN,
+        .start     = start,
+        .end       = end,
+        .nr_frames = frames,
+    });
 }
 
 void uia_quad_float(struct ui_element *uie, void *setter, float start, float end, float accel)
 {
-    struct ui_animation *uia;
-
     if ((start > end && accel >= 0) || (start < end && accel <= 0)) {
         warn("end %f unreachable from start %f via %f\n", end, start, accel);
         return;
     }
 
-    CHECK(uia = ui_animation(uie));
-    uia->float_start = start;
-    uia->float_end   = end;
-    uia->float_delta = accel;
-    uia->setter      = setter;
-    uia->iter        = __uia_quad_float;
-    uia->trans       = __uia_float;
-}
-
-static void __uia_float_move(struct ui_animation *ua)
-{
-    bool done = false;
-
-    if (!ua->int0) {
-        ua->float0      = ua->float_start;
-        ua->start_frame = ua->uie->ui->frames_total;
-        ua->int0++;
-    } else {
-        ua->iter(ua);
-    }
-
-    if ((ua->float_start < ua->float_end && ua->float0 >= ua->float_end) ||
-        (ua->float_start > ua->float_end && ua->float0 <= ua->float_end) ||
-        ua_frames_done(ua)) {
-        done       = true;
-        ua->float0 = ua->float_end;
-    }
-
-    ua->uie->movable[ua->int1] = ua->float0;
-    ui_animation_next(ua);
-
-    if (done)
-        ui_animation_done(ua);
+    uia_tween(uie, &(struct uia_tween){
+        .setter    = setter,
+        .curve     = UIA_QUAD,
+        .start     = start,
+        .end       = end,
+        .param     = accel,
+    });
 }
 
 void uia_lin_move(struct ui_element *uie, enum uie_mv mv, float start, float end, unsigned long frames)
 {
-    struct ui_animation *uia;
-    float               len = end - start;
-
-    CHECK(uia = ui_animation(uie));
-    uia->nr_frames   = frames;
-    uia->float_start = start;
-    uia->float_end   = end;
-    uia->float_delta = len / frames;
-    uia->int1        = mv;
-    uia->trans       = __uia_float_move;
-    uia->iter        = __uia_lin_float;
-}
-
-static void __uia_cos_float(struct ui_animation *ua)
-{
-    struct ui *ui = ua->uie->ui;
-
-    ua->float0 = cos_interp(ua->float_start, ua->float_end,
-                            ua->float_shift + ua->float_delta * ua_frames(ua));
+    uia_tween(uie, &(struct uia_tween){
+        .target    = &uie->movable[mv],
+        .curve     = UIA_LIN,
+        .start     = start,
+        .end       = end,
+        .nr_frames = frames,
+    });
 }
 
+/* @phase: how much of the half period to go through, @shift: where to start it */
 void uia_cos_move(struct ui_element *uie, enum uie_mv mv, float start, float end, unsigned long frames, float phase,
                   float shift)
 {
-    struct ui_animation *uia;
-    float               len   = fabsf(start - end);
-    float               delta = len / frames;
-
-    CHECK(uia = ui_animation(uie));
-    uia->nr_frames   = frames;
-    uia->float_start = start;
-    uia->float_end   = end;
-    uia->float_delta = (delta / len) * phase;
-    uia->float_shift = delta * shift;
-    uia->int1        = mv;
-    uia->trans       = __uia_float_move;
-    uia->iter        = __uia_cos_float;
+    uia_tween(uie, &(struct uia_tween){
+        .target    = &uie->movable[mv],
+        .curve     = UIA_COS,
+        .start     = start,
+        .end       = end,
+        .param     = phase,
+        .shift     = shift,
+        .nr_frames = frames,
+    });
 }
@@ -2,11 +2,13 @@
 #define _GNU_SOURCE
 #include <stdlib.h>
 #include <errno.h>
+#include <inttypes.h>
 #include "model.h"
 #include "render.h"
 #include "shader.h"
 #include "messagebus.h"
 #include "input.h"
+#include "profiler.h"
 #include "ui.h"
 #include "font.h"
 #include "render.h"
@@ -35,18 +37,45 @@ static bool __ui_element_is_visible(struct ui_element *uie, struct ui *ui)
     return true;
 }
 
+/*
+ * An element's layout only depends on its own offsets, size and affinity,
+ * its parent's layout and the screen size; unless one of those changed
+ * since the last ui_element_position(), there's nothing to do.
+ */
+static bool ui_element_dirty(struct ui_element *uie, struct ui *ui)
+{
+    if (uie->layout_dirty || uie->layout_ui_gen != ui->layout_gen)
+        return true;
+    if (uie->parent && uie->layout_parent_gen != uie->parent->layout_gen)
+        return true;
+    if (uie->layout_affinity != uie->affinity || uie->layout_hidden != uie->force_hidden)
+        return true;
+
+    return !!memcmp(uie->layout, uie->movable, sizeof(uie->layout));
+}
+
+/* for the changes ui_element_dirty() can't see */
+static void ui_element_invalidate(struct ui_element *uie)
+{
+    uie->layout_dirty = true;
+}
+
 static void ui_element_position(struct ui_element *uie, struct ui *ui)
 {
     struct entity3d *e = uie->entity;
     float parent_width = ui->width, parent_height = ui->height;
     float x_off, y_off;
+    mat4x4 p;
+
+    /* parents first, their layout is an input */
+    if (uie->parent)
+        ui_element_position(uie->parent, ui);
 
-    if (uie->actual_x >= 0.0)
+    if (!ui_element_dirty(uie, ui))
         return;
 
+    uie->actual_x = uie->actual_y = uie->actual_w = uie->actual_h = -1.0;
     if (uie->parent) {
-        if (uie->parent->actual_x < 0.0)
-            ui_element_position(uie->parent, ui);
         /*trace("parent: %f/%f/%f/%f\n",
               uie->parent->actual_x,
               uie->parent->actual_y,
@@ -94,7 +123,6 @@ static void ui_element_position(struct ui_element *uie, struct ui *ui)
         uie->actual_y += uie->parent->actual_y;
     }
 
-compute_mx:
     /* We might want force_invisible also */
     e->visible = __ui_element_is_visible(uie, ui) ? 1 : 0;
     /*trace("VIEWPORT %fx%f; xywh: %f %f %f %f\n", parent_width, parent_height,
@@ -104,42 +132,52 @@ compute_mx:
     //dbg("## positioning '%s' at %f,%f\n", entity_name(e), uie->actual_x, uie->actual_y);
     if (!uie->prescaled)
         mat4x4_scale_aniso(e->mx->m, e->mx->m, uie->actual_w, uie->actual_h, 1.0);
+
+    mat4x4_identity(p);
+    mat4x4_ortho(p, 0, (float)ui->width, 0, (float)ui->height, 1.0, -1.0);
+    mat4x4_mul(e->mx->m, p, e->mx->m);
+
+    memcpy(uie->layout, uie->movable, sizeof(uie->layout));
+    uie->layout_affinity = uie->affinity;
+    uie->layout_hidden = uie->force_hidden;
+    uie->layout_ui_gen = ui->layout_gen;
+    if (uie->parent)
+        uie->layout_parent_gen = uie->parent->layout_gen;
+    uie->layout_dirty = false;
+    /* the children will see this */
+    uie->layout_gen++;
 }
 
 int ui_element_update(struct entity3d *e, void *data)
 {
     struct ui_element *uie = e->priv;
-    struct ui *ui = uie->ui;
-    mat4x4 p;
-
-    ui_element_position(uie, ui);
-    if (!e->visible)
-        return 0;
 
-    mat4x4_identity(p);
-    mat4x4_ortho(p, 0, (float)ui->width, 0, (float)ui->height, 1.0, -1.0);
-    mat4x4_mul(e->mx->m, p, e->mx->m);
+    ui_element_position(uie, uie->ui);
 
     return 0;
 }
 
 static void ui_debug_update(struct ui *ui);
-static void ui_reset_positioning(struct entity3d *e, void *data)
-{
-    struct ui_element *uie = e->priv;
-    /* XXX */
-    uie->actual_x = uie->actual_y = uie->actual_w = uie->actual_h = -1.0;
-}
 
 static void ui_roll_done(void);
 static bool ui_roll_finished;
 
 void ui_update(struct ui *ui)
 {
+    PROF_SCOPE("ui_update");
+
     ui_debug_update(ui);
 
-    /* XXX: this is double for_each, make better */
-    mq_for_each(&ui->mq, ui_reset_positioning, NULL);
+    /* everything's layout depends on the screen size */
+    if (ui->width != ui->layout_width || ui->height != ui->layout_height) {
+        ui->layout_width  = ui->width;
+        ui->layout_height = ui->height;
+        ui->layout_gen++;
+    }
+
+    uia_update(ui);
+
+    /* only the elements that changed get laid out, see ui_element_dirty() */
     mq_update(&ui->mq);
     if (ui_roll_finished)
         ui_roll_done();
@@ -175,7 +213,7 @@ static void ui_element_drop(struct ref *ref)
     ref_put_last(uie->entity);
 }
 
-DECLARE_REFCLASS(ui_element);
+DECLARE_REFCLASS(ui_element, .pooled = true);
 
 struct ui_element *ui_element_new(struct ui *ui, struct ui_element *parent, struct model3dtx *txmodel,
                                   unsigned long affinity, float x_off, float y_off, float w, float h)
@@ -195,13 +233,13 @@ struct ui_element *ui_element_new(struct ui *ui, struct ui_element *parent, stru
         list_append(&parent->children, &uie->child_entry);
     }
 
+    uie->layout_dirty = true;
     uie->affinity = affinity;
     uie->width    = w;
     uie->height   = h;
     uie->x_off    = x_off;
     uie->y_off    = y_off;
     list_init(&uie->children);
-    list_init(&uie->animation);
 
     //dbg("VIEWPORT: %ux%u; width %u -> %f; height %u -> %f\n", ui->width, ui->height, w, width, h, height);
 
@@ -250,11 +288,11 @@ static int ui_model_init(struct ui *ui)
 }
 
 struct ui_text {
+    struct ref          ref;
     struct font         *font;
     const char          *str;
     struct ui_element   *uietex;
     unsigned long       flags;
-    unsigned int        nr_uies;
     unsigned int        nr_lines;
     /* total width of all glyphs in each line, not counting whitespace */
     unsigned int        *line_w; /* array of int x nr_lines */
@@ -264,6 +302,16 @@ struct ui_text {
     unsigned int        *line_nrw; /* likewise */
     int                 width, height, y_off;
     int                 margin_x, margin_y;
+    /* retained text, see ui_text_new() */
+    struct ui           *ui;
+    struct ui_element   *parent;
+    float               color[4];
+    unsigned long       hash;
+    /* glyph quads as they are in the model's buffers */
+    GLfloat             *vx, *tx;
+    unsigned int        nr_glyphs;
+    /* how many glyphs the model's buffers have room for */
+    unsigned int        cap;
 };
 
 /*
@@ -280,6 +328,10 @@ static void ui_text_measure(struct ui_text *uit)
     free(uit->line_nrw);
     free(uit->line_ws);
     free(uit->line_w);
+    uit->line_nrw = NULL;
+    uit->line_ws = NULL;
+    uit->line_w = NULL;
+    uit->nr_lines = 0;
 
     glyph = font_get_glyph(uit->font, '-');
     ws_w = glyph->width;
@@ -342,44 +394,95 @@ static inline int x_off(struct ui_text *uit, unsigned int line)
     return x;
 }
 
-static struct model3dtx *ui_txm_find_by_texture(struct ui *ui, texture_t *tex)
+/*
+ * Lay out @len characters of @uit as quads in the @width x @height FBO space,
+ * textured from the font's atlas; returns the number of quads. @idx can be
+ * NULL if the indices are already there.
+ */
+static unsigned int ui_text_quads(struct ui_text *uit, size_t len, int width, int height,
+                                  GLfloat *vx, GLfloat *tx, GLushort *idx)
 {
-    struct model3dtx *txmodel;
+    const char *str = uit->str;
+    unsigned int i, line, nr = 0;
+    struct glyph *glyph;
+    float x, y, l, t, r, b;
+
+    y = (float)uit->margin_y + uit->y_off;
+    dbg_on(y < 0, "y: %f, height: %d y_off: %d, margin_y: %d\n",
+           y, uit->height, uit->y_off, uit->margin_y);
+    for (line = 0, i = 0, x = x_off(uit, line); i < len; i++) {
+        if (str[i] == '\n') {
+            line++;
+            y += (uit->height / uit->nr_lines);
+            x = x_off(uit, line);
+            continue;
+        }
+        if (isspace(str[i])) {
+            x += uit->line_ws[line];
+            continue;
+        }
 
-    /* XXX: need trees for better search, these lists are actually long */
-    /* XXX^2: struct mq */
-    list_for_each_entry(txmodel, &ui->mq.txmodels, entry) {
-        /*
-         * Since it's already on the list, the "extra" list
-         * reference is already taken, the next ui element
-         * to use it needs only its own reference.
-         */
-        if (texture_id(txmodel->texture) == texture_id(tex))
-            return txmodel;
+        glyph = font_get_glyph(uit->font, str[i]);
+        if (!glyph->width || !glyph->height)
+            goto advance;
+
+        /* @y goes down from the top, GL's goes up */
+        l = x + glyph->bearing_x;
+        r = l + glyph->width;
+        t = height - (y - glyph->bearing_y);
+        b = t - glyph->height;
+
+        /* same corners as model3d_new_quad() */
+        vx[0] = l; vx[1]  = t; vx[2]  = 0;
+        vx[3] = l; vx[4]  = b; vx[5]  = 0;
+        vx[6] = r; vx[7]  = b; vx[8]  = 0;
+        vx[9] = r; vx[10] = t; vx[11] = 0;
+        tx[0] = glyph->u0; tx[1] = glyph->v0;
+        tx[2] = glyph->u0; tx[3] = glyph->v1;
+        tx[4] = glyph->u1; tx[5] = glyph->v1;
+        tx[6] = glyph->u1; tx[7] = glyph->v0;
+        if (idx) {
+            idx[0] = nr * 4 + 0; idx[1] = nr * 4 + 1; idx[2] = nr * 4 + 3;
+            idx[3] = nr * 4 + 3; idx[4] = nr * 4 + 1; idx[5] = nr * 4 + 2;
+            idx += 6;
+        }
+        vx += 12;
+        tx += 8;
+        nr++;
+advance:
+        x += glyph->advance_x >> 6;
     }
 
-    return NULL;
+    return nr;
 }
 
+/* 4 vertices per glyph, all in one GLushort indexed draw */
+#define UI_TEXT_MAX_GLYPHS  (65536 / 4)
+
 struct ui_element *
 ui_render_string(struct ui *ui, struct font *font, struct ui_element *parent,
                  const char *str, float *color, unsigned long flags)
 {
     size_t len = strlen(str);
-    struct ui           fbo_ui;
-    struct ui_element   **uies;
+    struct ui           fbo_ui = {};
+    struct ui_element   *uie;
     struct model3dtx    *txm, *txmtex;
     struct fbo          *fbo;
     struct ui_text      uit = {};
     struct shader_prog  *prog;
-    struct glyph        *glyph;
     struct model3d      *m;
-    unsigned int        i, line;
-    float               x, y;
+    GLfloat             *vx, *tx;
+    GLushort            *idx;
+    unsigned int        nr;
 
     if (!flags)
         flags = UI_AF_VCENTER;
 
+    if (len > UI_TEXT_MAX_GLYPHS) {
+        warn("string too long (%zu), only showing %u characters\n", len, UI_TEXT_MAX_GLYPHS);
+        len = UI_TEXT_MAX_GLYPHS;
+    }
+
     // CHECK(uit       = ref_new(ui_text));
     uit.flags      = flags;
     uit.margin_x   = 10;
@@ -403,59 +506,41 @@ ui_render_string(struct ui *ui, struct font *font, struct ui_element *parent,
         parent->height = uit.height + uit.margin_y * 2;
         ui_element_position(parent, ui);
     }
-    y = (float)uit.margin_y + uit.y_off;
-    dbg_on(y < 0, "y: %f, height: %d y_off: %d, margin_y: %d\n",
-           y, uit.height, uit.y_off, uit.margin_y);
-    CHECK(prog      = shader_prog_find(ui->prog, "glyph"));
-    CHECK(uies = calloc(len, sizeof(struct ui_element *)));
-    uit.nr_uies = len;
-    for (line = 0, i = 0, x = x_off(&uit, line); i < len; i++) {
-        if (str[i] == '\n') {
-            line++;
-            y += (uit.height / uit.nr_lines);
-            x = x_off(&uit, line);
-            continue;
-        }
-        if (isspace(str[i])) {
-            x += uit.line_ws[line];
-            continue;
-        }
-        glyph   = font_get_glyph(uit.font, str[i]);
-        txm = ui_txm_find_by_texture(&fbo_ui, &glyph->tex);
-        if (!txm) {
-            m       = model3d_new_quad(prog, 0, 0, 0, glyph->width, glyph->height);
-            //model3d_set_name(m, "glyph");
-            model3d_set_name(m, "glyph_%s_%c", font_name(uit.font), str[i]);
-            m->cull_face = false;
-            m->alpha_blend = true;
-            txm = model3dtx_new_texture(ref_pass(m), &glyph->tex);
-            ui_add_model(&fbo_ui, txm);
-        }
-        /* uies[i] consumes (holds the only reference to) txm */
-        uies[i] = ui_element_new(&fbo_ui, NULL, txm, UI_AF_TOP | UI_AF_LEFT,
-                                      x + glyph->bearing_x,
-                                      y - glyph->bearing_y,
-                                      glyph->width, glyph->height);
-        ref_only(uies[i]->entity);
-        ref_only(uies[i]);
-        uies[i]->entity->color[0] = color[0];
-        uies[i]->entity->color[1] = color[1];
-        uies[i]->entity->color[2] = color[2];
-        uies[i]->entity->color[3] = color[3];
-        uies[i]->entity->color_pt = COLOR_PT_ALL;
-
-        uies[i]->prescaled = true;
-        
-        /* XXX: to trigger ui_element_position() XXX */
-        uies[i]->actual_x = uies[i]->actual_y = -1;
-        // uies[i]->actual_w = glyph->width;
-        // uies[i]->actual_h = glyph->height;
-        entity3d_update(uies[i]->entity, &fbo_ui);
-        x += glyph->advance_x >> 6;
+
+    CHECK(vx  = calloc(len * 12, sizeof(*vx)));
+    CHECK(tx  = calloc(len * 8, sizeof(*tx)));
+    CHECK(idx = calloc(len * 6, sizeof(*idx)));
+    nr = ui_text_quads(&uit, len, fbo_ui.width, fbo_ui.height, vx, tx, idx);
+
+    /* the whole string is one draw out of the font's atlas */
+    CHECK(prog = shader_prog_find(ui->prog, "glyph"));
+    if (nr) {
+        m = model3d_new_from_vectors("glyphs", prog, vx, nr * 12 * sizeof(*vx),
+                                     idx, nr * 6 * sizeof(*idx), tx, nr * 8 * sizeof(*tx),
+                                     NULL, 0);
+        model3d_set_name(m, "glyphs_%s", font_name(uit.font));
+        m->cull_face = false;
+        m->alpha_blend = true;
+        txm = model3dtx_new_texture(ref_pass(m), font_get_texture(uit.font));
+        ui_add_model(&fbo_ui, txm);
+
+        /* the quads are already in pixels, ortho projection is all it needs */
+        uie = ui_element_new(&fbo_ui, NULL, txm, UI_AF_BOTTOM | UI_AF_LEFT, 0, 0,
+                             fbo_ui.width, fbo_ui.height);
+        ref_only(uie->entity);
+        ref_only(uie);
+        memcpy(uie->entity->color, color, sizeof(uie->entity->color));
+        uie->entity->color_pt = COLOR_PT_ALL;
+        uie->prescaled = true;
+        ui_element_invalidate(uie);
+        entity3d_update(uie->entity, &fbo_ui);
     }
+    free(idx);
+    free(tx);
+    free(vx);
 
     fbo_prepare(fbo);
-    glDisable(GL_DEPTH_TEST);
+    render_depth_test(false);
     glClearColor(0.f, 0.f, 0.f, 0.f);
     glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
     // dbg("rendering '%s' uit(%dx%d) to FBO %d (%dx%d)\n", str, uit.width, uit.height,
@@ -466,7 +551,6 @@ ui_render_string(struct ui *ui, struct font *font, struct ui_element *parent,
 
     ref_put(prog);
 
-    free(uies);
     free(uit.line_nrw);
     free(uit.line_ws);
     free(uit.line_w);
@@ -490,6 +574,177 @@ ui_render_string(struct ui *ui, struct font *font, struct ui_element *parent,
     return uit.uietex;
 }
 
+/*
+ * Retained text: for the strings that stay on the screen and change, like
+ * counters and the debug overlay. The glyphs are drawn straight out of the
+ * font's atlas, without an FBO in between; ui_text_set() does nothing if
+ * the string is the same and otherwise only uploads the glyphs that moved
+ * or changed. The owner drops it with ref_put_last().
+ */
+static void ui_text_drop(struct ref *ref)
+{
+    struct ui_text *uit = container_of(ref, struct ui_text, ref);
+
+    if (uit->uietex)
+        ref_put_last(uit->uietex);
+    font_put(uit->font);
+    free((void *)uit->str);
+    free(uit->vx);
+    free(uit->tx);
+    free(uit->line_nrw);
+    free(uit->line_ws);
+    free(uit->line_w);
+}
+
+DECLARE_REFCLASS(ui_text);
+
+/* FNV-1a */
+static unsigned long ui_text_hash(const char *str)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+
+    return hash;
+}
+
+/* (re)create the model and the element with room for at least @nr glyphs */
+static void ui_text_grow(struct ui_text *uit, unsigned int nr)
+{
+    struct shader_prog *prog;
+    struct model3dtx *txm;
+    struct model3d *m;
+    GLfloat *vx, *tx;
+    GLushort *idx;
+    unsigned int i;
+
+    if (uit->uietex)
+        ref_put_last(uit->uietex);
+
+    for (uit->cap = 16; uit->cap < nr; uit->cap *= 2)
+        ;
+    uit->cap = min(uit->cap, UI_TEXT_MAX_GLYPHS);
+
+    /* the indices never change, the vertices get filled in by the caller */
+    CHECK(vx  = calloc(uit->cap * 12, sizeof(*vx)));
+    CHECK(tx  = calloc(uit->cap * 8, sizeof(*tx)));
+    CHECK(idx = calloc(uit->cap * 6, sizeof(*idx)));
+    for (i = 0; i < uit->cap; i++) {
+        idx[i * 6 + 0] = i * 4 + 0; idx[i * 6 + 1] = i * 4 + 1; idx[i * 6 + 2] = i * 4 + 3;
+        idx[i * 6 + 3] = i * 4 + 3; idx[i * 6 + 4] = i * 4 + 1; idx[i * 6 + 5] = i * 4 + 2;
+    }
+
+    CHECK(prog = shader_prog_find(uit->ui->prog, "glyph"));
+    m = model3d_new_from_vectors("ui_text", prog, vx, uit->cap * 12 * sizeof(*vx),
+                                 idx, uit->cap * 6 * sizeof(*idx), tx, uit->cap * 8 * sizeof(*tx),
+                                 NULL, 0);
+    ref_put(prog);
+    free(idx);
+    free(tx);
+    free(vx);
+
+    model3d_set_name(m, "ui_text_%s", font_name(uit->font));
+    m->cull_face = false;
+    m->alpha_blend = true;
+    txm = model3dtx_new_texture(ref_pass(m), font_get_texture(uit->font));
+    ui_add_model(uit->ui, txm);
+
+    uit->uietex = ui_element_new(uit->ui, uit->parent, ref_pass(txm),
+                                 uit->parent ? UI_AF_CENTER : UI_AF_HCENTER | UI_AF_BOTTOM,
+                                 0, 0, 1, 1);
+    ref_only(uit->uietex->entity);
+    ref_only(uit->uietex);
+    memcpy(uit->uietex->entity->color, uit->color, sizeof(uit->color));
+    uit->uietex->entity->color_pt = COLOR_PT_ALL;
+    /* the quads are in pixels already */
+    uit->uietex->prescaled = true;
+    ui_element_invalidate(uit->uietex);
+
+    /* nothing in the new buffers yet */
+    uit->nr_glyphs = 0;
+}
+
+static int ui_text_set(struct ui_text *uit, const char *str)
+{
+    unsigned long hash = ui_text_hash(str);
+    unsigned int nr, nr_same, first, last;
+    size_t len = strlen(str);
+    int width, height;
+    GLfloat *vx, *tx;
+
+    if (uit->str && hash == uit->hash && !strcmp(str, uit->str))
+        return 0;
+
+    len = min(len, UI_TEXT_MAX_GLYPHS);
+    free((void *)uit->str);
+    CHECK(uit->str = strndup(str, len));
+    uit->hash = hash;
+
+    ui_text_measure(uit);
+    width = uit->width + uit->margin_x * 2;
+    height = uit->height + uit->margin_y * 2;
+
+    CHECK(vx = calloc(len * 12 + 1, sizeof(*vx)));
+    CHECK(tx = calloc(len * 8 + 1, sizeof(*tx)));
+    nr = ui_text_quads(uit, len, width, height, vx, tx, NULL);
+
+    if (!uit->uietex || nr > uit->cap)
+        ui_text_grow(uit, nr);
+
+    /* what's the same on both ends stays in the buffers */
+    nr_same = min(nr, uit->nr_glyphs);
+    for (first = 0; first < nr_same; first++)
+        if (memcmp(&vx[first * 12], &uit->vx[first * 12], sizeof(*vx) * 12) ||
+            memcmp(&tx[first * 8], &uit->tx[first * 8], sizeof(*tx) * 8))
+            break;
+    for (last = nr_same; last > first; last--)
+        if (memcmp(&vx[(last - 1) * 12], &uit->vx[(last - 1) * 12], sizeof(*vx) * 12) ||
+            memcmp(&tx[(last - 1) * 8], &uit->tx[(last - 1) * 8], sizeof(*tx) * 8))
+            break;
+    if (nr > nr_same)
+        last = nr;
+
+    model3d_update_vectors(uit->uietex->entity->txmodel->model, &vx[first * 12], &tx[first * 8],
+                           first * 4, (last - first) * 4, nr * 6);
+    free(uit->vx);
+    free(uit->tx);
+    uit->vx = vx;
+    uit->tx = tx;
+    uit->nr_glyphs = nr;
+
+    uit->uietex->width = width;
+    uit->uietex->height = height;
+    if (uit->parent) {
+        uit->parent->width = width;
+        uit->parent->height = height;
+    }
+
+    return 0;
+}
+
+static struct ui_text *
+ui_text_new(struct ui *ui, struct font *font, struct ui_element *parent,
+            const char *str, float *color, unsigned long flags)
+{
+    struct ui_text *uit;
+
+    uit = ref_new(ui_text);
+    if (!uit)
+        return NULL;
+
+    uit->ui       = ui;
+    uit->font     = font_get(font);
+    uit->parent   = parent;
+    uit->flags    = flags ? flags : UI_AF_VCENTER;
+    uit->margin_x = 10;
+    uit->margin_y = 10;
+    memcpy(uit->color, color, sizeof(uit->color));
+    ui_text_set(uit, str);
+
+    return uit;
+}
+
 static const char *menu_font = "Rancho-Regular.ttf";
 static struct ui_element *ui_roll_element;
 
@@ -555,13 +810,13 @@ static void ui_roll_init(struct ui *ui)
 }
 
 static bool display_fps;
-static struct ui_element *bottom_uit;
+static struct ui_text *bottom_uit;
 static struct ui_element *bottom_element;
 static const char **ui_debug_mods = NULL;
 static unsigned int nr_ui_debug_mods;
 static unsigned int ui_debug_current;
 static char **ui_debug_strs;
-static struct ui_element *debug_uit;
+static struct ui_text *debug_uit;
 static struct ui_element *debug_element;
 static struct font *debug_font;
 
@@ -600,6 +855,10 @@ static void ui_debug_update(struct ui *ui)
 
     // ui_debug_str = x;
     if (debug_uit) {
+        if (str) {
+            ui_text_set(debug_uit, str);
+            return;
+        }
         ref_put_last(debug_uit);
         debug_uit = NULL;
     } else if (str) {
@@ -607,7 +866,7 @@ static void ui_debug_update(struct ui *ui)
     }
     if (str) {
         font = font_get(debug_font);
-        debug_uit = ui_render_string(ui, font, debug_element, str, color, UI_AF_LEFT);
+        debug_uit = ui_text_new(ui, font, debug_element, str, color, UI_AF_LEFT);
         font_put(font);
     }
 }
@@ -643,6 +902,7 @@ static void __set_visibility(struct ui_element *uie, void *data)
 {
     uie->entity->visible = !!*(int *)data;
     uie->force_hidden = !*(int *)data;
+    ui_element_invalidate(uie);
 }
 
 void ui_element_set_visibility(struct ui_element *uie, int visible)
@@ -1289,14 +1549,15 @@ static int ui_handle_command(struct message *m, void *data)
         return 0;
 
     if (m->cmd.status && display_fps) {
+        CHECK(asprintf(&str, "FPS: %d\nTime: %d:%02d\nMem: %" PRIu64 "M GPU: %" PRIu64 "M",
+                       m->cmd.fps, m->cmd.sys_seconds / 60, m->cmd.sys_seconds % 60,
+                       m->cmd.mem_live >> 20, m->cmd.gpu_mem_live >> 20));
         if (bottom_uit) {
-            ref_put_last(bottom_uit);
+            ui_text_set(bottom_uit, str);
         } else {
             bottom_element = ui_element_new(ui, NULL, ui_quadtx, UI_AF_BOTTOM | UI_AF_RIGHT, 0.01, 50, 400, 150);
+            bottom_uit = ui_text_new(ui, font, bottom_element, str, color, UI_AF_RIGHT);
         }
-        CHECK(asprintf(&str, "FPS: %d\nTime: %d:%02d", m->cmd.fps,
-                       m->cmd.sys_seconds / 60, m->cmd.sys_seconds % 60));
-        bottom_uit = ui_render_string(ui, font, bottom_element, str, color, UI_AF_RIGHT);
     } else if (m->cmd.menu_enter) {
         ui_menu_init(ui);
     } else if (m->cmd.menu_exit) {
@@ -1413,7 +1674,8 @@ static int ui_handle_input(struct message *m, void *data)
 
 static struct ui_element *limeric_uit;
 static struct ui_element *build_uit;
-struct ui_element *uie0, *uie1, *health, *pocket, **pocket_text;
+struct ui_element *uie0, *uie1, *health, *pocket;
+static struct ui_text **pocket_text;
 static int pocket_buckets, *pocket_count, *pocket_total;
 static float health_bar_width;
 
@@ -1456,7 +1718,7 @@ struct ui_element *ui_pocket_new(struct ui *ui, const char **tex, int nr)
     if (!font)
         return NULL;
 
-    CHECK(pocket_text = calloc(nr, sizeof(struct ui_element *)));
+    CHECK(pocket_text = calloc(nr, sizeof(*pocket_text)));
     CHECK(pocket_count = calloc(nr, sizeof(int)));
     CHECK(pocket_total = calloc(nr, sizeof(int)));
 
@@ -1470,7 +1732,7 @@ struct ui_element *ui_pocket_new(struct ui *ui, const char **tex, int nr)
 
         pic = ui_element_new(ui, p, txm, UI_AF_LEFT | UI_AF_TOP, 0, 100 * i, 100, 100);
         t = ui_element_new(ui, p, ui_quadtx, UI_AF_LEFT | UI_AF_TOP, 100, 100 * i, 100, 100);
-        pocket_text[i] = ui_render_string(ui, font, t, "", color, UI_AF_LEFT | UI_AF_VCENTER);
+        pocket_text[i] = ui_text_new(ui, font, t, "", color, UI_AF_LEFT | UI_AF_VCENTER);
     }
     ui_element_set_visibility(p, 0);
     font_put(font);
@@ -1479,6 +1741,17 @@ struct ui_element *ui_pocket_new(struct ui *ui, const char **tex, int nr)
     return p;
 }
 
+static void ui_pocket_done(void)
+{
+    int i;
+
+    for (i = 0; i < pocket_buckets; i++)
+        ref_put_last(pocket_text[i]);
+    free(pocket_text);
+    pocket_text = NULL;
+    pocket_buckets = 0;
+}
+
 void show_apple_in_pocket()
 {
     ui_element_set_visibility(pocket, 1);
@@ -1491,23 +1764,13 @@ void show_empty_pocket()
 
 void pocket_update(struct ui *ui)
 {
-    struct ui_element *parent;
-    float color[4] = { 1, 1, 1, 1 };
-    char buf[10];
-    struct font *font = font_open("ProggyTiny.ttf", 48);
+    char buf[32];
     int i;
 
-    if (!font)
-        return;
-
     for (i = 0; i < pocket_buckets; i++) {
-        parent = pocket_text[i]->parent;
-        ref_put_last(pocket_text[i]);
-
-        sprintf(buf, "x %d/%d", pocket_count[i], pocket_total[i]);
-        pocket_text[i] = ui_render_string(ui, font, parent, buf, color, UI_AF_LEFT | UI_AF_VCENTER);
+        snprintf(buf, sizeof(buf), "x %d/%d", pocket_count[i], pocket_total[i]);
+        ui_text_set(pocket_text[i], buf);
     }
-    font_put(font);
 }
 
 void pocket_count_set(struct ui *ui, int kind, int count)
@@ -1602,6 +1865,7 @@ int ui_init(struct ui *ui, int width, int height)
 
     ui_debug_mod_str("off");
     mq_init(&ui->mq, ui);
+    uia_init(ui);
     lib_request_shaders("glyph", &ui->prog);
     lib_request_shaders("ui", &ui->prog);
 
@@ -1626,7 +1890,8 @@ int ui_init(struct ui *ui, int width, int height)
     pocket = ui_pocket_new(ui, pocket_textures, array_size(pocket_textures));
     // wheel = ui_wheel_new(ui, wheel_items);
     font_put(font);
-    subscribe(MT_COMMAND, ui_handle_command, ui);
+    subscribe_mask(MT_COMMAND, ui_handle_command, ui,
+                   MSG_COMMAND(status) | MSG_COMMAND(menu_enter) | MSG_COMMAND(menu_exit));
     subscribe(MT_INPUT, ui_handle_input, ui);
     return 0;
 }
@@ -1655,8 +1920,11 @@ void ui_done(struct ui *ui)
         ref_put_last(debug_uit);
     }
     ui_roll_done();
+    ui_pocket_done();
 
     mq_release(&ui->mq);
+    /* after the elements, which drop their animations */
+    uia_done(ui);
 }
 
 void ui_show(struct ui *ui)
@@ -30,22 +30,65 @@ enum uie_mv {
 
 struct ui_element;
 
-struct ui_animation {
-    struct list entry;
-    struct ui_element *uie;
-    void (*trans)(struct ui_animation *uia);
-    void *setter;
-    void (*iter)(struct ui_animation *uia);
-    unsigned long start_frame;
-    unsigned long nr_frames;
-    unsigned long sound_frame;
-    int           int0;
-    int           int1;
-    float         float0;
-    float         float_start;
-    float         float_end;
-    float         float_delta;
-    float         float_shift;
+/*
+ * Animations: each element's uia_*() calls queue up steps, which start in
+ * order; tweens run alongside the steps that follow them, uia_skip_frames()
+ * holds the rest back for a while and uia_action() waits for the element's
+ * tweens to finish. Started tweens live in struct uia_tweens, one array
+ * per field, and uia_update() runs through all of them in one go.
+ */
+enum uia_curve {
+    /* start + (end - start) * t */
+    UIA_LIN = 0,
+    /* start + param * frames^2 / 2, until it gets to end */
+    UIA_QUAD,
+    /* cos_interp(start, end, shift + param * t) */
+    UIA_COS,
+};
+
+typedef void (*uia_setter_fn)(struct ui_element *uie, float value);
+typedef void (*uia_action_fn)(struct ui_element *uie);
+
+struct uia_tween {
+    /* either one */
+    float           *target;
+    uia_setter_fn   setter;
+    enum uia_curve  curve;
+    float           start, end;
+    float           param, shift;
+    /* 0: until it gets to end */
+    unsigned long   nr_frames;
+};
+
+enum uia_step_type {
+    UIA_STEP_SKIP = 0,
+    UIA_STEP_ACTION,
+    UIA_STEP_VISIBLE,
+    UIA_STEP_TWEEN,
+};
+
+struct uia_step {
+    /* NULL: the element is gone */
+    struct ui_element       *uie;
+    enum uia_step_type      type;
+    union {
+        /* UIA_STEP_SKIP */
+        unsigned long       until;
+        uia_action_fn       action;
+        int                 visible;
+        struct uia_tween    tween;
+    };
+};
+
+struct uia_tweens {
+    unsigned int        nr, nr_alloc;
+    /* NULL: the element is gone */
+    struct ui_element   **uie;
+    float               **target;
+    uia_setter_fn       *setter;
+    unsigned char       *curve;
+    float               *start, *end, *param, *shift;
+    unsigned long       *start_frame, *nr_frames;
 };
 
 struct ui_element {
@@ -55,7 +98,9 @@ struct ui_element {
     struct ui        *ui;
     struct list      children;
     struct list      child_entry;
-    struct list      animation;
+    /* running tweens, see uia_update() */
+    unsigned int     nr_tweens;
+    unsigned long    uia_blocked;
     unsigned long    affinity;
     void             *priv;
     void             (*on_click)(struct ui_element *uie, float x, float y);
@@ -74,6 +119,15 @@ struct ui_element {
     float            actual_y;
     float            actual_w;
     float            actual_h;
+    /* layout inputs as of the last layout, see ui_element_dirty() */
+    float            layout[UIE_MV_MAX];
+    unsigned long    layout_affinity;
+    int              layout_hidden;
+    bool             layout_dirty;
+    unsigned long    layout_ui_gen;
+    unsigned long    layout_parent_gen;
+    /* bumped every time actual_* are recomputed */
+    unsigned long    layout_gen;
 };
 
 struct ui_widget_builder {
@@ -104,8 +158,15 @@ struct ui {
     struct ui_widget   *inventory;
     unsigned long      frames_total;
     int width, height;
+    /* the size the layout was last done for */
+    int layout_width, layout_height;
+    unsigned long      layout_gen;
     bool modal;
     float mod_x, mod_y;
+    /* animations that haven't started and the tweens that have */
+    darray(struct uia_step, uia_steps);
+    struct uia_tweens  tweens;
+    unsigned long      uia_pass;
 };
 
 void ui_pip_update(struct ui *ui, struct fbo *fbo);
@@ -122,8 +183,12 @@ void ui_element_set_visibility(struct ui_element *uie, int visible);
 void ui_element_set_alpha(struct ui_element *uie, float alpha);
 
 /* animations */
+void uia_init(struct ui *ui);
+void uia_done(struct ui *ui);
+/* once a frame, before the elements are laid out */
+void uia_update(struct ui *ui);
 void uia_skip_frames(struct ui_element *uie, unsigned long frames);
-void uia_action(struct ui_element *uie, void (*callback)(struct ui_animation *));
+void uia_action(struct ui_element *uie, uia_action_fn callback);
 void uia_set_visible(struct ui_element *uie, int visible);
 void uia_lin_float(struct ui_element *uie, void *setter, float start, float end, unsigned long frames);
 void uia_quad_float(struct ui_element *uie, void *setter, float start, float end, float accel);
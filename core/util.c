@@ -42,28 +42,57 @@ void *memdup(const void *x, size_t size)
     return r;
 }
 
-void *darray_resize(struct darray *da, unsigned int nr_el)
+/* exactly @nr_alloc elements, out of the inline buffer if need be */
+static int darray_realloc(struct darray *da, unsigned int nr_alloc)
 {
     void *new;
 
+    if (da->small && da->array == da->small) {
+        new = malloc(nr_alloc * da->elsz);
+        if (new)
+            memcpy(new, da->array, da->nr_el * da->elsz);
+    } else {
+        new = realloc(da->array, nr_alloc * da->elsz);
+    }
+
+    if (!new)
+        return -ENOMEM;
+
+    da->array = new;
+    da->nr_alloc = nr_alloc;
+
+    return 0;
+}
+
+int darray_reserve(struct darray *da, unsigned int nr_el)
+{
+    if (nr_el <= da->nr_alloc)
+        return 0;
+
+    return darray_realloc(da, nr_el);
+}
+
+void *darray_resize(struct darray *da, unsigned int nr_el)
+{
+    unsigned int nr_alloc;
+
     /*
-     * XXX: be smarter. For now, just avoid realloc() on deletion:
+     * Shrinking keeps the memory around:
      *  - the array is likely to get repopulated (game.c)
      *  - or, filled in once and then cleared out (gltf.c)
      */
-    if (nr_el < da->nr_el)
-        goto out;
-
-    new = realloc(da->array, nr_el * da->elsz);
+    if (nr_el > da->nr_alloc) {
+        nr_alloc = max(da->nr_alloc * 2, 4u);
+        if (nr_alloc < nr_el)
+            nr_alloc = nr_el;
 
-    if (!new)
-        return NULL;
+        if (darray_realloc(da, nr_alloc))
+            return NULL;
+    }
 
-    da->array = new;
     if (nr_el > da->nr_el)
-        memset(new + da->nr_el * da->elsz, 0, (nr_el - da->nr_el) * da->elsz);
+        memset(da->array + da->nr_el * da->elsz, 0, (nr_el - da->nr_el) * da->elsz);
 
-out:
     da->nr_el = nr_el;
 
     return da->array;
@@ -107,109 +136,389 @@ void darray_delete(struct darray *da, int idx)
 
 void darray_clearout(struct darray *da)
 {
-    free(da->array);
-    da->array = NULL;
+    if (da->array != da->small)
+        free(da->array);
+    da->array = da->small;
+    da->nr_alloc = da->nr_small;
     da->nr_el = 0;
 }
 
-static unsigned long hash_simple(struct hashmap *hm, unsigned int key)
+/* murmur3's finalizer: keys are often sequential, the index takes low bits */
+static unsigned int hash_int(unsigned int key)
 {
-    return key & (hm->nr_buckets - 1);
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+
+    return key;
 }
 
-int hashmap_init(struct hashmap *hm, size_t nr_buckets)
+/* FNV-1a */
+static unsigned int hash_str(const char *str)
 {
-    int i;
+    unsigned int hash = 2166136261u;
 
-    if (nr_buckets & (nr_buckets - 1))
-        return -1;
+    for (; *str; str++)
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+
+    return hash;
+}
 
-    hm->buckets = calloc(nr_buckets, sizeof(struct list));
+/* how many entries fit before the index needs to grow */
+static inline size_t hashmap_capacity(size_t nr_buckets)
+{
+    return nr_buckets - max(nr_buckets / 8, 1);
+}
+
+static inline size_t hashmap_dist(struct hashmap *hm, size_t slot, unsigned int hash)
+{
+    return (slot - hash) & (hm->nr_buckets - 1);
+}
+
+static void hashmap_index_add(struct hashmap *hm, unsigned int ent)
+{
+    size_t mask = hm->nr_buckets - 1, slot, dist, edist;
+    unsigned int hash = hm->entries[ent].hash, tmp;
+
+    ent++;
+    for (slot = hash & mask, dist = 0;; slot = (slot + 1) & mask, dist++) {
+        if (!hm->index[slot]) {
+            hm->index[slot] = ent;
+            return;
+        }
+
+        /* take from the rich: the one that's closer to home moves on */
+        edist = hashmap_dist(hm, slot, hm->entries[hm->index[slot] - 1].hash);
+        if (edist < dist) {
+            tmp = hm->index[slot];
+            hm->index[slot] = ent;
+            ent = tmp;
+            dist = edist;
+        }
+    }
+}
+
+/* drops the deleted entries and rebuilds the index, @nr_buckets big */
+static int hashmap_rehash(struct hashmap *hm, size_t nr_buckets)
+{
+    struct hashmap_entry *entries;
+    unsigned int *index;
+    size_t i, nr = 0;
+
+    index = calloc(nr_buckets, sizeof(*index));
+    if (!index)
+        return -ENOMEM;
+
+    entries = malloc(hashmap_capacity(nr_buckets) * sizeof(*entries));
+    if (!entries) {
+        free(index);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < hm->nr_entries; i++)
+        if (!hm->entries[i].dead)
+            entries[nr++] = hm->entries[i];
+
+    free(hm->index);
+    free(hm->entries);
+    hm->index = index;
+    hm->entries = entries;
     hm->nr_buckets = nr_buckets;
-    hm->hash = hash_simple;
-    list_init(&hm->list);
+    hm->nr_entries = nr;
 
-    for (i = 0; i < nr_buckets; i++)
-        list_init(&hm->buckets[i]);
+    for (i = 0; i < nr; i++)
+        hashmap_index_add(hm, i);
 
     return 0;
 }
 
+int hashmap_init(struct hashmap *hm, size_t nr_buckets)
+{
+    memset(hm, 0, sizeof(*hm));
+
+    /* the index needs at least one empty slot to stop the probes */
+    if (nr_buckets < 2 || nr_buckets & (nr_buckets - 1))
+        return -EINVAL;
+
+    return hashmap_rehash(hm, nr_buckets);
+}
+
 void hashmap_done(struct hashmap *hm)
 {
-    struct hashmap_entry *e, *it;
+    size_t i;
 
-    list_for_each_entry_iter(e, it, &hm->list, list_entry) {
-        list_del(&e->list_entry);
-        free(e);
-    }
-    free(hm->buckets);
-    hm->nr_buckets = 0;
+    for (i = 0; i < hm->nr_entries; i++)
+        free(hm->entries[i].str);
+    free(hm->entries);
+    free(hm->index);
+    memset(hm, 0, sizeof(*hm));
 }
 
-static struct hashmap_entry *
-_hashmap_find(struct hashmap *hm, unsigned int key, unsigned long *phash)
+/* the slot in the index, or -1 */
+static long hashmap_lookup(struct hashmap *hm, unsigned int hash, unsigned int key, const char *str)
 {
+    size_t mask = hm->nr_buckets - 1, slot, dist;
     struct hashmap_entry *e;
 
-    *phash = hm->hash(hm, key);
-    list_for_each_entry(e, &hm->buckets[*phash], entry) {
-        if (e->key == key)
-            return e;
+    if (!hm->nr_buckets)
+        return -1;
+
+    for (slot = hash & mask, dist = 0; hm->index[slot]; slot = (slot + 1) & mask, dist++) {
+        e = &hm->entries[hm->index[slot] - 1];
+        /* it would have taken this slot */
+        if (hashmap_dist(hm, slot, e->hash) < dist)
+            break;
+        if (e->hash == hash && (str ? !strcmp(e->str, str) : e->key == key))
+            return slot;
     }
 
-    return NULL;
+    return -1;
 }
 
-void *hashmap_find(struct hashmap *hm, unsigned int key)
+static void *hashmap_find_hash(struct hashmap *hm, unsigned int hash, unsigned int key, const char *str)
 {
-    unsigned long hash;
-    struct hashmap_entry *e = _hashmap_find(hm, key, &hash);
+    long slot = hashmap_lookup(hm, hash, key, str);
 
-    return e ? e->value : NULL;
+    return slot < 0 ? NULL : hm->entries[hm->index[slot] - 1].value;
 }
 
-void hashmap_delete(struct hashmap *hm, unsigned int key)
+/* Robin Hood leaves no tombstones: shift the rest of the run back */
+static void hashmap_delete_hash(struct hashmap *hm, unsigned int hash, unsigned int key, const char *str)
 {
-    unsigned long hash;
-    struct hashmap_entry *e = _hashmap_find(hm, key, &hash);
+    long slot = hashmap_lookup(hm, hash, key, str);
+    size_t mask = hm->nr_buckets - 1, next;
+    struct hashmap_entry *e;
 
-    if (!e)
+    if (slot < 0)
         return;
 
-    list_del(&e->entry);
-    list_del(&e->list_entry);
-    free(e);
+    e = &hm->entries[hm->index[slot] - 1];
+    free(e->str);
+    e->str = NULL;
+    e->dead = true;
+    hm->nr_items--;
+
+    for (next = (slot + 1) & mask; hm->index[next]; slot = next, next = (next + 1) & mask) {
+        if (!hashmap_dist(hm, next, hm->entries[hm->index[next] - 1].hash))
+            break;
+        hm->index[slot] = hm->index[next];
+    }
+    hm->index[slot] = 0;
 }
 
-int hashmap_insert(struct hashmap *hm, unsigned int key, void *value)
+static int hashmap_insert_hash(struct hashmap *hm, unsigned int hash, unsigned int key,
+                               const char *str, void *value)
 {
-    unsigned long hash;
     struct hashmap_entry *e;
-    void *v;
+    size_t nr_buckets;
+    int err;
 
-    if (_hashmap_find(hm, key, &hash))
+    if (!hm->nr_buckets)
+        return -EINVAL;
+
+    if (hashmap_lookup(hm, hash, key, str) >= 0)
         return -EBUSY;
 
-    e = calloc(1, sizeof(*e));
-    if (!e)
-        return -ENOMEM;
+    if (hm->nr_entries == hashmap_capacity(hm->nr_buckets)) {
+        /* mostly deleted entries: compact them instead of growing */
+        nr_buckets = hm->nr_buckets;
+        if (hm->nr_items >= hm->nr_entries / 2)
+            nr_buckets *= 2;
+
+        err = hashmap_rehash(hm, nr_buckets);
+        if (err)
+            return err;
+    }
+
+    e = &hm->entries[hm->nr_entries];
+    e->str = NULL;
+    if (str) {
+        e->str = strdup(str);
+        if (!e->str)
+            return -ENOMEM;
+    }
 
     e->value = value;
     e->key = key;
-    list_append(&hm->buckets[hash], &e->entry);
-    list_append(&hm->list, &e->list_entry);
+    e->hash = hash;
+    e->dead = false;
+    hashmap_index_add(hm, hm->nr_entries++);
+    hm->nr_items++;
 
     return 0;
 }
 
+void *hashmap_find(struct hashmap *hm, unsigned int key)
+{
+    return hashmap_find_hash(hm, hash_int(key), key, NULL);
+}
+
+void hashmap_delete(struct hashmap *hm, unsigned int key)
+{
+    hashmap_delete_hash(hm, hash_int(key), key, NULL);
+}
+
+int hashmap_insert(struct hashmap *hm, unsigned int key, void *value)
+{
+    return hashmap_insert_hash(hm, hash_int(key), key, NULL, value);
+}
+
+void *hashmap_find_str(struct hashmap *hm, const char *key)
+{
+    return hashmap_find_hash(hm, hash_str(key), 0, key);
+}
+
+void hashmap_delete_str(struct hashmap *hm, const char *key)
+{
+    hashmap_delete_hash(hm, hash_str(key), 0, key);
+}
+
+int hashmap_insert_str(struct hashmap *hm, const char *key, void *value)
+{
+    return hashmap_insert_hash(hm, hash_str(key), 0, key, value);
+}
+
 void hashmap_for_each(struct hashmap *hm, void (*cb)(void *value, void *data), void *data)
 {
-    struct hashmap_entry *e;
+    size_t i;
+
+    for (i = 0; i < hm->nr_entries; i++)
+        if (!hm->entries[i].dead)
+            cb(hm->entries[i].value, data);
+}
+
+#define XXH_P1 0x9e3779b185ebca87ull
+#define XXH_P2 0xc2b2ae3d27d4eb4full
+#define XXH_P3 0x165667b19e3779f9ull
+#define XXH_P4 0x85ebca77c2b2ae63ull
+#define XXH_P5 0x27d4eb2f165667c5ull
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* little endian hosts only, same as the rest of the on-disk formats */
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ xxh64_round(0, v)) * XXH_P1 + XXH_P4;
+}
 
-    list_for_each_entry(e, &hm->list, list_entry) {
-        cb(e->value, data);
+/* 4 lanes of 8 bytes per stripe, all of them independent */
+static const unsigned char *xxh64_stripes(uint64_t v[4], const unsigned char *p, size_t nr)
+{
+    for (; nr; nr--, p += 32) {
+        v[0] = xxh64_round(v[0], read64(p));
+        v[1] = xxh64_round(v[1], read64(p + 8));
+        v[2] = xxh64_round(v[2], read64(p + 16));
+        v[3] = xxh64_round(v[3], read64(p + 24));
+    }
+
+    return p;
+}
+
+void hash64_init(struct hash64 *h, uint64_t seed)
+{
+    h->v[0]   = seed + XXH_P1 + XXH_P2;
+    h->v[1]   = seed + XXH_P2;
+    h->v[2]   = seed;
+    h->v[3]   = seed - XXH_P1;
+    h->seed   = seed;
+    h->total  = 0;
+    h->nr_buf = 0;
+}
+
+void hash64_update(struct hash64 *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    h->total += len;
+
+    if (h->nr_buf) {
+        n = min(len, sizeof(h->buf) - h->nr_buf);
+        memcpy(h->buf + h->nr_buf, p, n);
+        h->nr_buf += n;
+        p += n;
+        len -= n;
+        if (h->nr_buf < sizeof(h->buf))
+            return;
+        xxh64_stripes(h->v, h->buf, 1);
+        h->nr_buf = 0;
     }
+
+    p = xxh64_stripes(h->v, p, len / 32);
+    len %= 32;
+    memcpy(h->buf, p, len);
+    h->nr_buf = len;
+}
+
+uint64_t hash64_final(struct hash64 *h)
+{
+    const unsigned char *p = h->buf, *end = h->buf + h->nr_buf;
+    uint64_t acc;
+
+    if (h->total >= 32) {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        acc = xxh64_merge(acc, h->v[0]);
+        acc = xxh64_merge(acc, h->v[1]);
+        acc = xxh64_merge(acc, h->v[2]);
+        acc = xxh64_merge(acc, h->v[3]);
+    } else {
+        acc = h->seed + XXH_P5;
+    }
+
+    acc += h->total;
+
+    for (; p + 8 <= end; p += 8)
+        acc = rotl64(acc ^ xxh64_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        acc = rotl64(acc ^ (read32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        acc = rotl64(acc ^ (*p * XXH_P5), 11) * XXH_P1;
+
+    acc ^= acc >> 33;
+    acc *= XXH_P2;
+    acc ^= acc >> 29;
+    acc *= XXH_P3;
+    acc ^= acc >> 32;
+
+    return acc;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    struct hash64 h;
+
+    hash64_init(&h, seed);
+    hash64_update(&h, data, len);
+
+    return hash64_final(&h);
 }
 
 void bitmap_init(struct bitmap *b, size_t bits)
@@ -258,6 +567,46 @@ bool bitmap_includes(struct bitmap *b, struct bitmap *subset)
     return true;
 }
 
+/*
+ * Stable LSD radix sort on 64-bit keys, a byte at a time; @tmp must have
+ * room for @nr items. Passes where all the keys have the same byte are
+ * skipped, so the sort costs as many passes as there are "live" bytes in
+ * the keys. Returns whichever of @items or @tmp ends up holding the result.
+ */
+struct sort_item *radix_sort(struct sort_item *items, struct sort_item *tmp, size_t nr)
+{
+    struct sort_item *src = items, *dst = tmp, *swap;
+    size_t count[256], off;
+    unsigned int shift;
+    int i;
+
+    for (shift = 0; shift < 64; shift += 8) {
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < nr; i++)
+            count[(src[i].key >> shift) & 0xff]++;
+
+        /* all the keys share this byte */
+        if (count[(src[0].key >> shift) & 0xff] == nr)
+            continue;
+
+        for (i = 0, off = 0; i < 256; i++) {
+            size_t c = count[i];
+
+            count[i] = off;
+            off += c;
+        }
+
+        for (i = 0; i < nr; i++)
+            dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    return src;
+}
+
 struct exit_handler {
     exit_handler_fn     fn;
     struct exit_handler *next;
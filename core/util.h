@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
 #include "logger.h"
 
 typedef unsigned char uchar;
@@ -89,10 +90,19 @@ static inline const char *str_basename(const char *str)
     return str;
 }
 
+/*
+ * Grows geometrically: @nr_alloc is how many elements fit in @array, and
+ * it doesn't shrink until darray_clearout(). The darray_small() ones start
+ * out in the inline buffer, @small, and only go to the heap if they
+ * outgrow it, so they can't be moved around by value.
+ */
 struct darray {
     void            *array;
     size_t          elsz;
     unsigned int    nr_el;
+    unsigned int    nr_alloc;
+    void            *small;
+    unsigned int    nr_small;
 };
 
 #define darray(_type, _name) \
@@ -101,7 +111,19 @@ union { \
     struct darray   da; \
 } _name;
 
-#define darray_init(_da) { (_da)->da.elsz = sizeof(*(_da)->x); (_da)->da.nr_el = 0; (_da)->x = NULL; }
+#define darray_small(_type, _name, _nr) \
+struct { \
+    union { \
+        _type           *x; \
+        struct darray   da; \
+    }; \
+    _type           __small[_nr]; \
+} _name;
+
+#define darray_init(_da) { (_da)->da.elsz = sizeof(*(_da)->x); (_da)->da.nr_el = 0; (_da)->x = NULL; \
+    (_da)->da.nr_alloc = 0; (_da)->da.small = NULL; (_da)->da.nr_small = 0; }
+#define darray_init_small(_da) { darray_init(_da); (_da)->x = (_da)->da.small = (_da)->__small; \
+    (_da)->da.nr_alloc = (_da)->da.nr_small = array_size((_da)->__small); }
 static inline void *darray_get(struct darray *da, unsigned int el)
 {
     if (el >= da->nr_el)
@@ -110,6 +132,7 @@ static inline void *darray_get(struct darray *da, unsigned int el)
 }
 
 void *darray_resize(struct darray *da, unsigned int nr_el);
+int darray_reserve(struct darray *da, unsigned int nr_el);
 void *darray_add(struct darray *da);
 void *darray_insert(struct darray *da, int idx);
 void darray_delete(struct darray *da, int idx);
@@ -172,27 +195,60 @@ static inline void list_del(struct list *el)
          &(__ent->__link) != (__list);             \
          __ent = __it, __it = list_next_entry(__it, __link))
 
-struct hashmap {
-    struct list *buckets;
-    struct list list;
-    size_t      nr_buckets;
-    unsigned long (*hash)(struct hashmap *hm, unsigned int key);
-};
-
+/*
+ * Open addressing: the index is a power of 2 table of slots, probed
+ * linearly in Robin Hood order, pointing into the entries, which are
+ * inline, in insertion order, so that's the hashmap_for_each() order.
+ * It grows by a rehash at 7/8 of the index. Keys are either integers
+ * or strings (the _str() variants, they copy the key), not both in one
+ * map.
+ */
 struct hashmap_entry {
-    struct list     entry;
-    struct list     list_entry;
     void            *value;
+    char            *str;
     unsigned int    key;
+    unsigned int    hash;
+    bool            dead;
+};
+
+struct hashmap {
+    /* entry + 1, 0 is an empty slot */
+    unsigned int            *index;
+    struct hashmap_entry    *entries;
+    size_t                  nr_buckets;
+    /* including the deleted ones, until the next rehash */
+    size_t                  nr_entries;
+    size_t                  nr_items;
 };
 
 int hashmap_init(struct hashmap *hm, size_t nr_buckets);
 void *hashmap_find(struct hashmap *hm, unsigned int key);
 void hashmap_delete(struct hashmap *hm, unsigned int key);
 int hashmap_insert(struct hashmap *hm, unsigned int key, void *value);
+void *hashmap_find_str(struct hashmap *hm, const char *key);
+void hashmap_delete_str(struct hashmap *hm, const char *key);
+int hashmap_insert_str(struct hashmap *hm, const char *key, void *value);
 void hashmap_done(struct hashmap *hm);
 void hashmap_for_each(struct hashmap *hm, void (*cb)(void *value, void *data), void *data);
 
+/*
+ * XXH64: a fast 64-bit hash for cache keys and the like, where nobody is
+ * trying to make collisions: use SHA-1 for anything that's checked against
+ * data from the outside. Incremental, like SHA1Update(), or in one go.
+ */
+struct hash64 {
+    uint64_t        v[4];
+    uint64_t        seed;
+    uint64_t        total;
+    unsigned char   buf[32];
+    unsigned int    nr_buf;
+};
+
+void hash64_init(struct hash64 *h, uint64_t seed);
+void hash64_update(struct hash64 *h, const void *data, size_t len);
+uint64_t hash64_final(struct hash64 *h);
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
 struct bitmap {
     unsigned long   *mask;
     size_t          size;
@@ -204,6 +260,13 @@ void bitmap_set(struct bitmap *b, unsigned int bit);
 bool bitmap_is_set(struct bitmap *b, unsigned int bit);
 bool bitmap_includes(struct bitmap *b, struct bitmap *subset);
 
+struct sort_item {
+    uint64_t    key;
+    void        *data;
+};
+
+struct sort_item *radix_sort(struct sort_item *items, struct sort_item *tmp, size_t nr);
+
 void *memdup(const void *x, size_t size);
 
 static inline int clamp(int x, int floor, int ceil)
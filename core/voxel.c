@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jobs.h"
+#include "logger.h"
+#include "voxel.h"
+
+int voxel_mask_init(struct voxel_mask *vm, struct xyzarray *xyz, bool inv)
+{
+    int x, y, z;
+    uint64_t *row;
+    int *cell;
+
+    memcpy(vm->dim, xyz->dim, sizeof(vm->dim));
+    vm->row_words = (vm->dim[0] + 63) / 64;
+    vm->bits = calloc((size_t)vm->dim[1] * vm->dim[2] * vm->row_words ? : 1, sizeof(*vm->bits));
+    if (!vm->bits)
+        return -ENOMEM;
+
+    /* same order as xyzarray, a row at a time */
+    for (z = 0, cell = xyz->arr; z < vm->dim[2]; z++)
+        for (y = 0; y < vm->dim[1]; y++) {
+            row = vm->bits + ((size_t)z * vm->dim[1] + y) * vm->row_words;
+            for (x = 0; x < vm->dim[0]; x++, cell++)
+                if (!*cell == inv)
+                    row[x / 64] |= 1ull << (x % 64);
+        }
+
+    return 0;
+}
+
+void voxel_mask_done(struct voxel_mask *vm)
+{
+    free(vm->bits);
+    vm->bits = NULL;
+}
+
+/*
+ * One slice of faces: @dv rows of @du bits (along the quad's w), each row
+ * @words long
+ */
+struct voxel_plane {
+    unsigned int    du, dv, words;
+    uint64_t        *rows;
+};
+
+static inline uint64_t *plane_row(struct voxel_plane *p, unsigned int v)
+{
+    return p->rows + (size_t)v * p->words;
+}
+
+static inline bool plane_get(struct voxel_plane *p, unsigned int u, unsigned int v)
+{
+    return !!(plane_row(p, v)[u / 64] & (1ull << (u % 64)));
+}
+
+/* mask of bits [@from, @from + @nr) within word @w of a row */
+static inline uint64_t range_word(unsigned int w, unsigned int from, unsigned int nr)
+{
+    unsigned int lo = max(from, w * 64), hi = min(from + nr, w * 64 + 64);
+    uint64_t m;
+
+    if (lo >= hi)
+        return 0;
+
+    m = hi - lo == 64 ? ~0ull : ((1ull << (hi - lo)) - 1);
+    return m << (lo % 64);
+}
+
+static bool plane_range_set(struct voxel_plane *p, unsigned int v, unsigned int u, unsigned int nr)
+{
+    uint64_t *row = plane_row(p, v), m;
+    unsigned int w;
+
+    for (w = u / 64; w <= (u + nr - 1) / 64; w++) {
+        m = range_word(w, u, nr);
+        if ((row[w] & m) != m)
+            return false;
+    }
+
+    return true;
+}
+
+static void plane_range_clear(struct voxel_plane *p, unsigned int v, unsigned int u, unsigned int nr)
+{
+    uint64_t *row = plane_row(p, v);
+    unsigned int w;
+
+    for (w = u / 64; w <= (u + nr - 1) / 64; w++)
+        row[w] &= ~range_word(w, u, nr);
+}
+
+struct voxel_chunk {
+    darray(struct voxel_quad, quads);
+    int     ret;
+};
+
+struct voxel_meshing {
+    struct voxel_mask   *vm;
+    struct voxel_chunk  *chunks;
+};
+
+/* merge the faces in @p into quads, eating them up as it goes */
+static int voxel_plane_quads(struct voxel_plane *p, struct voxel_chunk *chunk, int axis, bool positive,
+                             int d, int u0, int v0)
+{
+    int ua = (axis + 1) % 3, va = (axis + 2) % 3;
+    unsigned int u, v, w, h, r, word;
+    struct voxel_quad *q;
+    uint64_t *row;
+
+    for (v = 0; v < p->dv; v++) {
+        row = plane_row(p, v);
+        for (word = 0; word < p->words; word++)
+            while (row[word]) {
+                u = word * 64 + __builtin_ctzll(row[word]);
+
+                for (w = 1; u + w < p->du && plane_get(p, u + w, v); w++)
+                    ;
+                for (h = 1; v + h < p->dv && plane_range_set(p, v + h, u, w); h++)
+                    ;
+                for (r = v; r < v + h; r++)
+                    plane_range_clear(p, r, u, w);
+
+                q = darray_add(&chunk->quads.da);
+                if (!q)
+                    return -ENOMEM;
+
+                q->pos[axis]  = d;
+                q->pos[ua]    = u0 + u;
+                q->pos[va]    = v0 + v;
+                q->w          = w;
+                q->h          = h;
+                q->axis       = axis;
+                q->positive   = positive;
+            }
+    }
+
+    return 0;
+}
+
+static void voxel_chunk_job(unsigned int idx, void *data)
+{
+    struct voxel_meshing *vmg = data;
+    struct voxel_chunk *chunk = &vmg->chunks[idx];
+    struct voxel_mask *vm = vmg->vm;
+    int lo[3] = { 0, 0, idx * VOXEL_CHUNK };
+    int hi[3] = { vm->dim[0], vm->dim[1], min((idx + 1) * VOXEL_CHUNK, (unsigned int)vm->dim[2]) };
+    struct voxel_plane p;
+    unsigned int u, v, words, max_words = 0;
+    int axis, ua, va, dir, d, c[3], n;
+    uint64_t *row, *next;
+
+    for (axis = 0; axis < 3; axis++) {
+        ua = (axis + 1) % 3;
+        words = (hi[ua] - lo[ua] + 63) / 64;
+        max_words = max(max_words, words * (hi[(axis + 2) % 3] - lo[(axis + 2) % 3]));
+    }
+
+    p.rows = calloc(max_words ? : 1, sizeof(*p.rows));
+    if (!p.rows) {
+        chunk->ret = -ENOMEM;
+        return;
+    }
+
+    for (axis = 0; axis < 3; axis++) {
+        ua = (axis + 1) % 3;
+        va = (axis + 2) % 3;
+        p.du = hi[ua] - lo[ua];
+        p.dv = hi[va] - lo[va];
+        p.words = (p.du + 63) / 64;
+
+        for (dir = 0; dir < 2; dir++)
+            for (d = lo[axis]; d < hi[axis]; d++) {
+                n = dir ? d + 1 : d - 1;
+                memset(p.rows, 0, (size_t)p.words * p.dv * sizeof(*p.rows));
+
+                if (axis == 2) {
+                    /* x rows line up with the mask's, a word at a time */
+                    for (v = 0; v < p.dv; v++) {
+                        row = vm->bits + ((size_t)d * vm->dim[1] + v) * vm->row_words;
+                        next = n >= 0 && n < vm->dim[2] ?
+                            vm->bits + ((size_t)n * vm->dim[1] + v) * vm->row_words : NULL;
+                        for (u = 0; u < p.words; u++)
+                            plane_row(&p, v)[u] = row[u] & ~(next ? next[u] : 0);
+                    }
+                } else {
+                    for (v = 0; v < p.dv; v++)
+                        for (u = 0; u < p.du; u++) {
+                            c[axis] = d;
+                            c[ua] = lo[ua] + u;
+                            c[va] = lo[va] + v;
+                            if (!voxel_mask_get(vm, c[0], c[1], c[2]))
+                                continue;
+
+                            c[axis] = n;
+                            if (!voxel_mask_get(vm, c[0], c[1], c[2]))
+                                plane_row(&p, v)[u / 64] |= 1ull << (u % 64);
+                        }
+                }
+
+                chunk->ret = voxel_plane_quads(&p, chunk, axis, dir, d, lo[ua], lo[va]);
+                if (chunk->ret)
+                    goto out;
+            }
+    }
+
+out:
+    free(p.rows);
+}
+
+ssize_t voxel_quads(struct voxel_mask *vm, struct voxel_quad **quads)
+{
+    unsigned int i, nr_chunks = (vm->dim[2] + VOXEL_CHUNK - 1) / VOXEL_CHUNK;
+    struct voxel_meshing vmg = { .vm = vm };
+    ssize_t nr = 0, ret = 0;
+
+    *quads = NULL;
+    if (vm->dim[0] <= 0 || vm->dim[1] <= 0 || vm->dim[2] <= 0)
+        return 0;
+
+    vmg.chunks = calloc(nr_chunks, sizeof(*vmg.chunks));
+    if (!vmg.chunks)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_chunks; i++)
+        darray_init(&vmg.chunks[i].quads);
+
+    jobs_parallel_for(nr_chunks, voxel_chunk_job, &vmg);
+
+    for (i = 0; i < nr_chunks; i++) {
+        if (vmg.chunks[i].ret)
+            ret = vmg.chunks[i].ret;
+        nr += vmg.chunks[i].quads.da.nr_el;
+    }
+
+    if (!ret && nr) {
+        *quads = malloc(nr * sizeof(**quads));
+        if (!*quads)
+            ret = -ENOMEM;
+    }
+
+    for (i = 0, nr = 0; i < nr_chunks; i++) {
+        if (!ret && vmg.chunks[i].quads.da.nr_el) {
+            memcpy(*quads + nr, vmg.chunks[i].quads.x,
+                   vmg.chunks[i].quads.da.nr_el * sizeof(**quads));
+            nr += vmg.chunks[i].quads.da.nr_el;
+        }
+        darray_clearout(&vmg.chunks[i].quads.da);
+    }
+    free(vmg.chunks);
+
+    return ret ? ret : nr;
+}
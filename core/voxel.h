@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_VOXEL_H__
+#define __CLAP_VOXEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ca3d.h"
+#include "util.h"
+
+/*
+ * Voxel meshing for xyzarray volumes: the occupancy goes into a mask of a
+ * bit per cell, rows along x packed into 64 bit words; a cell's face is
+ * there when its neighbor along the face's normal is empty (or outside of
+ * the volume), and the faces on the same slice that look the same way are
+ * merged greedily into quads. The volume is cut into VOXEL_CHUNK slabs
+ * along z that are meshed in parallel, so quads don't cross slabs.
+ * mesh_new_voxels() turns the quads into geometry.
+ */
+#define VOXEL_CHUNK 16
+
+struct voxel_mask {
+    ivec3           dim;
+    unsigned int    row_words;
+    uint64_t        *bits;
+};
+
+/* @inv: the empty cells are the solid ones */
+int voxel_mask_init(struct voxel_mask *vm, struct xyzarray *xyz, bool inv);
+void voxel_mask_done(struct voxel_mask *vm);
+
+static inline bool voxel_mask_get(struct voxel_mask *vm, int x, int y, int z)
+{
+    uint64_t *row;
+
+    if (x < 0 || y < 0 || z < 0 || x >= vm->dim[0] || y >= vm->dim[1] || z >= vm->dim[2])
+        return false;
+
+    row = vm->bits + ((size_t)z * vm->dim[1] + y) * vm->row_words;
+    return !!(row[x / 64] & (1ull << (x % 64)));
+}
+
+/*
+ * In cells: the face is on the @axis side of the cell at @pos, facing
+ * +@axis if @positive; it spans @w cells along the next axis after @axis
+ * and @h along the one after that (x -> y -> z -> x)
+ */
+struct voxel_quad {
+    int             pos[3];
+    unsigned short  w, h;
+    unsigned char   axis;
+    bool            positive;
+};
+
+/* the number of quads in @quads or -errno; free() them */
+ssize_t voxel_quads(struct voxel_mask *vm, struct voxel_quad **quads);
+
+#endif /* __CLAP_VOXEL_H__ */
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xform.h"
+#include "util.h"
+
+struct xform_store xforms = { .free = -1 };
+
+static int xform_store_grow(void)
+{
+    struct xform_chunk **chunks, *chunk;
+
+    chunks = realloc(xforms.chunks, (xforms.nr_chunks + 1) * sizeof(*chunks));
+    if (!chunks)
+        return -ENOMEM;
+    xforms.chunks = chunks;
+
+    chunk = malloc(sizeof(*chunk));
+    if (!chunk)
+        return -ENOMEM;
+
+    xforms.chunks[xforms.nr_chunks++] = chunk;
+
+    return 0;
+}
+
+int xform_alloc(void)
+{
+    struct xform_chunk *chunk;
+    int handle, slot;
+
+    if (xforms.free >= 0) {
+        handle = xforms.free;
+        xforms.free = xform_chunk(handle)->next_free[XFORM_SLOT(handle)];
+    } else {
+        if (xforms.nr_handles == xforms.nr_chunks * XFORM_CHUNK && xform_store_grow())
+            return -ENOMEM;
+        handle = xforms.nr_handles++;
+    }
+
+    chunk = xform_chunk(handle);
+    slot = XFORM_SLOT(handle);
+    memset(chunk->pos[slot], 0, sizeof(chunk->pos[slot]));
+    memset(chunk->rot[slot], 0, sizeof(chunk->rot[slot]));
+    chunk->scale[slot] = 0;
+    memset(chunk->aabb[slot], 0, sizeof(chunk->aabb[slot]));
+    mx_set_identity(&chunk->mx[slot]);
+    chunk->next_free[slot] = -1;
+
+    return handle;
+}
+
+void xform_free(int handle)
+{
+    if (handle < 0 || handle >= xforms.nr_handles)
+        return;
+
+    xform_chunk(handle)->next_free[XFORM_SLOT(handle)] = xforms.free;
+    xforms.free = handle;
+}
+
+void xform_store_done(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < xforms.nr_chunks; i++)
+        free(xforms.chunks[i]);
+    free(xforms.chunks);
+
+    xforms.chunks = NULL;
+    xforms.nr_chunks = xforms.nr_handles = 0;
+    xforms.free = -1;
+}
+
+bool xform_commit(int handle, const float pos[3], const float rot[3], float scale)
+{
+    struct xform_chunk *chunk = xform_chunk(handle);
+    int slot = XFORM_SLOT(handle);
+
+    if (chunk->pos[slot][0] == pos[0] && chunk->pos[slot][1] == pos[1] &&
+        chunk->pos[slot][2] == pos[2] && chunk->rot[slot][0] == rot[0] &&
+        chunk->rot[slot][1] == rot[1] && chunk->rot[slot][2] == rot[2] &&
+        chunk->scale[slot] == scale)
+        return false;
+
+    memcpy(chunk->pos[slot], pos, sizeof(chunk->pos[slot]));
+    memcpy(chunk->rot[slot], rot, sizeof(chunk->rot[slot]));
+    chunk->scale[slot] = scale;
+
+    return true;
+}
+
+void xform_rebuild(int handle)
+{
+    struct xform_chunk *chunk = xform_chunk(handle);
+    int slot = XFORM_SLOT(handle);
+    float *pos = chunk->pos[slot], *rot = chunk->rot[slot], scale = chunk->scale[slot];
+    mat4x4 *m = &chunk->mx[slot].m;
+
+    mat4x4_identity(*m);
+    mat4x4_translate_in_place(*m, pos[0], pos[1], pos[2]);
+    mat4x4_rotate_X(*m, *m, rot[0]);
+    mat4x4_rotate_Y(*m, *m, rot[1]);
+    mat4x4_rotate_Z(*m, *m, rot[2]);
+    mat4x4_scale_aniso(*m, *m, scale, scale, scale);
+}
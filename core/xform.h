@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_XFORM_H__
+#define __CLAP_XFORM_H__
+
+#include <stdbool.h>
+#include "matrix.h"
+
+/*
+ * Transform store: entities' transforms, world matrices and world AABBs,
+ * packed by field instead of by entity, so that passes that go over all
+ * of them (matrix rebuilds, culling, uploads) stream through memory
+ * instead of hopping between entity3d allocations, which are mostly cold.
+ *
+ * The storage is in chunks that don't move once allocated, so pointers
+ * into it (entity3d::mx, entity3d::aabb) stay valid for as long as the
+ * handle is allocated. Handles freed get reused, most recent first.
+ *
+ * @pos, @rot and @scale are what @mx was last built from (see
+ * xform_commit()); @aabb is laid out like bvh_node::aabb.
+ */
+#define XFORM_CHUNK_SHIFT   8
+#define XFORM_CHUNK         (1u << XFORM_CHUNK_SHIFT)
+
+struct xform_chunk {
+    float           pos[XFORM_CHUNK][3];
+    float           rot[XFORM_CHUNK][3];
+    float           scale[XFORM_CHUNK];
+    float           aabb[XFORM_CHUNK][6];
+    struct matrix4f mx[XFORM_CHUNK];
+    /* free handles are chained through here */
+    int             next_free[XFORM_CHUNK];
+};
+
+struct xform_store {
+    struct xform_chunk  **chunks;
+    unsigned int        nr_chunks;
+    unsigned int        nr_handles;
+    int                 free;
+};
+
+/* main thread only; the updates may run in parallel on different handles */
+extern struct xform_store xforms;
+
+int xform_alloc(void);
+void xform_free(int handle);
+void xform_store_done(void);
+
+static inline struct xform_chunk *xform_chunk(int handle)
+{
+    return xforms.chunks[handle >> XFORM_CHUNK_SHIFT];
+}
+
+#define XFORM_SLOT(_h) ((_h) & (XFORM_CHUNK - 1))
+
+static inline struct matrix4f *xform_mx(int handle)
+{
+    return &xform_chunk(handle)->mx[XFORM_SLOT(handle)];
+}
+
+static inline float *xform_aabb(int handle)
+{
+    return xform_chunk(handle)->aabb[XFORM_SLOT(handle)];
+}
+
+/*
+ * If @pos, @rot or @scale differ from what's stored, store them and
+ * return true: the matrix needs rebuilding (xform_rebuild())
+ */
+bool xform_commit(int handle, const float pos[3], const float rot[3], float scale);
+/* translate, rotate around X, Y, Z (radians), scale */
+void xform_rebuild(int handle);
+
+#endif /* __CLAP_XFORM_H__ */
@@ -26,6 +26,7 @@
 #include "scene.h"
 #include "sound.h"
 #include "pipeline.h"
+#include "profiler.h"
 #include "physics.h"
 #include "primitives.h"
 #include "networking.h"
@@ -90,14 +91,17 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
     timespec_diff(&s->fps.ts_prev, &ts_start, &ts_delta);
 #ifndef CONFIG_BROWSER
-    if (ts_delta.tv_nsec < 1000000000 / gl_refresh_rate())
+    if (!bench_active() && ts_delta.tv_nsec < 1000000000 / gl_refresh_rate())
         return;
 #endif
     clap_fps_calc(&s->fps);
+    bench_frame_begin(&ts_start, &ts_delta);
+    prof_frame();
     frame_count = max((unsigned long)gl_refresh_rate() / s->fps.fps_fine, 1);
     PROF_FIRST(start);
 
     fuzzer_input_step();
+    messagebus_drain();
 
     game_update(&game_state, ts_start, ui.modal);
 
@@ -114,8 +118,7 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
      * Collisions, dynamics
      */
     y1 = s->control->entity->dy;
-    for (count = 0; count < frame_count; count++)
-        phys_step(1);
+    phys_advance(s->phys, ts_delta.tv_sec + ts_delta.tv_nsec / 1e9);
 
     PROF_STEP(phys, start);
 
@@ -170,9 +173,15 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
 
     s->frames_total += frame_count;
     ui.frames_total += frame_count;
+    bench_frame_end();
     gl_swap_buffers();
     PROF_STEP(end, ui);
 #ifndef CONFIG_FINAL
+    struct render_stats rst;
+    char rstr[256];
+
+    render_stats(&rst, true);
+    render_stats_print(rstr, sizeof(rstr), &rst);
     ui_debug_printf(
         "phys:    %" PRItvsec ".%09lu\n"
         "net:     %" PRItvsec ".%09lu\n"
@@ -180,17 +189,20 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
         "models:  %" PRItvsec ".%09lu\n"
         "ui:      %" PRItvsec ".%09lu\n"
         "end:     %" PRItvsec ".%09lu\n"
-        "ui_entities: %lu\n%s",
+        "ui_entities: %lu\n"
+        "phys pairs: %lu contacts: %lu\n"
+        "render: %s\n%s",
         prof_phys.diff.tv_sec, prof_phys.diff.tv_nsec,
         prof_net.diff.tv_sec, prof_net.diff.tv_nsec,
         prof_updates.diff.tv_sec, prof_updates.diff.tv_nsec,
         prof_models.diff.tv_sec, prof_models.diff.tv_nsec,
         prof_ui.diff.tv_sec, prof_ui.diff.tv_nsec,
         prof_end.diff.tv_sec, prof_end.diff.tv_nsec,
-        count, ref_classes_get_string()
+        count, s->phys->stats.pairs, s->phys->stats.contacts, rstr, ref_classes_get_string()
     );
 #endif
     debug_draw_clearout(s);
+    ref_frame_end();
 }
 
 #define FOV to_radians(70.0)
@@ -355,15 +367,14 @@ static struct entity3d *cd_add_item(struct cube_data *cd, struct model3dtx *txm,
 #define CUBE_SIDE 16
 static void cube_geom(struct scene *s, struct cube_data *cd, float x, float y, float z, float side)
 {
-    struct mesh **mesh;
+    struct mesh *mesh;
     struct model3d *model;
-    struct model3dtx **txm, *objtxm, *ramptxm, *tentacletxm;
-    struct entity3d **entity, *e, *iter;
+    struct model3dtx *txm, *objtxm, *ramptxm, *tentacletxm;
+    struct entity3d *entity, *e, *iter;
     struct shader_prog *prog = shader_prog_find(s->prog, "model"); /* XXX */
-    float *vx, *norm, *tx;
-    unsigned short *idx;
-    int nr_cubes, nr_vx, nr_meshes, cubes_per_mesh;
-    int cx, cy, cz, cc, cm;
+    vec3 origin = { x, y, z };
+    int nr_cubes;
+    int cx, cy, cz;
     int entities = 0;
     DECLARE_LIST(list);
 
@@ -408,42 +419,17 @@ static void cube_geom(struct scene *s, struct cube_data *cd, float x, float y, f
     if (!nr_cubes)
         return;
 
-    if (cd->inv)
-        nr_cubes = cd->xyz->dim[0] * cd->xyz->dim[1] * cd->xyz->dim[2] - nr_cubes;
-    nr_vx = nr_cubes * mesh_nr_vx(&cube_mesh);
-    // ui_debug_printf("ca: %d steps: %d inv: %d prune: %d nr_cubes: %d nr_vx: %d",
-    //                 cd->ca, cd->steps, cd->inv, cd->prune, nr_cubes, nr_vx);
-    /* we're limited by unsigned short for index elements */
-    nr_meshes = nr_vx / 65536;
-    nr_meshes += !!(nr_vx % 65536);
-    cubes_per_mesh = nr_cubes / nr_meshes;
-    nr_meshes += !!(nr_cubes % cubes_per_mesh);
-    dbg("nr_meshes: %d\n", nr_meshes);
-
-    CHECK(mesh = calloc(nr_meshes, sizeof(*mesh)));
-    CHECK(txm = calloc(nr_meshes, sizeof(*txm)));
-    CHECK(entity = calloc(nr_meshes, sizeof(*entity)));
-    for (cm = 0; cm < nr_meshes; cm++) {
-        mesh[cm] = mesh_new("cubity");
-
-        mesh_attr_alloc(mesh[cm], MESH_VX, cube_mesh.attr[MESH_VX].stride, cubes_per_mesh * mesh_nr_vx(&cube_mesh));
-        mesh_attr_alloc(mesh[cm], MESH_NORM, cube_mesh.attr[MESH_NORM].stride, cubes_per_mesh * mesh_nr_norm(&cube_mesh));
-        mesh_attr_alloc(mesh[cm], MESH_TX, cube_mesh.attr[MESH_TX].stride, cubes_per_mesh * mesh_nr_tx(&cube_mesh));
-        mesh_attr_alloc(mesh[cm], MESH_IDX, cube_mesh.attr[MESH_IDX].stride, cubes_per_mesh * mesh_nr_idx(&cube_mesh));
+    /* faces between solid cubes are culled and the rest merged, see voxel.h */
+    mesh = mesh_new_voxels("cubity", cd->xyz, cd->inv, side, origin);
+    if (!mesh) {
+        ref_put(prog);
+        return;
     }
 
-    for (cc = 0, cm = 0, cz = 0; cz < cd->xyz->dim[2]; cz++)
+    for (cz = 0; cz < cd->xyz->dim[2]; cz++)
         for (cy = 0; cy < cd->xyz->dim[1]; cy++)
             for (cx = 0; cx < cd->xyz->dim[0]; cx++)
-                if (!!xyzarray_getat(cd->xyz, cx, cy, cz) == !cd->inv) {
-                    mesh_push_mesh(mesh[cm], &cube_mesh,
-                                   side * cx + x, side * cz + y, side * cy + z, side);
-                    cc++;
-                    if (cc == cubes_per_mesh) {
-                        cm++;
-                        cc = 0;
-                    }
-                } else {
+                if (!!xyzarray_getat(cd->xyz, cx, cy, cz) != !cd->inv) {
                     struct entity3d *e;
                     bool skip = false;
 
@@ -463,7 +449,7 @@ static void cube_geom(struct scene *s, struct cube_data *cd, float x, float y, f
                                               side * cx + x + side / 2,
                                               side * cz + y,
                                               side * cy + z + side / 2, to_radians(-90));
-                            entity3d_add_physics(e, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
+                            entity3d_add_physics(e, s->phys, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
                             entities++;
                         } else if (!!xyzarray_getat(cd->xyz, cx - 1, cy, cz + 1) != !cd->inv &&
                             !!xyzarray_getat(cd->xyz, cx - 1, cy, cz) == !cd->inv) {
@@ -471,21 +457,21 @@ static void cube_geom(struct scene *s, struct cube_data *cd, float x, float y, f
                                               side * cx + x + side / 2,
                                               side * cz + y,
                                               side * cy + z + side / 2, to_radians(90));
-                            entity3d_add_physics(e, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
+                            entity3d_add_physics(e, s->phys, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
                         } else if (!!xyzarray_getat(cd->xyz, cx, cy - 1, cz + 1) != !cd->inv &&
                             !!xyzarray_getat(cd->xyz, cx, cy - 1, cz) == !cd->inv) {
                             e = cd_add_entity(cd, ramptxm,
                                               side * cx + x + side / 2,
                                               side * cz + y,
                                               side * cy + z + side / 2, 0);
-                            entity3d_add_physics(e, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
+                            entity3d_add_physics(e, s->phys, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
                         } else if (!!xyzarray_getat(cd->xyz, cx, cy + 1, cz + 1) != !cd->inv &&
                             !!xyzarray_getat(cd->xyz, cx, cy + 1, cz) == !cd->inv) {
                             e = cd_add_entity(cd, ramptxm,
                                               side * cx + x + side / 2,
                                               side * cz + y,
                                               side * cy + z + side / 2, to_radians(180));
-                            entity3d_add_physics(e, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
+                            entity3d_add_physics(e, s->phys, dInfinity, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
                         } else if (!skip && drand48() > 0.9) {
                             e = cd_add_entity(cd, tentacletxm,
                                               side * cx + x + side / 2,
@@ -494,29 +480,23 @@ static void cube_geom(struct scene *s, struct cube_data *cd, float x, float y, f
                         }
                     }
                 }
-    for (cm = 0; cm < nr_meshes; cm++) {
-        // mesh_optimize(mesh[cm]);
-        model = model3d_new_from_mesh("cubity", prog, mesh[cm]);
-        model3d_set_name(model, "cubity.%d", cm);
-        model->collision_vx = mesh_vx(mesh[cm]);
-        model->collision_vxsz = mesh_vx_sz(mesh[cm]);
-        model->collision_idx = mesh_idx(mesh[cm]);
-        model->collision_idxsz = mesh_idx_sz(mesh[cm]);
-
-        txm[cm] = model3dtx_new(ref_pass(model), "purple wall seamless.png");
-        scene_add_model(s, txm[cm]);
-        entity[cm] = entity3d_new(txm[cm]);
-        entity[cm]->visible = 1;
-        entity[cm]->update  = NULL;
-        entity[cm]->scale = 1;
-        entity[cm]->skip_culling = true;
-        entity3d_reset(entity[cm]);
-        model3dtx_add_entity(txm[cm], entity[cm]);
-        entity3d_add_physics(entity[cm], 0, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
-    }
-    free(mesh);
-    free(txm);
-    free(entity);
+    model = model3d_new_from_mesh("cubity", prog, mesh);
+    model->collision_vx = mesh_vx(mesh);
+    model->collision_vxsz = mesh_vx_sz(mesh);
+    model->collision_idx = mesh_idx(mesh);
+    model->collision_idxsz = mesh_idx_sz(mesh);
+    model->collision_idx_stride = mesh_idx_stride(mesh);
+
+    txm = model3dtx_new(ref_pass(model), "purple wall seamless.png");
+    scene_add_model(s, txm);
+    entity = entity3d_new(txm);
+    entity->visible = 1;
+    entity->update  = NULL;
+    entity->scale = 1;
+    entity->skip_culling = true;
+    entity3d_reset(entity);
+    model3dtx_add_entity(txm, entity);
+    entity3d_add_physics(entity, s->phys, 0, dTriMeshClass, PHYS_GEOM, 0, 0, 0);
     ref_put(prog); /* matches shader_prog_find() above */
     /* drop the character on top of the structure */
     entity3d_position(s->control->entity,
@@ -618,8 +598,12 @@ static void ohc_ground_contact(void *priv, float x, float y, float z)
 static void settings_onload(struct settings *rs, void *data)
 {
     float gain = settings_get_num(rs, "music_volume");
+    struct phys_config pc = {};
 
     sound_set_gain(intro_sound, gain);
+
+    phys_config_from_settings(&pc, rs);
+    phys_set_config(scene.phys, &pc);
 }
 
 static int handle_input(struct message *m, void *data)
@@ -663,10 +647,27 @@ static struct option long_options[] = {
     { "exitafter",  required_argument,  0, 'e' },
     { "aoe",        no_argument,        0, 'E' },
     { "server",     required_argument,  0, 'S'},
+    { "profile",    required_argument,  0, 'P'},
+    { "bench",      required_argument,  0, 'B'},
+    { "capture",    required_argument,  0, 'C'},
+    { "scene",      required_argument,  0, 'L'},
+    { "record",     required_argument,  0, 'R'},
+    { "replay",     required_argument,  0, 'r'},
     {}
 };
 
-static const char short_options[] = "Ae:EFS:";
+static const char short_options[] = "Ae:B:C:EFL:P:r:R:S:";
+
+#ifndef CONFIG_FINAL
+/* the server's view of the world: let it correct the controlled character */
+static void ohc_snapshot(const struct snapshot *snap, void *data)
+{
+    struct scene *s = data;
+
+    if (s->control && !scene_character_is_camera(s, s->control))
+        character_reconcile(s->control, snap);
+}
+#endif /* CONFIG_FINAL */
 
 int main(int argc, char **argv, char **envp)
 {
@@ -689,9 +690,11 @@ int main(int argc, char **argv, char **envp)
         .server_port   = 21044,
         .server_wsport = 21045,
         .logger        = 1,
+        .status        = 1,
     };
     int c, option_index;
     unsigned int fullscreen = 0;
+    const char *scene_file = "scene.json";
     struct render_pass *pass;
     //struct lib_handle *lh;
 
@@ -700,6 +703,8 @@ int main(int argc, char **argv, char **envp)
      * on projection matrix being allocated.
      */
     scene_init(&scene);
+    /* the terrain and the foliage are fill rate bound */
+    scene.mq.depth_prepass = true;
 
     for (;;) {
         c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -723,6 +728,26 @@ int main(int argc, char **argv, char **envp)
         case 'S':
             ncfg.server_ip = optarg;
             break;
+        case 'P':
+            cfg.profile = optarg;
+            break;
+        case 'B':
+            cfg.bench.frames = atoi(optarg);
+            cfg.bench.warmup = BENCH_RATE;
+            scene.autopilot  = 1;
+            break;
+        case 'C':
+            cfg.bench.capture = optarg;
+            break;
+        case 'L':
+            scene_file = optarg;
+            break;
+        case 'R':
+            cfg.record = optarg;
+            break;
+        case 'r':
+            cfg.replay = optarg;
+            break;
 #endif /* CONFIG_FINAL */
         default:
             fprintf(stderr, "invalid option %x\n", c);
@@ -734,18 +759,21 @@ int main(int argc, char **argv, char **envp)
 
 #ifndef CONFIG_FINAL
     ncfg.clap = clap;
+    ncfg.snapshot = ohc_snapshot;
+    ncfg.snapshot_data = &scene;
     networking_init(&ncfg, CLIENT);
 #endif
 
-    phys->ground_contact = ohc_ground_contact;
+    scene.phys = phys_new();
+    scene.phys->ground_contact = ohc_ground_contact;
 
     cube_data.s = &scene;
     cube_data.make = true;
     darray_init(&cube_data.entities);
-    subscribe(MT_INPUT, cube_input, &cube_data);
+    subscribe_mask(MT_INPUT, cube_input, &cube_data, MSG_INPUT(pad_lb));
 
-    subscribe(MT_INPUT, handle_input, NULL);
-    subscribe(MT_COMMAND, handle_command, &scene);
+    subscribe_mask(MT_INPUT, handle_input, NULL, MSG_INPUT(volume_up) | MSG_INPUT(volume_down));
+    subscribe_mask(MT_COMMAND, handle_command, &scene, MSG_COMMAND(status));
 
     /*
      * Need to write vorbis callbacks for this
@@ -765,6 +793,8 @@ int main(int argc, char **argv, char **envp)
     lib_request_shaders("terrain", &scene.prog);
     lib_request_shaders("model", &scene.prog);
     //lib_request_shaders("ui", &scene);
+    /* the maze walls and the trees hide most of the rest */
+    scene.mq.occlusion_prog = shader_prog_find(scene.prog, "debug");
 
     /*
      * XXX: needs to be in the scene code, but can't be called before
@@ -781,7 +811,9 @@ int main(int argc, char **argv, char **envp)
     scene.camera = &scene.cameras[0];
     // scene_camera_add(&scene);
 
-    scene_load(&scene, "scene.json");
+    scene_load(&scene, scene_file);
+    /* the trees, too */
+    scene_load_finish(&scene);
 
     game_init(&scene, &ui); // this must happen after scene_load, because we need the trees.
     spawn_mushrooms(&game_state);
@@ -799,6 +831,9 @@ int main(int argc, char **argv, char **envp)
     pass = pipeline_add_pass(main_pl, NULL, NULL, true);
     pass = pipeline_add_pass(main_pl, pass, "contrast", false);
     // pass = pipeline_add_pass(main_pl, pass, "contrast", false);
+    /* 60fps with some room to spare, at no less than half the resolution */
+    pipeline_set_gpu_target(main_pl, 14.0, 0.5);
+    pipeline_set_gpu_target(blur_pl, 14.0, 0.5);
 
     scene.lin_speed = 2.0;
     scene.ang_speed = 45.0;
@@ -24,6 +24,7 @@
 #include "scene.h"
 #include "sound.h"
 #include "pipeline.h"
+#include "profiler.h"
 #include "physics.h"
 #include "primitives.h"
 #include "networking.h"
@@ -87,14 +88,17 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
     timespec_diff(&s->fps.ts_prev, &ts_start, &ts_delta);
 #ifndef CONFIG_BROWSER
-    if (ts_delta.tv_nsec < 1000000000 / gl_refresh_rate())
+    if (!bench_active() && ts_delta.tv_nsec < 1000000000 / gl_refresh_rate())
         return;
 #endif
     clap_fps_calc(&s->fps);
+    bench_frame_begin(&ts_start, &ts_delta);
+    prof_frame();
     frame_count = max((unsigned long)gl_refresh_rate() / s->fps.fps_fine, 1);
     PROF_FIRST(start);
 
     fuzzer_input_step();
+    messagebus_drain();
 
     /* XXX: fix game_init() */
     // game_update(&game_state, ts_start, ui.modal);
@@ -112,8 +116,7 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
      * Collisions, dynamics
      */
     y1 = s->control->entity->dy;
-    for (count = 0; count < frame_count; count++)
-        phys_step(1);
+    phys_advance(s->phys, ts_delta.tv_sec + ts_delta.tv_nsec / 1e9);
 
     PROF_STEP(phys, start);
 
@@ -146,7 +149,7 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
     /* XXX: this actually goes to ->update() */
     scene_cameras_calc(s);
 
-    glEnable(GL_DEPTH_TEST);
+    render_depth_test(true);
 #ifndef CONFIG_GLES
     glEnable(GL_MULTISAMPLE);
 #endif
@@ -166,9 +169,17 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
 
     s->frames_total += frame_count;
     ui.frames_total += frame_count;
+    bench_frame_end();
     gl_swap_buffers();
     PROF_STEP(end, ui);
 #ifndef CONFIG_FINAL
+    struct render_state_stats rss;
+    struct render_stats rst;
+    char rstr[256];
+
+    render_state_stats(&rss, true);
+    render_stats(&rst, true);
+    render_stats_print(rstr, sizeof(rstr), &rst);
     ui_debug_printf(
         "phys:    %" PRItvsec ".%09lu\n"
         "net:     %" PRItvsec ".%09lu\n"
@@ -176,17 +187,22 @@ EMSCRIPTEN_KEEPALIVE void renderFrame(void *data)
         "models:  %" PRItvsec ".%09lu\n"
         "ui:      %" PRItvsec ".%09lu\n"
         "end:     %" PRItvsec ".%09lu\n"
-        "ui_entities: %lu\n%s",
+        "ui_entities: %lu\n"
+        "phys pairs: %lu contacts: %lu\n"
+        "gl state: %lu calls, %lu avoided\n"
+        "render: %s\n%s",
         prof_phys.diff.tv_sec, prof_phys.diff.tv_nsec,
         prof_net.diff.tv_sec, prof_net.diff.tv_nsec,
         prof_updates.diff.tv_sec, prof_updates.diff.tv_nsec,
         prof_models.diff.tv_sec, prof_models.diff.tv_nsec,
         prof_ui.diff.tv_sec, prof_ui.diff.tv_nsec,
         prof_end.diff.tv_sec, prof_end.diff.tv_nsec,
-        count, ref_classes_get_string()
+        count, s->phys->stats.pairs, s->phys->stats.contacts, rss.calls, rss.avoided, rstr,
+        ref_classes_get_string()
     );
 #endif
     debug_draw_clearout(s);
+    ref_frame_end();
 }
 
 #define FOV to_radians(70.0)
@@ -240,8 +256,12 @@ static void ohc_ground_contact(void *priv, float x, float y, float z)
 static void settings_onload(struct settings *rs, void *data)
 {
     float gain = settings_get_num(rs, "music_volume");
+    struct phys_config pc = {};
 
     sound_set_gain(intro_sound, gain);
+
+    phys_config_from_settings(&pc, rs);
+    phys_set_config(scene.phys, &pc);
 }
 
 static int handle_input(struct message *m, void *data)
@@ -285,10 +305,27 @@ static struct option long_options[] = {
     { "exitafter",  required_argument,  0, 'e' },
     { "aoe",        no_argument,        0, 'E' },
     { "server",     required_argument,  0, 'S'},
+    { "profile",    required_argument,  0, 'P'},
+    { "bench",      required_argument,  0, 'B'},
+    { "capture",    required_argument,  0, 'C'},
+    { "scene",      required_argument,  0, 'L'},
+    { "record",     required_argument,  0, 'R'},
+    { "replay",     required_argument,  0, 'r'},
     {}
 };
 
-static const char short_options[] = "Ae:EFS:";
+static const char short_options[] = "Ae:B:C:EFL:P:r:R:S:";
+
+#ifndef CONFIG_FINAL
+/* the server's view of the world: let it correct the controlled character */
+static void ohc_snapshot(const struct snapshot *snap, void *data)
+{
+    struct scene *s = data;
+
+    if (s->control && !scene_character_is_camera(s, s->control))
+        character_reconcile(s->control, snap);
+}
+#endif /* CONFIG_FINAL */
 
 int main(int argc, char **argv, char **envp)
 {
@@ -314,9 +351,11 @@ int main(int argc, char **argv, char **envp)
         .server_port   = 21044,
         .server_wsport = 21045,
         .logger        = 1,
+        .status        = 1,
     };
     int c, option_index, err;
     unsigned int fullscreen = 0;
+    const char *scene_file = "scene.json";
     struct render_pass *pass;
     //struct lib_handle *lh;
 
@@ -325,6 +364,8 @@ int main(int argc, char **argv, char **envp)
      * on projection matrix being allocated.
      */
     scene_init(&scene);
+    /* the terrain and the foliage are fill rate bound */
+    scene.mq.depth_prepass = true;
 
     for (;;) {
         c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -348,6 +389,26 @@ int main(int argc, char **argv, char **envp)
         case 'S':
             ncfg.server_ip = optarg;
             break;
+        case 'P':
+            cfg.profile = optarg;
+            break;
+        case 'B':
+            cfg.bench.frames = atoi(optarg);
+            cfg.bench.warmup = BENCH_RATE;
+            scene.autopilot  = 1;
+            break;
+        case 'C':
+            cfg.bench.capture = optarg;
+            break;
+        case 'L':
+            scene_file = optarg;
+            break;
+        case 'R':
+            cfg.record = optarg;
+            break;
+        case 'r':
+            cfg.replay = optarg;
+            break;
 #endif /* CONFIG_FINAL */
         default:
             fprintf(stderr, "invalid option %x\n", c);
@@ -359,13 +420,16 @@ int main(int argc, char **argv, char **envp)
 
 #ifndef CONFIG_FINAL
     ncfg.clap = clap;
+    ncfg.snapshot = ohc_snapshot;
+    ncfg.snapshot_data = &scene;
     networking_init(&ncfg, CLIENT);
 #endif
 
-    phys->ground_contact = ohc_ground_contact;
+    scene.phys = phys_new();
+    scene.phys->ground_contact = ohc_ground_contact;
 
-    subscribe(MT_INPUT, handle_input, NULL);
-    subscribe(MT_COMMAND, handle_command, &scene);
+    subscribe_mask(MT_INPUT, handle_input, NULL, MSG_INPUT(volume_up) | MSG_INPUT(volume_down));
+    subscribe_mask(MT_COMMAND, handle_command, &scene, MSG_COMMAND(status));
 
     /*
      * Need to write vorbis callbacks for this
@@ -383,8 +447,19 @@ int main(int argc, char **argv, char **envp)
     lib_request_shaders("vblur", &scene.prog);
     lib_request_shaders("debug", &scene.prog);
     lib_request_shaders("terrain", &scene.prog);
+    /* before "model", which the scene's defaults are */
+#ifndef CONFIG_GLES
+    /* GLSL ES 1.00 has no texture arrays for the texture variants */
+    lib_request_shader_variants("model", SHADER_SKINNING | SHADER_NORMALS | SHADER_LAYERS |
+                                SHADER_DEFAULT_FEATURES, &scene.prog);
+#else
+    lib_request_shader_variants("model", SHADER_SKINNING | SHADER_NORMALS | SHADER_DEFAULT_FEATURES,
+                                &scene.prog);
+#endif
     lib_request_shaders("model", &scene.prog);
     //lib_request_shaders("ui", &scene);
+    /* the maze walls and the trees hide most of the rest */
+    scene.mq.occlusion_prog = shader_prog_find(scene.prog, "debug");
 
     fuzzer_input_init();
 
@@ -395,7 +470,7 @@ int main(int argc, char **argv, char **envp)
     scene.camera = &scene.cameras[0];
     // scene_camera_add(&scene);
 
-    scene_load(&scene, "scene.json");
+    scene_load(&scene, scene_file);
 
     /* XXX: fix game_init() */
     //game_init(&scene, &ui); // this must happen after scene_load, because we need the trees.
@@ -416,6 +491,9 @@ int main(int argc, char **argv, char **envp)
     pass = pipeline_add_pass(main_pl, NULL, NULL, true);
     pass = pipeline_add_pass(main_pl, pass, "contrast", false);
     // pass = pipeline_add_pass(main_pl, pass, "contrast", false);
+    /* 60fps with some room to spare, at no less than half the resolution */
+    pipeline_set_gpu_target(main_pl, 14.0, 0.5);
+    pipeline_set_gpu_target(blur_pl, 14.0, 0.5);
 
     scene.lin_speed = 2.0;
     scene.ang_speed = 45.0;
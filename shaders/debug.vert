@@ -1,15 +1,15 @@
 #version 330
 
 in vec3 position;
-in vec2 tex;
+// world space lines, color is per vertex, see debug_draws_render()
+in vec4 batch_color;
 
-uniform mat4 proj;
-uniform mat4 view;
-// uniform mat4 inverse_view;
-uniform mat4 trans;
-out vec2 pass_tex;
+#include "frame.glsl"
+
+out vec4 pass_color;
 
 void main()
 {
-    gl_Position = proj * view * trans * vec4(position, 1.0);
+    gl_Position = proj * view * vec4(position, 1.0);
+    pass_color = batch_color;
 }
@@ -0,0 +1,27 @@
+// per-frame globals, written once per view, see struct render_frame
+#ifdef GL_ES
+// GLSL ES 1.00 has no uniform blocks, these are set one by one; the same
+// precision in both stages, or they don't link
+#ifdef GL_FRAGMENT_PRECISION_HIGH
+#define FRAME_PRECISION highp
+#else
+#define FRAME_PRECISION mediump
+#endif
+uniform FRAME_PRECISION mat4 proj;
+uniform FRAME_PRECISION mat4 view;
+uniform FRAME_PRECISION mat4 inverse_view;
+uniform FRAME_PRECISION vec3 light_pos;
+uniform FRAME_PRECISION vec3 light_color;
+uniform FRAME_PRECISION float width;
+uniform FRAME_PRECISION float height;
+#else
+layout (std140) uniform frame {
+    mat4 proj;
+    mat4 view;
+    mat4 inverse_view;
+    vec3 light_pos;
+    vec3 light_color;
+    float width;
+    float height;
+};
+#endif
@@ -4,7 +4,7 @@ in vec3 position;
 in vec2 tex;
 
 uniform mat4 trans;
-uniform mat4 proj;
+#include "frame.glsl"
 
 out vec2 pass_tex;
 
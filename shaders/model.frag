@@ -5,25 +5,57 @@ in vec3 surface_normal;
 in vec3 to_light_vector;
 in vec3 to_camera_vector;
 in float color_override;
-in float do_use_normals;
 in vec4 pass_tangent;
 
+// see model.vert
+#ifdef SPECIALIZED
+#ifdef NORMALS
+#define USE_NORMALS true
+#else
+#define USE_NORMALS false
+#endif
+#else
+in float do_use_normals;
+#define USE_NORMALS (do_use_normals > 0.5)
+#endif
+
+// see model.vert
+#ifdef LAYERS
+flat in float pass_layer;
+uniform sampler2DArray model_tex;
+uniform sampler2DArray normal_map;
+#define model_texture(sampler) texture(sampler, vec3(pass_tex, pass_layer))
+#else
 uniform sampler2D model_tex;
 uniform sampler2D normal_map;
-uniform vec3 light_color;
+#define model_texture(sampler) texture(sampler, pass_tex)
+#endif
+#include "frame.glsl"
 uniform float shine_damper;
 uniform float reflectivity;
+#if !defined(SPECIALIZED) || defined(HIGHLIGHT)
 uniform vec4 highlight_color;
+#define USE_HIGHLIGHT
+#endif
+
+// the depth pre-pass, see models_render()
+uniform float depth_only;
 
 layout (location=0) out vec4 FragColor;
 // out vec4 FragColor;
 
 void main()
 {
+    if (depth_only > 0.5) {
+        FragColor = vec4(0.0);
+        return;
+    }
+#ifdef USE_HIGHLIGHT
     if (highlight_color.w != 0.0) {
         FragColor = highlight_color;
         return;
     }
+#endif
     if (color_override == 1.0) {
         FragColor = vec4(0.5, 1.0, 1.0, 1.0);
         return;
@@ -31,8 +63,8 @@ void main()
 
     vec3 unit_normal;
 
-    if (do_use_normals > 0.5) {
-        vec4 normal_vec = texture(normal_map, pass_tex) * 2.0 - 1.0;
+    if (USE_NORMALS) {
+        vec4 normal_vec = model_texture(normal_map) * 2.0 - 1.0;
         unit_normal = normalize(normal_vec.xyz);
         // /*gl_*/FragColor = normal_vec * pass_tangent;
         // return;
@@ -51,8 +83,12 @@ void main()
     specular_factor = max(specular_factor, 0.2);
     float damped_factor = pow(specular_factor, shine_damper);
     vec3 final_specular = damped_factor * reflectivity * light_color;
-    vec4 texture_sample = texture(model_tex, pass_tex);
+    vec4 texture_sample = model_texture(model_tex);
     FragColor = vec4(diffuse, 1.0) * texture_sample + vec4(final_specular, 1.0);
+#ifdef ALPHA
+    // the specular term above leaves it at 1 or more
+    FragColor.a = texture_sample.a;
+#endif
     //gl_FragColor.rgb = pow(gl_FragColor.rgb, vec3(1.0/2.2));
     // gl_FragColor = vec4(pass_tangent.xyz, 1);
     // gl_FragColor = pass_tangent;
@@ -6,27 +6,72 @@ in vec3 normal;
 in vec4 tangent;
 in vec4 joints;
 in vec4 weights;
+in mat4 instance_trans;
+in float instance_joint_off;
 
 uniform vec3 ray;
-uniform vec3 light_pos;
-uniform mat4 proj;
-uniform mat4 view;
-uniform mat4 inverse_view;
+#include "frame.glsl"
 uniform mat4 trans;
+// quantized positions are within the AABB, see struct packed_vertex
+uniform vec3 pos_scale;
+uniform vec3 pos_offset;
+uniform float use_instancing;
+uniform sampler2D joint_tex;
+uniform float joint_off;
+uniform float joint_rows;
+
+// the variants have these compiled in or out, see preprocess_shaders -p
+#ifdef SPECIALIZED
+#ifdef SKINNING
+#define USE_SKINNING true
+#else
+#define USE_SKINNING false
+#endif
+#ifdef NORMALS
+#define USE_NORMALS true
+#else
+#define USE_NORMALS false
+#endif
+#else
 uniform float use_normals;
 uniform float use_skinning;
-uniform mat4 joint_transforms[100];
-
 out float do_use_normals;
+#define USE_SKINNING (use_skinning > 0.5)
+#define USE_NORMALS (use_normals > 0.5)
+#endif
+
 out vec2 pass_tex;
 out vec3 surface_normal;
 out vec3 to_light_vector;
 out vec3 to_camera_vector;
 out float color_override;
 
+// one texture array for the txmodels that only differ in the texture
+#ifdef LAYERS
+in float instance_layer;
+uniform float tex_layer;
+flat out float pass_layer;
+#endif
+
+// joint_tex: 256 matrices per row, a texel per column, see mq_joints_upload()
+mat4 joint_mx(float idx)
+{
+    float row = floor((idx + 0.5) / 256.0);
+    float u = ((idx - row * 256.0) * 4.0 + 0.5) / 1024.0;
+    float v = (row + 0.5) / joint_rows;
+
+    return mat4(texture(joint_tex, vec2(u, v)),
+                texture(joint_tex, vec2(u + 1.0 / 1024.0, v)),
+                texture(joint_tex, vec2(u + 2.0 / 1024.0, v)),
+                texture(joint_tex, vec2(u + 3.0 / 1024.0, v)));
+}
+
 void main()
 {
-    vec4 world_pos = trans * vec4(position, 1.0);
+    mat4 model_trans = use_instancing > 0.5 ? instance_trans : trans;
+    float joints_base = use_instancing > 0.5 ? instance_joint_off : joint_off;
+    vec3 pos = position * pos_scale + pos_offset;
+    vec4 world_pos = model_trans * vec4(pos, 1.0);
     color_override = 0.0;
     if (ray.z > 0.5) {
         if (pow(world_pos.x - ray.x, 2.0) + pow(world_pos.z - ray.y, 2.0) <= 64.0)
@@ -36,26 +81,31 @@ void main()
     vec4 our_normal = vec4(normal, 0);
     vec4 total_local_pos = vec4(0, 0, 0, 0);
     vec4 total_normal = vec4(0, 0, 0, 0);
-    if (use_skinning > 0.5) {
+    if (USE_SKINNING) {
         for (int i = 0; i < 4; i++) {
-            mat4 joint_transform = joint_transforms[int(joints[i])];
-            vec4 local_pos = joint_transform * vec4(position, 1.0);
+            mat4 joint_transform = joint_mx(joints_base + joints[i]);
+            vec4 local_pos = joint_transform * vec4(pos, 1.0);
             total_local_pos += local_pos * weights[i];
 
             vec4 world_normal = joint_transform * vec4(normal, 0.0);
             total_normal += world_normal * weights[i];
         }
 
-        gl_Position = proj * view * trans * total_local_pos;
-        our_normal = trans * total_normal;
+        gl_Position = proj * view * model_trans * total_local_pos;
+        our_normal = model_trans * total_normal;
     } else {
-        gl_Position = proj * view * trans * vec4(position, 1.0);
+        gl_Position = proj * view * model_trans * vec4(pos, 1.0);
     }
     pass_tex = tex;
+#ifdef LAYERS
+    pass_layer = use_instancing > 0.5 ? instance_layer : tex_layer;
+#endif
 
     // this is still needed in frag
-    if (use_normals > 0.5) {
+    if (USE_NORMALS) {
+#ifndef SPECIALIZED
         do_use_normals = use_normals;
+#endif
         surface_normal = (view * vec4(our_normal.xyz, 0.0)).xyz;
 
         vec3 N = normalize(surface_normal);
@@ -70,7 +120,7 @@ void main()
         to_light_vector = to_tangent_space * (light_pos - world_pos.xyz);
         to_camera_vector = to_tangent_space * (inverse_view * vec4(0.0, 0.0, 0.0, 1.0) - world_pos).xyz;
     } else {
-        surface_normal = (trans * vec4(our_normal.xyz, 0.0)).xyz;
+        surface_normal = (model_trans * vec4(our_normal.xyz, 0.0)).xyz;
 
         to_light_vector = light_pos - world_pos.xyz;
         to_camera_vector = (inverse_view * vec4(0.0, 0.0, 0.0, 1.0) - world_pos).xyz;
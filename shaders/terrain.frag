@@ -8,16 +8,23 @@ in float do_use_normals;
 in vec4 pass_tangent;
 
 uniform sampler2D model_tex;
-uniform vec3 light_color;
+#include "frame.glsl"
 uniform float shine_damper;
 uniform float reflectivity;
 
+// the depth pre-pass, see models_render()
+uniform float depth_only;
+
 layout (location=0) out vec4 FragColor;
 // out vec4 FragColor;
 #define PI 3.1415926538
 
 void main()
 {
+    if (depth_only > 0.5) {
+        FragColor = vec4(0.0);
+        return;
+    }
 
     vec3 unit_normal;
 
@@ -5,28 +5,62 @@ in vec2 tex;
 in vec3 normal;
 in vec4 tangent;
 
-uniform vec3 light_pos;
-uniform mat4 proj;
-uniform mat4 view;
-uniform mat4 inverse_view;
+#include "frame.glsl"
 uniform mat4 trans;
 
+// the chunks are a flat grid over the heights, see terrain_set_vtf()
+uniform float use_height_map;
+uniform sampler2D height_map;
+// x, z of the map's corner, its side and the points along it
+uniform vec4 height_map_rect;
+
 out vec2 pass_tex;
 out vec3 surface_normal;
 out vec3 to_light_vector;
 out vec3 to_camera_vector;
 out float color_override;
 
+float map_height(vec2 uv)
+{
+    return texture(height_map, uv).r;
+}
+
 void main()
 {
-    vec4 world_pos = trans * vec4(position, 1.0);
+    vec4 world_pos;
+    vec3 world_normal;
+
+    if (use_height_map > 0.5) {
+        float side = height_map_rect.z;
+        float nr = height_map_rect.w;
+        float texel = 1.0 / nr;
+
+        // .y is the skirt's drop; the last chunks hang over the edge, fold those back
+        world_pos = trans * vec4(position.x, 0.0, position.z, 1.0);
+        vec2 grid = clamp(world_pos.xz - height_map_rect.xy, 0.0, side) / side * (nr - 1.0);
+        world_pos.xz = height_map_rect.xy + grid / (nr - 1.0) * side;
+
+        // the map goes by X, then Z, so Z is along the texture's rows
+        vec2 uv = (grid.yx + 0.5) * texel;
+        world_pos.y += map_height(uv) + position.y;
+
+        // same as calc_normal()
+        float hl = map_height(uv - vec2(0.0, texel));
+        float hr = map_height(uv + vec2(0.0, texel));
+        float hd = map_height(uv - vec2(texel, 0.0));
+        float hu = map_height(uv + vec2(texel, 0.0));
+        world_normal = normalize(vec3(hl - hr, 2.0, hd - hu));
+        pass_tex = grid * 32.0 / (nr - 1.0);
+    } else {
+        world_pos = trans * vec4(position, 1.0);
+        world_normal = (trans * vec4(normal, 0.0)).xyz;
+        pass_tex = tex;
+    }
 
-    vec4 our_normal = vec4(normal, 0);
-    gl_Position = proj * view * trans * vec4(position, 1.0);
-    pass_tex = tex;
+    gl_Position = proj * view * world_pos;
 
     // this is still needed in frag
-    surface_normal = (trans * vec4(our_normal.xyz, 0.0)).xyz;
+    surface_normal = world_normal;
 
     to_light_vector = light_pos - world_pos.xyz;
     to_camera_vector = (inverse_view * vec4(0.0, 0.0, 0.0, 1.0) - world_pos).xyz;
@@ -2,12 +2,10 @@
 
 layout (location=0) out vec4 FragColor;
 in vec2 pass_tex;
-// varying vec4 color_override;
-// varying float color_pt;
+in vec4 pass_color;
+in float pass_color_pt;
 
 uniform sampler2D model_tex;
-uniform vec4 in_color;
-uniform float color_passthrough;
 
 /*void mux(out float o, in float x, in float y, in float a);
 void mux(out float o, in float x, in float y, in float a)
@@ -20,13 +18,12 @@ void main()
 {
     vec4 tex_color;
 
-    // color_passthrough = 2.;
-    if (color_passthrough >= 0.6) {
-    	tex_color = in_color;
+    if (pass_color_pt >= 0.6) {
+    	tex_color = pass_color;
     } else {
         tex_color = texture(model_tex, pass_tex);
-        if (color_passthrough >= 0.4)
-            tex_color.w = in_color.w;
+        if (pass_color_pt >= 0.4)
+            tex_color.w = pass_color.w;
     }
 
     // float vignette = pass_tex.x * pass_tex.y * (1.-pass_tex.x) * (1.-pass_tex.y);
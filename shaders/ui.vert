@@ -2,20 +2,30 @@
 
 in vec3 position;
 in vec2 tex;
+// batched draws: position is already transformed, color is per vertex
+in vec4 batch_color;
+in float batch_color_pt;
 
 uniform mat4 trans;
-uniform mat4 proj;
-// uniform vec4 color;
-// uniform float color_passthrough;
+#include "frame.glsl"
+uniform vec4 in_color;
+uniform float color_passthrough;
+uniform float use_batching;
 
 out vec2 pass_tex;
-// varying vec4 color_override;
-// varying float color_pt;
+out vec4 pass_color;
+out float pass_color_pt;
 
 void main()
 {
-    gl_Position = /*proj * */trans * vec4(position, 1.0);
+    if (use_batching > 0.5) {
+        gl_Position = vec4(position, 1.0);
+        pass_color = batch_color;
+        pass_color_pt = batch_color_pt;
+    } else {
+        gl_Position = /*proj * */trans * vec4(position, 1.0);
+        pass_color = in_color;
+        pass_color_pt = color_passthrough;
+    }
     pass_tex = tex;
-    // color_override = color;
-    // color_pt = color_passthrough;
 }
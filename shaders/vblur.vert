@@ -4,7 +4,7 @@ in vec3 position;
 in vec2 tex;
 
 uniform mat4 trans;
-uniform float height;
+#include "frame.glsl"
 
 out vec2 pass_tex;
 out vec2 blur_coords[11];
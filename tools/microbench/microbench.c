@@ -0,0 +1,846 @@
+// SPDX-License-Identifier: Apache-2.0
+#define _GNU_SOURCE
+#include <ftw.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "base64.h"
+#include "ca2d.h"
+#include "ca3d.h"
+#include "json.h"
+#include "librarian.h"
+#include "linmath.h"
+#include "mesh.h"
+#include "object.h"
+#include "objfile.h"
+#include "sha1.h"
+#include "terrain.h"
+#include "util.h"
+
+/*
+ * Microbenchmarks: each one does a fixed number of operations, so the
+ * numbers are comparable between builds, MB_RUNS times; the best and the
+ * median run are reported in ns per operation, along with the bytes that
+ * got allocated per operation and, where it makes sense, the throughput.
+ *
+ *   microbench [substring of the names to run]
+ */
+#define MB_RUNS 5
+
+/*
+ * Count what gets allocated: glibc lets us replace malloc(), and calls
+ * from within libc (strdup(), asprintf()) come here too. Not with ASAN,
+ * which has its own.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(HAVE_ASAN)
+#define MB_ALLOC_STATS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_size_t mb_alloc_bytes;
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&mb_alloc_bytes, size, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&mb_alloc_bytes, nmemb * size, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&mb_alloc_bytes, size, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#endif /* glibc && !ASAN */
+
+static inline size_t mb_allocated(void)
+{
+#ifdef MB_ALLOC_STATS
+    return atomic_load_explicit(&mb_alloc_bytes, memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+struct mb {
+    unsigned long   iters;
+    /* processed per operation, for the throughput; 0 if that's meaningless */
+    size_t          bytes;
+    void            *priv;
+};
+
+/* results go here, so that the compiler can't throw the work away */
+static volatile unsigned long mb_sink;
+
+/* xorshift: deterministic and cheap enough to not show up */
+static inline uint32_t mb_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+static void mb_fill(void *buf, size_t size, uint32_t seed)
+{
+    unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        p[i] = mb_rand(&seed);
+}
+
+/* darray */
+static void darray_add_bench(struct mb *mb)
+{
+    darray(int, da);
+    unsigned long i;
+
+    darray_init(&da);
+    for (i = 0; i < mb->iters; i++)
+        *(int *)darray_add(&da.da) = i;
+
+    mb_sink += da.x[da.da.nr_el / 2];
+    darray_clearout(&da.da);
+}
+
+static void darray_insert_bench(struct mb *mb)
+{
+    darray(int, da);
+    unsigned long i;
+
+    darray_init(&da);
+    /* in the middle: half the array moves every time */
+    for (i = 0; i < mb->iters; i++)
+        *(int *)darray_insert(&da.da, da.da.nr_el / 2) = i;
+
+    mb_sink += da.x[0];
+    darray_clearout(&da.da);
+}
+
+/* hashmap */
+#define MB_HASH_BUCKETS 1024
+#define MB_HASH_KEYS    (1 << 16)
+
+static inline unsigned int mb_key(unsigned long i)
+{
+    return (i * 2654435761u) ^ 0x5bd1e995;
+}
+
+static void hashmap_insert_bench(struct mb *mb)
+{
+    struct hashmap hm;
+    unsigned long i;
+
+    hashmap_init(&hm, MB_HASH_BUCKETS);
+    for (i = 0; i < mb->iters; i++)
+        hashmap_insert(&hm, mb_key(i), (void *)i);
+
+    mb_sink += (unsigned long)hashmap_find(&hm, mb_key(mb->iters / 2));
+    hashmap_done(&hm);
+}
+
+static int hashmap_find_setup(struct mb *mb)
+{
+    struct hashmap *hm;
+    unsigned long i;
+
+    hm = calloc(1, sizeof(*hm));
+    if (!hm || hashmap_init(hm, MB_HASH_BUCKETS))
+        return -1;
+
+    for (i = 0; i < MB_HASH_KEYS; i++)
+        hashmap_insert(hm, mb_key(i), (void *)i);
+
+    mb->priv = hm;
+
+    return 0;
+}
+
+static void hashmap_find_bench(struct mb *mb)
+{
+    uint32_t seed = 1;
+    unsigned long i;
+
+    /* mostly hits, some misses */
+    for (i = 0; i < mb->iters; i++)
+        mb_sink += (unsigned long)hashmap_find(mb->priv, mb_key(mb_rand(&seed) % (MB_HASH_KEYS + MB_HASH_KEYS / 8)));
+}
+
+static int hashmap_find_str_setup(struct mb *mb)
+{
+    struct hashmap *hm;
+    unsigned long i;
+    char name[16];
+
+    hm = calloc(1, sizeof(*hm));
+    if (!hm || hashmap_init(hm, MB_HASH_BUCKETS))
+        return -1;
+
+    for (i = 0; i < MB_HASH_KEYS; i++) {
+        snprintf(name, sizeof(name), "%08x", mb_key(i));
+        hashmap_insert_str(hm, name, (void *)i);
+    }
+
+    mb->priv = hm;
+
+    return 0;
+}
+
+static void hashmap_find_str_bench(struct mb *mb)
+{
+    uint32_t seed = 1;
+    unsigned long i;
+    char name[16];
+
+    for (i = 0; i < mb->iters; i++) {
+        snprintf(name, sizeof(name), "%08x", mb_key(mb_rand(&seed) % (MB_HASH_KEYS + MB_HASH_KEYS / 8)));
+        mb_sink += (unsigned long)hashmap_find_str(mb->priv, name);
+    }
+}
+
+static void hashmap_teardown(struct mb *mb)
+{
+    hashmap_done(mb->priv);
+    free(mb->priv);
+}
+
+/* list */
+#define MB_LIST_NODES   (1 << 14)
+
+struct mb_node {
+    struct list     entry;
+    unsigned long   value;
+};
+
+static int list_setup(struct mb *mb)
+{
+    struct mb_node *node;
+    struct list *head;
+    unsigned long i;
+
+    head = malloc(sizeof(*head));
+    if (!head)
+        return -1;
+
+    list_init(head);
+    /* one by one, like the engine does */
+    for (i = 0; i < MB_LIST_NODES; i++) {
+        node = malloc(sizeof(*node));
+        if (!node)
+            return -1;
+        node->value = i;
+        list_append(head, &node->entry);
+    }
+
+    mb->priv = head;
+
+    return 0;
+}
+
+static void list_bench(struct mb *mb)
+{
+    struct list *head = mb->priv;
+    struct mb_node *node;
+    unsigned long pass, sum = 0;
+
+    /* an operation is one node visited */
+    for (pass = 0; pass < mb->iters / MB_LIST_NODES; pass++)
+        list_for_each_entry(node, head, entry)
+            sum += node->value;
+
+    mb_sink += sum;
+}
+
+static void list_teardown(struct mb *mb)
+{
+    struct list *head = mb->priv;
+    struct mb_node *node, *iter;
+
+    list_for_each_entry_iter(node, iter, head, entry) {
+        list_del(&node->entry);
+        free(node);
+    }
+    free(mb->priv);
+}
+
+/* linmath */
+static void mat4x4_mul_bench(struct mb *mb)
+{
+    mat4x4 a, b, r;
+    unsigned long i;
+
+    mat4x4_identity(a);
+    mat4x4_translate(b, 1, 2, 3);
+    mat4x4_rotate_Y(b, b, 0.1);
+    /* each result feeds the next one */
+    for (i = 0; i < mb->iters; i++) {
+        mat4x4_mul(r, a, b);
+        mat4x4_dup(a, r);
+    }
+
+    mb_sink += (unsigned long)a[3][0];
+}
+
+static void mat4x4_invert_bench(struct mb *mb)
+{
+    mat4x4 a, r;
+    unsigned long i;
+
+    mat4x4_translate(a, 1, 2, 3);
+    mat4x4_rotate_X(a, a, 0.3);
+    mat4x4_scale_aniso(a, a, 1, 2, 0.5);
+    for (i = 0; i < mb->iters; i++) {
+        mat4x4_invert(r, a);
+        mat4x4_dup(a, r);
+    }
+
+    mb_sink += (unsigned long)a[3][1];
+}
+
+#define MB_JOINTS 64
+
+/* a skeleton's worth of local transforms, then into its globals */
+static void mat4x4_from_trs_bench(struct mb *mb)
+{
+    vec3 t[MB_JOINTS], s[MB_JOINTS];
+    quat r[MB_JOINTS];
+    mat4x4 m[MB_JOINTS];
+    unsigned long i;
+    int j;
+
+    for (j = 0; j < MB_JOINTS; j++) {
+        vec3_scale(t[j], (vec3){ 1, 2, 3 }, j);
+        vec3_scale(s[j], (vec3){ 1, 1, 1 }, 1 + j * 0.01);
+        quat_rotate(r[j], j * 0.1, (vec3){ 0, 1, 0 });
+    }
+
+    for (i = 0; i < mb->iters; i++) {
+        mat4x4_from_trs_n(m, t, r, s, MB_JOINTS);
+        mat4x4_mul_n(m, m, m, MB_JOINTS);
+        t[i % MB_JOINTS][0] = m[i % MB_JOINTS][3][0];
+    }
+
+    mb_sink += (unsigned long)m[1][3][0];
+}
+
+/* base64 */
+#define MB_BUF_SIZE 4096
+
+struct mb_base64 {
+    char    *encoded;
+    size_t  size;
+    char    *decoded;
+};
+
+static int base64_setup(struct mb *mb)
+{
+    struct mb_base64 *b;
+    char raw[MB_BUF_SIZE];
+
+    b = calloc(1, sizeof(*b));
+    if (!b)
+        return -1;
+
+    mb_fill(raw, sizeof(raw), 1);
+    b->size    = base64_encoded_length(sizeof(raw)) + 1;
+    b->encoded = malloc(b->size);
+    b->decoded = malloc(base64_decoded_length(b->size));
+    if (!b->encoded || !b->decoded)
+        return -1;
+
+    b->size = base64_encode(b->encoded, b->size, raw, sizeof(raw));
+    mb->bytes = b->size;
+    mb->priv  = b;
+
+    return 0;
+}
+
+static void base64_bench(struct mb *mb)
+{
+    struct mb_base64 *b = mb->priv;
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++)
+        mb_sink += base64_decode(b->decoded, base64_decoded_length(b->size), b->encoded, b->size);
+}
+
+static void base64_teardown(struct mb *mb)
+{
+    struct mb_base64 *b = mb->priv;
+
+    free(b->encoded);
+    free(b->decoded);
+    free(b);
+}
+
+/* sha1 */
+static int sha1_setup(struct mb *mb)
+{
+    mb->priv = malloc(MB_BUF_SIZE);
+    if (!mb->priv)
+        return -1;
+
+    mb_fill(mb->priv, MB_BUF_SIZE, 2);
+    mb->bytes = MB_BUF_SIZE;
+
+    return 0;
+}
+
+static void sha1_bench(struct mb *mb)
+{
+    unsigned char digest[20];
+    unsigned long i;
+    SHA1_CTX ctx;
+
+    for (i = 0; i < mb->iters; i++) {
+        SHA1Init(&ctx);
+        SHA1Update(&ctx, mb->priv, MB_BUF_SIZE);
+        SHA1Final(digest, &ctx);
+        mb_sink += digest[0];
+    }
+}
+
+static void hash64_bench(struct mb *mb)
+{
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++)
+        mb_sink += hash64(mb->priv, MB_BUF_SIZE, i);
+}
+
+static void free_teardown(struct mb *mb)
+{
+    free(mb->priv);
+}
+
+/* json: something shaped like a scene or a glTF, objects, arrays, numbers */
+static int json_setup(struct mb *mb)
+{
+    size_t size = 0, len = 0;
+    char *doc = NULL;
+    uint32_t seed = 3;
+    FILE *f;
+    int i, j;
+
+    f = open_memstream(&doc, &size);
+    if (!f)
+        return -1;
+
+    fprintf(f, "{\"name\":\"bench\",\"nodes\":[");
+    for (i = 0; i < 64; i++) {
+        fprintf(f, "%s{\"name\":\"node%d\",\"mesh\":%d,\"visible\":true,\"translation\":[", i ? "," : "", i, i);
+        for (j = 0; j < 3; j++)
+            fprintf(f, "%s%f", j ? "," : "", (float)mb_rand(&seed) / UINT32_MAX);
+        fprintf(f, "],\"rotation\":[0,0,0,1],\"children\":[%d,%d]}", i + 1, i + 2);
+    }
+    fprintf(f, "],\"accessors\":[");
+    for (i = 0; i < 64; i++)
+        fprintf(f, "%s{\"bufferView\":%d,\"count\":%u,\"type\":\"VEC3\",\"min\":[-1,-1,-1],\"max\":[1,1,1]}",
+                i ? "," : "", i, mb_rand(&seed) % 65536);
+    fprintf(f, "]}");
+    fclose(f);
+
+    len = strlen(doc);
+    if (!json_validate(doc))
+        return -1;
+
+    mb->bytes = len;
+    mb->priv  = doc;
+
+    return 0;
+}
+
+static void json_bench(struct mb *mb)
+{
+    JsonNode *root;
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++) {
+        root = json_decode(mb->priv);
+        mb_sink += !!root;
+        json_delete(root);
+    }
+}
+
+/* OBJ: a grid of quads, like an exported prop, every vertex shared by 4 of them */
+#define MB_OBJ_GRID 128
+
+static int obj_setup(struct mb *mb)
+{
+    int x, z, n = MB_OBJ_GRID + 1, a, b;
+    size_t size = 0;
+    uint32_t seed = 6;
+    char *doc = NULL;
+    FILE *f;
+
+    f = open_memstream(&doc, &size);
+    if (!f)
+        return -1;
+
+    for (z = 0; z < n; z++)
+        for (x = 0; x < n; x++)
+            fprintf(f, "v %f %f %f\n", (float)x, (float)(mb_rand(&seed) % 1000) / 1000, (float)z);
+    for (z = 0; z < n; z++)
+        for (x = 0; x < n; x++)
+            fprintf(f, "vt %f %f\n", (float)x / MB_OBJ_GRID, (float)z / MB_OBJ_GRID);
+    fprintf(f, "vn 0.000000 1.000000 0.000000\n");
+    for (z = 0; z < MB_OBJ_GRID; z++)
+        for (x = 0; x < MB_OBJ_GRID; x++) {
+            a = z * n + x + 1;
+            b = a + n;
+            fprintf(f, "f %d/%d/1 %d/%d/1 %d/%d/1 %d/%d/1\n", a, a, b, b, b + 1, b + 1, a + 1, a + 1);
+        }
+    fclose(f);
+
+    mb->bytes = size;
+    mb->priv  = doc;
+
+    return 0;
+}
+
+static void obj_bench(struct mb *mb)
+{
+    struct model_data *md;
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++) {
+        md = model_data_new_from_obj(mb->priv, mb->bytes);
+        mb_sink += md ? md->nr_vx : 0;
+        if (md)
+            model_data_free(md);
+    }
+}
+
+/* mesh_optimize: a grid of unindexed quads, that is, lots of duplicates */
+#define MB_GRID 32
+
+struct mb_mesh {
+    float           vx[MB_GRID * MB_GRID * 6 * 3];
+    float           norm[MB_GRID * MB_GRID * 6 * 3];
+    float           tx[MB_GRID * MB_GRID * 6 * 2];
+    unsigned short  idx[MB_GRID * MB_GRID * 6];
+    char            dir[PATH_MAX];
+    unsigned int    gen;
+};
+
+static int mesh_setup(struct mb *mb)
+{
+    static const int quad[6][2] = { { 0, 0 }, { 1, 0 }, { 0, 1 }, { 0, 1 }, { 1, 0 }, { 1, 1 } };
+    char dir[] = "/tmp/clap-bench-XXXXXX";
+    struct mb_mesh *m;
+    int x, z, v, n = 0;
+
+    m = calloc(1, sizeof(*m));
+    if (!m || !mkdtemp(dir))
+        return -1;
+
+    /* mesh_optimize() caches its results, keep those out of the tree */
+    snprintf(m->dir, sizeof(m->dir), "%s/", dir);
+    librarian_init(m->dir);
+
+    for (x = 0; x < MB_GRID; x++)
+        for (z = 0; z < MB_GRID; z++)
+            for (v = 0; v < 6; v++, n++) {
+                m->vx[n * 3 + 0] = x + quad[v][0];
+                m->vx[n * 3 + 1] = 0;
+                m->vx[n * 3 + 2] = z + quad[v][1];
+                m->norm[n * 3 + 1] = 1;
+                m->tx[n * 2 + 0] = (float)quad[v][0];
+                m->tx[n * 2 + 1] = (float)quad[v][1];
+                m->idx[n] = n;
+            }
+
+    mb->priv = m;
+
+    return 0;
+}
+
+static struct mesh *mb_mesh_new(struct mb_mesh *m)
+{
+    struct mesh *mesh = mesh_new("bench");
+
+    mesh_attr_dup(mesh, MESH_VX, m->vx, sizeof(float) * 3, array_size(m->vx) / 3);
+    mesh_attr_dup(mesh, MESH_NORM, m->norm, sizeof(float) * 3, array_size(m->norm) / 3);
+    mesh_attr_dup(mesh, MESH_TX, m->tx, sizeof(float) * 2, array_size(m->tx) / 2);
+    mesh_attr_dup(mesh, MESH_IDX, m->idx, sizeof(unsigned short), array_size(m->idx));
+
+    return mesh;
+}
+
+/* a new mesh every time, so the cache never has it */
+static void mesh_optimize_miss_bench(struct mb *mb)
+{
+    struct mb_mesh *m = mb->priv;
+    struct mesh *mesh;
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++) {
+        m->vx[1] = ++m->gen;
+        mesh = mb_mesh_new(m);
+        mesh_optimize(mesh);
+        mb_sink += mesh_nr_vx(mesh);
+        ref_put(mesh);
+    }
+}
+
+static int mesh_hit_setup(struct mb *mb)
+{
+    struct mesh *mesh;
+
+    if (mesh_setup(mb))
+        return -1;
+
+    mesh = mb_mesh_new(mb->priv);
+    mesh_optimize(mesh);
+    ref_put(mesh);
+
+    return 0;
+}
+
+static int mb_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void mesh_teardown(struct mb *mb)
+{
+    struct mb_mesh *m = mb->priv;
+
+    nftw(m->dir, mb_remove, 8, FTW_DEPTH | FTW_PHYS);
+    free(m);
+}
+
+static void mesh_optimize_hit_bench(struct mb *mb)
+{
+    struct mb_mesh *m = mb->priv;
+    struct mesh *mesh;
+    unsigned long i;
+
+    for (i = 0; i < mb->iters; i++) {
+        mesh = mb_mesh_new(m);
+        mesh_optimize(mesh);
+        mb_sink += mesh_nr_vx(mesh);
+        ref_put(mesh);
+    }
+}
+
+/* cellular automata */
+static const struct cell_automaton mb_ca2d = {
+    .name       = "bench",
+    .born       = 3 << 2,
+    .surv       = 3 << 7,
+    .nr_states  = 4,
+    .decay      = true,
+    .neigh      = ca2d_neigh_m1,
+};
+
+#define MB_CA2D_SIDE    128
+#define MB_CA3D_SIDE    32
+
+static void ca2d_bench(struct mb *mb)
+{
+    unsigned char *arr;
+    unsigned long i;
+
+    srand(1);
+    for (i = 0; i < mb->iters; i++) {
+        arr = ca2d_generate(&mb_ca2d, MB_CA2D_SIDE, 4);
+        mb_sink += arr[MB_CA2D_SIDE * MB_CA2D_SIDE / 2];
+        free(arr);
+    }
+}
+
+static int ca3d_setup(struct mb *mb)
+{
+    srand(1);
+    mb->priv = ca3d_make(MB_CA3D_SIDE, MB_CA3D_SIDE, MB_CA3D_SIDE);
+
+    return mb->priv ? 0 : -1;
+}
+
+/* an operation is one step over the whole volume */
+static void ca3d_bench(struct mb *mb)
+{
+    mb_sink += ca3d_run(mb->priv, ca_445m, mb->iters);
+}
+
+/* terrain_height: the heightmap only, no GL and no physics */
+#define MB_TERRAIN_VERT 257
+
+static int terrain_setup(struct mb *mb)
+{
+    struct terrain *t;
+    uint32_t seed = 4;
+    int i;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return -1;
+
+    t->nr_vert = MB_TERRAIN_VERT;
+    t->side    = MB_TERRAIN_VERT - 1;
+    t->x       = -(float)t->side / 2;
+    t->z       = -(float)t->side / 2;
+    t->map     = malloc(sizeof(*t->map) * t->nr_vert * t->nr_vert);
+    if (!t->map)
+        return -1;
+
+    for (i = 0; i < t->nr_vert * t->nr_vert; i++)
+        t->map[i] = (float)(mb_rand(&seed) % 1000) / 100;
+
+    mb->priv = t;
+
+    return 0;
+}
+
+static void terrain_bench(struct mb *mb)
+{
+    struct terrain *t = mb->priv;
+    uint32_t seed = 5;
+    unsigned long i;
+    float sum = 0, x, z;
+
+    for (i = 0; i < mb->iters; i++) {
+        x = t->x + (float)(mb_rand(&seed) % (t->side * 64)) / 64;
+        z = t->z + (float)(mb_rand(&seed) % (t->side * 64)) / 64;
+        sum += terrain_height(t, x, z);
+    }
+
+    mb_sink += (unsigned long)sum;
+}
+
+static void terrain_teardown(struct mb *mb)
+{
+    struct terrain *t = mb->priv;
+
+    free(t->map);
+    free(t);
+}
+
+static struct microbench {
+    const char      *name;
+    unsigned long   iters;
+    int             (*setup)(struct mb *mb);
+    void            (*run)(struct mb *mb);
+    void            (*teardown)(struct mb *mb);
+} benches[] = {
+    { .name = "darray_add", .iters = 1 << 20, .run = darray_add_bench },
+    { .name = "darray_insert", .iters = 1 << 14, .run = darray_insert_bench },
+    { .name = "hashmap_insert", .iters = 1 << 16, .run = hashmap_insert_bench },
+    { .name = "hashmap_find", .iters = 1 << 20, .setup = hashmap_find_setup, .run = hashmap_find_bench,
+      .teardown = hashmap_teardown },
+    { .name = "hashmap_find_str", .iters = 1 << 18, .setup = hashmap_find_str_setup,
+      .run = hashmap_find_str_bench, .teardown = hashmap_teardown },
+    { .name = "list traversal", .iters = 1 << 24, .setup = list_setup, .run = list_bench,
+      .teardown = list_teardown },
+    { .name = "mat4x4_mul", .iters = 1 << 22, .run = mat4x4_mul_bench },
+    { .name = "mat4x4_invert", .iters = 1 << 22, .run = mat4x4_invert_bench },
+    { .name = "mat4x4_from_trs_n 64", .iters = 1 << 16, .run = mat4x4_from_trs_bench },
+    { .name = "base64_decode 4k", .iters = 1 << 14, .setup = base64_setup, .run = base64_bench,
+      .teardown = base64_teardown },
+    { .name = "sha1 4k", .iters = 1 << 14, .setup = sha1_setup, .run = sha1_bench,
+      .teardown = free_teardown },
+    { .name = "hash64 4k", .iters = 1 << 16, .setup = sha1_setup, .run = hash64_bench,
+      .teardown = free_teardown },
+    { .name = "json_decode", .iters = 1 << 10, .setup = json_setup, .run = json_bench,
+      .teardown = free_teardown },
+    { .name = "obj parse 128x128", .iters = 1 << 4, .setup = obj_setup, .run = obj_bench,
+      .teardown = free_teardown },
+    { .name = "mesh_optimize miss", .iters = 1 << 5, .setup = mesh_setup, .run = mesh_optimize_miss_bench,
+      .teardown = mesh_teardown },
+    { .name = "mesh_optimize hit", .iters = 1 << 8, .setup = mesh_hit_setup, .run = mesh_optimize_hit_bench,
+      .teardown = mesh_teardown },
+    { .name = "ca2d_generate 128", .iters = 1 << 6, .run = ca2d_bench },
+    { .name = "ca3d_run 32^3", .iters = 1 << 3, .setup = ca3d_setup, .run = ca3d_bench,
+      .teardown = free_teardown },
+    { .name = "terrain_height", .iters = 1 << 22, .setup = terrain_setup, .run = terrain_bench,
+      .teardown = terrain_teardown },
+};
+
+static uint64_t mb_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+static int microbench_run(struct microbench *b)
+{
+    uint64_t ns[MB_RUNS], start;
+    struct mb mb = { .iters = b->iters };
+    size_t allocated = 0, alloc_start;
+    double median;
+    int run;
+
+    if (b->setup && b->setup(&mb)) {
+        printf("%-24s setup failed\n", b->name);
+        return -1;
+    }
+
+    for (run = 0; run < MB_RUNS; run++) {
+        alloc_start = mb_allocated();
+        start = mb_now();
+        b->run(&mb);
+        ns[run] = mb_now() - start;
+        /* setup and teardown aren't counted */
+        allocated = mb_allocated() - alloc_start;
+    }
+
+    if (b->teardown)
+        b->teardown(&mb);
+
+    qsort(ns, MB_RUNS, sizeof(*ns), cmp_u64);
+    median = (double)ns[MB_RUNS / 2] / b->iters;
+    printf("%-24s %10lu %12.2f %12.2f", b->name, b->iters, median, (double)ns[0] / b->iters);
+#ifdef MB_ALLOC_STATS
+    printf(" %10.1f", (double)allocated / b->iters);
+#else
+    printf(" %10s", "-");
+#endif
+    if (mb.bytes)
+        printf(" %10.1f", mb.bytes * 1e3 / median);
+    printf("\n");
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int i, ret = EXIT_SUCCESS;
+
+    log_init(LOG_DEFAULT | LOG_QUIET);
+    printf("%-24s %10s %12s %12s %10s %10s\n", "benchmark", "ops", "ns/op", "best ns/op", "B/op", "MB/s");
+    for (i = 0; i < array_size(benches); i++) {
+        if (argc > 1 && !strstr(benches[i].name, argv[1]))
+            continue;
+        if (microbench_run(&benches[i]))
+            ret = EXIT_FAILURE;
+    }
+
+    return ret;
+}
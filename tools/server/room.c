@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: Apache-2.0
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include "jobs.h"
+#include "logger.h"
+#include "matrix.h"
+#include "networking.h"
+#include "room.h"
+#include "snapshot.h"
+
+#define ROOM_TICK_NS        (1000000000ull / ROOM_TICK_HZ)
+/* behind by more than this, it skips ahead instead of catching up */
+#define ROOM_TICKS_MAX      4
+/* players with no input for 30s are gone */
+#define ROOM_IDLE_TICKS     (30 * ROOM_TICK_HZ)
+/* units and degrees per second at full deflection */
+#define ROOM_SPEED          5.0f
+#define ROOM_TURN           90.0f
+
+void rooms_init(struct rooms *rs)
+{
+    darray_init(&rs->rooms);
+    rs->tick = 0;
+    rs->next_tick_ns = 0;
+    rs->next_id = 0;
+    rs->next_player_id = 0;
+}
+
+void rooms_done(struct rooms *rs)
+{
+    struct room *room;
+
+    darray_for_each(room, &rs->rooms)
+        darray_clearout(&room->players.da);
+    darray_clearout(&rs->rooms.da);
+}
+
+static struct room_player *rooms_find_player(struct rooms *rs, struct message_source *src)
+{
+    struct room_player *p;
+    struct room *room;
+
+    darray_for_each(room, &rs->rooms)
+        darray_for_each(p, &room->players)
+            if (p->src == src)
+                return p;
+
+    return NULL;
+}
+
+/* the emptiest room with space, or a new one */
+static struct room *rooms_pick(struct rooms *rs)
+{
+    struct room *room, *best = NULL;
+
+    darray_for_each(room, &rs->rooms)
+        if (room->players.da.nr_el < ROOM_PLAYERS_MAX &&
+            (!best || room->players.da.nr_el < best->players.da.nr_el))
+            best = room;
+
+    if (best || rs->rooms.da.nr_el == ROOMS_MAX)
+        return best;
+
+    room = darray_add(&rs->rooms.da);
+    if (!room)
+        return NULL;
+
+    room->id = rs->next_id++;
+    darray_init(&room->players);
+    dbg("room %u opened\n", room->id);
+
+    return room;
+}
+
+/* 1 is a press, 2 is a release, anything else leaves it as it was */
+static inline void key_state(bool *held, unsigned char key)
+{
+    if (key == 1)
+        *held = true;
+    else if (key == 2)
+        *held = false;
+}
+
+int rooms_input(struct rooms *rs, struct message *m)
+{
+    struct message_input *mi = &m->input;
+    struct room_player *p;
+    struct room *room;
+
+    if (!m->source)
+        return -EINVAL;
+
+    p = rooms_find_player(rs, m->source);
+    if (!p) {
+        room = rooms_pick(rs);
+        if (!room)
+            return -EBUSY;
+
+        p = darray_add(&room->players.da);
+        if (!p)
+            return -ENOMEM;
+
+        p->src = m->source;
+        p->id = rs->next_player_id++;
+        dbg("'%s' joins room %u\n", m->source->name ? : "client", room->id);
+    }
+
+    p->input_tick = rs->tick;
+    key_state(&p->left, mi->left);
+    key_state(&p->right, mi->right);
+    key_state(&p->up, mi->up);
+    key_state(&p->down, mi->down);
+    key_state(&p->yaw_left, mi->yaw_left);
+    key_state(&p->yaw_right, mi->yaw_right);
+    /* the sticks are absolute, as the joystick code sends them */
+    p->ls_dx = mi->delta_lx;
+    p->ls_dy = mi->delta_ly;
+    p->rs_dx = mi->delta_rx;
+
+    return 0;
+}
+
+/*
+ * No physics here, just the input on the ground plane: the clients'
+ * own collisions and falls aren't checked against it, see prediction.h
+ */
+static void room_player_tick(struct room_player *p, float dt)
+{
+    float dx = p->ls_dx, dz = p->ls_dy, turn = p->rs_dx, yawcos, yawsin;
+
+    if (p->left || p->right)
+        dx = (int)p->right - (int)p->left;
+    if (p->up || p->down)
+        dz = (int)p->down - (int)p->up;
+    if (p->yaw_left || p->yaw_right)
+        turn = (int)p->yaw_right - (int)p->yaw_left;
+
+    p->yaw = fmodf(p->yaw + turn * ROOM_TURN * dt, 360);
+    yawcos = cosf(to_radians(p->yaw));
+    yawsin = sinf(to_radians(p->yaw));
+    p->pos[0] += (dx * yawcos - dz * yawsin) * ROOM_SPEED * dt;
+    p->pos[2] += (dx * yawsin + dz * yawcos) * ROOM_SPEED * dt;
+}
+
+static void room_tick(unsigned int idx, void *priv)
+{
+    struct rooms *rs = priv;
+    struct room *room = &rs->rooms.x[idx];
+    struct room_player *p;
+    int i;
+
+    for (i = 0; i < room->players.da.nr_el; i++) {
+        p = &room->players.x[i];
+        if (rs->tick - p->input_tick > ROOM_IDLE_TICKS) {
+            /* order doesn't matter */
+            *p = room->players.x[room->players.da.nr_el - 1];
+            darray_resize(&room->players.da, room->players.da.nr_el - 1);
+            i--;
+            continue;
+        }
+
+        room_player_tick(p, 1.0f / ROOM_TICK_HZ);
+    }
+}
+
+/* on the main thread, networking isn't thread safe */
+static void rooms_replicate(struct rooms *rs)
+{
+    struct snapshot *all, *near;
+    struct snapshot_entity se;
+    struct room_player *p;
+    struct room *room;
+
+    all = malloc(sizeof(*all));
+    near = malloc(sizeof(*near));
+    if (!all || !near)
+        goto out;
+
+    darray_for_each(room, &rs->rooms) {
+        all->nr_ents = 0;
+        darray_for_each(p, &room->players) {
+            snapshot_entity_pack(&se, p->id, p->pos, p->yaw, -1, 0, 0);
+            snapshot_add(all, &se);
+        }
+
+        darray_for_each(p, &room->players) {
+            snapshot_filter(near, all, p->pos, ROOM_INTEREST_RADIUS);
+            near->self = p->id;
+            networking_send_snapshot(p->src, near);
+        }
+    }
+
+out:
+    free(near);
+    free(all);
+}
+
+unsigned int rooms_run(struct rooms *rs, uint64_t now_ns)
+{
+    unsigned int nr = 0;
+
+    if (!rs->next_tick_ns)
+        rs->next_tick_ns = now_ns;
+
+    if (now_ns > rs->next_tick_ns + ROOM_TICKS_MAX * ROOM_TICK_NS) {
+        warn("server is %llu ticks behind, skipping\n",
+             (unsigned long long)((now_ns - rs->next_tick_ns) / ROOM_TICK_NS));
+        rs->next_tick_ns = now_ns;
+    }
+
+    for (; rs->next_tick_ns <= now_ns; rs->next_tick_ns += ROOM_TICK_NS, nr++) {
+        jobs_parallel_for(rs->rooms.da.nr_el, room_tick, rs);
+        rs->tick++;
+    }
+
+    if (nr)
+        rooms_replicate(rs);
+
+    return nr;
+}
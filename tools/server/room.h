@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef __CLAP_ROOM_H__
+#define __CLAP_ROOM_H__
+
+#include <stdint.h>
+#include "messagebus.h"
+#include "util.h"
+
+/*
+ * The server's simulation: clients are placed into rooms as their input
+ * arrives, rooms tick at a fixed rate, all of them at once on the job
+ * workers. Inputs are folded into the players' held state on the main
+ * thread, between ticks, so a tick only ever touches its own room.
+ * After the ticks, each player gets a snapshot of what's in their room
+ * within ROOM_INTEREST_RADIUS of them, see networking_send_snapshot().
+ */
+#define ROOM_TICK_HZ        30
+#define ROOM_PLAYERS_MAX    8
+#define ROOMS_MAX           64
+#define ROOM_INTEREST_RADIUS 50.0f
+
+struct room_player {
+    /* never dereferenced, the node may be gone; see ROOM_IDLE_TICKS */
+    struct message_source   *src;
+    /* in the snapshots */
+    uint16_t                id;
+    unsigned long           input_tick;
+    /* held keys, like motionctl */
+    bool                    left, right, up, down;
+    bool                    yaw_left, yaw_right;
+    float                   ls_dx, ls_dy;
+    float                   rs_dx;
+    float                   pos[3];
+    float                   yaw;
+};
+
+struct room {
+    unsigned int            id;
+    darray(struct room_player, players);
+};
+
+struct rooms {
+    darray(struct room, rooms);
+    unsigned long           tick;
+    uint64_t                next_tick_ns;
+    unsigned int            next_id;
+    uint16_t                next_player_id;
+};
+
+void rooms_init(struct rooms *rs);
+void rooms_done(struct rooms *rs);
+/* MT_INPUT from a client: to its player, making one if it's new */
+int rooms_input(struct rooms *rs, struct message *m);
+/* the ticks that are due by @now_ns, CLOCK_MONOTONIC; returns how many */
+unsigned int rooms_run(struct rooms *rs, uint64_t now_ns);
+
+#endif /* __CLAP_ROOM_H__ */
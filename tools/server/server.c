@@ -4,11 +4,13 @@
 #include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "clap.h"
 #include "config.h"
 #include "messagebus.h"
 #include "networking.h"
+#include "room.h"
 
 struct clap_context *clap;
 
@@ -22,11 +24,24 @@ static void sigint_handler(int sig)
 
 static bool exit_server_loop = false;
 static bool restart_server   = false;
+static struct rooms rooms;
 
 void server_run(void)
 {
-    while (!exit_server_loop)
+    struct timespec now;
+
+    while (!exit_server_loop) {
         networking_poll();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rooms_run(&rooms, now.tv_sec * 1000000000ull + now.tv_nsec);
+    }
+}
+
+static int handle_input(struct message *m, void *data)
+{
+    if (m->source && m->source->type == MST_CLIENT)
+        rooms_input(&rooms, m);
+    return 0;
 }
 
 static int handle_command(struct message *m, void *data)
@@ -44,10 +59,11 @@ static int handle_command(struct message *m, void *data)
 static struct option long_options[] = {
     { "restart",    no_argument,        0, 'R' },
     { "server",     required_argument,  0, 'S'},
+    { "reactors",   required_argument,  0, 'n'},
     {}
 };
 
-static const char short_options[] = "RS:";
+static const char short_options[] = "RS:n:";
 
 int main(int argc, char **argv, char **envp)
 {
@@ -74,6 +90,9 @@ int main(int argc, char **argv, char **envp)
         case 'S':
             ncfg.server_ip = optarg;
             break;
+        case 'n':
+            ncfg.reactors = strtoul(optarg, NULL, 0);
+            break;
         default:
             fprintf(stderr, "invalid option %x\n", c);
             exit(EXIT_FAILURE);
@@ -96,9 +115,14 @@ int main(int argc, char **argv, char **envp)
         return EXIT_SUCCESS;
     }
 
+    /* wake up for the ticks */
+    ncfg.timeout = 1000 / ROOM_TICK_HZ / 2;
     networking_init(&ncfg, SERVER);
-    subscribe(MT_COMMAND, handle_command, NULL);
+    subscribe_mask(MT_COMMAND, handle_command, NULL, MSG_COMMAND(restart) | MSG_COMMAND(status));
+    subscribe(MT_INPUT, handle_input, NULL);
+    rooms_init(&rooms);
     server_run();
+    rooms_done(&rooms);
     networking_done();
     clap_done(clap, 0);
     if (restart_server) {